@@ -30,6 +30,8 @@
 #include "server.h"
 #include "bio.h"
 #include "rio.h"
+#include "atomicvar.h"
+#include "lz4.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -41,224 +43,362 @@
 #include <sys/param.h>
 
 void aofUpdateCurrentSize(void);
-void aofClosePipes(void);
+ssize_t aofWrite(int fd, const char *buf, size_t len);
+void aof_background_fsync_and_close(int fd);
+static void aofBinaryCompressBuffer(void);
 
 /* ----------------------------------------------------------------------------
- * AOF rewrite buffer implementation.
+ * AOF manifest
  *
- * AOF 重写缓存的实现。
+ * The AOF is made of a base file, written by the last rewrite, followed by
+ * the incremental files that received the writes performed since then. When
+ * a rewrite starts the parent just switches to a new incr file, so there is
+ * no need to accumulate the writes received while the child saves the
+ * dataset: once the child is done the new base plus the new incr file
+ * replace all the previous files.
  *
- * The following code implement a simple buffer used in order to accumulate
- * changes while the background process is rewriting the AOF file.
+ * The files are listed, in the order they must be loaded, in a manifest
+ * with one line per file:
  *
- * 以下代码实现了一个简单的缓存，
- * 它可以在 BGREWRITEAOF 执行的过程中，累积所有修改数据集的命令。
- *
- * We only need to append, but can't just use realloc with a large block
- * because 'huge' reallocs are not always handled as one could expect
- * (via remapping of pages at OS level) but may involve copying data.
- *
- * For this reason we use a list of blocks, every block is
- * AOF_RW_BUF_BLOCK_SIZE bytes.
- *
- * 程序需要不断对这个缓存执行 append 操作，
- * 因为分配一个非常大的空间并不总是可能的，
- * 也可能产生大量的复制工作，
- * 所以这里使用多个大小为 AOF_RW_BUF_BLOCK_SIZE/10MB 的空间来保存命令。
+ *   file <name> seq <seq> type <b|i>
  *
+ * The manifest is always replaced atomically, so after a crash the AOF
+ * can be loaded from whatever set of files it lists.
  * ------------------------------------------------------------------------- */
-// AOF缓冲区大小
-#define AOF_RW_BUF_BLOCK_SIZE (1024*1024*10)    /* 10 MB per block */
 
-// AOF块缓冲区结构
-typedef struct aofrwblock {
+aofInfo *aofInfoCreate(sds file_name, long long file_seq, int file_type) {
+    aofInfo *ai = zmalloc(sizeof(*ai));
 
-    // 缓存块已使用字节数和可用字节数
-    unsigned long used, free;
+    ai->file_name = file_name;
+    ai->file_seq = file_seq;
+    ai->file_type = file_type;
+    return ai;
+}
 
-    //缓冲区
-    char buf[AOF_RW_BUF_BLOCK_SIZE];
+void aofInfoFree(void *ptr) {
+    aofInfo *ai = ptr;
 
-} aofrwblock;
+    sdsfree(ai->file_name);
+    zfree(ai);
+}
 
-/* This function free the old AOF rewrite buffer if needed, and initialize
- * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
- * so can be used for the first initialization as well.
- *
-* 释放旧的 AOF 重写缓存，并初始化一个新的 AOF 缓存。
- *
- * 这个函数也可以单纯地用于 AOF 重写缓存的初始化。
- *
- * */
-void aofRewriteBufferReset(void) {
+void *aofInfoDup(void *ptr) {
+    aofInfo *ai = ptr;
+
+    return aofInfoCreate(sdsdup(ai->file_name),ai->file_seq,ai->file_type);
+}
 
-    // 如果当期有缓冲块的链表，则释放旧的缓冲区
-    if (server.aof_rewrite_buf_blocks)
-        listRelease(server.aof_rewrite_buf_blocks);
+aofManifest *aofManifestCreate(void) {
+    aofManifest *am = zcalloc(sizeof(*am));
 
-    // 初始化一个新的缓冲块链表
-    server.aof_rewrite_buf_blocks = listCreate();
-    // 设置链表的释放方法
-    listSetFreeMethod(server.aof_rewrite_buf_blocks,zfree);
+    am->incr_aof_list = listCreate();
+    listSetFreeMethod(am->incr_aof_list,aofInfoFree);
+    listSetDupMethod(am->incr_aof_list,aofInfoDup);
+    return am;
 }
 
-/* Return the current size of the AOF rewrite buffer.
- *
- * 返回 AOF 重写缓存当前的大小
- * */
-unsigned long aofRewriteBufferSize(void) {
-    listNode *ln;
-    listIter li;
-    unsigned long size = 0;
+void aofManifestFree(aofManifest *am) {
+    if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+    listRelease(am->incr_aof_list);
+    zfree(am);
+}
 
-    // 设置链表迭代器指向头节点，并设置迭代方向为从头到位
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    // 遍历所有链表节点
-    while((ln = listNext(&li))) {
-        // 取出当前节点的缓冲块
-        aofrwblock *block = listNodeValue(ln);
-        // 总缓冲区的大小 = 节点数量 × AOF_RW_BUF_BLOCK_SIZE - 最后一个节点的free字节数
-        size += block->used;
-    }
-    return size;
+aofManifest *aofManifestDup(aofManifest *orig) {
+    aofManifest *am = zcalloc(sizeof(*am));
+
+    if (orig->base_aof_info)
+        am->base_aof_info = aofInfoDup(orig->base_aof_info);
+    am->incr_aof_list = listDup(orig->incr_aof_list);
+    serverAssert(am->incr_aof_list != NULL);
+    am->curr_base_file_seq = orig->curr_base_file_seq;
+    am->curr_incr_file_seq = orig->curr_incr_file_seq;
+    return am;
+}
+
+/* Set a new base file in 'am', replacing the old base and all the incr
+ * files. The returned name is owned by the manifest. */
+sds aofManifestSetNewBase(aofManifest *am, int rdb_preamble) {
+    sds name = sdscatprintf(sdsempty(),"%s.%lld.base.%s",
+        server.aof_filename,++am->curr_base_file_seq,
+        rdb_preamble ? "rdb" : "aof");
+
+    if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+    am->base_aof_info = aofInfoCreate(name,am->curr_base_file_seq,
+                                      AOF_FILE_TYPE_BASE);
+    listEmpty(am->incr_aof_list);
+    return name;
+}
+
+/* Append a new incr file to 'am'. The returned name is owned by the
+ * manifest. */
+sds aofManifestAddNewIncr(aofManifest *am) {
+    sds name = sdscatprintf(sdsempty(),"%s.%lld.incr.aof",
+        server.aof_filename,++am->curr_incr_file_seq);
+
+    listAddNodeTail(am->incr_aof_list,
+        aofInfoCreate(name,am->curr_incr_file_seq,AOF_FILE_TYPE_INCR));
+    return name;
+}
+
+sds getAofManifestFileName(void) {
+    return sdscatprintf(sdsempty(),"%s.manifest",server.aof_filename);
+}
+
+/* While the AOF is being turned on there is no base yet: the writes are
+ * appended to this file, that only becomes part of the manifest once the
+ * first rewrite succeeded. */
+sds getTempIncrAofFileName(void) {
+    return sdscatprintf(sdsempty(),"temp-%s.incr",server.aof_filename);
+}
+
+static sds aofManifestCatInfo(sds buf, aofInfo *ai) {
+    buf = sdscat(buf,"file ");
+    buf = sdscatrepr(buf,ai->file_name,sdslen(ai->file_name));
+    return sdscatprintf(buf," seq %lld type %c\n",ai->file_seq,ai->file_type);
 }
 
-/* Event handler used to send data to the child process doing the AOF
- * rewrite. We send pieces of our AOF differences buffer so that the final
- * write when the child finishes the rewrite will be small. */
-// 事件处理程序发送一些数据给正在做AOF重写的子进程，我们发送AOF缓冲区一部分不同的数据给子进程，当子进程完成重写时，重写的文件会比较小
-void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask) {
+sds getAofManifestAsString(aofManifest *am) {
+    sds buf = sdsempty();
+    listIter li;
     listNode *ln;
-    aofrwblock *block;
-    ssize_t nwritten;
-    UNUSED(el);
-    UNUSED(fd);
-    UNUSED(privdata);
-    UNUSED(mask);
 
-    while(1) {
-        // 获取缓冲块链表的头节点地址
-        ln = listFirst(server.aof_rewrite_buf_blocks);
-        // 获取缓冲块地址
-        block = ln ? ln->value : NULL;
-        // 如果aof_stop_sending_diff为真，则停止发送累计的不同数据给子进程，或者缓冲块为空
-        // 则将管道的写端从服务器的监听队列中删除
-        if (server.aof_stop_sending_diff || !block) {
-            aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,
-                              AE_WRITABLE);
-            return;
+    if (am->base_aof_info) buf = aofManifestCatInfo(buf,am->base_aof_info);
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL)
+        buf = aofManifestCatInfo(buf,listNodeValue(ln));
+    return buf;
+}
+
+/* Load the manifest stored at 'path'. NULL is returned if the file does not
+ * exist. A manifest that can't be read or parsed is a fatal error: starting
+ * with just a part of the AOF would silently lose data. */
+aofManifest *aofLoadManifestFromFile(sds path) {
+    char buf[MAXPATHLEN+128];
+    const char *err = NULL;
+    long linenum = 0;
+    aofManifest *am;
+    FILE *fp;
+
+    if ((fp = fopen(path,"r")) == NULL) {
+        if (errno == ENOENT) return NULL;
+        serverLog(LL_WARNING,"Fatal error: can't open the AOF manifest %s "
+                             "for reading: %s", path, strerror(errno));
+        exit(1);
+    }
+
+    am = aofManifestCreate();
+    while (err == NULL && fgets(buf,sizeof(buf),fp) != NULL) {
+        long long seq;
+        aofInfo *ai;
+        sds *argv;
+        int argc;
+
+        linenum++;
+        if (buf[0] == '#') continue;
+        if (strchr(buf,'\n') == NULL && !feof(fp)) {
+            err = "Line too long";
+            break;
         }
-        // 如果已经有缓存的数据
-        if (block->used > 0) {
-            // 则将缓存的数据写到管道中
-            nwritten = write(server.aof_pipe_write_data_to_child,
-                             block->buf,block->used);
-            if (nwritten <= 0) return;
-            // 更新缓冲区的数据，覆盖掉已经写到管道的数据
-            memmove(block->buf,block->buf+nwritten,block->used-nwritten);
-            block->used -= nwritten;
-            block->free += nwritten;
+        argv = sdssplitargs(buf,&argc);
+        if (argv == NULL) {
+            err = "Unbalanced quotes";
+            break;
         }
-        // 如果当前节点的所缓冲的数据全部写完，则删除该节点
-        if (block->used == 0) listDelNode(server.aof_rewrite_buf_blocks,ln);
+        if (argc == 0) {
+            sdsfreesplitres(argv,argc);
+            continue;
+        }
+
+        if (argc != 6 || strcmp(argv[0],"file") || strcmp(argv[2],"seq") ||
+            strcmp(argv[4],"type") || sdslen(argv[5]) != 1 ||
+            !string2ll(argv[3],sdslen(argv[3]),&seq) || seq < 0)
+        {
+            err = "Invalid file entry";
+        } else if (argv[5][0] == AOF_FILE_TYPE_BASE) {
+            if (am->base_aof_info) {
+                err = "Duplicated base file";
+            } else {
+                am->base_aof_info = aofInfoCreate(sdsdup(argv[1]),seq,
+                                                  AOF_FILE_TYPE_BASE);
+                am->curr_base_file_seq = seq;
+            }
+        } else if (argv[5][0] == AOF_FILE_TYPE_INCR) {
+            ai = aofInfoCreate(sdsdup(argv[1]),seq,AOF_FILE_TYPE_INCR);
+            listAddNodeTail(am->incr_aof_list,ai);
+            if (seq > am->curr_incr_file_seq) am->curr_incr_file_seq = seq;
+        } else {
+            err = "Unknown file type";
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    if (err == NULL && ferror(fp)) err = strerror(errno);
+    fclose(fp);
+
+    if (err) {
+        serverLog(LL_WARNING,"Fatal error: invalid AOF manifest %s at "
+                             "line %ld: %s", path, linenum, err);
+        exit(1);
+    }
+    return am;
+}
+
+/* Load the manifest at startup. When there is none but an AOF written by a
+ * version without multi part AOF exists, it is adopted as the base file
+ * and will be replaced by the next rewrite like any other base. */
+void aofLoadManifestFromDisk(void) {
+    sds am_name = getAofManifestFileName();
+    aofManifest *am = aofLoadManifestFromFile(am_name);
+
+    if (am == NULL) {
+        am = aofManifestCreate();
+        if (access(server.aof_filename,F_OK) == 0)
+            am->base_aof_info = aofInfoCreate(sdsnew(server.aof_filename),0,
+                                              AOF_FILE_TYPE_BASE);
     }
+    if (server.aof_manifest) aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
+    sdsfree(am_name);
 }
 
-/* Append data to the AOF rewrite buffer, allocating new blocks if needed. */
-// 将s指向的数据追加到AOF重写缓冲区中，如果需要可以新分配一个缓冲块
-void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
-    // 获取缓冲块链表的尾节点地址
-    listNode *ln = listLast(server.aof_rewrite_buf_blocks);
-    aofrwblock *block = ln ? ln->value : NULL;
+/* Atomically replace the manifest on disk with 'am': it is written into
+ * a temp file that is then renamed, and both the file and the directory
+ * are synced so that the new manifest survives a crash. */
+int persistAofManifest(aofManifest *am) {
+    sds am_name = getAofManifestFileName();
+    sds tmp_am_name = sdscatprintf(sdsempty(),"temp-%s",am_name);
+    sds buf = getAofManifestAsString(am);
+    int fd, dirfd, ret = C_ERR;
+
+    if ((fd = open(tmp_am_name,O_WRONLY|O_TRUNC|O_CREAT,0644)) == -1) {
+        serverLog(LL_WARNING,"Can't open the AOF manifest %s: %s",
+            tmp_am_name, strerror(errno));
+        goto cleanup;
+    }
+    if (aofWrite(fd,buf,sdslen(buf)) != (ssize_t)sdslen(buf) ||
+        redis_fsync(fd) == -1)
+    {
+        serverLog(LL_WARNING,"Error writing the AOF manifest %s: %s",
+            tmp_am_name, strerror(errno));
+        close(fd);
+        unlink(tmp_am_name);
+        goto cleanup;
+    }
+    close(fd);
+    if (rename(tmp_am_name,am_name) == -1) {
+        serverLog(LL_WARNING,"Error trying to rename the temporary AOF "
+            "manifest %s into %s: %s", tmp_am_name, am_name, strerror(errno));
+        unlink(tmp_am_name);
+        goto cleanup;
+    }
+    if ((dirfd = open(".",O_RDONLY)) != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    ret = C_OK;
 
-    while(len) {
-        /* If we already got at least an allocated block, try appending
-         * at least some piece into it. */
-        // 如果已经有一个缓存快，那么执行追加append操作
-        if (block) {
-            // 判断缓存块的可用空间最多能写的空间
-            unsigned long thislen = (block->free < len) ? block->free : len;
-            // 当前缓存块有一定空间
-            if (thislen) {  /* The current block is not already full. */
-                // 将s指向的数据拷贝thislen长度到当前缓存块
-                memcpy(block->buf+block->used, s, thislen);
-                // 更新可用和已用的信息
-                block->used += thislen;
-                block->free -= thislen;
-                // 更新要拷贝的数据地址
-                s += thislen;
-                // 更新拷贝的长度
-                len -= thislen;
-            }
-        }
+cleanup:
+    sdsfree(am_name);
+    sdsfree(tmp_am_name);
+    sdsfree(buf);
+    return ret;
+}
 
-        // 需要新创建一个缓存块
-        if (len) { /* First block to allocate, or need another block. */
-            int numblocks;
-
-            // 分配缓存块空间和初始化
-            block = zmalloc(sizeof(*block));
-            block->free = AOF_RW_BUF_BLOCK_SIZE;
-            block->used = 0;
-            // 将缓存块加如到链表缓存区末尾
-            listAddNodeTail(server.aof_rewrite_buf_blocks,block);
-
-            /* Log every time we cross more 10 or 100 blocks, respectively
-             * as a notice or warning. */
-            // 每次创建10个或100个缓存块，就更新日志，当做标记
-
-            // 获取当前缓存块个数
-            numblocks = listLength(server.aof_rewrite_buf_blocks);
-            // 更新日志
-            if (((numblocks+1) % 10) == 0) {
-                int level = ((numblocks+1) % 100) == 0 ? LL_WARNING :
-                                                         LL_NOTICE;
-                serverLog(level,"Background AOF buffer size: %lu MB",
-                    aofRewriteBufferSize()/(1024*1024));
-            }
+/* Called at startup, once the manifest is loaded, to open the file the
+ * writes are appended to: the last incr file of the manifest, or a new one
+ * when there is none yet (empty dataset, or AOF written by an older
+ * version). */
+void aofOpenIfNeededOnServerStart(void) {
+    aofManifest *am;
+    sds name;
+
+    if (server.aof_state != AOF_ON) return;
+    if (listLength(server.aof_manifest->incr_aof_list)) {
+        aofInfo *ai = listNodeValue(listLast(server.aof_manifest->incr_aof_list));
+        server.aof_fd = open(ai->file_name,O_WRONLY|O_APPEND);
+        if (server.aof_fd == -1) {
+            serverLog(LL_WARNING,"Can't open the append-only file %s: %s",
+                ai->file_name, strerror(errno));
+            exit(1);
         }
+        return;
     }
 
-    /* Install a file event to send data to the rewrite child if there is
-     * not one already. */
-    // 获取当前事件正在监听的类型，如果等于0，未设置，则设置管道aof_pipe_write_data_to_child为可写状态
-    // 当然aof_pipe_write_data_to_child可以用的时候，调用aofChildWriteDiffDatah()函数写数据
-    if (aeGetFileEvents(server.el,server.aof_pipe_write_data_to_child) == 0) {
-        aeCreateFileEvent(server.el, server.aof_pipe_write_data_to_child,
-            AE_WRITABLE, aofChildWriteDiffData, NULL);
+    am = aofManifestDup(server.aof_manifest);
+    name = aofManifestAddNewIncr(am);
+    server.aof_fd = open(name,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+    if (server.aof_fd == -1) {
+        serverLog(LL_WARNING,"Can't open the append-only file %s: %s",
+            name, strerror(errno));
+        exit(1);
     }
+    if (persistAofManifest(am) == C_ERR) exit(1);
+    aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
 }
 
-/* Write the buffer (possibly composed of multiple blocks) into the specified
- * fd. If a short write or any other error happens -1 is returned,
- * otherwise the number of bytes written is returned. */
-// 将缓冲区的数据写到指定的文件描述符fd中，成功返回写入的字节数，否则返回-1
-ssize_t aofRewriteBufferWrite(int fd) {
-    listNode *ln;
-    listIter li;
-    ssize_t count = 0;
+/* Switch the appends to a new incr file. This is called right before
+ * forking the rewrite child, so that the writes received from now on are
+ * not part of the new base and don't need to be buffered.
+ *
+ * The new file is added to the manifest right away, so that if the rewrite
+ * fails, or the server crashes, the AOF can still be loaded from the old
+ * base and all the incr files. However while the AOF is being turned on
+ * there is no valid base to start from, so the temp incr file is used
+ * instead, see getTempIncrAofFileName(). */
+int openNewIncrAofForAppend(void) {
+    aofManifest *am = NULL;
+    sds name;
+    int newfd;
 
-    // 设置链表迭代器指向头节点，并设置迭代方向为从头到位
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    // 遍历所有链表节点
-    while((ln = listNext(&li))) {
-        // 获取缓存块地址
-        aofrwblock *block = listNodeValue(ln);
-        ssize_t nwritten;
-
-        // 如果有数据，则将已有的数据写到fd中
-        if (block->used) {
-            // 如果发生短写（short write），设置errno返回-1
-            nwritten = write(fd,block->buf,block->used);
-            if (nwritten != (ssize_t)block->used) {
-                if (nwritten == 0) errno = EIO;
-                return -1;
-            }
-            // 更新成功写的字节数
-            count += nwritten;
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        name = getTempIncrAofFileName();
+    } else {
+        am = aofManifestDup(server.aof_manifest);
+        name = sdsdup(aofManifestAddNewIncr(am));
+    }
+
+    newfd = open(name,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+    if (newfd == -1) {
+        serverLog(LL_WARNING,"Can't open the append-only file %s: %s",
+            name, strerror(errno));
+        goto error;
+    }
+    if (am) {
+        if (persistAofManifest(am) == C_ERR) {
+            close(newfd);
+            unlink(name);
+            goto error;
         }
+        aofManifestFree(server.aof_manifest);
+        server.aof_manifest = am;
+    }
+
+    /* The previous file gets no more writes: sync and close it in
+     * background. */
+    if (server.aof_fd != -1) aof_background_fsync_and_close(server.aof_fd);
+    server.aof_fd = newfd;
+    server.aof_last_incr_size = 0;
+    server.aof_selected_db = -1; /* The new file must start with a SELECT. */
+    sdsfree(name);
+    return C_OK;
+
+error:
+    if (am) aofManifestFree(am);
+    sdsfree(name);
+    return C_ERR;
+}
+
+/* Return the size of the AOF file 'name', or 0 if it can't be accessed. */
+off_t getAppendOnlyFileSize(sds name) {
+    struct redis_stat sb;
+
+    if (redis_stat(name,&sb) == -1) {
+        if (errno != ENOENT)
+            serverLog(LL_WARNING,"Unable to obtain the size of the AOF "
+                "file %s: %s", name, strerror(errno));
+        return 0;
     }
-    return count;
+    return sb.st_size;
 }
 
 /* ----------------------------------------------------------------------------
@@ -277,7 +417,40 @@ int aofFsyncInProgress(void) {
  * file descriptor (the one of the AOF file) in another thread. */
 // 启动一个后台任务，对另一个线程中的指定文件描述符（AOF文件之一）执行fsync（）。
 void aof_background_fsync(int fd) {
-    bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,NULL,NULL);
+    bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,
+                           (void*)(long)server.aof_written_woff,NULL);
+}
+
+/* Like aof_background_fsync() but the file is closed once synced. This is
+ * used for the incr files that stop receiving writes: the job is queued
+ * in the same FIFO of the other fsyncs, so the fsynced offset reported by
+ * the next jobs, targeting the new file, always covers the old one too. */
+void aof_background_fsync_and_close(int fd) {
+    bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,
+                           (void*)(long)server.aof_written_woff,(void*)1);
+}
+
+/* Called by the thread that performed the fsync covering the AOF up to
+ * 'offset'. Offsets may be reported out of order, and concurrently, by the
+ * main thread (appendfsync always) and the bio thread, so we never go back:
+ * the offset is only replaced by a larger one with a compare and swap. */
+void aofSetFsyncedOffset(long long offset) {
+    long long fsynced;
+
+    atomicGet(server.aof_fsynced_woff,fsynced);
+    while (offset > fsynced &&
+           !__atomic_compare_exchange_n(&server.aof_fsynced_woff,&fsynced,
+                offset,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+/* Return true if some client blocked in WAITAOF needs an fsync that is
+ * not already done. */
+static int aofFsyncNeededByWaiters(void) {
+    long long fsynced;
+
+    if (listLength(server.clients_waiting_aof) == 0) return 0;
+    atomicGet(server.aof_fsynced_woff,fsynced);
+    return fsynced < server.aof_written_woff;
 }
 
 /* Kills an AOFRW child process if exists */
@@ -295,17 +468,11 @@ void killAppendOnlyChild(void) {
         // 等待子进程退出
         while(wait3(&statloc,0,NULL) != server.aof_child_pid);
     }
-    /* Reset the buffer accumulating changes while the child saves. */
-    // 释放旧的AOF缓冲块的，并且初始化一个新的。
-    aofRewriteBufferReset();
     // 删除临时文件
     aofRemoveTempFile(server.aof_child_pid);
     // 清除执行AOF进程的id和重写的时间
     server.aof_child_pid = -1;
     server.aof_rewrite_time_start = -1;
-    /* Close pipes used for IPC between the two processes. */
-    // 关闭两个进程之间的通信管道
-    aofClosePipes();
     closeChildInfoPipe();
     updateDictResizePolicy();
 }
@@ -318,10 +485,20 @@ void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
     // 强制将AOF缓冲区内容冲洗到AOF文件中
     flushAppendOnlyFile(1);
-    // 对AOF文件执行同步操作
-    redis_fsync(server.aof_fd);
-    // 关闭AOF文件
-    close(server.aof_fd);
+    if (server.aof_fd != -1) {
+        // 对AOF文件执行同步操作
+        if (redis_fsync(server.aof_fd) == 0 && server.aof_state == AOF_ON)
+            aofSetFsyncedOffset(server.aof_written_woff);
+        // 关闭AOF文件
+        close(server.aof_fd);
+    }
+    /* The writes logged while waiting for the first rewrite are useless
+     * without a base. */
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        sds tmpname = getTempIncrAofFileName();
+        bg_unlink(tmpname);
+        sdsfree(tmpname);
+    }
 
     // 清空AOF状态
     server.aof_fd = -1;
@@ -330,39 +507,27 @@ void stopAppendOnly(void) {
     server.aof_rewrite_scheduled = 0;
     //关闭AOF子进程
     killAppendOnlyChild();
+    /* Nothing will be fsynced anymore: reply to the WAITAOF clients. */
+    processClientsWaitingAof();
 }
 
 /* Called when the user switches from "appendonly no" to "appendonly yes"
  * at runtime using the CONFIG command. */
 // 用户通过CONFIG命令设置appendonly为yes时，调用startAppendOnly()
 int startAppendOnly(void) {
-    char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-    int newfd;
-
-    // 打开一个AOF文件
-    newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     // 确保当前AOF状态为关闭状态
     serverAssert(server.aof_state == AOF_OFF);
-    // 打开文件失败，获得文件路径更新日志
-    if (newfd == -1) {
-        char *cwdp = getcwd(cwd,MAXPATHLEN);
-
-        serverLog(LL_WARNING,
-            "Redis needs to enable the AOF but can't open the "
-            "append only file %s (in server root dir %s): %s",
-            server.aof_filename,
-            cwdp ? cwdp : "unknown",
-            strerror(errno));
-        return C_ERR;
-    }
+    /* Set the state before starting the rewrite: the writes performed while
+     * it runs are logged in the temp incr file. */
+    server.aof_state = AOF_WAIT_REWRITE;
     // 当前正在执行RDB持久化，那么将AOF提上日程
     if (hasActiveChildProcess() && server.aof_child_pid == -1) {
         server.aof_rewrite_scheduled = 1;    //设置提上日程标记
         serverLog(LL_WARNING,"AOF was enabled but there is already another background operation. An AOF background was scheduled to start when possible.");
     } else {
         /* If there is a pending AOF rewrite, we need to switch it off and
-         * start a new one: the old one cannot be reused because it is not
-         * accumulating the AOF buffer. */
+         * start a new one: the old one cannot be reused because its writes
+         * are not logged in a new incr file. */
         if (server.aof_child_pid != -1) {
             serverLog(LL_WARNING,"AOF was enabled but there is already an AOF rewriting in background. Stopping background AOF and starting a rewrite now.");
             // 关闭aof子进程
@@ -371,18 +536,19 @@ int startAppendOnly(void) {
         // 如果AOF后台重写失败
         if (rewriteAppendOnlyFileBackground() == C_ERR) {
             // 关闭AOF文件描述符，并更新日志
-            close(newfd);
+            if (server.aof_fd != -1) {
+                close(server.aof_fd);
+                server.aof_fd = -1;
+            }
+            server.aof_state = AOF_OFF;
             serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
             return C_ERR;
         }
     }
     /* We correctly switched on AOF, now wait for the rewrite to be complete
-     * in order to append data on disk. */
-    // 设置AOF状态为等待重写完成
-    server.aof_state = AOF_WAIT_REWRITE;
+     * in order to add the appended data to the manifest. */
     // 设置AOF最近一个同步的时间
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = newfd;
     return C_OK;
 }
 
@@ -460,6 +626,8 @@ void flushAppendOnlyFile(int force) {
             server.unixtime > server.aof_last_fsync &&
             !(sync_in_progress = aofFsyncInProgress())) {
             goto try_fsync;
+        } else if (aofFsyncNeededByWaiters()) {
+            goto try_fsync;
         } else {
             return;
         }
@@ -512,6 +680,12 @@ void flushAppendOnlyFile(int force) {
     }
     // 执行write操作，保证写操作是原子操作
 
+    /* Compress the frames of this write in a single block. This is not done
+     * after a failed write, since the buffer may already hold a block. */
+    if (server.aof_binary_encoding && server.aof_binary_compression &&
+        !server.aof_buf_has_resp && server.aof_last_write_status == C_OK)
+        aofBinaryCompressBuffer();
+
     // 设置延迟检测开始的时间
     latencyStartMonitor(latency);
     // 将缓冲区的内容写到AOF文件中
@@ -574,7 +748,7 @@ void flushAppendOnlyFile(int force) {
             }
 
             // 将追加的内容截断，删除了追加的内容，恢复成原来的文件
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            if (ftruncate(server.aof_fd, server.aof_last_incr_size) == -1) {
                 if (can_log) {
                     serverLog(LL_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -611,8 +785,12 @@ void flushAppendOnlyFile(int force) {
             if (nwritten > 0) {
                 // 只能更新当前的AOF文件的大小
                 server.aof_current_size += nwritten;
+                server.aof_last_incr_size += nwritten;
                 // 删除AOF缓冲区写入的字节数
                 sdsrange(server.aof_buf,nwritten,-1);
+                /* aof_written_woff is not updated: the buffer may be a
+                 * compressed block, so what was written in terms of
+                 * commands is unknown until the whole buffer is written. */
             }
             return; /* We'll try again on the next call... */
         }
@@ -629,6 +807,9 @@ void flushAppendOnlyFile(int force) {
     }
     // 只能更新当前的AOF文件的大小
     server.aof_current_size += nwritten;
+    server.aof_last_incr_size += nwritten;
+    server.aof_written_woff = server.aof_woff;
+    server.aof_buf_has_resp = 0;
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -653,7 +834,8 @@ try_fsync:
         // 设置延迟检测开始的时间
         latencyStartMonitor(latency);
         // Linux下调用fdatasync()函数更高效的执行同步
-        redis_fsync(server.aof_fd); /* Let's try to get this data on the disk */
+        if (redis_fsync(server.aof_fd) == 0) /* Let's try to get this data on the disk */
+            aofSetFsyncedOffset(server.aof_written_woff);
         // 设置延迟的时间 = 当前的时间 - 开始的时间
         latencyEndMonitor(latency);
         // 将latency和"aof-fsync-always"关联到延迟诊断字典中
@@ -672,6 +854,282 @@ try_fsync:
         // 更新最近一次执行同步的时间
         server.aof_last_fsync = server.unixtime;
     }
+
+    /* Group commit: when clients are blocked in WAITAOF we don't wait for
+     * the next second, a single background fsync is started ASAP and covers
+     * all the writes accumulated so far, whatever the fsync policy. The
+     * writes performed while it runs are covered by the next one, started
+     * as soon as the bio thread wakes us up. */
+    if (server.aof_fsync != AOF_FSYNC_ALWAYS && aofFsyncNeededByWaiters() &&
+        !aofFsyncInProgress())
+    {
+        aof_background_fsync(server.aof_fd);
+        server.aof_fsync_offset = server.aof_current_size;
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Binary AOF encoding
+ * ------------------------------------------------------------------------- */
+
+/* With 'aof-binary-encoding' enabled the commands are logged as binary
+ * frames instead of the Redis protocol:
+ *
+ *   <AOF_BIN_CMD> <len> <payload>
+ *   <AOF_BIN_BLOCK> <len> <codec> <rawlen> <compressed frames>
+ *
+ * All the numbers are unsigned LEB128 varints. The payload of a command
+ * is its argc, the ID of the command name in aofBinaryCommands[], and the
+ * arguments, the name included when the ID is zero. Every argument starts
+ * with a varint header: an even header 2*len is followed by len bytes, the
+ * header 1 is followed by an integer as a zigzag varint. A block holds the
+ * frames of a whole write of the AOF buffer, compressed with LZ4 or zstd.
+ *
+ * Frames are told apart from the protocol by their first byte, so a file
+ * may contain both, for instance when the option is changed at runtime. */
+
+/* IDs of the command names, the position in the table is the ID. Never
+ * remove or reorder entries: only append new ones. */
+static const char *aofBinaryCommands[] = {
+    NULL, /* The name is the first argument. */
+    "select", "set", "pexpireat", "del", "unlink", "incr", "decr", "incrby",
+    "decrby", "incrbyfloat", "append", "setrange", "setbit", "getset",
+    "mset", "msetnx", "setnx", "persist", "rename", "renamenx", "move",
+    "lpush", "rpush", "lpushx", "rpushx", "lpop", "rpop", "lset", "lrem",
+    "ltrim", "linsert", "rpoplpush", "sadd", "srem", "smove", "spop",
+    "sinterstore", "sunionstore", "sdiffstore", "zadd", "zincrby", "zrem",
+    "zremrangebyscore", "zremrangebyrank", "zremrangebylex", "zpopmin",
+    "zpopmax", "zunionstore", "zinterstore", "hset", "hsetnx", "hmset",
+    "hdel", "hincrby", "hincrbyfloat", "xadd", "xdel", "xtrim", "xgroup",
+    "xack", "xclaim", "xsetid", "pfadd", "pfmerge", "bitop", "bitfield",
+    "restore", "flushdb", "flushall", "swapdb", "multi", "exec", "publish",
+    "geoadd", "sort", "copy"
+};
+
+#define AOF_BIN_NUMCMDS (sizeof(aofBinaryCommands)/sizeof(aofBinaryCommands[0]))
+
+/* Maps the names of aofBinaryCommands[] to their ID, case insensitive. */
+static dict *aofBinaryCommandIds = NULL;
+
+/* Don't compress AOF buffers smaller than this. */
+#define AOF_BIN_BLOCK_MIN_SIZE 1024
+
+static int aofBinaryCommandId(robj *name) {
+    dictEntry *de;
+
+    if (!sdsEncodedObject(name)) return 0;
+    if (aofBinaryCommandIds == NULL) {
+        aofBinaryCommandIds = dictCreate(&commandTableDictType,NULL);
+        for (unsigned long j = 1; j < AOF_BIN_NUMCMDS; j++)
+            dictAdd(aofBinaryCommandIds,sdsnew(aofBinaryCommands[j]),
+                    (void*)j);
+    }
+    de = dictFind(aofBinaryCommandIds,name->ptr);
+    return de ? (long)dictGetVal(de) : 0;
+}
+
+static sds aofBinaryCatVarint(sds dst, uint64_t v) {
+    unsigned char buf[10];
+    int len = 0;
+
+    do {
+        buf[len] = v & 0x7f;
+        v >>= 7;
+        if (v) buf[len] |= 0x80;
+        len++;
+    } while(v);
+    return sdscatlen(dst,buf,len);
+}
+
+/* Decode a varint at '*p', not going over 'end'. Returns 0 on success. */
+static int aofBinaryGetVarint(const unsigned char **p,
+                              const unsigned char *end, uint64_t *v)
+{
+    uint64_t val = 0;
+    int shift = 0;
+
+    while(*p < end && shift < 64) {
+        unsigned char byte = *(*p)++;
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = val;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static sds aofBinaryCatArg(sds dst, robj *o) {
+    long long value;
+
+    if (o->encoding == OBJ_ENCODING_INT ||
+        (sdslen(o->ptr) <= 20 && string2ll(o->ptr,sdslen(o->ptr),&value)))
+    {
+        if (o->encoding == OBJ_ENCODING_INT) value = (long)o->ptr;
+        dst = aofBinaryCatVarint(dst,1);
+        return aofBinaryCatVarint(dst,
+            ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+    }
+    dst = aofBinaryCatVarint(dst,(uint64_t)sdslen(o->ptr) << 1);
+    return sdscatlen(dst,o->ptr,sdslen(o->ptr));
+}
+
+/* Append the binary frame of the command to 'dst'. */
+sds catAppendOnlyBinaryCommand(sds dst, int argc, robj **argv) {
+    sds payload = sdsempty();
+    int id = aofBinaryCommandId(argv[0]);
+    char marker = AOF_BIN_CMD;
+
+    payload = aofBinaryCatVarint(payload,argc);
+    payload = aofBinaryCatVarint(payload,id);
+    for (int j = id ? 1 : 0; j < argc; j++)
+        payload = aofBinaryCatArg(payload,argv[j]);
+
+    dst = sdscatlen(dst,&marker,1);
+    dst = aofBinaryCatVarint(dst,sdslen(payload));
+    dst = sdscatlen(dst,payload,sdslen(payload));
+    sdsfree(payload);
+    return dst;
+}
+
+/* Decode the payload of an AOF_BIN_CMD frame into an array of argc sds
+ * strings. Returns C_ERR if the payload is not valid. */
+int aofBinaryDecodeCommand(const unsigned char *p, size_t len, int *argcp,
+                           sds **argvp)
+{
+    const unsigned char *end = p+len;
+    uint64_t argc, id, hdr, v;
+    sds *argv;
+    int j = 0;
+
+    if (aofBinaryGetVarint(&p,end,&argc) == -1 || argc < 1 ||
+        argc > len || aofBinaryGetVarint(&p,end,&id) == -1 ||
+        id >= AOF_BIN_NUMCMDS) return C_ERR;
+
+    argv = zmalloc(sizeof(sds)*argc);
+    if (id) argv[j++] = sdsnew(aofBinaryCommands[id]);
+    for (; j < (int)argc; j++) {
+        if (aofBinaryGetVarint(&p,end,&hdr) == -1) goto err;
+        if (hdr == 1) {
+            if (aofBinaryGetVarint(&p,end,&v) == -1) goto err;
+            argv[j] = sdsfromlonglong((long long)((v >> 1) ^ -(v & 1)));
+        } else if (!(hdr & 1) && (hdr >> 1) <= (uint64_t)(end-p)) {
+            argv[j] = sdsnewlen(p,hdr >> 1);
+            p += hdr >> 1;
+        } else {
+            goto err;
+        }
+    }
+    if (p != end) goto err;
+    *argcp = argc;
+    *argvp = argv;
+    return C_OK;
+
+err:
+    while(j--) sdsfree(argv[j]);
+    zfree(argv);
+    return C_ERR;
+}
+
+/* Read the rest of a frame whose marker byte was already consumed from
+ * 'fp'. On success C_OK is returned and '*frame' is set to its content.
+ * On error C_ERR is returned, with feof(fp) set if the frame is truncated. */
+int aofBinaryReadFrame(FILE *fp, sds *frame) {
+    uint64_t len = 0;
+    int c, shift = 0;
+
+    do {
+        if ((c = getc(fp)) == EOF) return C_ERR;
+        len |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while((c & 0x80) && shift < 64);
+    if ((c & 0x80) || len > AOF_BIN_MAX_FRAME) return C_ERR;
+
+    *frame = sdsnewlen(SDS_NOINIT,len);
+    if (len && fread(*frame,len,1,fp) == 0) {
+        sdsfree(*frame);
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Return the frames compressed in the content of an AOF_BIN_BLOCK frame,
+ * or NULL if the block is not valid. */
+sds aofBinaryInflateBlock(sds block) {
+    const unsigned char *p = (unsigned char*)block+1;
+    const unsigned char *end = (unsigned char*)block+sdslen(block);
+    uint64_t rawlen;
+    sds raw;
+    int ok;
+
+    if (sdslen(block) < 1 || aofBinaryGetVarint(&p,end,&rawlen) == -1 ||
+        rawlen > AOF_BIN_MAX_FRAME) return NULL;
+    raw = sdsnewlen(SDS_NOINIT,rawlen);
+    switch(block[0]) {
+    case RDB_ENC_LZ4:
+        ok = lz4_decompress(p,end-p,raw,rawlen) == rawlen;
+        break;
+    case RDB_ENC_ZSTD:
+        ok = rdbZstdDecompress(raw,rawlen,p,end-p) == 0;
+        break;
+    default:
+        ok = 0;
+        break;
+    }
+    if (!ok) {
+        sdsfree(raw);
+        return NULL;
+    }
+    return raw;
+}
+
+/* Get the next AOF_BIN_CMD frame of an inflated block, starting at '*pos'.
+ * Returns C_ERR if the frame is not valid. */
+int aofBinaryNextBlockCommand(sds raw, size_t *pos, int *argcp, sds **argvp) {
+    const unsigned char *start = (unsigned char*)raw+*pos;
+    const unsigned char *end = (unsigned char*)raw+sdslen(raw);
+    const unsigned char *p = start+1;
+    uint64_t len;
+
+    if (start >= end || *start != AOF_BIN_CMD ||
+        aofBinaryGetVarint(&p,end,&len) == -1 ||
+        len > (uint64_t)(end-p)) return C_ERR;
+    if (aofBinaryDecodeCommand(p,len,argcp,argvp) == C_ERR) return C_ERR;
+    *pos = (p+len)-(unsigned char*)raw;
+    return C_OK;
+}
+
+/* Replace the content of the AOF buffer, that only contains binary frames,
+ * with a single compressed block, if this makes it smaller. */
+static void aofBinaryCompressBuffer(void) {
+    size_t len = sdslen(server.aof_buf), clen;
+    sds block, hdr;
+    unsigned char *out;
+
+    if (len < AOF_BIN_BLOCK_MIN_SIZE || len > AOF_BIN_MAX_FRAME) return;
+
+    out = zmalloc(len);
+    if (server.aof_binary_compression == RDB_ENC_LZ4)
+        clen = lz4_compress(server.aof_buf,len,out,len);
+    else
+        clen = rdbZstdCompress(out,len,server.aof_buf,len);
+    if (clen == 0 || clen + 24 >= len) {
+        zfree(out);
+        return;
+    }
+    hdr = sdsnewlen(NULL,1);
+    hdr[0] = server.aof_binary_compression;
+    hdr = aofBinaryCatVarint(hdr,len);
+    block = sdsnewlen(NULL,1);
+    block[0] = AOF_BIN_BLOCK;
+    block = aofBinaryCatVarint(block,sdslen(hdr)+clen);
+    block = sdscatsds(block,hdr);
+    sdsfree(hdr);
+    block = sdscatlen(block,out,clen);
+    zfree(out);
+    sdsfree(server.aof_buf);
+    server.aof_buf = block;
 }
 
 // 根据传入的命令和命令参数，将他们还原成协议格式
@@ -680,6 +1138,9 @@ sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
     int len, j;
     robj *o;
 
+    if (server.aof_binary_encoding)
+        return catAppendOnlyBinaryCommand(dst,argc,argv);
+
     // 格式："*<argc>\r\n"
     buf[0] = '*';
     len = 1+ll2string(buf+1,sizeof(buf)-1,argc);
@@ -758,12 +1219,12 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
      * we appended. To issue a SELECT command is needed. */
     // 使用SELECT命令，显式的设置当前数据库
     if (dictid != server.aof_selected_db) {
-        char seldb[64];
-
-        snprintf(seldb,sizeof(seldb),"%d",dictid);
         // 构造SELECT命令的协议格式
-        buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
-            (unsigned long)strlen(seldb),seldb);
+        tmpargv[0] = createStringObject("SELECT",6);
+        tmpargv[1] = createStringObjectFromLongLong(dictid);
+        buf = catAppendOnlyGenericCommand(buf,2,tmpargv);
+        decrRefCount(tmpargv[0]);
+        decrRefCount(tmpargv[1]);
         // 执行AOF时，当前的数据库ID
         server.aof_selected_db = dictid;
     }
@@ -820,20 +1281,104 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
      * of re-entering the event loop, so before the client will get a
      * positive reply about the operation performed. */
     // 如果正在进行AOF，则将命令追加到AOF的缓存中，在重新进入事件循环之前，这些命令会被冲洗到磁盘上，并向client回复
-    if (server.aof_state == AOF_ON)
+    /* While the AOF is being turned on, the writes performed after the
+     * rewrite child forked are not in the new base: log them in the temp
+     * incr file opened for this rewrite. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_state == AOF_WAIT_REWRITE && server.aof_child_pid != -1))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
-
-    /* If a background append only file rewriting is in progress we want to
-     * accumulate the differences between the child DB and the current one
-     * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    // 如果后台正在进行重写，那么将命令追加到重写缓存区中，以便我们记录重写的AOF文件于当前数据库的差异
-    if (server.aof_child_pid != -1)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+        server.aof_woff += sdslen(buf);
+        /* Only binary frames can be compressed in a block. */
+        if (!server.aof_binary_encoding) server.aof_buf_has_resp = 1;
+    }
 
     sdsfree(buf);
 }
 
+/* ----------------------------------------------------------------------------
+ * WAITAOF: durability acknowledgement
+ * ------------------------------------------------------------------------- */
+
+/* WAITAOF <timeout>
+ *
+ * Block the client until the AOF is fsynced up to its latest write command
+ * (and all the previous commands). Replies with 1 when the data is on
+ * disk, or with 0 if the timeout, in milliseconds, is reached before.
+ * While clients are waiting the fsyncs are grouped: a single background
+ * fsync acknowledges all the writes performed before it started, so it is
+ * possible to get the "always" durability only for the writes that need
+ * it, with the throughput of "everysec". */
+void waitaofCommand(client *c) {
+    mstime_t timeout;
+    long long fsynced;
+
+    if (server.aof_state != AOF_ON) {
+        addReplyError(c,"WAITAOF cannot be used when appendonly is disabled "
+                        "or while it is being enabled");
+        return;
+    }
+    if (getTimeoutFromObjectOrReply(c,c->argv[1],&timeout,UNIT_MILLISECONDS)
+        != C_OK) return;
+
+    /* First try without blocking at all. */
+    atomicGet(server.aof_fsynced_woff,fsynced);
+    if (fsynced >= c->aof_woff || c->flags & CLIENT_MULTI) {
+        addReplyLongLong(c,fsynced >= c->aof_woff);
+        return;
+    }
+
+    /* Otherwise block the client: the AOF is flushed and the fsync started
+     * in beforeSleep(), and the client is served as soon as the bio thread
+     * wakes us up. */
+    c->bpop.timeout = timeout;
+    c->bpop.aofoffset = c->aof_woff;
+    listAddNodeTail(server.clients_waiting_aof,c);
+    blockClient(c,BLOCKED_WAITAOF);
+}
+
+/* This is called by unblockClient() to perform the blocking op type
+ * specific cleanup. Never call it directly, call unblockClient() instead. */
+void unblockClientWaitingAof(client *c) {
+    listNode *ln = listSearchKey(server.clients_waiting_aof,c);
+    serverAssert(ln != NULL);
+    listDelNode(server.clients_waiting_aof,ln);
+}
+
+/* Unblock the clients in WAITAOF whose offset was fsynced. When the AOF
+ * was turned off nothing will ever be fsynced again, so all the clients
+ * are served with the current state. */
+void processClientsWaitingAof(void) {
+    long long fsynced;
+    listIter li;
+    listNode *ln;
+
+    if (listLength(server.clients_waiting_aof) == 0) return;
+    atomicGet(server.aof_fsynced_woff,fsynced);
+    listRewind(server.clients_waiting_aof,&li);
+    while((ln = listNext(&li))) {
+        client *c = ln->value;
+        int done = fsynced >= c->bpop.aofoffset;
+
+        if (done || server.aof_state == AOF_OFF) {
+            unblockClient(c);
+            addReplyLongLong(c,done);
+        }
+    }
+}
+
+/* The bio thread writes to this pipe after every AOF fsync, just to make
+ * sure the event loop does not sleep while WAITAOF clients can be served:
+ * the work is done in beforeSleep(). */
+void aofFsyncPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+}
+
 /* ----------------------------------------------------------------------------
  * AOF loading
  * ------------------------------------------------------------------------- */
@@ -897,47 +1442,313 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
-/* Replay the append log file. On success C_OK is returned. On non fatal
- * error (the append only file is zero-length) C_ERR is returned. On
+/* Replay of the AOF commands.
+ *
+ * Parsing the protocol and building the argument objects takes a good part
+ * of the loading time, so with 'aof-load-reader-thread' enabled a reader
+ * thread parses the file into batches of commands, up to AOF_REPLAY_RING
+ * batches ahead of the main thread, that only executes them. Commands are
+ * still executed in the order of the file. Without the thread the main
+ * thread parses the batches itself, so the loading code is the same. */
+#define AOF_REPLAY_BATCH 256    /* Commands in a batch. */
+#define AOF_REPLAY_RING 16      /* Batches the reader can be ahead of us. */
+
+#define AOF_REPLAY_OK 0         /* A command was parsed. */
+#define AOF_REPLAY_EOF 1        /* End of file, between two commands. */
+#define AOF_REPLAY_READERR 2    /* Read error or short read. */
+#define AOF_REPLAY_FMTERR 3     /* Not the Redis protocol. */
+
+typedef struct aofReplayCmd {
+    int argc;
+    robj **argv;
+    off_t end;                  /* File offset after the command. */
+} aofReplayCmd;
+
+typedef struct aofReplayBatch {
+    int count;
+    aofReplayCmd cmds[AOF_REPLAY_BATCH];
+} aofReplayBatch;
+
+typedef struct aofReplay {
+    FILE *fp;
+    int started;                /* aofReplayStart() was called. */
+    int threaded;               /* The batches come from the reader thread. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* A batch was produced or consumed. */
+    aofReplayBatch *ring[AOF_REPLAY_RING];
+    int head, count;            /* First batch and number of batches. */
+    int done;                   /* No more batches will be produced. */
+    int status;                 /* AOF_REPLAY_* that stopped the parsing. */
+    int eof;                    /* feof() at the time of the read error. */
+    int err;                    /* errno at the time of the read error. */
+    sds block;                  /* Inflated AOF_BIN_BLOCK being consumed. */
+    size_t blockpos;            /* Next frame in 'block'. */
+    off_t blockend;             /* File offset after the block. */
+} aofReplay;
+
+/* Parse the next command of the AOF, "*<argc>\r\n" followed by argc
+ * "$<len>\r\n<arg>\r\n" arguments, into 'rc'. */
+static int aofReplayReadRespCommand(FILE *fp, aofReplayCmd *rc) {
+    char buf[128];
+    int argc, j;
+    unsigned long len;
+    robj **argv;
+    sds argsds;
+    int status = AOF_REPLAY_READERR;
+
+    // 将一行文件内容读到buf中，遇到"\r\n"停止
+    if (fgets(buf,sizeof(buf),fp) == NULL)
+        return feof(fp) ? AOF_REPLAY_EOF : AOF_REPLAY_READERR;
+    // 检查文件格式 "*<argc>\r\n"
+    if (buf[0] != '*') return AOF_REPLAY_FMTERR;
+    if (buf[1] == '\0') return AOF_REPLAY_READERR;
+    // 取出命令参数个数
+    argc = atoi(buf+1);
+    if (argc < 1) return AOF_REPLAY_FMTERR;  //至少一个参数，就是当前命令
+
+    // 分配参数列表空间
+    argv = zmalloc(sizeof(robj*)*argc);
+    // "$<command_len>\r\n<command>\r\n"
+    for (j = 0; j < argc; j++) {
+        /* Parse the argument len. */
+        char *readres = fgets(buf,sizeof(buf),fp);
+        if (readres == NULL || buf[0] != '$') {
+            if (readres != NULL) status = AOF_REPLAY_FMTERR;
+            goto err;
+        }
+
+        // 读出参数的长度len
+        len = strtol(buf+1,NULL,10);
+
+        /* Read it into a string object. */
+        argsds = sdsnewlen(SDS_NOINIT,len);
+        if (len && fread(argsds,len,1,fp) == 0) {
+            sdsfree(argsds);
+            goto err;
+        }
+        argv[j] = createObject(OBJ_STRING,argsds);
+
+        /* Discard CRLF. */
+        if (fread(buf,2,1,fp) == 0) {
+            j++; /* Free up to j. */
+            goto err;
+        }
+    }
+    rc->argc = argc;
+    rc->argv = argv;
+    rc->end = ftello(fp);
+    return AOF_REPLAY_OK;
+
+err:
+    while(j--) decrRefCount(argv[j]);
+    zfree(argv);
+    return status;
+}
+
+/* Turn the sds arguments decoded from a binary frame into 'rc'. */
+static void aofReplaySetBinaryCommand(aofReplayCmd *rc, int argc, sds *argv) {
+    rc->argc = argc;
+    rc->argv = zmalloc(sizeof(robj*)*argc);
+    for (int j = 0; j < argc; j++)
+        rc->argv[j] = createObject(OBJ_STRING,argv[j]);
+    zfree(argv);
+}
+
+/* Parse the next command of the AOF, in the Redis protocol or binary. The
+ * commands of a block all end at the end of the block, since a block is
+ * written at once and can't be truncated in the middle. */
+static int aofReplayReadCommand(aofReplay *r, aofReplayCmd *rc) {
+    int c, argc;
+    sds frame, *argv;
+
+    if (r->block == NULL) {
+        if ((c = getc(r->fp)) == EOF)
+            return feof(r->fp) ? AOF_REPLAY_EOF : AOF_REPLAY_READERR;
+        if (c != AOF_BIN_CMD && c != AOF_BIN_BLOCK) {
+            ungetc(c,r->fp);
+            return aofReplayReadRespCommand(r->fp,rc);
+        }
+        if (aofBinaryReadFrame(r->fp,&frame) == C_ERR)
+            return (feof(r->fp) || ferror(r->fp)) ? AOF_REPLAY_READERR :
+                                                    AOF_REPLAY_FMTERR;
+        if (c == AOF_BIN_CMD) {
+            int retval = aofBinaryDecodeCommand((unsigned char*)frame,
+                sdslen(frame),&argc,&argv);
+            sdsfree(frame);
+            if (retval == C_ERR) return AOF_REPLAY_FMTERR;
+            aofReplaySetBinaryCommand(rc,argc,argv);
+            rc->end = ftello(r->fp);
+            return AOF_REPLAY_OK;
+        }
+        r->block = aofBinaryInflateBlock(frame);
+        sdsfree(frame);
+        if (r->block == NULL) return AOF_REPLAY_FMTERR;
+        r->blockpos = 0;
+        r->blockend = ftello(r->fp);
+    }
+
+    if (aofBinaryNextBlockCommand(r->block,&r->blockpos,&argc,&argv) == C_ERR)
+        return AOF_REPLAY_FMTERR;
+    aofReplaySetBinaryCommand(rc,argc,argv);
+    rc->end = r->blockend;
+    if (r->blockpos == sdslen(r->block)) {
+        sdsfree(r->block);
+        r->block = NULL;
+    }
+    return AOF_REPLAY_OK;
+}
+
+/* Parse up to AOF_REPLAY_BATCH commands. Returns NULL if the parsing was
+ * already stopped, otherwise a batch, possibly empty, and when the batch
+ * is not full the reason is in r->status. */
+static aofReplayBatch *aofReplayReadBatch(aofReplay *r) {
+    aofReplayBatch *b;
+    int status = AOF_REPLAY_OK;
+
+    if (r->status != AOF_REPLAY_OK) return NULL;
+    b = zmalloc(sizeof(*b));
+    b->count = 0;
+    while(b->count < AOF_REPLAY_BATCH) {
+        status = aofReplayReadCommand(r,b->cmds+b->count);
+        if (status != AOF_REPLAY_OK) break;
+        b->count++;
+    }
+    if (status == AOF_REPLAY_READERR) {
+        r->eof = feof(r->fp);
+        r->err = errno;
+    }
+    if (status != AOF_REPLAY_OK && r->block) {
+        sdsfree(r->block);
+        r->block = NULL;
+    }
+    r->status = status;
+    return b;
+}
+
+static void aofReplayFreeBatch(aofReplayBatch *b) {
+    for (int i = 0; i < b->count; i++) {
+        aofReplayCmd *rc = b->cmds+i;
+
+        if (rc->argv == NULL) continue; /* Owned by the fake client. */
+        for (int j = 0; j < rc->argc; j++) decrRefCount(rc->argv[j]);
+        zfree(rc->argv);
+    }
+    zfree(b);
+}
+
+static void *aofReplayThreadMain(void *arg) {
+    aofReplay *r = arg;
+    aofReplayBatch *b;
+    sigset_t sigset;
+
+    redis_set_thread_title("aof_load");
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in AOF loading thread: %s",
+            strerror(errno));
+
+    while((b = aofReplayReadBatch(r)) != NULL) {
+        pthread_mutex_lock(&r->lock);
+        while(r->count == AOF_REPLAY_RING)
+            pthread_cond_wait(&r->cond,&r->lock);
+        r->ring[(r->head+r->count) % AOF_REPLAY_RING] = b;
+        r->count++;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_lock(&r->lock);
+    r->done = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* Start parsing 'fp' from its current offset. */
+static void aofReplayStart(aofReplay *r, FILE *fp) {
+    r->fp = fp;
+    r->started = 1;
+    r->threaded = 0;
+    r->head = r->count = 0;
+    r->done = 0;
+    r->status = AOF_REPLAY_OK;
+    r->eof = r->err = 0;
+    r->block = NULL;
+    if (!server.aof_load_reader_thread) return;
+
+    pthread_mutex_init(&r->lock,NULL);
+    pthread_cond_init(&r->cond,NULL);
+    if (pthread_create(&r->thread,NULL,aofReplayThreadMain,r) != 0) {
+        serverLog(LL_WARNING,"Can't create the AOF loading thread, "
+                             "parsing the AOF in the main thread.");
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        return;
+    }
+    r->threaded = 1;
+}
+
+/* Return the next batch to execute, or NULL when the parsing stopped and
+ * all the batches were consumed: r->status tells why. */
+static aofReplayBatch *aofReplayNextBatch(aofReplay *r) {
+    aofReplayBatch *b = NULL;
+
+    if (!r->threaded) return aofReplayReadBatch(r);
+
+    pthread_mutex_lock(&r->lock);
+    while(r->count == 0 && !r->done)
+        pthread_cond_wait(&r->cond,&r->lock);
+    if (r->count) {
+        b = r->ring[r->head];
+        r->head = (r->head+1) % AOF_REPLAY_RING;
+        r->count--;
+        pthread_cond_signal(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return b;
+}
+
+/* Wait for the reader thread, if any, to exit. All the batches must have
+ * been consumed already. */
+static void aofReplayStop(aofReplay *r) {
+    if (!r->threaded) return;
+    pthread_join(r->thread,NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    r->threaded = 0;
+}
+
+/* Replay one of the files of the AOF. 'offset' is the amount of data
+ * loaded from the previous files, only used to report the loading progress.
+ * A short read at the end of the file is handled according to the
+ * 'aof-load-truncated' option only when 'last_file' is true, that is when
+ * no data follows in the next files: otherwise truncating it would drop
+ * commands from the middle of the log. On success C_OK is returned. On
  * fatal error an error message is logged and the program exists. */
 // 执行AOF文件中的命令
-// 成功返回C_OK，出现非致命错误返回C_ERR，例如AOF文件长度为0，出现致命错误打印日志退出
-int loadAppendOnlyFile(char *filename) {
+// 成功返回C_OK，出现致命错误打印日志退出
+static int loadSingleAppendOnlyFile(char *filename, off_t offset, int last_file) {
     struct client *fakeClient;
     FILE *fp = fopen(filename,"r");     //以读打开AOF文件
-    struct redis_stat sb;
-    int old_aof_state = server.aof_state;       //备份当前AOF的状态
+    aofReplay replay = {0};
+    aofReplayBatch *batch;
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of latest well-formed command loaded. */
     off_t valid_before_multi = 0; /* Offset before MULTI command loaded. */
 
     // 如果文件打开失败，打印日志，退出
     if (fp == NULL) {
-        serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
+        serverLog(LL_WARNING,"Fatal error: can't open the append log file %s for reading: %s",filename,strerror(errno));
         exit(1);
     }
 
-    /* Handle a zero-length AOF file as a special case. An empty AOF file
-     * is a valid AOF because an empty server with AOF enabled will create
-     * a zero length file at startup, that will remain like that if no write
-     * operation is received. */
-    // 如果文件打开，但是大小为0，则返回C_ERR
-    if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
-        server.aof_current_size = 0;
-        server.aof_fsync_offset = server.aof_current_size;
-        fclose(fp);
-        return C_ERR;
-    }
-
-    /* Temporarily disable AOF, to prevent EXEC from feeding a MULTI
-     * to the same file we're about to read. */
-    // 暂时关闭AOF，防止在执行MULTI时，EXEC命令被传播到AOF文件中
-    server.aof_state = AOF_OFF;
-
     // 生成一个伪client
     fakeClient = createAOFClient();
-    // 设置载入的状态信息
-    startLoadingFile(fp, filename, RDBFLAGS_AOF_PREAMBLE);
 
     /* Check if this AOF file has an RDB preamble. In that case we need to
      * load the RDB file and later continue loading the AOF tail. */
@@ -960,129 +1771,78 @@ int loadAppendOnlyFile(char *filename) {
         }
     }
 
-    /* Read the actual AOF file, in REPL format, command by command. */
-    while(1) {
-        int argc, j;
-        unsigned long len;
-        robj **argv;
-        char buf[128];
-        sds argsds;
-        struct redisCommand *cmd;
-
-        /* Serve the clients from time to time */
-        // 间隔性的处理client请求
-        if (!(loops++ % 1000)) {
-            // ftello(fp)返回当前文件载入的偏移量
-            // 设置载入时server的状态信息，更新当前载入的进度
-            loadingProgress(ftello(fp));
-            // 在服务器被阻塞的状态下，仍然能处理请求
-            // 因为当前处于载入状态，当client的请求到来时，总是返回loading的状态错误
-            processEventsWhileBlocked();
-            processModuleLoadingProgressEvent(1);
-        }
-
-        // 将一行文件内容读到buf中，遇到"\r\n"停止
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
-            if (feof(fp))   //如果文件已经读完了或数据库为空，则跳出while循环
-                break;
-            else
-                goto readerr;
-        }
-        // 检查文件格式 "*<argc>\r\n"
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        // 取出命令参数个数
-        argc = atoi(buf+1);
-        if (argc < 1) goto fmterr;  //至少一个参数，就是当前命令
-
-        /* Load the next command in the AOF as our fake client
-         * argv. */
-        // 分配参数列表空间
-        argv = zmalloc(sizeof(robj*)*argc);
-        // 设置伪client的参数列表
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-
-        // 遍历参数列表
-        // "$<command_len>\r\n<command>\r\n"
-        for (j = 0; j < argc; j++) {
-            /* Parse the argument len. */
-            char *readres = fgets(buf,sizeof(buf),fp);
-            // 读一行内容到buf中，遇到"\r\n"停止
-            if (readres == NULL || buf[0] != '$') {
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                if (readres == NULL)
-                    goto readerr;
-                else
-                    goto fmterr;
+    /* Read the actual AOF file, in REPL format, command by command. The
+     * commands are parsed in batches, by the reader thread if enabled. */
+    aofReplayStart(&replay,fp);
+    while((batch = aofReplayNextBatch(&replay)) != NULL) {
+        for (int i = 0; i < batch->count; i++) {
+            aofReplayCmd *rc = batch->cmds+i;
+            struct redisCommand *cmd;
+
+            /* Serve the clients from time to time */
+            // 间隔性的处理client请求
+            if (!(loops++ % 1000)) {
+                // 设置载入时server的状态信息，更新当前载入的进度
+                loadingProgress(offset+rc->end);
+                // 在服务器被阻塞的状态下，仍然能处理请求
+                // 因为当前处于载入状态，当client的请求到来时，总是返回loading的状态错误
+                processEventsWhileBlocked();
+                processModuleLoadingProgressEvent(1);
             }
 
-            // 读出参数的长度len
-            len = strtol(buf+1,NULL,10);
-
-            /* Read it into a string object. */
-            // 初始化一个len长度的sds
-            argsds = sdsnewlen(SDS_NOINIT,len);
-            // 从文件中读出一个len字节长度，将值保存到argsds中
-            if (len && fread(argsds,len,1,fp) == 0) {
-                sdsfree(argsds);
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
-            }
-            // 创建一个字符串对象保存读出的参数argsds
-            argv[j] = createObject(OBJ_STRING,argsds);
-
-            /* Discard CRLF. */
-            // 读两个字节，跳过"\r\n"
-            if (fread(buf,2,1,fp) == 0) {
-                fakeClient->argc = j+1; /* Free up to j. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
+            // 设置伪client的参数列表
+            fakeClient->argc = rc->argc;
+            fakeClient->argv = rc->argv;
+            rc->argv = NULL;
+
+            /* Command lookup */
+            // 查找命令
+            cmd = lookupCommand(fakeClient->argv[0]->ptr);
+            if (!cmd) {
+                serverLog(LL_WARNING,
+                    "Unknown command '%s' reading the append only file",
+                    (char*)fakeClient->argv[0]->ptr);
+                exit(1);
             }
-        }
 
-        /* Command lookup */
-        // 查找命令
-        cmd = lookupCommand(argv[0]->ptr);
-        if (!cmd) {
-            serverLog(LL_WARNING,
-                "Unknown command '%s' reading the append only file",
-                (char*)argv[0]->ptr);
-            exit(1);
-        }
+            if (cmd == server.multiCommand) valid_before_multi = valid_up_to;
 
-        if (cmd == server.multiCommand) valid_before_multi = valid_up_to;
+            /* Run the command in the context of a fake client */
+            fakeClient->cmd = fakeClient->lastcmd = cmd;
+            if (fakeClient->flags & CLIENT_MULTI &&
+                fakeClient->cmd->proc != execCommand)
+            {
+                queueMultiCommand(fakeClient);
+            } else {
+                cmd->proc(fakeClient);
+            }
 
-        /* Run the command in the context of a fake client */
-        fakeClient->cmd = fakeClient->lastcmd = cmd;
-        if (fakeClient->flags & CLIENT_MULTI &&
-            fakeClient->cmd->proc != execCommand)
-        {
-            queueMultiCommand(fakeClient);
-        } else {
-            cmd->proc(fakeClient);
+            /* The fake client should not have a reply */
+            // 伪client不应该有回复
+            serverAssert(fakeClient->bufpos == 0 &&
+                         listLength(fakeClient->reply) == 0);
+
+            /* The fake client should never get blocked */
+            // 伪client不应该是阻塞的
+            serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+
+            /* Clean up. Command code may have changed argv/argc so we use the
+             * argv/argc of the client instead of the local variables. */
+            // 释放伪client的参数列表
+            freeFakeClientArgv(fakeClient);
+            fakeClient->cmd = NULL;
+            // 更新已载入且命令合法的当前文件的偏移量
+            if (server.aof_load_truncated) valid_up_to = rc->end;
+            if (server.key_load_delay)
+                usleep(server.key_load_delay);
         }
-
-        /* The fake client should not have a reply */
-        // 伪client不应该有回复
-        serverAssert(fakeClient->bufpos == 0 &&
-                     listLength(fakeClient->reply) == 0);
-
-        /* The fake client should never get blocked */
-        // 伪client不应该是阻塞的
-        serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
-
-        /* Clean up. Command code may have changed argv/argc so we use the
-         * argv/argc of the client instead of the local variables. */
-        // 释放伪client的参数列表
-        freeFakeClientArgv(fakeClient);
-        fakeClient->cmd = NULL;
-        // 更新已载入且命令合法的当前文件的偏移量
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
-        if (server.key_load_delay)
-            usleep(server.key_load_delay);
+        aofReplayFreeBatch(batch);
+    }
+    aofReplayStop(&replay);
+    if (replay.status == AOF_REPLAY_FMTERR) goto fmterr;
+    if (replay.status == AOF_REPLAY_READERR) {
+        errno = replay.err;
+        goto readerr;
     }
 
     /* This point can only be reached when EOF is reached without errors.
@@ -1102,28 +1862,27 @@ int loadAppendOnlyFile(char *filename) {
 loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
     fclose(fp);     //关闭文件
     freeFakeClient(fakeClient);     //释放伪client
-    server.aof_state = old_aof_state;       //还原AOF状态
-    stopLoading(1);     //设置载入完成的状态
-    aofUpdateCurrentSize();     //更新服务器状态，当前AOF文件的大小
-    server.aof_rewrite_base_size = server.aof_current_size;     //更新重写的大小
-    server.aof_fsync_offset = server.aof_current_size;
     return C_OK;
 
 // 载入时读错误，如果feof(fp)为真，则直接执行 uxeof
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
-    if (!feof(fp)) {
+    if (!(replay.started ? replay.eof : feof(fp))) {
         // 退出前释放伪client的空间
         if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
         fclose(fp);
-        serverLog(LL_WARNING,"Unrecoverable error reading the append only file: %s", strerror(errno));
+        serverLog(LL_WARNING,"Unrecoverable error reading the append only file %s: %s", filename, strerror(errno));
         exit(1);
     }
 
 // 不被预期的AOF文件结束格式
 uxeof: /* Unexpected AOF end of file. */
     // 如果发现末尾结束格式不完整则自动截掉,成功加载前面正确的数据。
-    if (server.aof_load_truncated) {
-        serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
+    if (server.aof_load_truncated && !last_file) {
+        serverLog(LL_WARNING,"The AOF file %s is truncated but more data "
+            "follows in the next AOF files: it can't be truncated.",
+            filename);
+    } else if (server.aof_load_truncated) {
+        serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file %s !!!", filename);
         serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
             (unsigned long long) valid_up_to);
         // 截断文件到正确加载的位置
@@ -1151,7 +1910,7 @@ uxeof: /* Unexpected AOF end of file. */
     // 退出前释放伪client的空间
     if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
     fclose(fp);
-    serverLog(LL_WARNING,"Unexpected end of file reading the append only file. You can: 1) Make a backup of your AOF file, then use ./redis-check-aof --fix <filename>. 2) Alternatively you can set the 'aof-load-truncated' configuration option to yes and restart the server.");
+    serverLog(LL_WARNING,"Unexpected end of file reading the append only file %s. You can: 1) Make a backup of your AOF file, then use ./redis-check-aof --fix <filename>. 2) Alternatively you can set the 'aof-load-truncated' configuration option to yes and restart the server.", filename);
     exit(1);
 
 // 格式错误
@@ -1159,10 +1918,78 @@ fmterr: /* Format error. */
     // 退出前释放伪client的空间
     if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
     fclose(fp);
-    serverLog(LL_WARNING,"Bad file format reading the append only file: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>");
+    serverLog(LL_WARNING,"Bad file format reading the append only file %s: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>", filename);
     exit(1);
 }
 
+/* Load all the files of the AOF listed in 'am', base first. On success
+ * C_OK is returned. On non fatal error (the files are all zero-length)
+ * C_ERR is returned: an empty AOF is valid, since an empty server with AOF
+ * enabled creates a zero length incr file at startup, that will remain like
+ * that if no write operation is received. On fatal error an error message
+ * is logged and the program exists. */
+int loadAppendOnlyFiles(aofManifest *am) {
+    int old_aof_state = server.aof_state;   //备份当前AOF的状态
+    int numfiles = 0, j;
+    off_t total = 0, loaded = 0;
+    aofInfo **files;
+    off_t *sizes;
+    listIter li;
+    listNode *ln;
+
+    files = zmalloc(sizeof(aofInfo*)*(listLength(am->incr_aof_list)+1));
+    if (am->base_aof_info) files[numfiles++] = am->base_aof_info;
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) files[numfiles++] = listNodeValue(ln);
+
+    /* A missing file is fatal: silently skipping it would lose data. */
+    sizes = zmalloc(sizeof(off_t)*(numfiles+1));
+    for (j = 0; j < numfiles; j++) {
+        struct redis_stat sb;
+
+        if (redis_stat(files[j]->file_name,&sb) == -1) {
+            serverLog(LL_WARNING,"Fatal error: can't open the append log "
+                "file %s for reading: %s", files[j]->file_name,
+                strerror(errno));
+            exit(1);
+        }
+        sizes[j] = sb.st_size;
+        total += sb.st_size;
+    }
+
+    if (total == 0) {
+        server.aof_current_size = 0;
+        server.aof_last_incr_size = 0;
+        server.aof_fsync_offset = server.aof_current_size;
+        zfree(files);
+        zfree(sizes);
+        return C_ERR;
+    }
+
+    /* Temporarily disable AOF, to prevent EXEC from feeding a MULTI
+     * to the same file we're about to read. */
+    // 暂时关闭AOF，防止在执行MULTI时，EXEC命令被传播到AOF文件中
+    server.aof_state = AOF_OFF;
+    // 设置载入的状态信息
+    startLoading(total,RDBFLAGS_AOF_PREAMBLE);
+    for (j = 0; j < numfiles; j++) {
+        if (sizes[j] == 0) continue;
+        serverLog(LL_NOTICE,"Reading the AOF file %s...",
+            files[j]->file_name);
+        loadSingleAppendOnlyFile(files[j]->file_name,loaded,
+                                 total-loaded-sizes[j] == 0);
+        loaded += sizes[j];
+    }
+    server.aof_state = old_aof_state;       //还原AOF状态
+    stopLoading(1);     //设置载入完成的状态
+    aofUpdateCurrentSize();     //更新服务器状态，当前AOF文件的大小
+    server.aof_rewrite_base_size = server.aof_current_size;     //更新重写的大小
+    server.aof_fsync_offset = server.aof_current_size;
+    zfree(files);
+    zfree(sizes);
+    return C_OK;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -1185,6 +2012,42 @@ int rioWriteBulkObject(rio *r, robj *obj) {
     }
 }
 
+/* Emit the commands needed to rebuild a bitmap encoded string without
+ * making it flat: a SETBIT of the last bit to give the string its length,
+ * followed by BITFIELD commands setting the other bits.
+ * The function returns 0 on error, 1 on success. */
+int rewriteStringBitmapObject(rio *r, robj *key, robj *o) {
+    bitmapString *bs = o->ptr;
+    long long count = 0, items = roaringCard(bs->bits);
+    roaringIterator ri;
+    int64_t offset;
+
+    if (rioWriteBulkCount(r,'*',4) == 0) return 0;
+    if (rioWriteBulkString(r,"SETBIT",6) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    if (rioWriteBulkLongLong(r,(long long)bs->len*8-1) == 0) return 0;
+    if (rioWriteBulkLongLong(r,0) == 0) return 0;
+
+    roaringInitIterator(&ri,bs->bits);
+    while(roaringNext(&ri,&offset)) {
+        if (count == 0) {
+            int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                AOF_REWRITE_ITEMS_PER_CMD : items;
+
+            if (rioWriteBulkCount(r,'*',2+cmd_items*4) == 0) return 0;
+            if (rioWriteBulkString(r,"BITFIELD",8) == 0) return 0;
+            if (rioWriteBulkObject(r,key) == 0) return 0;
+        }
+        if (rioWriteBulkString(r,"SET",3) == 0) return 0;
+        if (rioWriteBulkString(r,"u1",2) == 0) return 0;
+        if (rioWriteBulkLongLong(r,offset) == 0) return 0;
+        if (rioWriteBulkLongLong(r,1) == 0) return 0;
+        if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+        items--;
+    }
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a list object.
  * The function returns 0 on error, 1 on success. */
 // 重建一个列表对象，将所需要的命令写到rio中，成功返回1，出错返回0
@@ -1262,6 +2125,24 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        roaringIterator ri;
+        int64_t llval;
+
+        roaringInitIterator(&ri,o->ptr);
+        while(roaringNext(&ri,&llval)) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0) return 0;
+                if (rioWriteBulkString(r,"SADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (rioWriteBulkLongLong(r,llval) == 0) return 0;
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
         // 集合对象编码类型为字典
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictIterator *di = dictGetIterator(o->ptr);
@@ -1345,7 +2226,9 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             items--;
         }
         // 有序集合对象编码类型为跳跃表
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+               o->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = o->ptr;
         dictIterator *di = dictGetIterator(zs->dict);
         dictEntry *de;
@@ -1354,7 +2237,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         while((de = dictNext(di)) != NULL) {
             // 获取成员对象和分值
             sds ele = dictGetKey(de);
-            double *score = dictGetVal(de);
+            double score = dictGetDoubleVal(de);
 
             // 第一次先构建一个 ZADD KEY
             if (count == 0) {
@@ -1366,7 +2249,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                 if (rioWriteBulkObject(r,key) == 0) return 0;
             }
             // 写入分值和成员对象
-            if (rioWriteBulkDouble(r,*score) == 0) return 0;
+            if (rioWriteBulkDouble(r,score) == 0) return 0;
             if (rioWriteBulkString(r,ele,sdslen(ele)) == 0) return 0;
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
@@ -1441,6 +2324,31 @@ int rewriteHashObject(rio *r, robj *key, robj *o) {
 
     hashTypeReleaseIterator(hi);
 
+    /* Fields having a TTL are followed by an absolute HPEXPIREAT each, so
+     * that the rewritten AOF does not depend on when it is loaded. */
+    dict *ttls = hashTypeGetExpires(o);
+    if (ttls) {
+        dictIterator *di = dictGetIterator(ttls);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            sds field = dictGetKey(de);
+
+            if (rioWriteBulkCount(r,'*',6) == 0 ||
+                rioWriteBulkString(r,"HPEXPIREAT",10) == 0 ||
+                rioWriteBulkObject(r,key) == 0 ||
+                rioWriteBulkLongLong(r,dictGetSignedIntegerVal(de)) == 0 ||
+                rioWriteBulkString(r,"FIELDS",6) == 0 ||
+                rioWriteBulkLongLong(r,1) == 0 ||
+                rioWriteBulkString(r,field,sdslen(field)) == 0)
+            {
+                dictReleaseIterator(di);
+                return 0;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+
     return 1;
 }
 
@@ -1461,14 +2369,13 @@ int rioWriteBulkStreamID(rio *r,streamID *id) {
 }
 
 /* Helper for rewriteStreamObject(): emit the XCLAIM needed in order to
- * add the message described by 'nack' having the id 'rawid', into the pending
+ * add the message described by 'nack', into the pending
  * list of the specified consumer. All this in the context of the specified
  * key and group. */
-int rioWriteStreamPendingEntry(rio *r, robj *key, const char *groupname, size_t groupname_len, streamConsumer *consumer, unsigned char *rawid, streamNACK *nack) {
+int rioWriteStreamPendingEntry(rio *r, robj *key, const char *groupname, size_t groupname_len, streamConsumer *consumer, streamNACK *nack) {
      /* XCLAIM <key> <group> <consumer> 0 <id> TIME <milliseconds-unix-time>
                RETRYCOUNT <count> JUSTID FORCE. */
-    streamID id;
-    streamDecodeID(rawid,&id);
+    streamID id = nack->id;
     if (rioWriteBulkCount(r,'*',12) == 0) return 0;
     if (rioWriteBulkString(r,"XCLAIM",6) == 0) return 0;
     if (rioWriteBulkObject(r,key) == 0) return 0;
@@ -1582,23 +2489,23 @@ int rewriteStreamObject(rio *r, robj *key, robj *o) {
                 streamConsumer *consumer = ri_cons.data;
                 /* For the current consumer, iterate all the PEL entries
                  * to emit the XCLAIM protocol. */
-                raxIterator ri_pel;
-                raxStart(&ri_pel,consumer->pel);
-                raxSeek(&ri_pel,"^",NULL,0);
-                while(raxNext(&ri_pel)) {
-                    streamNACK *nack = ri_pel.data;
+                streamPELIterator it_pel;
+                streamID *pelid;
+                streamPELIteratorStart(&it_pel,consumer->pel,NULL);
+                while((pelid = streamPELIteratorNext(&it_pel)) != NULL) {
+                    streamNACK *nack = streamPELFind(group->pel,pelid);
                     if (rioWriteStreamPendingEntry(r,key,(char*)ri.key,
                                                    ri.key_len,consumer,
-                                                   ri_pel.key,nack) == 0)
+                                                   nack) == 0)
                     {
-                        raxStop(&ri_pel);
+                        streamPELIteratorStop(&it_pel);
                         raxStop(&ri_cons);
                         raxStop(&ri);
                         streamIteratorStop(&si);
                         return 0;
                     }
                 }
-                raxStop(&ri_pel);
+                streamPELIteratorStop(&it_pel);
             }
             raxStop(&ri_cons);
         }
@@ -1625,25 +2532,9 @@ int rewriteModuleObject(rio *r, robj *key, robj *o) {
     return io.error ? 0 : 1;
 }
 
-/* This function is called by the child rewriting the AOF file to read
- * the difference accumulated from the parent into a buffer, that is
- * concatenated at the end of the rewrite. */
-ssize_t aofReadDiffFromParent(void) {
-    char buf[65536]; /* Default pipe buffer size on most Linux systems. */
-    ssize_t nread, total = 0;
-
-    while ((nread =
-            read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
-        server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
-        total += nread;
-    }
-    return total;
-}
-
 int rewriteAppendOnlyFileRio(rio *aof) {
     dictIterator *di = NULL;
     dictEntry *de;
-    size_t processed = 0;
     int j;
 
     for (j = 0; j < server.dbnum; j++) {
@@ -1670,7 +2561,11 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             expiretime = getExpire(db,&key);
 
             /* Save the key and associated value */
-            if (o->type == OBJ_STRING) {
+            if (o->type == OBJ_STRING &&
+                o->encoding == OBJ_ENCODING_BITMAP)
+            {
+                if (rewriteStringBitmapObject(aof,&key,o) == 0) goto werr;
+            } else if (o->type == OBJ_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
                 if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
@@ -1699,11 +2594,6 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rioWriteBulkObject(aof,&key) == 0) goto werr;
                 if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
             }
-            /* Read some diff from the parent process from time to time. */
-            if (aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES) {
-                processed = aof->processed_bytes;
-                aofReadDiffFromParent();
-            }
         }
         dictReleaseIterator(di);
         di = NULL;
@@ -1729,7 +2619,6 @@ int rewriteAppendOnlyFile(char *filename) {
     rio aof;
     FILE *fp = NULL;
     char tmpfile[256];
-    char byte;
 
     /* Note that we have to use a different temp name here compared to the
      * one used by rewriteAppendOnlyFileBackground() function. */
@@ -1742,8 +2631,6 @@ int rewriteAppendOnlyFile(char *filename) {
         return C_ERR;
     }
 
-    // 设置一个空sds给 保存子进程AOF时差异累计数据的sds
-    server.aof_child_diff = sdsempty();
     // 初始化rio为文件io对象
     rioInitWithFile(&aof,fp);
 
@@ -1765,63 +2652,6 @@ int rewriteAppendOnlyFile(char *filename) {
         if (rewriteAppendOnlyFileRio(&aof) == C_ERR) goto werr;
     }
 
-    /* Do an initial slow fsync here while the parent is still sending
-     * data, in order to make the next final fsync faster. */
-    // 当父进程仍然在发送数据时，先执行一个缓慢的同步，以便下一次最中的同步更快
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
-
-    /* Read again a few times to get more data from the parent.
-     * We can't read forever (the server may receive data from clients
-     * faster than it is able to send data to the child), so we try to read
-     * some more data in a loop as soon as there is a good chance more data
-     * will come. If it looks like we are wasting time, we abort (this
-     * happens after 20 ms without new data). */
-    // 再次从父进程读取几次数据，以获得更多的数据，我们无法一直读取，因为服务器从client接受的数据总是比发送给子进程要快，所以当数据来临的时候，我们尝试从在循环中多次读取。
-    // 如果在20ms之内没有新的数据到来，那么我们终止读取
-    int nodata = 0;
-    mstime_t start = mstime();  //读取的开始时间
-    // 在20ms之内等待数据到来
-    while(mstime()-start < 1000 && nodata < 20) {
-        // 在1ms之内，查看从父进程读数据的fd是否变成可读的，若不可读则aeWait()函数返回0
-        if (aeWait(server.aof_pipe_read_data_from_parent, AE_READABLE, 1) <= 0)
-        {
-            nodata++;   //更新新数据到来的时间，超过20ms则退出while循环
-            continue;
-        }
-        // 当管道的读端可读时，清零nodata
-        nodata = 0; /* Start counting from zero, we stop on N *contiguous*
-                       timeouts. */
-        // 从父进程累计写入的缓冲区的差异，在重写结束时链接到文件的结尾
-        aofReadDiffFromParent();
-    }
-
-    /* Ask the master to stop sending diffs. */
-    // 请求父进程停止发送累计差异数据
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
-    // 将从父进程读ack的fd设置为非阻塞模式
-    if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
-    /* We read the ACK from the server using a 10 seconds timeout. Normally
-     * it should reply ASAP, but just in case we lose its reply, we are sure
-     * the child will eventually get terminated. */
-    // 在5000ms之内，从fd读1个字节的数据保存在byte中，查看byte是否是'!'
-    if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
-    serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
-
-    /* Read the final diff if any. */
-    // 最后一次从父进程累计写入的缓冲区的差异
-    aofReadDiffFromParent();
-
-    /* Write the received diff to the file. */
-    serverLog(LL_NOTICE,
-        "Concatenating %.2f MB of AOF diff received from parent.",
-        (double) sdslen(server.aof_child_diff) / (1024*1024));
-    // 将子进程aof_child_diff中保存的差异数据写到AOF文件中
-    if (rioWrite(&aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
-        goto werr;
-
     /* Make sure data will not remain on the OS's output buffers */
     // 再次冲洗文件缓冲区，执行同步操作
     if (fflush(fp)) goto werr;
@@ -1851,125 +2681,50 @@ werr:
     return C_ERR;
 }
 
-/* ----------------------------------------------------------------------------
- * AOF rewrite pipes for IPC
- * -------------------------------------------------------------------------- */
-// AOF重写管道的进程间通信
-
-/* This event handler is called when the AOF rewriting child sends us a
- * single '!' char to signal we should stop sending buffer diffs. The
- * parent sends a '!' as well to acknowledge. */
-// 当AOF重写的子进程发送一个'!'字符信号，调用这个事件处理程序，告知我们应该停止发送缓冲区差异数据
-// 父进程也发送给一个'!'字符信号去告知收到。
-void aofChildPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
-    char byte;
-    UNUSED(el);
-    UNUSED(privdata);
-    UNUSED(mask);
-
-    // 从fd中读一个字节的数据，且是'!'字符信号
-    if (read(fd,&byte,1) == 1 && byte == '!') {
-        //打印日志
-        serverLog(LL_NOTICE,"AOF rewrite child asks to stop sending diffs.");
-        // 停止发送累计的不同数据给子进程标志设置为真
-        server.aof_stop_sending_diff = 1;
-        // 应答给子进程一个'!'字符信号
-        if (write(server.aof_pipe_write_ack_to_child,"!",1) != 1) {
-            /* If we can't send the ack, inform the user, but don't try again
-             * since in the other side the children will use a timeout if the
-             * kernel can't buffer our write, or, the children was
-             * terminated. */
-            serverLog(LL_WARNING,"Can't send ACK to AOF child: %s",
-                strerror(errno));
-        }
-    }
-    /* Remove the handler since this can be called only one time during a
-     * rewrite. */
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-}
-
-/* Create the pipes used for parent - child process IPC during rewrite.
- * We have a data pipe used to send AOF incremental diffs to the child,
- * and two other pipes used by the children to signal it finished with
- * the rewrite so no more data should be written, and another for the
- * parent to acknowledge it understood this new condition. */
-// 在重写期间创建一个用来在父子进程通信的管道。有一个数据管道用于子进程发送AOF增量差异，另外两个由子进程使用完成重写操作，所以不应该写入更多的数据，另一个用于父进程发送ack应答信号取确认这个新条件。
-int aofCreatePipes(void) {
-    int fds[6] = {-1, -1, -1, -1, -1, -1};
-    int j;
-
-    if (pipe(fds) == -1) goto error; /* parent -> children data. */
-    if (pipe(fds+2) == -1) goto error; /* children -> parent ack. */
-    if (pipe(fds+4) == -1) goto error; /* parent -> children ack. */
-    /* Parent -> children data is non blocking. */
-    // 将两条发送数据管道设置为非阻塞模式
-    if (anetNonBlock(NULL,fds[0]) != ANET_OK) goto error;
-    if (anetNonBlock(NULL,fds[1]) != ANET_OK) goto error;
-    // 监听aof_pipe_read_ack_from_child的状态，如果可读，则调用aofChildPipeReadable
-    if (aeCreateFileEvent(server.el, fds[2], AE_READABLE, aofChildPipeReadable, NULL) == AE_ERR) goto error;
-
-    server.aof_pipe_write_data_to_child = fds[1];
-    server.aof_pipe_read_data_from_parent = fds[0];
-    server.aof_pipe_write_ack_to_parent = fds[3];
-    server.aof_pipe_read_ack_from_child = fds[2];
-    server.aof_pipe_write_ack_to_child = fds[5];
-    server.aof_pipe_read_ack_from_parent = fds[4];
-    // 停止发送累计的不同数据给子进程标志设置为假
-    server.aof_stop_sending_diff = 0;
-    return C_OK;
-
-// 错误处理，关闭fd
-error:
-    serverLog(LL_WARNING,"Error opening /setting AOF rewrite IPC pipes: %s",
-        strerror(errno));
-    for (j = 0; j < 6; j++) if(fds[j] != -1) close(fds[j]);
-    return C_ERR;
-}
-
-// 关闭所有管道
-void aofClosePipes(void) {
-    // 将aof_pipe_read_ack_from_child和aof_pipe_write_data_to_child从监听的队列中删除
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-    aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,AE_WRITABLE);
-    // 关闭所有fd
-    close(server.aof_pipe_write_data_to_child);
-    close(server.aof_pipe_read_data_from_parent);
-    close(server.aof_pipe_write_ack_to_parent);
-    close(server.aof_pipe_read_ack_from_child);
-    close(server.aof_pipe_write_ack_to_child);
-    close(server.aof_pipe_read_ack_from_parent);
-}
-
 /* ----------------------------------------------------------------------------
  * AOF background rewrite
  * ------------------------------------------------------------------------- */
 
+/* Whether the running rewrite child writes an RDB preamble, used to name
+ * the new base file. */
+static int aof_rewrite_rdb_preamble = 0;
+
 /* This is how rewriting of the append only file in background works:
  *
  * 1) The user calls BGREWRITEAOF
- * 2) Redis calls this function, that forks():
+ * 2) Redis calls this function, that opens a new incr file, so that the
+ *    writes from now on are appended to it, and forks():
  *    2a) the child rewrite the append only file in a temp file.
- *    2b) the parent accumulates differences in server.aof_rewrite_buf.
+ *    2b) the parent appends the new writes to the new incr file.
  * 3) When the child finished '2a' exists.
- * 4) The parent will trap the exit code, if it's OK, will append the
- *    data accumulated into server.aof_rewrite_buf into the temp file, and
- *    finally will rename(2) the temp file in the actual file name.
- *    The the new file is reopened as the new append only file. Profit!
+ * 4) The parent will trap the exit code, if it's OK, will rename(2) the
+ *    temp file as the new base, and switch the manifest to the new base
+ *    followed by the new incr file. The previous files are deleted. Profit!
  */
 // 以下是BGREWRITEAOF的工作步骤
 // 1. 用户调用BGREWRITEAOF
-// 2. Redis调用这个函数，它执行fork()
+// 2. Redis调用这个函数，它打开一个新的增量文件，然后执行fork()
 //      2.1 子进程在临时文件中执行重写操作
-//      2.2 父进程将累计的差异数据追加到server.aof_rewrite_buf中
+//      2.2 父进程将新的写命令追加到新的增量文件中
 // 3. 当子进程完成2.1
-// 4. 父进程会捕捉到子进程的退出码，如果是OK，那么追加累计的差异数据到临时文件，并且对临时文件rename，用它代替旧的AOF文件，然后就完成AOF的重写。
+// 4. 父进程会捕捉到子进程的退出码，如果是OK，那么将临时文件rename为新的基础文件，并更新manifest，然后就完成AOF的重写。
 int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
 
     // 如果正在进行重写或正在进行RDB持久化操作，则返回C_ERR
     if (hasActiveChildProcess()) return C_ERR;
-    // 创建父子进程间通信的管道
-    if (aofCreatePipes() != C_OK) return C_ERR;
+    if (server.aof_state != AOF_OFF) {
+        /* What is still in the AOF buffer belongs to the current incr
+         * file, that must not start with a partial command. */
+        flushAppendOnlyFile(1);
+        if (sdslen(server.aof_buf)) {
+            serverLog(LL_WARNING,"Can't rewrite the append only file while "
+                "the AOF buffer can't be written on disk.");
+            return C_ERR;
+        }
+        if (openNewIncrAofForAppend() == C_ERR) return C_ERR;
+    }
+    aof_rewrite_rdb_preamble = server.aof_use_rdb_preamble;
     //打开父子间通讯的通道
     openChildInfoPipe();
     if ((childpid = redisFork(CHILD_TYPE_AOF)) == 0) {
@@ -1992,7 +2747,6 @@ int rewriteAppendOnlyFileBackground(void) {
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
             return C_ERR;
         }
         serverLog(LL_NOTICE,
@@ -2001,9 +2755,9 @@ int rewriteAppendOnlyFileBackground(void) {
         server.aof_rewrite_time_start = time(NULL);
         server.aof_child_pid = childpid;
         /* We set appendseldb to -1 in order to force the next call to the
-         * feedAppendOnlyFile() to issue a SELECT command, so the differences
-         * accumulated by the parent into server.aof_rewrite_buf will start
-         * with a SELECT statement and it will be safe to merge. */
+         * feedAppendOnlyFile() to issue a SELECT command, so the new incr
+         * file will start with a SELECT statement and it will be safe to
+         * load it after the new base. */
         server.aof_selected_db = -1;
         replicationScriptCacheFlush();
         return C_OK;
@@ -2041,23 +2795,38 @@ void aofRemoveTempFile(pid_t childpid) {
 }
 
 /* Update the server.aof_current_size field explicitly using stat(2)
- * to check the size of the file. This is useful after a rewrite or after
+ * to check the size of the files listed in the manifest, and the size
+ * of the incr file being appended. This is useful after a rewrite or after
  * a restart, normally the size is updated just adding the write length
  * to the current length, that is much faster. */
 // 更新AOF文件的当前的大小，记录到服务器状态中，用于BGREWRITEAOF执行后，或服务器重启时
 void aofUpdateCurrentSize(void) {
+    aofManifest *am = server.aof_manifest;
     struct redis_stat sb;
     mstime_t latency;
+    off_t size = 0;
+    listIter li;
+    listNode *ln;
 
     // 设置延迟检测开始的时间
     latencyStartMonitor(latency);
+    if (am->base_aof_info)
+        size += getAppendOnlyFileSize(am->base_aof_info->file_name);
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = listNodeValue(ln);
+        size += getAppendOnlyFileSize(ai->file_name);
+    }
+    // 更新AOF文件的大小
+    server.aof_current_size = size;
     // 读取AOF文件的信息到sb中
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
-        serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
-            strerror(errno));
-    } else {
-        // 更新AOF文件的大小
-        server.aof_current_size = sb.st_size;
+    if (server.aof_fd != -1) {
+        if (redis_fstat(server.aof_fd,&sb) == -1) {
+            serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
+                strerror(errno));
+        } else {
+            server.aof_last_incr_size = sb.st_size;
+        }
     }
     // 设置延迟的时间 = 当前的时间 - 开始的时间
     latencyEndMonitor(latency);
@@ -2071,98 +2840,62 @@ void aofUpdateCurrentSize(void) {
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     // 子进程正常退出
     if (!bysignal && exitcode == 0) {
-        int newfd, oldfd;
+        aofManifest *old_am = server.aof_manifest, *new_am;
+        sds base_name, incr_name = NULL, temp_incr_name = NULL;
+        aofInfo *keep = NULL;
         char tmpfile[256];
         long long now = ustime();
         mstime_t latency;
+        listIter li;
+        listNode *ln;
 
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
 
-        /* Flush the differences accumulated by the parent to the
-         * rewritten AOF. */
+        /* The new base replaces the old base and all the incr files, but
+         * the one opened when the rewrite started, that received the writes
+         * performed after the fork. While the AOF is being turned on such
+         * writes are in the temp incr file, that becomes a regular one. */
+        new_am = aofManifestCreate();
+        new_am->curr_base_file_seq = old_am->curr_base_file_seq;
+        new_am->curr_incr_file_seq = old_am->curr_incr_file_seq;
+        base_name = aofManifestSetNewBase(new_am,aof_rewrite_rdb_preamble);
+        if (server.aof_state == AOF_WAIT_REWRITE) {
+            temp_incr_name = getTempIncrAofFileName();
+            incr_name = aofManifestAddNewIncr(new_am);
+        } else if (server.aof_fd != -1) {
+            keep = listNodeValue(listLast(old_am->incr_aof_list));
+            listAddNodeTail(new_am->incr_aof_list,aofInfoDup(keep));
+        }
+
         // 设置延迟检测开始的时间
         latencyStartMonitor(latency);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
             (int)server.aof_child_pid);
-        // 打开临时文件，追加写入
-        newfd = open(tmpfile,O_WRONLY|O_APPEND);
-        if (newfd == -1) {
+        if (rename(tmpfile,base_name) == -1) {
             serverLog(LL_WARNING,
-                "Unable to open the temporary AOF produced by the child: %s", strerror(errno));
+                "Error trying to rename the temporary AOF file %s into %s: %s",
+                tmpfile, base_name, strerror(errno));
+            aofManifestFree(new_am);
+            sdsfree(temp_incr_name);
             goto cleanup;
         }
-
-        // 将缓冲区的数据追加写到制定的文件描述符fd中，成功返回写入的字节数，否则返回-1
-        if (aofRewriteBufferWrite(newfd) == -1) {
+        if (temp_incr_name && rename(temp_incr_name,incr_name) == -1) {
             serverLog(LL_WARNING,
-                "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
-            close(newfd);
+                "Error trying to rename the temporary AOF file %s into %s: %s",
+                temp_incr_name, incr_name, strerror(errno));
+            bg_unlink(base_name);
+            aofManifestFree(new_am);
+            sdsfree(temp_incr_name);
             goto cleanup;
         }
-        // 设置延迟的时间 = 当前的时间 - 开始的时间
-        latencyEndMonitor(latency);
-        // latency超过设置的latency_monitor_threshold阀值
-        // 则将latency和"aof-rewrite-diff-write"关联到延迟诊断字典中
-        latencyAddSampleIfNeeded("aof-rewrite-diff-write",latency);
-
-        serverLog(LL_NOTICE,
-            "Residual parent diff successfully flushed to the rewritten AOF (%.2f MB)", (double) aofRewriteBufferSize() / (1024*1024));
-
-        /* The only remaining thing to do is to rename the temporary file to
-         * the configured file and switch the file descriptor used to do AOF
-         * writes. We don't want close(2) or rename(2) calls to block the
-         * server on old file deletion.
-         *
-         * There are two possible scenarios:
-         *
-         * 1) AOF is DISABLED and this was a one time rewrite. The temporary
-         * file will be renamed to the configured file. When this file already
-         * exists, it will be unlinked, which may block the server.
-         *
-         * 2) AOF is ENABLED and the rewritten AOF will immediately start
-         * receiving writes. After the temporary file is renamed to the
-         * configured file, the original AOF file descriptor will be closed.
-         * Since this will be the last reference to that file, closing it
-         * causes the underlying file to be unlinked, which may block the
-         * server.
-         *
-         * To mitigate the blocking effect of the unlink operation (either
-         * caused by rename(2) in scenario 1, or by close(2) in scenario 2), we
-         * use a background thread to take care of this. First, we
-         * make scenario 1 identical to scenario 2 by opening the target file
-         * when it exists. The unlink operation after the rename(2) will then
-         * be executed upon calling close(2) for its descriptor. Everything to
-         * guarantee atomicity for this switch has already happened by then, so
-         * we don't care what the outcome or duration of that close operation
-         * is, as long as the file descriptor is released again. */
-        // 如果AOF已经完成，被设置为关闭状态
-        if (server.aof_fd == -1) {
-            /* AOF disabled */
-
-            /* Don't care if this fails: oldfd will be -1 and we handle that.
-             * One notable case of -1 return is if the old file does
-             * not exist. */
-            // 重新非阻塞打开AOF文件，防止rename是阻塞服务器，因为rename会unlink原来的临时文件
-            oldfd = open(server.aof_filename,O_RDONLY|O_NONBLOCK);
-        } else {
-            /* AOF enabled */
-            oldfd = -1; /* We'll set this to the current AOF filedes later. */
-        }
-
-        /* Rename the temporary file. This will not unlink the target file if
-         * it exists, because we reference it with "oldfd". */
-        // 设置延迟检测开始的时间
-        latencyStartMonitor(latency);
-        // 设置AOF文件的名字，替换现有的AOF文件
-        if (rename(tmpfile,server.aof_filename) == -1) {
-            serverLog(LL_WARNING,
-                "Error trying to rename the temporary AOF file %s into %s: %s",
-                tmpfile,
-                server.aof_filename,
-                strerror(errno));
-            close(newfd);
-            if (oldfd != -1) close(oldfd);
+        /* Until the new manifest is in place the old one is still the
+         * valid description of the AOF: on error just undo the renames. */
+        if (persistAofManifest(new_am) == C_ERR) {
+            bg_unlink(base_name);
+            if (temp_incr_name) rename(incr_name,temp_incr_name);
+            aofManifestFree(new_am);
+            sdsfree(temp_incr_name);
             goto cleanup;
         }
         // 设置延迟的时间 = 当前的时间 - 开始的时间
@@ -2170,35 +2903,25 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         // latency超过设置的latency_monitor_threshold阀值
         // 则将latency和"aof-rename"关联到延迟诊断字典中
         latencyAddSampleIfNeeded("aof-rename",latency);
+        sdsfree(temp_incr_name);
+
+        /* Delete the files replaced by the new base. This is done in
+         * background since unlinking big files may block the server. */
+        if (old_am->base_aof_info) bg_unlink(old_am->base_aof_info->file_name);
+        listRewind(old_am->incr_aof_list,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            aofInfo *ai = listNodeValue(ln);
+            if (ai != keep) bg_unlink(ai->file_name);
+        }
+        aofManifestFree(old_am);
+        server.aof_manifest = new_am;
 
-        // 如果AOF已经完成，被设置为关闭状态，直接关闭打开的临时文件
-        if (server.aof_fd == -1) {
-            /* AOF disabled, we don't need to set the AOF file descriptor
-             * to this new file, so we can close it. */
-            close(newfd);
-        } else {
-            // 如果AOF没有完成，用新的AOF文件fd替换原来的AOF文件fd
-            /* AOF enabled, replace the old fd with the new one. */
-            oldfd = server.aof_fd;
-            server.aof_fd = newfd;
-            // 根据同步策略，进行同步，因为之前做了一个追加新命令到重写缓冲区
-            if (server.aof_fsync == AOF_FSYNC_ALWAYS)
-                redis_fsync(newfd);
-            else if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
-                aof_background_fsync(newfd);
-            // 强制引发select
-            server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+        if (server.aof_fd != -1) {
             // 更新AOF文件的当前的大小，记录到服务器状态中，用于BGREWRITEAOF执行后，或服务器重启时
             aofUpdateCurrentSize();
             // 更新当前的重新的大小
             server.aof_rewrite_base_size = server.aof_current_size;
             server.aof_fsync_offset = server.aof_current_size;
-
-            /* Clear regular AOF buffer since its contents was just written to
-             * the new AOF from the background rewrite buffer. */
-            // 清空AOF缓存
-            sdsfree(server.aof_buf);
-            server.aof_buf = sdsempty();
         }
 
         // 更新最近一次执行BGREWRITEAOF的状态为C_OK
@@ -2210,10 +2933,6 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         if (server.aof_state == AOF_WAIT_REWRITE)
             server.aof_state = AOF_ON;
 
-        /* Asynchronously close the overwritten AOF. */
-        // 异步关闭旧的AOF文件
-        if (oldfd != -1) bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,NULL,NULL);
-
         serverLog(LL_VERBOSE,
             "Background AOF rewrite signal handler took %lldus", ustime()-now);
         // 如果子进程执行BGREWRITEAOF错误退出
@@ -2236,8 +2955,6 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
 
 // 清空代码
 cleanup:
-    aofClosePipes();
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.aof_child_pid);
     server.aof_child_pid = -1;
     server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
@@ -198,7 +198,16 @@ void *bioProcessBackgroundJobs(void *arg) {
         if (type == BIO_CLOSE_FILE) {
             close((long)job->arg1);
         } else if (type == BIO_AOF_FSYNC) {
-            redis_fsync((long)job->arg1);
+            /* arg2 is the AOF offset covered by this fsync, arg3 is set
+             * when the file gets no more writes and must be closed. */
+            if (redis_fsync((long)job->arg1) == 0)
+                aofSetFsyncedOffset((long)job->arg2);
+            if (job->arg3) close((long)job->arg1);
+            /* Awake the event loop, WAITAOF clients may be served now. */
+            if (write(server.aof_fsync_pipe[1],"A",1) != 1) {
+                /* Ignore the error, the pipe is full so the event loop
+                 * is going to be awaken anyway. */
+            }
         } else if (type == BIO_LAZY_FREE) {
             /* What we free changes depending on what arguments are set:
              * arg1 -> free the object at pointer.
@@ -30,10 +30,146 @@
 
 #include "server.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* -----------------------------------------------------------------------------
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
+/* The bit counting, bit searching and BITOP loops have AVX2 and AVX-512
+ * versions, compiled with the target attribute and selected at runtime
+ * according to the CPU features, so that the same binary runs everywhere.
+ * They only process whole vectors: the remaining bytes are handled by the
+ * scalar code, so the results are the same whatever path is taken. */
+#define BITOPS_SIMD_NONE 0
+#define BITOPS_SIMD_AVX2 1
+#define BITOPS_SIMD_AVX512 2
+
+static int bitops_simd = -1; /* Detected on first use. */
+
+static int bitopsSimdLevel(void) {
+    if (bitops_simd == -1) {
+        bitops_simd = BITOPS_SIMD_NONE;
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw"))
+            bitops_simd = BITOPS_SIMD_AVX512;
+        else if (__builtin_cpu_supports("avx2"))
+            bitops_simd = BITOPS_SIMD_AVX2;
+#endif
+    }
+    return bitops_simd;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Count the bits set in the 'len' bytes at 'p', 'len' being a multiple of
+ * the vector size. The count of every nibble is looked up with a byte
+ * shuffle and accumulated in 8 bit counters, that are summed into 64 bit
+ * counters every 31 vectors, before they can overflow. */
+__attribute__((target("avx2")))
+static uint64_t popcountAVX2(const unsigned char *p, size_t len) {
+    const __m256i lookup = _mm256_setr_epi8(
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t i = 0;
+
+    while (i < len) {
+        __m256i acc = zero;
+        size_t end = i + 31*32;
+        if (end > len) end = len;
+        for (; i < end; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p+i));
+            __m256i lo = _mm256_and_si256(v,mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4),mask);
+            acc = _mm256_add_epi8(acc,_mm256_shuffle_epi8(lookup,lo));
+            acc = _mm256_add_epi8(acc,_mm256_shuffle_epi8(lookup,hi));
+        }
+        total = _mm256_add_epi64(total,_mm256_sad_epu8(acc,zero));
+    }
+    return (uint64_t)_mm256_extract_epi64(total,0) +
+           (uint64_t)_mm256_extract_epi64(total,1) +
+           (uint64_t)_mm256_extract_epi64(total,2) +
+           (uint64_t)_mm256_extract_epi64(total,3);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t popcountAVX512(const unsigned char *p, size_t len) {
+    const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4));
+    const __m512i mask = _mm512_set1_epi8(0x0f);
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i total = zero;
+    size_t i = 0;
+
+    while (i < len) {
+        __m512i acc = zero;
+        size_t end = i + 31*64;
+        if (end > len) end = len;
+        for (; i < end; i += 64) {
+            __m512i v = _mm512_loadu_si512((const void*)(p+i));
+            __m512i lo = _mm512_and_si512(v,mask);
+            __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v,4),mask);
+            acc = _mm512_add_epi8(acc,_mm512_shuffle_epi8(lookup,lo));
+            acc = _mm512_add_epi8(acc,_mm512_shuffle_epi8(lookup,hi));
+        }
+        total = _mm512_add_epi64(total,_mm512_sad_epu8(acc,zero));
+    }
+    return (uint64_t)_mm512_reduce_add_epi64(total);
+}
+
+/* Return how many bytes at the start of the 'len' bytes at 'p' are all
+ * equal to 'skipval', in multiples of the vector size. */
+__attribute__((target("avx2")))
+static size_t bitposSkipAVX2(const unsigned char *p, size_t len, unsigned char skipval) {
+    const __m256i skip = _mm256_set1_epi8((char)skipval);
+    size_t i = 0;
+
+    while (i+128 <= len) {
+        __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p+i)),skip);
+        __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p+i+32)),skip);
+        __m256i c = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p+i+64)),skip);
+        __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p+i+96)),skip);
+        a = _mm256_or_si256(_mm256_or_si256(a,b),_mm256_or_si256(c,d));
+        if (!_mm256_testz_si256(a,a)) break;
+        i += 128;
+    }
+    while (i+32 <= len) {
+        __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p+i)),skip);
+        if (!_mm256_testz_si256(a,a)) break;
+        i += 32;
+    }
+    return i;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t bitposSkipAVX512(const unsigned char *p, size_t len, unsigned char skipval) {
+    const __m512i skip = _mm512_set1_epi8((char)skipval);
+    size_t i = 0;
+
+    while (i+256 <= len) {
+        __m512i a = _mm512_xor_si512(_mm512_loadu_si512((const void*)(p+i)),skip);
+        __m512i b = _mm512_xor_si512(_mm512_loadu_si512((const void*)(p+i+64)),skip);
+        __m512i c = _mm512_xor_si512(_mm512_loadu_si512((const void*)(p+i+128)),skip);
+        __m512i d = _mm512_xor_si512(_mm512_loadu_si512((const void*)(p+i+192)),skip);
+        a = _mm512_or_si512(_mm512_or_si512(a,b),_mm512_or_si512(c,d));
+        if (_mm512_test_epi64_mask(a,a)) break;
+        i += 256;
+    }
+    while (i+64 <= len) {
+        __m512i a = _mm512_xor_si512(_mm512_loadu_si512((const void*)(p+i)),skip);
+        if (_mm512_test_epi64_mask(a,a)) break;
+        i += 64;
+    }
+    return i;
+}
+#endif
+
 /* Count number of bits set in the binary array pointed by 's' and long
  * 'count' bytes. The implementation of this function is required to
  * work with an input string length up to 512 MB. */
@@ -43,6 +179,23 @@ size_t redisPopcount(void *s, long count) {
     uint32_t *p4;
     static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
+#ifdef HAVE_X86_SIMD
+    /* Count most of the bits with the vector kernels if available. */
+    if (count >= 64) {
+        int simd = bitopsSimdLevel();
+        long len = 0;
+        if (simd == BITOPS_SIMD_AVX512) {
+            len = count & ~63L;
+            bits = popcountAVX512(p,len);
+        } else if (simd == BITOPS_SIMD_AVX2) {
+            len = count & ~31L;
+            bits = popcountAVX2(p,len);
+        }
+        p += len;
+        count -= len;
+    }
+#endif
+
     /* Count initial bytes not aligned to 32 bit. */
     while((unsigned long)p & 3 && count) {
         bits += bitsinbyte[*p++];
@@ -132,6 +285,21 @@ long redisBitpos(void *s, unsigned long count, int bit) {
     /* Skip bits with full word step. */
     l = (unsigned long*) c;
     if (!found) {
+#ifdef HAVE_X86_SIMD
+        /* Skip most of the bytes with the vector kernels if available:
+         * they skip whole vectors, so 'l' is still aligned. */
+        if (count >= 128) {
+            int simd = bitopsSimdLevel();
+            size_t skipped = 0;
+            if (simd == BITOPS_SIMD_AVX512)
+                skipped = bitposSkipAVX512(c,count,skipval);
+            else if (simd == BITOPS_SIMD_AVX2)
+                skipped = bitposSkipAVX2(c,count,skipval);
+            l = (unsigned long*) (c+skipped);
+            count -= skipped;
+            pos += skipped*8;
+        }
+#endif
         skipval = bit ? 0 : ULONG_MAX;
         while (count >= sizeof(*l)) {
             if (*l != skipval) break;
@@ -390,6 +558,157 @@ void printBits(unsigned char *p, unsigned long count) {
     printf("\n");
 }
 
+/* -----------------------------------------------------------------------------
+ * Bitmap encoded strings.
+ *
+ * A string created or grown by the bit commands that has few bits set is
+ * encoded as a roaring bitmap of the offsets of its bits set, see the
+ * bitmapString structure, so that a single SETBIT at offset 2^32-1 takes a
+ * few bytes instead of 512MB. The bit commands work on this encoding
+ * directly, while the commands reading the bytes of the string get the
+ * flat string from getDecodedObject(), that builds it on demand.
+ *
+ * A string switches to the bitmap encoding when it is at least
+ * string-bitmap-min-bytes long and the bitmap is estimated to take at most
+ * 1/4 of the flat string, and is converted back once the bitmap takes more
+ * than half of it, so that strings close to the limit are not converted
+ * back and forth at every write.
+ * -------------------------------------------------------------------------- */
+
+bitmapString *bitmapStringNew(size_t len) {
+    bitmapString *bs = zmalloc(sizeof(*bs));
+    bs->len = len;
+    bs->bits = roaringNew();
+    return bs;
+}
+
+void bitmapStringFree(bitmapString *bs) {
+    roaringFree(bs->bits);
+    zfree(bs);
+}
+
+bitmapString *bitmapStringDup(const bitmapString *bs) {
+    bitmapString *dup = zmalloc(sizeof(*dup));
+    dup->len = bs->len;
+    dup->bits = roaringDup(bs->bits);
+    return dup;
+}
+
+size_t bitmapStringAllocSize(const bitmapString *bs) {
+    return sizeof(*bs)+roaringAllocSize(bs->bits);
+}
+
+/* Set in 'dst' the bits set in the 'len' bytes of the string starting at
+ * byte 'start'. The other bits of 'dst' are left untouched. */
+static void bitmapStringOrBytes(const bitmapString *bs, size_t start,
+                                size_t len, unsigned char *dst)
+{
+    int64_t end = (int64_t)(start+len)*8, offset;
+    roaringIterator ri;
+
+    roaringInitIterator(&ri,bs->bits);
+    roaringSeekIterator(&ri,(int64_t)start*8);
+    while (roaringNext(&ri,&offset) && offset < end)
+        dst[(offset>>3)-start] |= 0x80 >> (offset&7);
+}
+
+/* Store in 'dst' the 'len' bytes of the string starting at byte 'start'.
+ * Bytes past the end of the string are zero. */
+void bitmapStringRead(const bitmapString *bs, size_t start, size_t len,
+                      unsigned char *dst)
+{
+    memset(dst,0,len);
+    bitmapStringOrBytes(bs,start,len,dst);
+}
+
+/* Return the flat representation of the string as a new sds. */
+sds bitmapStringToSds(const bitmapString *bs) {
+    sds s = sdsnewlen(NULL,bs->len); /* Zero filled. */
+    bitmapStringOrBytes(bs,0,bs->len,(unsigned char*)s);
+    return s;
+}
+
+/* Return true if a string of 'len' bytes with 'card' bits set should be
+ * bitmap encoded. Sparse bits take a bit more than two bytes each. */
+static int bitmapStringShouldEncode(size_t len, uint64_t card) {
+    return server.string_bitmap_min_bytes &&
+           len >= server.string_bitmap_min_bytes &&
+           card*2 <= len/4;
+}
+
+/* Return true if the bitmap encoded string should be made flat. */
+static int bitmapStringShouldDecode(const bitmapString *bs) {
+    return !server.string_bitmap_min_bytes ||
+           roaringAllocSize(bs->bits) > bs->len/2;
+}
+
+/* Create a bitmap encoded string object with the content of the 'len'
+ * bytes at 'p'. */
+static robj *createStringBitmapObjectFromBuffer(const unsigned char *p,
+                                                size_t len)
+{
+    robj *o = createStringBitmapObject(len);
+    bitmapString *bs = o->ptr;
+    size_t j = 0;
+
+    while (j < len) {
+        uint64_t word;
+        unsigned char byte;
+
+        /* Skip zero words fast, the strings we encode are mostly zeros. */
+        if (j+8 <= len) {
+            memcpy(&word,p+j,8);
+            if (word == 0) {
+                j += 8;
+                continue;
+            }
+        }
+        byte = p[j];
+        while (byte) {
+            int bit = __builtin_clz(byte)-24; /* Bit 0 is the MSB. */
+            roaringAdd(bs->bits,(int64_t)j*8+bit);
+            byte &= ~(0x80 >> bit);
+        }
+        j++;
+    }
+    return o;
+}
+
+/* Convert the bitmap encoded string 'o', the value of 'key', into a raw
+ * string if the bitmap is not worth it anymore. The object replacing 'o' in
+ * the database is returned, 'o' itself should not be used anymore. */
+static robj *bitmapStringDecodeIfNeeded(redisDb *db, robj *key, robj *o) {
+    if (o->encoding != OBJ_ENCODING_BITMAP ||
+        !bitmapStringShouldDecode(o->ptr)) return o;
+    robj *raw = createObject(OBJ_STRING,bitmapStringToSds(o->ptr));
+    dbOverwrite(db,key,raw);
+    return raw;
+}
+
+/* Like redisBitpos() for the bytes from 'start' to 'end' of a bitmap
+ * encoded string: the position returned is relative to the first bit of
+ * the range, and when looking for a clear bit in a range with all the bits
+ * set, the first bit after the range is returned. */
+static long bitmapStringBitpos(const bitmapString *bs, long start, long end,
+                               int bit)
+{
+    int64_t first = (int64_t)start*8, last = (int64_t)end*8+7, offset;
+    int64_t expected = first;
+    roaringIterator ri;
+
+    roaringInitIterator(&ri,bs->bits);
+    roaringSeekIterator(&ri,first);
+    if (bit) {
+        if (roaringNext(&ri,&offset) && offset <= last) return offset-first;
+        return -1;
+    }
+
+    /* Look for the first hole in the run of bits set at 'first', if any. */
+    while (expected <= last && roaringNext(&ri,&offset) && offset == expected)
+        expected++;
+    return expected-first;
+}
+
 /* -----------------------------------------------------------------------------
  * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
  * -------------------------------------------------------------------------- */
@@ -399,6 +718,186 @@ void printBits(unsigned char *p, unsigned long count) {
 #define BITOP_XOR   2
 #define BITOP_NOT   3
 
+/* The BITOP result is computed in blocks of this size, applying every source
+ * key to a block before moving to the next one, so that the destination
+ * bytes stay in the cache while the sources are streamed. */
+#define BITOP_CHUNK_BYTES (64*1024)
+
+#ifdef HAVE_X86_SIMD
+#define BITOP_VECTOR_LOOP(vtype,width,load,store,expr) do { \
+    for (; i+(width) <= len; i += (width)) { \
+        vtype a = load((const void*)(dst+i)); \
+        vtype b = load((const void*)(src+i)); \
+        store((void*)(dst+i),expr); \
+    } \
+} while(0)
+
+/* Compute dst = dst <op> src (dst = ~src for NOT) for whole vectors in the
+ * first 'len' bytes, returning the number of bytes processed. */
+__attribute__((target("avx2")))
+static size_t bitopApplyAVX2(int op, unsigned char *dst, const unsigned char *src, size_t len) {
+    const __m256i ones = _mm256_set1_epi8((char)0xff);
+    size_t i = 0;
+
+#define LOAD256(p) _mm256_loadu_si256((const __m256i*)(p))
+#define STORE256(p,v) _mm256_storeu_si256((__m256i*)(p),(v))
+    switch(op) {
+    case BITOP_AND:
+        BITOP_VECTOR_LOOP(__m256i,32,LOAD256,STORE256,_mm256_and_si256(a,b));
+        break;
+    case BITOP_OR:
+        BITOP_VECTOR_LOOP(__m256i,32,LOAD256,STORE256,_mm256_or_si256(a,b));
+        break;
+    case BITOP_XOR:
+        BITOP_VECTOR_LOOP(__m256i,32,LOAD256,STORE256,_mm256_xor_si256(a,b));
+        break;
+    case BITOP_NOT:
+        BITOP_VECTOR_LOOP(__m256i,32,LOAD256,STORE256,
+            ((void)a,_mm256_xor_si256(b,ones)));
+        break;
+    }
+#undef LOAD256
+#undef STORE256
+    return i;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t bitopApplyAVX512(int op, unsigned char *dst, const unsigned char *src, size_t len) {
+    const __m512i ones = _mm512_set1_epi8((char)0xff);
+    size_t i = 0;
+
+    switch(op) {
+    case BITOP_AND:
+        BITOP_VECTOR_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+            _mm512_and_si512(a,b));
+        break;
+    case BITOP_OR:
+        BITOP_VECTOR_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+            _mm512_or_si512(a,b));
+        break;
+    case BITOP_XOR:
+        BITOP_VECTOR_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+            _mm512_xor_si512(a,b));
+        break;
+    case BITOP_NOT:
+        BITOP_VECTOR_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+            ((void)a,_mm512_xor_si512(b,ones)));
+        break;
+    }
+    return i;
+}
+#endif
+
+/* Compute dst = dst <op> src (dst = ~src for NOT) for the first 'len' bytes.
+ * The sources are not aligned in general since the blocks start at
+ * arbitrary offsets, so words are moved with memcpy(), that compiles to
+ * plain loads and stores where unaligned access is allowed. */
+static void bitopApply(int op, unsigned char *dst, const unsigned char *src, size_t len) {
+    size_t i = 0;
+
+#ifdef HAVE_X86_SIMD
+    int simd = bitopsSimdLevel();
+    if (simd == BITOPS_SIMD_AVX512)
+        i = bitopApplyAVX512(op,dst,src,len);
+    else if (simd == BITOPS_SIMD_AVX2)
+        i = bitopApplyAVX2(op,dst,src,len);
+#endif
+
+#ifndef USE_ALIGNED_ACCESS
+    for (; i+8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a,dst+i,8);
+        memcpy(&b,src+i,8);
+        switch(op) {
+        case BITOP_AND: a &= b; break;
+        case BITOP_OR:  a |= b; break;
+        case BITOP_XOR: a ^= b; break;
+        case BITOP_NOT: a = ~b; break;
+        }
+        memcpy(dst+i,&a,8);
+    }
+#endif
+    for (; i < len; i++) {
+        switch(op) {
+        case BITOP_AND: dst[i] &= src[i]; break;
+        case BITOP_OR:  dst[i] |= src[i]; break;
+        case BITOP_XOR: dst[i] ^= src[i]; break;
+        case BITOP_NOT: dst[i] = ~src[i]; break;
+        }
+    }
+}
+
+/* Compute the 'maxlen' bytes of the result of BITOP 'op' into 'res'. Keys
+ * shorter than 'maxlen', or missing (NULL src), are handled as if they were
+ * padded with zero bytes. */
+static void bitopCompute(int op, unsigned char *res, unsigned long maxlen,
+                         unsigned char **src, unsigned long *len,
+                         unsigned long numkeys)
+{
+    unsigned long start, j;
+
+    for (start = 0; start < maxlen; start += BITOP_CHUNK_BYTES) {
+        unsigned long end = start + BITOP_CHUNK_BYTES;
+        if (end > maxlen) end = maxlen;
+
+        /* Initialize the block with the first key: the zero padding is
+         * inverted by NOT. */
+        unsigned long avail = len[0] > start ? (len[0] < end ? len[0] : end) - start : 0;
+        if (op == BITOP_NOT) {
+            if (avail) bitopApply(op,res+start,src[0]+start,avail);
+            memset(res+start+avail,0xff,end-start-avail);
+            continue;
+        }
+        if (avail) memcpy(res+start,src[0]+start,avail);
+        memset(res+start+avail,0,end-start-avail);
+
+        /* Apply the other keys. The padding of a short key is a no-op for
+         * OR and XOR, and clears the rest of the block for AND. */
+        for (j = 1; j < numkeys; j++) {
+            avail = len[j] > start ? (len[j] < end ? len[j] : end) - start : 0;
+            if (avail) bitopApply(op,res+start,src[j]+start,avail);
+            if (op == BITOP_AND && avail < end-start)
+                memset(res+start+avail,0,end-start-avail);
+        }
+    }
+}
+
+/* Compute AND, OR or XOR of the bitmap encoded strings 'objects', NULL
+ * for missing keys, into 'dst', initially empty. */
+static void bitopComputeBitmap(int op, roaring *dst, robj **objects,
+                               unsigned long numkeys)
+{
+    unsigned long j;
+
+    /* A missing key is all zeros: the result of AND is empty, while OR and
+     * XOR can just skip it. */
+    if (op == BITOP_AND) {
+        for (j = 0; j < numkeys; j++)
+            if (objects[j] == NULL) return;
+    }
+
+    for (j = 0; j < numkeys; j++) {
+        const roaring *bits;
+
+        if (objects[j] == NULL) continue;
+        bits = ((bitmapString*)objects[j]->ptr)->bits;
+        if (j == 0) {
+            roaringOr(dst,bits);
+        } else if (op == BITOP_AND) {
+            roaringAnd(dst,bits);
+        } else if (op == BITOP_OR) {
+            roaringOr(dst,bits);
+        } else {
+            /* a ^ b = (a | b) & ~(a & b) */
+            roaring *common = roaringDup(dst);
+            roaringAnd(common,bits);
+            roaringOr(dst,bits);
+            roaringAndNot(dst,common);
+            roaringFree(common);
+        }
+    }
+}
+
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
 #define BITFIELDOP_INCRBY 2
@@ -472,26 +971,6 @@ int getBitfieldTypeFromArgument(client *c, robj *o, int *sign, int *bits) {
     return C_OK;
 }
 
-/* This is an helper function for commands implementations that need to write
- * bits to a string object. The command creates or pad with zeroes the string
- * so that the 'maxbit' bit can be addressed. The object is finally
- * returned. Otherwise if the key holds a wrong type NULL is returned and
- * an error is sent to the client. */
-robj *lookupStringForBitCommand(client *c, size_t maxbit) {
-    size_t byte = maxbit >> 3;
-    robj *o = lookupKeyWrite(c->db,c->argv[1]);
-
-    if (o == NULL) {
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
-        dbAdd(c->db,c->argv[1],o);
-    } else {
-        if (checkType(c,o,OBJ_STRING)) return NULL;
-        o = dbUnshareStringValue(c->db,c->argv[1],o);
-        o->ptr = sdsgrowzero(o->ptr,byte+1);
-    }
-    return o;
-}
-
 /* Return a pointer to the string object content, and stores its length
  * in 'len'. The user is required to pass (likely stack allocated) buffer
  * 'llbuf' of at least LONG_STR_SIZE bytes. Such a buffer is used in the case
@@ -523,6 +1002,62 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     return p;
 }
 
+/* This is an helper function for commands implementations that need to write
+ * bits to a string object. The command creates or pad with zeroes the string
+ * so that the 'maxbit' bit can be addressed. The object is finally
+ * returned. Otherwise if the key holds a wrong type NULL is returned and
+ * an error is sent to the client.
+ *
+ * The returned object is either a raw string or a bitmap encoded one, that
+ * is used for new strings and strings growing a lot if the bits set are
+ * few enough. */
+robj *lookupStringForBitCommand(client *c, size_t maxbit) {
+    size_t byte = maxbit >> 3;
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+
+    if (o == NULL) {
+        if (bitmapStringShouldEncode(byte+1,0))
+            o = createStringBitmapObject(byte+1);
+        else
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        dbAdd(c->db,c->argv[1],o);
+        return o;
+    }
+
+    if (checkType(c,o,OBJ_STRING)) return NULL;
+    if (o->encoding == OBJ_ENCODING_BITMAP) {
+        bitmapString *bs;
+
+        if (o->refcount != 1) {
+            o = dupStringObject(o);
+            dbOverwrite(c->db,c->argv[1],o);
+        }
+        bs = o->ptr;
+        if (bs->len < byte+1) bs->len = byte+1;
+        return o;
+    }
+
+    /* Check the bits set only when the string at least doubles, so that
+     * the cost of the check is amortized like the one of the growth. */
+    if (byte+1 > stringObjectLen(o)*2 &&
+        bitmapStringShouldEncode(byte+1,0))
+    {
+        char llbuf[LONG_STR_SIZE];
+        long len;
+        unsigned char *p = getObjectReadOnlyString(o,&len,llbuf);
+
+        if (bitmapStringShouldEncode(byte+1,redisPopcount(p,len))) {
+            o = createStringBitmapObjectFromBuffer(p,len);
+            ((bitmapString*)o->ptr)->len = byte+1;
+            dbOverwrite(c->db,c->argv[1],o);
+            return o;
+        }
+    }
+    o = dbUnshareStringValue(c->db,c->argv[1],o);
+    o->ptr = sdsgrowzero(o->ptr,byte+1);
+    return o;
+}
+
 /* SETBIT key offset bitvalue */
 /**
  * 字节设置，比set更加细腻
@@ -550,16 +1085,27 @@ void setbitCommand(client *c) {
 
     if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
 
-    /* Get current values */
-    byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
-    bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+    if (o->encoding == OBJ_ENCODING_BITMAP) {
+        bitmapString *bs = o->ptr;
+
+        if (on) {
+            bitval = !roaringAdd(bs->bits,bitoffset);
+            bitmapStringDecodeIfNeeded(c->db,c->argv[1],o);
+        } else {
+            bitval = roaringRemove(bs->bits,bitoffset);
+        }
+    } else {
+        /* Get current values */
+        byte = bitoffset >> 3;
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bit = 7 - (bitoffset & 0x7);
+        bitval = byteval & (1 << bit);
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c,c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
@@ -585,6 +1131,8 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        bitval = roaringContains(((bitmapString*)o->ptr)->bits,bitoffset);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -602,8 +1150,8 @@ void bitopCommand(client *c) {
     unsigned char **src; /* Array of source strings pointers. */
     unsigned long *len, maxlen = 0; /* Array of length of src strings,
                                        and max len. */
-    unsigned long minlen = 0;    /* Min len among the input keys. */
-    unsigned char *res = NULL; /* Resulting string. */
+    unsigned long bitmaps = 0, missing = 0; /* Bitmap encoded / missing keys. */
+    robj *res = NULL; /* Resulting string object. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -637,7 +1185,7 @@ void bitopCommand(client *c) {
             objects[j] = NULL;
             src[j] = NULL;
             len[j] = 0;
-            minlen = 0;
+            missing++;
             continue;
         }
         /* Return an error if one of the keys is not a string. */
@@ -652,101 +1200,53 @@ void bitopCommand(client *c) {
             zfree(objects);
             return;
         }
-        objects[j] = getDecodedObject(o);
-        src[j] = objects[j]->ptr;
-        len[j] = sdslen(objects[j]->ptr);
+        if (o->encoding == OBJ_ENCODING_BITMAP) {
+            /* Decoded below only if the result can't be computed on the
+             * bitmaps. */
+            incrRefCount(o);
+            objects[j] = o;
+            src[j] = NULL;
+            len[j] = ((bitmapString*)o->ptr)->len;
+            bitmaps++;
+        } else {
+            objects[j] = getDecodedObject(o);
+            src[j] = objects[j]->ptr;
+            len[j] = sdslen(objects[j]->ptr);
+        }
         if (len[j] > maxlen) maxlen = len[j];
-        if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
-    /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
-        res = (unsigned char*) sdsnewlen(NULL,maxlen);
-        unsigned char output, byte;
-        unsigned long i;
-
-        /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
-        j = 0;
-        #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
+    /* Compute the bit operation, if at least one string is not empty.
+     * When all the keys are bitmap encoded (or missing) AND, OR and XOR
+     * are computed on the bitmaps without making any string flat. */
+    if (maxlen && bitmaps && bitmaps+missing == numkeys && op != BITOP_NOT) {
+        res = createStringBitmapObject(maxlen);
+        bitopComputeBitmap(op,((bitmapString*)res->ptr)->bits,objects,numkeys);
+        if (bitmapStringShouldDecode(res->ptr)) {
+            robj *raw = createObject(OBJ_STRING,bitmapStringToSds(res->ptr));
+            decrRefCount(res);
+            res = raw;
         }
-        #endif
-
-        /* j is set to the next byte to process by the previous loop. */
-        for (; j < maxlen; j++) {
-            output = (len[0] <= j) ? 0 : src[0][j];
-            if (op == BITOP_NOT) output = ~output;
-            for (i = 1; i < numkeys; i++) {
-                byte = (len[i] <= j) ? 0 : src[i][j];
-                switch(op) {
-                case BITOP_AND: output &= byte; break;
-                case BITOP_OR:  output |= byte; break;
-                case BITOP_XOR: output ^= byte; break;
-                }
+    } else if (maxlen) {
+        for (j = 0; j < numkeys; j++) {
+            if (objects[j] && objects[j]->encoding == OBJ_ENCODING_BITMAP) {
+                robj *decoded = getDecodedObject(objects[j]);
+                decrRefCount(objects[j]);
+                objects[j] = decoded;
+                src[j] = decoded->ptr;
             }
-            res[j] = output;
+        }
+        res = createObject(OBJ_STRING,sdsnewlen(NULL,maxlen));
+        bitopCompute(op,res->ptr,maxlen,src,len,numkeys);
+
+        /* The result of operations involving sparse bitmaps is likely to
+         * be sparse as well. */
+        if (bitmaps && bitmapStringShouldEncode(maxlen,0) &&
+            bitmapStringShouldEncode(maxlen,redisPopcount(res->ptr,maxlen)))
+        {
+            robj *encoded = createStringBitmapObjectFromBuffer(res->ptr,maxlen);
+            decrRefCount(res);
+            res = encoded;
         }
     }
     for (j = 0; j < numkeys; j++) {
@@ -759,10 +1259,9 @@ void bitopCommand(client *c) {
 
     /* Store the computed value into the target key */
     if (maxlen) {
-        o = createObject(OBJ_STRING,res);
-        setKey(c,c->db,targetkey,o);
+        setKey(c,c->db,targetkey,res);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
-        decrRefCount(o);
+        decrRefCount(res);
         server.dirty++;
     } else if (dbDelete(c->db,targetkey)) {
         signalModifiedKey(c,c->db,targetkey);
@@ -782,7 +1281,12 @@ void bitcountCommand(client *c) {
     /* Lookup, check for type, and return 0 for non existing keys. */
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_BITMAP) {
+        p = NULL;
+        strlen = ((bitmapString*)o->ptr)->len;
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4) {
@@ -814,6 +1318,10 @@ void bitcountCommand(client *c) {
      * zero can be returned is: start > end. */
     if (start > end) {
         addReply(c,shared.czero);
+    } else if (p == NULL) {
+        bitmapString *bs = o->ptr;
+        addReplyLongLong(c,roaringRangeCard(bs->bits,(int64_t)start*8,
+                                            (int64_t)end*8+7));
     } else {
         long bytes = end-start+1;
 
@@ -846,7 +1354,12 @@ void bitposCommand(client *c) {
         return;
     }
     if (checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_BITMAP) {
+        p = NULL;
+        strlen = ((bitmapString*)o->ptr)->len;
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4 || c->argc == 5) {
@@ -881,7 +1394,8 @@ void bitposCommand(client *c) {
         addReplyLongLong(c, -1);
     } else {
         long bytes = end-start+1;
-        long pos = redisBitpos(p+start,bytes,bit);
+        long pos = p ? redisBitpos(p+start,bytes,bit) :
+                       bitmapStringBitpos(o->ptr,start,end,bit);
 
         /* If we are looking for clear bits, and the user specified an exact
          * range with start-end, we can't consider the right of the range as
@@ -1040,6 +1554,16 @@ void bitfieldGeneric(client *c, int flags) {
             /* SET and INCRBY: We handle both with the same code path
              * for simplicity. SET return value is the previous value so
              * we need fetch & store as well. */
+            unsigned char *p = o->ptr, window[9];
+            uint64_t offset = thisop->offset;
+
+            /* Bitmap encoded strings are operated on a copy of the 9
+             * bytes holding the field, whose bits are then stored back. */
+            if (o->encoding == OBJ_ENCODING_BITMAP) {
+                bitmapStringRead(o->ptr,offset>>3,sizeof(window),window);
+                p = window;
+                offset &= 7;
+            }
 
             /* We need two different but very similar code paths for signed
              * and unsigned operations, since the set of functions to get/set
@@ -1048,8 +1572,7 @@ void bitfieldGeneric(client *c, int flags) {
                 int64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getSignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getSignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1069,8 +1592,7 @@ void bitfieldGeneric(client *c, int flags) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setSignedBitfield(o->ptr,thisop->offset,
-                                      thisop->bits,newval);
+                    setSignedBitfield(p,offset,thisop->bits,newval);
                 } else {
                     addReplyNull(c);
                 }
@@ -1078,8 +1600,7 @@ void bitfieldGeneric(client *c, int flags) {
                 uint64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getUnsignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getUnsignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1098,12 +1619,23 @@ void bitfieldGeneric(client *c, int flags) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setUnsignedBitfield(o->ptr,thisop->offset,
-                                        thisop->bits,newval);
+                    setUnsignedBitfield(p,offset,thisop->bits,newval);
                 } else {
                     addReplyNull(c);
                 }
             }
+            if (p == window) {
+                bitmapString *bs = o->ptr;
+                int i;
+
+                for (i = 0; i < thisop->bits; i++) {
+                    uint64_t bit = offset+i;
+                    if (window[bit>>3] & (0x80 >> (bit&7)))
+                        roaringAdd(bs->bits,thisop->offset+i);
+                    else
+                        roaringRemove(bs->bits,thisop->offset+i);
+                }
+            }
             changes++;
         } else {
             /* GET */
@@ -1112,7 +1644,7 @@ void bitfieldGeneric(client *c, int flags) {
             unsigned char *src = NULL;
             char llbuf[LONG_STR_SIZE];
 
-            if (o != NULL)
+            if (o != NULL && o->encoding != OBJ_ENCODING_BITMAP)
                 src = getObjectReadOnlyString(o,&strlen,llbuf);
 
             /* For GET we use a trick: before executing the operation
@@ -1122,6 +1654,8 @@ void bitfieldGeneric(client *c, int flags) {
             memset(buf,0,9);
             int i;
             size_t byte = thisop->offset >> 3;
+            if (o != NULL && o->encoding == OBJ_ENCODING_BITMAP)
+                bitmapStringRead(o->ptr,byte,9,buf);
             for (i = 0; i < 9; i++) {
                 if (src == NULL || i+byte >= (size_t)strlen) break;
                 buf[i] = src[i+byte];
@@ -1142,6 +1676,7 @@ void bitfieldGeneric(client *c, int flags) {
     }
 
     if (changes) {
+        bitmapStringDecodeIfNeeded(c->db,c->argv[1],o);
         signalModifiedKey(c,c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
         server.dirty += changes;
@@ -1156,3 +1691,84 @@ void bitfieldCommand(client *c) {
 void bitfieldroCommand(client *c) {
     bitfieldGeneric(c, BITFIELD_FLAG_READONLY);
 }
+
+#ifdef REDIS_TEST
+#include <time.h>
+
+/* Fill 'len' bytes with random data, with long runs of zero or 0xff bytes
+ * so that BITPOS has something to skip. */
+static void bitopsRandomFill(unsigned char *p, size_t len) {
+    size_t j = 0;
+    while (j < len) {
+        size_t run = rand() % 2048;
+        int type = rand() % 3;
+        if (run > len-j) run = len-j;
+        if (type == 2) {
+            for (size_t k = 0; k < run; k++) p[j+k] = rand();
+        } else {
+            memset(p+j,type ? 0xff : 0,run);
+        }
+        j += run;
+    }
+}
+
+/* Check the vector kernels, if the CPU has any, against the scalar code on
+ * random buffers at every alignment. */
+int bitopsTest(int argc, char **argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+
+    int level = bitopsSimdLevel();
+    size_t bufsize = 1024*1024;
+    unsigned char *a = zmalloc(bufsize), *b = zmalloc(bufsize);
+    unsigned char *r1 = zmalloc(bufsize), *r2 = zmalloc(bufsize);
+    printf("Vector level: %d\n", level);
+
+    printf("Popcount and bitpos: ");
+    for (int k = 0; k < 2000; k++) {
+        if (k % 100 == 0) bitopsRandomFill(a,bufsize);
+        size_t off = rand() % 128;
+        size_t len = rand() % (k < 1000 ? 4096 : bufsize-off);
+        int bit = rand() % 2;
+
+        bitops_simd = BITOPS_SIMD_NONE;
+        size_t count = redisPopcount(a+off,len);
+        long pos = redisBitpos(a+off,len,bit);
+        for (bitops_simd = 1; bitops_simd <= level; bitops_simd++) {
+            serverAssert(redisPopcount(a+off,len) == count);
+            serverAssert(redisBitpos(a+off,len,bit) == pos);
+        }
+    }
+    bitops_simd = level;
+    printf("OK\n");
+
+    printf("Bitop apply: ");
+    for (int k = 0; k < 2000; k++) {
+        if (k % 100 == 0) {
+            bitopsRandomFill(a,bufsize);
+            bitopsRandomFill(b,bufsize);
+        }
+        size_t off1 = rand() % 128, off2 = rand() % 128;
+        size_t len = rand() % (k < 1000 ? 4096 : bufsize-256);
+        int op = rand() % 4;
+
+        memcpy(r1,a,bufsize);
+        bitops_simd = BITOPS_SIMD_NONE;
+        bitopApply(op,r1+off1,b+off2,len);
+        for (bitops_simd = 1; bitops_simd <= level; bitops_simd++) {
+            memcpy(r2,a,bufsize);
+            bitopApply(op,r2+off1,b+off2,len);
+            serverAssert(memcmp(r1,r2,bufsize) == 0);
+        }
+    }
+    bitops_simd = level;
+    printf("OK\n");
+
+    zfree(a);
+    zfree(b);
+    zfree(r1);
+    zfree(r2);
+    return 0;
+}
+#endif
@@ -61,6 +61,7 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 
 int serveClientBlockedOnList(client *receiver, robj *key, robj *dstkey, redisDb *db, robj *value, int where);
 
@@ -152,6 +153,8 @@ void unblockClient(client *c) {
         unblockClientWaitingData(c);
     } else if (c->btype == BLOCKED_WAIT) {
         unblockClientWaitingReplicas(c);
+    } else if (c->btype == BLOCKED_WAITAOF) {
+        unblockClientWaitingAof(c);
     } else if (c->btype == BLOCKED_MODULE) {
         if (moduleClientIsBlockedOnKeys(c)) unblockClientWaitingData(c);
         unblockClientFromModule(c);
@@ -178,6 +181,10 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyNullArray(c);
     } else if (c->btype == BLOCKED_WAIT) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
+    } else if (c->btype == BLOCKED_WAITAOF) {
+        long long fsynced;
+        atomicGet(server.aof_fsynced_woff,fsynced);
+        addReplyLongLong(c,fsynced >= c->bpop.aofoffset);
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
     } else {
@@ -316,12 +323,29 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
     }
 }
 
+/* Clients blocked with XREAD (without a group) that are tailing the same
+ * stream usually wait for the same ID with the same COUNT, so they receive
+ * exactly the same entries: we encode them once and copy the protocol to
+ * every such client. A few slots are enough to cover readers that are
+ * lagging behind at different IDs. */
+#define STREAM_REPLY_CACHE_SLOTS 4
+typedef struct streamReplyCache {
+    streamID start;
+    size_t count;
+    size_t emitted;
+    sds proto;          /* NULL if the slot is unused. */
+} streamReplyCache;
+
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
  * when there may be clients blocked on a stream key, and there may be new
  * data to fetch (the key is ready). */
 void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
     dictEntry *de = dictFind(rl->db->blocking_keys,rl->key);
     stream *s = o->ptr;
+    streamReplyCache cache[STREAM_REPLY_CACHE_SLOTS];
+    int cache_next = 0;
+
+    for (int j = 0; j < STREAM_REPLY_CACHE_SLOTS; j++) cache[j].proto = NULL;
 
     /* We need to provide the new data arrived on the stream
      * to all the clients that are waiting for an offset smaller
@@ -392,13 +416,38 @@ void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
                 }
                 addReplyBulk(receiver,rl->key);
 
-                streamPropInfo pi = {
-                    rl->key,
-                    receiver->bpop.xread_group
-                };
-                streamReplyWithRange(receiver,s,&start,NULL,
-                                     receiver->bpop.xread_count,
-                                     0, group, consumer, noack, &pi);
+                if (group == NULL) {
+                    size_t count = receiver->bpop.xread_count;
+                    streamReplyCache *rc = NULL;
+                    for (int j = 0; j < STREAM_REPLY_CACHE_SLOTS; j++) {
+                        if (cache[j].proto && cache[j].count == count &&
+                            streamCompareID(&cache[j].start,&start) == 0)
+                        {
+                            rc = cache+j;
+                            break;
+                        }
+                    }
+                    if (rc == NULL) {
+                        rc = cache+cache_next;
+                        cache_next = (cache_next+1) % STREAM_REPLY_CACHE_SLOTS;
+                        if (rc->proto) sdsclear(rc->proto);
+                        else rc->proto = sdsempty();
+                        rc->start = start;
+                        rc->count = count;
+                        rc->emitted = streamRenderRange(s,&start,NULL,count,
+                                                        &rc->proto);
+                    }
+                    addReplyArrayLen(receiver,rc->emitted);
+                    addReplyProto(receiver,rc->proto,sdslen(rc->proto));
+                } else {
+                    streamPropInfo pi = {
+                        rl->key,
+                        receiver->bpop.xread_group
+                    };
+                    streamReplyWithRange(receiver,s,&start,NULL,
+                                         receiver->bpop.xread_count,
+                                         0, group, consumer, noack, &pi);
+                }
 
                 /* Note that after we unblock the client, 'gt'
                  * and other receiver->bpop stuff are no longer
@@ -408,6 +457,8 @@ void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
             }
         }
     }
+
+    for (int j = 0; j < STREAM_REPLY_CACHE_SLOTS; j++) sdsfree(cache[j].proto);
 }
 
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
@@ -6084,7 +6084,7 @@ int verifyDumpPayload(unsigned char *p, size_t len) {
     //获取RDB版本
     rdbver = (footer[1] << 8) | footer[0];
     // 检验版本
-    if (rdbver > RDB_VERSION) return C_ERR;
+    if (!rdbIsKnownVersion(rdbver)) return C_ERR;
 
     /* Verify CRC64 */
     // 验证CRC64校验和
@@ -98,6 +98,20 @@ configEnum repl_diskless_load_enum[] = {
     {NULL, 0}
 };
 
+configEnum rdb_compression_codec_enum[] = {
+    {"lzf", RDB_ENC_LZF},
+    {"lz4", RDB_ENC_LZ4},
+    {"zstd", RDB_ENC_ZSTD},
+    {NULL, 0}
+};
+
+configEnum aof_binary_compression_enum[] = {
+    {"no", 0},
+    {"lz4", RDB_ENC_LZ4},
+    {"zstd", RDB_ENC_ZSTD},
+    {NULL, 0}
+};
+
 configEnum tls_auth_clients_enum[] = {
     {"no", TLS_CLIENT_AUTH_NO},
     {"yes", TLS_CLIENT_AUTH_YES},
@@ -2261,6 +2275,8 @@ standardConfig configs[] = {
     createBoolConfig("protected-mode", NULL, MODIFIABLE_CONFIG, server.protected_mode, 1, NULL, NULL),
     createBoolConfig("rdbcompression", NULL, MODIFIABLE_CONFIG, server.rdb_compression, 1, NULL, NULL),
     createBoolConfig("rdb-del-sync-files", NULL, MODIFIABLE_CONFIG, server.rdb_del_sync_files, 0, NULL, NULL),
+    createBoolConfig("rdb-forkless-save", NULL, MODIFIABLE_CONFIG, server.rdb_forkless_save, 0, NULL, NULL),
+    createBoolConfig("rdb-mmap-snapshot", NULL, MODIFIABLE_CONFIG, server.rdb_mmap_snapshot, 0, NULL, NULL),
     createBoolConfig("activerehashing", NULL, MODIFIABLE_CONFIG, server.activerehashing, 1, NULL, NULL),
     createBoolConfig("stop-writes-on-bgsave-error", NULL, MODIFIABLE_CONFIG, server.stop_writes_on_bgsave_err, 1, NULL, NULL),
     createBoolConfig("dynamic-hz", NULL, MODIFIABLE_CONFIG, server.dynamic_hz, 1, NULL, NULL), /* Adapt hz to # of clients.*/
@@ -2276,6 +2292,8 @@ standardConfig configs[] = {
     createBoolConfig("cluster-require-full-coverage", NULL, MODIFIABLE_CONFIG, server.cluster_require_full_coverage, 1, NULL, NULL),
     createBoolConfig("rdb-save-incremental-fsync", NULL, MODIFIABLE_CONFIG, server.rdb_save_incremental_fsync, 1, NULL, NULL),
     createBoolConfig("aof-load-truncated", NULL, MODIFIABLE_CONFIG, server.aof_load_truncated, 1, NULL, NULL),
+    createBoolConfig("aof-load-reader-thread", NULL, MODIFIABLE_CONFIG, server.aof_load_reader_thread, 0, NULL, NULL),
+    createBoolConfig("aof-binary-encoding", NULL, MODIFIABLE_CONFIG, server.aof_binary_encoding, 0, NULL, NULL),
     createBoolConfig("aof-use-rdb-preamble", NULL, MODIFIABLE_CONFIG, server.aof_use_rdb_preamble, 1, NULL, NULL),
     createBoolConfig("cluster-replica-no-failover", "cluster-slave-no-failover", MODIFIABLE_CONFIG, server.cluster_slave_no_failover, 0, NULL, NULL), /* Failover by default. */
     createBoolConfig("replica-lazy-flush", "slave-lazy-flush", MODIFIABLE_CONFIG, server.repl_slave_lazy_flush, 0, NULL, NULL),
@@ -2289,6 +2307,8 @@ standardConfig configs[] = {
     createBoolConfig("appendonly", NULL, MODIFIABLE_CONFIG, server.aof_enabled, 0, NULL, updateAppendonly),
     createBoolConfig("cluster-allow-reads-when-down", NULL, MODIFIABLE_CONFIG, server.cluster_allow_reads_when_down, 0, NULL, NULL),
     createBoolConfig("oom-score-adj", NULL, MODIFIABLE_CONFIG, server.oom_score_adj, 0, NULL, updateOOMScoreAdj),
+    createBoolConfig("set-bitmap-encoding", NULL, MODIFIABLE_CONFIG, server.set_bitmap_encoding, 1, NULL, NULL),
+    createBoolConfig("zset-btree-encoding", NULL, MODIFIABLE_CONFIG, server.zset_btree_encoding, 0, NULL, NULL),
 
     /* String Configs */
     createStringConfig("aclfile", NULL, IMMUTABLE_CONFIG, ALLOW_EMPTY_STRING, server.acl_filename, "", NULL, NULL),
@@ -2311,6 +2331,8 @@ standardConfig configs[] = {
     createEnumConfig("syslog-facility", NULL, IMMUTABLE_CONFIG, syslog_facility_enum, server.syslog_facility, LOG_LOCAL0, NULL, NULL),
     createEnumConfig("repl-diskless-load", NULL, MODIFIABLE_CONFIG, repl_diskless_load_enum, server.repl_diskless_load, REPL_DISKLESS_LOAD_DISABLED, NULL, NULL),
     createEnumConfig("loglevel", NULL, MODIFIABLE_CONFIG, loglevel_enum, server.verbosity, LL_NOTICE, NULL, NULL),
+    createEnumConfig("rdb-compression-codec", NULL, MODIFIABLE_CONFIG, rdb_compression_codec_enum, server.rdb_compression_codec, RDB_ENC_LZF, NULL, NULL),
+    createEnumConfig("aof-binary-compression", NULL, MODIFIABLE_CONFIG, aof_binary_compression_enum, server.aof_binary_compression, 0, NULL, NULL),
     createEnumConfig("maxmemory-policy", NULL, MODIFIABLE_CONFIG, maxmemory_policy_enum, server.maxmemory_policy, MAXMEMORY_NO_EVICTION, NULL, NULL),
     createEnumConfig("appendfsync", NULL, MODIFIABLE_CONFIG, aof_fsync_enum, server.aof_fsync, AOF_FSYNC_EVERYSEC, NULL, NULL),
 
@@ -2342,6 +2364,11 @@ standardConfig configs[] = {
     createIntConfig("list-compress-depth", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.list_compress_depth, 0, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("rdb-key-save-delay", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.rdb_key_save_delay, 0, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("key-load-delay", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.key_load_delay, 0, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("rdb-compression-min-size", NULL, MODIFIABLE_CONFIG, 4, INT_MAX, server.rdb_compression_min_size, 20, INTEGER_CONFIG, NULL, NULL), /* LZF can't compress even 20 bytes of "a" */
+    createIntConfig("rdb-zstd-min-size", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.rdb_zstd_min_size, 256, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("rdb-zstd-level", NULL, MODIFIABLE_CONFIG, 1, 19, server.rdb_zstd_level, 1, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("rdb-save-threads", NULL, MODIFIABLE_CONFIG, 0, RDB_SAVE_THREADS_MAX, server.rdb_save_threads, 0, INTEGER_CONFIG, NULL, NULL), /* Classic single section format by default */
+    createIntConfig("rdb-load-threads", NULL, MODIFIABLE_CONFIG, 0, RDB_LOAD_THREADS_MAX, server.rdb_load_threads, 0, INTEGER_CONFIG, NULL, NULL), /* Decode in the main thread by default */
     createIntConfig("active-expire-effort", NULL, MODIFIABLE_CONFIG, 1, 10, server.active_expire_effort, 1, INTEGER_CONFIG, NULL, NULL), /* From 1 to 10. */
     createIntConfig("hz", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.config_hz, CONFIG_DEFAULT_HZ, INTEGER_CONFIG, NULL, updateHZ),
     createIntConfig("min-replicas-to-write", "min-slaves-to-write", MODIFIABLE_CONFIG, 0, INT_MAX, server.repl_min_slaves_to_write, 0, INTEGER_CONFIG, NULL, updateGoodSlaves),
@@ -2362,6 +2389,7 @@ standardConfig configs[] = {
     createLongLongConfig("latency-monitor-threshold", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.latency_monitor_threshold, 0, INTEGER_CONFIG, NULL, NULL),
     createLongLongConfig("proto-max-bulk-len", NULL, MODIFIABLE_CONFIG, 1024*1024, LLONG_MAX, server.proto_max_bulk_len, 512ll*1024*1024, MEMORY_CONFIG, NULL, NULL), /* Bulk request max size */
     createLongLongConfig("stream-node-max-entries", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.stream_node_max_entries, 100, INTEGER_CONFIG, NULL, NULL),
+    createLongLongConfig("stream-max-age", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.stream_max_age, 0, INTEGER_CONFIG, NULL, NULL),
     createLongLongConfig("repl-backlog-size", NULL, MODIFIABLE_CONFIG, 1, LLONG_MAX, server.repl_backlog_size, 1024*1024, MEMORY_CONFIG, NULL, updateReplBacklogSize), /* Default: 1mb */
 
     /* Unsigned Long Long configs */
@@ -2375,6 +2403,7 @@ standardConfig configs[] = {
     createSizeTConfig("hash-max-ziplist-value", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.hash_max_ziplist_value, 64, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("stream-node-max-bytes", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.stream_node_max_bytes, 4096, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("zset-max-ziplist-value", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.zset_max_ziplist_value, 64, MEMORY_CONFIG, NULL, NULL),
+    createSizeTConfig("string-bitmap-min-bytes", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.string_bitmap_min_bytes, 65536, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("hll-sparse-max-bytes", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.hll_sparse_max_bytes, 3000, MEMORY_CONFIG, NULL, NULL),
     createSizeTConfig("tracking-table-max-keys", NULL, MODIFIABLE_CONFIG, 0, LONG_MAX, server.tracking_table_max_keys, 1000000, INTEGER_CONFIG, NULL, NULL), /* Default: 1 million keys max. */
 
@@ -231,6 +231,12 @@ void setproctitle(const char *fmt, ...);
 #define USE_ALIGNED_ACCESS
 #endif
 
+/* Test for x86-64 compilers able to build AVX2 / AVX-512 functions using the
+ * target attribute, so that the bitmap kernels can be selected at runtime. */
+#if defined(__x86_64__) && ((defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__))
+#define HAVE_X86_SIMD 1
+#endif
+
 /* Define for redis_set_thread_title */
 #ifdef __linux__
 #define redis_set_thread_title(name) pthread_setname_np(pthread_self(), name)
@@ -112,19 +112,188 @@ uint64_t _crc64(uint_fast64_t crc, const void *in_data, const uint64_t len) {
 
 /******************** END GENERATED PYCRC FUNCTIONS ********************/
 
-/* Initializes the 16KB lookup tables. */
+/* ----------------------------------------------------------------------------
+ * Carry-less multiplication kernel
+ *
+ * On x86-64 CPUs with the PCLMULQDQ instruction long buffers are checksummed
+ * by folding: the data is consumed 64 bytes at a time into four 128 bit
+ * accumulators, every accumulator being multiplied by x^512 mod P (using two
+ * 64x64 carry-less multiplications) and XORed with the next 16 bytes of its
+ * lane. At the end the four accumulators are folded into one, whose 16 bytes,
+ * followed by the unaligned tail, are fed to the table driven code.
+ *
+ * Since the CRC is reflected, a 64 bit constant K stands for x^n mod P with
+ * the bits in reverse order, and the product of two reflected operands is
+ * shifted by one bit: that's why moving the low half of an accumulator
+ * forward by D bits uses x^(D+63) and the high half uses x^(D-1).
+ * ------------------------------------------------------------------------- */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define HAVE_CRC64_CLMUL 1
+#define CRC64_CLMUL_MIN_LEN 128  /* Shorter buffers just use the tables. */
+
+static int crc64_clmul_enabled = 0;
+
+/* Fold constants, low qword for the low half of the accumulator. */
+static uint64_t crc64_k512[2], crc64_k384[2], crc64_k256[2], crc64_k128[2];
+
+/* Return x^n mod P, reflected. */
+static uint64_t crc64_xpow_reflected(unsigned int n) {
+    uint64_t r = 1;
+
+    while (n--) r = (r & UINT64_C(0x8000000000000000)) ? (r << 1) ^ POLY : r << 1;
+    return crc_reflect(r,64);
+}
+
+static void crc64_clmul_init(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1,&eax,&ebx,&ecx,&edx) || !(ecx & bit_PCLMUL)) return;
+    crc64_k512[0] = crc64_xpow_reflected(512+63);
+    crc64_k512[1] = crc64_xpow_reflected(512-1);
+    crc64_k384[0] = crc64_xpow_reflected(384+63);
+    crc64_k384[1] = crc64_xpow_reflected(384-1);
+    crc64_k256[0] = crc64_xpow_reflected(256+63);
+    crc64_k256[1] = crc64_xpow_reflected(256-1);
+    crc64_k128[0] = crc64_xpow_reflected(128+63);
+    crc64_k128[1] = crc64_xpow_reflected(128-1);
+    crc64_clmul_enabled = 1;
+}
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc64_fold(__m128i x, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x,k,0x00),
+                         _mm_clmulepi64_si128(x,k,0x11));
+}
+
+/* Requires l >= 64. */
+__attribute__((target("pclmul,sse2")))
+static uint64_t crc64_clmul(uint64_t crc, const unsigned char *s, uint64_t l) {
+    const __m128i k512 = _mm_loadu_si128((const __m128i*)crc64_k512);
+    const __m128i k384 = _mm_loadu_si128((const __m128i*)crc64_k384);
+    const __m128i k256 = _mm_loadu_si128((const __m128i*)crc64_k256);
+    const __m128i k128 = _mm_loadu_si128((const __m128i*)crc64_k128);
+    __m128i x0, x1, x2, x3;
+    unsigned char last[16];
+
+    /* Without a final XOR, the initial CRC is the same as XORing it with
+     * the first 8 bytes of data and starting from zero. */
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)s),
+                       _mm_cvtsi64_si128((long long)crc));
+    x1 = _mm_loadu_si128((const __m128i*)(s+16));
+    x2 = _mm_loadu_si128((const __m128i*)(s+32));
+    x3 = _mm_loadu_si128((const __m128i*)(s+48));
+    s += 64;
+    l -= 64;
+
+    while (l >= 64) {
+        x0 = _mm_xor_si128(crc64_fold(x0,k512),
+                           _mm_loadu_si128((const __m128i*)s));
+        x1 = _mm_xor_si128(crc64_fold(x1,k512),
+                           _mm_loadu_si128((const __m128i*)(s+16)));
+        x2 = _mm_xor_si128(crc64_fold(x2,k512),
+                           _mm_loadu_si128((const __m128i*)(s+32)));
+        x3 = _mm_xor_si128(crc64_fold(x3,k512),
+                           _mm_loadu_si128((const __m128i*)(s+48)));
+        s += 64;
+        l -= 64;
+    }
+
+    x0 = _mm_xor_si128(_mm_xor_si128(crc64_fold(x0,k384),
+                                     crc64_fold(x1,k256)),
+                       _mm_xor_si128(crc64_fold(x2,k128),x3));
+    while (l >= 16) {
+        x0 = _mm_xor_si128(crc64_fold(x0,k128),
+                           _mm_loadu_si128((const __m128i*)s));
+        s += 16;
+        l -= 16;
+    }
+
+    _mm_storeu_si128((__m128i*)last,x0);
+    crc = crcspeed64native(crc64_table,0,last,16);
+    return crcspeed64native(crc64_table,crc,(void*)s,l);
+}
+#endif
+
+/* Initializes the 16KB lookup tables, and the constants of the carry-less
+ * multiplication kernel if the CPU supports it. */
 void crc64_init(void) {
     crcspeed64native_init(_crc64, crc64_table);
+#ifdef HAVE_CRC64_CLMUL
+    crc64_clmul_init();
+#endif
 }
 
 /* Compute crc64 */
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+#ifdef HAVE_CRC64_CLMUL
+    if (crc64_clmul_enabled && l >= CRC64_CLMUL_MIN_LEN)
+        return crc64_clmul(crc,s,l);
+#endif
     return crcspeed64native(crc64_table, crc, (void *) s, l);
 }
 
+/* ----------------------------------------------------------------------------
+ * CRC combination
+ *
+ * Given crc1 = crc64(0,A,len(A)) and crc2 = crc64(0,B,len2), returns
+ * crc64(0,A+B,len(A)+len2) without touching the data, so that buffers can be
+ * checksummed in parallel and their CRCs merged afterwards. Since there is
+ * no final XOR this is just crc1 advanced by len2 zero bytes XOR crc2: the
+ * advance is computed with the GF(2) matrix squaring used by zlib, so the
+ * cost is logarithmic in len2.
+ * ------------------------------------------------------------------------- */
+
+static uint64_t gf2_matrix_times(const uint64_t *mat, uint64_t vec) {
+    uint64_t sum = 0;
+
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint64_t *square, const uint64_t *mat) {
+    for (int n = 0; n < 64; n++)
+        square[n] = gf2_matrix_times(mat,mat[n]);
+}
+
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2) {
+    uint64_t even[64], odd[64], row = 1;
+
+    if (len2 == 0) return crc1;
+
+    /* Operator for one zero bit in odd. */
+    odd[0] = crc_reflect(POLY,64);
+    for (int n = 1; n < 64; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even,odd);    /* Two zero bits. */
+    gf2_matrix_square(odd,even);    /* Four zero bits. */
+
+    /* Apply len2 zero bytes to crc1, the first square below being the
+     * operator for one zero byte. */
+    do {
+        gf2_matrix_square(even,odd);
+        if (len2 & 1) crc1 = gf2_matrix_times(even,crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        gf2_matrix_square(odd,even);
+        if (len2 & 1) crc1 = gf2_matrix_times(odd,crc1);
+        len2 >>= 1;
+    } while (len2);
+    return crc1 ^ crc2;
+}
+
 /* Test main */
 #ifdef REDIS_TEST
 #include <stdio.h>
+#include <stdlib.h>
 
 #define UNUSED(x) (void)(x)
 int crc64Test(int argc, char *argv[]) {
@@ -147,7 +316,34 @@ int crc64Test(int argc, char *argv[]) {
            (uint64_t)_crc64(0, li, sizeof(li)));
     printf("[64speed]: c7794709e69683b3 == %016" PRIx64 "\n",
            (uint64_t)crc64(0, li, sizeof(li)));
-    return 0;
+
+    /* Check the carry-less multiplication kernel, if any, against the
+     * tables, at every alignment and with many lengths, and that the CRCs
+     * of consecutive chunks combine into the CRC of the whole buffer. */
+    static unsigned char buf[65536+16];
+    int errors = 0;
+    for (size_t j = 0; j < sizeof(buf); j++) buf[j] = rand();
+    for (int j = 0; j < 2000; j++) {
+        size_t off = rand() % 16;
+        size_t len = j < 1000 ? (size_t)j : (size_t)rand() % 65536;
+        uint64_t init = ((uint64_t)rand() << 32) ^ rand();
+        uint64_t expected = crcspeed64native(crc64_table,init,buf+off,len);
+        if (crc64(init,buf+off,len) != expected) errors++;
+
+        size_t split = len ? rand() % len : 0;
+        uint64_t crc1 = crc64(0,buf+off,split);
+        uint64_t crc2 = crc64(0,buf+off+split,len-split);
+        if (crc64_combine(crc1,crc2,len-split) !=
+            crc64(0,buf+off,len)) errors++;
+    }
+    printf("[%s]: %d mismatches\n",
+#ifdef HAVE_CRC64_CLMUL
+        crc64_clmul_enabled ? "clmul" : "64speed",
+#else
+        "64speed",
+#endif
+        errors);
+    return errors != 0;
 }
 
 #endif
@@ -117,6 +117,7 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
     robj *val;
 
+    rdbForklessKeyAccess(db,key);
     if (expireIfNeeded(db,key) == 1) {
         // key达到过期时间，时效
         // 在一个master环境下，key确保被删除，所以返回null
@@ -178,6 +179,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * 以写操作取出key的值对象，不更新是否命中的信息
  * */
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags) {
+    rdbForklessKeyWrite(db,key);
     // 删除过期键
     expireIfNeeded(db,key);
 
@@ -235,6 +237,7 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  * 程序在键已经存在时会停止。
  */
 void dbAdd(redisDb *db, robj *key, robj *val) {
+    rdbForklessKeyWrite(db,key);
 
     // 复制键名
     sds copy = sdsdup(key->ptr);
@@ -250,9 +253,14 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
         val->type == OBJ_ZSET ||
         val->type == OBJ_STREAM)
         signalKeyAsReady(db, key);
-    ∂∂
+
     // 如果开启了集群模式，则讲key添加到槽中
     if (server.cluster_enabled) slotToKeyAdd(key->ptr);
+
+    // 含有field过期时间的哈希（RENAME/MOVE/RESTORE）需要登记
+    if (val->type == OBJ_HASH && hashTypeGetExpires(val))
+        dbTrackHashFieldExpires(db,key->ptr);
+    if (val->type == OBJ_STREAM) dbTrackStream(db,key->ptr);
 }
 
 /* This is a special version of dbAdd() that is used only when loading
@@ -271,9 +279,29 @@ int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
     int retval = dictAdd(db->dict, key, val);
     if (retval != DICT_OK) return 0;
     if (server.cluster_enabled) slotToKeyAdd(key);
+    if (val->type == OBJ_HASH && hashTypeGetExpires(val))
+        dbTrackHashFieldExpires(db,key);
+    if (val->type == OBJ_STREAM) dbTrackStream(db,key);
     return 1;
 }
 
+/* Remember that the hash stored at 'key' has fields with a TTL, so that the
+ * active expire cycle can sample it. Entries are never removed when the
+ * last volatile field goes away: the cycle drops them once it finds them
+ * stale, and deleting the key drops them as well. */
+void dbTrackHashFieldExpires(redisDb *db, sds key) {
+    if (dictFind(db->hexpires,key) == NULL)
+        dictAdd(db->hexpires,sdsdup(key),NULL);
+}
+
+/* Remember that 'key' holds a stream, so that the stream retention cycle
+ * can visit it without scanning the whole keyspace. Like db->hexpires,
+ * stale entries are dropped by the cycle or when the key is deleted. */
+void dbTrackStream(redisDb *db, sds key) {
+    if (dictFind(db->streams,key) == NULL)
+        dictAdd(db->streams,sdsdup(key),NULL);
+}
+
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  *
@@ -290,6 +318,7 @@ int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
  * 如果键不存在，那么函数停止。
  */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
+    rdbForklessKeyWrite(db,key);
     // 找到保存key的节点地址
     dictEntry *de = dictFind(db->dict,key->ptr);
 
@@ -305,6 +334,9 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
 
     //val设置
     dictSetVal(db->dict, de, val);
+    if (val->type == OBJ_HASH && hashTypeGetExpires(val))
+        dbTrackHashFieldExpires(db,key->ptr);
+    if (val->type == OBJ_STREAM) dbTrackStream(db,key->ptr);
 
     if (server.lazyfree_lazy_server_del) {
         freeObjAsync(old);
@@ -411,10 +443,13 @@ robj *dbRandomKey(redisDb *db) {
  * 删除成功返回 1 ，因为键不存在而导致删除失败时，返回 0 。
  */
 int dbSyncDelete(redisDb *db, robj *key) {
+    rdbForklessKeyWrite(db,key);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     //如果在过期字典中发现该key并且该key的过期时间大于0。则删除过期字典中的key
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if (dictSize(db->hexpires) > 0) dictDelete(db->hexpires,key->ptr);
+    if (dictSize(db->streams) > 0) dictDelete(db->streams,key->ptr);
     //删除数据字典中的key
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         //如果开启了集群模式，从槽位中删除该key
@@ -467,9 +502,14 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     //如果o对象是共享的(refcount > 1)，或者o对象的编码不是RAW的
     if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW) {
         robj *decoded = getDecodedObject(o);    //获取o的字符串类型对象
-        // 根据o的字符串类型对象新创建一个RAW对象
-        o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
-        decrRefCount(decoded);  //原有的对象解除共享
+        if (o->encoding == OBJ_ENCODING_BITMAP) {
+            /* Decoding a bitmap already creates a new raw object. */
+            o = decoded;
+        } else {
+            // 根据o的字符串类型对象新创建一个RAW对象
+            o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
+            decrRefCount(decoded);  //原有的对象解除共享
+        }
         dbOverwrite(db,key,o);  //重写key的val对象此时val对象是唯一的
     }
     return o;
@@ -507,6 +547,9 @@ long long emptyDbGeneric(redisDb *dbarray, int dbnum, int flags, void(callback)(
 
     /* Pre-flush actions */
     if (!backup) {
+        /* A forkless save reads the live keyspace, it can't survive it. */
+        rdbForklessAbort();
+
         /* Fire the flushdb modules event. */
         //触发flushdb模块事件。
         moduleFireServerEvent(REDISMODULE_EVENT_FLUSHDB,
@@ -538,6 +581,8 @@ long long emptyDbGeneric(redisDb *dbarray, int dbnum, int flags, void(callback)(
             dictEmpty(dbarray[j].dict,callback);
             // 删除当前数据库的过期字典
             dictEmpty(dbarray[j].expires,callback);
+            dictEmpty(dbarray[j].hexpires,callback);
+            dictEmpty(dbarray[j].streams,callback);
         }
     }
 
@@ -611,12 +656,14 @@ long long dbTotalServerKeyCount() {
 void signalModifiedKey(client *c, redisDb *db, robj *key) {
     touchWatchedKey(db,key);//key监听通知
     trackingInvalidateKey(c,key);//失效key
+    pfcountCacheInvalidateKey(db,key);
 }
 
 /* 当数据库被清空，调用该函数 */
 void signalFlushedDb(int dbid) {
     touchWatchedKeysOnFlush(dbid);
     trackingInvalidateKeysOnFlush(dbid);
+    pfcountCacheFlush(dbid);
 }
 
 /*-----------------------------------------------------------------------------
@@ -654,6 +701,7 @@ void flushAllDataAndResetRDB(int flags) {
     server.dirty += emptyDb(-1,flags,NULL);
     //如果正在执行RDB，取消执行的进程
     if (server.rdb_child_pid != -1) killRDBChild();
+    rdbForklessAbort();
     //更新RDB文件
     if (server.saveparamslen > 0) {
         /* Normally rdbSave() will reset dirty, but we don't want this here
@@ -880,7 +928,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(dictGetDoubleVal(de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -1026,7 +1074,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
         // 迭代目标是skiplist编码的有序集合对象
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && o->encoding != OBJ_ENCODING_ZIPLIST) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
@@ -1056,14 +1104,37 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count); //没迭代完，或没迭代够count，就继续循环
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_BITMAP &&
+               sizeof(cursor) == sizeof(uint64_t))
+    {
+        /* Bitmaps can be huge, so unlike the other compact encodings they
+         * are scanned incrementally. Elements are visited in ascending
+         * order and the cursor is the next element to return, with the sign
+         * bit flipped so that the smallest possible value maps to zero: this
+         * way elements added or removed during the iteration don't affect
+         * the ones already returned or still to be returned. */
+        roaringIterator ri;
+        int64_t ll;
+
+        roaringInitIterator(&ri,o->ptr);
+        if (cursor) roaringSeekIterator(&ri,(int64_t)(cursor^(1ULL<<63)));
+        cursor = 0;
+        while (roaringNext(&ri,&ll)) {
+            if (listLength(keys) == (unsigned long)count) {
+                cursor = ((uint64_t)ll)^(1ULL<<63);
+                break;
+            }
+            listAddNodeTail(keys,createStringObjectFromLongLong(ll));
+        }
         // 如果是集合对象但编码不是HT是整数集合
     } else if (o->type == OBJ_SET) {
-        int pos = 0;
-        int64_t ll;
+        setTypeIterator *si = setTypeInitIterator(o);
+        sds sdsele;
 
         // 将整数值取出来，构建成字符串对象加入到keys列表中，游标设置为0，表示迭代完成
-        while(intsetGet(o->ptr,pos++,&ll))
-            listAddNodeTail(keys,createStringObjectFromLongLong(ll));
+        while((sdsele = setTypeNextObject(si)) != NULL)
+            listAddNodeTail(keys,createObject(OBJ_STRING,sdsele));
+        setTypeReleaseIterator(si);
         cursor = 0;
         // 如果是哈希对象，或有序集合对象，但是编码都不是HT，是ziplist
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
@@ -1125,6 +1196,10 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         // 迭代目标是数据库，如果kobj是过期键，则过滤
         if (!filter && o == NULL && expireIfNeeded(c->db, kobj)) filter = 1;
 
+        /* Filter hash fields which are logically expired. */
+        if (!filter && o && o->type == OBJ_HASH && sdsEncodedObject(kobj) &&
+            hashTypeFieldIsExpired(o, kobj->ptr)) filter = 1;
+
         /* Remove the element and its associated value if needed. */
         //如果该键满足了上述的过滤条件，那么将其从keys列表删除并释放
         if (filter) {
@@ -1451,21 +1526,33 @@ int dbSwapDatabases(long id1, long id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    rdbForklessAbort();
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
     /* Swap hash tables. Note that we don't swap blocking_keys,
      * ready_keys and watched_keys, since we want clients to
-     * remain in the same DB they were. */
+     * remain in the same DB they were. The PFCOUNT cache describes
+     * the data, so it moves with it. */
     db1->dict = db2->dict;
     db1->expires = db2->expires;
+    db1->hexpires = db2->hexpires;
+    db1->streams = db2->streams;
+    db1->streams_cursor = db2->streams_cursor;
     db1->avg_ttl = db2->avg_ttl;
     db1->expires_cursor = db2->expires_cursor;
+    db1->pfcount_cache = db2->pfcount_cache;
+    db1->pfcount_cache_keys = db2->pfcount_cache_keys;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
+    db2->hexpires = aux.hexpires;
+    db2->streams = aux.streams;
+    db2->streams_cursor = aux.streams_cursor;
     db2->avg_ttl = aux.avg_ttl;
     db2->expires_cursor = aux.expires_cursor;
+    db2->pfcount_cache = aux.pfcount_cache;
+    db2->pfcount_cache_keys = aux.pfcount_cache_keys;
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1527,6 +1614,7 @@ int removeExpire(redisDb *db, robj *key) {
      * main dict. Otherwise, the key will never be freed. */
     // key存在于键值对字典中
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+    rdbForklessKeyWrite(db,key);
     //从过期字典中删除key
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
@@ -1539,6 +1627,7 @@ int removeExpire(redisDb *db, robj *key) {
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
+    rdbForklessKeyWrite(db,key);
     /* Reuse the sds from the main dict in the expire dict */
     //查看该key是存在字典中存在
     kde = dictFind(db->dict,key->ptr);
@@ -1819,18 +1908,23 @@ void getKeysFreeResult(getKeysResult *result) {
 
 /* Helper function to extract keys from following commands:
  * ZUNIONSTORE <destkey> <num-keys> <key> <key> ... <key> <options>
- * ZINTERSTORE <destkey> <num-keys> <key> <key> ... <key> <options> */
-/* 从ZUNIONSTORE、ZINTERSTORE命令中提取key的下标 */
+ * ZINTERSTORE <destkey> <num-keys> <key> <key> ... <key> <options>
+ * ZUNION <num-keys> <key> <key> ... <key> <options>
+ * ZINTER <num-keys> <key> <key> ... <key> <options> */
+/* 从ZUNIONSTORE、ZINTERSTORE、ZUNION、ZINTER命令中提取key的下标 */
 int zunionInterGetKeys(struct redisCommand *cmd, robj **argv, int argc, getKeysResult *result) {
     int i, num, *keys;
-    UNUSED(cmd);
+    /* ZUNION / ZINTER have no storage key. */
+    int store = cmd->proc == zunionstoreCommand ||
+                cmd->proc == zinterstoreCommand;
+    int first = store ? 3 : 2;
 
     //计算key的个数
-    num = atoi(argv[2]->ptr);
+    num = atoi(argv[first-1]->ptr);
     /* Sanity check. Don't return any key if the command is going to
      * reply with syntax error. */
     //语法检查
-    if (num < 1 || num > (argc-3)) {
+    if (num < 1 || num > (argc-first)) {
         result->numkeys = 0;
         return 0;
     }
@@ -1840,15 +1934,38 @@ int zunionInterGetKeys(struct redisCommand *cmd, robj **argv, int argc, getKeysR
      * argv[3...n] = keys to intersect */
     /* Total keys = {union,inter} keys + storage key */
 
-    keys = getKeysPrepareResult(result, num+1);
-    result->numkeys = num+1;
+    keys = getKeysPrepareResult(result, num+store);
+    result->numkeys = num+store;
 
-    /* Add all key positions for argv[3...n] to keys[] */
+    /* Add all key positions for argv[first...n] to keys[] */
     //key的参数的下标，保存在*keys中
-    for (i = 0; i < num; i++) keys[i] = 3+i;
+    for (i = 0; i < num; i++) keys[i] = first+i;
 
     /* Finally add the argv[1] key position (the storage key target). */
-    keys[num] = 1;//设置destkey的下标
+    if (store) keys[num] = 1;//设置destkey的下标
+
+    return result->numkeys;
+}
+
+/* Helper function to extract keys from the following commands:
+ * SINTERCARD <num-keys> <key> <key> ... <key> [LIMIT <limit>] */
+int sintercardGetKeys(struct redisCommand *cmd, robj **argv, int argc, getKeysResult *result) {
+    int i, num, *keys;
+    UNUSED(cmd);
+
+    num = atoi(argv[1]->ptr);
+    /* Sanity check. Don't return any key if the command is going to
+     * reply with syntax error. */
+    if (num < 1 || num > (argc-2)) {
+        result->numkeys = 0;
+        return 0;
+    }
+
+    keys = getKeysPrepareResult(result, num);
+    result->numkeys = num;
+
+    /* Add all key positions for argv[2...n] to keys[] */
+    for (i = 0; i < num; i++) keys[i] = 2+i;
 
     return result->numkeys;
 }
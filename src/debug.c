@@ -177,16 +177,18 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
                 xorDigest(digest,eledigest,20);
                 zzlNext(zl,&eptr,&sptr);
             }
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                   o->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = o->ptr;
             dictIterator *di = dictGetIterator(zs->dict);
             dictEntry *de;
 
             while((de = dictNext(di)) != NULL) {
                 sds sdsele = dictGetKey(de);
-                double *score = dictGetVal(de);
+                double score = dictGetDoubleVal(de);
 
-                snprintf(buf,sizeof(buf),"%.17g",*score);
+                snprintf(buf,sizeof(buf),"%.17g",score);
                 memset(eledigest,0,20);
                 mixDigest(eledigest,sdsele,sdslen(sdsele));
                 mixDigest(eledigest,buf,strlen(buf));
@@ -202,13 +204,21 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
             unsigned char eledigest[20];
             sds sdsele;
 
+            long long when;
+
             memset(eledigest,0,20);
             sdsele = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
             mixDigest(eledigest,sdsele,sdslen(sdsele));
+            when = hashTypeGetFieldExpire(o,sdsele);
             sdsfree(sdsele);
             sdsele = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             mixDigest(eledigest,sdsele,sdslen(sdsele));
             sdsfree(sdsele);
+            if (when != -1) {
+                char buf[128];
+                int len = ll2string(buf,sizeof(buf),when);
+                mixDigest(eledigest,buf,len);
+            }
             xorDigest(digest,eledigest,20);
         }
         hashTypeReleaseIterator(hi);
@@ -485,7 +495,7 @@ NULL
         if (server.aof_state != AOF_OFF) flushAppendOnlyFile(1);
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
         protectClient(c);
-        int ret = loadAppendOnlyFile(server.aof_filename);
+        int ret = loadAppendOnlyFiles(server.aof_manifest);
         unprotectClient(c);
         if (ret != C_OK) {
             addReply(c,shared.err);
@@ -768,6 +778,7 @@ NULL
         /* Get the hash table reference from the object, if possible. */
         switch (o->encoding) {
         case OBJ_ENCODING_SKIPLIST:
+        case OBJ_ENCODING_BTREE:
             {
                 zset *zs = o->ptr;
                 ht = zs->dict;
@@ -876,6 +887,8 @@ void serverLogObjectDebugInfo(const robj *o) {
         serverLog(LL_WARNING,"Sorted set size: %d", (int) zsetLength(o));
         if (o->encoding == OBJ_ENCODING_SKIPLIST)
             serverLog(LL_WARNING,"Skiplist level: %d", (int) ((const zset*)o->ptr)->zsl->level);
+        else if (o->encoding == OBJ_ENCODING_BTREE)
+            serverLog(LL_WARNING,"B+-tree height: %d", ((const zset*)o->ptr)->zbt->height);
     } else if (o->type == OBJ_STREAM) {
         serverLog(LL_WARNING,"Stream size: %d", (int) streamLength(o));
     }
@@ -48,6 +48,7 @@ int je_get_defrag_hint(void* ptr);
 /* forward declarations*/
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref);
 dictEntry* replaceSatelliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, uint64_t hash, long *defragged);
+long defragRoaring(roaring **rref);
 
 /* Defrag helper for generic allocations.
  *
@@ -57,6 +58,8 @@ dictEntry* replaceSatelliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, s
 void* activeDefragAlloc(void *ptr) {
     size_t size;
     void *newptr;
+    /* Adopted from a memory mapped RDB file, not ours to move. */
+    if (zmalloc_is_mapped(ptr)) return NULL;
     if(!je_get_defrag_hint(ptr)) {
         server.stat_active_defrag_misses++;
         size = zmalloc_size(ptr);
@@ -122,6 +125,13 @@ robj *activeDefragStringOb(robj* ob, long *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
+        } else if (ob->encoding==OBJ_ENCODING_BITMAP) {
+            bitmapString *bs = ob->ptr, *newbs;
+            if ((newbs = activeDefragAlloc(bs))) {
+                ob->ptr = bs = newbs;
+                (*defragged)++;
+            }
+            *defragged += defragRoaring(&bs->bits);
         } else if (ob->encoding!=OBJ_ENCODING_INT) {
             serverPanic("Unknown string encoding");
         }
@@ -197,13 +207,12 @@ void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnod
 }
 
 /* Defrag helper for sorted set.
- * Update the robj pointer, defrag the skiplist struct and return the new score
- * reference. We may not access oldele pointer (not even the pointer stored in
- * the skiplist), as it was already freed. Newele may be null, in which case we
- * only need to defrag the skiplist, but not update the obj pointer.
- * When return value is non-NULL, it is the score reference that must be updated
- * in the dict record. */
-double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
+ * Update the robj pointer, defrag the skiplist struct and return 1 if the
+ * skiplist node was moved. We may not access oldele pointer (not even the
+ * pointer stored in the skiplist), as it was already freed. Newele may be
+ * null, in which case we only need to defrag the skiplist, but not update
+ * the obj pointer. */
+int zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
     int i;
     sds ele = newele? newele: oldele;
@@ -233,24 +242,27 @@ double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
     newx = activeDefragAlloc(x);
     if (newx) {
         zslUpdateNode(zsl, x, newx, update);
-        return &newx->score;
+        return 1;
     }
-    return NULL;
+    return 0;
 }
 
 /* Defrag helper for sorted set.
- * Defrag a single dict entry key name, and corresponding skiplist struct */
+ * Defrag a single dict entry key name, and corresponding skiplist struct.
+ * B+-tree nodes hold many elements, so they are defragged separately and
+ * here we only update the element pointer. */
 long activeDefragZsetEntry(zset *zs, dictEntry *de) {
     sds newsds;
-    double* newscore;
     long defragged = 0;
     sds sdsele = dictGetKey(de);
     if ((newsds = activeDefragSds(sdsele)))
         defragged++, de->key = newsds;
-    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-    if (newscore) {
-        dictSetVal(zs->dict, de, newscore);
-        defragged++;
+    if (zs->zbt) {
+        if (newsds)
+            serverAssert(zbtReplaceEle(zs->zbt, dictGetDoubleVal(de),
+                                       sdsele, newsds));
+    } else {
+        defragged += zslDefrag(zs->zsl, dictGetDoubleVal(de), sdsele, newsds);
     }
     return defragged;
 }
@@ -497,7 +509,7 @@ void scanLaterZsetCallback(void *privdata, const dictEntry *_de) {
 }
 
 long scanLaterZset(robj *ob, unsigned long *cursor) {
-    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_SKIPLIST)
+    if (ob->type != OBJ_ZSET || ob->encoding == OBJ_ENCODING_ZIPLIST)
         return 0;
     zset *zs = (zset*)ob->ptr;
     dict *d = zs->dict;
@@ -592,6 +604,40 @@ long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
     return defragged;
 }
 
+/* Like defragZsetSkiplist(). The nodes of the tree are only defragged when
+ * the elements are, that is not for the big sorted sets scanned later: a
+ * node holds dozens of elements, so fragmentation is less of an issue. */
+long defragZsetBtree(redisDb *db, dictEntry *kde) {
+    robj *ob = dictGetVal(kde);
+    long defragged = 0;
+    zset *zs = (zset*)ob->ptr;
+    zset *newzs;
+    zbtree *newzbt;
+    dict *newdict;
+    dictEntry *de;
+    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_BTREE);
+    if ((newzs = activeDefragAlloc(zs)))
+        defragged++, ob->ptr = zs = newzs;
+    if ((newzbt = activeDefragAlloc(zs->zbt)))
+        defragged++, zs->zbt = newzbt;
+    if (dictSize(zs->dict) > server.active_defrag_max_scan_fields)
+        defragLater(db, kde);
+    else {
+        dictIterator *di = dictGetIterator(zs->dict);
+        while((de = dictNext(di)) != NULL) {
+            defragged += activeDefragZsetEntry(zs, de);
+        }
+        dictReleaseIterator(di);
+        defragged += zbtDefragNodes(zs->zbt, activeDefragAlloc);
+    }
+    /* handle the dict struct */
+    if ((newdict = activeDefragAlloc(zs->dict)))
+        defragged++, zs->dict = newdict;
+    /* defrag the dict tables */
+    defragged += dictDefragTables(zs->dict);
+    return defragged;
+}
+
 long defragHash(redisDb *db, dictEntry *kde) {
     long defragged = 0;
     robj *ob = dictGetVal(kde);
@@ -628,6 +674,43 @@ long defragSet(redisDb *db, dictEntry *kde) {
     return defragged;
 }
 
+/* Defrag a roaring bitmap: the roaring struct, the chunks array, the
+ * containers array of every chunk and every container payload are separate
+ * allocations. Since containers are grouped in chunks the number of
+ * allocations is about the number of containers, that is bounded by the
+ * number of elements, so like for small dicts we don't bother deferring the
+ * work to defragLater(). */
+long defragRoaring(roaring **rref) {
+    long defragged = 0;
+    roaring *r = *rref, *newr;
+    roaringChunk *newchunks;
+    roaringContainer *newc;
+    void *newdata;
+    uint32_t i, j;
+
+    if ((newr = activeDefragAlloc(r)))
+        defragged++, *rref = r = newr;
+    if (r->chunks && (newchunks = activeDefragAlloc(r->chunks)))
+        defragged++, r->chunks = newchunks;
+    for (i = 0; i < r->numchunks; i++) {
+        roaringChunk *ch = r->chunks+i;
+
+        if ((newc = activeDefragAlloc(ch->containers)))
+            defragged++, ch->containers = newc;
+        for (j = 0; j < ch->len; j++) {
+            if ((newdata = activeDefragAlloc(ch->containers[j].data)))
+                defragged++, ch->containers[j].data = newdata;
+        }
+    }
+    return defragged;
+}
+
+/* Defrag a bitmap encoded set. */
+long defragSetBitmap(robj *ob) {
+    serverAssert(ob->type == OBJ_SET && ob->encoding == OBJ_ENCODING_BITMAP);
+    return defragRoaring((roaring**)&ob->ptr);
+}
+
 /* Defrag callback for radix tree iterator, called for each node,
  * used in order to defrag the nodes allocations. */
 int defragRaxNode(raxNode **noderef) {
@@ -723,25 +806,15 @@ long defragRadixTree(rax **raxref, int defrag_data, raxDefragFunction *element_c
     return defragged;
 }
 
-typedef struct {
-    streamCG *cg;
-    streamConsumer *c;
-} PendingEntryContext;
-
-void* defragStreamConsumerPendingEntry(raxIterator *ri, void *privdata, long *defragged) {
-    UNUSED(defragged);
-    PendingEntryContext *ctx = privdata;
-    streamNACK *nack = ri->data, *newnack;
-    nack->consumer = ctx->c; /* update nack pointer to consumer */
-    newnack = activeDefragAlloc(nack);
-    if (newnack) {
-        /* update consumer group pointer to the nack */
-        void *prev;
-        raxInsert(ctx->cg->pel, ri->key, ri->key_len, newnack, &prev);
-        serverAssert(prev==nack);
-        /* note: we don't increment 'defragged' that's done by the caller */
-    }
-    return newnack;
+/* PELs are radix trees of flat blocks of entries, there are no pointers
+ * into the blocks held elsewhere so both can be moved freely. */
+long defragStreamPEL(streamPEL **pelref) {
+    long defragged = 0;
+    streamPEL *newpel = activeDefragAlloc(*pelref);
+    if (newpel)
+        defragged++, *pelref = newpel;
+    defragged += defragRadixTree(&(*pelref)->blocks, 1, NULL, NULL);
+    return defragged;
 }
 
 void* defragStreamConsumer(raxIterator *ri, void *privdata, long *defragged) {
@@ -756,8 +829,20 @@ void* defragStreamConsumer(raxIterator *ri, void *privdata, long *defragged) {
     if (newsds)
         (*defragged)++, c->name = newsds;
     if (c->pel) {
-        PendingEntryContext pel_ctx = {cg, c};
-        *defragged += defragRadixTree(&c->pel, 0, defragStreamConsumerPendingEntry, &pel_ctx);
+        /* The NACKs in the group PEL point to the consumer: fix them
+         * if the consumer was moved. */
+        if (newc) {
+            streamPELIterator it;
+            streamID *id;
+            streamPELIteratorStart(&it,c->pel,NULL);
+            while((id = streamPELIteratorNext(&it)) != NULL) {
+                streamNACK *nack = streamPELFind(cg->pel,id);
+                serverAssert(nack != NULL);
+                nack->consumer = c;
+            }
+            streamPELIteratorStop(&it);
+        }
+        *defragged += defragStreamPEL(&c->pel);
     }
     return newc; /* returns NULL if c was not defragged */
 }
@@ -768,7 +853,7 @@ void* defragStreamConsumerGroup(raxIterator *ri, void *privdata, long *defragged
     if (cg->consumers)
         *defragged += defragRadixTree(&cg->consumers, 0, defragStreamConsumer, cg);
     if (cg->pel)
-        *defragged += defragRadixTree(&cg->pel, 0, NULL, NULL);
+        *defragged += defragStreamPEL(&cg->pel);
     return NULL;
 }
 
@@ -842,6 +927,8 @@ long defragKey(redisDb *db, dictEntry *de) {
             intset *newis, *is = ob->ptr;
             if ((newis = activeDefragAlloc(is)))
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_BITMAP) {
+            defragged += defragSetBitmap(ob);
         } else {
             serverPanic("Unknown set encoding");
         }
@@ -851,6 +938,8 @@ long defragKey(redisDb *db, dictEntry *de) {
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
             defragged += defragZsetSkiplist(db, de);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            defragged += defragZsetBtree(db, de);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -554,6 +554,51 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+/* Like dictFind(), but also store in '*table' and '*idx' the hash table and
+ * the bucket holding the entry, and never perform a rehashing step. The
+ * position of an entry is stable only while rehashing is paused, see
+ * dictPauseRehashing(). */
+dictEntry *dictFindPosition(dict *d, const void *key, int *table,
+                            unsigned long *idx)
+{
+    dictEntry *he;
+    uint64_t h;
+    int t;
+
+    if (d->ht[0].used + d->ht[1].used == 0) return NULL;
+    h = dictHashKey(d, key);
+    for (t = 0; t <= 1; t++) {
+        unsigned long i = h & d->ht[t].sizemask;
+
+        for (he = d->ht[t].table[i]; he; he = he->next) {
+            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+                *table = t;
+                *idx = i;
+                return he;
+            }
+        }
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
+/* Prefetch the bucket where 'key' would be stored, so that a dictFind()
+ * of the same key performed a bit later is less likely to miss the cache.
+ * Callers looking up many keys can compute all of them first, prefetch
+ * them, and only then perform the actual lookups. */
+void dictPrefetch(dict *d, const void *key) {
+    uint64_t h, table;
+
+    if (d->ht[0].used + d->ht[1].used == 0) return;
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(&d->ht[table].table[h & d->ht[table].sizemask]);
+#endif
+        if (!dictIsRehashing(d)) break;
+    }
+}
+
 /* 获取字典中指定key的value。 */
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
@@ -1024,6 +1069,35 @@ unsigned long dictScan(dict *d,
     return v;
 }
 
+/* Call 'fn' for every entry stored in the buckets of the slice 'shard' out
+ * of 'numshards' equally sized slices of both hash tables. Every entry lives
+ * in exactly one slice, so different threads can visit different shards of
+ * the same dictionary at the same time, as long as nobody modifies it and
+ * rehashing is paused (see dictPauseRehashing()) while they run. */
+void dictScanShard(dict *d, unsigned long shard, unsigned long numshards,
+                   dictScanFunction *fn, void *privdata)
+{
+    int table;
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        unsigned long idx, start, end;
+
+        if (ht->size == 0) continue;
+        start = ht->size / numshards * shard;
+        end = (shard == numshards-1) ? ht->size :
+                                       ht->size / numshards * (shard+1);
+        for (idx = start; idx < end; idx++) {
+            const dictEntry *de = ht->table[idx], *next;
+            while (de) {
+                next = de->next;
+                fn(privdata, de);
+                de = next;
+            }
+        }
+    }
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
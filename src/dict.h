@@ -159,6 +159,8 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)      //获取字典中哈希表的总长度，总长度=哈希表1散列数组长度+哈希表2散列数组长度
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)       //获取字典中哈希表已被使用的节点数量，已被使用的节点数量=哈希表1散列数组已被使用的节点数量+哈希表2散列数组已被使用的节点数量
 #define dictIsRehashing(d) ((d)->rehashidx != -1)           //字典当前是否正在进行rehash操作
+#define dictPauseRehashing(d) ((d)->iterators++)
+#define dictResumeRehashing(d) ((d)->iterators--)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);        //创建一个字典
@@ -172,7 +174,9 @@ dictEntry *dictUnlink(dict *ht, const void *key);           //根据key删除字
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he);         //释放字典中的一个key-value对
 void dictRelease(dict *d);                                  //释放一个字典
 dictEntry * dictFind(dict *d, const void *key);             //根据key在字典中查找一个key-value对
+dictEntry *dictFindPosition(dict *d, const void *key, int *table, unsigned long *idx);
 void *dictFetchValue(dict *d, const void *key);             //根据key从字典中获取它对应的value
+void dictPrefetch(dict *d, const void *key);
 int dictResize(dict *d);                                    //重新计算并设置字典的哈希数组大小，调整到能包含所有元素的最小大小
 dictIterator *dictGetIterator(dict *d);                     //获取一个字典的普通（非安全）迭代器
 dictIterator *dictGetSafeIterator(dict *d);                 //获取一个字典的安全迭代器
@@ -192,6 +196,7 @@ int dictRehashMilliseconds(dict *d, int ms);                //在ms时间内reha
 void dictSetHashFunctionSeed(uint8_t *seed);                //设置rehash函数种子
 uint8_t *dictGetHashFunctionSeed(void);                     //获取rehash函数种子
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);//遍历整个字典，每次访问一个元素都会调用fn操作其数据
+void dictScanShard(dict *d, unsigned long shard, unsigned long numshards, dictScanFunction *fn, void *privdata);
 uint64_t dictGetHash(dict *d, const void *key);             //获取当前字典指定key的哈希值
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);   //通过使用指针和预先计算的哈希查找dictEntry引用
 
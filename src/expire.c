@@ -119,6 +119,62 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* Max % of CPU to use. */
 #define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 10 /* % of stale keys after which
                                                    we do extra efforts. */
+#define ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY 20 /* Fields sampled per hash. */
+
+/* Helper function for the activeExpireCycle() function.
+ * Sample up to 'num' random hashes among the ones having fields with a TTL,
+ * and up to ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY fields of each, reclaiming
+ * the expired ones. The counters of sampled and expired fields are
+ * incremented. Hashes registered in db->hexpires that no longer have any
+ * volatile field are unregistered. */
+void activeExpireHashFields(redisDb *db, unsigned long num, long long now,
+                            unsigned long *sampled, unsigned long *expired)
+{
+    while (num-- && dictSize(db->hexpires)) {
+        dictEntry *de = dictGetRandomKey(db->hexpires);
+        dictEntry *fields[ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY];
+        sds names[ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY];
+        sds key = dictGetKey(de);
+        robj *o, *keyobj, statickey;
+        dict *ttls;
+        unsigned int count, j, n = 0;
+
+        /* Sampling the TTL index may rehash it: a forkless save must be
+         * done with the hash first. */
+        initStaticStringObject(statickey,key);
+        rdbForklessKeyAccess(db,&statickey);
+        o = dictFetchValue(db->dict,key);
+        ttls = (o && o->type == OBJ_HASH) ? hashTypeGetExpires(o) : NULL;
+
+        if (ttls == NULL) {
+            dictDelete(db->hexpires,key);
+            continue;
+        }
+
+        /* Copy the names of the expired fields first: deleting a field
+         * releases the entry of the TTL index, and the index itself when
+         * it becomes empty. */
+        count = dictSize(ttls) < ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY ?
+                dictSize(ttls) : ACTIVE_EXPIRE_CYCLE_FIELDS_PER_KEY;
+        count = dictGetSomeKeys(ttls,fields,count);
+        for (j = 0; j < count; j++) {
+            (*sampled)++;
+            if (now > dictGetSignedIntegerVal(fields[j]))
+                names[n++] = sdsdup(dictGetKey(fields[j]));
+        }
+        if (n == 0) continue;
+
+        keyobj = createStringObject(key,sdslen(key));
+        for (j = 0; j < n; j++) {
+            /* Once the hash is gone the remaining names are just freed. */
+            if (o && hashTypeDeleteExpiredField(db,keyobj,o,names[j]))
+                o = NULL;
+            sdsfree(names[j]);
+        }
+        *expired += n;
+        decrRefCount(keyobj);
+    }
+}
 
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
@@ -399,6 +455,26 @@ void activeExpireCycle(int type) {
              * not reclaimed). */
         } while (sampled == 0 ||
                  (expired*100/sampled) > config_cycle_acceptable_stale);
+
+        /* Then the hashes having fields with a TTL, with the same adaptive
+         * logic: keep going while many of the sampled fields are expired. */
+        while (!timelimit_exit && dictSize(db->hexpires)) {
+            expired = 0;
+            sampled = 0;
+            iteration++;
+            activeExpireHashFields(db,config_keys_per_loop,mstime(),
+                                   &sampled,&expired);
+            if ((iteration & 0xf) == 0) {
+                elapsed = ustime()-start;
+                if (elapsed > timelimit) {
+                    timelimit_exit = 1;
+                    server.stat_expired_time_cap_reached_count++;
+                    break;
+                }
+            }
+            if (sampled == 0 ||
+                (expired*100/sampled) <= config_cycle_acceptable_stale) break;
+        }
     }
 
     elapsed = ustime()-start;
@@ -32,6 +32,8 @@
 #include "geohash_helper.h"
 #include "debugmacro.h"
 
+#include <math.h>
+
 /* Things exported from t_zset.c only for geo.c, since it is the only other
  * part of Redis that requires close zset introspection. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
@@ -56,6 +58,7 @@ geoArray *geoArrayCreate(void) {
     ga->array = NULL;
     ga->buckets = 0;
     ga->used = 0;
+    ga->limit = 0;
     return ga;
 }
 
@@ -71,6 +74,25 @@ geoPoint *geoArrayAppend(geoArray *ga) {
     return gp;
 }
 
+/* Restore the max-heap property of a bounded geoArray (see 'limit'), where
+ * the farthest point is at the root, starting at index 'j'. */
+static void geoArraySiftDown(geoArray *ga, size_t j) {
+    geoPoint *a = ga->array;
+
+    while (1) {
+        size_t child = j*2+1, largest = j;
+        if (child < ga->used && a[child].dist > a[largest].dist)
+            largest = child;
+        if (child+1 < ga->used && a[child+1].dist > a[largest].dist)
+            largest = child+1;
+        if (largest == j) break;
+        geoPoint tmp = a[j];
+        a[j] = a[largest];
+        a[largest] = tmp;
+        j = largest;
+    }
+}
+
 /* Destroy a geoArray created with geoArrayCreate(). */
 void geoArrayFree(geoArray *ga) {
     size_t i;
@@ -185,13 +207,27 @@ void addReplyDoubleDistance(client *c, double d) {
 /* Helper function for geoGetPointsInRange(): given a sorted set score
  * representing a point, and another point (the center of our search) and
  * a radius, appends this entry as a geoPoint into the specified geoArray
- * only if the point is within the search area.
+ * only if the point is within the search area. The member is given as
+ * the string 'ele' of length 'elelen', or as the integer 'elelong' if 'ele'
+ * is NULL, and it is only copied if the point is included.
+ *
+ * If the array has a 'limit' and is full, the point replaces the farthest
+ * one if it is nearer, otherwise it is discarded.
  *
  * returns C_OK if the point is included, or REIDS_ERR if it is outside. */
-int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius, double score, sds member) {
+int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius, double score, const char *ele, size_t elelen, long long elelong) {
     double distance, xy[2];
+    int full = ga->limit && ga->used == ga->limit;
+    geoPoint *gp;
 
     if (!decodeGeohash(score,xy)) return C_ERR; /* Can't decode. */
+    if (full && ga->array[0].dist < radius) radius = ga->array[0].dist;
+
+    /* The distance along the meridian is a lower bound of the distance,
+     * and it is much cheaper to check than the actual distance. */
+    if (fabs(xy[1]-lat) * DEG_TO_RAD * EARTH_RADIUS_IN_METERS >
+        radius*1.000001) return C_ERR;
+
     /* Note that geohashGetDistanceIfInRadiusWGS84() takes arguments in
      * reverse order: longitude first, latitude later. */
     if (!geohashGetDistanceIfInRadiusWGS84(lon,lat, xy[0], xy[1],
@@ -200,13 +236,28 @@ int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius,
         return C_ERR;
     }
 
-    /* Append the new element. */
-    geoPoint *gp = geoArrayAppend(ga);
+    if (full) {
+        /* Replace the farthest point. */
+        if (distance >= ga->array[0].dist) return C_ERR;
+        gp = ga->array;
+        sdsfree(gp->member);
+    } else {
+        /* Append the new element. */
+        gp = geoArrayAppend(ga);
+    }
     gp->longitude = xy[0];
     gp->latitude = xy[1];
     gp->dist = distance;
-    gp->member = member;
+    gp->member = ele ? sdsnewlen(ele,elelen) : sdsfromlonglong(elelong);
     gp->score = score;
+
+    if (full) {
+        geoArraySiftDown(ga,0);
+    } else if (ga->limit && ga->used == ga->limit) {
+        /* The array just became full: turn it into a heap. */
+        size_t j = ga->used/2;
+        while (j--) geoArraySiftDown(ga,j);
+    }
     return C_OK;
 }
 
@@ -227,7 +278,6 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
     /* That's: min <= val < max */
     zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
     size_t origincount = ga->used;
-    sds member;
 
     if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
@@ -252,10 +302,8 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
 
             /* We know the element exists. ziplistGet should always succeed */
             ziplistGet(eptr, &vstr, &vlen, &vlong);
-            member = (vstr == NULL) ? sdsfromlonglong(vlong) :
-                                      sdsnewlen(vstr,vlen);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,member)
-                == C_ERR) sdsfree(member);
+            geoAppendIfWithinRadius(ga,lon,lat,radius,score,
+                                    (char*)vstr,vlen,vlong);
             zzlNext(zl, &eptr, &sptr);
         }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -274,11 +322,31 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             if (!zslValueLteMax(ln->score, &range))
                 break;
 
-            ele = sdsdup(ele);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,ln->score,ele)
-                == C_ERR) sdsfree(ele);
+            geoAppendIfWithinRadius(ga,lon,lat,radius,ln->score,
+                                    ele,sdslen(ele),0);
             ln = ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        int found;
+
+        if (!zbtFirstInRange(zs->zbt, &range, &it)) {
+            /* Nothing exists starting at our min.  No results. */
+            return 0;
+        }
+
+        do {
+            double score = zbtIterScore(&it);
+            /* Abort when the node is no longer in range. */
+            if (!zslValueLteMax(score, &range))
+                break;
+
+            sds ele = zbtIterEle(&it);
+            geoAppendIfWithinRadius(ga,lon,lat,radius,score,
+                                    ele,sdslen(ele),0);
+            found = zbtNext(&it);
+        } while (found);
     }
     return ga->used - origincount;
 }
@@ -322,11 +390,183 @@ int membersOfGeoHashBox(robj *zobj, GeoHashBits hash, geoArray *ga, double lon,
     return geoGetPointsInRange(zobj, min, max, lon, lat, radius, ga);
 }
 
+/* Every one of the 9 search boxes is split into cells up to
+ * GEO_CELL_REFINE_STEPS steps smaller, and only the cells that may contain
+ * points within the radius are scanned. When the radius is large compared to
+ * the boxes, or the search area is near the border of a box, this avoids
+ * scanning, and computing the distance of, most of the points in the boxes.
+ * The cost is an additional range lookup per cell, so small sorted sets
+ * encoded as ziplists, where lookups are linear, are not refined.
+ *
+ * When only the nearest points are needed the cells are instead visited
+ * nearest first, and the cells holding more than GEO_CELL_SPLIT_POINTS
+ * points are split again, so that the search quickly narrows down to the
+ * neighborhood of the center whatever the density of the points, and stops
+ * as soon as the remaining cells are farther than the points found. */
+#define GEO_CELL_REFINE_STEPS 2
+#define GEO_CELL_MAX (9*(1<<(GEO_CELL_REFINE_STEPS*2)))
+#define GEO_CELL_SPLIT_POINTS 64
+
+typedef struct geoCell {
+    GeoHashBits hash;
+    double mindist;     /* Lower bound of the distance of the cell points. */
+} geoCell;
+
+/* Return the number of elements of the sorted set with a score in the
+ * range min (inclusive) to max (exclusive), counting at most 'maxcount'. */
+static unsigned long geoCountInRange(robj *zobj, double min, double max,
+                                     unsigned long maxcount)
+{
+    zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
+    unsigned long count = 0;
+
+    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        unsigned char *zl = zobj->ptr;
+        unsigned char *eptr, *sptr;
+
+        if ((eptr = zzlFirstInRange(zl, &range)) == NULL) return 0;
+        sptr = ziplistNext(zl, eptr);
+        while (eptr && count < maxcount) {
+            if (!zslValueLteMax(zzlGetScore(sptr), &range)) break;
+            count++;
+            zzlNext(zl, &eptr, &sptr);
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        zset *zs = zobj->ptr;
+        zskiplistNode *ln;
+
+        if ((ln = zslFirstInRange(zs->zsl, &range)) == NULL) return 0;
+        while (ln && count < maxcount) {
+            if (!zslValueLteMax(ln->score, &range)) break;
+            count++;
+            ln = ln->level[0].forward;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        int found;
+
+        if (!zbtFirstInRange(zs->zbt, &range, &it)) return 0;
+        do {
+            if (!zslValueLteMax(zbtIterScore(&it), &range)) break;
+            count++;
+            found = zbtNext(&it);
+        } while (found && count < maxcount);
+    }
+    return count;
+}
+
+/* Binary heap of cells, nearest cell first. */
+static void geoCellHeapPush(geoCell **heap, int *len, int *alloc,
+                            geoCell cell)
+{
+    int j;
+
+    if (*len == *alloc) {
+        *alloc = *alloc ? *alloc*2 : 64;
+        *heap = zrealloc(*heap,sizeof(geoCell)*(*alloc));
+    }
+    j = (*len)++;
+    while (j > 0 && (*heap)[(j-1)/2].mindist > cell.mindist) {
+        (*heap)[j] = (*heap)[(j-1)/2];
+        j = (j-1)/2;
+    }
+    (*heap)[j] = cell;
+}
+
+static geoCell geoCellHeapPop(geoCell *heap, int *len) {
+    geoCell top = heap[0], last = heap[--(*len)];
+    int j = 0;
+
+    while (1) {
+        int child = j*2+1;
+        if (child >= *len) break;
+        if (child+1 < *len && heap[child+1].mindist < heap[child].mindist)
+            child++;
+        if (heap[child].mindist >= last.mindist) break;
+        heap[j] = heap[child];
+        j = child;
+    }
+    if (*len) heap[j] = last;
+    return top;
+}
+
+/* Append to 'cells' the cells, up to 'levels' steps smaller than 'hash',
+ * covering the part of 'hash' that is within 'radius' from lon,lat. */
+static void geoCellsCover(geoCell *cells, int *numcells, GeoHashBits hash,
+                          int levels, double lon, double lat, double radius)
+{
+    GeoHashArea area;
+    double mindist;
+    int j;
+
+    geohashDecodeWGS84(hash,&area);
+    mindist = geohashGetDistanceToArea(lon,lat,&area);
+    /* Leave some room for rounding errors: the bound is computed with
+     * different operations than the actual distances. */
+    if (mindist > radius*1.000001) return;
+    if (levels == 0 || hash.step >= GEO_STEP_MAX) {
+        cells[*numcells].hash = hash;
+        cells[*numcells].mindist = mindist;
+        (*numcells)++;
+        return;
+    }
+    for (j = 0; j < 4; j++) {
+        GeoHashBits child = { .bits = (hash.bits << 2) | j,
+                              .step = hash.step + 1 };
+        geoCellsCover(cells,numcells,child,levels-1,lon,lat,radius);
+    }
+}
+
+/* Search the cells nearest first, splitting the ones with many points, and
+ * stop once the array holds 'limit' points nearer than the next cell. */
+static int membersOfNearestCells(robj *zobj, geoCell *cells, int numcells,
+                                 double lon, double lat, double radius,
+                                 geoArray *ga)
+{
+    geoCell *heap = NULL;
+    int len = 0, alloc = 0, count = 0, i;
+
+    for (i = 0; i < numcells; i++)
+        geoCellHeapPush(&heap,&len,&alloc,cells[i]);
+
+    while (len) {
+        geoCell cell = geoCellHeapPop(heap,&len);
+        double maxdist = radius;
+
+        if (ga->used == ga->limit && ga->array[0].dist < maxdist)
+            maxdist = ga->array[0].dist;
+        if (cell.mindist > maxdist*1.000001) break;
+
+        if (cell.hash.step < GEO_STEP_MAX) {
+            GeoHashFix52Bits min, max;
+
+            scoresOfGeoHashBox(cell.hash,&min,&max);
+            if (geoCountInRange(zobj,min,max,GEO_CELL_SPLIT_POINTS+1) >
+                GEO_CELL_SPLIT_POINTS)
+            {
+                int children = 0;
+                geoCell child[4];
+
+                geoCellsCover(child,&children,cell.hash,1,lon,lat,maxdist);
+                for (i = 0; i < children; i++)
+                    geoCellHeapPush(&heap,&len,&alloc,child[i]);
+                continue;
+            }
+        }
+        count += membersOfGeoHashBox(zobj, cell.hash, ga, lon, lat, radius);
+    }
+    zfree(heap);
+    return count;
+}
+
 /* Search all eight neighbors + self geohash box */
 int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, double radius, geoArray *ga) {
     GeoHashBits neighbors[9];
-    unsigned int i, count = 0, last_processed = 0;
-    int debugmsg = 0;
+    geoCell cells[GEO_CELL_MAX];
+    int levels = (zobj->encoding == OBJ_ENCODING_ZIPLIST || ga->limit) ?
+                 0 : GEO_CELL_REFINE_STEPS;
+    int i, j, numcells = 0, count = 0;
 
     neighbors[0] = n.hash;
     neighbors[1] = n.neighbors.north;
@@ -338,45 +578,28 @@ int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, d
     neighbors[7] = n.neighbors.south_east;
     neighbors[8] = n.neighbors.south_west;
 
-    /* For each neighbor (*and* our own hashbox), get all the matching
-     * members and add them to the potential result list. */
-    for (i = 0; i < sizeof(neighbors) / sizeof(*neighbors); i++) {
-        if (HASHISZERO(neighbors[i])) {
-            if (debugmsg) D("neighbors[%d] is zero",i);
-            continue;
-        }
-
-        /* Debugging info. */
-        if (debugmsg) {
-            GeoHashRange long_range, lat_range;
-            geohashGetCoordRange(&long_range,&lat_range);
-            GeoHashArea myarea = {{0}};
-            geohashDecode(long_range, lat_range, neighbors[i], &myarea);
-
-            /* Dump center square. */
-            D("neighbors[%d]:\n",i);
-            D("area.longitude.min: %f\n", myarea.longitude.min);
-            D("area.longitude.max: %f\n", myarea.longitude.max);
-            D("area.latitude.min: %f\n", myarea.latitude.min);
-            D("area.latitude.max: %f\n", myarea.latitude.max);
-            D("\n");
-        }
+    /* For each neighbor (*and* our own hashbox), get the cells that may
+     * contain matching members. */
+    for (i = 0; i < 9; i++) {
+        if (HASHISZERO(neighbors[i])) continue;
 
         /* When a huge Radius (in the 5000 km range or more) is used,
          * adjacent neighbors can be the same, leading to duplicated
-         * elements. Skip every range which is the same as the one
-         * processed previously. */
-        if (last_processed &&
-            neighbors[i].bits == neighbors[last_processed].bits &&
-            neighbors[i].step == neighbors[last_processed].step)
-        {
-            if (debugmsg)
-                D("Skipping processing of %d, same as previous\n",i);
-            continue;
+         * elements. Skip every box which is the same as one already
+         * processed. */
+        for (j = 0; j < i; j++) {
+            if (neighbors[i].bits == neighbors[j].bits &&
+                neighbors[i].step == neighbors[j].step) break;
         }
-        count += membersOfGeoHashBox(zobj, neighbors[i], ga, lon, lat, radius);
-        last_processed = i;
+        if (j != i) continue;
+        geoCellsCover(cells,&numcells,neighbors[i],levels,lon,lat,radius);
     }
+
+    if (ga->limit)
+        return membersOfNearestCells(zobj,cells,numcells,lon,lat,radius,ga);
+
+    for (i = 0; i < numcells; i++)
+        count += membersOfGeoHashBox(zobj, cells[i].hash, ga, lon, lat, radius);
     return count;
 }
 
@@ -560,8 +783,10 @@ void georadiusGeneric(client *c, int flags) {
     GeoHashRadius georadius =
         geohashGetAreasByRadiusWGS84(xy[0], xy[1], radius_meters);
 
-    /* Search the zset for all matching points */
+    /* Search the zset for all matching points. With COUNT and ASC only the
+     * nearest 'count' points are retained while searching. */
     geoArray *ga = geoArrayCreate();
+    if (count != 0 && sort == SORT_ASC) ga->limit = count;
     membersOfAllNeighbors(zobj, georadius, xy[0], xy[1], radius_meters, ga);
 
     /* If no matching results, the user gets an empty reply. */
@@ -643,15 +868,13 @@ void georadiusGeneric(client *c, int flags) {
         }
 
         for (i = 0; i < returned_items; i++) {
-            zskiplistNode *znode;
             geoPoint *gp = ga->array+i;
             gp->dist /= conversion; /* Fix according to unit. */
             double score = storedist ? gp->dist : gp->score;
             size_t elelen = sdslen(gp->member);
 
             if (maxelelen < elelen) maxelelen = elelen;
-            znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            zsetInsert(zs,score,gp->member);
             gp->member = NULL;
         }
 
@@ -17,6 +17,7 @@ typedef struct geoArray {
     struct geoPoint *array;
     size_t buckets;
     size_t used;
+    size_t limit;   /* If not zero, only keep the 'limit' nearest points. */
 } geoArray;
 
 #endif
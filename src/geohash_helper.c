@@ -220,6 +220,36 @@ double geohashGetDistance(double lon1d, double lat1d, double lon2d, double lat2d
            asin(sqrt(u * u + cos(lat1r) * cos(lat2r) * v * v));
 }
 
+/* Return a lower bound of the distance between lon,lat and the points of
+ * 'area', used in order to discard the areas of a radius search that can't
+ * contain any matching point. Every factor of the haversine formula used
+ * by geohashGetDistance() is replaced by its minimum over the area: the
+ * smallest latitude and longitude differences, and the smallest cosine of
+ * the latitudes of the area. */
+double geohashGetDistanceToArea(double lon, double lat,
+                                const GeoHashArea *area) {
+    double dlat = 0, dlon = 0, coslat, u, v, a;
+
+    if (lat < area->latitude.min) dlat = area->latitude.min - lat;
+    else if (lat > area->latitude.max) dlat = lat - area->latitude.max;
+    if (lon < area->longitude.min || lon > area->longitude.max) {
+        double d1 = fabs(lon - area->longitude.min);
+        double d2 = fabs(lon - area->longitude.max);
+        if (d1 > 180) d1 = 360 - d1;
+        if (d2 > 180) d2 = 360 - d2;
+        dlon = d1 < d2 ? d1 : d2;
+    }
+    coslat = cos(deg_rad(area->latitude.min));
+    if (cos(deg_rad(area->latitude.max)) < coslat)
+        coslat = cos(deg_rad(area->latitude.max));
+
+    u = sin(deg_rad(dlat) / 2);
+    v = sin(deg_rad(dlon) / 2);
+    a = u * u + cos(deg_rad(lat)) * coslat * v * v;
+    if (a > 1) a = 1;
+    return 2.0 * EARTH_RADIUS_IN_METERS * asin(sqrt(a));
+}
+
 int geohashGetDistanceIfInRadius(double x1, double y1,
                                  double x2, double y2, double radius,
                                  double *distance) {
@@ -38,6 +38,9 @@
 #define GISZERO(s) (!s.bits && !s.step)
 #define GISNOTZERO(s) (s.bits || s.step)
 
+extern const double EARTH_RADIUS_IN_METERS;
+extern const double DEG_TO_RAD;
+
 typedef uint64_t GeoHashFix52Bits;
 typedef uint64_t GeoHashVarBits;
 
@@ -58,6 +61,8 @@ GeoHashRadius geohashGetAreasByRadiusWGS84(double longitude, double latitude,
 GeoHashRadius geohashGetAreasByRadiusMercator(double longitude, double latitude,
                                               double radius_meters);
 GeoHashFix52Bits geohashAlign52Bits(const GeoHashBits hash);
+double geohashGetDistanceToArea(double lon, double lat,
+                                const GeoHashArea *area);
 double geohashGetDistance(double lon1d, double lat1d,
                           double lon2d, double lat2d);
 int geohashGetDistanceIfInRadius(double x1, double y1,
@@ -34,6 +34,10 @@
 #include <stdint.h>
 #include <math.h>
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* The Redis HyperLogLog implementation is based on the following ideas:
  *
  * * The use of a 64 bit hash function as proposed in [1], in order to estimate
@@ -515,10 +519,161 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     return hllDenseSet(registers,index,count);
 }
 
+/* Merging and counting need all the registers of a dense HLL, so instead of
+ * extracting them one by one with HLL_DENSE_GET_REGISTER, they are converted
+ * in bulk between the packed 6 bit format and an array of HLL_REGISTERS
+ * bytes (the HLL_RAW format). On x86 CPUs with AVX2, detected at runtime,
+ * 32 registers are processed per iteration; the few registers at the edges
+ * of the array, where a full vector load would read out of bounds, and all
+ * the other CPUs, use the scalar code. */
+#define HLL_SIMD_NONE 0
+#define HLL_SIMD_AVX2 1
+
+static int hll_simd = -1; /* Detected on first use. */
+
+static int hllSimdLevel(void) {
+    if (hll_simd == -1) {
+        hll_simd = HLL_SIMD_NONE;
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (HLL_BITS == 6 && __builtin_cpu_supports("avx2"))
+            hll_simd = HLL_SIMD_AVX2;
+#endif
+    }
+    return hll_simd;
+}
+
+/* Set max[j] to MAX(max[j],register[j]) for the registers from 'start' to
+ * 'end' (exclusive) of the dense registers at 'registers'. */
+static void hllMergeDenseRange(uint8_t *max, uint8_t *registers,
+                               int start, int end)
+{
+    uint8_t val;
+    int j;
+
+    for (j = start; j < end; j++) {
+        HLL_DENSE_GET_REGISTER(val,registers,j);
+        if (val > max[j]) max[j] = val;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* Every three bytes hold four registers:
+ *
+ *   {bbaaaaaa|ccccbbbb|ddddddcc}
+ *
+ * 32 bytes are loaded starting 4 bytes before the first register to merge,
+ * so that the 24 bytes of interest are at offset 4-15 of the low lane and
+ * 0-11 of the high lane. A byte shuffle moves every group of three bytes in
+ * its own 32 bit integer, then the four registers are moved in place with
+ * masks and shifts, one register per byte, and merged with a byte max. */
+__attribute__((target("avx2")))
+static void hllMergeDenseAVX2(uint8_t *max, uint8_t *registers) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        4,5,6,-1, 7,8,9,-1, 10,11,12,-1, 13,14,15,-1,
+        0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+    const __m256i m0 = _mm256_set1_epi32(0x0000003f);
+    const __m256i m1 = _mm256_set1_epi32(0x00000fc0);
+    const __m256i m2 = _mm256_set1_epi32(0x0003f000);
+    const __m256i m3 = _mm256_set1_epi32(0x00fc0000);
+    const uint8_t *p = registers+2; /* Register 8 starts at byte 6. */
+    uint8_t *t = max+8;
+    int j;
+
+    hllMergeDenseRange(max,registers,0,8);
+    for (j = 0; j < HLL_REGISTERS/32-1; j++) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        x = _mm256_shuffle_epi8(x,shuffle);
+        __m256i r0 = _mm256_and_si256(x,m0);
+        __m256i r1 = _mm256_slli_epi32(_mm256_and_si256(x,m1),2);
+        __m256i r2 = _mm256_slli_epi32(_mm256_and_si256(x,m2),4);
+        __m256i r3 = _mm256_slli_epi32(_mm256_and_si256(x,m3),6);
+        __m256i regs = _mm256_or_si256(_mm256_or_si256(r0,r1),
+                                       _mm256_or_si256(r2,r3));
+        __m256i cur = _mm256_loadu_si256((const __m256i*)t);
+        _mm256_storeu_si256((__m256i*)t,_mm256_max_epu8(cur,regs));
+        p += 24;
+        t += 32;
+    }
+    hllMergeDenseRange(max,registers,HLL_REGISTERS-24,HLL_REGISTERS);
+}
+
+/* The reverse of hllMergeDenseAVX2(): the bytes of every group of four
+ * registers are combined into a 24 bit integer with two multiply-add
+ * operations (a|b<<6 and c|d<<6 first, then the two halves), the three
+ * low bytes of every integer are packed at the start of each lane, and the
+ * two lanes are joined. Every store writes 24 bytes of registers followed
+ * by 8 bytes that are overwritten by the next iteration, so the last 32
+ * registers are handled by the scalar code. */
+__attribute__((target("avx2")))
+static void hllDenseFromRawAVX2(uint8_t *registers, const uint8_t *raw) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+    const __m256i join = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+    const __m256i mul6 = _mm256_set1_epi16(0x4001);
+    const __m256i mul12 = _mm256_set1_epi32(0x10000001);
+    uint8_t *p = registers;
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS/32-1; j++) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(raw+j*32));
+        x = _mm256_maddubs_epi16(x,mul6);
+        x = _mm256_madd_epi16(x,mul12);
+        x = _mm256_shuffle_epi8(x,shuffle);
+        x = _mm256_permutevar8x32_epi32(x,join);
+        _mm256_storeu_si256((__m256i*)p,x);
+        p += 24;
+    }
+    for (j = HLL_REGISTERS-32; j < HLL_REGISTERS; j++)
+        HLL_DENSE_SET_REGISTER(registers,j,raw[j]);
+}
+#endif
+
+/* Merge the dense registers at 'registers' into the array of HLL_REGISTERS
+ * bytes 'max', setting max[j] to MAX(max[j],register[j]). */
+void hllMergeDense(uint8_t *max, uint8_t *registers) {
+#ifdef HAVE_X86_SIMD
+    if (hllSimdLevel() == HLL_SIMD_AVX2) {
+        hllMergeDenseAVX2(max,registers);
+        return;
+    }
+#endif
+    hllMergeDenseRange(max,registers,0,HLL_REGISTERS);
+}
+
+/* Overwrite all the dense registers at 'registers' with the values of
+ * the array of HLL_REGISTERS bytes 'raw', each at most HLL_REGISTER_MAX. */
+void hllDenseFromRaw(uint8_t *registers, const uint8_t *raw) {
+    int j;
+
+#ifdef HAVE_X86_SIMD
+    if (hllSimdLevel() == HLL_SIMD_AVX2) {
+        hllDenseFromRawAVX2(registers,raw);
+        return;
+    }
+#endif
+    for (j = 0; j < HLL_REGISTERS; j++)
+        HLL_DENSE_SET_REGISTER(registers,j,raw[j]);
+}
+
+void hllRawRegHisto(uint8_t *registers, int* reghisto);
+
 /* Compute the register histogram in the dense representation. */
 void hllDenseRegHisto(uint8_t *registers, int* reghisto) {
     int j;
 
+    /* With SIMD support it is faster to expand the registers into bytes
+     * and take the histogram of those. */
+    if (hllSimdLevel() != HLL_SIMD_NONE) {
+        uint8_t raw[HLL_REGISTERS];
+
+        memset(raw,0,sizeof(raw));
+        hllMergeDense(raw,registers);
+        hllRawRegHisto(raw,reghisto);
+        return;
+    }
+
     /* Redis default is to use 16384 registers 6 bits each. The code works
      * with other values by modifying the defines, but for our target value
      * we take a faster path with unrolled loops. */
@@ -636,6 +791,22 @@ int hllSparseToDense(robj *o) {
     return C_OK;
 }
 
+/* Make sure the sparse representation has room for the 3 bytes an update
+ * may add. The buffer grows geometrically, so that a sparse HLL reaching
+ * hll-sparse-max-bytes is only reallocated a logarithmic number of times,
+ * but never beyond the size at which it gets promoted to dense, since that
+ * space would never be used. */
+static void hllSparseMakeRoom(robj *o) {
+    size_t len = sdslen(o->ptr), size, limit;
+
+    if (sdsavail(o->ptr) >= 3) return;
+    size = len*2;
+    limit = server.hll_sparse_max_bytes+3;
+    if (size > limit) size = limit;
+    if (size < len+3) size = len+3;
+    o->ptr = sdsMakeRoomForNonGreedy(o->ptr,size-len);
+}
+
 /* Low level function to set the sparse HLL register at 'index' to the
  * specified value if the current value is smaller than 'count'.
  *
@@ -666,7 +837,7 @@ int hllSparseSet(robj *o, long index, uint8_t count) {
      * into XZERO-VAL-XZERO). Make sure there is enough space right now
      * so that the pointers we take during the execution of the function
      * will be valid all the time. */
-    o->ptr = sdsMakeRoomFor(o->ptr,3);
+    hllSparseMakeRoom(o);
 
     /* Step 1: we need to locate the opcode we need to modify to check
      * if a value update is actually needed. */
@@ -1070,12 +1241,7 @@ int hllMerge(uint8_t *max, robj *hll) {
     int i;
 
     if (hdr->encoding == HLL_DENSE) {
-        uint8_t val;
-
-        for (i = 0; i < HLL_REGISTERS; i++) {
-            HLL_DENSE_GET_REGISTER(val,hdr->registers,i);
-            if (val > max[i]) max[i] = val;
-        }
+        hllMergeDense(max,hdr->registers);
     } else {
         uint8_t *p = hll->ptr, *end = p + sdslen(hll->ptr);
         long runlen, regval;
@@ -1107,6 +1273,143 @@ int hllMerge(uint8_t *max, robj *hll) {
     return C_OK;
 }
 
+/* ======================== Multi-key PFCOUNT cache ========================= */
+
+/* The cardinality of a single HLL is cached in its header, but the
+ * cardinality of the union computed by PFCOUNT with multiple keys has no
+ * place to live, while it is common for clients to poll the same union
+ * again and again. So every DB maps the sets of keys used with PFCOUNT to
+ * the cardinality of their union, and signalModifiedKey() drops all the
+ * entries using a key as soon as it is modified, expired, evicted or
+ * deleted. The cache never holds more than PFCOUNT_CACHE_MAX_ENTRIES
+ * entries per DB: when full, a random entry is evicted. */
+#define PFCOUNT_CACHE_MAX_ENTRIES 1024
+
+typedef struct pfcountCacheEntry {
+    sds id;             /* Canonical form of the set of keys. */
+    robj **keys;        /* The distinct keys of the union. */
+    int numkeys;
+    uint64_t card;      /* Cardinality of the union. */
+} pfcountCacheEntry;
+
+static int pfcountCacheCompareKeys(const void *a, const void *b) {
+    return sdscmp((*(robj**)a)->ptr,(*(robj**)b)->ptr);
+}
+
+/* Sort and remove the duplicates from the '*numkeys' keys at 'keys',
+ * updating '*numkeys', and return the canonical name of the set of keys,
+ * that is, the length prefixed names of the sorted keys. */
+static sds pfcountCacheId(robj **keys, int *numkeys) {
+    sds id = sdsempty();
+    int j, n = 0;
+
+    qsort(keys,*numkeys,sizeof(robj*),pfcountCacheCompareKeys);
+    for (j = 0; j < *numkeys; j++) {
+        uint32_t len = sdslen(keys[j]->ptr);
+
+        if (n && sdscmp(keys[n-1]->ptr,keys[j]->ptr) == 0) continue;
+        keys[n++] = keys[j];
+        id = sdscatlen(id,&len,sizeof(len));
+        id = sdscatlen(id,keys[j]->ptr,len);
+    }
+    *numkeys = n;
+    return id;
+}
+
+static void pfcountCacheFreeEntry(pfcountCacheEntry *e) {
+    int j;
+
+    for (j = 0; j < e->numkeys; j++) decrRefCount(e->keys[j]);
+    zfree(e->keys);
+    sdsfree(e->id);
+    zfree(e);
+}
+
+/* Remove the entry 'e' from the cache of 'db', and free it. */
+static void pfcountCacheRemove(redisDb *db, pfcountCacheEntry *e) {
+    int j;
+
+    for (j = 0; j < e->numkeys; j++) {
+        dictEntry *de = dictFind(db->pfcount_cache_keys,e->keys[j]);
+        list *entries = dictGetVal(de);
+
+        listDelNode(entries,listSearchKey(entries,e));
+        if (listLength(entries) == 0)
+            dictDelete(db->pfcount_cache_keys,e->keys[j]);
+    }
+    dictDelete(db->pfcount_cache,e->id);
+    pfcountCacheFreeEntry(e);
+}
+
+/* Cache 'card' as the cardinality of the union of the 'numkeys' distinct
+ * keys at 'keys', whose canonical name is 'id'. The cache takes ownership
+ * of 'id'. */
+static void pfcountCacheAdd(redisDb *db, sds id, robj **keys, int numkeys,
+                            uint64_t card)
+{
+    pfcountCacheEntry *e;
+    int j;
+
+    if (dictSize(db->pfcount_cache) >= PFCOUNT_CACHE_MAX_ENTRIES) {
+        dictEntry *de = dictGetRandomKey(db->pfcount_cache);
+        pfcountCacheRemove(db,dictGetVal(de));
+    }
+
+    e = zmalloc(sizeof(*e));
+    e->id = id;
+    e->keys = zmalloc(sizeof(robj*)*numkeys);
+    e->numkeys = numkeys;
+    e->card = card;
+    dictAdd(db->pfcount_cache,e->id,e);
+    for (j = 0; j < numkeys; j++) {
+        dictEntry *de = dictFind(db->pfcount_cache_keys,keys[j]);
+        list *entries;
+
+        if (de == NULL) {
+            entries = listCreate();
+            dictAdd(db->pfcount_cache_keys,keys[j],entries);
+            incrRefCount(keys[j]);
+        } else {
+            entries = dictGetVal(de);
+        }
+        listAddNodeTail(entries,e);
+        e->keys[j] = keys[j];
+        incrRefCount(keys[j]);
+    }
+}
+
+/* Called by signalModifiedKey(): drop the cached unions using 'key'. */
+void pfcountCacheInvalidateKey(redisDb *db, robj *key) {
+    dictEntry *de;
+
+    if (dictSize(db->pfcount_cache_keys) == 0) return;
+    while ((de = dictFind(db->pfcount_cache_keys,key)) != NULL) {
+        list *entries = dictGetVal(de);
+        pfcountCacheRemove(db,listNodeValue(listFirst(entries)));
+    }
+}
+
+/* Called by signalFlushedDb(): drop the cache of the DB 'dbid', or of all
+ * the DBs if 'dbid' is -1. */
+void pfcountCacheFlush(int dbid) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dictIterator *di;
+        dictEntry *de;
+
+        if (dbid != -1 && dbid != j) continue;
+        if (dictSize(db->pfcount_cache) == 0) continue;
+        dictEmpty(db->pfcount_cache_keys,NULL);
+        di = dictGetSafeIterator(db->pfcount_cache);
+        while((de = dictNext(di)) != NULL)
+            pfcountCacheFreeEntry(dictGetVal(de));
+        dictReleaseIterator(di);
+        dictEmpty(db->pfcount_cache,NULL);
+    }
+}
+
 /* ========================== HyperLogLog commands ========================== */
 
 /* Create an HLL object. We always create the HLL using sparse encoding.
@@ -1229,29 +1532,67 @@ void pfcountCommand(client *c) {
      * the cardinality of the merge of the N HLLs specified. */
     if (c->argc > 2) {
         uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
-        int j;
+        int numkeys = c->argc-1, volatile_keys = 0, j;
+        robj **objs = zmalloc(sizeof(robj*)*numkeys);
+        robj **keys = zmalloc(sizeof(robj*)*numkeys);
+        pfcountCacheEntry *e;
+        sds id;
+
+        /* Check type and size. Looking up the keys before checking the
+         * cache also expires the keys that need it, invalidating the
+         * cached unions using them. */
+        for (j = 0; j < numkeys; j++) {
+            objs[j] = lookupKeyRead(c->db,c->argv[j+1]);
+            if (objs[j] == NULL) continue;
+            if (isHLLObjectOrReply(c,objs[j]) != C_OK) {
+                zfree(objs);
+                zfree(keys);
+                return;
+            }
+            if (getExpire(c->db,c->argv[j+1]) != -1) volatile_keys = 1;
+        }
+
+        memcpy(keys,c->argv+1,sizeof(robj*)*numkeys);
+        id = pfcountCacheId(keys,&numkeys);
+        e = dictFetchValue(c->db->pfcount_cache,id);
+        if (e) {
+            addReplyLongLong(c,e->card);
+            sdsfree(id);
+            zfree(objs);
+            zfree(keys);
+            return;
+        }
 
         /* Compute an HLL with M[i] = MAX(M[i]_j). */
         memset(max,0,sizeof(max));
         hdr = (struct hllhdr*) max;
         hdr->encoding = HLL_RAW; /* Special internal-only encoding. */
         registers = max + HLL_HDR_SIZE;
-        for (j = 1; j < c->argc; j++) {
-            /* Check type and size. */
-            robj *o = lookupKeyRead(c->db,c->argv[j]);
-            if (o == NULL) continue; /* Assume empty HLL for non existing var.*/
-            if (isHLLObjectOrReply(c,o) != C_OK) return;
+        for (j = 0; j < c->argc-1; j++) {
+            if (objs[j] == NULL) continue; /* Assume empty HLL for non existing var.*/
 
             /* Merge with this HLL with our 'max' HLL by setting max[i]
              * to MAX(max[i],hll[i]). */
-            if (hllMerge(registers,o) == C_ERR) {
+            if (hllMerge(registers,objs[j]) == C_ERR) {
                 addReplySds(c,sdsnew(invalid_hll_err));
+                sdsfree(id);
+                zfree(objs);
+                zfree(keys);
                 return;
             }
         }
 
-        /* Compute cardinality of the resulting set. */
-        addReplyLongLong(c,hllCount(hdr,NULL));
+        /* Compute cardinality of the resulting set, and cache it. Replicas
+         * don't delete expired keys, just hide them, without invalidating
+         * the cache: so they don't cache unions of volatile keys. */
+        card = hllCount(hdr,NULL);
+        if (volatile_keys && server.masterhost)
+            sdsfree(id);
+        else
+            pfcountCacheAdd(c->db,id,keys,numkeys,card);
+        addReplyLongLong(c,card);
+        zfree(objs);
+        zfree(keys);
         return;
     }
 
@@ -1360,13 +1701,19 @@ void pfmergeCommand(client *c) {
     }
 
     /* Write the resulting HLL to the destination HLL registers and
-     * invalidate the cached value. */
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        if (max[j] == 0) continue;
-        hdr = o->ptr;
-        switch(hdr->encoding) {
-        case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
-        case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+     * invalidate the cached value. The destination is one of the merged
+     * HLLs, so a dense destination can be overwritten as a whole. */
+    hdr = o->ptr;
+    if (hdr->encoding == HLL_DENSE) {
+        hllDenseFromRaw(hdr->registers,max);
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            if (max[j] == 0) continue;
+            hdr = o->ptr;
+            switch(hdr->encoding) {
+            case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
+            case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+            }
         }
     }
     hdr = o->ptr; /* o->ptr may be different now, as a side effect of
@@ -1421,7 +1768,54 @@ void pfselftestCommand(client *c) {
         }
     }
 
-    /* Test 2: approximation error.
+    /* Test 2: bulk register access.
+     * Merging the registers into a bytes array, packing a bytes array into
+     * the registers and computing the histogram must give the same results
+     * with every implementation available on this CPU. The registers and
+     * 'bytecounters' still hold the same random values from test 1. */
+    int simd_level = hllSimdLevel();
+    int level;
+    for (level = HLL_SIMD_NONE; level <= simd_level; level++) {
+        uint8_t raw[HLL_REGISTERS], expected[HLL_REGISTERS];
+        int histo[64] = {0}, expected_histo[64] = {0};
+        sds packed = sdsnewlen(NULL,HLL_DENSE_SIZE);
+        struct hllhdr *phdr = (struct hllhdr*) packed;
+
+        hll_simd = level;
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            raw[i] = rand() & HLL_REGISTER_MAX;
+            expected[i] = raw[i] > bytecounters[i] ? raw[i] : bytecounters[i];
+            expected_histo[bytecounters[i]]++;
+        }
+        hllMergeDense(raw,hdr->registers);
+        hllDenseRegHisto(hdr->registers,histo);
+        hllDenseFromRaw(phdr->registers,expected);
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            unsigned int val;
+
+            HLL_DENSE_GET_REGISTER(val,phdr->registers,i);
+            if (raw[i] != expected[i] || val != expected[i]) {
+                addReplyErrorFormat(c,
+                    "TESTFAILED Bulk register %d should be %d but is %d/%d "
+                    "(simd level %d)", i, (int) expected[i], (int) raw[i],
+                    (int) val, level);
+                sdsfree(packed);
+                hll_simd = simd_level;
+                goto cleanup;
+            }
+        }
+        sdsfree(packed);
+        if (memcmp(histo,expected_histo,sizeof(histo)) != 0) {
+            addReplyErrorFormat(c,
+                "TESTFAILED Register histogram mismatch (simd level %d)",
+                level);
+            hll_simd = simd_level;
+            goto cleanup;
+        }
+    }
+    hll_simd = simd_level;
+
+    /* Test 3: approximation error.
      * The test adds unique elements and check that the estimated value
      * is always reasonable bounds.
      *
@@ -241,6 +241,55 @@ intset *intsetAdd(intset *is, int64_t value, uint8_t *success) {
     return is;
 }
 
+/* Add the 'count' integers in 'values', that must be sorted in ascending
+ * order and free of duplicates, to the set with a single resize: the
+ * encoding is upgraded at most once and the new values are merged with the
+ * current ones starting from the tail, so nothing is overwritten before it
+ * is moved. When 'added' is not NULL it is set to the number of values that
+ * were not already members. */
+intset *intsetAddMany(intset *is, const int64_t *values, uint32_t count,
+                      uint32_t *added)
+{
+    uint8_t curenc = intrev32ifbe(is->encoding), newenc = curenc;
+    uint32_t len = intrev32ifbe(is->length), newlen = len;
+    int64_t i, j, k, cur = 0;
+
+    if (count) {
+        if (_intsetValueEncoding(values[0]) > newenc)
+            newenc = _intsetValueEncoding(values[0]);
+        if (_intsetValueEncoding(values[count-1]) > newenc)
+            newenc = _intsetValueEncoding(values[count-1]);
+    }
+    for (j = 0; j < count; j++)
+        if (!intsetFind(is,values[j])) newlen++;
+    if (added) *added = newlen-len;
+    if (newlen == len) return is;
+
+    is->encoding = intrev32ifbe(newenc);
+    is = intsetResize(is,newlen);
+    i = (int64_t)len-1;
+    j = (int64_t)count-1;
+    k = (int64_t)newlen-1;
+    while (j >= 0) {
+        if (i >= 0 && (cur = _intsetGetEncoded(is,i,curenc)) >= values[j]) {
+            if (cur == values[j]) j--;
+            _intsetSet(is,k--,cur);
+            i--;
+        } else {
+            _intsetSet(is,k--,values[j--]);
+        }
+    }
+    /* The smallest old values are already in place, unless they have to be
+     * rewritten with the new encoding. */
+    if (newenc != curenc)
+        while (i >= 0) {
+            _intsetSet(is,k--,_intsetGetEncoded(is,i,curenc));
+            i--;
+        }
+    is->length = intrev32ifbe(newlen);
+    return is;
+}
+
 /* 从整数集合种删除元素。 */
 intset *intsetRemove(intset *is, int64_t value, int *success) {
     uint8_t valenc = _intsetValueEncoding(value);// 计算要添加数值需要的编码方式
@@ -470,6 +519,55 @@ int intsetTest(int argc, char **argv) {
         ok();
     }
 
+    printf("Adding many sorted values at once: "); {
+        int64_t values[] = {-4294967295,-65535,-5,4,5,7,65535,4294967295};
+        uint32_t added;
+
+        is = intsetNew();
+        is = intsetAdd(is,5,NULL);
+        is = intsetAdd(is,6,NULL);
+        is = intsetAddMany(is,values,4,&added);
+        assert(added == 4);
+        assert(intrev32ifbe(is->encoding) == INTSET_ENC_INT64);
+        assert(intsetLen(is) == 6);
+        is = intsetAddMany(is,values,8,&added);
+        assert(added == 3);
+        assert(intsetLen(is) == 9);
+        for (i = 0; i < 8; i++) assert(intsetFind(is,values[i]));
+        assert(intsetFind(is,6));
+        checkConsistency(is);
+        is = intsetAddMany(is,values,8,&added);
+        assert(added == 0 && intsetLen(is) == 9);
+
+        is = intsetNew();
+        is = intsetAdd(is,-3,NULL);
+        is = intsetAdd(is,3,NULL);
+        is = intsetAddMany(is,values+2,3,&added);
+        assert(added == 3);
+        assert(intrev32ifbe(is->encoding) == INTSET_ENC_INT16);
+        checkConsistency(is);
+
+        for (i = 0; i < 100; i++) {
+            intset *one = createSet(20,rand()%64), *many = intsetNew();
+            int64_t v, sorted[64];
+            uint32_t j, n = 0;
+
+            while (intsetGet(one,n,&v)) sorted[n++] = v;
+            many = intsetAdd(many,rand()%(1<<20),NULL);
+            many = intsetAdd(many,-(rand()%(1<<20)),NULL);
+            for (j = 0; j < intsetLen(many); j++) {
+                intsetGet(many,j,&v);
+                one = intsetAdd(one,v,NULL);
+            }
+            many = intsetAddMany(many,sorted,n,NULL);
+            assert(intsetBlobLen(one) == intsetBlobLen(many));
+            assert(!memcmp(one,many,intsetBlobLen(one)));
+            zfree(one);
+            zfree(many);
+        }
+        ok();
+    }
+
     printf("Stress lookups: "); {
         long num = 100000, size = 10000;
         int i, bits = 20;
@@ -41,6 +41,7 @@ typedef struct intset {
 
 intset *intsetNew(void);//创建一个新整数集合
 intset *intsetAdd(intset *is, int64_t value, uint8_t *success);// 向一个整数集合中加入元素
+intset *intsetAddMany(intset *is, const int64_t *values, uint32_t count, uint32_t *added);
 intset *intsetRemove(intset *is, int64_t value, int *success); // 从一个整数集合中移除元素
 uint8_t intsetFind(intset *is, int64_t value);// 在一个整数集合中查找元素
 int64_t intsetRandom(intset *is); // 从一个整数集合中随机返回一个元素
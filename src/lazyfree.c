@@ -35,9 +35,14 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
-    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
-        zset *zs = obj->ptr;
-        return zs->zsl->length;
+    } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_BITMAP) {
+        roaring *r = obj->ptr;
+        return r->len;
+    } else if (obj->type == OBJ_STRING && obj->encoding == OBJ_ENCODING_BITMAP) {
+        bitmapString *bs = obj->ptr;
+        return bs->bits->len;
+    } else if (obj->type == OBJ_ZSET && obj->encoding != OBJ_ENCODING_ZIPLIST){
+        return zsetLength(obj);
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
@@ -61,7 +66,7 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
              * work. */
             serverAssert(raxNext(&ri));
             cg = ri.data;
-            effort += raxSize(s->cgroups)*(1+raxSize(cg->pel));
+            effort += raxSize(s->cgroups)*(1+raxSize(cg->pel->blocks));
             raxStop(&ri);
         }
         return effort;
@@ -76,9 +81,12 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
+    rdbForklessKeyWrite(db,key);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if (dictSize(db->hexpires) > 0) dictDelete(db->hexpires,key->ptr);
+    if (dictSize(db->streams) > 0) dictDelete(db->streams,key->ptr);
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
@@ -132,6 +140,9 @@ void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
     db->dict = dictCreate(&dbDictType,NULL);
     db->expires = dictCreate(&keyptrDictType,NULL);
+    /* Only holds key names of volatile hashes, cheap to drop right away. */
+    dictEmpty(db->hexpires,NULL);
+    dictEmpty(db->streams,NULL);
     atomicIncr(lazyfree_objects,dictSize(oldht1));
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
 }
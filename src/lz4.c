@@ -0,0 +1,255 @@
+/*
+ * In-tree implementation of the LZ4 block format, written for Redis from
+ * the format specification. This is not the upstream LZ4 library
+ * (https://github.com/lz4/lz4) and shares no code with it, so it is not
+ * vendored under deps/ and is covered by the license below.
+ *
+ * Copyright (c) 2026, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+/* A block is a sequence of sequences. Every sequence is a token byte holding
+ * the literals length in the high nibble and the match length minus
+ * LZ4_MIN_MATCH in the low nibble, the extra length bytes of the literals,
+ * the literals, the 16 bits little endian match offset and the extra length
+ * bytes of the match. A nibble of 15 means that the length continues in the
+ * following bytes, each one added to it until a byte is not 255. The last
+ * sequence only has the literals. */
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5     /* The last 5 bytes are always literals. */
+#define LZ4_MF_LIMIT 12         /* No match starts in the last 12 bytes. */
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12
+#define LZ4_HASH_LOG_MIN 6   /* Small inputs use smaller tables. */
+#define LZ4_SKIP_TRIGGER 6      /* Step faster on incompressible data. */
+
+static inline uint32_t lz4Read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4Hash(uint32_t seq, int hashlog) {
+    return (seq * 2654435761U) >> (32 - hashlog);
+}
+
+/* Return the end of the common prefix of 'mp' and 'rp', not going past
+ * 'limit'. */
+static inline const unsigned char *lz4MatchEnd(const unsigned char *mp,
+                                               const unsigned char *rp,
+                                               const unsigned char *limit)
+{
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* Compare 8 bytes at a time: the lowest differing bit tells how many
+     * bytes matched. */
+    while (mp + 8 <= limit) {
+        uint64_t a, b;
+        memcpy(&a,mp,8);
+        memcpy(&b,rp,8);
+        if (a != b) return mp + (__builtin_ctzll(a ^ b) >> 3);
+        mp += 8;
+        rp += 8;
+    }
+#endif
+    while (mp < limit && *mp == *rp) {
+        mp++;
+        rp++;
+    }
+    return mp;
+}
+
+/* Write the extra bytes of a length that doesn't fit its 4 bits nibble. */
+static inline unsigned char *lz4WriteLength(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Emit a sequence made of the literals [anchor,anchor+litlen) and, if
+ * 'offset' is not zero, a match of 'matchlen' bytes. Returns NULL if it
+ * does not fit before 'oend'. */
+static unsigned char *lz4WriteSequence(unsigned char *op, unsigned char *oend,
+                                       const unsigned char *anchor,
+                                       size_t litlen, size_t offset,
+                                       size_t matchlen)
+{
+    unsigned char *token = op++;
+    size_t needed = 1 + litlen + litlen/255 + 1 + (offset ? 2 + matchlen/255 + 1 : 0);
+
+    if (needed > (size_t)(oend - token)) return NULL;
+    if (litlen >= 15) {
+        *token = 15 << 4;
+        op = lz4WriteLength(op,litlen-15);
+    } else {
+        *token = litlen << 4;
+    }
+    memcpy(op,anchor,litlen);
+    op += litlen;
+    if (!offset) return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    matchlen -= LZ4_MIN_MATCH;
+    if (matchlen >= 15) {
+        *token |= 15;
+        op = lz4WriteLength(op,matchlen-15);
+    } else {
+        *token |= matchlen;
+    }
+    return op;
+}
+
+unsigned int lz4_compress(const void *const in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len)
+{
+    const unsigned char *in = in_data, *ip = in, *anchor = in;
+    const unsigned char *iend = in + in_len;
+    unsigned char *op = out_data, *oend = op + out_len;
+    uint32_t htab[1 << LZ4_HASH_LOG];
+
+    if (in_len > LZ4_MF_LIMIT) {
+        const unsigned char *mflimit = iend - LZ4_MF_LIMIT;
+        const unsigned char *matchlimit = iend - LZ4_LAST_LITERALS;
+        unsigned int misses = 0;
+        int hashlog = LZ4_HASH_LOG;
+
+        /* Clearing the table costs more than compressing small values. */
+        while (hashlog > LZ4_HASH_LOG_MIN && (1U << hashlog) > in_len)
+            hashlog--;
+        memset(htab,0,sizeof(uint32_t) << hashlog);
+        ip++;
+        while (ip <= mflimit) {
+            uint32_t seq = lz4Read32(ip), h = lz4Hash(seq,hashlog);
+            const unsigned char *ref = in + htab[h];
+            const unsigned char *mp;
+
+            htab[h] = ip - in;
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+                lz4Read32(ref) != seq)
+            {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            /* Extend the match backward over the pending literals, and
+             * forward up to the last literals. */
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            mp = lz4MatchEnd(ip+LZ4_MIN_MATCH,ref+LZ4_MIN_MATCH,matchlimit);
+
+            op = lz4WriteSequence(op,oend,anchor,ip-anchor,ip-ref,mp-ip);
+            if (op == NULL) return 0;
+            ip = anchor = mp;
+            if (ip - 2 > in && ip <= mflimit)
+                htab[lz4Hash(lz4Read32(ip-2),hashlog)] = ip - 2 - in;
+        }
+    }
+
+    op = lz4WriteSequence(op,oend,anchor,iend-anchor,0,0);
+    if (op == NULL) return 0;
+    return op - (unsigned char*)out_data;
+}
+
+/* Read the extra bytes of a length whose nibble was 15. Returns 0 if the
+ * input ends first. */
+static inline int lz4ReadLength(const unsigned char **ip,
+                                const unsigned char *iend, size_t *len)
+{
+    unsigned char b;
+
+    do {
+        if (*ip >= iend) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+unsigned int lz4_decompress(const void *const in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len)
+{
+    const unsigned char *ip = in_data, *iend = ip + in_len;
+    unsigned char *out = out_data, *op = out, *oend = out + out_len;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t len = token >> 4, offset;
+        const unsigned char *ref;
+
+        /* Literals. */
+        if (len == 15 && !lz4ReadLength(&ip,iend,&len)) return 0;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return 0;
+        if (len <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op,ip,16); /* Short literals: copy a fixed size. */
+        else
+            memcpy(op,ip,len);
+        op += len;
+        ip += len;
+        if (ip == iend) break; /* The last sequence has no match. */
+
+        /* Match. */
+        if (iend - ip < 2) return 0;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) return 0;
+        len = token & 15;
+        if (len == 15 && !lz4ReadLength(&ip,iend,&len)) return 0;
+        len += LZ4_MIN_MATCH;
+        if (len > (size_t)(oend - op)) return 0;
+        ref = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= len + 8) {
+            /* Copy 8 bytes at a time, possibly writing past the match:
+             * the extra bytes are overwritten by what follows. */
+            unsigned char *mend = op + len;
+            do {
+                memcpy(op,ref,8);
+                op += 8;
+                ref += 8;
+            } while (op < mend);
+            op = mend;
+        } else if (offset >= len) {
+            memcpy(op,ref,len);
+            op += len;
+        } else {
+            /* Overlapping match: it repeats the last 'offset' bytes. */
+            while (len--) *op++ = *ref++;
+        }
+    }
+    return op - out;
+}
@@ -0,0 +1,50 @@
+/*
+ * Interface of the in-tree LZ4 block format implementation (lz4.c). This
+ * is not the upstream LZ4 library and does not provide its API.
+ *
+ * Copyright (c) 2026, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __LZ4_H
+#define __LZ4_H
+
+/* Compressor and decompressor for the LZ4 block format, as specified in
+ * lz4_Block_format.md of the LZ4 project: the output of lz4_compress() can
+ * be decoded by LZ4_decompress_safe() and vice versa. Only raw blocks are
+ * handled, the frame format is not supported. The API mimics lzf.h: both
+ * functions return the number of bytes written to 'out_data', or 0 if the
+ * output does not fit 'out_len' bytes or, when decompressing, if the input
+ * is not a valid block. */
+
+unsigned int lz4_compress(const void *const in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len);
+unsigned int lz4_decompress(const void *const in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len);
+
+#endif /* __LZ4_H */
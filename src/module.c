@@ -183,6 +183,8 @@ struct RedisModuleKey {
     uint32_t zstart;        /* Start pos for positional ranges. */
     uint32_t zend;          /* End pos for positional ranges. */
     void *zcurrent;         /* Zset iterator current node. */
+    zbtreeIter zbtit;       /* Zset iterator position for B+-tree zsets,
+                               zcurrent points here while it is valid. */
     int zer;                /* Zset iterator end reached flag
                                (true if end was reached). */
 };
@@ -2584,6 +2586,11 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zslFirstInRange(zsl,zrs) :
                                 zslLastInRange(zsl,zrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        int found = first ? zbtFirstInRange(zs->zbt,zrs,&key->zbtit) :
+                            zbtLastInRange(zs->zbt,zrs,&key->zbtit);
+        key->zcurrent = found ? &key->zbtit : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2648,6 +2655,11 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zslFirstInLexRange(zsl,zlrs) :
                                 zslLastInLexRange(zsl,zlrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        int found = first ? zbtFirstInLexRange(zs->zbt,zlrs,&key->zbtit) :
+                            zbtLastInLexRange(zs->zbt,zlrs,&key->zbtit);
+        key->zcurrent = found ? &key->zbtit : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2698,6 +2710,11 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
         zskiplistNode *ln = key->zcurrent;
         if (score) *score = ln->score;
         str = createStringObject(ln->ele,sdslen(ln->ele));
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter *it = key->zcurrent;
+        sds ele = zbtIterEle(it);
+        if (score) *score = zbtIterScore(it);
+        str = createStringObject(ele,sdslen(ele));
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2763,6 +2780,26 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             key->zcurrent = next;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter next = key->zbtit;
+        if (!zbtNext(&next)) {
+            key->zer = 1;
+            return 0;
+        }
+        /* Are we still within the range? */
+        if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+            !zslValueLteMax(zbtIterScore(&next),&key->zrs))
+        {
+            key->zer = 1;
+            return 0;
+        } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX &&
+                   !zslLexValueLteMax(zbtIterEle(&next),&key->zlrs))
+        {
+            key->zer = 1;
+            return 0;
+        }
+        key->zbtit = next;
+        return 1;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2826,6 +2863,26 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             key->zcurrent = prev;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter prev = key->zbtit;
+        if (!zbtPrev(&prev)) {
+            key->zer = 1;
+            return 0;
+        }
+        /* Are we still within the range? */
+        if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+            !zslValueGteMin(zbtIterScore(&prev),&key->zrs))
+        {
+            key->zer = 1;
+            return 0;
+        } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX &&
+                   !zslLexValueGteMin(zbtIterEle(&prev),&key->zlrs))
+        {
+            key->zer = 1;
+            return 0;
+        }
+        key->zbtit = prev;
+        return 1;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -6830,8 +6887,7 @@ static void moduleScanKeyCallback(void *privdata, const dictEntry *de) {
         sds val = dictGetVal(de);
         value = createStringObject(val, sdslen(val));
     } else if (o->type == OBJ_ZSET) {
-        double *val = (double*)dictGetVal(de);
-        value = createStringObjectFromLongDouble(*val, 0);
+        value = createStringObjectFromLongDouble(dictGetDoubleVal(de), 0);
     }
 
     data->fn(data->key, field, value, data->user_data);
@@ -6897,7 +6953,8 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
         if (o->encoding == OBJ_ENCODING_HT)
             ht = o->ptr;
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+            o->encoding == OBJ_ENCODING_BTREE)
             ht = ((zset *)o->ptr)->dict;
     } else {
         errno = EINVAL;
@@ -6915,14 +6972,15 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
             cursor->done = 1;
             ret = 0;
         }
-    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_INTSET) {
-        int pos = 0;
-        int64_t ll;
-        while(intsetGet(o->ptr,pos++,&ll)) {
-            robj *field = createObject(OBJ_STRING,sdsfromlonglong(ll));
+    } else if (o->type == OBJ_SET && setEncodingIsInteger(o->encoding)) {
+        setTypeIterator *si = setTypeInitIterator(o);
+        sds sdsele;
+        while((sdsele = setTypeNextObject(si)) != NULL) {
+            robj *field = createObject(OBJ_STRING,sdsele);
             fn(key, field, NULL, privdata);
             decrRefCount(field);
         }
+        setTypeReleaseIterator(si);
         cursor->cursor = 1;
         cursor->done = 1;
         ret = 0;
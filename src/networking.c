@@ -214,6 +214,7 @@ client *createClient(connection *conn) {
     c->bpop.reploffset = 0;
     // 全局的复制偏移量
     c->woff = 0;
+    c->aof_woff = 0;
     // 监控的键
     c->watched_keys = listCreate();
     // 订阅频道
@@ -802,6 +803,13 @@ void addReplyBulkLen(client *c, robj *obj) {
 /* Add a Redis Object as a bulk reply */
 /** 添加Redis对象作为批量回复 */
 void addReplyBulk(client *c, robj *obj) {
+    if (obj->encoding == OBJ_ENCODING_BITMAP) {
+        /* Bitmap encoded strings are only made flat for the reply. */
+        robj *dec = getDecodedObject(obj);
+        addReplyBulk(c,dec);
+        decrRefCount(dec);
+        return;
+    }
     addReplyBulkLen(c,obj);
     addReply(c,obj);
     addReply(c,shared.crlf);
@@ -236,6 +236,10 @@ robj *dupStringObject(const robj *o) {
         d->encoding = OBJ_ENCODING_INT;
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_BITMAP:
+        d = createObject(OBJ_STRING,bitmapStringDup(o->ptr));
+        d->encoding = OBJ_ENCODING_BITMAP;
+        return d;
     default:
         serverPanic("Wrong encoding.");
         break;
@@ -274,6 +278,21 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+/** 创建一个bitmap编码的集合对象 */
+robj *createSetBitmapObject(void) {
+    roaring *r = roaringNew();
+    robj *o = createObject(OBJ_SET,r);
+    o->encoding = OBJ_ENCODING_BITMAP;
+    return o;
+}
+
+/** 创建一个bitmap编码的字符串对象，长度为len字节，所有位为0 */
+robj *createStringBitmapObject(size_t len) {
+    robj *o = createObject(OBJ_STRING,bitmapStringNew(len));
+    o->encoding = OBJ_ENCODING_BITMAP;
+    return o;
+}
+
 /** 创建一个ziplist编码的哈希对象 */
 robj *createHashObject(void) {
     unsigned char *zl = ziplistNew();       //创建一个ziplist
@@ -283,14 +302,22 @@ robj *createHashObject(void) {
 }
 
 /** 创建一个skiplist编码的有序集合对象 */
+/* When zset-btree-encoding is enabled the object is encoded as a B+-tree
+ * instead, see zsetLargeEncoding(). */
 robj *createZsetObject(void) {
     zset *zs = zmalloc(sizeof(*zs));
     robj *o;
 
     zs->dict = dictCreate(&zsetDictType,NULL);  //创建一个字典
-    zs->zsl = zslCreate();                                 //创建一个跳跃表
+    if (zsetLargeEncoding() == OBJ_ENCODING_BTREE) {
+        zs->zsl = NULL;
+        zs->zbt = zbtCreate();
+    } else {
+        zs->zsl = zslCreate();                             //创建一个跳跃表
+        zs->zbt = NULL;
+    }
     o = createObject(OBJ_ZSET,zs);                         //创建一个对象，对象的数据类型为OBJ_ZSET
-    o->encoding = OBJ_ENCODING_SKIPLIST;                   //对象的编码类型OBJ_ENCODING_SKIPLIST
+    o->encoding = zs->zbt ? OBJ_ENCODING_BTREE : OBJ_ENCODING_SKIPLIST;
     return o;
 }
 
@@ -322,6 +349,8 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        bitmapStringFree(o->ptr);
     }
 }
 
@@ -343,6 +372,9 @@ void freeSetObject(robj *o) {
     case OBJ_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case OBJ_ENCODING_BITMAP:
+        roaringFree(o->ptr);
+        break;
     default:
         serverPanic("Unknown set encoding type");
     }
@@ -358,6 +390,12 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
+    case OBJ_ENCODING_BTREE:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
     case OBJ_ENCODING_ZIPLIST:
         zfree(o->ptr);
         break;
@@ -370,6 +408,8 @@ void freeZsetObject(robj *o) {
 void freeHashObject(robj *o) {
     switch (o->encoding) {
     case OBJ_ENCODING_HT:
+        // 先释放field过期时间索引
+        if (((dict*)o->ptr)->privdata) dictRelease(((dict*)o->ptr)->privdata);
         dictRelease((dict*) o->ptr);
         break;
     case OBJ_ENCODING_ZIPLIST:
@@ -590,6 +630,10 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr); //将整数转换为字符串
         dec = createStringObject(buf,strlen(buf));  //创建一个字符串对象
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_BITMAP) {
+        /* The flat representation is built on demand, the bitmap is left
+         * untouched. */
+        return createObject(OBJ_STRING,bitmapStringToSds(o->ptr));
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -681,6 +725,8 @@ size_t stringObjectLen(robj *o) {
     //如果是字符串编码的两种类型
     if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);  //如果是整数编码类型
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        return ((bitmapString*)o->ptr)->len;
     } else {
         return sdigits10((long)o->ptr); //计算出整数值的位数返回
     }
@@ -700,6 +746,11 @@ int getDoubleFromObject(const robj *o, double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {//整数编码
             value = (long)o->ptr;                       //保存整数值
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            robj *dec = getDecodedObject((robj*)o);
+            int retval = getDoubleFromObject(dec,&value);
+            decrRefCount(dec);
+            if (retval != C_OK) return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -737,6 +788,11 @@ int getLongDoubleFromObject(robj *o, long double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            robj *dec = getDecodedObject(o);
+            int retval = getLongDoubleFromObject(dec,&value);
+            decrRefCount(dec);
+            if (retval != C_OK) return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -775,6 +831,11 @@ int getLongLongFromObject(robj *o, long long *target) {
             if (string2ll(o->ptr,sdslen(o->ptr),&value) == 0) return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            robj *dec = getDecodedObject(o);
+            int retval = getLongLongFromObject(dec,&value);
+            decrRefCount(dec);
+            if (retval != C_OK) return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -830,6 +891,8 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     case OBJ_ENCODING_STREAM: return "stream";
+    case OBJ_ENCODING_BITMAP: return "bitmap";
+    case OBJ_ENCODING_BTREE: return "btree";
     default: return "unknown";
     }
 }
@@ -879,6 +942,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsZmallocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_BITMAP) {
+            asize = bitmapStringAllocSize(o->ptr)+sizeof(*o);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -912,6 +977,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = o->ptr;
             asize = sizeof(*o)+sizeof(*is)+is->encoding*is->length;
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            asize = sizeof(*o)+roaringAllocSize(o->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
@@ -932,6 +999,21 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 znode = znode->level[0].forward;
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zbtreeIter it;
+            d = ((zset*)o->ptr)->dict;
+            asize = sizeof(*o)+sizeof(zset)+sizeof(dict)+
+                    (sizeof(struct dictEntry*)*dictSlots(d))+
+                    zbtNodesAllocSize(zbt);
+            if (zbtSeekFirst(zbt,&it)) {
+                do {
+                    elesize += sdsZmallocSize(zbtIterEle(&it));
+                    elesize += sizeof(struct dictEntry);
+                    samples++;
+                } while(samples < sample_size && zbtNext(&it));
+            }
+            if (samples) asize += (double)elesize/samples*dictSize(d);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -951,6 +1033,11 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             }
             dictReleaseIterator(di);
             if (samples) asize += (double)elesize/samples*dictSize(d);
+            /* The TTL index holds a copy of every volatile field. */
+            if ((d = hashTypeGetExpires(o)) != NULL) {
+                asize += sizeof(dict)+(sizeof(struct dictEntry*)*dictSlots(d));
+                if (samples) asize += (double)elesize/samples*dictSize(d)/2;
+            }
         } else {
             serverPanic("Unknown hash encoding");
         }
@@ -995,8 +1082,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             while(raxNext(&ri)) {
                 streamCG *cg = ri.data;
                 asize += sizeof(*cg);
-                asize += streamRadixTreeMemoryUsage(cg->pel);
-                asize += sizeof(streamNACK)*raxSize(cg->pel);
+                asize += streamPELMemoryUsage(cg->pel);
 
                 /* For each consumer we also need to add the basic data
                  * structures and the PEL memory usage. */
@@ -1007,9 +1093,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                     streamConsumer *consumer = cri.data;
                     asize += sizeof(*consumer);
                     asize += sdslen(consumer->name);
-                    asize += streamRadixTreeMemoryUsage(consumer->pel);
-                    /* Don't count NACKs again, they are shared with the
-                     * consumer group PEL. */
+                    asize += streamPELMemoryUsage(consumer->pel);
                 }
                 raxStop(&cri);
             }
@@ -1086,7 +1170,6 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem = 0;
     if (server.aof_state != AOF_OFF) {
         mem += sdsZmallocSize(server.aof_buf);
-        mem += aofRewriteBufferSize();
     }
     mh->aof_buffer = mem;
     mem_total+=mem;
@@ -29,6 +29,9 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#include "lz4.h"    /* LZ4 block compression */
+#define ZSTD_STATIC_LINKING_ONLY /* For ZSTD_createCCtx_advanced() */
+#include <zstd.h>
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
@@ -41,6 +44,7 @@
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 
 /* This macro is called when the internal RDB stracture is corrupt */
@@ -369,17 +373,91 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-//保存压缩对象
-//标记位为RDB_ENCVAL<<6)|RDB_ENC_LZF;
-//然后保存压缩后长度 然后写入原来的长度
-//最后写入压缩后的二进制 长度为压缩后的长度
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+/* zstd contexts are expensive to create, so every thread saving or loading
+ * RDB files keeps its own compression and decompression context around,
+ * released when the thread exits. Their memory is allocated with zmalloc()
+ * so that it is accounted like the rest of the memory we use. */
+static pthread_once_t rdbZstdOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t rdbZstdCCtxKey, rdbZstdDCtxKey;
+
+static void *rdbZstdAlloc(void *opaque, size_t size) {
+    UNUSED(opaque);
+    return zmalloc(size);
+}
+
+static void rdbZstdFree(void *opaque, void *ptr) {
+    UNUSED(opaque);
+    zfree(ptr);
+}
+
+static const ZSTD_customMem rdbZstdMem = {rdbZstdAlloc, rdbZstdFree, NULL};
+
+static void rdbZstdFreeCCtx(void *cctx) {
+    ZSTD_freeCCtx(cctx);
+}
+
+static void rdbZstdFreeDCtx(void *dctx) {
+    ZSTD_freeDCtx(dctx);
+}
+
+static void rdbZstdInitKeys(void) {
+    pthread_key_create(&rdbZstdCCtxKey,rdbZstdFreeCCtx);
+    pthread_key_create(&rdbZstdDCtxKey,rdbZstdFreeDCtx);
+}
+
+/* Compress 'srclen' bytes at 'src' as a zstd frame into 'dst'. Returns the
+ * compressed length, or 0 if it does not fit 'dstlen' bytes. */
+size_t rdbZstdCompress(void *dst, size_t dstlen, const void *src,
+                       size_t srclen)
+{
+    ZSTD_CCtx *cctx;
+    size_t n;
+
+    pthread_once(&rdbZstdOnce,rdbZstdInitKeys);
+    if ((cctx = pthread_getspecific(rdbZstdCCtxKey)) == NULL) {
+        cctx = ZSTD_createCCtx_advanced(rdbZstdMem);
+        if (cctx == NULL) return 0;
+        /* The RDB already stores the original length, and frames of small
+         * values are a big part of the output: drop the magic number and
+         * the content size from the frame header. */
+        ZSTD_CCtx_setParameter(cctx,ZSTD_c_format,ZSTD_f_zstd1_magicless);
+        ZSTD_CCtx_setParameter(cctx,ZSTD_c_contentSizeFlag,0);
+        pthread_setspecific(rdbZstdCCtxKey,cctx);
+    }
+    ZSTD_CCtx_setParameter(cctx,ZSTD_c_compressionLevel,server.rdb_zstd_level);
+    n = ZSTD_compress2(cctx,dst,dstlen,src,srclen);
+    return ZSTD_isError(n) ? 0 : n;
+}
+
+/* Decompress the zstd frame at 'src' into exactly 'dstlen' bytes at 'dst'.
+ * Returns 0 on success, -1 if the frame is invalid. */
+int rdbZstdDecompress(void *dst, size_t dstlen, const void *src,
+                      size_t srclen)
+{
+    ZSTD_DCtx *dctx;
+    size_t n;
+
+    pthread_once(&rdbZstdOnce,rdbZstdInitKeys);
+    if ((dctx = pthread_getspecific(rdbZstdDCtxKey)) == NULL) {
+        dctx = ZSTD_createDCtx_advanced(rdbZstdMem);
+        if (dctx == NULL) return -1;
+        ZSTD_DCtx_setParameter(dctx,ZSTD_d_format,ZSTD_f_zstd1_magicless);
+        pthread_setspecific(rdbZstdDCtxKey,dctx);
+    }
+    n = ZSTD_decompressDCtx(dctx,dst,dstlen,src,srclen);
+    return (ZSTD_isError(n) || n != dstlen) ? -1 : 0;
+}
+
+/* Save a compressed string: the RDB_ENC_* type of the compression 'enc',
+ * the compressed and the original length, and the compressed bytes. */
+ssize_t rdbSaveCompressedBlob(rio *rdb, int enc, void *data,
+                              size_t compress_len, size_t original_len)
+{
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF; //保存格式 压缩标记高两位也是用的11 低两位使用的11  在loadlen 代码可以参考
+    byte = (RDB_ENCVAL<<6)|enc; //保存格式 压缩标记高两位也是用的11 低两位使用的11  在loadlen 代码可以参考
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;    //首先写入压缩标记
     nwritten += n;
 
@@ -398,30 +476,58 @@ writeerr:
     return -1;
 }
 
+//保存压缩对象
+//标记位为RDB_ENCVAL<<6)|RDB_ENC_LZF;
+//然后保存压缩后长度 然后写入原来的长度
+//最后写入压缩后的二进制 长度为压缩后的长度
+ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                       size_t original_len) {
+    return rdbSaveCompressedBlob(rdb,RDB_ENC_LZF,data,compress_len,
+                                 original_len);
+}
+
+/* Save the string compressed with the codec selected by the
+ * rdb-compression-codec option. With zstd, strings shorter than
+ * rdb-zstd-min-size are compressed with LZ4 instead, since for them the
+ * zstd frame overhead is not worth it. Returns 0 if the string can't be
+ * compressed, otherwise the bytes written or -1 on error. */
 // string压缩保存
-ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
+    int enc = server.rdb_compression_codec;
     size_t comprlen, outlen;
     void *out;
 
     /* We require at least four bytes compression for this to be worth it */
     if (len <= 4) return 0;
+    if (enc == RDB_ENC_ZSTD && len < (size_t)server.rdb_zstd_min_size)
+        enc = RDB_ENC_LZ4;
     outlen = len-4;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;    //分配压缩后的空间
-    comprlen = lzf_compress(s, len, out, outlen);   //压缩
+    switch(enc) {
+    case RDB_ENC_LZ4:
+        comprlen = lz4_compress(s, len, out, outlen);
+        break;
+    case RDB_ENC_ZSTD:
+        comprlen = rdbZstdCompress(out, outlen, s, len);
+        break;
+    default:
+        comprlen = lzf_compress(s, len, out, outlen);   //压缩
+        break;
+    }
     if (comprlen == 0) {    //压缩失败
         zfree(out);
         return 0;
     }
-    ssize_t nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len); //写入压缩后的文件
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, enc, out, comprlen, len); //写入压缩后的文件
     zfree(out);
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
+/* Load a string compressed with the RDB_ENC_* codec 'enc' in RDB format.
+ * The returned value changes according to 'flags'. For more info check the
  * rdbGenericLoadStringObject() function. */
 // 从rio中读出一个压缩过的字符串，将其解压并返回构建成的字符串对象
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+void *rdbLoadCompressedStringObject(rio *rdb, int enc, int flags, size_t *lenptr) {
     int plain = flags & RDB_LOAD_PLAIN; //无格式的，没有编码过
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
@@ -449,8 +555,19 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
     // 从rio中读出压缩过的值
     if (rioRead(rdb,c,clen) == 0) goto err;
     // 将压缩过的值解压缩，保存在val中，解压后的长度为len
-    if (lzf_decompress(c,clen,val,len) == 0) {
-        rdbExitReportCorruptRDB("Invalid LZF compressed string");
+    switch(enc) {
+    case RDB_ENC_LZ4:
+        if (lz4_decompress(c,clen,val,len) != len)
+            rdbExitReportCorruptRDB("Invalid LZ4 compressed string");
+        break;
+    case RDB_ENC_ZSTD:
+        if (rdbZstdDecompress(val,len,c,clen) == -1)
+            rdbExitReportCorruptRDB("Invalid zstd compressed string");
+        break;
+    default:
+        if (lzf_decompress(c,clen,val,len) == 0)
+            rdbExitReportCorruptRDB("Invalid LZF compressed string");
+        break;
     }
     zfree(c);   //释放空间
 
@@ -488,10 +605,13 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
-     * aaaaaaaaaaaaaaaaaa so skip it */
-    if (server.rdb_compression && len > 20) {   //如果配置了压缩选项
-        n = rdbSaveLzfStringObject(rdb,s,len);
+    /* Try compression - LZF under 20 bytes is unable to compress even
+     * aaaaaaaaaaaaaaaaaa so by default skip it, see
+     * rdb-compression-min-size. */
+    if (server.rdb_compression &&
+        len > (size_t)server.rdb_compression_min_size) //如果配置了压缩选项
+    {
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -510,6 +630,54 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
     return nwritten;
 }
 
+/* Number of bytes rdbSaveLen() uses to store 'len'. */
+static size_t rdbLenSize(uint64_t len) {
+    if (len < (1<<6)) return 1;
+    if (len < (1<<14)) return 2;
+    if (len <= UINT32_MAX) return 5;
+    return 9;
+}
+
+/* Save the blob of a compact encoding: ziplist, intset or listpack. When
+ * the target is a file that may be memory mapped by the loader (see
+ * rdb-mmap-snapshot) the blob is stored verbatim, so that it can be used
+ * in place, and when that makes it span fewer pages it is padded to start
+ * at a page boundary with the RDB_ENC_ALIGNED encoding:
+ *
+ * 11|000110 <len> <16 bit little endian pad> <pad bytes> <blob>
+ *
+ * Otherwise this is just rdbSaveRawString(). */
+ssize_t rdbSaveEncodedBlob(rio *rdb, unsigned char *s, size_t len) {
+    static const unsigned char zeroes[RDB_MMAP_PAGE_SIZE];
+    const size_t page = RDB_MMAP_PAGE_SIZE;
+    size_t start, pad, pages;
+    ssize_t n, nwritten = 0;
+    unsigned char buf[2];
+
+    if (rdb == NULL || !(rdb->flags & RIO_FLAG_MAPPABLE))
+        return rdbSaveRawString(rdb,s,len);
+
+    start = rdb->processed_bytes+rdbLenSize(len);
+    pages = (start%page+len+page-1)/page;
+    if (len == 0 || pages == (len+page-1)/page) {
+        if ((n = rdbSaveLen(rdb,len)) == -1) return -1;
+        nwritten += n;
+    } else {
+        buf[0] = (RDB_ENCVAL<<6)|RDB_ENC_ALIGNED;
+        if (rdbWriteRaw(rdb,buf,1) == -1) return -1;
+        if ((n = rdbSaveLen(rdb,len)) == -1) return -1;
+        nwritten += n+1;
+        pad = (page-(rdb->processed_bytes+2)%page)%page;
+        buf[0] = pad&0xff;
+        buf[1] = pad>>8;
+        if (rdbWriteRaw(rdb,buf,2) == -1) return -1;
+        if (pad && rdbWriteRaw(rdb,(void*)zeroes,pad) == -1) return -1;
+        nwritten += 2+pad;
+    }
+    if (len && rdbWriteRaw(rdb,s,len) == -1) return -1;
+    return nwritten+len;
+}
+
 /* Save a long long value as either an encoded string or a string. */
 // string是否是一个数字或者是否能够被转换成一个数字来进行保存
 ssize_t rdbSaveLongLongAsStringObject(rio *rdb, long long value) {
@@ -557,10 +725,33 @@ ssize_t rdbSaveStringObject(rio *rdb, robj *obj) {
  * RDB_LOAD_PLAIN: Return a plain string allocated with zmalloc()
  *                 instead of a Redis object with an sds in it.
  * RDB_LOAD_SDS: Return an SDS string instead of a Redis object.
+ * RDB_LOAD_MAPPED: With RDB_LOAD_PLAIN, the string is the blob of a compact
+ *                  encoding (ziplist, intset, listpack): when loading a
+ *                  memory mapped file it is used in place instead of being
+ *                  copied.
  *
  * On I/O error NULL is returned.
  */
 
+/* Load the header of an RDB_ENC_ALIGNED string, see rdbSaveEncodedBlob(),
+ * consuming the padding. Returns the length of the verbatim string that
+ * follows, or RDB_LENERR on error. */
+static uint64_t rdbLoadAlignedLen(rio *rdb) {
+    unsigned char buf[256];
+    uint64_t len;
+    size_t pad;
+
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return RDB_LENERR;
+    if (rioRead(rdb,buf,2) == 0) return RDB_LENERR;
+    pad = buf[0] | (buf[1]<<8);
+    while(pad) {
+        size_t chunk = pad < sizeof(buf) ? pad : sizeof(buf);
+        if (rioRead(rdb,buf,chunk) == 0) return RDB_LENERR;
+        pad -= chunk;
+    }
+    return len;
+}
+
 // 根据flags，将从rio读出一个字符串对象进行编码
 void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
     int encode = flags & RDB_LOAD_ENC;
@@ -580,8 +771,14 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
             // 以上三种类型的整数编码，根据flags返回不同类型值
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
+        case RDB_ENC_LZ4:
+        case RDB_ENC_ZSTD:
             // 如果是压缩后的字符串，进行构建压缩字符串编码对象
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
+        case RDB_ENC_ALIGNED:
+            /* Just a verbatim string after the padding. */
+            len = rdbLoadAlignedLen(rdb);
+            break;
         default:
             rdbExitReportCorruptRDB("Unknown RDB string encoding type %llu",len);
             return NULL;
@@ -593,9 +790,19 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     // 如果是原生值
     if (plain || sds) {
-        // 分配空间
-        void *buf = plain ? zmalloc(len) : sdsnewlen(SDS_NOINIT,len);
+        void *buf;
+
         if (lenptr) *lenptr = len;
+        /* When loading a memory mapped file, the blobs of the compact
+         * encodings are used in place: they are copied only when modified,
+         * see zrealloc(). */
+        if (plain && (flags & RDB_LOAD_MAPPED) && len && rioIsMapped(rdb)) {
+            if ((buf = rioReadMapped(rdb,len)) == NULL) return NULL;
+            zmalloc_map_retain(buf,len);
+            return buf;
+        }
+        // 分配空间
+        buf = plain ? zmalloc(len) : sdsnewlen(SDS_NOINIT,len);
         // 从rio中读出来
         if (len && rioRead(rdb,buf,len) == 0) {
             if (plain)
@@ -748,6 +955,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     // 根据不同数据类型，写入不同编码类型
     switch (o->type) {
     case OBJ_STRING:    //字符串编码
+        if (o->encoding == OBJ_ENCODING_BITMAP)
+            return rdbSaveType(rdb,RDB_TYPE_STRING_BITMAP);
         return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:      //列表类型
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
@@ -757,6 +966,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_SET:       //集合类型
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_BITMAP)
+            return rdbSaveType(rdb,RDB_TYPE_SET_BITMAP);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
@@ -764,7 +975,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_ZSET:      //有序集合
         if (o->encoding == OBJ_ENCODING_ZIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                 o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
@@ -772,7 +984,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         if (o->encoding == OBJ_ENCODING_ZIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
         else if (o->encoding == OBJ_ENCODING_HT)
-            return rdbSaveType(rdb,RDB_TYPE_HASH);
+            return rdbSaveType(rdb,hashTypeGetExpires(o) ?
+                                   RDB_TYPE_HASH_TTL : RDB_TYPE_HASH);
         else
             serverPanic("Unknown hash encoding");
     case OBJ_STREAM:
@@ -804,35 +1017,37 @@ int rdbLoadObjectType(rio *rdb) {
  * we serialized the NACKs as well, but when serializing the local consumer
  * PELs we just add the ID, that will be resolved inside the global PEL to
  * put a reference to the same structure. */
-ssize_t rdbSaveStreamPEL(rio *rdb, rax *pel, int nacks) {
+ssize_t rdbSaveStreamPEL(rio *rdb, streamPEL *pel, int nacks) {
     ssize_t n, nwritten = 0;
 
     /* Number of entries in the PEL. */
-    if ((n = rdbSaveLen(rdb,raxSize(pel))) == -1) return -1;
+    if ((n = rdbSaveLen(rdb,streamPELSize(pel))) == -1) return -1;
     nwritten += n;
 
     /* Save each entry. */
-    raxIterator ri;
-    raxStart(&ri,pel);
-    raxSeek(&ri,"^",NULL,0);
-    while(raxNext(&ri)) {
+    streamPELIterator it;
+    streamID *id;
+    streamPELIteratorStart(&it,pel,NULL);
+    while((id = streamPELIteratorNext(&it)) != NULL) {
         /* We store IDs in raw form as 128 big big endian numbers, like
-         * they are inside the radix tree key. */
-        if ((n = rdbWriteRaw(rdb,ri.key,sizeof(streamID))) == -1) {
-            raxStop(&ri);
+         * they are inside the radix tree keys. */
+        unsigned char rawid[sizeof(streamID)];
+        streamEncodeID(rawid,id);
+        if ((n = rdbWriteRaw(rdb,rawid,sizeof(rawid))) == -1) {
+            streamPELIteratorStop(&it);
             return -1;
         }
         nwritten += n;
 
         if (nacks) {
-            streamNACK *nack = ri.data;
+            streamNACK *nack = (streamNACK*)id;
             if ((n = rdbSaveMillisecondTime(rdb,nack->delivery_time)) == -1) {
-                raxStop(&ri);
+                streamPELIteratorStop(&it);
                 return -1;
             }
             nwritten += n;
             if ((n = rdbSaveLen(rdb,nack->delivery_count)) == -1) {
-                raxStop(&ri);
+                streamPELIteratorStop(&it);
                 return -1;
             }
             nwritten += n;
@@ -841,7 +1056,7 @@ ssize_t rdbSaveStreamPEL(rio *rdb, rax *pel, int nacks) {
              * at loading time. */
         }
     }
-    raxStop(&ri);
+    streamPELIteratorStop(&it);
     return nwritten;
 }
 
@@ -896,7 +1111,24 @@ size_t rdbSaveStreamConsumers(rio *rdb, streamCG *cg) {
 ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
     ssize_t n = 0, nwritten = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_BITMAP) {
+        /* Bitmap encoded strings are saved as their length followed by
+         * the serialized bitmap of the offsets of the bits set. */
+        bitmapString *bs = o->ptr;
+        size_t l = roaringBlobLen(bs->bits);
+        unsigned char *blob = zmalloc(l);
+
+        if ((n = rdbSaveLen(rdb,bs->len)) == -1) {
+            zfree(blob);
+            return -1;
+        }
+        nwritten += n;
+        roaringSerialize(bs->bits,blob);
+        n = rdbSaveRawString(rdb,blob,l);
+        zfree(blob);
+        if (n == -1) return -1;
+        nwritten += n;
+    } else if (o->type == OBJ_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
         nwritten += n;
@@ -925,7 +1157,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                     nwritten += n;
                 } else {
                     // 未压缩过，则直接保存原始的字符串数据
-                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+                    if ((n = rdbSaveEncodedBlob(rdb,node->zl,node->sz)) == -1) return -1;
                     nwritten += n;
                 }
                 // 下一个结点
@@ -972,7 +1204,18 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             size_t l = intsetBlobLen((intset*)o->ptr);
 
             // 保存原始字符串到RDB
-            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            if ((n = rdbSaveEncodedBlob(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            /* Bitmaps are saved as their serialized blob, that can then
+             * be compressed like any other string. */
+            size_t l = roaringBlobLen(o->ptr);
+            unsigned char *blob = zmalloc(l);
+
+            roaringSerialize(o->ptr,blob);
+            n = rdbSaveRawString(rdb,blob,l);
+            zfree(blob);
+            if (n == -1) return -1;
             nwritten += n;
         } else {
             serverPanic("Unknown set encoding");
@@ -986,7 +1229,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             size_t l = ziplistBlobLen((unsigned char*)o->ptr);
 
             // 以一个原生字符串对象保存ziplist类型的有序集合
-            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            if ((n = rdbSaveEncodedBlob(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
             // 有序集合对象是skiplist类型
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -1019,6 +1262,29 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 nwritten += n;
                 zn = zn->backward;
             }
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = o->ptr;
+            zbtreeIter it;
+
+            if ((n = rdbSaveLen(rdb,zs->zbt->length)) == -1) return -1;
+            nwritten += n;
+
+            /* Same order of the skiplist, so that the format does not
+             * depend on the encoding. */
+            if (zbtSeekLast(zs->zbt,&it)) {
+                do {
+                    sds ele = zbtIterEle(&it);
+                    if ((n = rdbSaveRawString(rdb,
+                        (unsigned char*)ele,sdslen(ele))) == -1)
+                    {
+                        return -1;
+                    }
+                    nwritten += n;
+                    if ((n = rdbSaveBinaryDoubleValue(rdb,
+                        zbtIterScore(&it))) == -1) return -1;
+                    nwritten += n;
+                } while (zbtPrev(&it));
+            }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1031,7 +1297,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             size_t l = ziplistBlobLen((unsigned char*)o->ptr);
 
             // 存储到RDB
-            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            if ((n = rdbSaveEncodedBlob(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
 
             // 哈希表编码
@@ -1039,6 +1305,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             // 迭代器
             dictIterator *di = dictGetIterator(o->ptr);
             dictEntry *de;
+            // field过期时间索引，为NULL时保存为RDB_TYPE_HASH
+            dict *ttls = hashTypeGetExpires(o);
 
             // 保存字典长度到RDB
             if ((n = rdbSaveLen(rdb,dictSize((dict*)o->ptr))) == -1) {
@@ -1070,6 +1338,17 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                     return -1;
                 }
                 nwritten += n;
+                /* RDB_TYPE_HASH_TTL: every pair is followed by the field
+                 * unix time to live in milliseconds, -1 if not volatile. */
+                if (ttls) {
+                    dictEntry *te = dictFind(ttls,field);
+                    long long when = te ? dictGetSignedIntegerVal(te) : -1;
+                    if ((n = rdbSaveMillisecondTime(rdb,when)) == -1) {
+                        dictReleaseIterator(di);
+                        return -1;
+                    }
+                    nwritten += n;
+                }
             }
             dictReleaseIterator(di);
         } else {
@@ -1097,7 +1376,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 return -1;
             }
             nwritten += n;
-            if ((n = rdbSaveRawString(rdb,lp,lp_bytes)) == -1) {
+            if ((n = rdbSaveEncodedBlob(rdb,lp,lp_bytes)) == -1) {
                 raxStop(&ri);
                 return -1;
             }
@@ -1360,6 +1639,388 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
     return io.bytes;
 }
 
+/* ----------------------------------------------------------------------------
+ * Sharded saving
+ *
+ * When rdb-save-threads is greater than zero the keyspace is serialized by
+ * multiple threads. The buckets of every DB are split in shards that the
+ * threads claim one after the other, serializing the keys of every shard in
+ * a memory buffer. Every time the buffer of a thread grows over
+ * RDB_SECTION_BYTES, or the shard is over, the buffer is sealed as a
+ * section and handed to the thread calling rdbSaveRio(), that writes it as:
+ *
+ *   RDB_OPCODE_SECTION <dbid> <payload len> <crc64 of payload> <payload>
+ *
+ * The payload is the usual sequence of key records, with their expire,
+ * LRU and LFU opcodes. After the sections RDB_OPCODE_SECTION_INDEX lists
+ * the DB, offset and length of every section, so that readers can locate
+ * the sections without parsing the keys. The checksum is zero when
+ * rdbchecksum is disabled.
+ *
+ * Values of module types are not serialized by the threads: they are
+ * collected and saved by the calling thread after the sections, preceded by
+ * the classic SELECTDB opcode.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_SECTION_BYTES (4*1024*1024)
+#define RDB_SAVE_SHARDS_PER_THREAD 4
+#define RDB_SAVE_SHARD_MIN_KEYS 4096  /* Smaller DBs are saved as one shard. */
+#define RDB_SAVE_QUEUED_PER_THREAD 2  /* Max sealed sections not yet written. */
+
+typedef struct rdbSaveSection {
+    int dbid;
+    sds payload;
+    uint64_t crc;
+    struct rdbSaveSection *next;
+} rdbSaveSection;
+
+typedef struct rdbSaveDeferredKey {
+    int dbid;
+    dictEntry *de;
+} rdbSaveDeferredKey;
+
+static struct {
+    int numthreads;
+    pthread_t threads[RDB_SAVE_THREADS_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;      /* A section was sealed or a thread exited. */
+    pthread_cond_t space_cond;      /* A queued section was written. */
+    int dbid;                       /* DB of the last claimed shard. */
+    unsigned long shard, numshards; /* Next shard of 'dbid' to claim. */
+    rdbSaveSection *head, *tail;    /* Sealed sections to write. */
+    int queued;                     /* Length of the above list. */
+    int running;                    /* Threads that didn't exit yet. */
+    int abort;                      /* Writing failed, stop serializing. */
+    rdbSaveDeferredKey *deferred;   /* Keys of module types. */
+    unsigned long numdeferred, deferredsize;
+} rdbSavePool;
+
+/* State of a serializing thread. */
+typedef struct rdbSaveShard {
+    int dbid;
+    redisDb *db;
+    rio rdb;                        /* Buffer of the section being built. */
+    int aborted;
+} rdbSaveShard;
+
+/* Pick the next shard to serialize, setting 'dbid', 'shard' and 'numshards'.
+ * Returns 0 when all the shards were already claimed. Called with the pool
+ * lock held. */
+static int rdbSaveClaimShard(int *dbid, unsigned long *shard,
+                             unsigned long *numshards)
+{
+    while (rdbSavePool.shard == rdbSavePool.numshards) {
+        unsigned long size;
+
+        if (rdbSavePool.dbid+1 >= server.dbnum) return 0;
+        rdbSavePool.dbid++;
+        size = dictSize(server.db[rdbSavePool.dbid].dict);
+        rdbSavePool.shard = 0;
+        if (size == 0)
+            rdbSavePool.numshards = 0;
+        else if (size < RDB_SAVE_SHARD_MIN_KEYS)
+            rdbSavePool.numshards = 1;
+        else
+            rdbSavePool.numshards =
+                rdbSavePool.numthreads * RDB_SAVE_SHARDS_PER_THREAD;
+    }
+    *dbid = rdbSavePool.dbid;
+    *shard = rdbSavePool.shard++;
+    *numshards = rdbSavePool.numshards;
+    return 1;
+}
+
+/* Hand the section built so far to the writing thread, waiting if too many
+ * sections are already queued. */
+static void rdbSaveSealSection(rdbSaveShard *ss) {
+    rdbSaveSection *sec;
+    sds payload = ss->rdb.io.buffer.ptr;
+
+    if (sdslen(payload) == 0) return;
+    sec = zmalloc(sizeof(*sec));
+    sec->dbid = ss->dbid;
+    sec->payload = payload;
+    sec->crc = server.rdb_checksum ?
+        crc64(0,(unsigned char*)payload,sdslen(payload)) : 0;
+    sec->next = NULL;
+    rioInitWithBuffer(&ss->rdb,sdsempty());
+
+    pthread_mutex_lock(&rdbSavePool.lock);
+    while (rdbSavePool.queued >=
+           rdbSavePool.numthreads * RDB_SAVE_QUEUED_PER_THREAD &&
+           !rdbSavePool.abort)
+    {
+        pthread_cond_wait(&rdbSavePool.space_cond,&rdbSavePool.lock);
+    }
+    if (rdbSavePool.abort) {
+        pthread_mutex_unlock(&rdbSavePool.lock);
+        ss->aborted = 1;
+        sdsfree(sec->payload);
+        zfree(sec);
+        return;
+    }
+    if (rdbSavePool.tail)
+        rdbSavePool.tail->next = sec;
+    else
+        rdbSavePool.head = sec;
+    rdbSavePool.tail = sec;
+    rdbSavePool.queued++;
+    pthread_cond_signal(&rdbSavePool.ready_cond);
+    pthread_mutex_unlock(&rdbSavePool.lock);
+}
+
+/* dictScanShard() callback serializing a single key. */
+static void rdbSaveShardEntry(void *privdata, const dictEntry *de) {
+    rdbSaveShard *ss = privdata;
+    robj key, *o = dictGetVal(de);
+
+    if (ss->aborted) return;
+    if (o->type == OBJ_MODULE) {
+        pthread_mutex_lock(&rdbSavePool.lock);
+        if (rdbSavePool.numdeferred == rdbSavePool.deferredsize) {
+            rdbSavePool.deferredsize = rdbSavePool.deferredsize ?
+                                       rdbSavePool.deferredsize*2 : 16;
+            rdbSavePool.deferred = zrealloc(rdbSavePool.deferred,
+                sizeof(rdbSaveDeferredKey)*rdbSavePool.deferredsize);
+        }
+        rdbSavePool.deferred[rdbSavePool.numdeferred].dbid = ss->dbid;
+        rdbSavePool.deferred[rdbSavePool.numdeferred].de = (dictEntry*)de;
+        rdbSavePool.numdeferred++;
+        pthread_mutex_unlock(&rdbSavePool.lock);
+        return;
+    }
+
+    /* Writing to a memory buffer can't fail. */
+    initStaticStringObject(key,dictGetKey(de));
+    rdbSaveKeyValuePair(&ss->rdb,&key,o,getExpire(ss->db,&key));
+    if (sdslen(ss->rdb.io.buffer.ptr) >= RDB_SECTION_BYTES)
+        rdbSaveSealSection(ss);
+}
+
+static void *rdbSaveThreadMain(void *arg) {
+    rdbSaveShard ss;
+    unsigned long shard, numshards;
+    sigset_t sigset;
+    UNUSED(arg);
+
+    redis_set_thread_title("rdb_save");
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    rioInitWithBuffer(&ss.rdb,sdsempty());
+    ss.aborted = 0;
+    while(!ss.aborted) {
+        pthread_mutex_lock(&rdbSavePool.lock);
+        if (rdbSavePool.abort ||
+            !rdbSaveClaimShard(&ss.dbid,&shard,&numshards))
+        {
+            pthread_mutex_unlock(&rdbSavePool.lock);
+            break;
+        }
+        pthread_mutex_unlock(&rdbSavePool.lock);
+
+        ss.db = server.db+ss.dbid;
+        dictScanShard(ss.db->dict,shard,numshards,rdbSaveShardEntry,&ss);
+        rdbSaveSealSection(&ss);
+    }
+    sdsfree(ss.rdb.io.buffer.ptr);
+
+    pthread_mutex_lock(&rdbSavePool.lock);
+    rdbSavePool.running--;
+    pthread_cond_signal(&rdbSavePool.ready_cond);
+    pthread_mutex_unlock(&rdbSavePool.lock);
+    return NULL;
+}
+
+/* Wait for the threads to exit and release the pool. */
+static void rdbSavePoolStop(void) {
+    rdbSaveSection *sec;
+    int j;
+
+    for (j = 0; j < rdbSavePool.numthreads; j++)
+        pthread_join(rdbSavePool.threads[j],NULL);
+    while ((sec = rdbSavePool.head) != NULL) {
+        rdbSavePool.head = sec->next;
+        sdsfree(sec->payload);
+        zfree(sec);
+    }
+    rdbSavePool.tail = NULL;
+    zfree(rdbSavePool.deferred);
+    rdbSavePool.deferred = NULL;
+    pthread_mutex_destroy(&rdbSavePool.lock);
+    pthread_cond_destroy(&rdbSavePool.ready_cond);
+    pthread_cond_destroy(&rdbSavePool.space_cond);
+
+    for (j = 0; j < server.dbnum; j++) {
+        dictResumeRehashing(server.db[j].dict);
+        dictResumeRehashing(server.db[j].expires);
+    }
+}
+
+/* Start the serializing threads. Returns 0 if no thread could be created,
+ * in which case the caller should save the keyspace in the classic way. */
+static int rdbSavePoolStart(int numthreads) {
+    int j;
+
+    rdbSavePool.numthreads = 0;
+    rdbSavePool.dbid = -1;
+    rdbSavePool.shard = rdbSavePool.numshards = 0;
+    rdbSavePool.head = rdbSavePool.tail = NULL;
+    rdbSavePool.queued = 0;
+    rdbSavePool.running = 0;
+    rdbSavePool.abort = 0;
+    rdbSavePool.deferred = NULL;
+    rdbSavePool.numdeferred = rdbSavePool.deferredsize = 0;
+
+    /* Threads access the expires with dictFind(): make sure it will not
+     * perform rehashing steps, nor move entries while we scan them. */
+    for (j = 0; j < server.dbnum; j++) {
+        dictPauseRehashing(server.db[j].dict);
+        dictPauseRehashing(server.db[j].expires);
+    }
+
+    pthread_mutex_init(&rdbSavePool.lock,NULL);
+    pthread_cond_init(&rdbSavePool.ready_cond,NULL);
+    pthread_cond_init(&rdbSavePool.space_cond,NULL);
+    /* Threads need numthreads to be final before claiming shards. */
+    pthread_mutex_lock(&rdbSavePool.lock);
+    for (j = 0; j < numthreads && j < RDB_SAVE_THREADS_MAX; j++) {
+        if (pthread_create(&rdbSavePool.threads[j],NULL,
+                           rdbSaveThreadMain,NULL) != 0) break;
+        rdbSavePool.numthreads++;
+        rdbSavePool.running++;
+    }
+    pthread_mutex_unlock(&rdbSavePool.lock);
+
+    if (rdbSavePool.numthreads == 0) {
+        serverLog(LL_WARNING,"Can't create the RDB saving threads, "
+                             "saving without sections.");
+        rdbSavePoolStop();
+        return 0;
+    }
+    if (rdbSavePool.numthreads != numthreads)
+        serverLog(LL_WARNING,"Can't create all the RDB saving threads, "
+                             "saving with %d.", rdbSavePool.numthreads);
+    return 1;
+}
+
+static int rdbSaveDeferredKeyCompare(const void *a, const void *b) {
+    return ((const rdbSaveDeferredKey*)a)->dbid -
+           ((const rdbSaveDeferredKey*)b)->dbid;
+}
+
+/* Write the keyspace as sections serialized by the threads started with
+ * rdbSavePoolStart(), followed by the keys of module types and the sections
+ * index. 'start' is the value of rdb->processed_bytes when the RDB magic was
+ * written, offsets in the index are relative to it. The pool is stopped
+ * before returning. Returns C_ERR on write errors, with errno set. */
+static int rdbSaveSections(rio *rdb, size_t start) {
+    rdbSaveSection *sec;
+    uint64_t *index = NULL;     /* dbid, offset, length triplets. */
+    unsigned long numsections = 0, indexsize = 0, j;
+    int dbid = -1, saved_errno = 0;
+
+    /* Announce every DB upfront, so that its dictionaries can be resized
+     * before the sections are loaded. */
+    for (j = 0; j < (unsigned long)server.dbnum; j++) {
+        redisDb *db = server.db+j;
+
+        if (dictSize(db->dict) == 0) continue;
+        if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
+        if (rdbSaveLen(rdb,j) == -1) goto werr;
+        if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
+        if (rdbSaveLen(rdb,dictSize(db->dict)) == -1) goto werr;
+        if (rdbSaveLen(rdb,dictSize(db->expires)) == -1) goto werr;
+    }
+
+    while(1) {
+        uint64_t crc;
+
+        pthread_mutex_lock(&rdbSavePool.lock);
+        while (rdbSavePool.head == NULL && rdbSavePool.running)
+            pthread_cond_wait(&rdbSavePool.ready_cond,&rdbSavePool.lock);
+        if ((sec = rdbSavePool.head) != NULL) {
+            rdbSavePool.head = sec->next;
+            if (rdbSavePool.head == NULL) rdbSavePool.tail = NULL;
+            rdbSavePool.queued--;
+            pthread_cond_signal(&rdbSavePool.space_cond);
+        }
+        pthread_mutex_unlock(&rdbSavePool.lock);
+        if (sec == NULL) break;
+
+        if (numsections == indexsize) {
+            indexsize = indexsize ? indexsize*2 : 64;
+            index = zrealloc(index,sizeof(uint64_t)*3*indexsize);
+        }
+        index[numsections*3] = sec->dbid;
+        index[numsections*3+1] = rdb->processed_bytes - start;
+        index[numsections*3+2] = sdslen(sec->payload);
+        numsections++;
+
+        /* The section was already checksummed by the thread that built it,
+         * so the checksum of the file is updated by combining its CRC. */
+        crc = sec->crc;
+        memrev64ifbe(&crc);
+        if (rdbSaveType(rdb,RDB_OPCODE_SECTION) == -1 ||
+            rdbSaveLen(rdb,sec->dbid) == -1 ||
+            rdbSaveLen(rdb,sdslen(sec->payload)) == -1 ||
+            rdbWriteRaw(rdb,&crc,8) == -1 ||
+            (sec->crc ?
+             rioWriteWithChecksum(rdb,sec->payload,sdslen(sec->payload),
+                                  sec->crc) == 0 :
+             rdbWriteRaw(rdb,sec->payload,sdslen(sec->payload)) == -1))
+        {
+            sdsfree(sec->payload);
+            zfree(sec);
+            goto werr;
+        }
+        sdsfree(sec->payload);
+        zfree(sec);
+    }
+
+    /* All the threads exited: now save the keys of module types. */
+    qsort(rdbSavePool.deferred,rdbSavePool.numdeferred,
+          sizeof(rdbSaveDeferredKey),rdbSaveDeferredKeyCompare);
+    for (j = 0; j < rdbSavePool.numdeferred; j++) {
+        rdbSaveDeferredKey *dk = rdbSavePool.deferred+j;
+        redisDb *db = server.db+dk->dbid;
+        robj key;
+
+        if (dk->dbid != dbid) {
+            dbid = dk->dbid;
+            if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
+            if (rdbSaveLen(rdb,dbid) == -1) goto werr;
+        }
+        initStaticStringObject(key,dictGetKey(dk->de));
+        if (rdbSaveKeyValuePair(rdb,&key,dictGetVal(dk->de),
+                                getExpire(db,&key)) == -1) goto werr;
+    }
+
+    if (rdbSaveType(rdb,RDB_OPCODE_SECTION_INDEX) == -1) goto werr;
+    if (rdbSaveLen(rdb,numsections) == -1) goto werr;
+    for (j = 0; j < numsections*3; j++)
+        if (rdbSaveLen(rdb,index[j]) == -1) goto werr;
+
+    zfree(index);
+    rdbSavePoolStop();
+    return C_OK;
+
+werr:
+    saved_errno = errno;
+    pthread_mutex_lock(&rdbSavePool.lock);
+    rdbSavePool.abort = 1;
+    pthread_cond_broadcast(&rdbSavePool.space_cond);
+    pthread_mutex_unlock(&rdbSavePool.lock);
+    zfree(index);
+    rdbSavePoolStop();
+    errno = saved_errno;
+    return C_ERR;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1376,7 +2037,8 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     char magic[10];
     int j;
     uint64_t cksum;
-    size_t processed = 0;
+    size_t start = rdb->processed_bytes;
+    int sections;
 
     // 开启了校验和选项
     if (server.rdb_checksum)
@@ -1390,8 +2052,14 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) goto werr;
     if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) goto werr;
 
+    /* With rdb-save-threads the keyspace is serialized in sections by
+     * multiple threads, see rdbSaveSections(). */
+    sections = server.rdb_save_threads > 0 &&
+               rdbSavePoolStart(server.rdb_save_threads);
+    if (sections && rdbSaveSections(rdb,start) == C_ERR) goto werr;
+
     // 遍历所有服务器内的数据库
-    for (j = 0; j < server.dbnum; j++) {
+    for (j = 0; j < server.dbnum && !sections; j++) {
         redisDb *db = server.db+j;      //当前的数据库指针
         dict *d = db->dict;             //当数据库的键值对字典
         // 跳过为空的数据库
@@ -1429,16 +2097,6 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
             expire = getExpire(db,&key);
             // 将键的键对象，值对象，过期时间写到rio中
             if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
-
-            /* When this RDB is produced as part of an AOF rewrite, move
-             * accumulated diff from parent to child while rewriting in
-             * order to have a smaller final write. */
-            if (rdbflags & RDBFLAGS_AOF_PREAMBLE &&
-                rdb->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
-            {
-                processed = rdb->processed_bytes;
-                aofReadDiffFromParent();
-            }
         }
         dictReleaseIterator(di);        //释放迭代器
         di = NULL; /* So that we don't release it again on error. */
@@ -1544,6 +2202,7 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
 
     // 初始化一个rio对象，该对象是一个文件对象IO
     rioInitWithFile(&rdb,fp);
+    if (server.rdb_mmap_snapshot) rdb.flags |= RIO_FLAG_MAPPABLE;
     startSaving(RDBFLAGS_NONE);
 
     if (server.rdb_save_incremental_fsync)
@@ -1601,73 +2260,696 @@ werr:
     return C_ERR;
 }
 
-// 后台进行RDB持久化BGSAVE操作
-int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
-    pid_t childpid;
+/* ----------------------------------------------------------------------------
+ * Forkless saving
+ *
+ * With rdb-forkless-save enabled BGSAVE does not fork: the RDB file is
+ * written by a thread of the server, so that under a write load the memory
+ * of a big dataset is not duplicated page by page by the copy-on-write of
+ * the child. The RDB is still a point in time snapshot, thanks to a
+ * copy-on-write at key granularity:
+ *
+ * 1. The main thread walks the buckets of every DB in order, queueing the
+ *    keys it finds to the saving thread, that serializes and writes them.
+ *    Rehashing of the DBs is paused for the whole save, so entries never
+ *    move, and the position of the walk tells which keys were queued.
+ * 2. Before a key the walk did not reach yet is modified, deleted or gets
+ *    its TTL changed, the main thread serializes its current version and
+ *    queues the record, then remembers the key as "touched" so that the walk
+ *    will skip it. Keys created during the save are touched as well.
+ * 3. Before a queued key is accessed in any way, the main thread makes sure
+ *    the saving thread is not reading it: a key not yet claimed by the
+ *    thread is serialized by the main thread, otherwise the main thread
+ *    waits for the thread to be done with it.
+ *
+ * The hooks are rdbForklessKeyAccess() and rdbForklessKeyWrite(), called by
+ * the keyspace functions. Replacing whole DBs, like FLUSHDB and SWAPDB do,
+ * aborts the save.
+ *
+ * The thread wakes up the main thread with a pipe every time the queue is
+ * half empty, so that the walk goes on at the pace of the writes, in steps
+ * of RDB_FORKLESS_WALK_USEC microseconds at most.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_FORKLESS_QUEUE_MAX 4096     /* Max keys queued and not written. */
+#define RDB_FORKLESS_WALK_USEC 1000     /* Time budget of every walk step. */
+
+/* States of a queued item. */
+#define RDB_FORKLESS_PENDING 0          /* Not yet claimed by the thread. */
+#define RDB_FORKLESS_CLAIMED 1          /* The thread is writing it. */
+#define RDB_FORKLESS_DONE 2             /* Written, or skipped after errors. */
+#define RDB_FORKLESS_TAKEN 3            /* Serialized by the main thread. */
+
+typedef struct rdbForklessItem {
+    int state;
+    int dbid;                           /* -1 for the trailer of the file. */
+    int queued;                         /* Listed in rdbForkless.queued. */
+    sds key;                            /* Owned by the keyspace. */
+    robj *val;
+    long long expire;
+    sds record;                         /* Already serialized, or NULL. */
+    struct rdbForklessItem *next;
+} rdbForklessItem;
+
+static struct {
+    int active;                         /* Thread started, hooks enabled. */
+    int aborted;                        /* Stopped by rdbForklessAbort(). */
+    int result;                         /* C_OK if the file was renamed. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;           /* Items queued, or stop requested. */
+    pthread_cond_t done_cond;           /* A claimed item was written. */
+    int pipe[2];                        /* Wakes up the main thread. */
+    int wakeup;                         /* A byte is in the pipe already. */
+    char tmpfile[256];
+    sds filename;
+    FILE *fp;
+    rio rdb;
+    int lua;                            /* Save the scripts in the trailer. */
+    int dbid, table;                    /* Position of the walk. */
+    unsigned long idx;
+    unsigned long long *sizes;          /* Keys and expires of every DB. */
+    dict **queued;                      /* Per DB, key -> item of the walk. */
+    dict **touched;                     /* Per DB, keys the walk must skip. */
+    rdbForklessItem *head, *tail;       /* Items not yet released. */
+    rdbForklessItem *next;              /* Next item for the thread. */
+    unsigned long pending;              /* Items from 'next' to 'tail'. */
+    int waiting;                        /* Main thread waiting on done_cond. */
+    int finish;                         /* The trailer is queued. */
+    int stop;                           /* Exit without completing the file. */
+    int exited;                         /* The thread is done. */
+} rdbForkless;
+
+/* Wake up the main thread, if not already done. Called with the lock held. */
+static void rdbForklessWakeup(void) {
+    if (rdbForkless.wakeup) return;
+    rdbForkless.wakeup = 1;
+    if (write(rdbForkless.pipe[1],"x",1) != 1) {
+        /* Nothing to do, the pipe only ever holds a single byte. */
+    }
+}
 
-    // 当前没有正在进行AOF和RDB操作，否则返回C_ERR
-    if (hasActiveChildProcess()) return C_ERR;
+/* Write 'it' to the file, selecting its DB first if the previous item was
+ * about another DB. Returns -1 on write errors. */
+static int rdbForklessWriteItem(rdbForklessItem *it, int *dbid) {
+    rio *rdb = &rdbForkless.rdb;
+    robj key;
+
+    if (it->dbid != -1 && it->dbid != *dbid) {
+        unsigned long long *sizes = rdbForkless.sizes+it->dbid*2;
+
+        *dbid = it->dbid;
+        if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) return -1;
+        if (rdbSaveLen(rdb,*dbid) == -1) return -1;
+        /* A DB is selected again after the records of other DBs: the
+         * resize hint is only needed the first time. */
+        if (sizes[0]) {
+            if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) return -1;
+            if (rdbSaveLen(rdb,sizes[0]) == -1) return -1;
+            if (rdbSaveLen(rdb,sizes[1]) == -1) return -1;
+            sizes[0] = 0;
+        }
+    }
+    if (it->record) return rdbWriteRaw(rdb,it->record,sdslen(it->record));
+    initStaticStringObject(key,it->key);
+    return rdbSaveKeyValuePair(rdb,&key,it->val,it->expire);
+}
 
-    // 备份当前数据库的脏键值
-    server.dirty_before_bgsave = server.dirty;
-    // 最近一个执行BGSAVE的时间
-    server.lastbgsave_try = time(NULL);
-    // fork函数开始时间，记录fork函数的耗时
-    openChildInfoPipe();
+static void *rdbForklessThreadMain(void *arg) {
+    rio *rdb = &rdbForkless.rdb;
+    int dbid = -1, error = 0, stop;
+    uint64_t cksum;
+    sigset_t sigset;
+    UNUSED(arg);
 
-    // 创建子进程
-    if ((childpid = redisFork(CHILD_TYPE_RDB)) == 0) {
-        int retval;
+    redis_set_thread_title("rdb_forkless");
 
-        // 子进程执行的代码
-        /* Child */
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
-        // 设置进程标题，方便识别
-        redisSetProcTitle("redis-rdb-bgsave");
-        redisSetCpuAffinity(server.bgsave_cpulist);
-        // 执行保存操作，将数据库的写到filename文件中
-        retval = rdbSave(filename,rsi);
-        if (retval == C_OK) {
-            sendChildCOWInfo(CHILD_TYPE_RDB, "RDB");
+    pthread_mutex_lock(&rdbForkless.lock);
+    while(1) {
+        rdbForklessItem *it;
+
+        while (rdbForkless.next == NULL && !rdbForkless.finish &&
+               !rdbForkless.stop)
+        {
+            rdbForklessWakeup();
+            pthread_cond_wait(&rdbForkless.work_cond,&rdbForkless.lock);
         }
-        // 子进程退出，发送信号给父进程，发送0表示BGSAVE成功，1表示失败
-        exitFromChild((retval == C_OK) ? 0 : 1);
-    } else {
-        // 父进程执行的代码
-        /* Parent */
+        if (rdbForkless.stop || rdbForkless.next == NULL) break;
+        it = rdbForkless.next;
+        rdbForkless.next = it->next;
+        rdbForkless.pending--;
+        if (rdbForkless.pending <= RDB_FORKLESS_QUEUE_MAX/2)
+            rdbForklessWakeup();
+        if (it->state == RDB_FORKLESS_TAKEN) continue;
+        it->state = RDB_FORKLESS_CLAIMED;
+        pthread_mutex_unlock(&rdbForkless.lock);
+
+        error = rdbForklessWriteItem(it,&dbid) == -1;
+
+        pthread_mutex_lock(&rdbForkless.lock);
+        it->state = RDB_FORKLESS_DONE;
+        if (rdbForkless.waiting)
+            pthread_cond_broadcast(&rdbForkless.done_cond);
+        if (error) break;
+    }
+    stop = rdbForkless.stop;
+    pthread_mutex_unlock(&rdbForkless.lock);
 
-        // 如果fork出错
-        if (childpid == -1) {
-            closeChildInfoPipe();
-            server.lastbgsave_status = C_ERR;
-            serverLog(LL_WARNING,"Can't save in background: fork: %s",
-                strerror(errno));
-            return C_ERR;
+    /* The trailer was the last item: complete the file as rdbSave() does. */
+    if (!error && !stop) {
+        if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) {
+            error = 1;
+        } else {
+            cksum = rdb->cksum;
+            memrev64ifbe(&cksum);
+            if (rioWrite(rdb,&cksum,8) == 0 ||
+                fflush(rdbForkless.fp) ||
+                fsync(fileno(rdbForkless.fp))) error = 1;
         }
-        serverLog(LL_NOTICE,"Background saving started by pid %d",childpid);
-        server.rdb_save_time_start = time(NULL);    //设置BGSAVE开始的时间
-        server.rdb_child_pid = childpid;            //设置负责执行BGSAVE操作的子进程id
-        server.rdb_child_type = RDB_CHILD_TYPE_DISK;//设置BGSAVE的类型，往磁盘中写入
-        //关闭哈希表的resize，因为resize过程中会有复制拷贝动作
-        return C_OK;
     }
-    return C_OK; /* unreached */
+    if (fclose(rdbForkless.fp) && !stop) error = 1;
+    rdbForkless.fp = NULL;
+    if (error) {
+        serverLog(LL_WARNING,"Write error saving DB on disk: %s",
+            strerror(errno));
+    } else if (!stop &&
+               rename(rdbForkless.tmpfile,rdbForkless.filename) == -1)
+    {
+        serverLog(LL_WARNING,
+            "Error moving temp DB file %s on the final destination %s: %s",
+            rdbForkless.tmpfile, rdbForkless.filename, strerror(errno));
+        error = 1;
+    }
+
+    pthread_mutex_lock(&rdbForkless.lock);
+    rdbForkless.result = (error || stop) ? C_ERR : C_OK;
+    rdbForkless.exited = 1;
+    rdbForklessWakeup();
+    pthread_mutex_unlock(&rdbForkless.lock);
+    return NULL;
 }
 
-/* Note that we may call this function in signal handle 'sigShutdownHandler',
- * so we need guarantee all functions we call are async-signal-safe.
- * If  we call this function from signal handle, we won't call bg_unlik that
- * is not async-signal-safe. */
-// 删除临时文件，当BGSAVE执行被中断时使用
-void rdbRemoveTempFile(pid_t childpid, int from_signal) {
-    char tmpfile[256];
-    char pid[32];
+static rdbForklessItem *rdbForklessNewItem(int dbid) {
+    rdbForklessItem *it = zmalloc(sizeof(*it));
+
+    it->state = RDB_FORKLESS_PENDING;
+    it->dbid = dbid;
+    it->queued = 0;
+    it->key = NULL;
+    it->val = NULL;
+    it->expire = -1;
+    it->record = NULL;
+    it->next = NULL;
+    return it;
+}
 
-    /* Generate temp rdb file name using aync-signal safe functions. */
-    int pid_len = ll2string(pid, sizeof(pid), childpid);
-    strcpy(tmpfile, "temp-");
-    strncpy(tmpfile+5, pid, pid_len);
-    strcpy(tmpfile+5+pid_len, ".rdb");
+/* Create an item with the serialized version of a key. Writing to a memory
+ * buffer can't fail. */
+static rdbForklessItem *rdbForklessNewRecord(int dbid, sds key, robj *val,
+                                             long long expire)
+{
+    rdbForklessItem *it = rdbForklessNewItem(dbid);
+    robj keyobj;
+    rio rdb;
+
+    rioInitWithBuffer(&rdb,sdsempty());
+    initStaticStringObject(keyobj,key);
+    rdbSaveKeyValuePair(&rdb,&keyobj,val,expire);
+    it->record = rdb.io.buffer.ptr;
+    return it;
+}
+
+/* Append the 'count' items from 'first' to 'last' to the queue of the
+ * thread. With 'finish' set, 'last' is the trailer of the file. */
+static void rdbForklessAppend(rdbForklessItem *first, rdbForklessItem *last,
+                              unsigned long count, int finish)
+{
+    pthread_mutex_lock(&rdbForkless.lock);
+    if (rdbForkless.tail)
+        rdbForkless.tail->next = first;
+    else
+        rdbForkless.head = first;
+    rdbForkless.tail = last;
+    if (rdbForkless.next == NULL) rdbForkless.next = first;
+    rdbForkless.pending += count;
+    if (finish) rdbForkless.finish = 1;
+    pthread_cond_signal(&rdbForkless.work_cond);
+    pthread_mutex_unlock(&rdbForkless.lock);
+}
+
+/* Release the items at the head of the queue the thread is done with. */
+static void rdbForklessRelease(void) {
+    rdbForklessItem *it, *first;
+
+    pthread_mutex_lock(&rdbForkless.lock);
+    first = it = rdbForkless.head;
+    while (it && it != rdbForkless.next &&
+           (it->state == RDB_FORKLESS_DONE || it->state == RDB_FORKLESS_TAKEN))
+        it = it->next;
+    rdbForkless.head = it;
+    if (it == NULL) rdbForkless.tail = NULL;
+    pthread_mutex_unlock(&rdbForkless.lock);
+
+    while (first != it) {
+        rdbForklessItem *next = first->next;
+
+        if (first->queued)
+            dictDelete(rdbForkless.queued[first->dbid],first->key);
+        sdsfree(first->record);
+        zfree(first);
+        first = next;
+    }
+}
+
+/* Queue the keys of the next buckets to the thread, until the queue is full
+ * or 'usec' microseconds elapsed. At the end of the keyspace, queue the
+ * trailer of the file as well. */
+static void rdbForklessWalk(long long usec) {
+    rdbForklessItem *first = NULL, *last = NULL, *it;
+    unsigned long count = 0, room, buckets = 0;
+    long long start = ustime();
+    int finish = 0;
+
+    pthread_mutex_lock(&rdbForkless.lock);
+    room = rdbForkless.pending < RDB_FORKLESS_QUEUE_MAX ?
+           RDB_FORKLESS_QUEUE_MAX - rdbForkless.pending : 0;
+    pthread_mutex_unlock(&rdbForkless.lock);
+
+    while (count < room && rdbForkless.dbid < server.dbnum) {
+        int dbid = rdbForkless.dbid;
+        redisDb *db = server.db+dbid;
+        dictht *ht = &db->dict->ht[rdbForkless.table];
+        dict *touched = rdbForkless.touched[dbid];
+        dictEntry *de;
+
+        if (rdbForkless.idx >= ht->size) {
+            if (rdbForkless.table == 0) {
+                rdbForkless.table = 1;
+            } else {
+                rdbForkless.dbid++;
+                rdbForkless.table = 0;
+            }
+            rdbForkless.idx = 0;
+            continue;
+        }
+        for (de = ht->table[rdbForkless.idx]; de; de = de->next) {
+            sds key = dictGetKey(de);
+            robj keyobj, *val = dictGetVal(de);
+            long long expire;
+
+            if (dictSize(touched) && dictFind(touched,key)) continue;
+            initStaticStringObject(keyobj,key);
+            expire = getExpire(db,&keyobj);
+            if (val->type == OBJ_MODULE) {
+                /* Module callbacks can only be called by the main thread. */
+                it = rdbForklessNewRecord(dbid,key,val,expire);
+            } else {
+                it = rdbForklessNewItem(dbid);
+                it->key = key;
+                it->val = val;
+                it->expire = expire;
+                it->queued = 1;
+                dictAdd(rdbForkless.queued[dbid],key,it);
+            }
+            if (last) last->next = it; else first = it;
+            last = it;
+            count++;
+        }
+        rdbForkless.idx++;
+        if ((++buckets & 63) == 0 && ustime()-start > usec) break;
+    }
+
+    if (rdbForkless.dbid == server.dbnum) {
+        rio rdb;
+
+        rioInitWithBuffer(&rdb,sdsempty());
+        if (rdbForkless.lua) {
+            dictIterator *di = dictGetIterator(server.lua_scripts);
+            dictEntry *de;
+
+            while((de = dictNext(di)) != NULL) {
+                robj *body = dictGetVal(de);
+                rdbSaveAuxField(&rdb,"lua",3,body->ptr,sdslen(body->ptr));
+            }
+            dictReleaseIterator(di);
+        }
+        rdbSaveModulesAux(&rdb,REDISMODULE_AUX_AFTER_RDB);
+        it = rdbForklessNewItem(-1);
+        it->record = rdb.io.buffer.ptr;
+        if (last) last->next = it; else first = it;
+        last = it;
+        count++;
+        finish = 1;
+    }
+    if (count) rdbForklessAppend(first,last,count,finish);
+}
+
+/* Release what the thread wrote and queue more keys. */
+static void rdbForklessStep(void) {
+    rdbForklessRelease();
+    if (!rdbForkless.finish) rdbForklessWalk(RDB_FORKLESS_WALK_USEC);
+}
+
+/* Release the state of the save, once the thread exited. */
+static void rdbForklessFree(void) {
+    rdbForklessItem *it;
+    int j;
+
+    while ((it = rdbForkless.head) != NULL) {
+        rdbForkless.head = it->next;
+        sdsfree(it->record);
+        zfree(it);
+    }
+    rdbForkless.tail = rdbForkless.next = NULL;
+    for (j = 0; j < server.dbnum; j++) {
+        dictRelease(rdbForkless.queued[j]);
+        dictRelease(rdbForkless.touched[j]);
+        dictResumeRehashing(server.db[j].dict);
+    }
+    zfree(rdbForkless.queued);
+    zfree(rdbForkless.touched);
+    zfree(rdbForkless.sizes);
+    aeDeleteFileEvent(server.el,rdbForkless.pipe[0],AE_READABLE);
+    close(rdbForkless.pipe[0]);
+    close(rdbForkless.pipe[1]);
+    pthread_mutex_destroy(&rdbForkless.lock);
+    pthread_cond_destroy(&rdbForkless.work_cond);
+    pthread_cond_destroy(&rdbForkless.done_cond);
+    if (rdbForkless.result != C_OK) bg_unlink(rdbForkless.tmpfile);
+    sdsfree(rdbForkless.filename);
+    rdbForkless.active = 0;
+}
+
+/* Stop the thread, if still running, and release the state of the save. */
+static void rdbForklessStop(void) {
+    pthread_mutex_lock(&rdbForkless.lock);
+    rdbForkless.stop = 1;
+    pthread_cond_signal(&rdbForkless.work_cond);
+    pthread_mutex_unlock(&rdbForkless.lock);
+    pthread_join(rdbForkless.thread,NULL);
+    rdbForklessFree();
+}
+
+static void rdbForklessPipeHandler(aeEventLoop *el, int fd, void *privdata,
+                                   int mask)
+{
+    char buf[64];
+    int exited;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    pthread_mutex_lock(&rdbForkless.lock);
+    rdbForkless.wakeup = 0;
+    exited = rdbForkless.exited;
+    pthread_mutex_unlock(&rdbForkless.lock);
+
+    /* The outcome is handled by rdbForklessCheckDone(), from serverCron(),
+     * like it happens for children. */
+    if (exited)
+        rdbForklessStop();
+    else
+        rdbForklessStep();
+}
+
+/* Start a forkless BGSAVE, see the top comment of this section. */
+static int rdbSaveForkless(char *filename, rdbSaveInfo *rsi) {
+    rio *rdb = &rdbForkless.rdb;
+    char magic[10];
+    int j;
+
+    snprintf(rdbForkless.tmpfile,sizeof(rdbForkless.tmpfile),
+        "temp-%d.rdb",(int) getpid());
+    rdbForkless.fp = fopen(rdbForkless.tmpfile,"w");
+    if (!rdbForkless.fp) {
+        server.lastbgsave_status = C_ERR;
+        serverLog(LL_WARNING,"Failed opening the RDB file %s for saving: %s",
+            rdbForkless.tmpfile, strerror(errno));
+        return C_ERR;
+    }
+    rioInitWithFile(rdb,rdbForkless.fp);
+    if (server.rdb_mmap_snapshot) rdb->flags |= RIO_FLAG_MAPPABLE;
+    if (server.rdb_save_incremental_fsync)
+        rioSetAutoSync(rdb,REDIS_AUTOSYNC_BYTES);
+    if (server.rdb_checksum)
+        rdb->update_cksum = rioGenericUpdateChecksum;
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    if (rdbWriteRaw(rdb,magic,9) == -1 ||
+        rdbSaveInfoAuxFields(rdb,RDBFLAGS_NONE,rsi) == -1 ||
+        rdbSaveModulesAux(rdb,REDISMODULE_AUX_BEFORE_RDB) == -1 ||
+        pipe(rdbForkless.pipe) == -1)
+    {
+        server.lastbgsave_status = C_ERR;
+        serverLog(LL_WARNING,"Can't save in background: %s",strerror(errno));
+        fclose(rdbForkless.fp);
+        unlink(rdbForkless.tmpfile);
+        return C_ERR;
+    }
+    anetNonBlock(NULL,rdbForkless.pipe[0]);
+    anetNonBlock(NULL,rdbForkless.pipe[1]);
+
+    rdbForkless.aborted = 0;
+    rdbForkless.result = C_ERR;
+    rdbForkless.wakeup = 0;
+    rdbForkless.filename = sdsnew(filename);
+    rdbForkless.lua = rsi != NULL;
+    rdbForkless.dbid = rdbForkless.table = 0;
+    rdbForkless.idx = 0;
+    rdbForkless.sizes = zmalloc(sizeof(unsigned long long)*server.dbnum*2);
+    rdbForkless.queued = zmalloc(sizeof(dict*)*server.dbnum);
+    rdbForkless.touched = zmalloc(sizeof(dict*)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++) {
+        rdbForkless.sizes[j*2] = dictSize(server.db[j].dict);
+        rdbForkless.sizes[j*2+1] = dictSize(server.db[j].expires);
+        rdbForkless.queued[j] = dictCreate(&keyptrDictType,NULL);
+        rdbForkless.touched[j] = dictCreate(&setDictType,NULL);
+        dictPauseRehashing(server.db[j].dict);
+    }
+    rdbForkless.head = rdbForkless.tail = rdbForkless.next = NULL;
+    rdbForkless.pending = 0;
+    rdbForkless.waiting = 0;
+    rdbForkless.finish = rdbForkless.stop = rdbForkless.exited = 0;
+    pthread_mutex_init(&rdbForkless.lock,NULL);
+    pthread_cond_init(&rdbForkless.work_cond,NULL);
+    pthread_cond_init(&rdbForkless.done_cond,NULL);
+    rdbForkless.active = 1;
+
+    if (aeCreateFileEvent(server.el,rdbForkless.pipe[0],AE_READABLE,
+            rdbForklessPipeHandler,NULL) == AE_ERR ||
+        pthread_create(&rdbForkless.thread,NULL,
+            rdbForklessThreadMain,NULL) != 0)
+    {
+        serverLog(LL_WARNING,"Can't create the RDB saving thread");
+        fclose(rdbForkless.fp);
+        rdbForklessFree();
+        server.lastbgsave_status = C_ERR;
+        return C_ERR;
+    }
+
+    serverLog(LL_NOTICE,"Background saving started by a thread");
+    server.rdb_save_time_start = time(NULL);
+    server.rdb_forkless_in_progress = 1;
+    server.stat_rdb_forkless_cow_keys = 0;
+    updateDictResizePolicy();
+    rdbForklessStep();
+    return C_OK;
+}
+
+/* Serialize a key in the main thread, and queue the record. */
+static void rdbForklessCopyKey(int dbid, sds key, robj *val, long long expire) {
+    rdbForklessItem *it = rdbForklessNewRecord(dbid,key,val,expire);
+
+    rdbForklessAppend(it,it,1,0);
+    server.stat_rdb_forkless_cow_keys++;
+}
+
+/* Make sure the saving thread is not reading the value of 'key' in the DB
+ * 'dbid', that the main thread is about to access. */
+static void rdbForklessSyncKey(int dbid, sds key) {
+    dict *queued = rdbForkless.queued[dbid];
+    rdbForklessItem *it;
+    dictEntry *de;
+
+    if (dictSize(queued) == 0 || (de = dictFind(queued,key)) == NULL) return;
+    it = dictGetVal(de);
+    dictDelete(queued,key);
+    it->queued = 0;
+
+    pthread_mutex_lock(&rdbForkless.lock);
+    if (it->state == RDB_FORKLESS_PENDING) {
+        /* Not claimed yet: the thread will skip it. */
+        it->state = RDB_FORKLESS_TAKEN;
+        pthread_mutex_unlock(&rdbForkless.lock);
+        rdbForklessCopyKey(dbid,it->key,it->val,it->expire);
+        return;
+    }
+    rdbForkless.waiting++;
+    while (it->state == RDB_FORKLESS_CLAIMED)
+        pthread_cond_wait(&rdbForkless.done_cond,&rdbForkless.lock);
+    rdbForkless.waiting--;
+    pthread_mutex_unlock(&rdbForkless.lock);
+}
+
+/* Called before the value of 'key' is accessed without modifying it. Even
+ * read only access can change the internals of a value, for instance with
+ * a rehashing step of its hash table, so the saving thread must not be
+ * reading it at the same time. */
+void rdbForklessKeyAccess(redisDb *db, robj *key) {
+    if (!rdbForkless.active) return;
+    rdbForklessSyncKey(db->id,key->ptr);
+}
+
+/* Called before 'key' is created, modified or deleted, or its TTL changes.
+ * If the walk did not reach the key yet, save its current version now and
+ * make sure the walk will skip it. */
+void rdbForklessKeyWrite(redisDb *db, robj *key) {
+    dict *touched;
+    dictEntry *de;
+    unsigned long idx;
+    int table;
+
+    if (!rdbForkless.active) return;
+    rdbForklessSyncKey(db->id,key->ptr);
+    if (db->id < rdbForkless.dbid) return;
+    touched = rdbForkless.touched[db->id];
+    if (dictSize(touched) && dictFind(touched,key->ptr)) return;
+
+    de = dictFindPosition(db->dict,key->ptr,&table,&idx);
+    if (de) {
+        /* Already queued by the walk, and synchronized above. */
+        if (db->id == rdbForkless.dbid &&
+            (table < rdbForkless.table ||
+             (table == rdbForkless.table && idx < rdbForkless.idx))) return;
+
+        rdbForklessCopyKey(db->id,dictGetKey(de),dictGetVal(de),
+                           getExpire(db,key));
+    }
+    dictAdd(touched,sdsdup(key->ptr),NULL);
+}
+
+/* Abort the forkless save in progress, if any, since the DBs are about to be
+ * replaced. Like for killRDBChild() the outcome is handled later, by
+ * rdbForklessCheckDone(). */
+void rdbForklessAbort(void) {
+    if (!rdbForkless.active) return;
+    serverLog(LL_WARNING,"Aborting the background saving thread");
+    rdbForkless.aborted = 1;
+    rdbForklessStop();
+}
+
+/* Called by serverCron() while a forkless save is in progress, to make sure
+ * the walk goes on, and to handle the termination of the save like
+ * backgroundSaveDoneHandler() does for children. */
+void rdbForklessCheckDone(void) {
+    int exited, ok;
+
+    if (rdbForkless.active) {
+        pthread_mutex_lock(&rdbForkless.lock);
+        exited = rdbForkless.exited;
+        pthread_mutex_unlock(&rdbForkless.lock);
+        if (!exited) {
+            rdbForklessStep();
+            return;
+        }
+        rdbForklessStop();
+    }
+
+    ok = rdbForkless.result == C_OK;
+    if (ok) {
+        serverLog(LL_NOTICE,
+            "Background saving terminated with success, %lld keys copied",
+            server.stat_rdb_forkless_cow_keys);
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+    } else if (rdbForkless.aborted) {
+        serverLog(LL_WARNING,"Background saving aborted");
+    } else {
+        serverLog(LL_WARNING,"Background saving error");
+        server.lastbgsave_status = C_ERR;
+    }
+    server.rdb_forkless_in_progress = 0;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    updateDictResizePolicy();
+    updateSlavesWaitingBgsave(ok ? C_OK : C_ERR, RDB_CHILD_TYPE_DISK);
+}
+
+// 后台进行RDB持久化BGSAVE操作
+int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
+    pid_t childpid;
+
+    // 当前没有正在进行AOF和RDB操作，否则返回C_ERR
+    if (hasActiveChildProcess()) return C_ERR;
+
+    // 备份当前数据库的脏键值
+    server.dirty_before_bgsave = server.dirty;
+    // 最近一个执行BGSAVE的时间
+    server.lastbgsave_try = time(NULL);
+    if (server.rdb_forkless_save) return rdbSaveForkless(filename,rsi);
+    // fork函数开始时间，记录fork函数的耗时
+    openChildInfoPipe();
+
+    // 创建子进程
+    if ((childpid = redisFork(CHILD_TYPE_RDB)) == 0) {
+        int retval;
+
+        // 子进程执行的代码
+        /* Child */
+
+        // 设置进程标题，方便识别
+        redisSetProcTitle("redis-rdb-bgsave");
+        redisSetCpuAffinity(server.bgsave_cpulist);
+        // 执行保存操作，将数据库的写到filename文件中
+        retval = rdbSave(filename,rsi);
+        if (retval == C_OK) {
+            sendChildCOWInfo(CHILD_TYPE_RDB, "RDB");
+        }
+        // 子进程退出，发送信号给父进程，发送0表示BGSAVE成功，1表示失败
+        exitFromChild((retval == C_OK) ? 0 : 1);
+    } else {
+        // 父进程执行的代码
+        /* Parent */
+
+        // 如果fork出错
+        if (childpid == -1) {
+            closeChildInfoPipe();
+            server.lastbgsave_status = C_ERR;
+            serverLog(LL_WARNING,"Can't save in background: fork: %s",
+                strerror(errno));
+            return C_ERR;
+        }
+        serverLog(LL_NOTICE,"Background saving started by pid %d",childpid);
+        server.rdb_save_time_start = time(NULL);    //设置BGSAVE开始的时间
+        server.rdb_child_pid = childpid;            //设置负责执行BGSAVE操作的子进程id
+        server.rdb_child_type = RDB_CHILD_TYPE_DISK;//设置BGSAVE的类型，往磁盘中写入
+        //关闭哈希表的resize，因为resize过程中会有复制拷贝动作
+        return C_OK;
+    }
+    return C_OK; /* unreached */
+}
+
+/* Note that we may call this function in signal handle 'sigShutdownHandler',
+ * so we need guarantee all functions we call are async-signal-safe.
+ * If  we call this function from signal handle, we won't call bg_unlik that
+ * is not async-signal-safe. */
+// 删除临时文件，当BGSAVE执行被中断时使用
+void rdbRemoveTempFile(pid_t childpid, int from_signal) {
+    char tmpfile[256];
+    char pid[32];
+
+    /* Generate temp rdb file name using aync-signal safe functions. */
+    int pid_len = ll2string(pid, sizeof(pid), childpid);
+    strcpy(tmpfile, "temp-");
+    strncpy(tmpfile+5, pid, pid_len);
+    strcpy(tmpfile+5+pid_len, ".rdb");
 
     if (from_signal) {
         /* bg_unlink is not async-signal-safe, but in this case we don't really
@@ -1771,7 +3053,12 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
 
         /* Use a regular set when there are too many entries. */
         // 根据集合成员的数量，如果大于配置的最多intset节点数量，则创建一个字典编码的集合对象
-        if (len > server.set_max_intset_entries) {
+        if (len > server.set_max_intset_entries && server.set_bitmap_encoding) {
+            /* Sets of integers saved by older versions, or while bitmaps
+             * were disabled, are loaded as bitmaps. We switch to a hash
+             * table as soon as we find a non integer element. */
+            o = createSetBitmapObject();
+        } else if (len > server.set_max_intset_entries) {
             o = createSetObject();
             /* It's faster to expand the dict to the right size asap in order
              * to avoid rehashing */
@@ -1805,6 +3092,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     dictExpand(o->ptr,len);
                 }
+            } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+                if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
+                    roaringAdd(o->ptr,llval);
+                } else {
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    dictExpand(o->ptr,len);
+                }
             }
 
             /* This will also be called when the set was just converted
@@ -1838,7 +3132,6 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             // 从rio中读出一个有序集合的元素对象
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
@@ -1865,8 +3158,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
             // 将当前元素对象插入到有序集合的跳跃表和字典中
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            zsetInsert(zs,score,sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
@@ -1960,6 +3252,42 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
+    } else if (rdbtype == RDB_TYPE_HASH_TTL) {
+        /* Hashes with volatile fields are always hash table encoded, since
+         * only that encoding can reference the TTL index. */
+        uint64_t len;
+        sds field, value;
+        long long when;
+
+        len = rdbLoadLen(rdb, NULL);
+        if (len == RDB_LENERR) return NULL;
+        o = createObject(OBJ_HASH,dictCreate(&hashDictType,NULL));
+        o->encoding = OBJ_ENCODING_HT;
+        if (len > DICT_HT_INITIAL_SIZE) dictExpand(o->ptr,len);
+
+        while (len--) {
+            if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
+                decrRefCount(o);
+                return NULL;
+            }
+            if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
+                sdsfree(field);
+                decrRefCount(o);
+                return NULL;
+            }
+            when = rdbLoadMillisecondTime(rdb,RDB_VERSION);
+            if (rioGetReadError(rdb)) {
+                sdsfree(field);
+                sdsfree(value);
+                decrRefCount(o);
+                return NULL;
+            }
+            if (dictAdd((dict*)o->ptr,field,value) == DICT_ERR)
+                rdbExitReportCorruptRDB("Duplicate keys detected");
+            if (when != -1) hashTypeSetFieldExpire(o,field,when);
+        }
+        if (hashTypeLength(o) == 0)
+            rdbExitReportCorruptRDB("Empty hash with field TTLs");
         // 读出一个quicklist类型的列表
     } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
         // 读出quicklist的节点
@@ -1974,7 +3302,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
         while (len--) {
             // 从rio中读出一个quicklistNode节点的ziplist地址
             unsigned char *zl =
-                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN|RDB_LOAD_MAPPED,
+                                           NULL);
             if (zl == NULL) {
                 decrRefCount(o);
                 return NULL;
@@ -1990,7 +3319,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
     {
         // 读出一个字符串值
         unsigned char *encoded =
-            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN|RDB_LOAD_MAPPED,
+                                       NULL);
         if (encoded == NULL) return NULL;
         // 创建字符串
         o = createObject(OBJ_STRING,encoded); /* Obj type fixed below. */
@@ -2041,13 +3371,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 o->type = OBJ_SET;
                 o->encoding = OBJ_ENCODING_INTSET;
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)  //按需转换为字典类型编码
-                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    setTypeConvert(o,server.set_bitmap_encoding ?
+                                   OBJ_ENCODING_BITMAP : OBJ_ENCODING_HT);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST: //压缩列表编码的有序集合对象
                 o->type = OBJ_ZSET;
                 o->encoding = OBJ_ENCODING_ZIPLIST;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)    //按需转换为跳跃表类型编码
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                    zsetConvert(o,zsetLargeEncoding());
                 break;
             case RDB_TYPE_HASH_ZIPLIST: // 压缩列表编码的哈希对象
                 o->type = OBJ_HASH;
@@ -2060,6 +3391,43 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
                 break;
         }
+    } else if (rdbtype == RDB_TYPE_SET_BITMAP) {
+        /* Bitmap encoded sets are stored as a single serialized blob. */
+        size_t bloblen;
+        roaring *r;
+        unsigned char *blob =
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&bloblen);
+        if (blob == NULL) return NULL;
+        r = roaringDeserialize(blob,bloblen);
+        zfree(blob);
+        if (r == NULL || roaringCard(r) == 0)
+            rdbExitReportCorruptRDB("Invalid bitmap encoded set");
+        o = createObject(OBJ_SET,r);
+        o->encoding = OBJ_ENCODING_BITMAP;
+        if (!server.set_bitmap_encoding)
+            setTypeConvert(o,OBJ_ENCODING_HT);
+    } else if (rdbtype == RDB_TYPE_STRING_BITMAP) {
+        /* Bitmap encoded strings: the length of the string, then the
+         * serialized bitmap of the offsets of the bits set. */
+        size_t bloblen;
+        uint64_t len;
+        roaring *r;
+        unsigned char *blob;
+
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        blob = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&bloblen);
+        if (blob == NULL) return NULL;
+        r = roaringDeserialize(blob,bloblen);
+        zfree(blob);
+        if (r == NULL || len == 0 || len > 512*1024*1024 ||
+            roaringRangeCard(r,INT64_MIN,-1) != 0 ||
+            roaringRangeCard(r,(int64_t)len*8,INT64_MAX) != 0)
+            rdbExitReportCorruptRDB("Invalid bitmap encoded string");
+        bitmapString *bs = zmalloc(sizeof(*bs));
+        bs->len = len;
+        bs->bits = r;
+        o = createObject(OBJ_STRING,bs);
+        o->encoding = OBJ_ENCODING_BITMAP;
     } else if (rdbtype == RDB_TYPE_STREAM_LISTPACKS) {
         o = createStreamObject();
         stream *s = o->ptr;
@@ -2087,7 +3455,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
 
             /* Load the listpack. */
             unsigned char *lp =
-                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN|RDB_LOAD_MAPPED,
+                                           NULL);
             if (lp == NULL) {
                 rdbReportReadError("Stream listpacks loading failed.");
                 sdsfree(nodekey);
@@ -2175,18 +3544,21 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                     decrRefCount(o);
                     return NULL;
                 }
-                streamNACK *nack = streamCreateNACK(NULL);
-                nack->delivery_time = rdbLoadMillisecondTime(rdb,RDB_VERSION);
-                nack->delivery_count = rdbLoadLen(rdb,NULL);
+                mstime_t delivery_time = rdbLoadMillisecondTime(rdb,RDB_VERSION);
+                uint64_t delivery_count = rdbLoadLen(rdb,NULL);
                 if (rioGetReadError(rdb)) {
                     rdbReportReadError("Stream PEL NACK loading failed.");
                     decrRefCount(o);
-                    streamFreeNACK(nack);
                     return NULL;
                 }
-                if (!raxInsert(cgroup->pel,rawid,sizeof(rawid),nack,NULL))
+                streamID id;
+                streamDecodeID(rawid,&id);
+                streamNACK *nack = streamCreateNACK(cgroup,&id,NULL);
+                if (nack == NULL)
                     rdbExitReportCorruptRDB("Duplicated gobal PEL entry "
                                             "loading stream consumer group");
+                nack->delivery_time = delivery_time;
+                nack->delivery_count = delivery_count;
             }
 
             /* Now that we loaded our global PEL, we need to load the
@@ -2232,16 +3604,20 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                         decrRefCount(o);
                         return NULL;
                     }
-                    streamNACK *nack = raxFind(cgroup->pel,rawid,sizeof(rawid));
-                    if (nack == raxNotFound)
+                    streamID id;
+                    int added;
+                    streamDecodeID(rawid,&id);
+                    streamNACK *nack = streamPELFind(cgroup->pel,&id);
+                    if (nack == NULL)
                         rdbExitReportCorruptRDB("Consumer entry not found in "
                                                 "group global PEL");
 
                     /* Set the NACK consumer, that was left to NULL when
-                     * loading the global PEL. Then set the same shared
-                     * NACK structure also in the consumer-specific PEL. */
+                     * loading the global PEL. Then add the ID also in the
+                     * consumer-specific PEL. */
                     nack->consumer = consumer;
-                    if (!raxInsert(consumer->pel,rawid,sizeof(rawid),nack,NULL))
+                    streamPELAdd(consumer->pel,&id,&added);
+                    if (!added)
                         rdbExitReportCorruptRDB("Duplicated consumer PEL entry "
                                                 " loading a stream consumer "
                                                 "group");
@@ -2385,6 +3761,605 @@ void stopSaving(int success) {
                           NULL);
 }
 
+/* ----------------------------------------------------------------------------
+ * Parallel loading
+ *
+ * When rdb-load-threads is set, the main thread no longer builds the values
+ * while reading the file. For every key it only walks the serialized value,
+ * copying its bytes into a buffer, and queues the key into a batch. A pool of
+ * threads turns every serialized value into an object calling rdbLoadObject()
+ * against the buffer, which is where most of the loading time goes (LZF
+ * decompression, ziplist and intset handling, building big hash tables),
+ * while the main thread keeps reading the file and adds the decoded batches
+ * to the dataset, in the same order they appear in the file.
+ *
+ * Since the main thread still reads every byte of the file with the usual
+ * rio object, checksum verification and loadingProgress() reporting work
+ * exactly as before. Values of module types are loaded by the main thread,
+ * since modules may not expect to be called by other threads.
+ *
+ * Sections written with rdb-save-threads (see rdbSaveSections()) are not
+ * even parsed by the main thread: the whole section is queued as a single
+ * batch, and the thread decoding it verifies its checksum and parses the
+ * key records as well.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_LOAD_BATCH_KEYS 128         /* Max keys in a batch. */
+#define RDB_LOAD_BATCH_BYTES (1024*1024) /* Submit bigger batches ASAP. */
+#define RDB_LOAD_BATCHES_PER_THREAD 4   /* Max in flight batches per thread. */
+
+typedef struct rdbLoadKey {
+    redisDb *db;
+    int type;                   /* RDB type of the value. */
+    sds key;
+    sds payload;                /* Serialized value, NULL once decoded. */
+    robj *val;                  /* Decoded value. */
+    long long expiretime;
+    long long lru_idle;
+    long long lfu_freq;
+} rdbLoadKey;
+
+typedef struct rdbLoadBatch {
+    rdbLoadKey *keys;
+    int numkeys, size;
+    size_t bytes;               /* Total length of the payloads. */
+    redisDb *db;                /* DB of the section. */
+    sds section;                /* Section payload, NULL once parsed. */
+    uint64_t crc;               /* Section checksum, zero if not computed. */
+    const char *error;          /* Set if the section can't be parsed. */
+    int decoded;                /* Set by the worker that decoded it. */
+    struct rdbLoadBatch *next;
+} rdbLoadBatch;
+
+static struct {
+    int numthreads;             /* 0 if values are decoded synchronously. */
+    pthread_t threads[RDB_LOAD_THREADS_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* Signaled when batches are queued. */
+    pthread_cond_t done_cond;   /* Signaled when a batch gets decoded. */
+    rdbLoadBatch *head, *tail;  /* Queued batches in file order. */
+    rdbLoadBatch *next;         /* First batch no worker picked yet. */
+    int queued;                 /* Length of the head..tail list. */
+    int shutdown;               /* Workers should exit. */
+    rdbLoadBatch *cur;          /* Batch being filled by the main thread. */
+    int rdbflags;
+    long long lru_clock;
+    long long now;
+} rdbLoadPool;
+
+/* When not NULL, every byte read by rdbLoadRio() is appended to this
+ * buffer by rdbLoadProgressCallback(): this is how the serialized values
+ * are captured while walking them with rdbSkipObject(). */
+static sds rdbLoadCapture = NULL;
+
+/* Consume 'len' bytes from the stream. When capturing, the bytes are read
+ * straight into the capture buffer. Returns -1 on error, 0 on success. */
+static int rdbSkipRaw(rio *rdb, size_t len) {
+    char buf[PROTO_IOBUF_LEN];
+
+    if (rdbLoadCapture) {
+        sds s = sdsMakeRoomFor(rdbLoadCapture,len);
+        int retval;
+
+        rdbLoadCapture = NULL; /* Don't append what we read twice. */
+        retval = rioRead(rdb,s+sdslen(s),len);
+        if (retval) sdsIncrLen(s,len);
+        rdbLoadCapture = s;
+        return retval ? 0 : -1;
+    }
+    while(len) {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        if (rioRead(rdb,buf,chunk) == 0) return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Consume a string as saved by rdbSaveRawString() without decoding it.
+ * Returns -1 on error, 0 on success. */
+static int rdbSkipString(rio *rdb) {
+    int isencoded;
+    uint64_t len, clen;
+
+    if (rdbLoadLenByRef(rdb,&isencoded,&len) == -1) return -1;
+    if (!isencoded) return rdbSkipRaw(rdb,len);
+    switch(len) {
+    case RDB_ENC_INT8: return rdbSkipRaw(rdb,1);
+    case RDB_ENC_INT16: return rdbSkipRaw(rdb,2);
+    case RDB_ENC_INT32: return rdbSkipRaw(rdb,4);
+    case RDB_ENC_LZF:
+    case RDB_ENC_LZ4:
+    case RDB_ENC_ZSTD:
+        if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        if (rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+        return rdbSkipRaw(rdb,clen);
+    case RDB_ENC_ALIGNED:
+        if ((clen = rdbLoadAlignedLen(rdb)) == RDB_LENERR) return -1;
+        return rdbSkipRaw(rdb,clen);
+    default:
+        rdbExitReportCorruptRDB("Unknown RDB string encoding type %llu",
+            (unsigned long long)len);
+        return -1; /* Never reached. */
+    }
+}
+
+/* Consume 'count' strings. Returns -1 on error, 0 on success. */
+static int rdbSkipStrings(rio *rdb, uint64_t count) {
+    while(count--)
+        if (rdbSkipString(rdb) == -1) return -1;
+    return 0;
+}
+
+/* Consume the serialized stream object. Returns -1 on error, 0 on
+ * success. */
+static int rdbSkipStream(rio *rdb) {
+    uint64_t listpacks, cgroups, consumers, pel_size;
+
+    /* Master IDs and listpacks. */
+    if ((listpacks = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    if (rdbSkipStrings(rdb,listpacks*2) == -1) return -1;
+
+    /* Length and last ID. */
+    if (rdbLoadLen(rdb,NULL) == RDB_LENERR ||
+        rdbLoadLen(rdb,NULL) == RDB_LENERR ||
+        rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+
+    /* Consumer groups: name, last delivered ID, global PEL of raw IDs,
+     * delivery times and counts, then the consumers with their PEL. */
+    if ((cgroups = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    while(cgroups--) {
+        if (rdbSkipString(rdb) == -1 ||
+            rdbLoadLen(rdb,NULL) == RDB_LENERR ||
+            rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+        if ((pel_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while(pel_size--) {
+            if (rdbSkipRaw(rdb,sizeof(streamID)+8) == -1 ||
+                rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+        }
+        if ((consumers = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while(consumers--) {
+            if (rdbSkipString(rdb) == -1 || rdbSkipRaw(rdb,8) == -1) return -1;
+            if ((pel_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+            if (rdbSkipRaw(rdb,pel_size*sizeof(streamID)) == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+/* Consume a value of type 'rdbtype' as rdbLoadObject() would read it, but
+ * without creating any object. Module values can't be skipped, since only
+ * the module knows how to parse them. Returns -1 on error, 0 on success. */
+static int rdbSkipObject(rio *rdb, int rdbtype) {
+    uint64_t len;
+    double score;
+
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_SET_BITMAP:
+        return rdbSkipString(rdb);
+    case RDB_TYPE_STRING_BITMAP:
+        if (rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+        return rdbSkipString(rdb);
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET:
+    case RDB_TYPE_LIST_QUICKLIST:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        return rdbSkipStrings(rdb,len);
+    case RDB_TYPE_HASH:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        return rdbSkipStrings(rdb,len*2);
+    case RDB_TYPE_HASH_TTL:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while(len--) {
+            if (rdbSkipStrings(rdb,2) == -1 || rdbSkipRaw(rdb,8) == -1)
+                return -1;
+        }
+        return 0;
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while(len--) {
+            if (rdbSkipString(rdb) == -1) return -1;
+            if (rdbtype == RDB_TYPE_ZSET_2) {
+                if (rdbSkipRaw(rdb,sizeof(double)) == -1) return -1;
+            } else {
+                if (rdbLoadDoubleValue(rdb,&score) == -1) return -1;
+            }
+        }
+        return 0;
+    case RDB_TYPE_STREAM_LISTPACKS:
+        return rdbSkipStream(rdb);
+    default:
+        rdbReportReadError("Unknown RDB encoding type %d",rdbtype);
+        return -1;
+    }
+}
+
+/* Return true if a key with the specified expire should not be loaded at
+ * all. This function is used when loading an RDB file from disk, either at
+ * startup, or when an RDB was received from the master. In the latter case,
+ * the master is responsible for key expiry. If we would expire keys here,
+ * the snapshot taken by the master may not be reflected on the slave.
+ * Similarly if the RDB is the preamble of an AOF file, we want to load all
+ * the keys as they are, since the log of operations later assume to work in
+ * an exact keyspace state. */
+static int rdbLoadKeyIsExpired(int rdbflags, long long expiretime, long long now) {
+    return iAmMaster() &&
+           !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
+           expiretime != -1 && expiretime < now;
+}
+
+/* Add a key loaded from the RDB file to 'db', together with its expire and
+ * LRU/LFU information. The function takes ownership of 'key' and 'val'. */
+static void rdbLoadAddKey(redisDb *db, sds key, robj *val, int rdbflags,
+                          long long expiretime, long long lru_idle,
+                          long long lfu_freq, long long lru_clock)
+{
+    robj keyobj;
+    initStaticStringObject(keyobj,key);
+
+    /* Add the new object in the hash table */
+    int added = dbAddRDBLoad(db,key,val);
+    if (!added) {
+        if (rdbflags & RDBFLAGS_ALLOW_DUP) {
+            /* This flag is useful for DEBUG RELOAD special modes.
+             * When it's set we allow new keys to replace the current
+             * keys with the same name. */
+            dbSyncDelete(db,&keyobj);
+            dbAddRDBLoad(db,key,val);
+        } else {
+            serverLog(LL_WARNING,
+                "RDB has duplicated key '%s' in DB %d",key,db->id);
+            serverPanic("Duplicated key found in RDB file");
+        }
+    }
+
+    /* Set the expire time if needed */
+    if (expiretime != -1) {
+        setExpire(NULL,db,&keyobj,expiretime);
+    }
+
+    /* Set usage information (for eviction). */
+    objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
+
+    /* call key space notification on key loaded for modules only */
+    moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+}
+
+/* Create an empty batch with room for 'size' keys. */
+static rdbLoadBatch *rdbLoadNewBatch(int size) {
+    rdbLoadBatch *b = zmalloc(sizeof(*b));
+
+    b->keys = size ? zmalloc(sizeof(rdbLoadKey)*size) : NULL;
+    b->numkeys = 0;
+    b->size = size;
+    b->bytes = 0;
+    b->db = NULL;
+    b->section = NULL;
+    b->crc = 0;
+    b->error = NULL;
+    b->decoded = 0;
+    b->next = NULL;
+    return b;
+}
+
+/* Return the next free key slot of the batch, growing it if needed. */
+static rdbLoadKey *rdbLoadBatchNextKey(rdbLoadBatch *b) {
+    if (b->numkeys == b->size) {
+        b->size = b->size ? b->size*2 : RDB_LOAD_BATCH_KEYS;
+        b->keys = zrealloc(b->keys,sizeof(rdbLoadKey)*b->size);
+    }
+    return b->keys+b->numkeys++;
+}
+
+/* Parse the key records of a section batch, decoding their values. Keys
+ * that are already expired are not added to the batch at all. */
+static void rdbLoadDecodeSection(rdbLoadBatch *b) {
+    long long expiretime = -1, lru_idle = -1, lfu_freq = -1;
+    size_t len = sdslen(b->section);
+    rio payload;
+
+    if (b->crc && server.rdb_checksum &&
+        crc64(0,(unsigned char*)b->section,len) != b->crc)
+    {
+        b->error = "Wrong RDB section checksum";
+        goto done;
+    }
+
+    rioInitWithBuffer(&payload,b->section);
+    while((size_t)payload.io.buffer.pos < len) {
+        rdbLoadKey *k;
+        sds key;
+        robj *val;
+        int type;
+
+        if ((type = rdbLoadType(&payload)) == -1) goto err;
+        if (type == RDB_OPCODE_EXPIRETIME_MS) {
+            expiretime = rdbLoadMillisecondTime(&payload,RDB_VERSION);
+            if (rioGetReadError(&payload)) goto err;
+            continue;
+        } else if (type == RDB_OPCODE_FREQ) {
+            uint8_t byte;
+            if (rioRead(&payload,&byte,1) == 0) goto err;
+            lfu_freq = byte;
+            continue;
+        } else if (type == RDB_OPCODE_IDLE) {
+            uint64_t qword;
+            if ((qword = rdbLoadLen(&payload,NULL)) == RDB_LENERR) goto err;
+            lru_idle = qword;
+            continue;
+        } else if (!rdbIsObjectType(type) ||
+                   type == RDB_TYPE_MODULE || type == RDB_TYPE_MODULE_2)
+        {
+            goto err;
+        }
+
+        if ((key = rdbGenericLoadStringObject(&payload,RDB_LOAD_SDS,NULL))
+            == NULL) goto err;
+        if ((val = rdbLoadObject(type,&payload,key)) == NULL) {
+            sdsfree(key);
+            goto err;
+        }
+        if (rdbLoadKeyIsExpired(rdbLoadPool.rdbflags,expiretime,
+                                rdbLoadPool.now))
+        {
+            sdsfree(key);
+            decrRefCount(val);
+        } else {
+            k = rdbLoadBatchNextKey(b);
+            k->db = b->db;
+            k->type = type;
+            k->key = key;
+            k->payload = NULL;
+            k->val = val;
+            k->expiretime = expiretime;
+            k->lru_idle = lru_idle;
+            k->lfu_freq = lfu_freq;
+        }
+        expiretime = lru_idle = lfu_freq = -1;
+    }
+    goto done;
+
+err:
+    b->error = "Invalid RDB section";
+done:
+    sdsfree(b->section);
+    b->section = NULL;
+}
+
+/* Decode all the serialized values of the batch. */
+static void rdbLoadDecodeBatch(rdbLoadBatch *b) {
+    if (b->section) {
+        rdbLoadDecodeSection(b);
+        return;
+    }
+    for (int j = 0; j < b->numkeys; j++) {
+        rdbLoadKey *k = b->keys+j;
+        rio payload;
+
+        if (k->payload == NULL) continue; /* Loaded by the main thread. */
+        rioInitWithBuffer(&payload,k->payload);
+        k->val = rdbLoadObject(k->type,&payload,k->key);
+        sdsfree(k->payload);
+        k->payload = NULL;
+    }
+}
+
+static void *rdbLoadThreadMain(void *arg) {
+    rdbLoadBatch *b;
+    sigset_t sigset;
+    UNUSED(arg);
+
+    redis_set_thread_title("rdb_load");
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in RDB loading thread: %s",
+            strerror(errno));
+
+    pthread_mutex_lock(&rdbLoadPool.lock);
+    while(1) {
+        while(rdbLoadPool.next == NULL && !rdbLoadPool.shutdown)
+            pthread_cond_wait(&rdbLoadPool.work_cond,&rdbLoadPool.lock);
+        if ((b = rdbLoadPool.next) == NULL) break;
+        rdbLoadPool.next = b->next;
+        pthread_mutex_unlock(&rdbLoadPool.lock);
+
+        rdbLoadDecodeBatch(b);
+
+        pthread_mutex_lock(&rdbLoadPool.lock);
+        b->decoded = 1;
+        pthread_cond_signal(&rdbLoadPool.done_cond);
+    }
+    pthread_mutex_unlock(&rdbLoadPool.lock);
+    return NULL;
+}
+
+/* Start 'numthreads' decoding threads. If the threads can't be created,
+ * rdbLoadPool.numthreads is left to zero and the values are loaded by the
+ * main thread as usually. */
+static void rdbLoadPoolStart(int numthreads, int rdbflags, long long lru_clock, long long now) {
+    int j;
+
+    rdbLoadPool.numthreads = 0;
+    rdbLoadPool.head = rdbLoadPool.tail = rdbLoadPool.next = NULL;
+    rdbLoadPool.cur = NULL;
+    rdbLoadPool.queued = 0;
+    rdbLoadPool.shutdown = 0;
+    rdbLoadPool.rdbflags = rdbflags;
+    rdbLoadPool.lru_clock = lru_clock;
+    rdbLoadPool.now = now;
+    if (numthreads <= 0) return;
+
+    pthread_mutex_init(&rdbLoadPool.lock,NULL);
+    pthread_cond_init(&rdbLoadPool.work_cond,NULL);
+    pthread_cond_init(&rdbLoadPool.done_cond,NULL);
+
+    for (j = 0; j < numthreads && j < RDB_LOAD_THREADS_MAX; j++) {
+        if (pthread_create(&rdbLoadPool.threads[j],NULL,
+                           rdbLoadThreadMain,NULL) != 0) break;
+        rdbLoadPool.numthreads++;
+    }
+    if (rdbLoadPool.numthreads != numthreads)
+        serverLog(LL_WARNING,"Can't create all the RDB loading threads, "
+                             "loading with %d.", rdbLoadPool.numthreads);
+    else
+        serverLog(LL_NOTICE,"Loading RDB values with %d threads.",
+                  rdbLoadPool.numthreads);
+}
+
+/* Free the keys of a batch that was not added to the dataset. */
+static void rdbLoadFreeBatch(rdbLoadBatch *b) {
+    for (int j = 0; j < b->numkeys; j++) {
+        sdsfree(b->keys[j].key);
+        sdsfree(b->keys[j].payload);
+        if (b->keys[j].val) decrRefCount(b->keys[j].val);
+    }
+    sdsfree(b->section);
+    zfree(b->keys);
+    zfree(b);
+}
+
+/* Add to the dataset, in order, the queued batches that were already
+ * decoded. If more than 'maxqueued' batches remain queued, wait for the
+ * workers to decode them. */
+static void rdbLoadPoolDrain(int maxqueued) {
+    while(1) {
+        rdbLoadBatch *b;
+
+        pthread_mutex_lock(&rdbLoadPool.lock);
+        b = rdbLoadPool.head;
+        if (b == NULL ||
+            (!b->decoded && rdbLoadPool.queued <= maxqueued))
+        {
+            pthread_mutex_unlock(&rdbLoadPool.lock);
+            return;
+        }
+        while(!b->decoded)
+            pthread_cond_wait(&rdbLoadPool.done_cond,&rdbLoadPool.lock);
+        rdbLoadPool.head = b->next;
+        if (rdbLoadPool.head == NULL) rdbLoadPool.tail = NULL;
+        rdbLoadPool.queued--;
+        pthread_mutex_unlock(&rdbLoadPool.lock);
+
+        if (b->error) rdbExitReportCorruptRDB("%s",b->error);
+        for (int j = 0; j < b->numkeys; j++) {
+            rdbLoadKey *k = b->keys+j;
+
+            if (k->val == NULL) {
+                rdbExitReportCorruptRDB("Can't decode the value of key '%s'",
+                    k->key);
+            }
+            rdbLoadAddKey(k->db,k->key,k->val,rdbLoadPool.rdbflags,
+                k->expiretime,k->lru_idle,k->lfu_freq,rdbLoadPool.lru_clock);
+        }
+        zfree(b->keys);
+        zfree(b);
+    }
+}
+
+/* Queue the batch being filled to the decoding threads. */
+static void rdbLoadPoolSubmit(void) {
+    rdbLoadBatch *b = rdbLoadPool.cur;
+
+    if (b == NULL) return;
+    rdbLoadPool.cur = NULL;
+    pthread_mutex_lock(&rdbLoadPool.lock);
+    if (rdbLoadPool.tail)
+        rdbLoadPool.tail->next = b;
+    else
+        rdbLoadPool.head = b;
+    rdbLoadPool.tail = b;
+    if (rdbLoadPool.next == NULL) rdbLoadPool.next = b;
+    rdbLoadPool.queued++;
+    pthread_cond_signal(&rdbLoadPool.work_cond);
+    pthread_mutex_unlock(&rdbLoadPool.lock);
+
+    /* Bound the memory used by the values not yet in the dataset. */
+    rdbLoadPoolDrain(rdbLoadPool.numthreads*RDB_LOAD_BATCHES_PER_THREAD);
+}
+
+/* Queue a key for decoding. Either 'payload' is the serialized value, or
+ * 'val' is the value already loaded by the main thread. Keys are queued
+ * anyway in the latter case, so that they are added in file order. */
+static void rdbLoadPoolQueueKey(redisDb *db, sds key, int type, sds payload,
+                                robj *val, long long expiretime,
+                                long long lru_idle, long long lfu_freq)
+{
+    rdbLoadBatch *b = rdbLoadPool.cur;
+    rdbLoadKey *k;
+
+    if (b == NULL) b = rdbLoadPool.cur = rdbLoadNewBatch(RDB_LOAD_BATCH_KEYS);
+    k = rdbLoadBatchNextKey(b);
+    k->db = db;
+    k->type = type;
+    k->key = key;
+    k->payload = payload;
+    k->val = val;
+    k->expiretime = expiretime;
+    k->lru_idle = lru_idle;
+    k->lfu_freq = lfu_freq;
+    if (payload) b->bytes += sdslen(payload);
+    if (b->numkeys == RDB_LOAD_BATCH_KEYS || b->bytes >= RDB_LOAD_BATCH_BYTES)
+        rdbLoadPoolSubmit();
+}
+
+/* Queue a whole section, that a decoding thread will parse. */
+static void rdbLoadPoolQueueSection(redisDb *db, sds section, uint64_t crc) {
+    rdbLoadBatch *b;
+
+    rdbLoadPoolSubmit(); /* Keys read before go first. */
+    b = rdbLoadPool.cur = rdbLoadNewBatch(0);
+    b->db = db;
+    b->section = section;
+    b->crc = crc;
+    b->bytes = sdslen(section);
+    rdbLoadPoolSubmit();
+}
+
+/* Stop the decoding threads. If 'success' is true all the queued keys are
+ * added to the dataset first, otherwise they are just released. */
+static void rdbLoadPoolStop(int success) {
+    rdbLoadBatch *b;
+    int j;
+
+    if (rdbLoadPool.numthreads == 0) return;
+    if (success) {
+        rdbLoadPoolSubmit();
+        rdbLoadPoolDrain(0);
+    }
+
+    pthread_mutex_lock(&rdbLoadPool.lock);
+    rdbLoadPool.shutdown = 1;
+    pthread_cond_broadcast(&rdbLoadPool.work_cond);
+    pthread_mutex_unlock(&rdbLoadPool.lock);
+    for (j = 0; j < rdbLoadPool.numthreads; j++)
+        pthread_join(rdbLoadPool.threads[j],NULL);
+
+    /* After an error, workers decoded everything that was queued. */
+    while((b = rdbLoadPool.head) != NULL) {
+        rdbLoadPool.head = b->next;
+        rdbLoadFreeBatch(b);
+    }
+    if (rdbLoadPool.cur) rdbLoadFreeBatch(rdbLoadPool.cur);
+    rdbLoadPool.tail = rdbLoadPool.next = rdbLoadPool.cur = NULL;
+    rdbLoadPool.queued = 0;
+    rdbLoadPool.numthreads = 0;
+
+    pthread_mutex_destroy(&rdbLoadPool.lock);
+    pthread_cond_destroy(&rdbLoadPool.work_cond);
+    pthread_cond_destroy(&rdbLoadPool.done_cond);
+}
+
 /* Track loading progress in order to serve client's from time to time
    and if needed calculate rdb checksum  */
 // 跟踪载入的信息，以便client进行查询，在rdb查询和时也需要
@@ -2392,6 +4367,8 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     // 如果设置了校验和，则进行校验和计算
     if (server.rdb_checksum)
         rioGenericUpdateChecksum(r, buf, len);
+    if (rdbLoadCapture)
+        rdbLoadCapture = sdscatlen(rdbLoadCapture, buf, len);
     // loading_process_events_interval_bytes 在server初始化是设置为2M
     // 在load时，用来设置读或写的最大字节数max_processing_chunk
     if (server.loading_process_events_interval_bytes &&
@@ -2432,7 +4409,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         return C_ERR;
     }
     rdbver = atoi(buf+5);
-    if (rdbver < 1 || rdbver > RDB_VERSION) {
+    if (rdbver < 1 || !rdbIsKnownVersion(rdbver)) {
         serverLog(LL_WARNING,"Can't handle RDB format version %d",rdbver);
         errno = EINVAL;
         return C_ERR;
@@ -2441,6 +4418,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     /* Key-specific attributes, set by opcodes before the key type. */
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
     long long lru_clock = LRU_CLOCK();
+    rdbLoadPoolStart(server.rdb_load_threads,rdbflags,lru_clock,now);
 
     while(1) {
         sds key;
@@ -2478,6 +4456,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
+            rdbLoadPoolStop(1);
             break;
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
@@ -2502,6 +4481,50 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             dictExpand(db->dict,db_size);
             dictExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_SECTION) {
+            /* SECTION: a run of keys of the specified DB, see
+             * rdbSaveSections(). Without loading threads we just select
+             * the DB and read the keys as usually, the global checksum
+             * already covers them. */
+            uint64_t seclen, crc;
+            if ((dbid = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if (dbid >= (unsigned)server.dbnum) {
+                serverLog(LL_WARNING,
+                    "FATAL: Data file was created with a Redis "
+                    "server configured to handle more than %d "
+                    "databases. Exiting\n", server.dbnum);
+                exit(1);
+            }
+            db = server.db+dbid;
+            if ((seclen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if (rioRead(rdb,&crc,8) == 0) goto eoferr;
+            memrev64ifbe(&crc);
+            if (rdbLoadPool.numthreads) {
+                /* The thread decoding the section verifies its CRC, so we
+                 * combine it into the file checksum instead of computing
+                 * it here as well. */
+                sds section = sdsnewlen(SDS_NOINIT,seclen);
+                if ((crc && server.rdb_checksum ?
+                     rioReadWithChecksum(rdb,section,seclen,crc) :
+                     rioRead(rdb,section,seclen)) == 0)
+                {
+                    sdsfree(section);
+                    goto eoferr;
+                }
+                rdbLoadPoolQueueSection(db,section,crc);
+            }
+            continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_SECTION_INDEX) {
+            /* SECTION_INDEX: DB, offset and length of every section. We
+             * found the sections while reading the file already. */
+            uint64_t count;
+            if ((count = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            while(count--) {
+                if (rdbLoadLen(rdb,NULL) == RDB_LENERR ||
+                    rdbLoadLen(rdb,NULL) == RDB_LENERR ||
+                    rdbLoadLen(rdb,NULL) == RDB_LENERR) goto eoferr;
+            }
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
              * which is backward compatible. Implementations of RDB loading
@@ -2618,56 +4641,48 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         /* Read key */
         if ((key = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
             goto eoferr;
-        /* Read value */
-        if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
-            sdsfree(key);
-            goto eoferr;
-        }
 
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
-         * responsible for key expiry. If we would expire keys here, the
-         * snapshot taken by the master may not be reflected on the slave.
-         * Similarly if the RDB is the preamble of an AOF file, we want to
-         * load all the keys as they are, since the log of operations later
-         * assume to work in an exact keyspace state. */
-        if (iAmMaster() &&
-            !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
-            expiretime != -1 && expiretime < now)
+        if (rdbLoadPool.numthreads &&
+            type != RDB_TYPE_MODULE && type != RDB_TYPE_MODULE_2)
         {
-            sdsfree(key);
-            decrRefCount(val);
+            /* Capture the serialized value for the decoding threads,
+             * unless the key is expired and we don't need it at all. */
+            int expired = rdbLoadKeyIsExpired(rdbflags,expiretime,now);
+            sds payload;
+            int retval;
+
+            if (!expired) rdbLoadCapture = sdsempty();
+            retval = rdbSkipObject(rdb,type);
+            payload = rdbLoadCapture;
+            rdbLoadCapture = NULL;
+            if (retval == -1) {
+                sdsfree(payload);
+                sdsfree(key);
+                goto eoferr;
+            }
+            if (expired) {
+                sdsfree(key);
+            } else {
+                rdbLoadPoolQueueKey(db,key,type,payload,NULL,
+                                    expiretime,lru_idle,lfu_freq);
+            }
         } else {
-            robj keyobj;
-            initStaticStringObject(keyobj,key);
-
-            /* Add the new object in the hash table */
-            int added = dbAddRDBLoad(db,key,val);
-            if (!added) {
-                if (rdbflags & RDBFLAGS_ALLOW_DUP) {
-                    /* This flag is useful for DEBUG RELOAD special modes.
-                     * When it's set we allow new keys to replace the current
-                     * keys with the same name. */
-                    dbSyncDelete(db,&keyobj);
-                    dbAddRDBLoad(db,key,val);
-                } else {
-                    serverLog(LL_WARNING,
-                        "RDB has duplicated key '%s' in DB %d",key,db->id);
-                    serverPanic("Duplicated key found in RDB file");
-                }
+            /* Read value */
+            if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
+                sdsfree(key);
+                goto eoferr;
             }
 
-            /* Set the expire time if needed */
-            if (expiretime != -1) {
-                setExpire(NULL,db,&keyobj,expiretime);
+            if (rdbLoadKeyIsExpired(rdbflags,expiretime,now)) {
+                sdsfree(key);
+                decrRefCount(val);
+            } else if (rdbLoadPool.numthreads) {
+                rdbLoadPoolQueueKey(db,key,type,NULL,val,
+                                    expiretime,lru_idle,lfu_freq);
+            } else {
+                rdbLoadAddKey(db,key,val,rdbflags,expiretime,
+                              lru_idle,lfu_freq,lru_clock);
             }
-
-            /* Set usage information (for eviction). */
-            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
-
-            /* call key space notification on key loaded for modules only */
-            moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
         }
 
         /* Loading the database more slowly is useful in order to test
@@ -2705,6 +4720,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
      * the RDB file from a socket during initial SYNC (diskless replica mode),
      * we'll report the error to the caller, so that we can retry. */
 eoferr:
+    rdbLoadPoolStop(0);
     serverLog(LL_WARNING,
         "Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbReportReadError("Unexpected EOF reading RDB file");
@@ -2718,16 +4734,49 @@ eoferr:
  *
  * If you pass an 'rsi' structure initialied with RDB_SAVE_OPTION_INIT, the
  * loading code will fiil the information fields in the structure. */
+/* Map the RDB file open as 'fp' in memory for rdbLoad(), registering the
+ * mapping with zmalloc so that the strings of the file can be used in
+ * place. Returns NULL if the file can't be mapped. */
+static char *rdbMapFile(FILE *fp, size_t *lenptr) {
+    struct stat sb;
+    char *map;
+
+    if (fstat(fileno(fp),&sb) == -1 || sb.st_size == 0) return NULL;
+    map = mmap(NULL,sb.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,
+               fileno(fp),0);
+    if (map == MAP_FAILED) {
+        serverLog(LL_WARNING,"Can't map the RDB file in memory: %s",
+            strerror(errno));
+        return NULL;
+    }
+    if (zmalloc_map_register(map,sb.st_size) == -1) {
+        serverLog(LL_NOTICE,"Too many mapped RDB files still in use, "
+                            "loading the RDB file without mapping it");
+        munmap(map,sb.st_size);
+        return NULL;
+    }
+    *lenptr = sb.st_size;
+    return map;
+}
+
 // 将指定的RDB文件读到数据库中
 int rdbLoad(char *filename, rdbSaveInfo *rsi, int rdbflags) {
     FILE *fp;
     rio rdb;
     int retval;
+    char *map = NULL;
+    size_t maplen;
 
     if ((fp = fopen(filename,"r")) == NULL) return C_ERR;   // 只读打开文件
     startLoadingFile(fp, filename,rdbflags);
-    rioInitWithFile(&rdb,fp);
+    if (server.rdb_mmap_snapshot) map = rdbMapFile(fp,&maplen);
+    if (map)
+        rioInitWithMap(&rdb,map,maplen);
+    else
+        rioInitWithFile(&rdb,fp);
     retval = rdbLoadRio(&rdb,rdbflags,rsi);
+    /* The mapping stays around as long as the adopted strings. */
+    if (map) zmalloc_map_unregister(map);
     fclose(fp);
     stopLoading(retval==C_OK);
     return retval;
@@ -2912,7 +4961,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_forkless_in_progress) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -2943,7 +4992,7 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_forkless_in_progress) {
         addReplyError(c,"Background save already in progress");
     } else if (hasActiveChildProcess()) {
         if (schedule) {
@@ -38,7 +38,18 @@
 
 /* The current RDB version. When the format changes in a way that is no longer
  * backward compatible this number gets incremented. */
-#define RDB_VERSION 9   //RDB的版本
+#define RDB_VERSION 9002   //RDB的版本
+
+/* Versions 1 to RDB_VERSION_UPSTREAM_MAX are the upstream formats this tree
+ * can read. The formats specific to this tree are numbered starting from
+ * RDB_VERSION_LOCAL_BASE, far away from the upstream ones, so that files
+ * written here are never mistaken for upstream files and the other way
+ * around: 9001 added the bitmap and hash TTL types, 9002 the keyspace
+ * sections. */
+#define RDB_VERSION_UPSTREAM_MAX 9
+#define RDB_VERSION_LOCAL_BASE 9001
+#define rdbIsKnownVersion(v) ((v) <= RDB_VERSION_UPSTREAM_MAX || \
+                              ((v) >= RDB_VERSION_LOCAL_BASE && (v) <= RDB_VERSION))
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -68,6 +79,13 @@
 #define RDB_ENC_INT16 1       /* 16位有符号整数 16 bit signed integer */
 #define RDB_ENC_INT32 2       /* 32位有符号整数 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* LZF压缩过的字符串 string compressed with FASTLZ */
+#define RDB_ENC_LZ4 4         /* String compressed as an LZ4 block. */
+#define RDB_ENC_ZSTD 5        /* String compressed as a zstd frame. */
+#define RDB_ENC_ALIGNED 6     /* Verbatim string padded to a page boundary. */
+
+/* Page size the blobs of memory mappable snapshots are aligned to, see
+ * rdbSaveEncodedBlob(). */
+#define RDB_MMAP_PAGE_SIZE 4096
 
 /* Map object types to RDB object types. Macros starting with OBJ_ are for
  * memory storage and may change. Instead RDB types must be fixed because
@@ -94,11 +112,25 @@
 #define RDB_TYPE_STREAM_LISTPACKS 15
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
+/* Object types specific to this tree. Upstream allocates new types upward
+ * from the ones above, so these start from RDB_TYPE_LOCAL_BASE to never
+ * collide with them. */
+#define RDB_TYPE_LOCAL_BASE    128
+#define RDB_TYPE_SET_BITMAP    128  //roaring bitmap编码的集合对象
+#define RDB_TYPE_HASH_TTL      129  //带有field过期时间的哈希对象
+#define RDB_TYPE_STRING_BITMAP 130  //roaring bitmap编码的字符串对象
+/* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
+
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15) || \
+                            (t >= RDB_TYPE_LOCAL_BASE && t <= 130))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
 /* RDB操作码，保存和加载类型时使用 */
+/* Opcodes specific to this tree. Upstream allocates new opcodes downward
+ * from the ones below, so these are kept well apart from them. */
+#define RDB_OPCODE_SECTION_INDEX 200 /* Offsets of the keyspace sections. */
+#define RDB_OPCODE_SECTION    201   /* Checksummed run of keys of one DB. */
 #define RDB_OPCODE_MODULE_AUX 247   /* Module auxiliary data. */
 #define RDB_OPCODE_IDLE       248   /* LRU idle time. */
 #define RDB_OPCODE_FREQ       249   /* LFU frequency. */
@@ -122,6 +154,11 @@
 #define RDB_LOAD_ENC    (1<<0)
 #define RDB_LOAD_PLAIN  (1<<1)
 #define RDB_LOAD_SDS    (1<<2)
+#define RDB_LOAD_MAPPED (1<<3)
+
+/* Max number of threads decoding values while loading an RDB file. */
+#define RDB_LOAD_THREADS_MAX 64
+#define RDB_SAVE_THREADS_MAX 64
 
 /* flags on the purpose of rdb save or load */
 #define RDBFLAGS_NONE 0                 /* No special RDB loading. */
@@ -176,6 +213,9 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename);
 robj *rdbLoadStringObject(rio *rdb);
 ssize_t rdbSaveStringObject(rio *rdb, robj *obj);
 ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len);
+ssize_t rdbSaveEncodedBlob(rio *rdb, unsigned char *s, size_t len);
+size_t rdbZstdCompress(void *dst, size_t dstlen, const void *src, size_t srclen);
+int rdbZstdDecompress(void *dst, size_t dstlen, const void *src, size_t srclen);
 void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr);
 int rdbSaveBinaryDoubleValue(rio *rdb, double val);
 int rdbLoadBinaryDoubleValue(rio *rdb, double *val);
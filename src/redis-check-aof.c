@@ -30,6 +30,7 @@
 
 #include "server.h"
 #include <sys/stat.h>
+#include <sys/param.h>
 
 #define ERROR(...) { \
     char __buf[1024]; \
@@ -97,31 +98,89 @@ int readArgc(FILE *fp, long *target) {
     return readLong(fp,'*',target);
 }
 
+/* Track the MULTI/EXEC blocks given the name of each command. */
+int checkMultiExec(const char *name, int *multi) {
+    if (strcasecmp(name, "multi") == 0) {
+        if ((*multi)++) {
+            ERROR("Unexpected MULTI");
+            return 0;
+        }
+    } else if (strcasecmp(name, "exec") == 0) {
+        if (--(*multi)) {
+            ERROR("Unexpected EXEC");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int checkBinaryCommand(int argc, sds *argv, int *multi) {
+    int ok = checkMultiExec(argv[0],multi);
+
+    for (int j = 0; j < argc; j++) sdsfree(argv[j]);
+    zfree(argv);
+    return ok;
+}
+
+/* Check a frame of the binary encoding, whose marker was already read:
+ * a single command, or a compressed block of commands. */
+int processBinaryFrame(FILE *fp, int marker, int *multi) {
+    sds frame, raw;
+    sds *argv;
+    size_t pos = 0;
+    int argc, ok = 1;
+
+    epos = ftello(fp)-1;
+    if (aofBinaryReadFrame(fp,&frame) == C_ERR) {
+        ERROR("Truncated or invalid binary frame");
+        return 0;
+    }
+    if (marker == AOF_BIN_CMD) {
+        if (aofBinaryDecodeCommand((unsigned char*)frame,sdslen(frame),
+                                   &argc,&argv) == C_ERR)
+        {
+            ERROR("Invalid binary command");
+            ok = 0;
+        } else {
+            ok = checkBinaryCommand(argc,argv,multi);
+        }
+    } else if ((raw = aofBinaryInflateBlock(frame)) == NULL) {
+        ERROR("Invalid compressed block");
+        ok = 0;
+    } else {
+        while(ok && pos < sdslen(raw)) {
+            if (aofBinaryNextBlockCommand(raw,&pos,&argc,&argv) == C_ERR) {
+                ERROR("Invalid binary command in compressed block");
+                ok = 0;
+            } else {
+                ok = checkBinaryCommand(argc,argv,multi);
+            }
+        }
+        sdsfree(raw);
+    }
+    sdsfree(frame);
+    return ok;
+}
+
 off_t process(FILE *fp) {
     long argc;
     off_t pos = 0;
-    int i, multi = 0;
+    int i, c, multi = 0;
     char *str;
 
     while(1) {
         if (!multi) pos = ftello(fp);
+        if ((c = getc(fp)) == EOF) break;
+        if (c == AOF_BIN_CMD || c == AOF_BIN_BLOCK) {
+            if (!processBinaryFrame(fp,c,&multi)) break;
+            continue;
+        }
+        ungetc(c,fp);
         if (!readArgc(fp, &argc)) break;
 
         for (i = 0; i < argc; i++) {
             if (!readString(fp,&str)) break;
-            if (i == 0) {
-                if (strcasecmp(str, "multi") == 0) {
-                    if (multi++) {
-                        ERROR("Unexpected MULTI");
-                        break;
-                    }
-                } else if (strcasecmp(str, "exec") == 0) {
-                    if (--multi) {
-                        ERROR("Unexpected EXEC");
-                        break;
-                    }
-                }
-            }
+            if (i == 0 && !checkMultiExec(str,&multi)) break;
             zfree(str);
         }
 
@@ -141,42 +200,36 @@ off_t process(FILE *fp) {
     return pos;
 }
 
-int redis_check_aof_main(int argc, char **argv) {
-    char *filename;
-    int fix = 0;
+/* Return codes of checkAofFile(). */
+#define AOF_CHECK_OK 0          /* The file is valid. */
+#define AOF_CHECK_TRUNCATED 1   /* The file was fixed by truncating it. */
+#define AOF_CHECK_INVALID 2     /* The file is not valid. */
 
-    if (argc < 2) {
-        printf("Usage: %s [--fix] <file.aof>\n", argv[0]);
-        exit(1);
-    } else if (argc == 2) {
-        filename = argv[1];
-    } else if (argc == 3) {
-        if (strcmp(argv[1],"--fix") != 0) {
-            printf("Invalid argument: %s\n", argv[1]);
-            exit(1);
-        }
-        filename = argv[2];
-        fix = 1;
-    } else {
-        printf("Invalid arguments\n");
-        exit(1);
-    }
-
-    FILE *fp = fopen(filename,"r+");
+/* Check the AOF file at 'filepath', that may start with an RDB preamble.
+ * With 'fix' set an invalid tail is truncated away, after asking for a
+ * confirmation. Empty files are only accepted if 'allow_empty' is set,
+ * as the incr files of a multi part AOF may legitimately be empty. */
+int checkAofFile(char *filepath, int fix, int allow_empty) {
+    FILE *fp = fopen(filepath,"r+");
     if (fp == NULL) {
-        printf("Cannot open file: %s\n", filename);
+        printf("Cannot open file: %s\n", filepath);
         exit(1);
     }
 
     struct redis_stat sb;
     if (redis_fstat(fileno(fp),&sb) == -1) {
-        printf("Cannot stat file: %s\n", filename);
+        printf("Cannot stat file: %s\n", filepath);
         exit(1);
     }
 
     off_t size = sb.st_size;
     if (size == 0) {
-        printf("Empty file: %s\n", filename);
+        fclose(fp);
+        if (allow_empty) {
+            printf("AOF %s is empty\n", filepath);
+            return AOF_CHECK_OK;
+        }
+        printf("Empty file: %s\n", filepath);
         exit(1);
     }
 
@@ -188,9 +241,11 @@ int redis_check_aof_main(int argc, char **argv) {
                             memcmp(sig,"REDIS",sizeof(sig)) == 0;
         rewind(fp);
         if (has_preamble) {
+            char *rdbargv[] = {"redis-check-aof", filepath};
+
             printf("The AOF appears to start with an RDB preamble.\n"
                    "Checking the RDB preamble to start:\n");
-            if (redis_check_rdb_main(argc,argv,fp) == C_ERR) {
+            if (redis_check_rdb_main(2,rdbargv,fp) == C_ERR) {
                 printf("RDB preamble of AOF file is not sane, aborting.\n");
                 exit(1);
             } else {
@@ -199,8 +254,10 @@ int redis_check_aof_main(int argc, char **argv) {
         }
     }
 
+    error[0] = '\0';
     off_t pos = process(fp);
     off_t diff = size-pos;
+    int retval = AOF_CHECK_OK;
     printf("AOF analyzed: size=%lld, ok_up_to=%lld, diff=%lld\n",
         (long long) size, (long long) pos, (long long) diff);
     if (diff > 0) {
@@ -219,15 +276,127 @@ int redis_check_aof_main(int argc, char **argv) {
             } else {
                 printf("Successfully truncated AOF\n");
             }
+            retval = AOF_CHECK_TRUNCATED;
         } else {
-            printf("AOF is not valid. "
-                   "Use the --fix option to try fixing it.\n");
+            retval = AOF_CHECK_INVALID;
+        }
+    }
+
+    fclose(fp);
+    return retval;
+}
+
+/* Return true if the file at 'filepath' looks like an AOF manifest: its
+ * first line that is not a comment starts with "file ". */
+int fileIsManifest(char *filepath) {
+    char buf[MAXPATHLEN+128];
+    int is_manifest = 0;
+    FILE *fp = fopen(filepath,"r");
+
+    if (fp == NULL) return 0;
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        if (buf[0] == '#') continue;
+        is_manifest = strncmp(buf,"file ",5) == 0;
+        break;
+    }
+    fclose(fp);
+    return is_manifest;
+}
+
+/* Check every file listed by the manifest at 'filepath', the base first
+ * and then the incr files, in the order they are loaded. The file names
+ * are relative to the directory of the manifest. Only the last incr file
+ * may be fixed by truncating it: it is the one that was being appended
+ * to, while a problem in any other file means data in the middle of the
+ * AOF is lost, and truncating it would silently drop the files after. */
+void checkManifest(char *filepath, int fix) {
+    aofManifest *am = aofLoadManifestFromFile(filepath);
+    sds dir = sdsnew(filepath);
+    char *slash = strrchr(dir,'/');
+    list *files = listCreate();
+    listIter li;
+    listNode *ln;
+    int invalid = 0;
+
+    if (am == NULL) {
+        printf("Cannot open file: %s\n", filepath);
+        exit(1);
+    }
+    if (slash) sdsrange(dir,0,slash-dir); else sdsclear(dir);
+
+    if (am->base_aof_info) listAddNodeTail(files,am->base_aof_info);
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL)
+        listAddNodeTail(files,listNodeValue(ln));
+    if (listLength(files) == 0) {
+        printf("The AOF manifest %s lists no file\n", filepath);
+        exit(1);
+    }
+
+    listRewind(files,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = listNodeValue(ln);
+        int last = ln == listLast(files) &&
+                   ai->file_type == AOF_FILE_TYPE_INCR;
+        sds path = sdscatsds(sdsdup(dir),ai->file_name);
+
+        printf("Checking %s file %s\n",
+            ai->file_type == AOF_FILE_TYPE_BASE ? "base" : "incr", path);
+        int retval = checkAofFile(path,fix && last,
+                                  ai->file_type == AOF_FILE_TYPE_INCR);
+        if (retval == AOF_CHECK_INVALID) {
+            invalid = 1;
+            if (fix)
+                printf("%s is not the last incr file of the manifest, "
+                       "it can't be fixed by truncating it\n", path);
+        }
+        sdsfree(path);
+        if (invalid) break;
+    }
+
+    listRelease(files);
+    aofManifestFree(am);
+    sdsfree(dir);
+    if (invalid) {
+        printf("AOF is not valid. ");
+        if (!fix) printf("Use the --fix option to try fixing it.");
+        printf("\n");
+        exit(1);
+    }
+    printf("AOF is valid\n");
+    exit(0);
+}
+
+int redis_check_aof_main(int argc, char **argv) {
+    char *filename;
+    int fix = 0;
+
+    if (argc < 2) {
+        printf("Usage: %s [--fix] <file.aof|file.aof.manifest>\n", argv[0]);
+        exit(1);
+    } else if (argc == 2) {
+        filename = argv[1];
+    } else if (argc == 3) {
+        if (strcmp(argv[1],"--fix") != 0) {
+            printf("Invalid argument: %s\n", argv[1]);
             exit(1);
         }
+        filename = argv[2];
+        fix = 1;
     } else {
-        printf("AOF is valid\n");
+        printf("Invalid arguments\n");
+        exit(1);
     }
 
-    fclose(fp);
+    if (fileIsManifest(filename)) checkManifest(filename,fix);
+
+    int retval = checkAofFile(filename,fix,0);
+    if (retval == AOF_CHECK_INVALID) {
+        printf("AOF is not valid. "
+               "Use the --fix option to try fixing it.\n");
+        exit(1);
+    } else if (retval == AOF_CHECK_OK) {
+        printf("AOF is valid\n");
+    }
     exit(0);
 }
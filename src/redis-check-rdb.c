@@ -90,6 +90,24 @@ char *rdb_type_string[] = {
     "stream"
 };
 
+/* Types specific to this tree, starting from RDB_TYPE_LOCAL_BASE. */
+char *rdb_local_type_string[] = {
+    "set-bitmap",
+    "hash-ttl",
+    "string-bitmap"
+};
+
+/* Return the name of the RDB object type 'type'. */
+char *rdbTypeString(int type) {
+    int local = type-RDB_TYPE_LOCAL_BASE;
+
+    if ((unsigned)type < sizeof(rdb_type_string)/sizeof(char*))
+        return rdb_type_string[type];
+    if ((unsigned)local < sizeof(rdb_local_type_string)/sizeof(char*))
+        return rdb_local_type_string[local];
+    return "unknown";
+}
+
 /* Show a few stats collected into 'rdbstate' */
 void rdbShowGenericInfo(void) {
     printf("[info] %lu keys read\n", rdbstate.keys);
@@ -118,10 +136,7 @@ void rdbCheckError(const char *fmt, ...) {
             (char*)rdbstate.key->ptr);
     if (rdbstate.key_type != -1)
         printf("[additional info] Reading type %d (%s)\n",
-            rdbstate.key_type,
-            ((unsigned)rdbstate.key_type <
-             sizeof(rdb_type_string)/sizeof(char*)) ?
-                rdb_type_string[rdbstate.key_type] : "unknown");
+            rdbstate.key_type, rdbTypeString(rdbstate.key_type));
     rdbShowGenericInfo();
 }
 
@@ -198,7 +213,7 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         goto err;
     }
     rdbver = atoi(buf+5);
-    if (rdbver < 1 || rdbver > RDB_VERSION) {
+    if (rdbver < 1 || !rdbIsKnownVersion(rdbver)) {
         rdbCheckError("Can't handle RDB format version %d",rdbver);
         goto err;
     }
@@ -258,6 +273,32 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             if ((expires_size = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_SECTION) {
+            /* SECTION: the keys that follow belong to the specified DB. */
+            uint64_t seclen, crc;
+            rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
+            if ((dbid = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+                goto eoferr;
+            if ((seclen = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+                goto eoferr;
+            if (rioRead(&rdb,&crc,8) == 0) goto eoferr;
+            rdbCheckInfo("Section of %llu bytes for DB ID %d",
+                (unsigned long long) seclen, dbid);
+            continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_SECTION_INDEX) {
+            /* SECTION_INDEX: DB, offset and length of every section. */
+            uint64_t count;
+            rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
+            if ((count = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+                goto eoferr;
+            rdbCheckInfo("Index of %llu sections",
+                (unsigned long long) count);
+            while(count--) {
+                if (rdbLoadLen(&rdb,NULL) == RDB_LENERR ||
+                    rdbLoadLen(&rdb,NULL) == RDB_LENERR ||
+                    rdbLoadLen(&rdb,NULL) == RDB_LENERR) goto eoferr;
+            }
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
              * which is backward compatible. Implementations of RDB loading
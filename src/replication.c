@@ -1691,6 +1691,8 @@ redisDb *disklessLoadMakeBackups(void) {
         backups[i] = server.db[i];
         server.db[i].dict = dictCreate(&dbDictType,NULL);
         server.db[i].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[i].hexpires = dictCreate(&hashExpiresDictType,NULL);
+        server.db[i].streams = dictCreate(&hashExpiresDictType,NULL);
     }
     return backups;
 }
@@ -1713,6 +1715,8 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
         for (int i=0; i<server.dbnum; i++) {
             dictRelease(server.db[i].dict);
             dictRelease(server.db[i].expires);
+            dictRelease(server.db[i].hexpires);
+            dictRelease(server.db[i].streams);
             server.db[i] = backup[i];
         }
     } else {
@@ -1721,6 +1725,8 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
         for (int i=0; i<server.dbnum; i++) {
             dictRelease(backup[i].dict);
             dictRelease(backup[i].expires);
+            dictRelease(backup[i].hexpires);
+            dictRelease(backup[i].streams);
         }
     }
     zfree(backup);
@@ -2039,6 +2045,7 @@ void readSyncBulkPayload(connection *conn) {
                     (long) server.rdb_child_pid);
             killRDBChild();
         }
+        rdbForklessAbort();
 
         /* Make sure the new file (also used for persistence) is fully synced
          * (not covered by earlier calls to rdb_fsync_range). */
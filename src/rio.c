@@ -181,6 +181,82 @@ void rioInitWithFile(rio *r, FILE *fp) {
     r->io.file.autosync = 0;
 }
 
+/* ---------------- Memory mapped file implementation ----------------
+ * Read only target used to load an RDB file mapped in memory. On top of the
+ * usual reads, rioReadMapped() allows to use the data in place. */
+
+/* Returns 1 or 0 for success/failure. */
+static size_t rioMapRead(rio *r, void *buf, size_t len) {
+    if (r->io.map.len - r->io.map.pos < len) return 0;
+    memcpy(buf,r->io.map.base+r->io.map.pos,len);
+    r->io.map.pos += len;
+    return 1;
+}
+
+static size_t rioMapWrite(rio *r, const void *buf, size_t len) {
+    UNUSED(r);
+    UNUSED(buf);
+    UNUSED(len);
+    return 0; /* Error, this target is read only. */
+}
+
+static off_t rioMapTell(rio *r) {
+    return r->io.map.pos;
+}
+
+static int rioMapFlush(rio *r) {
+    UNUSED(r);
+    return 1; /* Nothing to flush, this target is read only. */
+}
+
+static const rio rioMapIO = {
+    rioMapRead,
+    rioMapWrite,
+    rioMapTell,
+    rioMapFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* flags */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+void rioInitWithMap(rio *r, char *base, size_t len) {
+    *r = rioMapIO;
+    r->io.map.base = base;
+    r->io.map.len = len;
+    r->io.map.pos = 0;
+}
+
+int rioIsMapped(rio *r) {
+    return r->read == rioMapRead;
+}
+
+/* Like rioRead() for a memory mapped target, but instead of copying the
+ * next 'len' bytes return a pointer to them. On short read NULL is
+ * returned. */
+void *rioReadMapped(rio *r, size_t len) {
+    char *p = r->io.map.base+r->io.map.pos;
+    size_t done = 0;
+
+    if (r->flags & RIO_FLAG_READ_ERROR) return NULL;
+    if (r->io.map.len - r->io.map.pos < len) {
+        r->flags |= RIO_FLAG_READ_ERROR;
+        return NULL;
+    }
+    while (done < len) {
+        size_t chunk = (r->max_processing_chunk &&
+                        r->max_processing_chunk < len-done) ?
+                        r->max_processing_chunk : len-done;
+        if (r->update_cksum) r->update_cksum(r,p+done,chunk);
+        done += chunk;
+        r->processed_bytes += chunk;
+    }
+    r->io.map.pos += len;
+    return p;
+}
+
 /* ------------------- Connection implementation -------------------
  * We use this RIO implemetnation when reading an RDB file directly from
  * the connection to the memory via rdbLoadRio(), thus this implementation
@@ -413,9 +489,38 @@ void rioFreeFd(rio *r) {
  * computation is needed. */
 // 根据CRC64算法进行校验和
 void rioGenericUpdateChecksum(rio *r, const void *buf, size_t len) {
+    if (r->flags & RIO_FLAG_CKSUM_KNOWN) return;
     r->cksum = crc64(r->cksum,buf,len);
 }
 
+/* Like rioWrite(), but 'crc' is the crc64 of the data, already computed by
+ * the caller (usually in another thread): instead of scanning the data again
+ * the checksum of the stream is updated by combining it with 'crc'. The
+ * update_cksum method is still called, so loading progress and the like
+ * keep working. */
+size_t rioWriteWithChecksum(rio *r, const void *buf, size_t len, uint64_t crc) {
+    size_t retval;
+
+    r->flags |= RIO_FLAG_CKSUM_KNOWN;
+    retval = rioWrite(r,buf,len);
+    r->flags &= ~RIO_FLAG_CKSUM_KNOWN;
+    if (retval && r->update_cksum) r->cksum = crc64_combine(r->cksum,crc,len);
+    return retval;
+}
+
+/* Like rioRead(), for data whose crc64 is expected to be 'crc'. The caller is
+ * responsible for verifying the data against 'crc' later, otherwise the
+ * checksum of the stream would not detect the corruption. */
+size_t rioReadWithChecksum(rio *r, void *buf, size_t len, uint64_t crc) {
+    size_t retval;
+
+    r->flags |= RIO_FLAG_CKSUM_KNOWN;
+    retval = rioRead(r,buf,len);
+    r->flags &= ~RIO_FLAG_CKSUM_KNOWN;
+    if (retval && r->update_cksum) r->cksum = crc64_combine(r->cksum,crc,len);
+    return retval;
+}
+
 /* Set the file-based rio object to auto-fsync every 'bytes' file written.
  * By default this is set to zero that means no automatic file sync is
  * performed.
@@ -39,6 +39,11 @@
 
 #define RIO_FLAG_READ_ERROR (1<<0)
 #define RIO_FLAG_WRITE_ERROR (1<<1)
+#define RIO_FLAG_MAPPABLE (1<<2) /* Target file may be memory mapped when
+                                    loaded, see rdbSaveEncodedBlob(). */
+#define RIO_FLAG_CKSUM_KNOWN (1<<3) /* Checksum of the data being transferred
+                                       is combined afterwards, see
+                                       rioWriteWithChecksum(). */
 
 // Redis IO API接口，用于多种情况下的读写
 struct _rio {
@@ -100,6 +105,12 @@ struct _rio {
             off_t pos;
             sds buf;
         } fd;
+        /* Memory mapped file target. */
+        struct {
+            char *base;
+            size_t len;
+            size_t pos;
+        } map;
     } io;
 };
 
@@ -182,6 +193,9 @@ void rioInitWithFile(rio *r, FILE *fp);
 void rioInitWithBuffer(rio *r, sds s);
 void rioInitWithConn(rio *r, connection *conn, size_t read_limit);
 void rioInitWithFd(rio *r, int fd);
+void rioInitWithMap(rio *r, char *base, size_t len);
+int rioIsMapped(rio *r);
+void *rioReadMapped(rio *r, size_t len);
 
 void rioFreeFd(rio *r);
 void rioFreeConn(rio *r, sds* out_remainingBufferedData);
@@ -195,6 +209,8 @@ struct redisObject;
 int rioWriteBulkObject(rio *r, struct redisObject *obj);
 
 void rioGenericUpdateChecksum(rio *r, const void *buf, size_t len);
+size_t rioWriteWithChecksum(rio *r, const void *buf, size_t len, uint64_t crc);
+size_t rioReadWithChecksum(rio *r, void *buf, size_t len, uint64_t crc);
 void rioSetAutoSync(rio *r, off_t bytes);
 
 #endif
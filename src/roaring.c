@@ -0,0 +1,1342 @@
+/*
+ * Roaring bitmap encoding of integer sets and bitmap strings.
+ *
+ * Copyright (c) 2026, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Compressed bitmap of 64 bit signed integers, roaring style.
+ *
+ * Every value is first biased (the sign bit is flipped) so that the natural
+ * unsigned order of the biased values matches the signed order of the
+ * original ones. The upper 48 bits of the biased value select a container,
+ * the lower 16 bits are stored inside the container:
+ *
+ *  - Array containers hold up to ROARING_ARRAY_MAX_CARD values as a sorted
+ *    array of uint16_t, that is at most 8k bytes.
+ *  - Bitmap containers are plain 65536 bits (8k bytes) bitmaps, used when
+ *    the array representation would be larger.
+ *
+ * Containers are kept sorted in chunks of up to ROARING_CHUNK_MAX entries,
+ * and located with a binary search on the chunks followed by one inside the
+ * chunk. Adding a container only shifts the containers of its chunk, a full
+ * chunk being split in two halves, so sparse bitmaps where almost every
+ * value has its own container are built in O(N log N). Dense ranges of
+ * integers cost about one bit per value, while sparse values cost a bit
+ * more than two bytes each plus the container header. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+#include "redisassert.h"
+
+#define ROARING_BIAS (1ULL<<63)
+#define ROARING_BITMAP_BYTES (ROARING_BITMAP_WORDS*sizeof(uint64_t))
+
+/* Containers with more values than this are sampled approximately by
+ * roaringRandom(), see the function comment. */
+#define ROARING_RANDOM_EXACT_CONTAINERS 4096
+
+static inline uint64_t _roaringBias(int64_t value) {
+    return ((uint64_t)value) ^ ROARING_BIAS;
+}
+
+static inline int64_t _roaringUnbias(uint64_t biased) {
+    return (int64_t)(biased ^ ROARING_BIAS);
+}
+
+static inline int _containerIsBitmap(const roaringContainer *c) {
+    return c->card > ROARING_ARRAY_MAX_CARD;
+}
+
+/* Bytes allocated for the payload of the container. */
+static inline size_t _containerAllocSize(const roaringContainer *c) {
+    return _containerIsBitmap(c) ? ROARING_BITMAP_BYTES :
+                                   sizeof(uint16_t)*c->alloc;
+}
+
+static uint32_t _bitmapCard(const uint64_t *words) {
+    uint32_t card = 0;
+    for (int j = 0; j < ROARING_BITMAP_WORDS; j++)
+        card += __builtin_popcountll(words[j]);
+    return card;
+}
+
+/* Binary search of 'v' inside the sorted array 'a' of 'len' elements.
+ * Return 1 if found, 0 otherwise. In both cases 'pos' is set to the position
+ * where the element is, or where it should be inserted. */
+static int _arraySearch(const uint16_t *a, uint32_t len, uint16_t v,
+                        uint32_t *pos)
+{
+    int64_t min = 0, max = (int64_t)len-1, mid;
+
+    while (min <= max) {
+        mid = ((uint64_t)min+(uint64_t)max) >> 1;
+        if (a[mid] < v) {
+            min = mid+1;
+        } else if (a[mid] > v) {
+            max = mid-1;
+        } else {
+            if (pos) *pos = mid;
+            return 1;
+        }
+    }
+    if (pos) *pos = min;
+    return 0;
+}
+
+/* Same as _arraySearch() but against the keys of the containers of a
+ * chunk. */
+static int _chunkSearch(const roaringChunk *ch, uint64_t key, uint32_t *pos) {
+    int64_t min = 0, max = (int64_t)ch->len-1, mid;
+
+    while (min <= max) {
+        mid = ((uint64_t)min+(uint64_t)max) >> 1;
+        if (ch->containers[mid].key < key) {
+            min = mid+1;
+        } else if (ch->containers[mid].key > key) {
+            max = mid-1;
+        } else {
+            *pos = mid;
+            return 1;
+        }
+    }
+    *pos = min;
+    return 0;
+}
+
+/* Locate the container for 'key'. Return 1 if found, 0 otherwise. In both
+ * cases 'chunk' and 'pos' are set to where the container is, or where it
+ * should be inserted: keys greater than every key in the bitmap belong at
+ * the end of the last chunk. */
+static int _roaringSearch(const roaring *r, uint64_t key, uint32_t *chunk,
+                          uint32_t *pos)
+{
+    int64_t min = 0, max = (int64_t)r->numchunks-1, mid;
+
+    /* Find the first chunk whose last key is not smaller than 'key'. */
+    while (min <= max) {
+        const roaringChunk *ch;
+
+        mid = ((uint64_t)min+(uint64_t)max) >> 1;
+        ch = r->chunks+mid;
+        if (ch->containers[ch->len-1].key < key)
+            min = mid+1;
+        else
+            max = mid-1;
+    }
+    if (min == r->numchunks) {
+        *chunk = r->numchunks ? r->numchunks-1 : 0;
+        *pos = r->numchunks ? r->chunks[*chunk].len : 0;
+        return 0;
+    }
+    *chunk = min;
+    return _chunkSearch(r->chunks+min,key,pos);
+}
+
+/* A cursor visiting the containers of a bitmap in key order. */
+typedef struct roaringCursor {
+    const roaring *r;
+    uint32_t chunk, pos;
+} roaringCursor;
+
+static inline void _cursorInit(roaringCursor *cur, const roaring *r,
+                               uint32_t chunk, uint32_t pos)
+{
+    cur->r = r;
+    cur->chunk = chunk;
+    cur->pos = pos;
+    if (chunk < r->numchunks && pos == r->chunks[chunk].len) {
+        cur->chunk++;
+        cur->pos = 0;
+    }
+}
+
+/* Return the current container, or NULL when the cursor is at the end. */
+static inline roaringContainer *_cursorGet(const roaringCursor *cur) {
+    if (cur->chunk == cur->r->numchunks) return NULL;
+    return cur->r->chunks[cur->chunk].containers+cur->pos;
+}
+
+static inline void _cursorNext(roaringCursor *cur) {
+    if (++cur->pos == cur->r->chunks[cur->chunk].len) {
+        cur->chunk++;
+        cur->pos = 0;
+    }
+}
+
+/* Turn an array container into a bitmap container. The cardinality is
+ * left untouched, so the caller is expected to push it above
+ * ROARING_ARRAY_MAX_CARD before returning. */
+static void _containerToBitmap(roaringContainer *c) {
+    uint16_t *a = c->data;
+    uint64_t *words = zcalloc(ROARING_BITMAP_BYTES);
+
+    for (uint32_t j = 0; j < c->card; j++)
+        words[a[j]>>6] |= 1ULL<<(a[j]&63);
+    zfree(a);
+    c->data = words;
+    c->alloc = 0;
+}
+
+/* Turn a bitmap container with at most ROARING_ARRAY_MAX_CARD values into
+ * an array container. */
+static void _containerToArray(roaringContainer *c) {
+    uint64_t *words = c->data;
+    uint16_t *a = zmalloc(sizeof(uint16_t)*c->card);
+    uint32_t n = 0;
+
+    for (int j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        uint64_t w = words[j];
+        while (w) {
+            a[n++] = (j<<6) + __builtin_ctzll(w);
+            w &= w-1;
+        }
+    }
+    assert(n == c->card);
+    zfree(words);
+    c->data = a;
+    c->alloc = c->card;
+}
+
+/* Make room for at least 'card' values in an array container. Small arrays
+ * double, larger ones grow by 25% to bound the wasted space. */
+static void _containerArrayReserve(roaringContainer *c, uint32_t card) {
+    uint32_t alloc;
+
+    if (c->alloc >= card) return;
+    if (c->alloc < 64) alloc = c->alloc ? c->alloc*2 : 1;
+    else if (c->alloc < 1024) alloc = c->alloc + c->alloc/2;
+    else alloc = c->alloc + c->alloc/4;
+    if (alloc < card) alloc = card;
+    if (alloc > ROARING_ARRAY_MAX_CARD) alloc = ROARING_ARRAY_MAX_CARD;
+    c->data = zrealloc(c->data,sizeof(uint16_t)*alloc);
+    c->alloc = alloc;
+}
+
+/* Release the unused tail of an array container once it is mostly empty. */
+static void _containerArrayShrink(roaringContainer *c) {
+    if (c->card && c->alloc > 8 && c->card < c->alloc/4) {
+        c->alloc = c->card*2;
+        c->data = zrealloc(c->data,sizeof(uint16_t)*c->alloc);
+    }
+}
+
+/* After a bulk operation changed the content of a bitmap container, update
+ * the cardinality and switch to the array representation if smaller. */
+static void _containerBitmapUpdate(roaringContainer *c) {
+    c->card = _bitmapCard(c->data);
+    if (c->card && c->card <= ROARING_ARRAY_MAX_CARD) _containerToArray(c);
+}
+
+static int _containerAdd(roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+    uint16_t *a;
+
+    if (_containerIsBitmap(c)) {
+        uint64_t *words = c->data, mask = 1ULL<<(low&63);
+        if (words[low>>6] & mask) return 0;
+        words[low>>6] |= mask;
+        c->card++;
+        return 1;
+    }
+
+    if (_arraySearch(c->data,c->card,low,&pos)) return 0;
+    if (c->card == ROARING_ARRAY_MAX_CARD) {
+        _containerToBitmap(c);
+        ((uint64_t*)c->data)[low>>6] |= 1ULL<<(low&63);
+        c->card++;
+        return 1;
+    }
+    _containerArrayReserve(c,c->card+1);
+    a = c->data;
+    memmove(a+pos+1,a+pos,sizeof(uint16_t)*(c->card-pos));
+    a[pos] = low;
+    c->card++;
+    return 1;
+}
+
+static int _containerRemove(roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+    uint16_t *a;
+
+    if (_containerIsBitmap(c)) {
+        uint64_t *words = c->data, mask = 1ULL<<(low&63);
+        if (!(words[low>>6] & mask)) return 0;
+        words[low>>6] &= ~mask;
+        c->card--;
+        if (c->card == ROARING_ARRAY_MAX_CARD) _containerToArray(c);
+        return 1;
+    }
+
+    if (!_arraySearch(c->data,c->card,low,&pos)) return 0;
+    a = c->data;
+    memmove(a+pos,a+pos+1,sizeof(uint16_t)*(c->card-pos-1));
+    c->card--;
+    _containerArrayShrink(c);
+    return 1;
+}
+
+static int _containerContains(const roaringContainer *c, uint16_t low) {
+    if (_containerIsBitmap(c)) {
+        const uint64_t *words = c->data;
+        return (words[low>>6] & (1ULL<<(low&63))) != 0;
+    }
+    return _arraySearch(c->data,c->card,low,NULL);
+}
+
+/* Return the value with the specified rank (zero based) in the container. */
+static uint16_t _containerSelect(const roaringContainer *c, uint32_t rank) {
+    const uint64_t *words;
+    int j;
+
+    if (!_containerIsBitmap(c)) return ((uint16_t*)c->data)[rank];
+
+    words = c->data;
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        uint32_t bits = __builtin_popcountll(words[j]);
+        if (rank < bits) break;
+        rank -= bits;
+    }
+    assert(j < ROARING_BITMAP_WORDS);
+
+    uint64_t w = words[j];
+    while (rank--) w &= w-1;
+    return (j<<6) + __builtin_ctzll(w);
+}
+
+/* Return the number of values of the container between 'lo' and 'hi',
+ * both included. */
+static uint32_t _containerRangeCard(const roaringContainer *c, uint32_t lo,
+                                    uint32_t hi)
+{
+    if (!_containerIsBitmap(c)) {
+        uint32_t first, last;
+        _arraySearch(c->data,c->card,lo,&first);
+        if (_arraySearch(c->data,c->card,hi,&last)) last++;
+        return last-first;
+    }
+
+    const uint64_t *words = c->data;
+    uint32_t j, card = 0;
+    for (j = lo>>6; j <= hi>>6; j++) {
+        uint64_t w = words[j];
+        if (j == lo>>6) w &= ~0ULL << (lo&63);
+        if (j == hi>>6) w &= ~0ULL >> (63-(hi&63));
+        card += __builtin_popcountll(w);
+    }
+    return card;
+}
+
+static void _containerCopy(roaringContainer *dst, const roaringContainer *src) {
+    dst->key = src->key;
+    dst->card = src->card;
+    if (_containerIsBitmap(src)) {
+        dst->alloc = 0;
+        dst->data = zmalloc(ROARING_BITMAP_BYTES);
+        memcpy(dst->data,src->data,ROARING_BITMAP_BYTES);
+    } else {
+        dst->alloc = src->card;
+        dst->data = zmalloc(sizeof(uint16_t)*src->card);
+        memcpy(dst->data,src->data,sizeof(uint16_t)*src->card);
+    }
+}
+
+/* c = c | o */
+static void _containerOr(roaringContainer *c, const roaringContainer *o) {
+    if (_containerIsBitmap(c) || _containerIsBitmap(o)) {
+        uint64_t *words;
+
+        if (!_containerIsBitmap(c)) {
+            /* Start from a copy of the other bitmap, then add our values. */
+            words = zmalloc(ROARING_BITMAP_BYTES);
+            memcpy(words,o->data,ROARING_BITMAP_BYTES);
+            uint16_t *a = c->data;
+            for (uint32_t j = 0; j < c->card; j++)
+                words[a[j]>>6] |= 1ULL<<(a[j]&63);
+            zfree(c->data);
+            c->data = words;
+            c->alloc = 0;
+        } else if (_containerIsBitmap(o)) {
+            const uint64_t *ow = o->data;
+            words = c->data;
+            for (int j = 0; j < ROARING_BITMAP_WORDS; j++) words[j] |= ow[j];
+        } else {
+            const uint16_t *a = o->data;
+            words = c->data;
+            for (uint32_t j = 0; j < o->card; j++)
+                words[a[j]>>6] |= 1ULL<<(a[j]&63);
+        }
+        c->card = _bitmapCard(c->data);
+        return;
+    }
+
+    /* Both are arrays: merge them. */
+    const uint16_t *a = c->data, *b = o->data;
+    uint16_t *m = zmalloc(sizeof(uint16_t)*(c->card+o->card));
+    uint32_t i = 0, j = 0, n = 0;
+
+    while (i < c->card && j < o->card) {
+        if (a[i] < b[j]) m[n++] = a[i++];
+        else if (a[i] > b[j]) m[n++] = b[j++];
+        else { m[n++] = a[i++]; j++; }
+    }
+    while (i < c->card) m[n++] = a[i++];
+    while (j < o->card) m[n++] = b[j++];
+    zfree(c->data);
+    c->data = m;
+    c->alloc = c->card+o->card;
+    c->card = n;
+    if (n > ROARING_ARRAY_MAX_CARD) {
+        /* Too many values for an array, _containerToBitmap() handles
+         * arrays of any size. */
+        _containerToBitmap(c);
+    }
+}
+
+/* c = c & o. The container may become empty: it is up to the caller to
+ * release it in that case. */
+static void _containerAnd(roaringContainer *c, const roaringContainer *o) {
+    uint32_t i, j, n = 0;
+
+    if (!_containerIsBitmap(c)) {
+        uint16_t *a = c->data;
+        if (_containerIsBitmap(o)) {
+            const uint64_t *ow = o->data;
+            for (i = 0; i < c->card; i++)
+                if (ow[a[i]>>6] & (1ULL<<(a[i]&63))) a[n++] = a[i];
+        } else if (o->card > c->card*64) {
+            /* Very different sizes: binary search the bigger array. */
+            for (i = 0; i < c->card; i++)
+                if (_arraySearch(o->data,o->card,a[i],NULL)) a[n++] = a[i];
+        } else {
+            const uint16_t *b = o->data;
+            i = j = 0;
+            while (i < c->card && j < o->card) {
+                if (a[i] < b[j]) i++;
+                else if (a[i] > b[j]) j++;
+                else { a[n++] = a[i]; i++; j++; }
+            }
+        }
+        c->card = n;
+        _containerArrayShrink(c);
+        return;
+    }
+
+    if (!_containerIsBitmap(o)) {
+        /* The result can't be bigger than the array, so it is an array. */
+        const uint64_t *words = c->data;
+        const uint16_t *b = o->data;
+        uint16_t *a = zmalloc(sizeof(uint16_t)*o->card);
+        for (j = 0; j < o->card; j++)
+            if (words[b[j]>>6] & (1ULL<<(b[j]&63))) a[n++] = b[j];
+        zfree(c->data);
+        c->data = a;
+        c->alloc = o->card;
+        c->card = n;
+        return;
+    }
+
+    uint64_t *words = c->data;
+    const uint64_t *ow = o->data;
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) words[j] &= ow[j];
+    _containerBitmapUpdate(c);
+}
+
+/* c = c & ~o. The container may become empty: it is up to the caller to
+ * release it in that case. */
+static void _containerAndNot(roaringContainer *c, const roaringContainer *o) {
+    uint32_t i, j, n = 0;
+
+    if (!_containerIsBitmap(c)) {
+        uint16_t *a = c->data;
+        if (_containerIsBitmap(o)) {
+            const uint64_t *ow = o->data;
+            for (i = 0; i < c->card; i++)
+                if (!(ow[a[i]>>6] & (1ULL<<(a[i]&63)))) a[n++] = a[i];
+        } else {
+            const uint16_t *b = o->data;
+            i = j = 0;
+            while (i < c->card) {
+                while (j < o->card && b[j] < a[i]) j++;
+                if (j == o->card || b[j] != a[i]) a[n++] = a[i];
+                i++;
+            }
+        }
+        c->card = n;
+        _containerArrayShrink(c);
+        return;
+    }
+
+    uint64_t *words = c->data;
+    if (_containerIsBitmap(o)) {
+        const uint64_t *ow = o->data;
+        for (j = 0; j < ROARING_BITMAP_WORDS; j++) words[j] &= ~ow[j];
+    } else {
+        const uint16_t *b = o->data;
+        for (j = 0; j < o->card; j++) words[b[j]>>6] &= ~(1ULL<<(b[j]&63));
+    }
+    _containerBitmapUpdate(c);
+}
+
+/* Create an empty bitmap. */
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->card = 0;
+    r->len = 0;
+    r->numchunks = 0;
+    r->chunksalloc = 0;
+    r->allocsize = 0;
+    r->chunks = NULL;
+    return r;
+}
+
+/* Release the chunks of 'r', and the payload of their containers as well
+ * if 'freedata' is true. */
+static void _roaringFreeChunks(roaring *r, int freedata) {
+    for (uint32_t i = 0; i < r->numchunks; i++) {
+        roaringChunk *ch = r->chunks+i;
+        if (freedata) {
+            for (uint32_t j = 0; j < ch->len; j++)
+                zfree(ch->containers[j].data);
+        }
+        zfree(ch->containers);
+    }
+    zfree(r->chunks);
+    r->chunks = NULL;
+    r->numchunks = r->chunksalloc = 0;
+    r->allocsize = 0;
+    r->len = 0;
+    r->card = 0;
+}
+
+void roaringFree(roaring *r) {
+    _roaringFreeChunks(r,1);
+    zfree(r);
+}
+
+roaring *roaringDup(const roaring *r) {
+    roaring *d = zmalloc(sizeof(*d));
+    d->card = r->card;
+    d->len = r->len;
+    d->numchunks = d->chunksalloc = r->numchunks;
+    d->allocsize = 0;
+    d->chunks = r->numchunks ?
+                zmalloc(sizeof(roaringChunk)*r->numchunks) : NULL;
+    for (uint32_t i = 0; i < r->numchunks; i++) {
+        const roaringChunk *src = r->chunks+i;
+        roaringChunk *dst = d->chunks+i;
+
+        dst->len = dst->alloc = src->len;
+        dst->containers = zmalloc(sizeof(roaringContainer)*src->len);
+        d->allocsize += sizeof(roaringContainer)*src->len;
+        for (uint32_t j = 0; j < src->len; j++) {
+            _containerCopy(dst->containers+j,src->containers+j);
+            d->allocsize += _containerAllocSize(dst->containers+j);
+        }
+    }
+    return d;
+}
+
+/* Make room for 'len' containers in the chunk. */
+static void _chunkReserve(roaring *r, roaringChunk *ch, uint32_t len) {
+    uint32_t alloc = ch->alloc ? ch->alloc : 1;
+
+    if (len <= ch->alloc) return;
+    while (alloc < len) alloc *= 2;
+    if (alloc > ROARING_CHUNK_MAX) alloc = ROARING_CHUNK_MAX;
+    r->allocsize += sizeof(roaringContainer)*(alloc-ch->alloc);
+    ch->alloc = alloc;
+    ch->containers = zrealloc(ch->containers,sizeof(roaringContainer)*alloc);
+}
+
+/* Insert an empty chunk at position 'idx' of the chunks array. */
+static roaringChunk *_roaringInsertChunk(roaring *r, uint32_t idx) {
+    roaringChunk *ch;
+
+    if (r->numchunks == r->chunksalloc) {
+        r->chunksalloc = r->chunksalloc ? r->chunksalloc*2 : 1;
+        r->chunks = zrealloc(r->chunks,sizeof(roaringChunk)*r->chunksalloc);
+    }
+    memmove(r->chunks+idx+1,r->chunks+idx,
+            sizeof(roaringChunk)*(r->numchunks-idx));
+    r->numchunks++;
+    ch = r->chunks+idx;
+    ch->len = 0;
+    ch->alloc = 0;
+    ch->containers = NULL;
+    return ch;
+}
+
+/* Remove the chunk at position 'idx', that must not hold containers. */
+static void _roaringDeleteChunk(roaring *r, uint32_t idx) {
+    r->allocsize -= sizeof(roaringContainer)*r->chunks[idx].alloc;
+    zfree(r->chunks[idx].containers);
+    memmove(r->chunks+idx,r->chunks+idx+1,
+            sizeof(roaringChunk)*(r->numchunks-idx-1));
+    r->numchunks--;
+    if (r->numchunks == 0) {
+        zfree(r->chunks);
+        r->chunks = NULL;
+        r->chunksalloc = 0;
+    } else if (r->chunksalloc > 4 && r->numchunks < r->chunksalloc/4) {
+        r->chunksalloc = r->numchunks*2;
+        r->chunks = zrealloc(r->chunks,sizeof(roaringChunk)*r->chunksalloc);
+    }
+}
+
+/* Insert an empty container for 'key' at position 'pos' of the specified
+ * chunk, as returned by _roaringSearch(). A full chunk is split in two
+ * halves first. */
+static roaringContainer *_roaringInsertContainer(roaring *r, uint32_t chunk,
+                                                 uint32_t pos, uint64_t key)
+{
+    roaringChunk *ch;
+    roaringContainer *c;
+
+    if (r->numchunks == 0) _roaringInsertChunk(r,0);
+    ch = r->chunks+chunk;
+    if (ch->len == ROARING_CHUNK_MAX) {
+        uint32_t half = ROARING_CHUNK_MAX/2;
+        roaringChunk *next = _roaringInsertChunk(r,chunk+1);
+
+        ch = r->chunks+chunk;
+        _chunkReserve(r,next,ch->len-half);
+        memcpy(next->containers,ch->containers+half,
+               sizeof(roaringContainer)*(ch->len-half));
+        next->len = ch->len-half;
+        ch->len = half;
+        if (pos > half) {
+            ch = next;
+            pos -= half;
+        }
+    }
+    _chunkReserve(r,ch,ch->len+1);
+    memmove(ch->containers+pos+1,ch->containers+pos,
+            sizeof(roaringContainer)*(ch->len-pos));
+    ch->len++;
+    r->len++;
+    c = ch->containers+pos;
+    c->key = key;
+    c->card = 0;
+    c->alloc = 0;
+    c->data = NULL;
+    return c;
+}
+
+/* Move the containers of chunk 'idx+1' at the end of chunk 'idx'. */
+static void _roaringMergeChunks(roaring *r, uint32_t idx) {
+    roaringChunk *ch = r->chunks+idx, *next = ch+1;
+
+    _chunkReserve(r,ch,ch->len+next->len);
+    memcpy(ch->containers+ch->len,next->containers,
+           sizeof(roaringContainer)*next->len);
+    ch->len += next->len;
+    next->len = 0;
+    _roaringDeleteChunk(r,idx+1);
+}
+
+/* Remove the (already emptied) container at position 'pos' of the specified
+ * chunk. Chunks left empty are removed, and chunks that become small are
+ * merged with a neighbour, so that the number of chunks stays proportional
+ * to the number of containers. */
+static void _roaringDeleteContainer(roaring *r, uint32_t chunk, uint32_t pos) {
+    roaringChunk *ch = r->chunks+chunk;
+
+    r->allocsize -= _containerAllocSize(ch->containers+pos);
+    zfree(ch->containers[pos].data);
+    memmove(ch->containers+pos,ch->containers+pos+1,
+            sizeof(roaringContainer)*(ch->len-pos-1));
+    ch->len--;
+    r->len--;
+    if (ch->len == 0) {
+        _roaringDeleteChunk(r,chunk);
+        return;
+    }
+    if (ch->alloc > 4 && ch->len < ch->alloc/4) {
+        r->allocsize -= sizeof(roaringContainer)*(ch->alloc-ch->len*2);
+        ch->alloc = ch->len*2;
+        ch->containers = zrealloc(ch->containers,
+                                  sizeof(roaringContainer)*ch->alloc);
+    }
+    if (chunk+1 < r->numchunks &&
+        ch->len + r->chunks[chunk+1].len <= ROARING_CHUNK_MAX/2)
+    {
+        _roaringMergeChunks(r,chunk);
+    } else if (chunk > 0 &&
+               ch->len + r->chunks[chunk-1].len <= ROARING_CHUNK_MAX/2)
+    {
+        _roaringMergeChunks(r,chunk-1);
+    }
+}
+
+/* Append a container, whose key must be greater than every key in the
+ * bitmap, taking ownership of its payload. Used to build bitmaps in order. */
+static void _roaringAppendContainer(roaring *r, const roaringContainer *c) {
+    roaringChunk *ch;
+
+    if (r->numchunks == 0 ||
+        r->chunks[r->numchunks-1].len == ROARING_CHUNK_MAX)
+    {
+        _roaringInsertChunk(r,r->numchunks);
+    }
+    ch = r->chunks+r->numchunks-1;
+    _chunkReserve(r,ch,ch->len+1);
+    ch->containers[ch->len++] = *c;
+    r->len++;
+    r->card += c->card;
+    r->allocsize += _containerAllocSize(c);
+}
+
+/* Add a value. Return 1 if the value was added, 0 if already present. */
+int roaringAdd(roaring *r, int64_t value) {
+    uint64_t biased = _roaringBias(value);
+    uint32_t chunk, pos;
+    roaringContainer *c;
+    size_t oldsize;
+
+    if (_roaringSearch(r,biased>>16,&chunk,&pos))
+        c = r->chunks[chunk].containers+pos;
+    else
+        c = _roaringInsertContainer(r,chunk,pos,biased>>16);
+    oldsize = _containerAllocSize(c);
+    if (!_containerAdd(c,biased&0xffff)) return 0;
+    r->allocsize += _containerAllocSize(c)-oldsize;
+    r->card++;
+    return 1;
+}
+
+/* Remove a value. Return 1 if the value was removed, 0 if not found. */
+int roaringRemove(roaring *r, int64_t value) {
+    uint64_t biased = _roaringBias(value);
+    uint32_t chunk, pos;
+    roaringContainer *c;
+    size_t oldsize;
+
+    if (!_roaringSearch(r,biased>>16,&chunk,&pos)) return 0;
+    c = r->chunks[chunk].containers+pos;
+    oldsize = _containerAllocSize(c);
+    if (!_containerRemove(c,biased&0xffff)) return 0;
+    r->allocsize += _containerAllocSize(c)-oldsize;
+    if (c->card == 0) _roaringDeleteContainer(r,chunk,pos);
+    r->card--;
+    return 1;
+}
+
+int roaringContains(const roaring *r, int64_t value) {
+    uint64_t biased = _roaringBias(value);
+    uint32_t chunk, pos;
+
+    if (!_roaringSearch(r,biased>>16,&chunk,&pos)) return 0;
+    return _containerContains(r->chunks[chunk].containers+pos,biased&0xffff);
+}
+
+uint64_t roaringCard(const roaring *r) {
+    return r->card;
+}
+
+/* Return the number of values between 'min' and 'max', both included.
+ * Containers entirely inside the range just contribute their cardinality. */
+uint64_t roaringRangeCard(const roaring *r, int64_t min, int64_t max) {
+    uint64_t bmin = _roaringBias(min), bmax = _roaringBias(max), card = 0;
+    uint32_t chunk, pos;
+    roaringCursor cur;
+    const roaringContainer *c;
+
+    if (min > max) return 0;
+    _roaringSearch(r,bmin>>16,&chunk,&pos);
+    for (_cursorInit(&cur,r,chunk,pos);
+         (c = _cursorGet(&cur)) != NULL && c->key <= bmax>>16;
+         _cursorNext(&cur))
+    {
+        uint32_t lo = c->key == bmin>>16 ? bmin&0xffff : 0;
+        uint32_t hi = c->key == bmax>>16 ? bmax&0xffff : 0xffff;
+
+        if (lo == 0 && hi == 0xffff)
+            card += c->card;
+        else
+            card += _containerRangeCard(c,lo,hi);
+    }
+    return card;
+}
+
+static uint64_t _roaringRand64(void) {
+    return ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+}
+
+/* Return a random value of a non empty bitmap. When the bitmap has up to
+ * ROARING_RANDOM_EXACT_CONTAINERS containers every value has exactly the
+ * same probability. Otherwise, to avoid an O(N) scan of the containers, a
+ * random container is picked first (walking just the chunks) and then a
+ * random value inside it, so values in sparsely populated containers are
+ * more likely to be returned: this is the same tradeoff dictGetRandomKey()
+ * does with buckets. */
+int64_t roaringRandom(const roaring *r) {
+    const roaringContainer *c;
+    uint64_t rank;
+
+    assert(r->card != 0);
+    if (r->len <= ROARING_RANDOM_EXACT_CONTAINERS) {
+        roaringCursor cur;
+
+        rank = _roaringRand64() % r->card;
+        _cursorInit(&cur,r,0,0);
+        while (rank >= (c = _cursorGet(&cur))->card) {
+            rank -= c->card;
+            _cursorNext(&cur);
+        }
+    } else {
+        const roaringChunk *ch = r->chunks;
+        uint64_t idx = _roaringRand64() % r->len;
+
+        while (idx >= ch->len) {
+            idx -= ch->len;
+            ch++;
+        }
+        c = ch->containers+idx;
+        rank = _roaringRand64() % c->card;
+    }
+    return _roaringUnbias((c->key<<16) | _containerSelect(c,rank));
+}
+
+/* dst = dst | src */
+void roaringOr(roaring *dst, const roaring *src) {
+    roaring old = *dst;
+    roaringCursor i, j;
+    roaringContainer *a, *b, m;
+
+    if (src->len == 0) return;
+    dst->chunks = NULL;
+    dst->numchunks = dst->chunksalloc = 0;
+    dst->allocsize = 0;
+    dst->len = 0;
+    dst->card = 0;
+    _cursorInit(&i,&old,0,0);
+    _cursorInit(&j,src,0,0);
+    while (1) {
+        a = _cursorGet(&i);
+        b = _cursorGet(&j);
+        if (a == NULL && b == NULL) break;
+        if (b == NULL || (a && a->key < b->key)) {
+            m = *a;
+            _cursorNext(&i);
+        } else if (a == NULL || a->key > b->key) {
+            _containerCopy(&m,b);
+            _cursorNext(&j);
+        } else {
+            m = *a;
+            _containerOr(&m,b);
+            _cursorNext(&i);
+            _cursorNext(&j);
+        }
+        _roaringAppendContainer(dst,&m);
+    }
+    _roaringFreeChunks(&old,0);
+}
+
+/* dst = dst & src when 'andnot' is false, dst = dst & ~src otherwise. */
+static void _roaringAndGeneric(roaring *dst, const roaring *src, int andnot) {
+    roaring old = *dst;
+    roaringCursor i, j;
+    roaringContainer *a, *b, m;
+
+    dst->chunks = NULL;
+    dst->numchunks = dst->chunksalloc = 0;
+    dst->allocsize = 0;
+    dst->len = 0;
+    dst->card = 0;
+    _cursorInit(&j,src,0,0);
+    for (_cursorInit(&i,&old,0,0); (a = _cursorGet(&i)) != NULL;
+         _cursorNext(&i))
+    {
+        m = *a;
+        while ((b = _cursorGet(&j)) != NULL && b->key < m.key)
+            _cursorNext(&j);
+        if (b && b->key == m.key) {
+            if (andnot)
+                _containerAndNot(&m,b);
+            else
+                _containerAnd(&m,b);
+        } else if (!andnot) {
+            m.card = 0;
+        }
+        if (m.card == 0)
+            zfree(m.data);
+        else
+            _roaringAppendContainer(dst,&m);
+    }
+    _roaringFreeChunks(&old,0);
+}
+
+/* dst = dst & src */
+void roaringAnd(roaring *dst, const roaring *src) {
+    _roaringAndGeneric(dst,src,0);
+}
+
+/* dst = dst & ~src */
+void roaringAndNot(roaring *dst, const roaring *src) {
+    _roaringAndGeneric(dst,src,1);
+}
+
+void roaringInitIterator(roaringIterator *it, const roaring *r) {
+    it->r = r;
+    it->chunk = 0;
+    it->ci = 0;
+    it->pos = 0;
+}
+
+/* Position the iterator so that the next value returned is the smallest
+ * one greater or equal to 'value'. */
+void roaringSeekIterator(roaringIterator *it, int64_t value) {
+    uint64_t biased = _roaringBias(value);
+    uint32_t chunk, ci;
+
+    it->pos = 0;
+    if (_roaringSearch(it->r,biased>>16,&chunk,&ci)) {
+        const roaringContainer *c = it->r->chunks[chunk].containers+ci;
+        uint16_t low = biased&0xffff;
+        if (_containerIsBitmap(c))
+            it->pos = low;
+        else
+            _arraySearch(c->data,c->card,low,&it->pos);
+    }
+    it->chunk = chunk;
+    it->ci = ci;
+}
+
+/* Store the next value in '*value' and return 1, or return 0 when the
+ * iteration is over. */
+int roaringNext(roaringIterator *it, int64_t *value) {
+    const roaringContainer *c;
+    uint32_t low;
+
+    while (it->chunk < it->r->numchunks) {
+        if (it->ci == it->r->chunks[it->chunk].len) {
+            it->chunk++;
+            it->ci = 0;
+            it->pos = 0;
+            continue;
+        }
+        c = it->r->chunks[it->chunk].containers+it->ci;
+        if (!_containerIsBitmap(c)) {
+            if (it->pos < c->card) {
+                low = ((uint16_t*)c->data)[it->pos++];
+                goto found;
+            }
+        } else if (it->pos < ROARING_BITMAP_WORDS*64) {
+            const uint64_t *words = c->data;
+            uint32_t j = it->pos>>6;
+            uint64_t w = words[j] & (~0ULL << (it->pos&63));
+
+            while (w == 0 && ++j < ROARING_BITMAP_WORDS) w = words[j];
+            if (w) {
+                low = (j<<6) + __builtin_ctzll(w);
+                it->pos = low+1;
+                goto found;
+            }
+        }
+        it->ci++;
+        it->pos = 0;
+    }
+    return 0;
+
+found:
+    *value = _roaringUnbias((c->key<<16) | low);
+    return 1;
+}
+
+/* Serialized format, all the integers are little endian:
+ *
+ * <len:uint32>
+ * <key:uint64><card-1:uint16> ... repeated 'len' times ...
+ * <payload> ... repeated 'len' times ...
+ *
+ * The payload of a container is its sorted array of uint16_t when the
+ * cardinality is up to ROARING_ARRAY_MAX_CARD, otherwise its bitmap as
+ * ROARING_BITMAP_WORDS uint64_t words. */
+#define ROARING_HDR_SIZE (sizeof(uint32_t))
+#define ROARING_DESC_SIZE (sizeof(uint64_t)+sizeof(uint16_t))
+
+static size_t _containerPayloadLen(uint32_t card) {
+    return card > ROARING_ARRAY_MAX_CARD ? ROARING_BITMAP_BYTES :
+                                           card*sizeof(uint16_t);
+}
+
+size_t roaringBlobLen(const roaring *r) {
+    size_t len = ROARING_HDR_SIZE + ROARING_DESC_SIZE*r->len;
+    roaringCursor cur;
+    const roaringContainer *c;
+
+    for (_cursorInit(&cur,r,0,0); (c = _cursorGet(&cur)); _cursorNext(&cur))
+        len += _containerPayloadLen(c->card);
+    return len;
+}
+
+/* Serialize the bitmap into 'buf', that must be roaringBlobLen() bytes. */
+void roaringSerialize(const roaring *r, unsigned char *buf) {
+    uint32_t len = r->len;
+    unsigned char *p;
+    roaringCursor cur;
+    const roaringContainer *c;
+
+    memrev32ifbe(&len);
+    memcpy(buf,&len,sizeof(len));
+    p = buf + ROARING_HDR_SIZE;
+    for (_cursorInit(&cur,r,0,0); (c = _cursorGet(&cur)); _cursorNext(&cur)) {
+        uint64_t key = c->key;
+        uint16_t card = c->card-1;
+
+        memrev64ifbe(&key);
+        memrev16ifbe(&card);
+        memcpy(p,&key,sizeof(key));
+        memcpy(p+sizeof(key),&card,sizeof(card));
+        p += ROARING_DESC_SIZE;
+    }
+    for (_cursorInit(&cur,r,0,0); (c = _cursorGet(&cur)); _cursorNext(&cur)) {
+        size_t plen = _containerPayloadLen(c->card);
+
+        memcpy(p,c->data,plen);
+#if (BYTE_ORDER == BIG_ENDIAN)
+        if (_containerIsBitmap(c)) {
+            for (int i = 0; i < ROARING_BITMAP_WORDS; i++)
+                memrev64(p+i*sizeof(uint64_t));
+        } else {
+            for (uint32_t i = 0; i < c->card; i++)
+                memrev16(p+i*sizeof(uint16_t));
+        }
+#endif
+        p += plen;
+    }
+}
+
+/* Load a bitmap serialized with roaringSerialize(). The blob is fully
+ * validated, so NULL is returned if it is corrupted. */
+roaring *roaringDeserialize(const unsigned char *buf, size_t len) {
+    const unsigned char *desc, *p;
+    uint32_t count;
+    uint64_t prevkey = 0;
+    size_t need;
+    roaring *r;
+
+    if (len < ROARING_HDR_SIZE) return NULL;
+    memcpy(&count,buf,sizeof(count));
+    memrev32ifbe(&count);
+    if ((len-ROARING_HDR_SIZE)/ROARING_DESC_SIZE < count) return NULL;
+    desc = buf + ROARING_HDR_SIZE;
+    p = desc + ROARING_DESC_SIZE*count;
+    need = p-buf;
+
+    r = roaringNew();
+    for (uint32_t j = 0; j < count; j++) {
+        roaringContainer c;
+        uint64_t key;
+        uint16_t card;
+        size_t plen;
+
+        memcpy(&key,desc+j*ROARING_DESC_SIZE,sizeof(key));
+        memcpy(&card,desc+j*ROARING_DESC_SIZE+sizeof(key),sizeof(card));
+        memrev64ifbe(&key);
+        memrev16ifbe(&card);
+        plen = _containerPayloadLen((uint32_t)card+1);
+        if (key >> 48 || (j && key <= prevkey) || len-need < plen)
+            goto corrupt;
+
+        c.key = prevkey = key;
+        c.card = (uint32_t)card+1;
+        c.alloc = _containerIsBitmap(&c) ? 0 : c.card;
+        c.data = zmalloc(plen);
+        memcpy(c.data,p,plen);
+        _roaringAppendContainer(r,&c);
+        p += plen;
+        need += plen;
+
+        if (_containerIsBitmap(&c)) {
+            uint64_t *words = c.data;
+#if (BYTE_ORDER == BIG_ENDIAN)
+            for (int i = 0; i < ROARING_BITMAP_WORDS; i++)
+                memrev64(words+i);
+#endif
+            if (_bitmapCard(words) != c.card) goto corrupt;
+        } else {
+            uint16_t *a = c.data;
+            for (uint32_t i = 0; i < c.card; i++) {
+                memrev16ifbe(a+i);
+                if (i && a[i] <= a[i-1]) goto corrupt;
+            }
+        }
+    }
+    if (need != len) goto corrupt;
+    return r;
+
+corrupt:
+    roaringFree(r);
+    return NULL;
+}
+
+/* Return the number of bytes allocated by the bitmap. */
+size_t roaringAllocSize(const roaring *r) {
+    return sizeof(*r) + sizeof(roaringChunk)*r->chunksalloc + r->allocsize;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include <time.h>
+#include "intset.h"
+
+#define UNUSED(x) (void)(x)
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Check the chunks, the containers and the allocation size accounting. */
+static void checkStructure(roaring *r) {
+    uint32_t len = 0;
+    uint64_t prevkey = 0;
+    for (uint32_t i = 0; i < r->numchunks; i++) {
+        roaringChunk *ch = r->chunks+i;
+        assert(ch->len != 0 && ch->len <= ch->alloc &&
+               ch->alloc <= ROARING_CHUNK_MAX);
+        for (uint32_t j = 0; j < ch->len; j++) {
+            roaringContainer *c = ch->containers+j;
+            assert(c->card != 0);
+            if (len++) assert(c->key > prevkey);
+            prevkey = c->key;
+            if (_containerIsBitmap(c))
+                assert(_bitmapCard(c->data) == c->card);
+            else
+                assert(c->card <= c->alloc);
+        }
+    }
+    assert(len == r->len);
+
+    size_t allocsize = 0;
+    for (uint32_t i = 0; i < r->numchunks; i++) {
+        roaringChunk *ch = r->chunks+i;
+        allocsize += sizeof(roaringContainer)*ch->alloc;
+        for (uint32_t j = 0; j < ch->len; j++)
+            allocsize += _containerAllocSize(ch->containers+j);
+    }
+    assert(allocsize == r->allocsize);
+}
+
+/* Check the bitmap against an intset holding the same values. */
+static void checkAgainstIntset(roaring *r, intset *is) {
+    roaringIterator it;
+    int64_t v, expected;
+    uint32_t pos = 0;
+
+    assert(roaringCard(r) == intsetLen(is));
+    roaringInitIterator(&it,r);
+    while (roaringNext(&it,&v)) {
+        assert(intsetGet(is,pos++,&expected));
+        assert(v == expected);
+    }
+    assert(pos == intsetLen(is));
+    checkStructure(r);
+}
+
+static int64_t randomValue(int64_t range) {
+    int64_t v = (int64_t)_roaringRand64();
+    return range ? v % range : v;
+}
+
+int roaringTest(int argc, char **argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+
+    printf("Add, remove and contains: ");
+    {
+        int64_t ranges[] = {0, 100000, 1000000, 100};
+        for (int k = 0; k < 4; k++) {
+            roaring *r = roaringNew();
+            intset *is = intsetNew();
+            for (int j = 0; j < 100000; j++) {
+                int64_t v = randomValue(ranges[k]);
+                uint8_t success;
+                is = intsetAdd(is,v,&success);
+                assert(roaringAdd(r,v) == success);
+                assert(roaringContains(r,v));
+            }
+            checkAgainstIntset(r,is);
+            for (int j = 0; j < 50000; j++) {
+                int64_t v = randomValue(ranges[k]);
+                int success;
+                is = intsetRemove(is,v,&success);
+                assert(roaringRemove(r,v) == success);
+                assert(!roaringContains(r,v));
+            }
+            checkAgainstIntset(r,is);
+            /* Random values of a wide range are rarely present: remove
+             * most of the existing ones too, so that chunks get merged. */
+            intset *kept = intsetNew();
+            for (uint32_t j = 0; j < intsetLen(is); j++) {
+                int64_t v;
+                assert(intsetGet(is,j,&v));
+                if (j % 8 == 0)
+                    kept = intsetAdd(kept,v,NULL);
+                else
+                    assert(roaringRemove(r,v) == 1);
+            }
+            checkAgainstIntset(r,kept);
+            zfree(kept);
+            roaringFree(r);
+            zfree(is);
+        }
+        printf("OK\n");
+    }
+
+    printf("Set operations: ");
+    {
+        for (int k = 0; k < 20; k++) {
+            int64_t range = k % 2 ? 200000 : 5000000;
+            roaring *a = roaringNew(), *b = roaringNew();
+            intset *ia = intsetNew(), *ib = intsetNew();
+            intset *iand = intsetNew(), *ior = intsetNew(), *inot = intsetNew();
+            int64_t v;
+
+            for (int j = 0; j < 30000*(k%5+1); j++) {
+                v = randomValue(range);
+                roaringAdd(a,v);
+                ia = intsetAdd(ia,v,NULL);
+                v = randomValue(range);
+                roaringAdd(b,v);
+                ib = intsetAdd(ib,v,NULL);
+            }
+            for (uint32_t j = 0; intsetGet(ia,j,&v); j++) {
+                ior = intsetAdd(ior,v,NULL);
+                if (intsetFind(ib,v)) iand = intsetAdd(iand,v,NULL);
+                else inot = intsetAdd(inot,v,NULL);
+            }
+            for (uint32_t j = 0; intsetGet(ib,j,&v); j++)
+                ior = intsetAdd(ior,v,NULL);
+
+            roaring *r = roaringDup(a);
+            roaringOr(r,b);
+            checkAgainstIntset(r,ior);
+            roaringFree(r);
+            r = roaringDup(a);
+            roaringAnd(r,b);
+            checkAgainstIntset(r,iand);
+            roaringFree(r);
+            r = roaringDup(a);
+            roaringAndNot(r,b);
+            checkAgainstIntset(r,inot);
+            roaringFree(r);
+
+            roaringFree(a);
+            roaringFree(b);
+            zfree(ia); zfree(ib); zfree(iand); zfree(ior); zfree(inot);
+        }
+        printf("OK\n");
+    }
+
+    printf("Serialization: ");
+    {
+        roaring *r = roaringNew();
+        for (int j = 0; j < 200000; j++)
+            roaringAdd(r,randomValue(j%2 ? 0 : 1000000));
+        size_t len = roaringBlobLen(r);
+        unsigned char *buf = zmalloc(len);
+        roaringSerialize(r,buf);
+        roaring *l = roaringDeserialize(buf,len);
+        assert(l != NULL);
+        assert(roaringCard(l) == roaringCard(r));
+        roaringIterator it1, it2;
+        int64_t v1, v2;
+        roaringInitIterator(&it1,r);
+        roaringInitIterator(&it2,l);
+        while (roaringNext(&it1,&v1)) {
+            assert(roaringNext(&it2,&v2));
+            assert(v1 == v2);
+        }
+        assert(!roaringNext(&it2,&v2));
+        checkStructure(l);
+        roaring *d = roaringDup(l);
+        checkStructure(d);
+        roaringFree(d);
+        assert(roaringDeserialize(buf,len-1) == NULL);
+        roaringFree(l);
+        roaringFree(r);
+        zfree(buf);
+        printf("OK\n");
+    }
+
+    printf("Range cardinality: ");
+    {
+        for (int k = 0; k < 10; k++) {
+            roaring *r = roaringNew();
+            int64_t range = k % 2 ? 100000 : 10000000;
+            for (int j = 0; j < 50000; j++)
+                roaringAdd(r,randomValue(range)-range/2);
+            for (int j = 0; j < 100; j++) {
+                int64_t min = randomValue(range)-range/2;
+                int64_t max = min+randomValue(range/(j%10+1));
+                uint64_t card = 0;
+                roaringIterator it;
+                int64_t v;
+
+                roaringInitIterator(&it,r);
+                roaringSeekIterator(&it,min);
+                while (roaringNext(&it,&v) && v <= max) card++;
+                assert(roaringRangeCard(r,min,max) == card);
+            }
+            assert(roaringRangeCard(r,INT64_MIN,INT64_MAX) == roaringCard(r));
+            assert(roaringRangeCard(r,1,0) == 0);
+            roaringFree(r);
+        }
+        printf("OK\n");
+    }
+
+    printf("Benchmark roaringAdd/roaringContains: ");
+    {
+        roaring *r = roaringNew();
+        long long start = usec();
+        for (int j = 0; j < 10000000; j++) roaringAdd(r,j*3);
+        for (int j = 0; j < 10000000; j++) assert(roaringContains(r,j*3));
+        printf("%lld usec, %zu bytes\n",usec()-start,roaringAllocSize(r));
+        roaringFree(r);
+    }
+
+    printf("Benchmark roaringAdd with sparse values: ");
+    {
+        roaring *r = roaringNew();
+        long long start = usec();
+        for (int j = 0; j < 1000000; j++) roaringAdd(r,randomValue(1LL<<60));
+        printf("%lld usec, %u containers in %u chunks\n",usec()-start,
+            r->len,r->numchunks);
+        roaringFree(r);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Roaring bitmap encoding of integer sets and bitmap strings.
+ *
+ * Copyright (c) 2026, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+#include <stdint.h>
+#include <stddef.h>
+
+/* A container holds all the values of the set sharing the same upper 48
+ * bits. The lower 16 bits are stored either as a sorted array of uint16_t
+ * (up to ROARING_ARRAY_MAX_CARD values) or as a 65536 bits bitmap. */
+#define ROARING_ARRAY_MAX_CARD 4096
+#define ROARING_BITMAP_WORDS 1024
+
+typedef struct roaringContainer {
+    uint64_t key;       /* Upper 48 bits of the biased value. */
+    uint32_t card;      /* Number of values, from 1 to 65536. */
+    uint32_t alloc;     /* Slots allocated, only used by array containers. */
+    void *data;         /* uint16_t[alloc] or uint64_t[ROARING_BITMAP_WORDS]. */
+} roaringContainer;
+
+/* Containers are grouped in chunks of up to ROARING_CHUNK_MAX containers,
+ * so that adding or removing a container only moves the other containers of
+ * its chunk, and the chunks are located with a binary search. */
+#define ROARING_CHUNK_MAX 256
+
+typedef struct roaringChunk {
+    uint32_t len;       /* Number of containers in use, never zero. */
+    uint32_t alloc;     /* Number of containers allocated. */
+    roaringContainer *containers; /* Sorted by key. */
+} roaringChunk;
+
+typedef struct roaring {
+    uint64_t card;      /* Total number of values in the set. */
+    uint32_t len;       /* Number of containers in use. */
+    uint32_t numchunks; /* Number of chunks in use. */
+    uint32_t chunksalloc; /* Number of chunks allocated. */
+    size_t allocsize;   /* Bytes allocated by the chunks for their containers
+                           and by the containers for their payload. */
+    roaringChunk *chunks; /* Sorted by key. */
+} roaring;
+
+/* Iterators return values in ascending order. The bitmap must not be
+ * modified while it is being iterated. */
+typedef struct roaringIterator {
+    const roaring *r;
+    uint32_t chunk;     /* Current chunk index. */
+    uint32_t ci;        /* Current container index inside the chunk. */
+    uint32_t pos;       /* Array index or bit index inside the container. */
+} roaringIterator;
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringDup(const roaring *r);
+int roaringAdd(roaring *r, int64_t value);
+int roaringRemove(roaring *r, int64_t value);
+int roaringContains(const roaring *r, int64_t value);
+uint64_t roaringCard(const roaring *r);
+uint64_t roaringRangeCard(const roaring *r, int64_t min, int64_t max);
+int64_t roaringRandom(const roaring *r);
+void roaringOr(roaring *dst, const roaring *src);
+void roaringAnd(roaring *dst, const roaring *src);
+void roaringAndNot(roaring *dst, const roaring *src);
+void roaringInitIterator(roaringIterator *it, const roaring *r);
+void roaringSeekIterator(roaringIterator *it, int64_t value);
+int roaringNext(roaringIterator *it, int64_t *value);
+size_t roaringBlobLen(const roaring *r);
+void roaringSerialize(const roaring *r, unsigned char *buf);
+roaring *roaringDeserialize(const unsigned char *buf, size_t len);
+size_t roaringAllocSize(const roaring *r);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[]);
+#endif
+
+#endif /* __ROARING_H */
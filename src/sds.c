@@ -229,6 +229,9 @@ void sdsclear(sds s) {
  * is sure that after calling this function can overwrite up to addlen
  * bytes after the end of the string, plus one more byte for nul term.
  *
+ * When 'greedy' is true more space than requested is allocated, so that
+ * repeated appends only need a logarithmic number of reallocations.
+ *
  * Note: this does not change the *length* of the sds string as returned
  * by sdslen(), but only the free buffer space we have. */
 /*
@@ -237,7 +240,7 @@ void sdsclear(sds s) {
  * 外加1个字节的终止符。
  * 注意：这个函数不会改变调用sdslen()返回的字符串长度，仅仅改变了空闲空间的大小。
  * */
-sds sdsMakeRoomFor(sds s, size_t addlen) {
+static sds _sdsMakeRoomFor(sds s, size_t addlen, int greedy) {
     void *sh, *newsh;
     size_t avail = sdsavail(s);//获取当前s的可用空间
     size_t len, newlen;
@@ -250,10 +253,12 @@ sds sdsMakeRoomFor(sds s, size_t addlen) {
     len = sdslen(s);//sds字符串当前长度
     sh = (char*)s-sdsHdrSize(oldtype);//sds字符串header指针
     newlen = (len+addlen);//扩充后的新长度
-    if (newlen < SDS_MAX_PREALLOC)// 扩充后的长度小于sds最大预分配长度时，把newlen加倍以防止短期内再扩充
-        newlen *= 2;
-    else // 否则直接加上sds最大预分配长度
-        newlen += SDS_MAX_PREALLOC;
+    if (greedy) {
+        if (newlen < SDS_MAX_PREALLOC)// 扩充后的长度小于sds最大预分配长度时，把newlen加倍以防止短期内再扩充
+            newlen *= 2;
+        else // 否则直接加上sds最大预分配长度
+            newlen += SDS_MAX_PREALLOC;
+    }
 
     type = sdsReqType(newlen);//获取新长度下的sds字符串类型
 
@@ -280,6 +285,16 @@ sds sdsMakeRoomFor(sds s, size_t addlen) {
     return s;
 }
 
+sds sdsMakeRoomFor(sds s, size_t addlen) {
+    return _sdsMakeRoomFor(s,addlen,1);
+}
+
+/* Like sdsMakeRoomFor(), but allocate exactly the space requested, for the
+ * callers that implement their own growth policy. */
+sds sdsMakeRoomForNonGreedy(sds s, size_t addlen) {
+    return _sdsMakeRoomFor(s,addlen,0);
+}
+
 /* Reallocate the sds string so that it has no free space at the end. The
  * contained string remains not altered, but next concatenation operations
  * will require a reallocation.
@@ -269,6 +269,7 @@ sds sdsjoinsds(sds *argv, int argc, const char *sep, size_t seplen);// 和sdsjoi
 
 /* 暴露出来作为用户API的低级函数 */
 sds sdsMakeRoomFor(sds s, size_t addlen);//为指定的sds扩充大小，扩充的大小为addlen
+sds sdsMakeRoomForNonGreedy(sds s, size_t addlen);
 void sdsIncrLen(sds s, ssize_t incr);//根据incr增加或减少sds的字符串长度
 sds sdsRemoveFreeSpace(sds s);  // 移除一个sds的空闲空间
 size_t sdsAllocSize(sds s);  // 获取一个sds的总大小（包括header、字符串、末尾的空闲空间和隐式项目）
@@ -409,6 +409,10 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory @set",
      0,NULL,1,-1,1,0,0,0},
 
+    {"sintercard",sintercardCommand,-3,
+     "read-only @set",
+     0,sintercardGetKeys,0,0,0,0,0,0},
+
     {"sunion",sunionCommand,-2,
      "read-only to-sort @set",
      0,NULL,1,-1,1,0,0,0},
@@ -465,6 +469,14 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory @sortedset",
      0,zunionInterGetKeys,0,0,0,0,0,0},
 
+    {"zunion",zunionCommand,-3,
+     "read-only @sortedset",
+     0,zunionInterGetKeys,0,0,0,0,0,0},
+
+    {"zinter",zinterCommand,-3,
+     "read-only @sortedset",
+     0,zunionInterGetKeys,0,0,0,0,0,0},
+
     {"zrange",zrangeCommand,-4,
      "read-only @sortedset",
      0,NULL,1,1,1,0,0,0},
@@ -569,6 +581,34 @@ struct redisCommand redisCommandTable[] = {
      "read-only fast @hash",
      0,NULL,1,1,1,0,0,0},
 
+    {"hexpire",hexpireCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpire",hpexpireCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hexpireat",hexpireatCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpireat",hpexpireatCommand,-6,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"httl",httlCommand,-5,
+     "read-only random fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpttl",hpttlCommand,-5,
+     "read-only random fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpersist",hpersistCommand,-5,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
     {"hstrlen",hstrlenCommand,3,
      "read-only fast @hash",
      0,NULL,1,1,1,0,0,0},
@@ -908,6 +948,10 @@ struct redisCommand redisCommandTable[] = {
      "no-script @keyspace",
      0,NULL,0,0,0,0,0,0},
 
+    {"waitaof",waitaofCommand,2,
+     "no-script @keyspace",
+     0,NULL,0,0,0,0,0,0},
+
     {"command",commandCommand,-1,
      "ok-loading ok-stale random @connection",
      0,NULL,0,0,0,0,0,0},
@@ -1415,6 +1459,18 @@ dictType hashDictType = {
     dictSdsDestructor           /* val destructor */
 };
 
+/* Per hash index of the fields having a TTL: the keys are copies of the
+ * field names, the value is the unix time in milliseconds stored as s64.
+ * Also used for db->hexpires and db->streams, where the values are unused. */
+dictType hashExpiresDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /* Keylist hash table type has unencoded redis objects as keys and
  * lists as values. It's used for blocking operations (BLPOP) and to
  * map swapped keys to a list of clients waiting for this keys to be loaded. */
@@ -1427,6 +1483,17 @@ dictType keylistDictType = {
     dictListDestructor          /* val destructor */
 };
 
+/* Multi-key PFCOUNT cache: keys are SDS strings owned by the values, that
+ * are freed by hyperloglog.c when entries are invalidated. */
+dictType pfcountCacheDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /* Cluster nodes hash table, mapping nodes addresses 1.2.3.4:6379 to
  * clusterNode structures. */
 dictType clusterNodesDictType = {
@@ -1505,6 +1572,10 @@ void tryResizeHashTables(int dbid) {
         dictResize(server.db[dbid].dict);
     if (htNeedsResize(server.db[dbid].expires))
         dictResize(server.db[dbid].expires);
+    if (htNeedsResize(server.db[dbid].hexpires))
+        dictResize(server.db[dbid].hexpires);
+    if (htNeedsResize(server.db[dbid].streams))
+        dictResize(server.db[dbid].streams);
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -1534,6 +1605,16 @@ int incrementallyRehash(int dbid) {
         dictRehashMilliseconds(server.db[dbid].expires,1);
         return 1; /* already used our millisecond for this loop... */
     }
+    /* Hashes with volatile fields */
+    if (dictIsRehashing(server.db[dbid].hexpires)) {
+        dictRehashMilliseconds(server.db[dbid].hexpires,1);
+        return 1; /* already used our millisecond for this loop... */
+    }
+    /* Streams */
+    if (dictIsRehashing(server.db[dbid].streams)) {
+        dictRehashMilliseconds(server.db[dbid].streams,1);
+        return 1; /* already used our millisecond for this loop... */
+    }
     return 0;
 }
 
@@ -1552,10 +1633,12 @@ void updateDictResizePolicy(void) {
 }
 
 /* Return true if there are no active children processes doing RDB saving,
- * AOF rewriting, or some side process spawned by a loaded module. */
+ * AOF rewriting, or some side process spawned by a loaded module. A forkless
+ * RDB save counts as a child as well. */
 // 检测当前是否存在rdb或者aof策略
 int hasActiveChildProcess() {
     return server.rdb_child_pid != -1 ||
+           server.rdb_forkless_in_progress ||
            server.aof_child_pid != -1 ||
            server.module_child_pid != -1;
 }
@@ -1818,6 +1901,10 @@ void databasesCron(void) {
         }
     }
 
+    /* Trim old entries of streams, if a retention is configured. As for
+     * expires, replicas get the XTRIM commands from their master. */
+    if (server.stream_max_age && iAmMaster()) streamRetentionCycle();
+
     /* Defrag keys gradually. */
     activeDefragCycle();
 
@@ -1908,6 +1995,11 @@ void checkChildrenDone(void) {
     if (server.rdb_child_pid != -1 && server.rdb_pipe_conns)
         return;
 
+    if (server.rdb_forkless_in_progress) {
+        rdbForklessCheckDone();
+        if (!ldbPendingChildren()) return;
+    }
+
     if ((pid = wait3(&statloc,WNOHANG,NULL)) != 0) {
         int exitcode = WEXITSTATUS(statloc);
         int bysignal = 0;
@@ -2375,6 +2467,10 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     // 将AOF缓存冲洗到磁盘中
     flushAppendOnlyFile(0);
 
+    /* Unblock the clients in WAITAOF whose writes reached the disk, with
+     * appendfsync always this is the case of all the writes just flushed. */
+    processClientsWaitingAof();
+
     /* Handle writes with pending output buffers. */
     // 处理放在clients_pending_write链表中的待写的client，将输出缓冲区的内容写到fd中
     handleClientsWithPendingWritesUsingThreads();
@@ -2496,6 +2592,9 @@ void createSharedObjects(void) {
     shared.punsubscribebulk = createStringObject("$12\r\npunsubscribe\r\n",19);
     shared.del = createStringObject("DEL",3);
     shared.unlink = createStringObject("UNLINK",6);
+    shared.hdel = createStringObject("HDEL",4);
+    shared.hpexpireat = createStringObject("HPEXPIREAT",10);
+    shared.fields = createStringObject("FIELDS",6);
     shared.rpop = createStringObject("RPOP",4);
     shared.lpop = createStringObject("LPOP",4);
     shared.lpush = createStringObject("LPUSH",5);
@@ -2560,6 +2659,11 @@ void initServerConfig(void) {
     server.aof_lastbgrewrite_status = C_OK;
     server.aof_delayed_fsync = 0;
     server.aof_fd = -1;
+    server.aof_last_incr_size = 0;
+    server.aof_manifest = NULL;
+    server.aof_woff = 0;
+    server.aof_written_woff = 0;
+    server.aof_fsynced_woff = 0;
     server.aof_selected_db = -1; /* Make sure the first time will not match */
     server.aof_flush_postponed_start = 0;
     server.pidfile = NULL;
@@ -2642,6 +2746,9 @@ void initServerConfig(void) {
     server.xclaimCommand = lookupCommandByCString("xclaim");
     server.xgroupCommand = lookupCommandByCString("xgroup");
     server.rpoplpushCommand = lookupCommandByCString("rpoplpush");
+    server.hdelCommand = lookupCommandByCString("hdel");
+    server.hpexpireatCommand = lookupCommandByCString("hpexpireat");
+    server.xtrimCommand = lookupCommandByCString("xtrim");
 
     /* Debugging */
     server.assert_failed = "<no assertion failed>";
@@ -3014,6 +3121,8 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_fields = 0;
+    server.stat_stream_trimmed = 0;
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_expire_cycle_time_used = 0;
@@ -3094,6 +3203,7 @@ void initServer(void) {
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
+    server.clients_waiting_aof = listCreate();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
     server.events_processed_while_blocked = 0;
@@ -3154,10 +3264,15 @@ void initServer(void) {
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[j].hexpires = dictCreate(&hashExpiresDictType,NULL);
+        server.db[j].streams = dictCreate(&hashExpiresDictType,NULL);
         server.db[j].expires_cursor = 0;
+        server.db[j].streams_cursor = 0;
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        server.db[j].pfcount_cache = dictCreate(&pfcountCacheDictType,NULL);
+        server.db[j].pfcount_cache_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
         server.db[j].defrag_later = listCreate();
@@ -3172,6 +3287,7 @@ void initServer(void) {
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
     server.cronloops = 0;
     server.rdb_child_pid = -1;
+    server.rdb_forkless_in_progress = 0;
     server.aof_child_pid = -1;
     server.module_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
@@ -3184,8 +3300,8 @@ void initServer(void) {
     server.child_info_pipe[0] = -1;
     server.child_info_pipe[1] = -1;
     server.child_info_data.magic = 0;
-    aofRewriteBufferReset();
     server.aof_buf = sdsempty();
+    server.aof_buf_has_resp = 0;
     server.lastsave = time(NULL); /* At startup we consider the DB saved. */
     server.lastbgsave_try = 0;    /* At startup we never tried to BGSAVE. */
     server.rdb_save_time_last = -1;
@@ -3196,6 +3312,7 @@ void initServer(void) {
     server.stat_starttime = time(NULL);
     server.stat_peak_memory = 0;
     server.stat_rdb_cow_bytes = 0;
+    server.stat_rdb_forkless_cow_keys = 0;
     server.stat_aof_cow_bytes = 0;
     server.stat_module_cow_bytes = 0;
     for (int j = 0; j < CLIENT_TYPE_COUNT; j++)
@@ -3250,22 +3367,32 @@ void initServer(void) {
                 "blocked clients subsystem.");
     }
 
+    /* The pipe used by the bio thread to awake the event loop when an AOF
+     * fsync is done, so that the clients in WAITAOF are served ASAP. */
+    if (pipe(server.aof_fsync_pipe) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for the AOF fsync notifications: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,server.aof_fsync_pipe[0]);
+    anetNonBlock(NULL,server.aof_fsync_pipe[1]);
+    if (aeCreateFileEvent(server.el, server.aof_fsync_pipe[0], AE_READABLE,
+        aofFsyncPipeReadable,NULL) == AE_ERR) {
+            serverPanic(
+                "Error registering the readable event for the AOF "
+                "fsync notifications.");
+    }
+
     /* Register before and after sleep handlers (note this needs to be done
      * before loading persistence since it is used by processEventsWhileBlocked. */
     aeSetBeforeSleepProc(server.el,beforeSleep);
     aeSetAfterSleepProc(server.el,afterSleep);
 
-    /* Open the AOF file if needed. */
+    /* Load the AOF manifest and open the AOF file if needed. */
     // 按需创建AOF的文件
-    if (server.aof_state == AOF_ON) {
-        server.aof_fd = open(server.aof_filename,
-                               O_WRONLY|O_APPEND|O_CREAT,0644);
-        if (server.aof_fd == -1) {
-            serverLog(LL_WARNING, "Can't open the append-only file: %s",
-                strerror(errno));
-            exit(1);
-        }
-    }
+    aofLoadManifestFromDisk();
+    aofOpenIfNeededOnServerStart();
 
     /* 32 bit instances are limited to 4GB of address space, so if there is
      * no explicit limit in the user provided configuration we set a limit
@@ -4155,6 +4282,7 @@ int processCommand(client *c) {
         call(c,CMD_CALL_FULL);
         // 保存写全局的复制偏移量
         c->woff = server.master_repl_offset;
+        c->aof_woff = server.aof_woff;
         // 如果因为BLPOP而阻塞的命令已经准备好，则处理client的阻塞状态
         if (listLength(server.ready_keys))
             handleClientsBlockedOnKeys();
@@ -4220,6 +4348,7 @@ int prepareForShutdown(int flags) {
          * but OS will close this fd when process exits. */
         killRDBChild();
     }
+    rdbForklessAbort();
 
     /* Kill module child if there is one. */
     if (server.module_child_pid != -1) {
@@ -4774,6 +4903,8 @@ sds genRedisInfoString(const char *section) {
             "rdb_last_bgsave_time_sec:%jd\r\n"
             "rdb_current_bgsave_time_sec:%jd\r\n"
             "rdb_last_cow_size:%zu\r\n"
+            "rdb_forkless_cow_keys:%lld\r\n"
+            "rdb_mmap_bytes:%zu\r\n"
             "aof_enabled:%d\r\n"
             "aof_rewrite_in_progress:%d\r\n"
             "aof_rewrite_scheduled:%d\r\n"
@@ -4786,13 +4917,15 @@ sds genRedisInfoString(const char *section) {
             "module_fork_last_cow_size:%zu\r\n",
             server.loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.rdb_forkless_in_progress,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
+            (intmax_t)((server.rdb_save_time_start == -1) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
+            server.stat_rdb_forkless_cow_keys,
+            zmalloc_mapped_memory(),
             server.aof_state != AOF_OFF,
             server.aof_child_pid != -1,
             server.aof_rewrite_scheduled,
@@ -4811,14 +4944,12 @@ sds genRedisInfoString(const char *section) {
                 "aof_base_size:%lld\r\n"
                 "aof_pending_rewrite:%d\r\n"
                 "aof_buffer_length:%zu\r\n"
-                "aof_rewrite_buffer_length:%lu\r\n"
                 "aof_pending_bio_fsync:%llu\r\n"
                 "aof_delayed_fsync:%lu\r\n",
                 (long long) server.aof_current_size,
                 (long long) server.aof_rewrite_base_size,
                 server.aof_rewrite_scheduled,
                 sdslen(server.aof_buf),
-                aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
                 server.aof_delayed_fsync);
         }
@@ -4872,6 +5003,8 @@ sds genRedisInfoString(const char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_fields:%lld\r\n"
+            "stream_trimmed_entries:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "expire_cycle_cpu_milliseconds:%lld\r\n"
@@ -4907,6 +5040,8 @@ sds genRedisInfoString(const char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            server.stat_expired_fields,
+            server.stat_stream_trimmed,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_expire_cycle_time_used/1000,
@@ -5441,7 +5576,7 @@ void loadDataFromDisk(void) {
     long long start = ustime();
     // 如果开启了AOF，则载入AOF文件
     if (server.aof_state == AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+        if (loadAppendOnlyFiles(server.aof_manifest) == C_OK)
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
         // 否则载入RDB文件
     } else {
@@ -5586,6 +5721,12 @@ int main(int argc, char **argv) {
             quicklistTest(argc, argv);
         } else if (!strcasecmp(argv[2], "intset")) {
             return intsetTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "roaring")) {
+            return roaringTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "zbtree")) {
+            return zbtreeTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "bitops")) {
+            return bitopsTest(argc, argv);
         } else if (!strcasecmp(argv[2], "zipmap")) {
             return zipmapTest(argc, argv);
         } else if (!strcasecmp(argv[2], "sha1test")) {
@@ -65,6 +65,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed bitmap of integers */
+#include "zbtree.h" /* B+-tree for big sorted sets */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
@@ -101,7 +103,6 @@ typedef long long ustime_t; /* microsecond time type. */
 #define OBJ_SHARED_BULKHDR_LEN 32
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages.*/
 #define AOF_REWRITE_ITEMS_PER_CMD 64
-#define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
 #define CONFIG_AUTHPASS_MAX_LEN 512
 #define CONFIG_RUN_ID_SIZE 40
 #define RDB_EOF_MARK_SIZE 40
@@ -216,6 +217,31 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* The AOF is made of a base file, written by the last rewrite, followed by
+ * the incremental files that received the writes since then. The manifest
+ * lists them in the order they must be replayed. */
+#define AOF_FILE_TYPE_BASE 'b'  /* Base file, RDB preamble or plain AOF. */
+#define AOF_FILE_TYPE_INCR 'i'  /* Incremental commands file. */
+
+/* First byte of the frames of the binary AOF encoding. The Redis protocol
+ * always starts with '*'. */
+#define AOF_BIN_CMD 1           /* A single command. */
+#define AOF_BIN_BLOCK 2         /* Compressed sequence of AOF_BIN_CMD frames. */
+#define AOF_BIN_MAX_FRAME (1ULL<<32) /* Sanity limit on frame lengths. */
+
+typedef struct aofInfo {
+    sds file_name;          /* File name, relative to the working dir. */
+    long long file_seq;     /* Sequence number of the file. */
+    int file_type;          /* AOF_FILE_TYPE_BASE or AOF_FILE_TYPE_INCR. */
+} aofInfo;
+
+typedef struct aofManifest {
+    aofInfo *base_aof_info;     /* Base file, NULL if there is none yet. */
+    list *incr_aof_list;        /* Incremental files, oldest first. */
+    long long curr_base_file_seq;   /* Last base sequence number used. */
+    long long curr_incr_file_seq;   /* Last incr sequence number used. */
+} aofManifest;
+
 /* Client flags */
 // client是从节点服务器
 #define CLIENT_SLAVE (1<<0)   /* This client is a repliaca */
@@ -299,7 +325,8 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
-#define BLOCKED_NUM 6     /* Number of blocked states. */
+#define BLOCKED_WAITAOF 6 /* WAITAOF for the AOF to be fsynced. */
+#define BLOCKED_NUM 7     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -655,6 +682,8 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_BITMAP 11 /* Encoded as a roaring bitmap of integers */
+#define OBJ_ENCODING_BTREE 12  /* Encoded as B+-tree */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -680,6 +709,14 @@ typedef struct redisObject {
     void *ptr;
 } robj;
 
+/* Strings encoded as OBJ_ENCODING_BITMAP are the compact form of sparse
+ * bitmaps created by the bit commands: the string is 'len' zero bytes except
+ * for the bits whose offsets are in the roaring bitmap. See bitops.c. */
+typedef struct bitmapString {
+    size_t len;         /* Length of the string in bytes. */
+    roaring *bits;      /* Offsets of the bits set, all < len*8. */
+} bitmapString;
+
 /* The a string name for an object's type as listed above
  * Native types are checked against the OBJ_STRING, OBJ_LIST, OBJ_* defines,
  * and Module types have their registered name returned. */
@@ -714,12 +751,18 @@ typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     // 过期字典，保存着设置过期的键和键的过期时间
     dict *expires;              /* Timeout of keys with a timeout set */
+    // 保存着 含有设置了过期时间的field的哈希键
+    dict *hexpires;             /* Hashes having fields with a timeout set */
+    dict *streams;              /* Stream keys, for the retention cycle */
+    unsigned long streams_cursor; /* Cursor of the stream retention cycle. */
     // 保存着 所有造成客户端阻塞的键和被阻塞的客户端
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     // 保存着 处于阻塞状态的键，value为NULL
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     // 事务模块，用于保存被WATCH命令所监控的键
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    dict *pfcount_cache;        /* Multi-key PFCOUNT results, by key set */
+    dict *pfcount_cache_keys;   /* Keys -> list of pfcount_cache entries */
     //数据库ID
     int id;                     /* Database ID */
     // 键的平均过期时间
@@ -792,6 +835,9 @@ typedef struct blockingState {
     // 要达到的复制偏移量
     long long reploffset;   /* Replication offset to reach. */
 
+    /* BLOCKED_WAITAOF */
+    long long aofoffset;    /* AOF offset that must be fsynced. */
+
     /* BLOCKED_MODULE */
     void *module_blocked_handle; /* RedisModuleBlockedClient structure.
                                     which is opaque for the Redis core, only
@@ -957,6 +1003,7 @@ typedef struct client {
     blockingState bpop;     /* blocking state */
     // 最近一个写全局的复制偏移量
     long long woff;         /* Last write global replication offset. */
+    long long aof_woff;     /* Last write global AOF offset. */
     // 监控列表
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     // 订阅频道
@@ -1020,6 +1067,7 @@ struct sharedObjectsStruct {
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
     *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *unlink,
+    *hdel, *hpexpireat, *fields,
     *rpop, *lpop, *lpush, *rpoplpush, *zpopmin, *zpopmax, *emptyscan,
     *multi, *exec,
     *select[PROTO_SHARED_SELECT_CMDS],
@@ -1052,9 +1100,13 @@ typedef struct zskiplist {
 } zskiplist;
 
 //有序集合类型
+/* The dict maps every element to its score, stored inline in the entry
+ * (see dictGetDoubleVal()). The elements are ordered by the skiplist, or by
+ * the B+-tree for OBJ_ENCODING_BTREE: only one of the two is not NULL. */
 typedef struct zset {
     dict *dict;     //字典
     zskiplist *zsl; //跳跃表
+    zbtree *zbt;    //B+树
 } zset;
 
 typedef struct clientBufferLimitsConfig {
@@ -1314,7 +1366,8 @@ struct redisServer {
                         *lpopCommand, *rpopCommand, *zpopminCommand,
                         *zpopmaxCommand, *sremCommand, *execCommand,
                         *expireCommand, *pexpireCommand, *xclaimCommand,
-                        *xgroupCommand, *rpoplpushCommand;
+                        *xgroupCommand, *rpoplpushCommand, *hdelCommand,
+                        *hpexpireatCommand, *xtrimCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     // 命令执行的次数
@@ -1323,6 +1376,8 @@ struct redisServer {
     long long stat_numconnections;  /* Number of connections received */
     // 过期键的数量
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expired_fields;  /* Number of expired hash fields */
+    long long stat_stream_trimmed;  /* Stream entries removed by retention */
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
@@ -1358,6 +1413,7 @@ struct redisServer {
     // 已经写到网络的字节数
     _Atomic long long stat_net_output_bytes; /* Bytes written to network. */
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
+    long long stat_rdb_forkless_cow_keys; /* Keys copied by the last forkless save. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
     size_t stat_module_cow_bytes;   /* Copy on write bytes during module fork. */
     uint64_t stat_clients_type_memory[CLIENT_TYPE_COUNT];/* Mem usage by type */
@@ -1423,16 +1479,24 @@ struct redisServer {
     // AOF文件在重写或启动后的大小
     off_t aof_rewrite_base_size;    /* AOF size on latest startup or rewrite. */
     // AOF文件当前的大小
-    off_t aof_current_size;         /* AOF current size. */
+    off_t aof_current_size;         /* AOF current size (base + incrs). */
+    off_t aof_last_incr_size;       /* Size of the incr file being appended. */
+    aofManifest *aof_manifest;      /* Files making up the AOF. */
     off_t aof_fsync_offset;         /* AOF offset which is already synced to disk. */
+    /* Logical AOF offsets, they never go back across rewrites and files. */
+    long long aof_woff;             /* Bytes fed into the AOF buffer. */
+    long long aof_written_woff;     /* Bytes written to the AOF file. */
+    _Atomic long long aof_fsynced_woff; /* Bytes known to be on disk. */
+    list *clients_waiting_aof;      /* Clients waiting in WAITAOF. */
+    int aof_fsync_pipe[2];          /* Wakes the event loop when a background
+                                       fsync WAITAOF clients need completes. */
     int aof_flush_sleep;            /* Micros to sleep before flush. (used by tests) */
     int aof_rewrite_scheduled;      /* Rewrite once BGSAVE terminates. */
     // 将AOF重写提上日程，当RDB的BGSAVE结束后，立即执行AOF重写
     pid_t aof_child_pid;            /* PID if rewriting process */
-    // AOF缓冲块的链表
-    list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
     // AOF缓冲区，在进入事件loop之前写入
     sds aof_buf;      /* AOF buffer, written before entering the event loop */
+    int aof_buf_has_resp; /* AOF buffer holds commands in the Redis protocol */
     // AOF文件的文件描述符
     int aof_fd;       /* File descriptor of currently selected AOF file */
     // 执行AOF时，当前的数据库id
@@ -1457,19 +1521,10 @@ struct redisServer {
     // 在不是所预期的AOF结尾的地方继续加载
     // 如果发现末尾命令不完整则自动截掉,成功加载前面正确的数据。
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
+    int aof_load_reader_thread;     /* Parse the AOF in a thread while loading. */
+    int aof_binary_encoding;        /* Log commands as binary frames. */
+    int aof_binary_compression;     /* RDB_ENC_* codec of the binary blocks, or 0. */
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
-    /* AOF pipes used to communicate between parent and child during rewrite. */
-    int aof_pipe_write_data_to_child;   //父进程写给子进程的文件描述符
-    int aof_pipe_read_data_from_parent; //子进程从父进程读的文件描述符
-    int aof_pipe_write_ack_to_parent;   //子进程写ack给父进程的文件描述符
-    int aof_pipe_read_ack_from_child;   //父进程从子进程读ack的文件描述符
-    int aof_pipe_write_ack_to_child;    //父进程写ack给子进程的文件描述符
-    int aof_pipe_read_ack_from_parent;  //子进程从父进程读ack的文件描述符
-    // 如果为真，则停止发送累计的不同数据给子进程
-    int aof_stop_sending_diff;     /* If true stop sending accumulated diffs
-                                      to child process. */
-    // 保存子进程AOF时差异累计数据的sds
-    sds aof_child_diff;             /* AOF diff accumulator child side. */
     /* RDB persistence */
     // 脏键，记录数据库被修改的次数
     long long dirty;                /* Changes to DB from the last save */
@@ -1485,10 +1540,19 @@ struct redisServer {
     char *rdb_filename;             /* Name of RDB file */
     // 是否采用LZF压缩算法压缩RDB文件，默认yes
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_codec;      /* RDB_ENC_* codec of compressed strings. */
+    int rdb_compression_min_size;   /* Don't compress strings up to this size. */
+    int rdb_zstd_min_size;          /* Use LZ4 for smaller strings with zstd. */
+    int rdb_zstd_level;             /* zstd compression level. */
     // RDB文件是否使用校验和，默认yes
     int rdb_checksum;               /* Use RDB checksum? */
     int rdb_del_sync_files;         /* Remove RDB files used only for SYNC if
                                        the instance does not use persistence. */
+    int rdb_load_threads;           /* Threads decoding values while loading. */
+    int rdb_save_threads;           /* Threads serializing keys while saving. */
+    int rdb_forkless_save;          /* BGSAVE from a thread, not a child. */
+    int rdb_forkless_in_progress;   /* Forkless BGSAVE not yet reaped. */
+    int rdb_mmap_snapshot;          /* Save and load mappable RDB files. */
     // 上一次执行SAVE成功的时间
     time_t lastsave;                /* Unix time of last successful save */
     // 最近一个尝试执行BGSAVE的时间
@@ -1673,11 +1737,15 @@ struct redisServer {
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
     size_t set_max_intset_entries;
+    int set_bitmap_encoding;
+    size_t string_bitmap_min_bytes;
+    int zset_btree_encoding;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
+    long long stream_max_age;       /* Stream retention in ms, 0 = disabled */
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
@@ -1873,6 +1941,7 @@ typedef struct {
     int encoding;                   //集合对象编码类型
     int ii; /* intset iterator */   //整数集合的迭代器，编码为INTSET使用
     dictIterator *di;               //字典的迭代器，编码为HT使用
+    roaringIterator ri; /* bitmap iterator */
 } setTypeIterator;
 
 /* Structure to hold hash iteration abstraction. Note that iteration over
@@ -1909,11 +1978,13 @@ extern dictType zsetDictType;
 extern dictType clusterNodesDictType;
 extern dictType clusterNodesBlackListDictType;
 extern dictType dbDictType;
+extern dictType commandTableDictType;
 extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
 extern dictType keyptrDictType;
+extern dictType hashExpiresDictType;
 extern dictType modulesDictType;
 
 /*-----------------------------------------------------------------------------
@@ -1958,6 +2029,15 @@ void getRandomBytes(unsigned char *p, size_t len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+bitmapString *bitmapStringNew(size_t len);
+void bitmapStringFree(bitmapString *bs);
+bitmapString *bitmapStringDup(const bitmapString *bs);
+void bitmapStringRead(const bitmapString *bs, size_t start, size_t len, unsigned char *dst);
+sds bitmapStringToSds(const bitmapString *bs);
+size_t bitmapStringAllocSize(const bitmapString *bs);
+#ifdef REDIS_TEST
+int bitopsTest(int argc, char **argv);
+#endif
 void redisSetProcTitle(char *title);
 int redisCommunicateSystemd(const char *sd_notify_msg);
 void redisSetCpuAffinity(const char *cpulist);
@@ -2127,6 +2207,8 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createSetBitmapObject(void);
+robj *createStringBitmapObject(size_t len);
 robj *createHashObject(void);
 robj *createZsetObject(void);
 robj *createZsetZiplistObject(void);
@@ -2203,6 +2285,10 @@ int writeCommandsDeniedByDiskError(void);
 /* RDB persistence */
 #include "rdb.h"
 void killRDBChild(void);
+void rdbForklessKeyAccess(redisDb *db, robj *key);
+void rdbForklessKeyWrite(redisDb *db, robj *key);
+void rdbForklessAbort(void);
+void rdbForklessCheckDone(void);
 int bg_unlink(const char *filename);
 
 /* AOF persistence */
@@ -2210,15 +2296,25 @@ void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
-int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFiles(aofManifest *am);
+aofManifest *aofLoadManifestFromFile(sds path);
+void aofManifestFree(aofManifest *am);
+void aofLoadManifestFromDisk(void);
+void aofOpenIfNeededOnServerStart(void);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
-void aofRewriteBufferReset(void);
-unsigned long aofRewriteBufferSize(void);
-ssize_t aofReadDiffFromParent(void);
 void killAppendOnlyChild(void);
 void restartAOFAfterSYNC();
+void aofSetFsyncedOffset(long long offset);
+void aofFsyncPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask);
+void processClientsWaitingAof(void);
+sds catAppendOnlyBinaryCommand(sds dst, int argc, robj **argv);
+int aofBinaryDecodeCommand(const unsigned char *p, size_t len, int *argcp, sds **argvp);
+int aofBinaryReadFrame(FILE *fp, sds *frame);
+sds aofBinaryInflateBlock(sds block);
+int aofBinaryNextBlockCommand(sds raw, size_t *pos, int *argcp, sds **argvp);
+void unblockClientWaitingAof(client *c);
 
 /* Child info */
 void openChildInfoPipe(void);
@@ -2308,10 +2404,15 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
+void zsetConvertAndExpand(robj *zobj, int encoding, unsigned long cap);
+robj *zsetTypeCreate(size_t size_hint, size_t val_len_hint);
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+int zsetLargeEncoding(void);
+void zsetInsert(zset *zs, double score, sds ele);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
+int zsetAddMany(robj *zobj, double *scores, robj **argv, int count, int flags, int *added, int *updated);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
@@ -2328,6 +2429,10 @@ int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
 
 /* Core functions */
 int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *level);
@@ -2381,9 +2486,15 @@ int setOOMScoreAdj(int process_class);
 int restartServer(int flags, mstime_t delay);
 
 /* Set data type */
+/* Intsets and bitmaps only hold integers: iterating them, or getting random
+ * elements, returns the int64_t form of the element instead of an sds. */
+#define setEncodingIsInteger(enc) \
+    ((enc) == OBJ_ENCODING_INTSET || (enc) == OBJ_ENCODING_BITMAP)
 // 创建一个保存value的集合
-robj *setTypeCreate(sds value);
+robj *setTypeCreate(sds value, size_t size_hint);
+void setTypeExpand(robj *set, size_t size_hint);
 int setTypeAdd(robj *subject, sds value);
+int setTypeAddMany(robj *set, robj **argv, int count);
 int setTypeRemove(robj *subject, sds value);
 int setTypeIsMember(robj *subject, sds value);
 setTypeIterator *setTypeInitIterator(robj *subject);
@@ -2394,6 +2505,7 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele);
 unsigned long setTypeRandomElements(robj *set, unsigned long count, robj *aux_set);
 unsigned long setTypeSize(const robj *subject);
 void setTypeConvert(robj *subject, int enc);
+robj *setTypeCreateFromBitmap(roaring *r);
 
 /* Hash data type */
 #define HASH_SET_TAKE_FIELD (1<<0)
@@ -2416,8 +2528,23 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
+int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll);
 robj *hashTypeGetValueObject(robj *o, sds field);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
+int hashTypeSetMany(robj *o, robj **argv, int count);
+dict *hashTypeGetExpires(const robj *o);
+long long hashTypeGetFieldExpire(robj *o, sds field);
+void hashTypeSetFieldExpire(robj *o, sds field, long long when);
+int hashTypePersistField(robj *o, sds field);
+int hashTypeFieldIsExpired(robj *o, sds field);
+void hashTypeExpireFieldsIfNeeded(client *c, int first, int last, int step);
+void hashTypeExpireAllFieldsIfNeeded(client *c);
+unsigned long hashTypeCountExpiredFields(robj *o);
+int hashTypeDeleteExpiredField(redisDb *db, robj *key, robj *o, sds field);
+
+/* HyperLogLog */
+void pfcountCacheInvalidateKey(redisDb *db, robj *key);
+void pfcountCacheFlush(int dbid);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
@@ -2464,6 +2591,8 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 void dbAdd(redisDb *db, robj *key, robj *val);
 int dbAddRDBLoad(redisDb *db, sds key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
+void dbTrackHashFieldExpires(redisDb *db, sds key);
+void dbTrackStream(redisDb *db, sds key);
 void genericSetKey(client *c, redisDb *db, robj *key, robj *val, int keepttl, int signal);
 void setKey(client *c, redisDb *db, robj *key, robj *val);
 int dbExists(redisDb *db, robj *key);
@@ -2503,6 +2632,7 @@ int *getKeysPrepareResult(getKeysResult *result, int numkeys);
 int getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, getKeysResult *result);
 void getKeysFreeResult(getKeysResult *result);
 int zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, getKeysResult *result);
+int sintercardGetKeys(struct redisCommand *cmd,robj **argv, int argc, getKeysResult *result);
 int evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, getKeysResult *result);
 int sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, getKeysResult *result);
 int migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, getKeysResult *result);
@@ -2643,6 +2773,7 @@ void spopCommand(client *c);
 void srandmemberCommand(client *c);
 void sinterCommand(client *c);
 void sinterstoreCommand(client *c);
+void sintercardCommand(client *c);
 void sunionCommand(client *c);
 void sunionstoreCommand(client *c);
 void sdiffCommand(client *c);
@@ -2707,11 +2838,20 @@ void hgetCommand(client *c);
 void hmsetCommand(client *c);
 void hmgetCommand(client *c);
 void hdelCommand(client *c);
+void hexpireCommand(client *c);
+void hpexpireCommand(client *c);
+void hexpireatCommand(client *c);
+void hpexpireatCommand(client *c);
+void httlCommand(client *c);
+void hpttlCommand(client *c);
+void hpersistCommand(client *c);
 void hlenCommand(client *c);
 void hstrlenCommand(client *c);
 void zremrangebyrankCommand(client *c);
 void zunionstoreCommand(client *c);
 void zinterstoreCommand(client *c);
+void zunionCommand(client *c);
+void zinterCommand(client *c);
 void zscanCommand(client *c);
 void hkeysCommand(client *c);
 void hvalsCommand(client *c);
@@ -2749,6 +2889,7 @@ void bitcountCommand(client *c);
 void bitposCommand(client *c);
 void replconfCommand(client *c);
 void waitCommand(client *c);
+void waitaofCommand(client *c);
 void geoencodeCommand(client *c);
 void geodecodeCommand(client *c);
 void georadiusbymemberCommand(client *c);
@@ -42,97 +42,225 @@ redisSortOperation *createSortOperation(int type, robj *pattern) {
     return so;
 }
 
-/* Return the value associated to the key with a name obtained using
- * the following rules:
+/* BY and GET patterns are parsed only once per SORT call. The key names
+ * obtained substituting the elements are written into a few reusable
+ * objects, so that the BY weights can be fetched in batches: first the key
+ * names of SORT_LOOKUP_BATCH elements are built and the hash table buckets
+ * where they live are prefetched, then the keys are actually looked up,
+ * overlapping most of the cache misses. */
+#define SORT_LOOKUP_BATCH 16
+
+#define SORT_PATTERN_SELF 0     /* "#": the element itself. */
+#define SORT_PATTERN_NONE 1     /* No '*' in the pattern: nothing to lookup. */
+#define SORT_PATTERN_KEY 2      /* Key name with '*' substitution. */
+
+typedef struct sortPattern {
+    int type;               /* SORT_PATTERN_* */
+    sds spat;               /* The pattern as given by the user. */
+    size_t prefixlen;       /* Bytes before the '*'. */
+    size_t postfixlen;      /* Bytes after the '*', excluding "->field". */
+    sds field;              /* Hash field name, or NULL. */
+    robj *keys[SORT_LOOKUP_BATCH]; /* Reusable key name objects. */
+} sortPattern;
+
+/* Parse 'pattern' according to the following rules:
  *
- * 1) The first occurrence of '*' in 'pattern' is substituted with 'subst'.
+ * 1) The first occurrence of '*' in 'pattern' is substituted with the
+ *    element.
  *
- * 2) If 'pattern' matches the "->" string, everything on the left of
+ * 2) If 'pattern' matches the "->" string, everything on the right of
  *    the arrow is treated as the name of a hash field, and the part on the
- *    left as the key name containing a hash. The value of the specified
- *    field is returned.
+ *    left as the key name containing a hash.
  *
- * 3) If 'pattern' equals "#", the function simply returns 'subst' itself so
- *    that the SORT command can be used like: SORT key GET # to retrieve
- *    the Set/List elements directly.
+ * 3) If 'pattern' equals "#", the element itself is returned so that the
+ *    SORT command can be used like: SORT key GET # to retrieve the
+ *    Set/List elements directly.
  *
- * The returned object will always have its refcount increased by 1
- * when it is non-NULL. */
-robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst, int writeflag) {
-    char *p, *f, *k;
-    sds spat, ssub;
-    robj *keyobj, *fieldobj = NULL, *o;
-    int prefixlen, sublen, postfixlen, fieldlen;
-
-    /* If the pattern is "#" return the substitution object itself in order
-     * to implement the "SORT ... GET #" feature. */
-    spat = pattern->ptr;
+ * If we can't find '*' in the pattern lookups always return NULL, as to
+ * GET a fixed key does not make sense. */
+void sortPatternInit(sortPattern *sp, robj *pattern) {
+    sds spat = pattern->ptr;
+    size_t fieldlen = 0;
+    char *p, *f;
+
+    memset(sp,0,sizeof(*sp));
+    sp->spat = spat;
     if (spat[0] == '#' && spat[1] == '\0') {
-        incrRefCount(subst);
-        return subst;
+        sp->type = SORT_PATTERN_SELF;
+        return;
     }
-
-    /* The substitution object may be specially encoded. If so we create
-     * a decoded object on the fly. Otherwise getDecodedObject will just
-     * increment the ref count, that we'll decrement later. */
-    subst = getDecodedObject(subst);
-    ssub = subst->ptr;
-
-    /* If we can't find '*' in the pattern we return NULL as to GET a
-     * fixed key does not make sense. */
-    p = strchr(spat,'*');
-    if (!p) {
-        decrRefCount(subst);
-        return NULL;
+    if ((p = strchr(spat,'*')) == NULL) {
+        sp->type = SORT_PATTERN_NONE;
+        return;
     }
+    sp->type = SORT_PATTERN_KEY;
 
     /* Find out if we're dealing with a hash dereference. */
     if ((f = strstr(p+1, "->")) != NULL && *(f+2) != '\0') {
         fieldlen = sdslen(spat)-(f-spat)-2;
-        fieldobj = createStringObject(f+2,fieldlen);
-    } else {
-        fieldlen = 0;
+        sp->field = sdsnewlen(f+2,fieldlen);
     }
+    sp->prefixlen = p-spat;
+    sp->postfixlen = sdslen(spat)-(sp->prefixlen+1)-(fieldlen ? fieldlen+2 : 0);
+}
+
+void sortPatternRelease(sortPattern *sp) {
+    int j;
 
-    /* Perform the '*' substitution. */
-    prefixlen = p-spat;
-    sublen = sdslen(ssub);
-    postfixlen = sdslen(spat)-(prefixlen+1)-(fieldlen ? fieldlen+2 : 0);
-    keyobj = createStringObject(NULL,prefixlen+sublen+postfixlen);
+    sdsfree(sp->field);
+    for (j = 0; j < SORT_LOOKUP_BATCH; j++)
+        if (sp->keys[j]) decrRefCount(sp->keys[j]);
+}
+
+/* Perform the '*' substitution of 'subst' into the key name object at
+ * position 'slot', and return it. The object is owned by the pattern and
+ * is overwritten by the next call using the same slot. */
+robj *sortPatternKey(sortPattern *sp, robj *subst, int slot) {
+    robj *keyobj = sp->keys[slot];
+    sds k;
+
+    /* Never rewrite a key name somebody else retained a reference to. */
+    if (keyobj == NULL || keyobj->refcount != 1) {
+        if (keyobj) decrRefCount(keyobj);
+        keyobj = sp->keys[slot] = createObject(OBJ_STRING,sdsempty());
+    }
     k = keyobj->ptr;
-    memcpy(k,spat,prefixlen);
-    memcpy(k+prefixlen,ssub,sublen);
-    memcpy(k+prefixlen+sublen,p+1,postfixlen);
-    decrRefCount(subst); /* Incremented by decodeObject() */
+    sdsclear(k);
+    k = sdscatlen(k,sp->spat,sp->prefixlen);
+    if (sdsEncodedObject(subst)) {
+        k = sdscatlen(k,subst->ptr,sdslen(subst->ptr));
+    } else if (subst->encoding == OBJ_ENCODING_INT) {
+        char buf[LONG_STR_SIZE];
+        int len = ll2string(buf,sizeof(buf),(long)subst->ptr);
+        k = sdscatlen(k,buf,len);
+    } else {
+        robj *dec = getDecodedObject(subst);
+        k = sdscatlen(k,dec->ptr,sdslen(dec->ptr));
+        decrRefCount(dec);
+    }
+    k = sdscatlen(k,sp->spat+sp->prefixlen+1,sp->postfixlen);
+    keyobj->ptr = k;
+    return keyobj;
+}
+
+/* Return the value associated with the already substituted key name
+ * 'keyobj', or NULL if the key is missing or of the wrong type. The
+ * returned object will always have its refcount increased by 1. */
+robj *sortPatternFetch(redisDb *db, sortPattern *sp, robj *keyobj, int writeflag) {
+    robj *o;
 
     /* Lookup substituted key */
     if (!writeflag)
         o = lookupKeyRead(db,keyobj);
     else
         o = lookupKeyWrite(db,keyobj);
-    if (o == NULL) goto noobj;
+    if (o == NULL) return NULL;
 
-    if (fieldobj) {
-        if (o->type != OBJ_HASH) goto noobj;
+    if (sp->field) {
+        if (o->type != OBJ_HASH) return NULL;
 
         /* Retrieve value from hash by the field name. The returned object
          * is a new object with refcount already incremented. */
-        o = hashTypeGetValueObject(o, fieldobj->ptr);
-    } else {
-        if (o->type != OBJ_STRING) goto noobj;
-
-        /* Every object that this function returns needs to have its refcount
-         * increased. sortCommand decreases it again. */
-        incrRefCount(o);
+        return hashTypeGetValueObject(o, sp->field);
     }
-    decrRefCount(keyobj);
-    if (fieldobj) decrRefCount(fieldobj);
+    if (o->type != OBJ_STRING) return NULL;
+
+    /* Every object that this function returns needs to have its refcount
+     * increased. sortCommand decreases it again. Bitmap encoded strings
+     * are returned decoded, as a new object. */
+    if (o->encoding == OBJ_ENCODING_BITMAP) return getDecodedObject(o);
+    incrRefCount(o);
     return o;
+}
+
+/* Build the key names of all the 'numpats' patterns for the 'count'
+ * elements starting at 'vector', one per slot, and prefetch the buckets
+ * where the keys are stored. */
+void sortPatternPrepare(redisDb *db, sortPattern *pats, int numpats, redisSortObject *vector, int count) {
+    int j, i;
+
+    for (j = 0; j < numpats; j++) {
+        if (pats[j].type != SORT_PATTERN_KEY) continue;
+        for (i = 0; i < count; i++) {
+            robj *keyobj = sortPatternKey(pats+j,vector[i].obj,i);
+            dictPrefetch(db->dict,keyobj->ptr);
+        }
+    }
+}
 
-noobj:
-    decrRefCount(keyobj);
-    if (fieldlen) decrRefCount(fieldobj);
-    return NULL;
+/* Return the value of the pattern 'sp' for the element 'subst', whose key
+ * name was already built into 'slot' by sortPatternPrepare(). The returned
+ * object will always have its refcount increased by 1 when it is
+ * non-NULL. */
+robj *lookupKeyByPattern(redisDb *db, sortPattern *sp, robj *subst, int slot, int writeflag) {
+    if (sp->type == SORT_PATTERN_SELF) {
+        incrRefCount(subst);
+        return subst;
+    }
+    if (sp->type == SORT_PATTERN_NONE) return NULL;
+    return sortPatternFetch(db,sp,sp->keys[slot],writeflag);
+}
+
+/* Convert a sorting weight: the whole string must be a valid double that
+ * is not NaN. Returns 0 on success, -1 on conversion error. */
+int sortParseWeight(const char *s, double *score) {
+    char *eptr;
+
+    errno = 0;
+    *score = strtod(s,&eptr);
+    if (eptr[0] != '\0' || errno == ERANGE || isnan(*score)) return -1;
+    return 0;
+}
+
+/* Like sortPatternFetch() followed by the weight conversion, but reading
+ * the value in place instead of creating an object for it, which is what
+ * numeric BY needs. If the key or field is missing 0 is returned and
+ * '*score' is left untouched. Returns -1 on conversion error. */
+int sortPatternWeight(redisDb *db, sortPattern *sp, robj *keyobj, int writeflag, double *score) {
+    robj *o;
+
+    if (!writeflag)
+        o = lookupKeyRead(db,keyobj);
+    else
+        o = lookupKeyWrite(db,keyobj);
+    if (o == NULL) return 0;
+
+    if (sp->field) {
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+        char buf[128];
+        int retval;
+
+        if (o->type != OBJ_HASH) return 0;
+        if (hashTypeGetValue(o,sp->field,&vstr,&vlen,&vll) == C_ERR) return 0;
+        if (vstr == NULL) {
+            *score = (double)vll;
+            return 0;
+        }
+        /* Ziplist values are not null terminated. */
+        if (vlen < sizeof(buf)) {
+            memcpy(buf,vstr,vlen);
+            buf[vlen] = '\0';
+            return sortParseWeight(buf,score);
+        }
+        sds tmp = sdsnewlen(vstr,vlen);
+        retval = sortParseWeight(tmp,score);
+        sdsfree(tmp);
+        return retval;
+    }
+    if (o->type != OBJ_STRING) return 0;
+    if (sdsEncodedObject(o)) return sortParseWeight(o->ptr,score);
+    if (o->encoding == OBJ_ENCODING_INT) {
+        *score = (long)o->ptr;
+        return 0;
+    }
+
+    /* Bitmap encoded strings. */
+    robj *dec = getDecodedObject(o);
+    int retval = sortParseWeight(dec->ptr,score);
+    decrRefCount(dec);
+    return retval;
 }
 
 /* sortCompare() is used by qsort in sortCommand(). Given that qsort_r with
@@ -187,6 +315,46 @@ int sortCompare(const void *s1, const void *s2) {
     return server.sort_desc ? -cmp : cmp;
 }
 
+/* When LIMIT selects at most 1/SORT_TOPK_RATIO of the elements, only the
+ * first ones are sorted, using a bounded heap. */
+#define SORT_TOPK_RATIO 8
+
+static void sortHeapSiftDown(redisSortObject *heap, long len, long i) {
+    while(1) {
+        long top = i, l = 2*i+1, r = 2*i+2;
+
+        if (l < len && sortCompare(heap+l,heap+top) > 0) top = l;
+        if (r < len && sortCompare(heap+r,heap+top) > 0) top = r;
+        if (top == i) break;
+
+        redisSortObject tmp = heap[i];
+        heap[i] = heap[top];
+        heap[top] = tmp;
+        i = top;
+    }
+}
+
+/* Move to vector[0..k-1], in order, the 'k' elements that a full sort of
+ * the 'len' elements of 'vector' would put first. A max-heap with the best
+ * 'k' elements seen so far is kept at the head of the vector, so this is
+ * O(N*log(K)) with a single pass over the elements. The other elements
+ * are left in the tail of the vector in unspecified order. */
+void sortTopK(redisSortObject *vector, long len, long k) {
+    long j;
+
+    if (k <= 0) return;
+    for (j = k/2-1; j >= 0; j--) sortHeapSiftDown(vector,k,j);
+    for (j = k; j < len; j++) {
+        if (sortCompare(vector+j,vector) < 0) {
+            redisSortObject tmp = vector[0];
+            vector[0] = vector[j];
+            vector[j] = tmp;
+            sortHeapSiftDown(vector,k,0);
+        }
+    }
+    qsort(vector,k,sizeof(redisSortObject),sortCompare);
+}
+
 /* The SORT command is the most complex command in Redis. Warning: this code
  * is optimized for speed and a bit less for readability */
 void sortCommand(client *c) {
@@ -200,6 +368,7 @@ void sortCommand(client *c) {
     int syntax_error = 0;
     robj *sortval, *sortby = NULL, *storekey = NULL;
     redisSortObject *vector; /* Resulting vector to sort */
+    sortPattern *getpats = NULL; /* Compiled GET patterns */
 
     /* Create a list of operations to perform for every sorted element.
      * Operations can be GET */
@@ -309,8 +478,9 @@ void sortCommand(client *c) {
     }
 
     /* Destructively convert encoded sorted sets for SORT. */
-    if (sortval->type == OBJ_ZSET)
-        zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
+    if (sortval->type == OBJ_ZSET &&
+        sortval->encoding == OBJ_ENCODING_ZIPLIST)
+        zsetConvert(sortval, zsetLargeEncoding());
 
     /* Objtain the length of the object to sort. */
     switch(sortval->type) {
@@ -409,27 +579,44 @@ void sortCommand(client *c) {
         sds sdsele;
         int rangelen = vectorlen;
 
-        /* Check if starting point is trivial, before doing log(N) lookup. */
-        if (desc) {
-            long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
+        if (zs->zbt) {
+            zbtreeIter it;
+            unsigned long zsetlen = zs->zbt->length;
+            int found = zbtSeekRank(zs->zbt,
+                desc ? zsetlen-start : (unsigned long)start+1, &it);
 
-            ln = zsl->tail;
-            if (start > 0)
-                ln = zslGetElementByRank(zsl,zsetlen-start);
+            while(rangelen--) {
+                serverAssertWithInfo(c,sortval,found);
+                sdsele = zbtIterEle(&it);
+                vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
+                vector[j].u.score = 0;
+                vector[j].u.cmpobj = NULL;
+                j++;
+                if (rangelen) found = desc ? zbtPrev(&it) : zbtNext(&it);
+            }
         } else {
-            ln = zsl->header->level[0].forward;
-            if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
-        }
+            /* Check if starting point is trivial, before doing log(N) lookup. */
+            if (desc) {
+                long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
 
-        while(rangelen--) {
-            serverAssertWithInfo(c,sortval,ln != NULL);
-            sdsele = ln->ele;
-            vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
-            vector[j].u.score = 0;
-            vector[j].u.cmpobj = NULL;
-            j++;
-            ln = desc ? ln->backward : ln->level[0].forward;
+                ln = zsl->tail;
+                if (start > 0)
+                    ln = zslGetElementByRank(zsl,zsetlen-start);
+            } else {
+                ln = zsl->header->level[0].forward;
+                if (start > 0)
+                    ln = zslGetElementByRank(zsl,start+1);
+            }
+
+            while(rangelen--) {
+                serverAssertWithInfo(c,sortval,ln != NULL);
+                sdsele = ln->ele;
+                vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
+                vector[j].u.score = 0;
+                vector[j].u.cmpobj = NULL;
+                j++;
+                ln = desc ? ln->backward : ln->level[0].forward;
+            }
         }
         /* Fix start/end: output code is not aware of this optimization. */
         end -= start;
@@ -455,29 +642,43 @@ void sortCommand(client *c) {
 
     /* Now it's time to load the right scores in the sorting vector */
     if (!dontsort) {
-        for (j = 0; j < vectorlen; j++) {
-            robj *byval;
-            if (sortby) {
-                /* lookup value to sort by */
-                byval = lookupKeyByPattern(c->db,sortby,vector[j].obj,storekey!=NULL);
-                if (!byval) continue;
-            } else {
-                /* use object itself to sort by */
-                byval = vector[j].obj;
+        if (sortby) {
+            sortPattern bypat;
+
+            /* Lookup the values to sort by, a batch of elements at a time.
+             * Numeric weights are converted in place, without creating
+             * objects for them. */
+            sortPatternInit(&bypat,sortby);
+            for (j = 0; j < vectorlen; j += SORT_LOOKUP_BATCH) {
+                int count = vectorlen-j, i;
+
+                if (count > SORT_LOOKUP_BATCH) count = SORT_LOOKUP_BATCH;
+                sortPatternPrepare(c->db,&bypat,1,vector+j,count);
+                for (i = 0; i < count; i++) {
+                    robj *keyobj = bypat.keys[i];
+
+                    if (alpha) {
+                        robj *byval = sortPatternFetch(c->db,&bypat,keyobj,
+                                                       storekey!=NULL);
+                        if (!byval) continue;
+                        vector[j+i].u.cmpobj = getDecodedObject(byval);
+                        decrRefCount(byval);
+                    } else if (sortPatternWeight(c->db,&bypat,keyobj,
+                               storekey!=NULL,&vector[j+i].u.score) == -1)
+                    {
+                        int_conversion_error = 1;
+                    }
+                }
             }
+            sortPatternRelease(&bypat);
+        } else if (!alpha) {
+            /* Use the objects themselves to sort by. */
+            for (j = 0; j < vectorlen; j++) {
+                robj *byval = vector[j].obj;
 
-            if (alpha) {
-                if (sortby) vector[j].u.cmpobj = getDecodedObject(byval);
-            } else {
                 if (sdsEncodedObject(byval)) {
-                    char *eptr;
-
-                    vector[j].u.score = strtod(byval->ptr,&eptr);
-                    if (eptr[0] != '\0' || errno == ERANGE ||
-                        isnan(vector[j].u.score))
-                    {
+                    if (sortParseWeight(byval->ptr,&vector[j].u.score) == -1)
                         int_conversion_error = 1;
-                    }
                 } else if (byval->encoding == OBJ_ENCODING_INT) {
                     /* Don't need to decode the object if it's
                      * integer-encoded (the only encoding supported) so
@@ -487,22 +688,36 @@ void sortCommand(client *c) {
                     serverAssertWithInfo(c,sortval,1 != 1);
                 }
             }
-
-            /* when the object was retrieved using lookupKeyByPattern,
-             * its refcount needs to be decreased. */
-            if (sortby) {
-                decrRefCount(byval);
-            }
         }
 
         server.sort_desc = desc;
         server.sort_alpha = alpha;
         server.sort_bypattern = sortby ? 1 : 0;
         server.sort_store = storekey ? 1 : 0;
-        if (sortby && (start != 0 || end != vectorlen-1))
+        if (int_conversion_error) {
+            /* No need to sort, an error is returned. */
+        } else if (end+1 <= vectorlen/SORT_TOPK_RATIO) {
+            sortTopK(vector,vectorlen,end+1);
+        } else if (sortby && (start != 0 || end != vectorlen-1)) {
             pqsort(vector,vectorlen,sizeof(redisSortObject),sortCompare, start,end);
-        else
+        } else {
             qsort(vector,vectorlen,sizeof(redisSortObject),sortCompare);
+        }
+    }
+
+    /* Compile the GET patterns. */
+    if (getop) {
+        listNode *ln;
+        listIter li;
+
+        getpats = zmalloc(sizeof(sortPattern)*getop);
+        j = 0;
+        listRewind(operations,&li);
+        while((ln = listNext(&li))) {
+            redisSortOperation *sop = ln->value;
+            sortPatternInit(getpats+j,sop->pattern);
+            j++;
+        }
     }
 
     /* Send command output to the output buffer, performing the specified
@@ -516,13 +731,17 @@ void sortCommand(client *c) {
         for (j = start; j <= end; j++) {
             listNode *ln;
             listIter li;
+            int slot = (j-start) % SORT_LOOKUP_BATCH, k = 0;
 
             if (!getop) addReplyBulk(c,vector[j].obj);
+            if (getop && slot == 0)
+                sortPatternPrepare(c->db,getpats,getop,vector+j,
+                    end-j+1 < SORT_LOOKUP_BATCH ? end-j+1 : SORT_LOOKUP_BATCH);
             listRewind(operations,&li);
             while((ln = listNext(&li))) {
                 redisSortOperation *sop = ln->value;
-                robj *val = lookupKeyByPattern(c->db,sop->pattern,
-                    vector[j].obj,storekey!=NULL);
+                robj *val = lookupKeyByPattern(c->db,getpats+k++,
+                    vector[j].obj,slot,storekey!=NULL);
 
                 if (sop->type == SORT_OP_GET) {
                     if (!val) {
@@ -544,15 +763,19 @@ void sortCommand(client *c) {
         for (j = start; j <= end; j++) {
             listNode *ln;
             listIter li;
+            int slot = (j-start) % SORT_LOOKUP_BATCH, k = 0;
 
             if (!getop) {
                 listTypePush(sobj,vector[j].obj,LIST_TAIL);
             } else {
+                if (slot == 0)
+                    sortPatternPrepare(c->db,getpats,getop,vector+j,
+                        end-j+1 < SORT_LOOKUP_BATCH ? end-j+1 : SORT_LOOKUP_BATCH);
                 listRewind(operations,&li);
                 while((ln = listNext(&li))) {
                     redisSortOperation *sop = ln->value;
-                    robj *val = lookupKeyByPattern(c->db,sop->pattern,
-                        vector[j].obj,storekey!=NULL);
+                    robj *val = lookupKeyByPattern(c->db,getpats+k++,
+                        vector[j].obj,slot,storekey!=NULL);
 
                     if (sop->type == SORT_OP_GET) {
                         if (!val) val = createStringObject("",0);
@@ -588,6 +811,8 @@ void sortCommand(client *c) {
         decrRefCount(vector[j].obj);
 
     decrRefCount(sortval);
+    for (j = 0; j < getop; j++) sortPatternRelease(getpats+j);
+    zfree(getpats);
     listRelease(operations);
     for (j = 0; j < vectorlen; j++) {
         if (alpha && vector[j].u.cmpobj)
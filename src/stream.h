@@ -40,6 +40,13 @@ typedef struct streamIterator {
     unsigned char *lp;      /* Current listpack. */
     unsigned char *lp_ele;  /* Current listpack cursor. */
     unsigned char *lp_flags; /* Current entry flags pointer. */
+    /* The master entry field names of the current listpack, already
+     * encoded as RESP bulk strings, so that entries with the same fields
+     * of the master entry can be emitted without decoding them again.
+     * Built lazily by streamAppendEntryReply(). */
+    sds master_fields_reply;
+    uint32_t *master_fields_offsets; /* Field i is at [off[i],off[i+1]). */
+    int master_fields_cached;        /* True if built for the current lp. */
     /* Buffers used to hold the string of lpGet() when the element is
      * integer encoded, so that there is no string representation of the
      * element inside the listpack itself. */
@@ -47,17 +54,50 @@ typedef struct streamIterator {
     unsigned char value_buf[LP_INTBUF_SIZE];
 } streamIterator;
 
+/* Pending entries lists (PELs) keep their entries sorted by ID in blocks of
+ * up to STREAM_PEL_BLOCK_ENTRIES entries. Blocks are indexed in a radix tree
+ * by the ID of their first entry, as 128 bit big endian number, so a single
+ * small allocation holds the metadata of many pending messages and ranges
+ * of IDs can be acknowledged a block at a time.
+ *
+ * All the entries of a PEL have the same size, and start with their ID:
+ * the consumer group PEL stores streamNACK entries, while the consumer
+ * PELs only store the IDs, that are looked up in the group PEL. */
+#define STREAM_PEL_BLOCK_ENTRIES 64
+
+typedef struct streamPELBlock {
+    uint32_t len;               /* Number of entries. */
+    uint32_t alloc;             /* Number of entries allocated. */
+    unsigned char entries[];    /* 'alloc' entries of 'esize' bytes. */
+} streamPELBlock;
+
+typedef struct streamPEL {
+    rax *blocks;                /* First ID of the block -> streamPELBlock. */
+    uint64_t size;              /* Number of entries. */
+    uint64_t alloc;             /* Number of entries allocated. */
+    uint32_t esize;             /* Size of an entry, starting with the ID. */
+} streamPEL;
+
+/* Iterate the entries of a PEL in ascending ID order. The PEL must not
+ * be modified while it is iterated. */
+typedef struct streamPELIterator {
+    streamPEL *pel;
+    raxIterator ri;
+    streamPELBlock *block;      /* Current block, NULL at the end. */
+    uint32_t pos;               /* Next entry to return in the block. */
+} streamPELIterator;
+
+#define streamPELSize(pel) ((pel)->size)
+
 /* Consumer group. */
 typedef struct streamCG {
     streamID last_id;       /* Last delivered (not acknowledged) ID for this
                                group. Consumers that will just ask for more
                                messages will served with IDs > than this. */
-    rax *pel;               /* Pending entries list. This is a radix tree that
-                               has every message delivered to consumers (without
-                               the NOACK option) that was yet not acknowledged
-                               as processed. The key of the radix tree is the
-                               ID as a 64 bit big endian number, while the
-                               associated value is a streamNACK structure.*/
+    streamPEL *pel;         /* Pending entries list. It has every message
+                               delivered to consumers (without the NOACK
+                               option) that was yet not acknowledged as
+                               processed, as streamNACK entries. */
     rax *consumers;         /* A radix tree representing the consumers by name
                                and their associated representation in the form
                                of streamConsumer structures. */
@@ -69,17 +109,18 @@ typedef struct streamConsumer {
     sds name;                   /* Consumer name. This is how the consumer
                                    will be identified in the consumer group
                                    protocol. Case sensitive. */
-    rax *pel;                   /* Consumer specific pending entries list: all
+    streamPEL *pel;             /* Consumer specific pending entries list: all
                                    the pending messages delivered to this
-                                   consumer not yet acknowledged. Keys are
-                                   big endian message IDs, while values are
-                                   the same streamNACK structure referenced
-                                   in the "pel" of the consumer group structure
-                                   itself, so the value is shared. */
+                                   consumer not yet acknowledged. It only
+                                   stores the IDs, the streamNACK entries are
+                                   in the "pel" of the consumer group
+                                   structure itself. */
 } streamConsumer;
 
-/* Pending (yet not acknowledged) message in a consumer group. */
+/* Pending (yet not acknowledged) message in a consumer group. Entries of the
+ * group PEL: pointers to them are only valid until the PEL is modified. */
 typedef struct streamNACK {
+    streamID id;                /* ID of the message. */
     mstime_t delivery_time;     /* Last time this message was delivered. */
     uint64_t delivery_count;    /* Number of times this message was delivered.*/
     streamConsumer *consumer;   /* The consumer this message was delivered to
@@ -109,13 +150,29 @@ void streamIteratorStart(streamIterator *si, stream *s, streamID *start, streamI
 int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields);
 void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsigned char **valueptr, int64_t *fieldlen, int64_t *valuelen);
 void streamIteratorStop(streamIterator *si);
+sds streamAppendEntryReply(sds reply, streamIterator *si, streamID *id, int64_t numfields);
+size_t streamRenderRange(stream *s, streamID *start, streamID *end, size_t count, sds *reply);
+void streamRetentionCycle(void);
 streamCG *streamLookupCG(stream *s, sds groupname);
 streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int flags);
 streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id);
-streamNACK *streamCreateNACK(streamConsumer *consumer);
+streamNACK *streamCreateNACK(streamCG *cg, streamID *id, streamConsumer *consumer);
+void streamEncodeID(void *buf, streamID *id);
 void streamDecodeID(void *buf, streamID *id);
 int streamCompareID(streamID *a, streamID *b);
-void streamFreeNACK(streamNACK *na);
 void streamIncrID(streamID *id);
+streamPEL *streamPELNew(size_t esize);
+void streamPELFree(streamPEL *pel);
+void *streamPELFind(streamPEL *pel, streamID *id);
+void *streamPELAdd(streamPEL *pel, streamID *id, int *added);
+int streamPELRemove(streamPEL *pel, streamID *id);
+uint64_t streamPELRemoveMany(streamPEL *pel, streamID *ids, size_t count, void (*removed)(void *entry, void *privdata), void *privdata);
+void *streamPELFirst(streamPEL *pel);
+void *streamPELLast(streamPEL *pel);
+void streamPELIteratorStart(streamPELIterator *it, streamPEL *pel, streamID *start);
+void *streamPELIteratorNext(streamPELIterator *it);
+void streamPELIteratorStop(streamPELIterator *it);
+size_t streamPELMemoryUsage(streamPEL *pel);
+size_t streamRadixTreeMemoryUsage(rax *rax);
 
 #endif
@@ -119,6 +119,9 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
     // 键不存在
     if (de == NULL) return NULL;
 
+    // 域已经逻辑过期，视为不存在
+    if (hashTypeFieldIsExpired(o, field)) return NULL;
+
     // 取出域（键）的值，直接返回
     return dictGetVal(de);
 }
@@ -310,6 +313,78 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
     return update;
 }
 
+/* Set the 'count' field/value pairs at 'argv' like HSET does, returning the
+ * number of fields created. A ziplist encoded hash is not grown one pair at
+ * a time: the fields it doesn't hold yet are counted first, then the hash is
+ * either converted and pre-sized once, or the fields it already holds are
+ * updated in place and the new pairs are appended with a single resize. */
+int hashTypeSetMany(robj *o, robj **argv, int count) {
+    int j, created = 0;
+
+    if (o->encoding == OBJ_ENCODING_ZIPLIST && count > 1) {
+        /* Map every new field to the value it gets, that is the last one
+         * given for it. */
+        dict *fields = dictCreate(&keyptrDictType,NULL);
+        unsigned long len = hashTypeLength(o);
+
+        for (j = 0; j < count*2; j += 2) {
+            sds field = argv[j]->ptr;
+            dictEntry *de = dictFind(fields,field);
+
+            if (de) {
+                dictSetVal(fields,de,argv[j+1]->ptr);
+            } else if (!hashTypeExists(o,field)) {
+                if (len+dictSize(fields) >= server.hash_max_ziplist_entries)
+                    break;
+                dictAdd(fields,field,argv[j+1]->ptr);
+            }
+        }
+
+        if (j < count*2) {
+            /* Too many fields for a ziplist. */
+            hashTypeConvert(o,OBJ_ENCODING_HT);
+            dictExpand(o->ptr,len+count);
+        } else {
+            unsigned long n = 0;
+            unsigned char **s = zmalloc(sizeof(unsigned char*)*
+                                        dictSize(fields)*2);
+            unsigned int *slen = zmalloc(sizeof(unsigned int)*
+                                         dictSize(fields)*2);
+
+            /* New fields are appended in the order they were first given,
+             * like one HSET per pair would do. */
+            for (j = 0; j < count*2; j += 2) {
+                sds field = argv[j]->ptr, value;
+                dictEntry *de = dictFind(fields,field);
+
+                if (de == NULL) {
+                    hashTypeSet(o,field,argv[j+1]->ptr,HASH_SET_COPY);
+                } else if ((value = dictGetVal(de)) != NULL) {
+                    s[n] = (unsigned char*)field;
+                    slen[n++] = sdslen(field);
+                    s[n] = (unsigned char*)value;
+                    slen[n++] = sdslen(value);
+                    dictSetVal(fields,de,NULL);
+                    created++;
+                }
+            }
+            o->ptr = ziplistPushMany(o->ptr,s,slen,n);
+            zfree(s);
+            zfree(slen);
+            dictRelease(fields);
+            return created;
+        }
+        dictRelease(fields);
+    }
+
+    for (j = 0; j < count*2; j += 2) {
+        /* Overwriting a field also clears its TTL, like SET does. */
+        hashTypePersistField(o,argv[j]->ptr);
+        created += !hashTypeSet(o,argv[j]->ptr,argv[j+1]->ptr,HASH_SET_COPY);
+    }
+    return created;
+}
+
 /* Delete an element from a hash.
  * Return 1 on deleted and 0 on not found. */
 /* 哈希删除 hdel */
@@ -331,6 +406,7 @@ int hashTypeDelete(robj *o, sds field) {
             }
         }
     } else if (o->encoding == OBJ_ENCODING_HT) {//哈希
+        hashTypePersistField(o, field);//同时删除field的过期时间
         if (dictDelete((dict*)o->ptr, field) == C_OK) {//直接删除
             deleted = 1;
 
@@ -359,6 +435,206 @@ unsigned long hashTypeLength(const robj *o) {
     return length;
 }
 
+/*-----------------------------------------------------------------------------
+ * Hash field expires
+ *
+ * Only hash table encoded hashes may have fields with a TTL. The TTLs are
+ * kept in a second dictionary (field -> unix time in milliseconds) that is
+ * referenced by the privdata of the main one, so hashes without volatile
+ * fields pay nothing. The index is created on the first TTL and released
+ * as soon as the last one is removed.
+ *
+ * An expired field is treated as missing by the lookup functions. It is
+ * reclaimed lazily by hashTypeExpireFieldsIfNeeded(), that commands call
+ * before looking up the key (hashTypeExpireAllFieldsIfNeeded() for HLEN,
+ * that depends on every field), and actively by activeExpireCycle(). Like
+ * keys, fields are never reclaimed by replicas: the master propagates an
+ * HDEL for every field it expires.
+ *----------------------------------------------------------------------------*/
+
+/* Return the TTL index of the hash, or NULL if no field has a TTL. */
+dict *hashTypeGetExpires(const robj *o) {
+    if (o->encoding != OBJ_ENCODING_HT) return NULL;
+    return ((const dict*)o->ptr)->privdata;
+}
+
+/* Return the unix time in milliseconds at which the field expires, or -1
+ * if the field has no TTL. */
+long long hashTypeGetFieldExpire(robj *o, sds field) {
+    dict *ttls = hashTypeGetExpires(o);
+    dictEntry *de;
+
+    if (ttls == NULL || (de = dictFind(ttls,field)) == NULL) return -1;
+    return dictGetSignedIntegerVal(de);
+}
+
+/* Set the TTL of an existing field. The hash must be hash table encoded. */
+void hashTypeSetFieldExpire(robj *o, sds field, long long when) {
+    dict *d = o->ptr, *ttls;
+    dictEntry *de;
+
+    serverAssert(o->encoding == OBJ_ENCODING_HT);
+    if ((ttls = d->privdata) == NULL)
+        ttls = d->privdata = dictCreate(&hashExpiresDictType,NULL);
+    if ((de = dictFind(ttls,field)) == NULL) {
+        de = dictAddRaw(ttls,sdsdup(field),NULL);
+        serverAssert(de != NULL);
+    }
+    dictSetSignedIntegerVal(de,when);
+}
+
+/* Remove the TTL of the field, if any. Returns 1 if the field had a TTL,
+ * otherwise 0. */
+int hashTypePersistField(robj *o, sds field) {
+    dict *d, *ttls = hashTypeGetExpires(o);
+
+    if (ttls == NULL || dictDelete(ttls,field) != DICT_OK) return 0;
+    if (dictSize(ttls) == 0) {
+        dictRelease(ttls);
+        d = o->ptr;
+        d->privdata = NULL;
+    }
+    return 1;
+}
+
+/* The reference time used to check if a field expired. See keyIsExpired()
+ * for why the time is frozen inside scripts and commands. */
+static long long hashFieldExpireNow(void) {
+    if (server.lua_caller) return server.lua_time_start;
+    if (server.fixed_time_expire > 0) return server.mstime;
+    return mstime();
+}
+
+/* Return 1 if the field has a TTL that already elapsed. Fields are never
+ * considered expired while loading, or when the command is received from
+ * our master, that is the only one in charge of deleting them. */
+int hashTypeFieldIsExpired(robj *o, sds field) {
+    long long when = hashTypeGetFieldExpire(o,field);
+
+    if (when == -1) return 0;
+    if (server.loading) return 0;
+    if (server.masterhost && server.current_client &&
+        server.current_client == server.master) return 0;
+    return hashFieldExpireNow() > when;
+}
+
+/* Delete the expired field from the hash stored at 'key', propagating an
+ * HDEL to the AOF and the replicas. If this was the last field the key is
+ * deleted as well, in that case 1 is returned and 'o' is no longer valid,
+ * otherwise 0 is returned. */
+int hashTypeDeleteExpiredField(redisDb *db, robj *key, robj *o, sds field) {
+    robj *argv[3];
+    int keyremoved = 0;
+
+    rdbForklessKeyWrite(db,key);
+    /* The field name may belong to the TTL index: copy it first. */
+    argv[0] = shared.hdel;
+    argv[1] = key;
+    argv[2] = createStringObject(field,sdslen(field));
+    if (!hashTypeDelete(o,argv[2]->ptr)) {
+        decrRefCount(argv[2]);
+        return 0;
+    }
+
+    if (server.aof_state != AOF_OFF)
+        feedAppendOnlyFile(server.hdelCommand,db->id,argv,3);
+    replicationFeedSlaves(server.slaves,db->id,argv,3);
+    decrRefCount(argv[2]);
+
+    server.stat_expired_fields++;
+    notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",key,db->id);
+    if (hashTypeLength(o) == 0) {
+        dbDelete(db,key);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,db->id);
+        keyremoved = 1;
+    }
+    signalModifiedKey(NULL,db,key);
+    return keyremoved;
+}
+
+/* Reclaim the expired fields among c->argv[first..last] (every 'step'
+ * arguments) of the hash at c->argv[1]. Commands call this before looking
+ * up the key, so that they never see an object that is about to be
+ * deleted because its last field expired. */
+void hashTypeExpireFieldsIfNeeded(client *c, int first, int last, int step) {
+    redisDb *db = c->db;
+    robj *key = c->argv[1], *o;
+    int j;
+
+    if (server.masterhost || server.loading) return;
+    if (dictSize(db->hexpires) == 0 ||
+        dictFind(db->hexpires,key->ptr) == NULL) return;
+    if (expireIfNeeded(db,key)) return;
+    rdbForklessKeyAccess(db,key);
+    o = dictFetchValue(db->dict,key->ptr);
+    if (o == NULL || o->type != OBJ_HASH) return;
+
+    for (j = first; j <= last; j += step) {
+        if (hashTypeGetExpires(o) == NULL) break;
+        if (hashTypeFieldIsExpired(o,c->argv[j]->ptr) &&
+            hashTypeDeleteExpiredField(db,key,o,c->argv[j]->ptr)) break;
+    }
+}
+
+/* Reclaim every expired field of the hash at c->argv[1], for commands that
+ * depend on all the fields of the hash, like HLEN. The cost is proportional
+ * to the number of fields having a TTL. */
+void hashTypeExpireAllFieldsIfNeeded(client *c) {
+    redisDb *db = c->db;
+    robj *key = c->argv[1], *o;
+    dict *ttls;
+    dictIterator *di;
+    dictEntry *de;
+    sds *names;
+    unsigned long n = 0, j;
+    long long now;
+
+    if (server.masterhost || server.loading) return;
+    if (dictSize(db->hexpires) == 0 ||
+        dictFind(db->hexpires,key->ptr) == NULL) return;
+    if (expireIfNeeded(db,key)) return;
+    rdbForklessKeyAccess(db,key);
+    o = dictFetchValue(db->dict,key->ptr);
+    if (o == NULL || o->type != OBJ_HASH ||
+        (ttls = hashTypeGetExpires(o)) == NULL) return;
+
+    /* Copy the names of the expired fields first: deleting a field
+     * releases the entry of the TTL index, and the index itself when it
+     * becomes empty. */
+    now = hashFieldExpireNow();
+    names = zmalloc(sizeof(sds)*dictSize(ttls));
+    di = dictGetIterator(ttls);
+    while((de = dictNext(di)) != NULL) {
+        if (now > dictGetSignedIntegerVal(de))
+            names[n++] = sdsdup(dictGetKey(de));
+    }
+    dictReleaseIterator(di);
+
+    for (j = 0; j < n; j++) {
+        /* Once the hash is gone the remaining names are just freed. */
+        if (o && hashTypeDeleteExpiredField(db,key,o,names[j])) o = NULL;
+        sdsfree(names[j]);
+    }
+    zfree(names);
+}
+
+/* Return the number of fields of the hash that are logically expired but
+ * not reclaimed yet, which only happens on replicas. */
+unsigned long hashTypeCountExpiredFields(robj *o) {
+    dict *ttls = hashTypeGetExpires(o);
+    dictIterator *di;
+    dictEntry *de;
+    unsigned long count = 0;
+
+    if (ttls == NULL || !server.masterhost) return 0;
+    di = dictGetIterator(ttls);
+    while((de = dictNext(di)) != NULL) {
+        if (hashTypeFieldIsExpired(o,dictGetKey(de))) count++;
+    }
+    dictReleaseIterator(di);
+    return count;
+}
+
 /* 获取hashType-dict迭代器 */
 hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hashTypeIterator *hi = zmalloc(sizeof(hashTypeIterator));//分配字典迭代器
@@ -560,6 +836,7 @@ void hashTypeConvert(robj *o, int enc) {
 /* hsetnx客户端命令 */
 void hsetnxCommand(client *c) {
     robj *o;
+    hashTypeExpireFieldsIfNeeded(c,2,2,1);
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;//写入或者创建key
     hashTypeTryConversion(o,c->argv,2,3);//判别当前的value是否超过了ziplist限制，超过了直接进行类型转换
 
@@ -580,7 +857,7 @@ void hsetnxCommand(client *c) {
 
 /* hset 客户端设置指令 */
 void hsetCommand(client *c) {
-    int i, created = 0;
+    int created;
     robj *o;
 
     if ((c->argc % 2) == 1) {//判别当前输入命令行参数数量
@@ -588,11 +865,11 @@ void hsetCommand(client *c) {
         return;
     }
 
+    hashTypeExpireFieldsIfNeeded(c,2,c->argc-2,2);
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;//写入或者创建key
     hashTypeTryConversion(o,c->argv,2,c->argc-1);//判别当前的value是否超过了ziplist限制，超过了直接进行类型转换
 
-    for (i = 2; i < c->argc; i += 2)
-        created += !hashTypeSet(o,c->argv[i]->ptr,c->argv[i+1]->ptr,HASH_SET_COPY);//哈希设置键值对
+    created = hashTypeSetMany(o,c->argv+2,(c->argc-2)/2);
 
     /* HMSET (deprecated) and HSET return value is different. */
     char *cmdname = c->argv[0]->ptr;
@@ -617,6 +894,7 @@ void hincrbyCommand(client *c) {
     unsigned int vlen;
 
     if (getLongLongFromObjectOrReply(c,c->argv[3],&incr,NULL) != C_OK) return;//数据转化
+    hashTypeExpireFieldsIfNeeded(c,2,2,1);
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;//写入或者创建key
     if (hashTypeGetValue(o,c->argv[2]->ptr,&vstr,&vlen,&value) == C_OK) {//当前value存在与否
         if (vstr) {
@@ -655,6 +933,7 @@ void hincrbyfloatCommand(client *c) {
     unsigned int vlen;
 
     if (getLongDoubleFromObjectOrReply(c,c->argv[3],&incr,NULL) != C_OK) return;//参数转化
+    hashTypeExpireFieldsIfNeeded(c,2,2,1);
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;//写入或者创建key
     if (hashTypeGetValue(o,c->argv[2]->ptr,&vstr,&vlen,&ll) == C_OK) {//value获取
         if (vstr) {
@@ -740,6 +1019,7 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
 void hgetCommand(client *c) {
     robj *o;
 
+    hashTypeExpireFieldsIfNeeded(c,2,2,1);
     //数据库检测 || 类型检测
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.null[c->resp])) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
@@ -758,6 +1038,7 @@ void hmgetCommand(client *c) {
     /*
      * 当找不到密钥时，请不要中止。 不存在的键是空散列，其中HMGET应该以一系列空散列作为响应。
      * */
+    hashTypeExpireFieldsIfNeeded(c,2,c->argc-1,1);
     o = lookupKeyRead(c->db, c->argv[1]);
     if (o != NULL && o->type != OBJ_HASH) {
         addReply(c, shared.wrongtypeerr);
@@ -775,6 +1056,7 @@ void hdelCommand(client *c) {
     robj *o;
     int j, deleted = 0, keyremoved = 0;
 
+    hashTypeExpireFieldsIfNeeded(c,2,c->argc-1,1);
     //数据库查找 || 类型检测
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
@@ -804,18 +1086,22 @@ void hdelCommand(client *c) {
 void hlenCommand(client *c) {
     robj *o;
 
+    /* Expired fields are not counted, like all the other read commands
+     * don't see them. Replicas never reclaim them, so they are skipped. */
+    hashTypeExpireAllFieldsIfNeeded(c);
     //数据库查找 || 类型检测
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
     //获取哈希长度并响应
-    addReplyLongLong(c,hashTypeLength(o));
+    addReplyLongLong(c,hashTypeLength(o)-hashTypeCountExpiredFields(o));
 }
 
 /** hstrlen 获取指定feild对应的value长度 */
 void hstrlenCommand(client *c) {
     robj *o;
 
+    hashTypeExpireFieldsIfNeeded(c,2,2,1);
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
     //获取当前结构题中field对应的value长度并做出响应
@@ -846,6 +1132,7 @@ static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int wh
 void genericHgetallCommand(client *c, int flags) {
     robj *o;
     hashTypeIterator *hi;
+    void *replylen = NULL;
     int length, count = 0;
 
     robj *emptyResp = (flags & OBJ_HASH_KEY && flags & OBJ_HASH_VALUE) ?
@@ -857,7 +1144,11 @@ void genericHgetallCommand(client *c, int flags) {
     /* We return a map if the user requested keys and values, like in the
      * HGETALL case. Otherwise to use a flat array makes more sense. */
     length = hashTypeLength(o);//获取元素个数
-    if (flags & OBJ_HASH_KEY && flags & OBJ_HASH_VALUE) {
+    if (hashTypeGetExpires(o)) {
+        /* Expired fields not yet reclaimed are skipped, so the final
+         * length is only known at the end. */
+        replylen = addReplyDeferredLen(c);
+    } else if (flags & OBJ_HASH_KEY && flags & OBJ_HASH_VALUE) {
         addReplyMapLen(c, length);
     } else {
         addReplyArrayLen(c, length);
@@ -865,6 +1156,12 @@ void genericHgetallCommand(client *c, int flags) {
 
     hi = hashTypeInitIterator(o);//获取哈希迭代器
     while (hashTypeNext(hi) != C_ERR) {//迭代
+        if (replylen && hashTypeFieldIsExpired(o,
+                hashTypeCurrentFromHashTable(hi,OBJ_HASH_KEY)))
+        {
+            length--;
+            continue;
+        }
         if (flags & OBJ_HASH_KEY) {
             addHashIteratorCursorToReply(c, hi, OBJ_HASH_KEY);
             count++;
@@ -880,6 +1177,12 @@ void genericHgetallCommand(client *c, int flags) {
     /* Make sure we returned the right number of elements. */
     if (flags & OBJ_HASH_KEY && flags & OBJ_HASH_VALUE) count /= 2;
     serverAssert(count == length);
+    if (replylen) {
+        if (flags & OBJ_HASH_KEY && flags & OBJ_HASH_VALUE)
+            setDeferredMapLen(c, replylen, length);
+        else
+            setDeferredArrayLen(c, replylen, length);
+    }
 }
 
 /**
@@ -912,6 +1215,7 @@ void hgetallCommand(client *c) {
  * */
 void hexistsCommand(client *c) {
     robj *o;
+    hashTypeExpireFieldsIfNeeded(c,2,2,1);
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
@@ -931,3 +1235,254 @@ void hscanCommand(client *c) {
         checkType(c,o,OBJ_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/*-----------------------------------------------------------------------------
+ * Hash field expire commands
+ *----------------------------------------------------------------------------*/
+
+#define HFE_NX (1<<0)   /* Set only if the field has no TTL. */
+#define HFE_XX (1<<1)   /* Set only if the field already has a TTL. */
+#define HFE_GT (1<<2)   /* Set only if greater than the current TTL. */
+#define HFE_LT (1<<3)   /* Set only if less than the current TTL. */
+
+/* Parse the "FIELDS numfields field [field ...]" block starting at
+ * c->argv[pos]. It must extend exactly to the end of the command. */
+static int hashParseFieldsOrReply(client *c, int pos, long *numfields) {
+    if (pos+2 > c->argc || strcasecmp(c->argv[pos]->ptr,"fields")) {
+        addReplyError(c,"Mandatory argument FIELDS is missing or not at the right position");
+        return C_ERR;
+    }
+    if (getLongFromObjectOrReply(c,c->argv[pos+1],numfields,NULL) != C_OK)
+        return C_ERR;
+    if (*numfields <= 0) {
+        addReplyError(c,"Parameter `numFields` should be greater than 0");
+        return C_ERR;
+    }
+    if (*numfields != c->argc-pos-2) {
+        addReplyError(c,"The `numfields` parameter must match the number of arguments");
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* This is the generic command implementation for HEXPIRE, HPEXPIRE,
+ * HEXPIREAT and HPEXPIREAT, see expireGenericCommand() for 'basetime' and
+ * 'unit'. The reply is an array with one of these codes for each field:
+ *
+ * -2 the field (or the whole key) does not exist.
+ *  0 the NX / XX / GT / LT condition was not met.
+ *  1 the TTL was set.
+ *  2 the time is already in the past, the field was deleted.
+ *
+ * The command is never propagated verbatim: fields that got a TTL are
+ * propagated as a single HPEXPIREAT with the absolute time, deleted fields
+ * as a single HDEL. */
+void hexpireGenericCommand(client *c, long long basetime, int unit) {
+    robj *key = c->argv[1], *o;
+    long long when;
+    long numfields;
+    int flags = 0, pos = 3, j;
+    int setcount = 0, delcount = 0, keyremoved = 0;
+    robj **setv, **delv;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&when,NULL) != C_OK)
+        return;
+    if (when < 0) {
+        addReplyError(c,"invalid expire time, must be >= 0");
+        return;
+    }
+    if ((unit == UNIT_SECONDS && when > LLONG_MAX/1000) ||
+        (unit == UNIT_SECONDS ? when*1000 : when) > LLONG_MAX-basetime)
+    {
+        addReplyError(c,"invalid expire time in 'hexpire' command");
+        return;
+    }
+    if (unit == UNIT_SECONDS) when *= 1000;
+    when += basetime;
+
+    if (strcasecmp(c->argv[pos]->ptr,"fields")) {
+        char *opt = c->argv[pos]->ptr;
+        if (!strcasecmp(opt,"nx")) flags = HFE_NX;
+        else if (!strcasecmp(opt,"xx")) flags = HFE_XX;
+        else if (!strcasecmp(opt,"gt")) flags = HFE_GT;
+        else if (!strcasecmp(opt,"lt")) flags = HFE_LT;
+        else {
+            addReplyErrorFormat(c,"Unsupported argument: %s",opt);
+            return;
+        }
+        pos++;
+    }
+    if (hashParseFieldsOrReply(c,pos,&numfields) != C_OK) return;
+
+    hashTypeExpireFieldsIfNeeded(c,pos+2,c->argc-1,1);
+    if ((o = lookupKeyWrite(c->db,key)) != NULL && checkType(c,o,OBJ_HASH))
+        return;
+
+    /* Room for the command name, key, time, FIELDS and numfields. */
+    setv = zmalloc(sizeof(robj*)*(numfields+5));
+    delv = zmalloc(sizeof(robj*)*(numfields+2));
+
+    addReplyArrayLen(c,numfields);
+    for (j = pos+2; j < c->argc; j++) {
+        sds field = c->argv[j]->ptr;
+        long long current;
+
+        if (o == NULL || keyremoved || !hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+
+        /* A field without TTL is considered to have an infinite TTL. */
+        current = hashTypeGetFieldExpire(o,field);
+        if ((flags & HFE_NX && current != -1) ||
+            (flags & HFE_XX && current == -1) ||
+            (flags & HFE_GT && (current == -1 || when <= current)) ||
+            (flags & HFE_LT && current != -1 && when >= current))
+        {
+            addReplyLongLong(c,0);
+            continue;
+        }
+
+        if (checkAlreadyExpired(when)) {
+            hashTypeDelete(o,field);
+            delv[2+delcount++] = c->argv[j];
+            addReplyLongLong(c,2);
+            if (hashTypeLength(o) == 0) {
+                dbDelete(c->db,key);
+                keyremoved = 1;
+            }
+        } else {
+            if (o->encoding == OBJ_ENCODING_ZIPLIST)
+                hashTypeConvert(o,OBJ_ENCODING_HT);
+            hashTypeSetFieldExpire(o,field,when);
+            setv[5+setcount++] = c->argv[j];
+            addReplyLongLong(c,1);
+        }
+    }
+
+    if (setcount || delcount) {
+        preventCommandPropagation(c);
+        signalModifiedKey(c,c->db,key);
+        server.dirty += setcount+delcount;
+    }
+    if (setcount && !keyremoved) {
+        robj *whenobj = createStringObjectFromLongLong(when);
+        robj *countobj = createStringObjectFromLongLong(setcount);
+
+        setv[0] = shared.hpexpireat;
+        setv[1] = key;
+        setv[2] = whenobj;
+        setv[3] = shared.fields;
+        setv[4] = countobj;
+        alsoPropagate(server.hpexpireatCommand,c->db->id,setv,setcount+5,
+                      PROPAGATE_AOF|PROPAGATE_REPL);
+        decrRefCount(whenobj);
+        decrRefCount(countobj);
+        dbTrackHashFieldExpires(c->db,key->ptr);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpire",key,c->db->id);
+    }
+    if (delcount) {
+        delv[0] = shared.hdel;
+        delv[1] = key;
+        alsoPropagate(server.hdelCommand,c->db->id,delv,delcount+2,
+                      PROPAGATE_AOF|PROPAGATE_REPL);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",key,c->db->id);
+        if (keyremoved)
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,c->db->id);
+    }
+    zfree(setv);
+    zfree(delv);
+}
+
+/* HEXPIRE key seconds [NX|XX|GT|LT] FIELDS numfields field [field ...] */
+void hexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+/* HPEXPIRE key milliseconds [NX|XX|GT|LT] FIELDS numfields field [field ...] */
+void hpexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+/* HEXPIREAT key unix-time-seconds [NX|XX|GT|LT] FIELDS numfields field ... */
+void hexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+/* HPEXPIREAT key unix-time-ms [NX|XX|GT|LT] FIELDS numfields field ... */
+void hpexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/* Implements HTTL and HPTTL. For every field the reply is -2 if the field
+ * does not exist, -1 if it has no TTL, or the remaining time to live. */
+void httlGenericCommand(client *c, int output_ms) {
+    robj *o;
+    long numfields;
+    int j;
+
+    if (hashParseFieldsOrReply(c,2,&numfields) != C_OK) return;
+    hashTypeExpireFieldsIfNeeded(c,4,c->argc-1,1);
+    if ((o = lookupKeyReadWithFlags(c->db,c->argv[1],LOOKUP_NOTOUCH)) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 4; j < c->argc; j++) {
+        long long expire, ttl;
+
+        if (o == NULL || !hashTypeExists(o,c->argv[j]->ptr)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        expire = hashTypeGetFieldExpire(o,c->argv[j]->ptr);
+        if (expire == -1) {
+            addReplyLongLong(c,-1);
+            continue;
+        }
+        ttl = expire-mstime();
+        if (ttl < 0) ttl = 0;
+        addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+/* HTTL key FIELDS numfields field [field ...] */
+void httlCommand(client *c) {
+    httlGenericCommand(c, 0);
+}
+
+/* HPTTL key FIELDS numfields field [field ...] */
+void hpttlCommand(client *c) {
+    httlGenericCommand(c, 1);
+}
+
+/* HPERSIST key FIELDS numfields field [field ...]
+ * For every field the reply is -2 if the field does not exist, -1 if it
+ * has no TTL, and 1 if the TTL was removed. */
+void hpersistCommand(client *c) {
+    robj *o;
+    long numfields;
+    int j, persisted = 0;
+
+    if (hashParseFieldsOrReply(c,2,&numfields) != C_OK) return;
+    hashTypeExpireFieldsIfNeeded(c,4,c->argc-1,1);
+    if ((o = lookupKeyWrite(c->db,c->argv[1])) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 4; j < c->argc; j++) {
+        if (o == NULL || !hashTypeExists(o,c->argv[j]->ptr)) {
+            addReplyLongLong(c,-2);
+        } else if (hashTypePersistField(o,c->argv[j]->ptr)) {
+            addReplyLongLong(c,1);
+            persisted++;
+        } else {
+            addReplyLongLong(c,-1);
+        }
+    }
+
+    if (persisted) {
+        signalModifiedKey(c,c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hpersist",c->argv[1],c->db->id);
+        server.dirty += persisted;
+    }
+}
@@ -506,7 +506,7 @@ void lsetCommand(client *c) {
             //替换成功，则发送ok
             addReply(c,shared.ok);
             //当数据库的键被改动，则会调用该函数发送信号
-            signalModifiedKey(c->db,c->argv[1]);
+            signalModifiedKey(c,c->db,c->argv[1]);
             //发送"lset"时间通知
             notifyKeyspaceEvent(NOTIFY_LIST,"lset",c->argv[1],c->db->id);
             //更新脏键
@@ -45,15 +45,84 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
  *
  * 当对象的值可以被编码为整数时，返回 intset ，
  * 否则，返回普通的哈希表。
+ *
+ * 'size_hint' is the number of elements the caller is about to add. It
+ * is only used to pre-size a hash table: the elements may be duplicated,
+ * so whether an intset holds them is decided by setTypeAddMany().
  */
-robj *setTypeCreate(sds value) {
+robj *setTypeCreate(sds value, size_t size_hint) {
 
     //如果value对象的值可以转换为long long 类型的整数，则创建一个整数集合intset
     if (isSdsRepresentableAsLongLong(value,NULL) == C_OK)
         return createIntsetObject();
 
     // 否则创建一个哈希表类型的集合
-    return createSetObject();
+    robj *o = createSetObject();
+    if (size_hint > 1) dictExpand(o->ptr,size_hint);
+    return o;
+}
+
+/* Make room for 'size_hint' more elements in a hash table encoded set, so
+ * that it does not rehash while they are added. Other encodings are left
+ * untouched. */
+void setTypeExpand(robj *set, size_t size_hint) {
+    if (set->encoding != OBJ_ENCODING_HT || size_hint == 0) return;
+    dictExpand(set->ptr,dictSize((dict*)set->ptr)+size_hint);
+}
+
+static int setTypeCompareIntegers(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Add the 'count' elements at 'argv' to the set, returning how many of
+ * them were not already members. An intset is not grown one element at a
+ * time: the number of integers it doesn't hold yet is computed first, then
+ * the set is either converted and pre-sized once, or the new integers are
+ * merged into the intset with a single resize. */
+int setTypeAddMany(robj *set, robj **argv, int count) {
+    int j, added = 0;
+
+    if (set->encoding == OBJ_ENCODING_INTSET && count > 1) {
+        int64_t *values = zmalloc(sizeof(int64_t)*count);
+        uint32_t unique = 0, newcount = 0;
+        long long llval;
+
+        for (j = 0; j < count; j++) {
+            if (isSdsRepresentableAsLongLong(argv[j]->ptr,&llval) != C_OK)
+                break;
+            values[j] = llval;
+        }
+
+        if (j < count) {
+            /* Not an integer: the set ends up as a hash table anyway. */
+            setTypeConvert(set,OBJ_ENCODING_HT);
+            setTypeExpand(set,count);
+        } else {
+            qsort(values,count,sizeof(int64_t),setTypeCompareIntegers);
+            for (j = 0; j < count; j++) {
+                if (unique && values[unique-1] == values[j]) continue;
+                values[unique++] = values[j];
+                if (!intsetFind(set->ptr,values[j])) newcount++;
+            }
+
+            if (intsetLen(set->ptr)+newcount <=
+                server.set_max_intset_entries)
+            {
+                set->ptr = intsetAddMany(set->ptr,values,unique,&newcount);
+                zfree(values);
+                return newcount;
+            }
+            setTypeConvert(set,server.set_bitmap_encoding ?
+                           OBJ_ENCODING_BITMAP : OBJ_ENCODING_HT);
+            setTypeExpand(set,newcount);
+        }
+        zfree(values);
+    }
+
+    for (j = 0; j < count; j++)
+        if (setTypeAdd(set,argv[j]->ptr)) added++;
+    return added;
 }
 
 /*
@@ -89,7 +158,8 @@ int setTypeAdd(robj *subject, sds value) {
                  * too many entries. */
                 //查看整数集合的元素个数是否大于配置的最大个数
                 if (intsetLen(subject->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                    setTypeConvert(subject,server.set_bitmap_encoding ?
+                                   OBJ_ENCODING_BITMAP : OBJ_ENCODING_HT);
                 return 1;
             }
         } else {
@@ -103,6 +173,15 @@ int setTypeAdd(robj *subject, sds value) {
             serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_BITMAP) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return roaringAdd(subject->ptr,llval);
+
+        /* Not an integer: the bitmap can't represent it, so convert to a
+         * regular set just like we do for intsets. */
+        setTypeConvert(subject,OBJ_ENCODING_HT);
+        serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+        return 1;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -129,6 +208,9 @@ int setTypeRemove(robj *setobj, sds value) {
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_BITMAP) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return roaringRemove(setobj->ptr,llval);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -149,6 +231,9 @@ int setTypeIsMember(robj *subject, sds value) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return intsetFind((intset*)subject->ptr,llval);
         }
+    } else if (subject->encoding == OBJ_ENCODING_BITMAP) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return roaringContains(subject->ptr,llval);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -168,6 +253,8 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
         //初始化集合的迭代器，该成员为集合的下标
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == OBJ_ENCODING_BITMAP) {
+        roaringInitIterator(&si->ri,subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -233,6 +320,9 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_BITMAP) {
+        if (!roaringNext(&si->ri,llele)) return -1;
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -264,6 +354,7 @@ sds setTypeNextObject(setTypeIterator *si) {
     switch(encoding) {
         case -1:    return NULL;            //迭代完成
         case OBJ_ENCODING_INTSET:           //整数集合返回一个字符串类型的对象
+        case OBJ_ENCODING_BITMAP:
             return sdsfromlonglong(intele);
         case OBJ_ENCODING_HT:               //字典集合，返回共享的该对象
             return sdsdup(sdsele);
@@ -307,6 +398,9 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {   //随机返回一个集合元素保存在参数中
         *llele = intsetRandom(setobj->ptr);
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_BITMAP) {
+        *llele = roaringRandom(setobj->ptr);
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -321,6 +415,8 @@ unsigned long setTypeSize(const robj *subject) {
     //返回整数集合中的元素数量
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_BITMAP) {
+        return roaringCard((const roaring*)subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -334,11 +430,15 @@ unsigned long setTypeSize(const robj *subject) {
  * is presized to hold the number of elements in the original set.
  *
  * 新创建的结果字典会被预先分配为和原来的集合一样大。
+ *
+ * Intsets can be converted to hash tables or bitmaps, bitmaps can only
+ * be converted to hash tables (when a non integer element is added).
  */
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             (setobj->encoding == OBJ_ENCODING_INTSET ||
+                              setobj->encoding == OBJ_ENCODING_BITMAP));
 
     // 转换成OBJ_ENCODING_HT字典类型的编码
     if (enc == OBJ_ENCODING_HT) {
@@ -349,7 +449,7 @@ void setTypeConvert(robj *setobj, int enc) {
 
         /* Presize the dict to avoid rehashing */
         // 扩展字典的大小
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
         /* To add the elements we extract integers and create redis objects */
 
@@ -367,30 +467,64 @@ void setTypeConvert(robj *setobj, int enc) {
         // 释放迭代器空间
         setTypeReleaseIterator(si);
 
+        // 更新集合对象的值对象
+        freeSetObject(setobj);
         // 设置转换后的集合对象的编码类型
         setobj->encoding = OBJ_ENCODING_HT;
-        // 更新集合对象的值对象
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == OBJ_ENCODING_BITMAP &&
+               setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        roaring *r = roaringNew();
+        int64_t intele;
+        uint32_t ii = 0;
+
+        while (intsetGet(setobj->ptr,ii++,&intele)) roaringAdd(r,intele);
+        zfree(setobj->ptr);
+        setobj->encoding = OBJ_ENCODING_BITMAP;
+        setobj->ptr = r;
     } else {
         serverPanic("Unsupported set conversion");
     }
 }
 
+/* Build a set object out of a bitmap, taking ownership of it. The set is
+ * encoded as an intset when small enough, exactly like a set built element
+ * by element with SADD would be. */
+robj *setTypeCreateFromBitmap(roaring *r) {
+    robj *o = createObject(OBJ_SET,r);
+    o->encoding = OBJ_ENCODING_BITMAP;
+
+    if (roaringCard(r) <= server.set_max_intset_entries) {
+        intset *is = intsetNew();
+        roaringIterator ri;
+        int64_t intele;
+
+        roaringInitIterator(&ri,r);
+        while (roaringNext(&ri,&intele)) is = intsetAdd(is,intele,NULL);
+        roaringFree(r);
+        o->ptr = is;
+        o->encoding = OBJ_ENCODING_INTSET;
+    } else if (!server.set_bitmap_encoding) {
+        setTypeConvert(o,OBJ_ENCODING_HT);
+    }
+    return o;
+}
+
 /*
  * SADD key member [member ...]
  * SADD命令的实现
  * */
 void saddCommand(client *c) {
     robj *set;
-    int j, added = 0;
+    int added;
 
     // 以写的方式取出集合对象
     set = lookupKeyWrite(c->db,c->argv[1]);
 
     // 如果当前key不存在，则创建一个集合对象，并将新建的集合对象加入到数据库中
     if (set == NULL) {
-        set = setTypeCreate(c->argv[2]->ptr);
+        set = setTypeCreate(c->argv[2]->ptr,c->argc-2);
         dbAdd(c->db,c->argv[1],set);
         // 对象存在，检查集合的类型
     } else {
@@ -401,11 +535,8 @@ void saddCommand(client *c) {
         }
     }
 
-    // 遍历所有的member
-    for (j = 2; j < c->argc; j++) {
-        // 将当前member加入到集合中
-        if (setTypeAdd(set,c->argv[j]->ptr)) added++;
-    }
+    // 将所有的member加入到集合中
+    added = setTypeAddMany(set,c->argv+2,c->argc-2);
 
     // 如果有至少一个元素被成功添加，那么执行以下程序
     if (added) {
@@ -515,7 +646,7 @@ void smoveCommand(client *c) {
     /* Create the destination set when it doesn't exist */
     //当目标集合不存在，则新创建一个目标集合，并将新建的集合加入到数据库中
     if (!dstset) {
-        dstset = setTypeCreate(ele->ptr);
+        dstset = setTypeCreate(ele->ptr,1);
         dbAdd(c->db,c->argv[2],dstset);
     }
 
@@ -672,13 +803,16 @@ void spopWithCountCommand(client *c) {
         while(count--) {
             /* Emit and remove. */
             // 从集合中随机弹出一个元素
-            encoding = setTypeRandomElement(set,&objele,&llele);
+            encoding = setTypeRandomElement(set,&sdsele,&llele);
             // 根据不同的编码类型，创建发送给client的对象，对象的值为弹出的元素的值
             // 将弹出的元素对象从源集合中删除
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (setEncodingIsInteger(encoding)) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
-                set->ptr = intsetRemove(set->ptr,llele,NULL);
+                if (encoding == OBJ_ENCODING_INTSET)
+                    set->ptr = intsetRemove(set->ptr,llele,NULL);
+                else
+                    roaringRemove(set->ptr,llele);
             } else {
                 addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
                 objele = createStringObject(sdsele,sdslen(sdsele));
@@ -711,13 +845,13 @@ void spopWithCountCommand(client *c) {
             //弹出一个元素
             encoding = setTypeRandomElement(set,&sdsele,&llele);
             //根据不同的编码类型，将弹出的元素封装成对象
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (setEncodingIsInteger(encoding)) {
                 sdsele = sdsfromlonglong(llele);
             } else {
                 sdsele = sdsdup(sdsele);
             }
             //创建一个新集合
-            if (!newset) newset = setTypeCreate(sdsele);
+            if (!newset) newset = setTypeCreate(sdsele,remaining+1);
             //将弹出元素的对象加入到新集合中
             setTypeAdd(newset,sdsele);
             //将弹出的元素对象从源集合中删除
@@ -733,7 +867,7 @@ void spopWithCountCommand(client *c) {
         //迭代原来的集合
         while((encoding = setTypeNext(si,&sdsele,&llele)) != -1) {
             //根据不同的编码类型，创建弹出值的对象
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (setEncodingIsInteger(encoding)) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
             } else {
@@ -795,9 +929,12 @@ void spopCommand(client *c) {
 
     /* Remove the element from the set */
     //从集合中将弹出元素删除，需要先讲元素构建成对象
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (setEncodingIsInteger(encoding)) {
         ele = createStringObjectFromLongLong(llele);
-        set->ptr = intsetRemove(set->ptr,llele,NULL);
+        if (encoding == OBJ_ENCODING_INTSET)
+            set->ptr = intsetRemove(set->ptr,llele,NULL);
+        else
+            roaringRemove(set->ptr,llele);
     } else {
         ele = createStringObject(sdsele,sdslen(sdsele));
         setTypeRemove(set,ele->ptr);
@@ -909,7 +1046,7 @@ void srandmemberWithCountCommand(client *c) {
             // 随机弹出一个元素保存在参数中
             encoding = setTypeRandomElement(set,&ele,&llele);
             // 发送保存在参数中的元素值
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (setEncodingIsInteger(encoding)) {
                 addReplyBulkLongLong(c,llele);
             } else {
                 addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -966,7 +1103,7 @@ void srandmemberWithCountCommand(client *c) {
             int retval = DICT_ERR;
 
             // 将参数中的元素值添加到字典d中
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (setEncodingIsInteger(encoding)) {
                 retval = dictAdd(d,createStringObjectFromLongLong(llele),NULL);
             } else {
                 retval = dictAdd(d,createStringObject(ele,sdslen(ele)),NULL);
@@ -1008,7 +1145,7 @@ void srandmemberWithCountCommand(client *c) {
             //随机弹出一个元素保存在参数中
             encoding = setTypeRandomElement(set,&ele,&llele);
             //将弹出的元素构建成字符串对象
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (setEncodingIsInteger(encoding)) {
                 objele = createStringObjectFromLongLong(llele);
             } else {
                 objele = createStringObject(ele,sdslen(ele));
@@ -1076,7 +1213,7 @@ void srandmemberCommand(client *c) {
     //随机返回一个元素，保存在参数中
     encoding = setTypeRandomElement(set,&ele,&llele);
     //发送参数中的值给client
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (setEncodingIsInteger(encoding)) {
         addReplyBulkLongLong(c,llele);
     } else {
         addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -1105,11 +1242,62 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/* Check if the element returned by setTypeNext() with the specified
+ * 'encoding' is a member of 'set'. Integers are looked up directly into
+ * integer encoded sets, without converting them to strings and back. */
+static int setTypeIsMemberEncoded(robj *set, int encoding, sds ele,
+                                  int64_t llele)
+{
+    int found;
+
+    if (!setEncodingIsInteger(encoding)) return setTypeIsMember(set,ele);
+    if (set->encoding == OBJ_ENCODING_INTSET)
+        return intsetFind(set->ptr,llele);
+    if (set->encoding == OBJ_ENCODING_BITMAP)
+        return roaringContains(set->ptr,llele);
+    ele = sdsfromlonglong(llele);
+    found = setTypeIsMember(set,ele);
+    sdsfree(ele);
+    return found;
+}
+
+/* Like intsetFind() but for a sequence of ascending lookups: '*pos' is a
+ * merge cursor inside the intset that only moves forward, so that probing N
+ * ascending values costs O(N+M) instead of O(N*log(M)).
+ * Returns 1 if the value was found, 0 if not, and -1 if the cursor reached
+ * the end of the intset, so no greater value can be found anymore. */
+static int intsetMergeFind(intset *is, long *pos, int64_t value) {
+    int64_t cur;
+
+    while (intsetGet(is,*pos,&cur)) {
+        if (cur >= value) return cur == value;
+        (*pos)++;
+    }
+    return -1;
+}
+
+/* Return the number of bits needed to represent 'n', that is the number of
+ * steps of a binary search into a sorted array of 'n' elements. */
+static int log2ceil(unsigned long n) {
+    int bits = 0;
+    while (n) {
+        bits++;
+        n >>= 1;
+    }
+    return bits;
+}
+
 // SINTER key [key ...]
 // SINTERSTORE destination key [key ...]
+// SINTERCARD numkeys key [key ...] [LIMIT limit]
 // SINTER、SINTERSTORE一类命令的底层实现
+//
+// When 'cardinality_only' is true, only the number of elements of the
+// intersection is returned to the client, stopping as soon as 'limit'
+// elements are found (if 'limit' is not zero).
 void sinterGenericCommand(client *c, robj **setkeys,
-                          unsigned long setnum, robj *dstkey) {
+                          unsigned long setnum, robj *dstkey,
+                          int cardinality_only, unsigned long limit) {
     //分配存储集合的数组
     robj **sets = zmalloc(sizeof(robj*)*setnum);
     setTypeIterator *si;
@@ -1117,8 +1305,9 @@ void sinterGenericCommand(client *c, robj **setkeys,
     sds elesds;
     int64_t intobj;
     void *replylen = NULL;
+    long *mergepos = NULL;
     unsigned long j, cardinality = 0;
-    int encoding;
+    int encoding, exhausted = 0;
 
     //遍历集合数组
     for (j = 0; j < setnum; j++) {
@@ -1132,7 +1321,6 @@ void sinterGenericCommand(client *c, robj **setkeys,
         if (!setobj) {
             zfree(sets);    //释放集合数组空间
             // 如果是SINTERSTORE命令
-            zfree(sets);
             if (dstkey) {
                 // 从数据库中删除存储的目标集合对象dstkey
                 if (dbDelete(c->db,dstkey)) {
@@ -1141,6 +1329,8 @@ void sinterGenericCommand(client *c, robj **setkeys,
                     server.dirty++;
                 }
                 addReply(c,shared.czero);//发送0给client
+            } else if (cardinality_only) {
+                addReply(c,shared.czero);
                 // 如果是SINTER命令，发送空回复
             } else {
                 addReply(c,shared.emptyset[c->resp]);
@@ -1158,6 +1348,57 @@ void sinterGenericCommand(client *c, robj **setkeys,
     //从小到大排序集合数组中的集合大小，能够提高算法的性能
     qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
 
+    /* When all the sets are bitmaps, intersect them natively container by
+     * container instead of probing every element of the smallest set. */
+    for (j = 0; j < setnum; j++)
+        if (sets[j]->encoding != OBJ_ENCODING_BITMAP) break;
+    if (j == setnum) {
+        roaring *r = roaringDup(sets[0]->ptr);
+
+        for (j = 1; j < setnum && roaringCard(r); j++)
+            if (sets[j] != sets[0]) roaringAnd(r,sets[j]->ptr);
+        if (cardinality_only) {
+            cardinality = roaringCard(r);
+            if (limit && cardinality > limit) cardinality = limit;
+            addReplyLongLong(c,cardinality);
+            roaringFree(r);
+            zfree(sets);
+            return;
+        } else if (!dstkey) {
+            roaringIterator ri;
+
+            addReplySetLen(c,roaringCard(r));
+            roaringInitIterator(&ri,r);
+            while (roaringNext(&ri,&intobj)) addReplyBulkLongLong(c,intobj);
+            roaringFree(r);
+            zfree(sets);
+            return;
+        }
+        dstset = setTypeCreateFromBitmap(r);
+        goto store;
+    }
+
+    /* Integer encoded sets are iterated in ascending order, so when the
+     * smallest set is one of them, the other intsets can be walked with a
+     * merge cursor instead of being binary searched for every element.
+     * For every intset we pick the strategy touching less elements: the
+     * merge costs |set| steps, the lookups |smallest| * log2(|set|). */
+    if (setEncodingIsInteger(sets[0]->encoding)) {
+        unsigned long first = setTypeSize(sets[0]);
+
+        for (j = 1; j < setnum; j++) {
+            unsigned long size = setTypeSize(sets[j]);
+
+            if (sets[j]->encoding != OBJ_ENCODING_INTSET ||
+                size >= first * log2ceil(size)) continue;
+            if (mergepos == NULL) {
+                mergepos = zmalloc(sizeof(long)*setnum);
+                memset(mergepos,-1,sizeof(long)*setnum);
+            }
+            mergepos[j] = 0;
+        }
+    }
+
     /* The first thing we should output is the total number of elements...
      * since this is a multi-bulk write, but at this stage we don't know
      * the intersection set size, so we use a trick, append an empty object
@@ -1166,12 +1407,12 @@ void sinterGenericCommand(client *c, robj **setkeys,
     // 因为不知道结果集会有多少个元素，所有没有办法直接设置回复的数量
     // 这里使用了一个小技巧，直接使用一个 BUFF 列表，
     // 然后将之后的回复都添加到列表中
-    if (!dstkey) {
-        replylen = addReplyDeferredLen(c);  // STINER命令创建一个链表
-    } else {
+    if (dstkey) {
         /* If we have a target key where to store the resulting set
          * create this key with an empty set inside */
         dstset = createIntsetObject();  //STINERSTORE命令创建要给整数集合对象
+    } else if (!cardinality_only) {
+        replylen = addReplyDeferredLen(c);  // STINER命令创建一个链表
     }
 
     /* Iterate all the elements of the first (smallest) set, and test
@@ -1184,41 +1425,28 @@ void sinterGenericCommand(client *c, robj **setkeys,
     while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
         for (j = 1; j < setnum; j++) {
             if (sets[j] == sets[0]) continue;
-            // 当前元素为INTSET类型
-            if (encoding == OBJ_ENCODING_INTSET) {
-                /* intset with intset is simple... and fast */
-                //如果在当前intset集合中没有找到该元素则直接跳过当前元素，操作下一个元素
-                if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,intobj))
-                {
-                    break;
-                /* in order to compare an integer with an object we
-                 * have to use the generic function, creating an object
-                 * for this */
-                //在字典中查找
-                } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
-                    //创建字符串对象
-                    elesds = sdsfromlonglong(intobj);
-                    //如果当前元素不是当前集合中的元素，则释放字符串对象跳过for循环体，操作下一个元素
-                    if (!setTypeIsMember(sets[j],elesds)) {
-                        sdsfree(elesds);
-                        break;
-                    }
-                    sdsfree(elesds);
-                }
-                //当前元素为HT字典类型
-            } else if (encoding == OBJ_ENCODING_HT) {
-                if (!setTypeIsMember(sets[j],elesds)) {
-                    break;
-                }
+            if (mergepos && mergepos[j] != -1) {
+                int found = intsetMergeFind(sets[j]->ptr,&mergepos[j],intobj);
+
+                /* Once a cursor reached the end of its intset no other
+                 * element of the smallest set can be in the result. */
+                if (found == -1) exhausted = 1;
+                if (found != 1) break;
+            } else if (!setTypeIsMemberEncoded(sets[j],encoding,elesds,intobj)) {
+                break;
             }
         }
 
         /* Only take action when all sets contain the member */
         //执行到这里，该元素为结果集合中的元素
         if (j == setnum) {
+            if (cardinality_only) {
+                cardinality++;
+                /* We only need to know if the intersection has at least
+                 * 'limit' elements. */
+                if (limit && cardinality >= limit) break;
             //如果是SINTER命令，回复集合
-            if (!dstkey) {
+            } else if (!dstkey) {
                 if (encoding == OBJ_ENCODING_HT)
                     addReplyBulkCBuffer(c,elesds,sdslen(elesds));
                 else
@@ -1226,7 +1454,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
                 cardinality++;
                 //如果是SINTERSTORE命令，先将结果添加到集合中，因为还要store到数据库中
             } else {
-                if (encoding == OBJ_ENCODING_INTSET) {
+                if (setEncodingIsInteger(encoding)) {
                     elesds = sdsfromlonglong(intobj);
                     setTypeAdd(dstset,elesds);
                     sdsfree(elesds);
@@ -1235,9 +1463,12 @@ void sinterGenericCommand(client *c, robj **setkeys,
                 }
             }
         }
+        if (exhausted) break;
     }
     setTypeReleaseIterator(si);//释放迭代器
+    zfree(mergepos);
 
+store:
     // SINTERSTORE命令，要将结果的集合添加到数据库中
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
@@ -1265,6 +1496,8 @@ void sinterGenericCommand(client *c, robj **setkeys,
         // 键被修改，发送信号。更新脏键
         signalModifiedKey(c,c->db,dstkey);
         server.dirty++;
+    } else if (cardinality_only) {
+        addReplyLongLong(c,cardinality);
     } else {
         // SINTER命令，回复结果集合给client
         setDeferredSetLen(c,replylen,cardinality);
@@ -1279,7 +1512,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
  * 返回一个集合的全部成员，该集合是所有给定集合的交集。
  * */
 void sinterCommand(client *c) {
-    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,0,0);
 }
 
 /*
@@ -1288,13 +1521,147 @@ void sinterCommand(client *c) {
  * 这个命令类似于 SINTER key [key …] 命令，但它将结果保存到 destination 集合，而不是简单地返回结果集。
  * */
 void sinterstoreCommand(client *c) {
-    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
+    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1],0,0);
+}
+
+/*
+ * SINTERCARD numkeys key [key …] [LIMIT limit]
+ * 时间复杂度: O(N * M)， N 为给定集合当中基数最小的集合， M 为给定集合的个数。
+ * 返回所有给定集合的交集的基数，不返回交集本身。
+ * 如果指定了 LIMIT，交集的基数达到 limit 时即停止计算。
+ * */
+void sintercardCommand(client *c) {
+    long j;
+    long numkeys = 0; /* Number of keys. */
+    long limit = 0;   /* 0 means no limit. */
+
+    if (getLongFromObjectOrReply(c,c->argv[1],&numkeys,NULL) != C_OK)
+        return;
+    if (numkeys < 1) {
+        addReplyError(c,"numkeys should be greater than 0");
+        return;
+    }
+    if (numkeys > (c->argc - 2)) {
+        addReplyError(c,"Number of keys can't be greater than number of args");
+        return;
+    }
+
+    for (j = 2 + numkeys; j < c->argc; j++) {
+        char *opt = c->argv[j]->ptr;
+        int moreargs = (c->argc - 1) - j;
+
+        if (!strcasecmp(opt,"LIMIT") && moreargs) {
+            j++;
+            if (getLongFromObjectOrReply(c,c->argv[j],&limit,NULL) != C_OK)
+                return;
+            if (limit < 0) {
+                addReplyError(c,"LIMIT can't be negative");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    sinterGenericCommand(c,c->argv+2,numkeys,NULL,1,limit);
 }
 
 #define SET_OP_UNION 0
 #define SET_OP_DIFF 1
 #define SET_OP_INTER 2
 
+/* Add or remove (according to 'op') all the elements of the integer
+ * encoded set 'setobj' to/from the bitmap 'r'. */
+static void bitmapApplySet(roaring *r, robj *setobj, int op) {
+    if (setobj->encoding == OBJ_ENCODING_BITMAP) {
+        if (op == SET_OP_UNION) roaringOr(r,setobj->ptr);
+        else roaringAndNot(r,setobj->ptr);
+    } else {
+        int64_t intele;
+        uint32_t ii = 0;
+
+        while (intsetGet(setobj->ptr,ii++,&intele)) {
+            if (op == SET_OP_UNION) roaringAdd(r,intele);
+            else roaringRemove(r,intele);
+        }
+    }
+}
+
+/* Compute the union or the difference of the specified sets, all of them
+ * integer encoded (NULL sets are considered empty), as a new bitmap.
+ * Bitmaps are merged container by container, which is much faster than
+ * adding or removing one element at a time. */
+static roaring *sunionDiffBitmap(robj **sets, int setnum, int op) {
+    roaring *r = roaringNew();
+
+    for (int j = 0; j < setnum; j++) {
+        if (!sets[j]) continue;
+        if (op == SET_OP_DIFF) {
+            if (j == 0) {
+                bitmapApplySet(r,sets[0],SET_OP_UNION);
+                continue;
+            }
+            if (roaringCard(r) == 0) break;
+        }
+        bitmapApplySet(r,sets[j],op);
+    }
+    return r;
+}
+
+/* Reply to SUNION or SDIFF without materializing the result into a
+ * temporary set, see sunionDiffGenericCommand(). Every element is sent to
+ * the client as soon as we know it belongs to the result: for the union this
+ * is the first time we see it, that is when none of the previous sets
+ * contain it, for the difference when none of the other sets contain it.
+ * NULL sets are considered empty. */
+static void sunionDiffStream(client *c, robj **sets, int setnum, int op) {
+    void *replylen = addReplyDeferredLen(c);
+    unsigned long cardinality = 0;
+    setTypeIterator *si;
+    sds ele;
+    int64_t llele;
+    int encoding, j, k;
+
+    for (j = 0; j < setnum; j++) {
+        if (op == SET_OP_DIFF && j > 0) break;
+        if (!sets[j]) continue;
+
+        /* Nothing to do if the same key was already specified: all its
+         * elements were already sent. */
+        for (k = 0; k < j; k++)
+            if (sets[k] == sets[j]) break;
+        if (k != j) continue;
+
+        si = setTypeInitIterator(sets[j]);
+        while((encoding = setTypeNext(si,&ele,&llele)) != -1) {
+            if (op == SET_OP_UNION) {
+                for (k = 0; k < j; k++) {
+                    if (sets[k] &&
+                        setTypeIsMemberEncoded(sets[k],encoding,ele,llele))
+                        break;
+                }
+                if (k != j) continue;
+            } else {
+                for (k = 1; k < setnum; k++) {
+                    if (!sets[k]) continue; /* no key is an empty set. */
+                    if (sets[k] == sets[0]) break; /* same set! */
+                    if (setTypeIsMemberEncoded(sets[k],encoding,ele,llele))
+                        break;
+                }
+                if (k != setnum) continue;
+            }
+            if (encoding == OBJ_ENCODING_HT)
+                addReplyBulkCBuffer(c,ele,sdslen(ele));
+            else
+                addReplyBulkLongLong(c,llele);
+            cardinality++;
+        }
+        setTypeReleaseIterator(si);
+    }
+    setDeferredSetLen(c,replylen,cardinality);
+}
+
 /*
  * SUNION key [key ...]
  * SUNIONSTORE destination key [key ...]
@@ -1310,7 +1677,7 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
     robj *dstset = NULL;
     sds ele;
     int j, cardinality = 0;
-    int diff_algo = 1;
+    int diff_algo = 1, bitmaps = 0, stream = 0;
 
     // 遍历数组中集合键对象
     for (j = 0; j < setnum; j++) {
@@ -1330,8 +1697,15 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
             return;
         }
         sets[j] = setobj;   //保存到集合数组中
+        if (setobj->encoding == OBJ_ENCODING_BITMAP) bitmaps++;
     }
 
+    /* If at least one of the sets is a bitmap and all the others only hold
+     * integers, the result is computed as a bitmap using whole container
+     * operations. See sunionDiffBitmap(). */
+    for (j = 0; j < setnum && bitmaps; j++)
+        if (sets[j] && !setEncodingIsInteger(sets[j]->encoding)) bitmaps = 0;
+
     /* Select what DIFF algorithm to use.
       *
       * 选择使用那个算法来执行计算
@@ -1381,6 +1755,35 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
             qsort(sets+1,setnum-1,sizeof(robj*),
                 qsortCompareSetsByRevCardinality);
         }
+
+        /* Without a destination key, algorithm 1 can send the elements
+         * to the client while they are found. */
+        if (!dstkey && diff_algo == 1) stream = 1;
+    }
+
+    /* The union is sent to the client without a temporary set when this is
+     * cheaper: every element is then looked up into all the previous sets,
+     * while building the temporary set costs an allocation and an insertion
+     * for every element. Lookups are cheaper, so give streaming some
+     * advantage. Processing the sets from the largest to the smallest
+     * minimizes the number of lookups. */
+    if (op == SET_OP_UNION && !dstkey && !bitmaps) {
+        long long stream_work = 0, temp_work = 0;
+        int previous = 0;
+
+        qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByRevCardinality);
+        for (j = 0; j < setnum; j++) {
+            if (sets[j] == NULL) continue;
+            temp_work += setTypeSize(sets[j]);
+            stream_work += (long long)setTypeSize(sets[j]) * previous++;
+        }
+        stream = (stream_work/2 <= temp_work);
+    }
+
+    if (stream && !bitmaps) {
+        sunionDiffStream(c,sets,setnum,op);
+        zfree(sets);
+        return;
     }
 
     /* We need a temp set object to store our union. If the dstkey
@@ -1390,10 +1793,13 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
     * 使用一个临时集合来保存结果集，如果程序执行的是 SUNIONSTORE 命令，
     * 那么这个结果将会成为将来的集合值对象。
     */
-    dstset = createIntsetObject();
+    if (!bitmaps) dstset = createIntsetObject();
 
+    if (bitmaps) {
+        dstset = setTypeCreateFromBitmap(sunionDiffBitmap(sets,setnum,op));
+        cardinality = setTypeSize(dstset);
     //执行并集操作
-    if (op == SET_OP_UNION) {
+    } else if (op == SET_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         // 仅仅讲每一个集合中的每一个元素加入到结果集中
@@ -41,8 +41,7 @@
 #define STREAM_ITEM_FLAG_SAMEFIELDS (1<<1)  /* Same fields as master entry. */
 
 void streamFreeCG(streamCG *cg);
-void streamFreeNACK(streamNACK *na);
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer);
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer);
 
 /* -----------------------------------------------------------------------
  * Low level stream encoding: a radix tree of listpacks.
@@ -488,6 +487,128 @@ int64_t streamTrimByLength(stream *s, size_t maxlen, int approx) {
     return deleted;
 }
 
+/* Store at 'id' the ID of the last entry, deleted or not, of the listpack
+ * 'lp' of the node with master ID 'master_id'. */
+static void streamNodeLastID(unsigned char *lp, streamID *master_id, streamID *id) {
+    unsigned char *p = lpLast(lp);
+    int64_t lp_count = lpGetInteger(p);
+    while(lp_count--) p = lpPrev(lp,p); /* Seek the flags of the entry. */
+    p = lpNext(lp,p);
+    id->ms = master_id->ms + lpGetInteger(p);
+    p = lpNext(lp,p);
+    id->seq = master_id->seq + lpGetInteger(p);
+}
+
+/* Trim the stream 's' removing the elements with an ID smaller than 'minid',
+ * and return the number of elements removed from the stream. Like for
+ * streamTrimByLength(), if 'approx' is non-zero only whole nodes of the radix
+ * tree are removed, that is, nodes whose last entry is smaller than 'minid',
+ * so the stream may still contain a few elements older than 'minid'.
+ *
+ * When 'approx' is non-zero and 'limit' is non-zero, no more nodes are
+ * removed once 'limit' elements were removed, so that the background
+ * retention cycle can bound the work done on a single stream. */
+int64_t streamTrimByID(stream *s, streamID *minid, int approx, int64_t limit) {
+    if (s->length == 0) return 0;
+
+    raxIterator ri;
+    raxStart(&ri,s->rax);
+    raxSeek(&ri,"^",NULL,0);
+
+    int64_t deleted = 0;
+    while(raxNext(&ri)) {
+        unsigned char *lp = ri.data, *p = lpFirst(lp);
+        int64_t entries = lpGetInteger(p);
+        streamID master_id, last_id;
+
+        /* All the entries of the node are >= the master ID: if the
+         * master ID is already in range there is nothing to trim. */
+        streamDecodeID(ri.key,&master_id);
+        if (streamCompareID(&master_id,minid) >= 0) break;
+
+        /* Remove the whole node if even its last entry is too old. */
+        streamNodeLastID(lp,&master_id,&last_id);
+        if (streamCompareID(&last_id,minid) < 0) {
+            if (approx && limit && deleted >= limit) break;
+            lpFree(lp);
+            raxRemove(s->rax,ri.key,ri.key_len,NULL);
+            raxSeek(&ri,">=",ri.key,ri.key_len);
+            s->length -= entries;
+            deleted += entries;
+            continue;
+        }
+
+        /* If we cannot remove a whole node, and approx is true,
+         * stop here. */
+        if (approx) break;
+
+        /* Otherwise we have to mark as deleted the entries of this node
+         * that are smaller than 'minid', that are all at its head. */
+        p = lpNext(lp,p); /* Seek deleted field. */
+        p = lpNext(lp,p); /* Seek num-of-fields in the master entry. */
+        int64_t master_fields_count = lpGetInteger(p);
+        p = lpNext(lp,p); /* Seek the first field. */
+        for (int64_t j = 0; j < master_fields_count; j++)
+            p = lpNext(lp,p); /* Skip all master fields. */
+        p = lpNext(lp,p); /* Skip the zero master entry terminator. */
+
+        int64_t marked = 0;
+        while(p) {
+            int flags = lpGetInteger(p);
+            int to_skip;
+            streamID id;
+            unsigned char *q = lpNext(lp,p);
+            id.ms = master_id.ms + lpGetInteger(q);
+            q = lpNext(lp,q);
+            id.seq = master_id.seq + lpGetInteger(q);
+            if (streamCompareID(&id,minid) >= 0) break;
+
+            /* Mark the entry as deleted. */
+            if (!(flags & STREAM_ITEM_FLAG_DELETED)) {
+                flags |= STREAM_ITEM_FLAG_DELETED;
+                lp = lpReplaceInteger(lp,&p,flags);
+                marked++;
+            }
+
+            p = lpNext(lp,p); /* Skip ID ms delta. */
+            p = lpNext(lp,p); /* Skip ID seq delta. */
+            p = lpNext(lp,p); /* Seek num-fields or values (if compressed). */
+            if (flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+                to_skip = master_fields_count;
+            } else {
+                to_skip = lpGetInteger(p);
+                to_skip = 1+(to_skip*2);
+            }
+
+            while(to_skip--) p = lpNext(lp,p); /* Skip the whole entry. */
+            p = lpNext(lp,p); /* Skip the final lp-count field. */
+        }
+
+        if (marked) {
+            s->length -= marked;
+            deleted += marked;
+            if (entries == marked) {
+                /* No valid entries left in the node. */
+                lpFree(lp);
+                raxRemove(s->rax,ri.key,ri.key_len,NULL);
+            } else {
+                /* Update the entries/deleted counters. */
+                p = lpFirst(lp);
+                lp = lpReplaceInteger(lp,&p,entries-marked);
+                p = lpNext(lp,p); /* Seek deleted field. */
+                int64_t marked_deleted = lpGetInteger(p);
+                lp = lpReplaceInteger(lp,&p,marked_deleted+marked);
+                /* Update the listpack with the new pointer. */
+                raxInsert(s->rax,ri.key,ri.key_len,lp,NULL);
+            }
+        }
+        break; /* The following nodes are all in range. */
+    }
+
+    raxStop(&ri);
+    return deleted;
+}
+
 /* Initialize the stream iterator, so that we can call iterating functions
  * to get the next items. This requires a corresponding streamIteratorStop()
  * at the end. The 'rev' parameter controls the direction. If it's zero the
@@ -549,6 +670,9 @@ void streamIteratorStart(streamIterator *si, stream *s, streamID *start, streamI
     si->lp = NULL; /* There is no current listpack right now. */
     si->lp_ele = NULL; /* Current listpack cursor. */
     si->rev = rev;  /* Direction, if non-zero reversed, from end to start. */
+    si->master_fields_reply = NULL;
+    si->master_fields_offsets = NULL;
+    si->master_fields_cached = 0;
 }
 
 /* Return 1 and store the current item ID at 'id' if there are still
@@ -573,6 +697,7 @@ int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields) {
             si->master_fields_count = lpGetInteger(si->lp_ele);
             si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek first field. */
             si->master_fields_start = si->lp_ele;
+            si->master_fields_cached = 0;
             /* We are now pointing to the first field of the master entry.
              * We need to seek either the first or the last entry depending
              * on the direction of the iteration. */
@@ -711,6 +836,104 @@ void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsign
     si->lp_ele = lpNext(si->lp,si->lp_ele);
 }
 
+/* Append to 'reply' the listpack element 'ele' as a RESP bulk string. Elements
+ * stored as strings are copied straight from the listpack. */
+static sds streamCatBulkElement(sds reply, unsigned char *ele) {
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int64_t len;
+    unsigned char *p = lpGet(ele,&len,intbuf);
+    char lenstr[LONG_STR_SIZE];
+    int lenlen = ll2string(lenstr,sizeof(lenstr),len);
+
+    reply = sdsMakeRoomFor(reply,lenlen+len+5);
+    char *dst = reply+sdslen(reply);
+    *dst++ = '$';
+    memcpy(dst,lenstr,lenlen); dst += lenlen;
+    *dst++ = '\r'; *dst++ = '\n';
+    memcpy(dst,p,len); dst += len;
+    *dst++ = '\r'; *dst++ = '\n';
+    sdsIncrLen(reply,dst-(reply+sdslen(reply)));
+    return reply;
+}
+
+/* Encode the master entry fields of the current listpack as RESP bulk
+ * strings, remembering where every field starts. This is done once per
+ * listpack node, then all the entries flagged SAMEFIELDS just copy the
+ * already encoded field names. */
+static void streamIteratorCacheMasterFields(streamIterator *si) {
+    if (si->master_fields_reply == NULL)
+        si->master_fields_reply = sdsempty();
+    else
+        sdsclear(si->master_fields_reply);
+    si->master_fields_offsets = zrealloc(si->master_fields_offsets,
+        sizeof(uint32_t)*(si->master_fields_count+1));
+
+    unsigned char *ele = si->master_fields_start;
+    for (uint64_t i = 0; i < si->master_fields_count; i++) {
+        si->master_fields_offsets[i] = sdslen(si->master_fields_reply);
+        si->master_fields_reply =
+            streamCatBulkElement(si->master_fields_reply,ele);
+        ele = lpNext(si->lp,ele);
+    }
+    si->master_fields_offsets[si->master_fields_count] =
+        sdslen(si->master_fields_reply);
+    si->master_fields_cached = 1;
+}
+
+/* Append to 'reply' the RESP encoding of the entry the iterator is
+ * positioned at, that is, a two elements array with the ID and the array
+ * of field-value pairs, exactly like the streamIteratorGetField() loop
+ * in streamReplyWithRange() used to emit them one by one. Must be called
+ * instead of streamIteratorGetField() after streamIteratorGetID(), passing
+ * the returned ID and number of fields. The function returns the
+ * (possibly reallocated) reply. */
+sds streamAppendEntryReply(sds reply, streamIterator *si, streamID *id, int64_t numfields) {
+    char idstr[LONG_STR_SIZE*2];
+    int idlen = ull2string(idstr,sizeof(idstr),id->ms);
+    idstr[idlen++] = '-';
+    idlen += ull2string(idstr+idlen,sizeof(idstr)-idlen,id->seq);
+    reply = sdscatfmt(reply,"*2\r\n$%i\r\n",idlen);
+    reply = sdscatlen(reply,idstr,idlen);
+    reply = sdscatfmt(reply,"\r\n*%I\r\n",numfields*2);
+
+    if (si->entry_flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+        if (!si->master_fields_cached) streamIteratorCacheMasterFields(si);
+        for (int64_t i = 0; i < numfields; i++) {
+            uint32_t off = si->master_fields_offsets[i];
+            reply = sdscatlen(reply,si->master_fields_reply+off,
+                              si->master_fields_offsets[i+1]-off);
+            reply = streamCatBulkElement(reply,si->lp_ele);
+            si->lp_ele = lpNext(si->lp,si->lp_ele);
+        }
+    } else {
+        for (int64_t i = 0; i < numfields*2; i++) {
+            reply = streamCatBulkElement(reply,si->lp_ele);
+            si->lp_ele = lpNext(si->lp,si->lp_ele);
+        }
+    }
+    return reply;
+}
+
+/* Render the entries in the specified range as RESP into '*reply', without
+ * the array length, that is returned by the function. This is useful when
+ * the same range must be sent to many clients: it is encoded just once
+ * and then copied in the output buffer of every client. */
+size_t streamRenderRange(stream *s, streamID *start, streamID *end, size_t count, sds *reply) {
+    streamIterator si;
+    streamID id;
+    int64_t numfields;
+    size_t emitted = 0;
+
+    streamIteratorStart(&si,s,start,end,0);
+    while(streamIteratorGetID(&si,&id,&numfields)) {
+        *reply = streamAppendEntryReply(*reply,&si,&id,numfields);
+        emitted++;
+        if (count && count == emitted) break;
+    }
+    streamIteratorStop(&si);
+    return emitted;
+}
+
 /* Remove the current entry from the stream: can be called after the
  * GetID() API or after any GetField() call, however we need to iterate
  * a valid entry while calling this function. Moreover the function
@@ -779,6 +1002,11 @@ void streamIteratorRemoveEntry(streamIterator *si, streamID *current) {
  * allocated. */
 void streamIteratorStop(streamIterator *si) {
     raxStop(&si->ri);
+    sdsfree(si->master_fields_reply);
+    zfree(si->master_fields_offsets);
+    si->master_fields_reply = NULL;
+    si->master_fields_offsets = NULL;
+    si->master_fields_cached = 0;
 }
 
 /* Delete the specified item ID from the stream, returning 1 if the item
@@ -955,11 +1183,14 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
      * as delivered. */
     if (group && (flags & STREAM_RWR_HISTORY)) {
         return streamReplyWithRangeFromConsumerPEL(c,s,start,end,count,
-                                                   consumer);
+                                                   group,consumer);
     }
 
     if (!(flags & STREAM_RWR_RAWENTRIES))
         arraylen_ptr = addReplyDeferredLen(c);
+    /* Entries are encoded straight from the listpacks into a local buffer,
+     * that is copied into the client output buffer in chunks. */
+    sds proto = sdsempty();
     streamIteratorStart(&si,s,start,end,rev);
     while(streamIteratorGetID(&si,&id,&numfields)) {
         /* Update the group last_id if needed. */
@@ -973,18 +1204,10 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
 
         /* Emit a two elements array for each item. The first is
          * the ID, the second is an array of field-value pairs. */
-        addReplyArrayLen(c,2);
-        addReplyStreamID(c,&id);
-
-        addReplyArrayLen(c,numfields*2);
-
-        /* Emit the field-value pairs. */
-        while(numfields--) {
-            unsigned char *key, *value;
-            int64_t key_len, value_len;
-            streamIteratorGetField(&si,&key,&value,&key_len,&value_len);
-            addReplyBulkCBuffer(c,key,key_len);
-            addReplyBulkCBuffer(c,value,value_len);
+        proto = streamAppendEntryReply(proto,&si,&id,numfields);
+        if (sdslen(proto) >= PROTO_REPLY_CHUNK_BYTES) {
+            addReplyProto(c,proto,sdslen(proto));
+            sdsclear(proto);
         }
 
         /* If a group is passed, we need to create an entry in the
@@ -997,35 +1220,28 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
          * a NACK for the entry, we need to associate it to the new
          * consumer. */
         if (group && !noack) {
-            unsigned char buf[sizeof(streamID)];
-            streamEncodeID(buf,&id);
-
             /* Try to add a new NACK. Most of the time this will work and
              * will not require extra lookups. We'll fix the problem later
              * if we find that there is already a entry for this ID. */
-            streamNACK *nack = streamCreateNACK(consumer);
-            int group_inserted =
-                raxTryInsert(group->pel,buf,sizeof(buf),nack,NULL);
-            int consumer_inserted =
-                raxTryInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
+            streamNACK *nack = streamCreateNACK(group,&id,consumer);
+            int consumer_inserted;
 
             /* Now we can check if the entry was already busy, and
              * in that case reassign the entry to the new consumer,
              * or update it if the consumer is the same as before. */
-            if (group_inserted == 0) {
-                streamFreeNACK(nack);
-                nack = raxFind(group->pel,buf,sizeof(buf));
-                serverAssert(nack != raxNotFound);
-                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
+            if (nack == NULL) {
+                nack = streamPELFind(group->pel,&id);
+                serverAssert(nack != NULL);
+                streamPELRemove(nack->consumer->pel,&id);
                 /* Update the consumer and NACK metadata. */
                 nack->consumer = consumer;
                 nack->delivery_time = mstime();
                 nack->delivery_count = 1;
-                /* Add the entry in the new consumer local PEL. */
-                raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
-            } else if (group_inserted == 1 && consumer_inserted == 0) {
-                serverPanic("NACK half-created. Should not be possible.");
             }
+            /* Add the entry in the new consumer local PEL. */
+            streamPELAdd(consumer->pel,&id,&consumer_inserted);
+            if (consumer_inserted == 0)
+                serverPanic("NACK half-created. Should not be possible.");
 
             /* Propagate as XCLAIM. */
             if (spi) {
@@ -1043,6 +1259,8 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
         streamPropagateGroupID(c,spi->keyname,group,spi->groupname);
 
     streamIteratorStop(&si);
+    if (sdslen(proto)) addReplyProto(c,proto,sdslen(proto));
+    sdsfree(proto);
     if (arraylen_ptr) setDeferredArrayLen(c,arraylen_ptr,arraylen);
     return arraylen;
 }
@@ -1060,21 +1278,18 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
  * seek into the radix tree of the messages in order to emit the full message
  * to the client. However clients only reach this code path when they are
  * fetching the history of already retrieved messages, which is rare. */
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer) {
-    raxIterator ri;
-    unsigned char startkey[sizeof(streamID)];
-    unsigned char endkey[sizeof(streamID)];
-    streamEncodeID(startkey,start);
-    if (end) streamEncodeID(endkey,end);
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer) {
+    streamPELIterator it;
+    streamID *pelid;
 
     size_t arraylen = 0;
     void *arraylen_ptr = addReplyDeferredLen(c);
-    raxStart(&ri,consumer->pel);
-    raxSeek(&ri,">=",startkey,sizeof(startkey));
-    while(raxNext(&ri) && (!count || arraylen < count)) {
-        if (end && memcmp(ri.key,end,ri.key_len) > 0) break;
-        streamID thisid;
-        streamDecodeID(ri.key,&thisid);
+    streamPELIteratorStart(&it,consumer->pel,start);
+    while((!count || arraylen < count) &&
+          (pelid = streamPELIteratorNext(&it)) != NULL)
+    {
+        if (end && streamCompareID(pelid,end) > 0) break;
+        streamID thisid = *pelid;
         if (streamReplyWithRange(c,s,&thisid,&thisid,1,0,NULL,NULL,
                                  STREAM_RWR_RAWENTRIES,NULL) == 0)
         {
@@ -1086,13 +1301,13 @@ size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start
             addReplyStreamID(c,&thisid);
             addReplyNullArray(c);
         } else {
-            streamNACK *nack = ri.data;
+            streamNACK *nack = streamPELFind(group->pel,&thisid);
             nack->delivery_time = mstime();
             nack->delivery_count++;
         }
         arraylen++;
     }
-    raxStop(&ri);
+    streamPELIteratorStop(&it);
     setDeferredArrayLen(c,arraylen_ptr,arraylen);
     return arraylen;
 }
@@ -1178,57 +1393,120 @@ int streamParseStrictIDOrReply(client *c, robj *o, streamID *id, uint64_t missin
     return streamGenericParseIDOrReply(c,o,id,missing_seq,1);
 }
 
-/* We propagate MAXLEN ~ <count> as MAXLEN = <resulting-len-of-stream>
- * otherwise trimming is no longer determinsitic on replicas / AOF. */
-void streamRewriteApproxMaxlen(client *c, stream *s, int maxlen_arg_idx) {
+/* We propagate MAXLEN ~ <count> and MINID ~ <id> as
+ * MAXLEN = <resulting-len-of-stream> otherwise trimming is no longer
+ * determinsitic on replicas / AOF: the nodes layout may be different.
+ * 'arg_idx' is the index of the count or ID, preceded by "~". */
+void streamRewriteApproxTrim(client *c, stream *s, int arg_idx) {
     robj *maxlen_obj = createStringObjectFromLongLong(s->length);
     robj *equal_obj = createStringObject("=",1);
+    robj *option_obj = createStringObject("MAXLEN",6);
 
-    rewriteClientCommandArgument(c,maxlen_arg_idx,maxlen_obj);
-    rewriteClientCommandArgument(c,maxlen_arg_idx-1,equal_obj);
+    rewriteClientCommandArgument(c,arg_idx,maxlen_obj);
+    rewriteClientCommandArgument(c,arg_idx-1,equal_obj);
+    rewriteClientCommandArgument(c,arg_idx-2,option_obj);
 
+    decrRefCount(option_obj);
     decrRefCount(equal_obj);
     decrRefCount(maxlen_obj);
 }
 
-/* XADD key [MAXLEN [~|=] <count>] <ID or *> [field value] [field value] ... */
+/* Trimming options of XADD and XTRIM. */
+#define TRIM_STRATEGY_NONE 0
+#define TRIM_STRATEGY_MAXLEN 1
+#define TRIM_STRATEGY_MINID 2
+typedef struct streamTrimArgs {
+    int strategy;           /* TRIM_STRATEGY_* */
+    int approx;             /* If 1 only delete whole radix tree nodes, so
+                               the threshold is not applied verbatim. */
+    long long maxlen;       /* MAXLEN count. */
+    streamID minid;         /* MINID ID. */
+    int arg_idx;            /* Index of the count or ID, for rewriting. */
+} streamTrimArgs;
+
+/* Parse the option at c->argv[*i] if it is one of:
+ *
+ *  MAXLEN [~|=] <count>
+ *  MINID [~|=] <id>
+ *
+ * Returns 1 if the option was parsed, updating *i to the index of its last
+ * argument, 0 if c->argv[*i] is not a trimming option, and -1 if an error
+ * was sent to the client. */
+int streamParseTrimArgsOrReply(client *c, int *i, streamTrimArgs *args) {
+    int moreargs = (c->argc-1) - *i; /* Number of additional arguments. */
+    char *opt = c->argv[*i]->ptr;
+    int strategy;
+
+    if (!strcasecmp(opt,"maxlen") && moreargs) {
+        strategy = TRIM_STRATEGY_MAXLEN;
+    } else if (!strcasecmp(opt,"minid") && moreargs) {
+        strategy = TRIM_STRATEGY_MINID;
+    } else {
+        return 0;
+    }
+    if (args->strategy != TRIM_STRATEGY_NONE &&
+        args->strategy != strategy)
+    {
+        addReplyError(c,"syntax error, MAXLEN and MINID options at the same "
+                        "time are not compatible");
+        return -1;
+    }
+    args->strategy = strategy;
+    args->approx = 0;
+
+    char *next = c->argv[*i+1]->ptr;
+    /* Check for the form MAXLEN ~ <count>. */
+    if (moreargs >= 2 && next[0] == '~' && next[1] == '\0') {
+        args->approx = 1;
+        (*i)++;
+    } else if (moreargs >= 2 && next[0] == '=' && next[1] == '\0') {
+        (*i)++;
+    }
+    (*i)++;
+    args->arg_idx = *i;
+
+    if (strategy == TRIM_STRATEGY_MAXLEN) {
+        if (getLongLongFromObjectOrReply(c,c->argv[*i],&args->maxlen,NULL)
+            != C_OK) return -1;
+        if (args->maxlen < 0) {
+            addReplyError(c,"The MAXLEN argument must be >= 0.");
+            return -1;
+        }
+    } else {
+        if (streamParseStrictIDOrReply(c,c->argv[*i],&args->minid,0) != C_OK)
+            return -1;
+    }
+    return 1;
+}
+
+/* Trim the stream according to the parsed options, returning the number
+ * of entries removed. */
+int64_t streamTrim(stream *s, streamTrimArgs *args) {
+    if (args->strategy == TRIM_STRATEGY_MAXLEN)
+        return streamTrimByLength(s,args->maxlen,args->approx);
+    else if (args->strategy == TRIM_STRATEGY_MINID)
+        return streamTrimByID(s,&args->minid,args->approx,0);
+    return 0;
+}
+
+/* XADD key [MAXLEN|MINID [~|=] <count|id>] <ID or *> [field value] ... */
 void xaddCommand(client *c) {
     streamID id;
     int id_given = 0; /* Was an ID different than "*" specified? */
-    long long maxlen = -1;  /* If left to -1 no trimming is performed. */
-    int approx_maxlen = 0;  /* If 1 only delete whole radix tree nodes, so
-                               the maximum length is not applied verbatim. */
-    int maxlen_arg_idx = 0; /* Index of the count in MAXLEN, for rewriting. */
+    streamTrimArgs trim = {TRIM_STRATEGY_NONE}; /* No trimming by default. */
 
     /* Parse options. */
     int i = 2; /* This is the first argument position where we could
                   find an option, or the ID. */
     for (; i < c->argc; i++) {
-        int moreargs = (c->argc-1) - i; /* Number of additional arguments. */
         char *opt = c->argv[i]->ptr;
+        int parsed;
         if (opt[0] == '*' && opt[1] == '\0') {
             /* This is just a fast path for the common case of auto-ID
              * creation. */
             break;
-        } else if (!strcasecmp(opt,"maxlen") && moreargs) {
-            approx_maxlen = 0;
-            char *next = c->argv[i+1]->ptr;
-            /* Check for the form MAXLEN ~ <count>. */
-            if (moreargs >= 2 && next[0] == '~' && next[1] == '\0') {
-                approx_maxlen = 1;
-                i++;
-            } else if (moreargs >= 2 && next[0] == '=' && next[1] == '\0') {
-                i++;
-            }
-            if (getLongLongFromObjectOrReply(c,c->argv[i+1],&maxlen,NULL)
-                != C_OK) return;
-
-            if (maxlen < 0) {
-                addReplyError(c,"The MAXLEN argument must be >= 0.");
-                return;
-            }
-            i++;
-            maxlen_arg_idx = i;
+        } else if ((parsed = streamParseTrimArgsOrReply(c,&i,&trim)) != 0) {
+            if (parsed == -1) return;
         } else {
             /* If we are here is a syntax error or a valid ID. */
             if (streamParseStrictIDOrReply(c,c->argv[i],&id,0) != C_OK) return;
@@ -1280,12 +1558,12 @@ void xaddCommand(client *c) {
     notifyKeyspaceEvent(NOTIFY_STREAM,"xadd",c->argv[1],c->db->id);
     server.dirty++;
 
-    if (maxlen >= 0) {
+    if (trim.strategy != TRIM_STRATEGY_NONE) {
         /* Notify xtrim event if needed. */
-        if (streamTrimByLength(s,maxlen,approx_maxlen)) {
+        if (streamTrim(s,&trim)) {
             notifyKeyspaceEvent(NOTIFY_STREAM,"xtrim",c->argv[1],c->db->id);
         }
-        if (approx_maxlen) streamRewriteApproxMaxlen(c,s,maxlen_arg_idx);
+        if (trim.approx) streamRewriteApproxTrim(c,s,trim.arg_idx);
     }
 
     /* Let's rewrite the ID argument with the one actually generated for
@@ -1458,6 +1736,8 @@ void xreadCommand(client *c) {
          * starting from now. */
         int id_idx = i - streams_arg - streams_count;
         robj *key = c->argv[i-streams_count];
+        /* Reading with a group modifies the consumer group state. */
+        if (groupname) rdbForklessKeyWrite(c->db,key);
         robj *o = lookupKeyRead(c->db,key);
         if (o && checkType(c,o,OBJ_STREAM)) goto cleanup;
         streamCG *group = NULL;
@@ -1638,34 +1918,376 @@ cleanup: /* Cleanup. */
     zfree(groups);
 }
 
+/* -----------------------------------------------------------------------
+ * Pending entries lists
+ * ----------------------------------------------------------------------- */
+
+#define streamPELEntry(pel,b,i) ((void*)((b)->entries+(size_t)(i)*(pel)->esize))
+#define streamPELEntryID(pel,b,i) ((streamID*)streamPELEntry(pel,b,i))
+
+/* Create an empty PEL storing entries of 'esize' bytes. */
+streamPEL *streamPELNew(size_t esize) {
+    streamPEL *pel = zmalloc(sizeof(*pel));
+    pel->blocks = raxNew();
+    pel->size = 0;
+    pel->alloc = 0;
+    pel->esize = esize;
+    return pel;
+}
+
+void streamPELFree(streamPEL *pel) {
+    raxFreeWithCallback(pel->blocks,zfree);
+    zfree(pel);
+}
+
+/* Create a block for 'alloc' entries, indexed by the radix tree only when
+ * its first entry is set, see streamPELIndexBlock(). */
+static streamPELBlock *streamPELCreateBlock(streamPEL *pel, uint32_t alloc) {
+    streamPELBlock *b = zmalloc(sizeof(*b)+(size_t)alloc*pel->esize);
+    b->len = 0;
+    b->alloc = alloc;
+    pel->alloc += alloc;
+    return b;
+}
+
+static void streamPELIndexBlock(streamPEL *pel, streamPELBlock *b) {
+    unsigned char key[sizeof(streamID)];
+    streamEncodeID(key,streamPELEntryID(pel,b,0));
+    raxInsert(pel->blocks,key,sizeof(key),b,NULL);
+}
+
+static void streamPELUnindexBlock(streamPEL *pel, streamID *first) {
+    unsigned char key[sizeof(streamID)];
+    streamEncodeID(key,first);
+    serverAssert(raxRemove(pel->blocks,key,sizeof(key),NULL));
+}
+
+/* Resize the block, that is indexed by its first entry, so that it can
+ * hold 'alloc' entries. Returns the new block pointer. */
+static streamPELBlock *streamPELResizeBlock(streamPEL *pel, streamPELBlock *b, uint32_t alloc) {
+    pel->alloc += alloc;
+    pel->alloc -= b->alloc;
+    b = zrealloc(b,sizeof(*b)+(size_t)alloc*pel->esize);
+    b->alloc = alloc;
+    streamPELIndexBlock(pel,b); /* Update the pointer in the radix tree. */
+    return b;
+}
+
+/* Return the block that should contain 'id', that is the last block having
+ * a first entry <= 'id', or NULL if 'id' is smaller than every entry. If
+ * 'next' is not NULL, it is set to the first ID of the following block,
+ * and 'hasnext' to zero if there is no following block. */
+static streamPELBlock *streamPELLookupBlock(streamPEL *pel, streamID *id, streamID *next, int *hasnext) {
+    unsigned char key[sizeof(streamID)];
+    streamPELBlock *b = NULL;
+    raxIterator ri;
+
+    streamEncodeID(key,id);
+    raxStart(&ri,pel->blocks);
+    raxSeek(&ri,"<=",key,sizeof(key));
+    if (raxNext(&ri)) {
+        b = ri.data;
+        if (next) {
+            *hasnext = raxNext(&ri);
+            if (*hasnext) streamDecodeID(ri.key,next);
+        }
+    }
+    raxStop(&ri);
+    return b;
+}
+
+/* Return the position of the first entry of the block that is >= 'id',
+ * setting 'found' to 1 if it is equal to 'id'. */
+static uint32_t streamPELBlockSearch(streamPEL *pel, streamPELBlock *b, streamID *id, int *found) {
+    uint32_t lo = 0, hi = b->len;
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (streamCompareID(streamPELEntryID(pel,b,mid),id) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    *found = lo < b->len && streamCompareID(streamPELEntryID(pel,b,lo),id) == 0;
+    return lo;
+}
+
+/* Return the entry with the specified ID, or NULL if not found. */
+void *streamPELFind(streamPEL *pel, streamID *id) {
+    streamPELBlock *b = streamPELLookupBlock(pel,id,NULL,NULL);
+    int found;
+    if (b == NULL) return NULL;
+    uint32_t pos = streamPELBlockSearch(pel,b,id,&found);
+    return found ? streamPELEntry(pel,b,pos) : NULL;
+}
+
+/* Return the entry with the specified ID, adding it if it does not exist
+ * yet. New entries have their ID set and all the other bytes zeroed, and
+ * 'added' is set to 1 in that case, to 0 otherwise.
+ *
+ * Since IDs are mostly added in increasing order, a new ID past the end
+ * of a full block goes in a new block instead of splitting it, so blocks
+ * stay full. */
+void *streamPELAdd(streamPEL *pel, streamID *id, int *added) {
+    streamPELBlock *b = streamPELLookupBlock(pel,id,NULL,NULL);
+    uint32_t pos = 0;
+    int found, rekey = 0;
+
+    *added = 0;
+    if (b == NULL) {
+        /* Smaller than every entry: add it to the first block. */
+        raxIterator ri;
+        raxStart(&ri,pel->blocks);
+        raxSeek(&ri,"^",NULL,0);
+        if (raxNext(&ri)) b = ri.data;
+        raxStop(&ri);
+        rekey = 1;
+    } else {
+        pos = streamPELBlockSearch(pel,b,id,&found);
+        if (found) return streamPELEntry(pel,b,pos);
+    }
+
+    if (b == NULL ||
+        (b->len == STREAM_PEL_BLOCK_ENTRIES && (pos == 0 || pos == b->len)))
+    {
+        /* New block at the head or after a full block. */
+        b = streamPELCreateBlock(pel,4);
+        pos = 0;
+        rekey = 0;
+    } else if (b->len == STREAM_PEL_BLOCK_ENTRIES) {
+        /* Split the block in two halves. Since the ID is not the first,
+         * the block it goes into keeps its first entry. */
+        uint32_t half = b->len/2;
+        streamPELBlock *nb = streamPELCreateBlock(pel,STREAM_PEL_BLOCK_ENTRIES);
+        memcpy(nb->entries,streamPELEntry(pel,b,half),
+               (size_t)(b->len-half)*pel->esize);
+        nb->len = b->len-half;
+        b->len = half;
+        streamPELIndexBlock(pel,nb);
+        if (pos > half) {
+            b = nb;
+            pos -= half;
+        }
+    } else if (rekey) {
+        /* The block will have a new first entry. */
+        streamPELUnindexBlock(pel,streamPELEntryID(pel,b,0));
+    }
+
+    if (b->len == b->alloc) {
+        uint32_t alloc = b->alloc*2;
+        if (alloc > STREAM_PEL_BLOCK_ENTRIES) alloc = STREAM_PEL_BLOCK_ENTRIES;
+        if (b->len && !rekey) {
+            b = streamPELResizeBlock(pel,b,alloc);
+        } else {
+            pel->alloc += alloc;
+            pel->alloc -= b->alloc;
+            b = zrealloc(b,sizeof(*b)+(size_t)alloc*pel->esize);
+            b->alloc = alloc;
+        }
+    }
+    memmove(streamPELEntry(pel,b,pos+1),streamPELEntry(pel,b,pos),
+            (size_t)(b->len-pos)*pel->esize);
+    memset(streamPELEntry(pel,b,pos),0,pel->esize);
+    *streamPELEntryID(pel,b,pos) = *id;
+    b->len++;
+    if (pos == 0) streamPELIndexBlock(pel,b);
+    pel->size++;
+    *added = 1;
+    return streamPELEntry(pel,b,pos);
+}
+
+/* Called after entries were removed from the block 'b', that was indexed
+ * with the ID 'first': free the block if empty, otherwise reindex it if its
+ * first entry changed, shrink it, and merge the next block into it if both
+ * are less than half full. */
+static void streamPELBlockUpdated(streamPEL *pel, streamPELBlock *b, streamID *first) {
+    if (b->len == 0) {
+        streamPELUnindexBlock(pel,first);
+        pel->alloc -= b->alloc;
+        zfree(b);
+        return;
+    }
+    if (streamCompareID(first,streamPELEntryID(pel,b,0)) != 0) {
+        streamPELUnindexBlock(pel,first);
+        streamPELIndexBlock(pel,b);
+    }
+
+    streamID lastid = *streamPELEntryID(pel,b,b->len-1), nextid;
+    int hasnext;
+    streamPELLookupBlock(pel,&lastid,&nextid,&hasnext);
+    if (hasnext) {
+        streamPELBlock *next = streamPELLookupBlock(pel,&nextid,NULL,NULL);
+        if (b->len+next->len <= STREAM_PEL_BLOCK_ENTRIES/2) {
+            if (b->alloc < b->len+next->len)
+                b = streamPELResizeBlock(pel,b,STREAM_PEL_BLOCK_ENTRIES/2);
+            memcpy(streamPELEntry(pel,b,b->len),next->entries,
+                   (size_t)next->len*pel->esize);
+            b->len += next->len;
+            streamPELUnindexBlock(pel,&nextid);
+            pel->alloc -= next->alloc;
+            zfree(next);
+            return;
+        }
+    }
+    if (b->alloc > 4 && b->len <= b->alloc/4)
+        streamPELResizeBlock(pel,b,b->alloc/2);
+}
+
+/* Remove the entries having the specified IDs, that must be sorted in
+ * ascending order, calling 'removed' (if not NULL) for every entry found
+ * before it is removed. Every block is updated once, however many of its
+ * entries are removed. Returns the number of entries removed. */
+uint64_t streamPELRemoveMany(streamPEL *pel, streamID *ids, size_t count, void (*removed)(void *entry, void *privdata), void *privdata) {
+    uint64_t deleted = 0;
+    size_t i = 0;
+
+    while (i < count) {
+        streamID first, nextid;
+        int hasnext;
+        streamPELBlock *b = streamPELLookupBlock(pel,ids+i,&nextid,&hasnext);
+
+        if (b == NULL) {
+            /* Skip the IDs smaller than every entry. */
+            void *head = streamPELFirst(pel);
+            if (head == NULL) break;
+            while (i < count && streamCompareID(ids+i,head) < 0) i++;
+            continue;
+        }
+
+        /* Compact the block, skipping the entries to remove. */
+        uint32_t r, w = 0;
+        first = *streamPELEntryID(pel,b,0);
+        for (r = 0; r < b->len; r++) {
+            streamID *eid = streamPELEntryID(pel,b,r);
+            while (i < count && streamCompareID(ids+i,eid) < 0) i++;
+            if (i < count && streamCompareID(ids+i,eid) == 0) {
+                if (removed) removed(streamPELEntry(pel,b,r),privdata);
+                deleted++;
+                i++;
+                continue;
+            }
+            if (w != r)
+                memcpy(streamPELEntry(pel,b,w),eid,pel->esize);
+            w++;
+            if (i == count) break;
+        }
+        if (r < b->len && w != r+1) {
+            memmove(streamPELEntry(pel,b,w),streamPELEntry(pel,b,r+1),
+                    (size_t)(b->len-r-1)*pel->esize);
+        }
+        if (r < b->len) w += b->len-r-1;
+        pel->size -= b->len-w;
+        if (w != b->len) {
+            b->len = w;
+            streamPELBlockUpdated(pel,b,&first);
+        }
+
+        /* The IDs up to the next block are not in the PEL. */
+        while (i < count && (!hasnext || streamCompareID(ids+i,&nextid) < 0))
+            i++;
+    }
+    return deleted;
+}
+
+/* Remove the entry with the specified ID. Returns 1 if it was found. */
+int streamPELRemove(streamPEL *pel, streamID *id) {
+    return streamPELRemoveMany(pel,id,1,NULL,NULL) == 1;
+}
+
+/* Return the entry with the smallest ID, or NULL if the PEL is empty. */
+void *streamPELFirst(streamPEL *pel) {
+    streamPELBlock *b = NULL;
+    raxIterator ri;
+    raxStart(&ri,pel->blocks);
+    raxSeek(&ri,"^",NULL,0);
+    if (raxNext(&ri)) b = ri.data;
+    raxStop(&ri);
+    return b ? streamPELEntry(pel,b,0) : NULL;
+}
+
+/* Return the entry with the greatest ID, or NULL if the PEL is empty. */
+void *streamPELLast(streamPEL *pel) {
+    streamPELBlock *b = NULL;
+    raxIterator ri;
+    raxStart(&ri,pel->blocks);
+    raxSeek(&ri,"$",NULL,0);
+    if (raxNext(&ri)) b = ri.data;
+    raxStop(&ri);
+    return b ? streamPELEntry(pel,b,b->len-1) : NULL;
+}
+
+/* Start iterating the PEL from the first entry >= 'start', or from the
+ * first entry if 'start' is NULL. */
+void streamPELIteratorStart(streamPELIterator *it, streamPEL *pel, streamID *start) {
+    it->pel = pel;
+    it->block = NULL;
+    it->pos = 0;
+    raxStart(&it->ri,pel->blocks);
+    if (start) {
+        unsigned char key[sizeof(streamID)];
+        streamEncodeID(key,start);
+        raxSeek(&it->ri,"<=",key,sizeof(key));
+        if (raxNext(&it->ri)) {
+            int found;
+            it->block = it->ri.data;
+            it->pos = streamPELBlockSearch(pel,it->block,start,&found);
+            return;
+        }
+    }
+    raxSeek(&it->ri,"^",NULL,0);
+    if (raxNext(&it->ri)) it->block = it->ri.data;
+}
+
+/* Return the next entry, or NULL when there are no more entries. */
+void *streamPELIteratorNext(streamPELIterator *it) {
+    if (it->block == NULL) return NULL;
+    if (it->pos == it->block->len) {
+        if (!raxNext(&it->ri)) {
+            it->block = NULL;
+            return NULL;
+        }
+        it->block = it->ri.data;
+        it->pos = 0;
+    }
+    return streamPELEntry(it->pel,it->block,it->pos++);
+}
+
+void streamPELIteratorStop(streamPELIterator *it) {
+    raxStop(&it->ri);
+}
+
+/* Memory used by the PEL, the radix tree size is estimated. */
+size_t streamPELMemoryUsage(streamPEL *pel) {
+    return sizeof(*pel)+streamRadixTreeMemoryUsage(pel->blocks)+
+           raxSize(pel->blocks)*sizeof(streamPELBlock)+
+           pel->alloc*pel->esize;
+}
+
 /* -----------------------------------------------------------------------
  * Low level implementation of consumer groups
  * ----------------------------------------------------------------------- */
 
-/* Create a NACK entry setting the delivery count to 1 and the delivery
- * time to the current time. The NACK consumer will be set to the one
- * specified as argument of the function. */
-streamNACK *streamCreateNACK(streamConsumer *consumer) {
-    streamNACK *nack = zmalloc(sizeof(*nack));
+/* Create a NACK entry in the group PEL setting the delivery count to 1 and
+ * the delivery time to the current time. The NACK consumer will be set to
+ * the one specified as argument of the function, but the ID is not added
+ * to the consumer PEL. If the group PEL already has an entry with the
+ * same ID, NULL is returned. */
+streamNACK *streamCreateNACK(streamCG *cg, streamID *id, streamConsumer *consumer) {
+    int added;
+    streamNACK *nack = streamPELAdd(cg->pel,id,&added);
+    if (!added) return NULL;
     nack->delivery_time = mstime();
     nack->delivery_count = 1;
     nack->consumer = consumer;
     return nack;
 }
 
-/* Free a NACK entry. */
-void streamFreeNACK(streamNACK *na) {
-    zfree(na);
-}
-
 /* Free a consumer and associated data structures. Note that this function
  * will not reassign the pending messages associated with this consumer
  * nor will delete them from the stream, so when this function is called
  * to delete a consumer, and not when the whole stream is destroyed, the caller
  * should do some work before. */
 void streamFreeConsumer(streamConsumer *sc) {
-    raxFree(sc->pel); /* No value free callback: the PEL entries are shared
-                         between the consumer and the main stream PEL. */
+    streamPELFree(sc->pel);
     sdsfree(sc->name);
     zfree(sc);
 }
@@ -1680,7 +2302,7 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
         return NULL;
 
     streamCG *cg = zmalloc(sizeof(*cg));
-    cg->pel = raxNew();
+    cg->pel = streamPELNew(sizeof(streamNACK));
     cg->consumers = raxNew();
     cg->last_id = *id;
     raxInsert(s->cgroups,(unsigned char*)name,namelen,cg,NULL);
@@ -1689,7 +2311,7 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
 
 /* Free a consumer group and all its associated data. */
 void streamFreeCG(streamCG *cg) {
-    raxFreeWithCallback(cg->pel,(void(*)(void*))streamFreeNACK);
+    streamPELFree(cg->pel);
     raxFreeWithCallback(cg->consumers,(void(*)(void*))streamFreeConsumer);
     zfree(cg);
 }
@@ -1716,7 +2338,7 @@ streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int flags) {
         if (!create) return NULL;
         consumer = zmalloc(sizeof(*consumer));
         consumer->name = sdsdup(name);
-        consumer->pel = raxNew();
+        consumer->pel = streamPELNew(sizeof(streamID));
         raxInsert(cg->consumers,(unsigned char*)name,sdslen(name),
                   consumer,NULL);
     }
@@ -1732,19 +2354,23 @@ uint64_t streamDelConsumer(streamCG *cg, sds name) {
         streamLookupConsumer(cg,name,SLC_NOCREAT|SLC_NOREFRESH);
     if (consumer == NULL) return 0;
 
-    uint64_t retval = raxSize(consumer->pel);
-
-    /* Iterate all the consumer pending messages, deleting every corresponding
-     * entry from the global entry. */
-    raxIterator ri;
-    raxStart(&ri,consumer->pel);
-    raxSeek(&ri,"^",NULL,0);
-    while(raxNext(&ri)) {
-        streamNACK *nack = ri.data;
-        raxRemove(cg->pel,ri.key,ri.key_len,NULL);
-        streamFreeNACK(nack);
+    uint64_t retval = streamPELSize(consumer->pel);
+
+    /* Delete all the consumer pending messages from the global PEL, a block
+     * of IDs at a time. */
+    streamID ids[STREAM_PEL_BLOCK_ENTRIES], *id;
+    size_t count = 0;
+    streamPELIterator it;
+    streamPELIteratorStart(&it,consumer->pel,NULL);
+    while((id = streamPELIteratorNext(&it)) != NULL) {
+        ids[count++] = *id;
+        if (count == STREAM_PEL_BLOCK_ENTRIES) {
+            streamPELRemoveMany(cg->pel,ids,count,NULL,NULL);
+            count = 0;
+        }
     }
-    raxStop(&ri);
+    streamPELIteratorStop(&it);
+    streamPELRemoveMany(cg->pel,ids,count,NULL,NULL);
 
     /* Deallocate the consumer. */
     raxRemove(cg->consumers,(unsigned char*)name,sdslen(name),NULL);
@@ -1931,9 +2557,40 @@ void xsetidCommand(client *c) {
  *
  * Return value of the command is the number of messages successfully
  * acknowledged, that is, the IDs we were actually able to resolve in the PEL.
+ *
+ * The IDs are sorted so that they are removed a PEL block at a time, first
+ * from the group PEL, then from the PEL of every consumer that owned some
+ * of them.
  */
+
+/* Acknowledged entry, with the consumer that owned it. */
+typedef struct {
+    streamConsumer *consumer;
+    streamID id;
+} streamAck;
+
+static int streamCompareIDQsort(const void *a, const void *b) {
+    return streamCompareID((streamID*)a,(streamID*)b);
+}
+
+static int streamCompareAckQsort(const void *a, const void *b) {
+    const streamAck *aa = a, *ab = b;
+    if (aa->consumer != ab->consumer)
+        return aa->consumer < ab->consumer ? -1 : 1;
+    return streamCompareID((streamID*)&aa->id,(streamID*)&ab->id);
+}
+
+static void streamCollectAck(void *entry, void *privdata) {
+    streamNACK *nack = entry;
+    streamAck **next = privdata;
+    (*next)->consumer = nack->consumer;
+    (*next)->id = nack->id;
+    (*next)++;
+}
+
 void xackCommand(client *c) {
     streamCG *group = NULL;
+    rdbForklessKeyWrite(c->db,c->argv[1]);
     robj *o = lookupKeyRead(c->db,c->argv[1]);
     if (o) {
         if (checkType(c,o,OBJ_STREAM)) return; /* Type error. */
@@ -1950,31 +2607,40 @@ void xackCommand(client *c) {
      * error: the return value of this command cannot be an error in case
      * the client successfully acknowledged some messages, so it should be
      * executed in a "all or nothing" fashion. */
-    for (int j = 3; j < c->argc; j++) {
-        streamID id;
-        if (streamParseStrictIDOrReply(c,c->argv[j],&id,0) != C_OK) return;
+    size_t numids = c->argc-3, j, k;
+    streamID *ids = zmalloc(sizeof(streamID)*numids);
+    for (j = 0; j < numids; j++) {
+        if (streamParseStrictIDOrReply(c,c->argv[j+3],ids+j,0) != C_OK) {
+            zfree(ids);
+            return;
+        }
     }
 
-    int acknowledged = 0;
-    for (int j = 3; j < c->argc; j++) {
-        streamID id;
-        unsigned char buf[sizeof(streamID)];
-        if (streamParseStrictIDOrReply(c,c->argv[j],&id,0) != C_OK)
-            serverPanic("StreamID invalid after check. Should not be possible.");
-        streamEncodeID(buf,&id);
-
-        /* Lookup the ID in the group PEL: it will have a reference to the
-         * NACK structure that will have a reference to the consumer, so that
-         * we are able to remove the entry from both PELs. */
-        streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
-        if (nack != raxNotFound) {
-            raxRemove(group->pel,buf,sizeof(buf),NULL);
-            raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-            streamFreeNACK(nack);
-            acknowledged++;
-            server.dirty++;
-        }
+    /* Sort the IDs removing duplicates. */
+    qsort(ids,numids,sizeof(streamID),streamCompareIDQsort);
+    for (j = 1, k = 1; j < numids; j++) {
+        if (streamCompareID(ids+j,ids+k-1) != 0) ids[k++] = ids[j];
     }
+    numids = k;
+
+    /* Remove the IDs from the group PEL: the NACK entries reference the
+     * consumers, so we remember them in order to remove the entries from
+     * their PELs as well. */
+    streamAck *acks = zmalloc(sizeof(streamAck)*numids), *next = acks;
+    uint64_t acknowledged =
+        streamPELRemoveMany(group->pel,ids,numids,streamCollectAck,&next);
+
+    /* Now remove the IDs from the consumer PELs, grouping them by
+     * consumer. The IDs array is no longer needed, and is reused. */
+    qsort(acks,acknowledged,sizeof(streamAck),streamCompareAckQsort);
+    for (j = 0; j < acknowledged; j = k) {
+        for (k = j; k < acknowledged && acks[k].consumer == acks[j].consumer; k++)
+            ids[k-j] = acks[k].id;
+        streamPELRemoveMany(acks[j].consumer->pel,ids,k-j,NULL,NULL);
+    }
+    server.dirty += acknowledged;
+    zfree(acks);
+    zfree(ids);
     addReplyLongLong(c,acknowledged);
 }
 
@@ -2032,39 +2698,33 @@ void xpendingCommand(client *c) {
     if (justinfo) {
         addReplyArrayLen(c,4);
         /* Total number of messages in the PEL. */
-        addReplyLongLong(c,raxSize(group->pel));
+        addReplyLongLong(c,streamPELSize(group->pel));
         /* First and last IDs. */
-        if (raxSize(group->pel) == 0) {
+        if (streamPELSize(group->pel) == 0) {
             addReplyNull(c); /* Start. */
             addReplyNull(c); /* End. */
             addReplyNullArray(c); /* Clients. */
         } else {
             /* Start. */
-            raxIterator ri;
-            raxStart(&ri,group->pel);
-            raxSeek(&ri,"^",NULL,0);
-            raxNext(&ri);
-            streamDecodeID(ri.key,&startid);
-            addReplyStreamID(c,&startid);
+            streamNACK *nack = streamPELFirst(group->pel);
+            addReplyStreamID(c,&nack->id);
 
             /* End. */
-            raxSeek(&ri,"$",NULL,0);
-            raxNext(&ri);
-            streamDecodeID(ri.key,&endid);
-            addReplyStreamID(c,&endid);
-            raxStop(&ri);
+            nack = streamPELLast(group->pel);
+            addReplyStreamID(c,&nack->id);
 
             /* Consumers with pending messages. */
+            raxIterator ri;
             raxStart(&ri,group->consumers);
             raxSeek(&ri,"^",NULL,0);
             void *arraylen_ptr = addReplyDeferredLen(c);
             size_t arraylen = 0;
             while(raxNext(&ri)) {
                 streamConsumer *consumer = ri.data;
-                if (raxSize(consumer->pel) == 0) continue;
+                if (streamPELSize(consumer->pel) == 0) continue;
                 addReplyArrayLen(c,2);
                 addReplyBulkCBuffer(c,ri.key,ri.key_len);
-                addReplyBulkLongLong(c,raxSize(consumer->pel));
+                addReplyBulkLongLong(c,streamPELSize(consumer->pel));
                 arraylen++;
             }
             setDeferredArrayLen(c,arraylen_ptr,arraylen);
@@ -2087,30 +2747,29 @@ void xpendingCommand(client *c) {
             }
         }
 
-        rax *pel = consumer ? consumer->pel : group->pel;
-        unsigned char startkey[sizeof(streamID)];
-        unsigned char endkey[sizeof(streamID)];
-        raxIterator ri;
+        /* The consumer PEL only has the IDs: the NACKs are looked up in
+         * the group PEL. */
+        streamPEL *pel = consumer ? consumer->pel : group->pel;
+        streamPELIterator it;
+        streamID *pelid;
         mstime_t now = mstime();
 
-        streamEncodeID(startkey,&startid);
-        streamEncodeID(endkey,&endid);
-        raxStart(&ri,pel);
-        raxSeek(&ri,">=",startkey,sizeof(startkey));
+        streamPELIteratorStart(&it,pel,&startid);
         void *arraylen_ptr = addReplyDeferredLen(c);
         size_t arraylen = 0;
 
-        while(count && raxNext(&ri) && memcmp(ri.key,endkey,ri.key_len) <= 0) {
-            streamNACK *nack = ri.data;
+        while(count && (pelid = streamPELIteratorNext(&it)) != NULL &&
+              streamCompareID(pelid,&endid) <= 0)
+        {
+            streamNACK *nack = consumer ? streamPELFind(group->pel,pelid) :
+                                          (streamNACK*)pelid;
 
             arraylen++;
             count--;
             addReplyArrayLen(c,4);
 
             /* Entry ID. */
-            streamID id;
-            streamDecodeID(ri.key,&id);
-            addReplyStreamID(c,&id);
+            addReplyStreamID(c,&nack->id);
 
             /* Consumer name. */
             addReplyBulkCBuffer(c,nack->consumer->name,
@@ -2124,7 +2783,7 @@ void xpendingCommand(client *c) {
             /* Number of deliveries. */
             addReplyLongLong(c,nack->delivery_count);
         }
-        raxStop(&ri);
+        streamPELIteratorStop(&it);
         setDeferredArrayLen(c,arraylen_ptr,arraylen);
     }
 }
@@ -2197,6 +2856,7 @@ void xpendingCommand(client *c) {
  * what messages it is now in charge of. */
 void xclaimCommand(client *c) {
     streamCG *group = NULL;
+    rdbForklessKeyWrite(c->db,c->argv[1]);
     robj *o = lookupKeyRead(c->db,c->argv[1]);
     long long minidle; /* Minimum idle time argument. */
     long long retrycount = -1;   /* -1 means RETRYCOUNT option not given. */
@@ -2292,26 +2952,30 @@ void xclaimCommand(client *c) {
         deliverytime = now;
     }
 
-    /* Do the actual claiming. */
+    /* Do the actual claiming. The consumer PELs are only updated at the
+     * end, a block at a time: 'moved' has the entries to remove from the
+     * PELs of their previous owners, 'claimed' the IDs to add to the PEL
+     * of the new owner. */
     streamConsumer *consumer = NULL;
     void *arraylenptr = addReplyDeferredLen(c);
-    size_t arraylen = 0;
+    size_t arraylen = 0, nummoved = 0;
+    streamAck *moved = zmalloc(sizeof(streamAck)*(last_id_arg-4));
+    /* The second half of 'claimed' is used to remove the moved IDs. */
+    streamID *claimed = zmalloc(sizeof(streamID)*(last_id_arg-4)*2);
     for (int j = 5; j <= last_id_arg; j++) {
         streamID id;
-        unsigned char buf[sizeof(streamID)];
         if (streamParseStrictIDOrReply(c,c->argv[j],&id,0) != C_OK)
             serverPanic("StreamID invalid after check. Should not be possible.");
-        streamEncodeID(buf,&id);
 
         /* Lookup the ID in the group PEL. */
-        streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
+        streamNACK *nack = streamPELFind(group->pel,&id);
 
         /* If FORCE is passed, let's check if at least the entry
          * exists in the Stream. In such case, we'll crate a new
          * entry in the PEL from scratch, so that XCLAIM can also
          * be used to create entries in the PEL. Useful for AOF
          * and replication of consumer groups. */
-        if (force && nack == raxNotFound) {
+        if (force && nack == NULL) {
             streamIterator myiterator;
             streamIteratorStart(&myiterator,o->ptr,&id,&id,0);
             int64_t numfields;
@@ -2324,11 +2988,10 @@ void xclaimCommand(client *c) {
             if (!found) continue;
 
             /* Create the NACK. */
-            nack = streamCreateNACK(NULL);
-            raxInsert(group->pel,buf,sizeof(buf),nack,NULL);
+            nack = streamCreateNACK(group,&id,NULL);
         }
 
-        if (nack != raxNotFound) {
+        if (nack != NULL) {
             /* We need to check if the minimum idle time requested
              * by the caller is satisfied by this entry.
              *
@@ -2342,8 +3005,11 @@ void xclaimCommand(client *c) {
             /* Remove the entry from the old consumer.
              * Note that nack->consumer is NULL if we created the
              * NACK above because of the FORCE option. */
-            if (nack->consumer)
-                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
+            if (nack->consumer) {
+                moved[nummoved].consumer = nack->consumer;
+                moved[nummoved].id = id;
+                nummoved++;
+            }
             /* Update the consumer and idle time. */
             if (consumer == NULL)
                 consumer = streamLookupConsumer(group,c->argv[3]->ptr,SLC_NONE);
@@ -2356,8 +3022,8 @@ void xclaimCommand(client *c) {
             } else if (!justid) {
                 nack->delivery_count++;
             }
-            /* Add the entry in the new consumer local PEL. */
-            raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
+            /* Add the entry in the new consumer local PEL, later. */
+            claimed[arraylen] = id;
             /* Send the reply for this entry. */
             if (justid) {
                 addReplyStreamID(c,&id);
@@ -2374,6 +3040,25 @@ void xclaimCommand(client *c) {
             server.dirty++;
         }
     }
+
+    /* Move the claimed entries to the PEL of the new owner. Removals are
+     * done first: the new owner may be one of the previous ones, or the
+     * same ID may be claimed multiple times. */
+    qsort(moved,nummoved,sizeof(streamAck),streamCompareAckQsort);
+    for (size_t j = 0, k; j < nummoved; j = k) {
+        for (k = j; k < nummoved && moved[k].consumer == moved[j].consumer; k++)
+            claimed[arraylen+k-j] = moved[k].id;
+        streamPELRemoveMany(moved[j].consumer->pel,claimed+arraylen,k-j,
+                            NULL,NULL);
+    }
+    qsort(claimed,arraylen,sizeof(streamID),streamCompareIDQsort);
+    for (size_t j = 0; j < arraylen; j++) {
+        int added;
+        streamPELAdd(consumer->pel,claimed+j,&added);
+    }
+    zfree(moved);
+    zfree(claimed);
+
     if (propagate_last_id) {
         streamPropagateGroupID(c,c->argv[1],group,c->argv[2]);
         server.dirty++;
@@ -2427,10 +3112,10 @@ void xdelCommand(client *c) {
  *                             the specified length. Use ~ before the
  *                             count in order to demand approximated trimming
  *                             (like XADD MAXLEN option).
+ * MINID [~|=] <id>         -- Trim the entries with an ID smaller than the
+ *                             specified one. Use ~ to only remove whole
+ *                             nodes (like XADD MINID option).
  */
-
-#define TRIM_STRATEGY_NONE 0
-#define TRIM_STRATEGY_MAXLEN 1
 void xtrimCommand(client *c) {
     robj *o;
 
@@ -2441,58 +3126,32 @@ void xtrimCommand(client *c) {
     stream *s = o->ptr;
 
     /* Argument parsing. */
-    int trim_strategy = TRIM_STRATEGY_NONE;
-    long long maxlen = -1;  /* If left to -1 no trimming is performed. */
-    int approx_maxlen = 0;  /* If 1 only delete whole radix tree nodes, so
-                               the maxium length is not applied verbatim. */
-    int maxlen_arg_idx = 0; /* Index of the count in MAXLEN, for rewriting. */
+    streamTrimArgs trim = {TRIM_STRATEGY_NONE};
 
     /* Parse options. */
     int i = 2; /* Start of options. */
     for (; i < c->argc; i++) {
-        int moreargs = (c->argc-1) - i; /* Number of additional arguments. */
-        char *opt = c->argv[i]->ptr;
-        if (!strcasecmp(opt,"maxlen") && moreargs) {
-            approx_maxlen = 0;
-            trim_strategy = TRIM_STRATEGY_MAXLEN;
-            char *next = c->argv[i+1]->ptr;
-            /* Check for the form MAXLEN ~ <count>. */
-            if (moreargs >= 2 && next[0] == '~' && next[1] == '\0') {
-                approx_maxlen = 1;
-                i++;
-            } else if (moreargs >= 2 && next[0] == '=' && next[1] == '\0') {
-                i++;
-            }
-            if (getLongLongFromObjectOrReply(c,c->argv[i+1],&maxlen,NULL)
-                != C_OK) return;
-
-            if (maxlen < 0) {
-                addReplyError(c,"The MAXLEN argument must be >= 0.");
-                return;
-            }
-            i++;
-            maxlen_arg_idx = i;
-        } else {
+        int parsed = streamParseTrimArgsOrReply(c,&i,&trim);
+        if (parsed == -1) return;
+        if (parsed == 0) {
             addReply(c,shared.syntaxerr);
             return;
         }
     }
 
     /* Perform the trimming. */
-    int64_t deleted = 0;
-    if (trim_strategy == TRIM_STRATEGY_MAXLEN) {
-        deleted = streamTrimByLength(s,maxlen,approx_maxlen);
-    } else {
+    if (trim.strategy == TRIM_STRATEGY_NONE) {
         addReplyError(c,"XTRIM called without an option to trim the stream");
         return;
     }
+    int64_t deleted = streamTrim(s,&trim);
 
     /* Propagate the write if needed. */
     if (deleted) {
         signalModifiedKey(c,c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STREAM,"xtrim",c->argv[1],c->db->id);
         server.dirty += deleted;
-        if (approx_maxlen) streamRewriteApproxMaxlen(c,s,maxlen_arg_idx);
+        if (trim.approx) streamRewriteApproxTrim(c,s,trim.arg_idx);
     }
     addReplyLongLong(c,deleted);
 }
@@ -2592,23 +3251,22 @@ void xinfoReplyWithStreamInfo(client *c, stream *s) {
 
                 /* Group PEL count */
                 addReplyBulkCString(c,"pel-count");
-                addReplyLongLong(c,raxSize(cg->pel));
+                addReplyLongLong(c,streamPELSize(cg->pel));
 
                 /* Group PEL */
                 addReplyBulkCString(c,"pending");
                 long long arraylen_cg_pel = 0;
                 void *arrayptr_cg_pel = addReplyDeferredLen(c);
-                raxIterator ri_cg_pel;
-                raxStart(&ri_cg_pel,cg->pel);
-                raxSeek(&ri_cg_pel,"^",NULL,0);
-                while(raxNext(&ri_cg_pel) && (!count || arraylen_cg_pel < count)) {
-                    streamNACK *nack = ri_cg_pel.data;
+                streamPELIterator it_cg_pel;
+                streamNACK *nack;
+                streamPELIteratorStart(&it_cg_pel,cg->pel,NULL);
+                while((!count || arraylen_cg_pel < count) &&
+                      (nack = streamPELIteratorNext(&it_cg_pel)) != NULL)
+                {
                     addReplyArrayLen(c,4);
 
                     /* Entry ID. */
-                    streamID id;
-                    streamDecodeID(ri_cg_pel.key,&id);
-                    addReplyStreamID(c,&id);
+                    addReplyStreamID(c,&nack->id);
 
                     /* Consumer name. */
                     addReplyBulkCBuffer(c,nack->consumer->name,
@@ -2623,7 +3281,7 @@ void xinfoReplyWithStreamInfo(client *c, stream *s) {
                     arraylen_cg_pel++;
                 }
                 setDeferredArrayLen(c,arrayptr_cg_pel,arraylen_cg_pel);
-                raxStop(&ri_cg_pel);
+                streamPELIteratorStop(&it_cg_pel);
 
                 /* Consumers */
                 addReplyBulkCString(c,"consumers");
@@ -2645,23 +3303,23 @@ void xinfoReplyWithStreamInfo(client *c, stream *s) {
 
                     /* Consumer PEL count */
                     addReplyBulkCString(c,"pel-count");
-                    addReplyLongLong(c,raxSize(consumer->pel));
+                    addReplyLongLong(c,streamPELSize(consumer->pel));
 
                     /* Consumer PEL */
                     addReplyBulkCString(c,"pending");
                     long long arraylen_cpel = 0;
                     void *arrayptr_cpel = addReplyDeferredLen(c);
-                    raxIterator ri_cpel;
-                    raxStart(&ri_cpel,consumer->pel);
-                    raxSeek(&ri_cpel,"^",NULL,0);
-                    while(raxNext(&ri_cpel) && (!count || arraylen_cpel < count)) {
-                        streamNACK *nack = ri_cpel.data;
+                    streamPELIterator it_cpel;
+                    streamID *pelid;
+                    streamPELIteratorStart(&it_cpel,consumer->pel,NULL);
+                    while((!count || arraylen_cpel < count) &&
+                          (pelid = streamPELIteratorNext(&it_cpel)) != NULL)
+                    {
+                        nack = streamPELFind(cg->pel,pelid);
                         addReplyArrayLen(c,3);
 
                         /* Entry ID. */
-                        streamID id;
-                        streamDecodeID(ri_cpel.key,&id);
-                        addReplyStreamID(c,&id);
+                        addReplyStreamID(c,pelid);
 
                         /* Last delivery. */
                         addReplyLongLong(c,nack->delivery_time);
@@ -2672,7 +3330,7 @@ void xinfoReplyWithStreamInfo(client *c, stream *s) {
                         arraylen_cpel++;
                     }
                     setDeferredArrayLen(c,arrayptr_cpel,arraylen_cpel);
-                    raxStop(&ri_cpel);
+                    streamPELIteratorStop(&it_cpel);
                 }
                 raxStop(&ri_consumers);
             }
@@ -2745,7 +3403,7 @@ NULL
             addReplyBulkCString(c,"name");
             addReplyBulkCBuffer(c,consumer->name,sdslen(consumer->name));
             addReplyBulkCString(c,"pending");
-            addReplyLongLong(c,raxSize(consumer->pel));
+            addReplyLongLong(c,streamPELSize(consumer->pel));
             addReplyBulkCString(c,"idle");
             addReplyLongLong(c,idle);
         }
@@ -2769,7 +3427,7 @@ NULL
             addReplyBulkCString(c,"consumers");
             addReplyLongLong(c,raxSize(cg->consumers));
             addReplyBulkCString(c,"pending");
-            addReplyLongLong(c,raxSize(cg->pel));
+            addReplyLongLong(c,streamPELSize(cg->pel));
             addReplyBulkCString(c,"last-delivered-id");
             addReplyStreamID(c,&cg->last_id);
         }
@@ -2781,3 +3439,114 @@ NULL
         addReplySubcommandSyntaxError(c);
     }
 }
+
+/* -----------------------------------------------------------------------
+ * Stream retention
+ * ----------------------------------------------------------------------- */
+
+#define STREAM_RETENTION_CYCLE_TIME_PERC 10 /* Max % of CPU per cron call. */
+#define STREAM_RETENTION_CYCLE_MAX_ENTRIES 10000 /* Max entries removed from
+                                                    a stream per visit. */
+
+/* Propagate to AOF and replicas the trimming of the stream at 'key' done by
+ * the retention cycle. Like for approximated trimming, it is propagated as
+ * XTRIM <key> MAXLEN = <resulting-len-of-stream>, so that the replicas
+ * remove exactly the same entries regardless of their clock. */
+static void streamPropagateTrim(redisDb *db, robj *key, stream *s) {
+    robj *argv[5];
+
+    argv[0] = createStringObject("XTRIM",5);
+    argv[1] = key;
+    argv[2] = createStringObject("MAXLEN",6);
+    argv[3] = createStringObject("=",1);
+    argv[4] = createStringObjectFromLongLong(s->length);
+
+    if (server.aof_state != AOF_OFF)
+        feedAppendOnlyFile(server.xtrimCommand,db->id,argv,5);
+    replicationFeedSlaves(server.slaves,db->id,argv,5);
+
+    decrRefCount(argv[0]);
+    decrRefCount(argv[2]);
+    decrRefCount(argv[3]);
+    decrRefCount(argv[4]);
+}
+
+static void streamRetentionScanCallback(void *privdata, const dictEntry *de) {
+    list *keys = privdata;
+    listAddNodeTail(keys,sdsdup(dictGetKey(de)));
+}
+
+/* Called by databasesCron() when "stream-max-age" is set: incrementally
+ * scan the streams of every DB, removing from their head the whole nodes
+ * having only entries older than the configured age. Like the slow active
+ * expire cycle the function uses a small percentage of CPU time, and the
+ * next call continues from where the previous one stopped. */
+void streamRetentionCycle(void) {
+    static unsigned int current_db = 0;
+    long long start = ustime(), timelimit;
+    int iteration = 0;
+    mstime_t now = mstime();
+
+    if (now <= server.stream_max_age) return;
+    streamID minid = {(uint64_t)(now - server.stream_max_age), 0};
+
+    timelimit = STREAM_RETENTION_CYCLE_TIME_PERC*1000000/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+
+    list *keys = listCreate();
+    listSetFreeMethod(keys,(void (*)(void*))sdsfree);
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+(current_db % server.dbnum);
+        int timelimit_exit = 0;
+
+        if (dictSize(db->streams) == 0) {
+            current_db++;
+            continue;
+        }
+        do {
+            listIter li;
+            listNode *ln;
+
+            /* Collect a few keys first: trimming may delete entries of
+             * db->streams that are no longer streams. */
+            db->streams_cursor = dictScan(db->streams,db->streams_cursor,
+                streamRetentionScanCallback,NULL,keys);
+            listRewind(keys,&li);
+            while((ln = listNext(&li))) {
+                sds key = listNodeValue(ln);
+                robj *o = dictFetchValue(db->dict,key);
+                if (o == NULL || o->type != OBJ_STREAM) {
+                    dictDelete(db->streams,key);
+                    continue;
+                }
+
+                robj statickey;
+                initStaticStringObject(statickey,key);
+                rdbForklessKeyWrite(db,&statickey);
+
+                stream *s = o->ptr;
+                int64_t deleted = streamTrimByID(s,&minid,1,
+                    STREAM_RETENTION_CYCLE_MAX_ENTRIES);
+                if (deleted == 0) continue;
+
+                robj *keyobj = createStringObject(key,sdslen(key));
+                streamPropagateTrim(db,keyobj,s);
+                signalModifiedKey(NULL,db,keyobj);
+                notifyKeyspaceEvent(NOTIFY_STREAM,"xtrim",keyobj,db->id);
+                decrRefCount(keyobj);
+                server.dirty += deleted;
+                server.stat_stream_trimmed += deleted;
+            }
+            listEmpty(keys);
+
+            if ((++iteration & 0xf) == 0 && ustime()-start > timelimit) {
+                timelimit_exit = 1;
+                break;
+            }
+        } while(db->streams_cursor != 0);
+
+        if (timelimit_exit) break;
+        current_db++;
+    }
+    listRelease(keys);
+}
@@ -415,6 +415,10 @@ void getrangeCommand(client *c) {
     if (o->encoding == OBJ_ENCODING_INT) {//int类型
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        /* Only the requested range is made flat, see below. */
+        str = NULL;
+        strlen = ((bitmapString*)o->ptr)->len;
     } else {//string类型
         str = o->ptr;
         strlen = sdslen(str);
@@ -437,6 +441,10 @@ void getrangeCommand(client *c) {
     if (start > end || strlen == 0) {
         // 处理索引范围为空的情况
         addReply(c,shared.emptybulk);
+    } else if (str == NULL) {
+        sds range = sdsnewlen(NULL,end-start+1);
+        bitmapStringRead(o->ptr,start,end-start+1,(unsigned char*)range);
+        addReplyBulkSds(c,range);
     } else {
         // 向客户端返回给定范围内的字符串内容
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
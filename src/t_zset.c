@@ -919,6 +919,104 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
     return x;
 }
 
+/*-----------------------------------------------------------------------------
+ * B+-tree backed sorted set API, on top of the tree implemented in zbtree.c
+ *----------------------------------------------------------------------------*/
+
+static int zbtValueGteMin(double score, sds ele, void *range) {
+    UNUSED(ele);
+    return zslValueGteMin(score,range);
+}
+
+static int zbtValueLteMax(double score, sds ele, void *range) {
+    UNUSED(ele);
+    return zslValueLteMax(score,range);
+}
+
+static int zbtLexValueGteMin(double score, sds ele, void *range) {
+    UNUSED(score);
+    return zslLexValueGteMin(ele,range);
+}
+
+static int zbtLexValueLteMax(double score, sds ele, void *range) {
+    UNUSED(score);
+    return zslLexValueLteMax(ele,range);
+}
+
+/* Position 'it' at the first element contained in the specified range.
+ * Returns 0 when no element is contained in the range. */
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    if (!zbtSeekFirstMatch(zbt,zbtValueGteMin,range,it)) return 0;
+    return zslValueLteMax(zbtIterScore(it),range);
+}
+
+/* Position 'it' at the last element contained in the specified range.
+ * Returns 0 when no element is contained in the range. */
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    if (!zbtSeekLastMatch(zbt,zbtValueLteMax,range,it)) return 0;
+    return zslValueGteMin(zbtIterScore(it),range);
+}
+
+/* Same as zbtFirstInRange() for lex ranges. Like for the skiplist, all the
+ * elements are assumed to have the same score. */
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    if (!zbtSeekFirstMatch(zbt,zbtLexValueGteMin,range,it)) return 0;
+    return zslLexValueLteMax(zbtIterEle(it),range);
+}
+
+/* Same as zbtLastInRange() for lex ranges. */
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    if (!zbtSeekLastMatch(zbt,zbtLexValueLteMax,range,it)) return 0;
+    return zslLexValueGteMin(zbtIterEle(it),range);
+}
+
+/* Delete the element at the iterator position from both the tree and the
+ * dict. The dict entry must go first, as the SDS string is shared. */
+static void zbtDeleteAt(zbtree *zbt, zbtreeIter *it, dict *dict) {
+    double score = zbtIterScore(it);
+    sds ele = zbtIterEle(it);
+
+    dictDelete(dict,ele);
+    zbtDelete(zbt,score,ele,NULL);
+}
+
+/* Delete all the elements with score in the range from the tree and from
+ * the hash table view of the sorted set, like zslDeleteRangeByScore(). */
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtreeIter it;
+    unsigned long removed = 0;
+
+    while (zbtFirstInRange(zbt,range,&it)) {
+        zbtDeleteAt(zbt,&it,dict);
+        removed++;
+    }
+    return removed;
+}
+
+/* Like zslDeleteRangeByLex(). */
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtreeIter it;
+    unsigned long removed = 0;
+
+    while (zbtFirstInLexRange(zbt,range,&it)) {
+        zbtDeleteAt(zbt,&it,dict);
+        removed++;
+    }
+    return removed;
+}
+
+/* Like zslDeleteRangeByRank(), start and end are 1-based and inclusive. */
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned int start, unsigned int end, dict *dict) {
+    zbtreeIter it;
+    unsigned long removed = 0;
+
+    while (start+removed <= end && zbtSeekRank(zbt,start,&it)) {
+        zbtDeleteAt(zbt,&it,dict);
+        removed++;
+    }
+    return removed;
+}
+
 /*-----------------------------------------------------------------------------
  * Ziplist-backed sorted set API
  * 压缩列表实现的有序列表API
@@ -1409,6 +1507,8 @@ unsigned long zsetLength(const robj *zobj) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1416,6 +1516,36 @@ unsigned long zsetLength(const robj *zobj) {
 }
 
 void zsetConvert(robj *zobj, int encoding) {
+    zsetConvertAndExpand(zobj, encoding, zsetLength(zobj));
+}
+
+/* Return the encoding used for sorted sets that can't be ziplists. */
+int zsetLargeEncoding(void) {
+    return server.zset_btree_encoding ? OBJ_ENCODING_BTREE :
+                                        OBJ_ENCODING_SKIPLIST;
+}
+
+/* Insert an element that is not already part of the skiplist or btree
+ * encoded sorted set 'zs'. The SDS string is owned by the set after the
+ * call. The score is stored in the dict entry itself, so that it does not
+ * need to be updated when the btree moves the element around. */
+void zsetInsert(zset *zs, double score, sds ele) {
+    dictEntry *de;
+
+    if (zs->zbt)
+        zbtInsert(zs->zbt,score,ele);
+    else
+        zslInsert(zs->zsl,score,ele);
+    de = dictAddRaw(zs->dict,ele,NULL);
+    serverAssert(de != NULL);
+    dictSetDoubleVal(de,score);
+}
+
+/* Like zsetConvert(), but when converting from a ziplist the dict is sized
+ * for 'cap' elements, so that the caller can add more without rehashing.
+ * A ziplist can be converted into a skiplist or a btree, both can only be
+ * converted back into a ziplist. */
+void zsetConvertAndExpand(robj *zobj, int encoding, unsigned long cap) {
     zset *zs;
     zskiplistNode *node, *next;
     sds ele;
@@ -1429,17 +1559,23 @@ void zsetConvert(robj *zobj, int encoding) {
         unsigned int vlen;
         long long vlong;
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
+        if (encoding != OBJ_ENCODING_SKIPLIST &&
+            encoding != OBJ_ENCODING_BTREE)
             serverPanic("Unknown target encoding");
 
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+        zs->zsl = encoding == OBJ_ENCODING_SKIPLIST ? zslCreate() : NULL;
+        zs->zbt = encoding == OBJ_ENCODING_BTREE ? zbtCreate() : NULL;
 
+        /* Presize the dict to avoid rehashing */
+        dictExpand(zs->dict,cap);
+
+        /* The ziplist is empty when zsetAddMany() converts a sorted set it
+         * just created. */
         eptr = ziplistIndex(zl,0);
-        serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
-        serverAssertWithInfo(NULL,zobj,sptr != NULL);
+        sptr = eptr ? ziplistNext(zl,eptr) : NULL;
+        serverAssertWithInfo(NULL,zobj,eptr == NULL || sptr != NULL);
 
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
@@ -1449,14 +1585,13 @@ void zsetConvert(robj *zobj, int encoding) {
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            zsetInsert(zs,score,ele);
             zzlNext(zl,&eptr,&sptr);
         }
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
+        zobj->encoding = encoding;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         unsigned char *zl = ziplistNew();
 
@@ -1478,6 +1613,25 @@ void zsetConvert(robj *zobj, int encoding) {
             node = next;
         }
 
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = ziplistNew();
+        zbtreeIter it;
+
+        if (encoding != OBJ_ENCODING_ZIPLIST)
+            serverPanic("Unknown target encoding");
+
+        zs = zobj->ptr;
+        dictRelease(zs->dict);
+        if (zbtSeekFirst(zs->zbt,&it)) {
+            do {
+                zl = zzlInsertAt(zl,NULL,zbtIterEle(&it),zbtIterScore(&it));
+            } while (zbtNext(&it));
+        }
+        zbtFree(zs->zbt);
+
         zfree(zs);
         zobj->ptr = zl;
         zobj->encoding = OBJ_ENCODING_ZIPLIST;
@@ -1486,14 +1640,30 @@ void zsetConvert(robj *zobj, int encoding) {
     }
 }
 
+/* Create a sorted set that is about to receive 'size_hint' elements, the
+ * longest being 'val_len_hint' bytes. The number of elements is only used
+ * to pre-size the dict: they may be duplicated, so whether a ziplist holds
+ * them is decided by zsetAddMany(). */
+robj *zsetTypeCreate(size_t size_hint, size_t val_len_hint) {
+    if (server.zset_max_ziplist_entries != 0 &&
+        val_len_hint <= server.zset_max_ziplist_value)
+    {
+        return createZsetZiplistObject();
+    }
+
+    robj *zobj = createZsetObject();
+    zset *zs = zobj->ptr;
+    dictExpand(zs->dict,size_hint);
+    return zobj;
+}
+
 /* Convert the sorted set object into a ziplist if it is not already a ziplist
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
     if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
-    zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
+    if (zsetLength(zobj) <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
             zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
 }
@@ -1507,11 +1677,13 @@ int zsetScore(robj *zobj, sds member, double *score) {
 
     if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
         dictEntry *de = dictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
+        *score = dictGetDoubleVal(de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1609,7 +1781,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             zobj->ptr = zzlInsert(zobj->ptr,ele,score);
             if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
                 sdslen(ele) > server.zset_max_ziplist_value)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,zsetLargeEncoding());
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
             return 1;
@@ -1617,9 +1789,10 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             *flags |= ZADD_NOP;
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplistNode *znode;
         dictEntry *de;
 
         de = dictFind(zs->dict,ele);
@@ -1629,7 +1802,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                 *flags |= ZADD_NOP;
                 return 1;
             }
-            curscore = *(double*)dictGetVal(de);
+            curscore = dictGetDoubleVal(de);
 
             /* Prepare the score for the increment if needed. */
             if (incr) {
@@ -1643,18 +1816,19 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 
             /* Remove and re-insert when score changes. */
             if (score != curscore) {
-                znode = zslUpdateScore(zs->zsl,curscore,ele,score);
+                if (zs->zbt)
+                    zbtUpdateScore(zs->zbt,curscore,ele,score);
+                else
+                    zslUpdateScore(zs->zsl,curscore,ele,score);
                 /* Note that we did not removed the original element from
                  * the hash table representing the sorted set, so we just
                  * update the score. */
-                dictGetVal(de) = &znode->score; /* Update score ptr. */
+                dictSetDoubleVal(de,score);
                 *flags |= ZADD_UPDATED;
             }
             return 1;
         } else if (!xx) {
-            ele = sdsdup(ele);
-            znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            zsetInsert(zs,score,sdsdup(ele));
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1668,6 +1842,117 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     return 0; /* Never reached. */
 }
 
+typedef struct zsetAddManyEntry {
+    sds ele;
+    double score;
+} zsetAddManyEntry;
+
+static int zsetAddManyCompare(const void *a, const void *b) {
+    const zsetAddManyEntry *x = a, *y = b;
+
+    if (x->score != y->score) return x->score > y->score ? 1 : -1;
+    return sdscmp(x->ele,y->ele);
+}
+
+/* Add the 'count' score/element pairs at 'argv', whose scores were already
+ * parsed into 'scores', to a ziplist encoded sorted set, honoring the ZADD_NX
+ * and ZADD_XX 'flags' like zsetAdd() does, and incrementing '*added' and
+ * '*updated' by the number of elements added and updated.
+ *
+ * The ziplist is not grown one element at a time: its final content is
+ * computed first, then it is rebuilt with a single resize and C_OK is
+ * returned. When the result would be too large for a ziplist, the sorted
+ * set is converted and pre-sized for it instead, nothing is added and
+ * C_ERR is returned so that the caller adds the elements with zsetAdd(). */
+int zsetAddMany(robj *zobj, double *scores, robj **argv, int count,
+                int flags, int *added, int *updated)
+{
+    int nx = (flags & ZADD_NX) != 0;
+    int xx = (flags & ZADD_XX) != 0;
+    unsigned char *zl = zobj->ptr, *eptr, *sptr;
+    unsigned long len = zzlLength(zl), maxlen, n = 0, j;
+    int newadded = 0, newupdated = 0, ok = 1;
+    zsetAddManyEntry *entries;
+    dict *d;
+
+    serverAssert(zobj->encoding == OBJ_ENCODING_ZIPLIST);
+    maxlen = server.zset_max_ziplist_entries;
+    if (len > maxlen) maxlen = len;
+    if (maxlen > len+count) maxlen = len+count;
+    entries = zmalloc(sizeof(*entries)*maxlen);
+    d = dictCreate(&keyptrDictType,NULL);
+
+    /* Load the current elements, then apply the new ones in order. */
+    eptr = ziplistIndex(zl,0);
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        entries[n].ele = ziplistGetObject(eptr);
+        entries[n].score = zzlGetScore(sptr);
+        dictSetUnsignedIntegerVal(dictAddRaw(d,entries[n].ele,NULL),n);
+        n++;
+        eptr = ziplistNext(zl,sptr);
+    }
+
+    for (j = 0; j < (unsigned long)count; j++) {
+        sds ele = argv[j*2+1]->ptr;
+        dictEntry *de = dictFind(d,ele);
+
+        if (de != NULL) {
+            zsetAddManyEntry *e = entries+dictGetUnsignedIntegerVal(de);
+            if (nx || e->score == scores[j]) continue;
+            e->score = scores[j];
+            newupdated++;
+        } else if (!xx) {
+            if (n == maxlen || sdslen(ele) > server.zset_max_ziplist_value) {
+                ok = 0;
+                break;
+            }
+            entries[n].ele = ele;
+            entries[n].score = scores[j];
+            dictSetUnsignedIntegerVal(dictAddRaw(d,ele,NULL),n);
+            n++;
+            newadded++;
+        }
+    }
+
+    if (ok && (newadded || newupdated)) {
+        unsigned char **strs = zmalloc(sizeof(unsigned char*)*n*2);
+        unsigned int *lens = zmalloc(sizeof(unsigned int)*n*2);
+        /* A score printed by d2string() never takes more than 24 bytes. */
+        char *scorebuf = zmalloc(n*32);
+
+        qsort(entries,n,sizeof(*entries),zsetAddManyCompare);
+        for (j = 0; j < n; j++) {
+            strs[j*2] = (unsigned char*)entries[j].ele;
+            lens[j*2] = sdslen(entries[j].ele);
+            strs[j*2+1] = (unsigned char*)scorebuf+j*32;
+            lens[j*2+1] = d2string(scorebuf+j*32,32,entries[j].score);
+        }
+        zl = ziplistPushMany(ziplistNew(),strs,lens,n*2);
+        zfree(zobj->ptr);
+        zobj->ptr = zl;
+        zfree(strs);
+        zfree(lens);
+        zfree(scorebuf);
+    }
+
+    /* Only the elements loaded from the ziplist were copied. */
+    for (j = 0; j < n; j++) {
+        if (dictGetUnsignedIntegerVal(dictFind(d,entries[j].ele)) < len)
+            sdsfree(entries[j].ele);
+    }
+    dictRelease(d);
+    zfree(entries);
+
+    if (!ok) {
+        zsetConvertAndExpand(zobj,zsetLargeEncoding(),len+count);
+        return C_ERR;
+    }
+    *added += newadded;
+    *updated += newupdated;
+    return C_OK;
+}
+
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
@@ -1678,7 +1963,9 @@ int zsetDel(robj *zobj, sds ele) {
             zobj->ptr = zzlDelete(zobj->ptr,eptr);
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
         dictEntry *de;
         double score;
@@ -1686,7 +1973,7 @@ int zsetDel(robj *zobj, sds ele) {
         de = dictUnlink(zs->dict,ele);
         if (de != NULL) {
             /* Get the score in order to delete from the skiplist later. */
-            score = *(double*)dictGetVal(de);
+            score = dictGetDoubleVal(de);
 
             /* Delete from the hash table and later from the skiplist.
              * Note that the order is important: deleting from the skiplist
@@ -1696,7 +1983,8 @@ int zsetDel(robj *zobj, sds ele) {
             dictFreeUnlinkedEntry(zs->dict,de);
 
             /* Delete from skiplist. */
-            int retval = zslDelete(zs->zsl,score,ele,NULL);
+            int retval = zs->zbt ? zbtDelete(zs->zbt,score,ele,NULL) :
+                                   zslDelete(zs->zsl,score,ele,NULL);
             serverAssert(retval);
 
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1750,16 +2038,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
-            rank = zslGetRank(zsl,score,ele);
+            score = dictGetDoubleVal(de);
+            rank = zs->zbt ? zbtGetRank(zs->zbt,score,ele) :
+                             zslGetRank(zs->zsl,score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
             if (reverse)
@@ -1787,6 +2077,7 @@ void zaddGenericCommand(client *c, int flags) {
     double score = 0, *scores = NULL;
     int j, elements;
     int scoreidx = 0;
+    size_t maxelelen = 0;
     /* The following vars are used in order to track what the command actually
      * did during the execution, to reply to the client and to trigger the
      * notification of keyspace change. */
@@ -1843,19 +2134,15 @@ void zaddGenericCommand(client *c, int flags) {
     for (j = 0; j < elements; j++) {
         if (getDoubleFromObjectOrReply(c,c->argv[scoreidx+j*2],&scores[j],NULL)
             != C_OK) goto cleanup;
+        if (sdslen(c->argv[scoreidx+1+j*2]->ptr) > maxelelen)
+            maxelelen = sdslen(c->argv[scoreidx+1+j*2]->ptr);
     }
 
     /* Lookup the key and create the sorted set if does not exist. */
     zobj = lookupKeyWrite(c->db,key);
     if (zobj == NULL) {
         if (xx) goto reply_to_client; /* No key + XX option: nothing to do. */
-        if (server.zset_max_ziplist_entries == 0 ||
-            server.zset_max_ziplist_value < sdslen(c->argv[scoreidx+1]->ptr))
-        {
-            zobj = createZsetObject();
-        } else {
-            zobj = createZsetZiplistObject();
-        }
+        zobj = zsetTypeCreate(elements,maxelelen);
         dbAdd(c->db,key,zobj);
     } else {
         if (zobj->type != OBJ_ZSET) {
@@ -1864,6 +2151,16 @@ void zaddGenericCommand(client *c, int flags) {
         }
     }
 
+    /* Variadic adds to a ziplist are applied at once, unless the result
+     * is too large for a ziplist: then the sorted set was just converted
+     * and pre-sized for them. */
+    if (!incr && elements > 1 && zobj->encoding == OBJ_ENCODING_ZIPLIST &&
+        zsetAddMany(zobj,scores,c->argv+scoreidx,elements,flags,
+                    &added,&updated) == C_OK)
+    {
+        elements = 0;
+    }
+
     for (j = 0; j < elements; j++) {
         double newscore;
         score = scores[j];
@@ -2003,17 +2300,25 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
         switch(rangetype) {
         case ZRANGE_RANK:
-            deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
+            deleted = zs->zbt ?
+                zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict) :
+                zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
             break;
         case ZRANGE_SCORE:
-            deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict);
+            deleted = zs->zbt ?
+                zbtDeleteRangeByScore(zs->zbt,&range,zs->dict) :
+                zslDeleteRangeByScore(zs->zsl,&range,zs->dict);
             break;
         case ZRANGE_LEX:
-            deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict);
+            deleted = zs->zbt ?
+                zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict) :
+                zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict);
             break;
         }
         if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -2057,6 +2362,7 @@ typedef struct {
     int type; /* Set, sorted set */
     int encoding;
     double weight;
+    int reverse; /* Iterate sorted sets from the highest score. */
 
     union {
         /* Set iterators. */
@@ -2070,6 +2376,7 @@ typedef struct {
                 dictIterator *di;
                 dictEntry *de;
             } ht;
+            roaringIterator ri;
         } set;
 
         /* Sorted set iterators. */
@@ -2082,6 +2389,7 @@ typedef struct {
                 zset *zs;
                 zskiplistNode *node;
             } sl;
+            zbtreeIter bt; /* bt.leaf is NULL at the end. */
         } zset;
     } iter;
 } zsetopsrc;
@@ -2122,8 +2430,12 @@ void zuiInitIterator(zsetopsrc *op) {
             it->is.ii = 0;
         } else if (op->encoding == OBJ_ENCODING_HT) {
             it->ht.dict = op->subject->ptr;
-            it->ht.di = dictGetIterator(op->subject->ptr);
+            /* Safe iterator: ZUNION/ZINTER may look up elements in a set
+             * while it is being iterated. */
+            it->ht.di = dictGetSafeIterator(op->subject->ptr);
             it->ht.de = dictNext(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_BITMAP) {
+            roaringInitIterator(&it->ri,op->subject->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
@@ -2131,14 +2443,20 @@ void zuiInitIterator(zsetopsrc *op) {
         iterzset *it = &op->iter.zset;
         if (op->encoding == OBJ_ENCODING_ZIPLIST) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = ziplistIndex(it->zl.zl,op->reverse ? -2 : 0);
             if (it->zl.eptr != NULL) {
                 it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             it->sl.zs = op->subject->ptr;
-            it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+            it->sl.node = op->reverse ? it->sl.zs->zsl->tail :
+                                        it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            int found = op->reverse ? zbtSeekLast(zs->zbt,&it->bt) :
+                                      zbtSeekFirst(zs->zbt,&it->bt);
+            if (!found) it->bt.leaf = NULL;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2153,7 +2471,7 @@ void zuiClearIterator(zsetopsrc *op) {
 
     if (op->type == OBJ_SET) {
         iterset *it = &op->iter.set;
-        if (op->encoding == OBJ_ENCODING_INTSET) {
+        if (setEncodingIsInteger(op->encoding)) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
@@ -2164,7 +2482,9 @@ void zuiClearIterator(zsetopsrc *op) {
         iterzset *it = &op->iter.zset;
         if (op->encoding == OBJ_ENCODING_ZIPLIST) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -2184,15 +2504,18 @@ unsigned long zuiLength(zsetopsrc *op) {
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             return dictSize(ht);
+        } else if (op->encoding == OBJ_ENCODING_BITMAP) {
+            return roaringCard(op->subject->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         if (op->encoding == OBJ_ENCODING_ZIPLIST) {
             return zzlLength(op->subject->ptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            zset *zs = op->subject->ptr;
-            return zs->zsl->length;
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
+            return zsetLength(op->subject);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2233,6 +2556,13 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->ht.de = dictNext(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_BITMAP) {
+            int64_t ell;
+
+            if (!roaringNext(&it->ri,&ell))
+                return 0;
+            val->ell = ell;
+            val->score = 1.0;
         } else {
             serverPanic("Unknown set encoding");
         }
@@ -2246,7 +2576,10 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
-            zzlNext(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
+            if (op->reverse)
+                zzlPrev(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
+            else
+                zzlNext(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             if (it->sl.node == NULL)
                 return 0;
@@ -2254,7 +2587,19 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
             val->score = it->sl.node->score;
 
             /* Move to next element. */
-            it->sl.node = it->sl.node->level[0].forward;
+            it->sl.node = op->reverse ? it->sl.node->backward :
+                                        it->sl.node->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (it->bt.leaf == NULL)
+                return 0;
+            val->ele = zbtIterEle(&it->bt);
+            val->score = zbtIterScore(&it->bt);
+
+            /* Move to next element. */
+            if (op->reverse)
+                zbtPrev(&it->bt);
+            else
+                zbtNext(&it->bt);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2350,6 +2695,15 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_BITMAP) {
+            if (zuiLongLongFromValue(val) &&
+                roaringContains(op->subject->ptr,val->ell))
+            {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else {
             serverPanic("Unknown set encoding");
         }
@@ -2363,11 +2717,13 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             if ((de = dictFind(zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+                *score = dictGetDoubleVal(de);
                 return 1;
             } else {
                 return 0;
@@ -2422,39 +2778,283 @@ dictType setAccumulatorDictType = {
     NULL                       /* val destructor */
 };
 
-void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
+/* An element of the reply of ZUNION / ZINTER. */
+typedef struct {
+    double order;   /* Aggregated score, negated for REV. */
+    sds ele;
+} zsetopres;
+
+/* Return non zero if 'a' must be returned before 'b'. Elements with the
+ * same score are returned in lexicographical order, reversed for REV like
+ * ZREVRANGE does. */
+static int zsetopresBefore(const zsetopres *a, const zsetopres *b, int rev) {
+    if (a->order != b->order) return a->order < b->order;
+    int cmp = sdscmp(a->ele,b->ele);
+    return rev ? cmp > 0 : cmp < 0;
+}
+
+/* The results are kept in a binary heap having at the root the element that
+ * will be returned last, so that it can be dropped in O(log K) when a better
+ * one is found. */
+static void zsetopresSiftDown(zsetopres *heap, long len, long i, int rev) {
+    while (1) {
+        long child = 2*i+1, last = i;
+        if (child < len && zsetopresBefore(heap+last,heap+child,rev))
+            last = child;
+        if (child+1 < len && zsetopresBefore(heap+last,heap+child+1,rev))
+            last = child+1;
+        if (last == i) break;
+        zsetopres tmp = heap[i];
+        heap[i] = heap[last];
+        heap[last] = tmp;
+        i = last;
+    }
+}
+
+static void zsetopresSiftUp(zsetopres *heap, long i, int rev) {
+    while (i > 0) {
+        long parent = (i-1)/2;
+        if (!zsetopresBefore(heap+parent,heap+i,rev)) break;
+        zsetopres tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Lower bound of the (REV adjusted) aggregated score of any element that
+ * was not read yet from the inputs. 'frontier[j]' is the adjusted weighted
+ * score of the last element read from src[j]: since the inputs are read in
+ * the reply order, the elements not read yet can't come before it. Inputs
+ * marked as 'done' were fully read. Returns -inf when no bound is known. */
+static double zunionInterUnseenBound(long setnum, double *frontier,
+                                     char *done, int op, int aggregate)
+{
+    double bound = 0, min = INFINITY, max = -INFINITY;
+    int j, seen = 0;
+
+    for (j = 0; j < setnum; j++) {
+        if (done[j]) continue;
+        double f = frontier[j];
+        if (aggregate == REDIS_AGGR_SUM) {
+            /* An element missing from a union input adds nothing. */
+            if (isinf(f)) return -INFINITY;
+            bound += (op == SET_OP_UNION && f > 0) ? 0 : f;
+        }
+        if (f < min) min = f;
+        if (f > max) max = f;
+        seen++;
+    }
+    if (!seen) return -INFINITY;
+
+    if (aggregate == REDIS_AGGR_SUM) {
+        /* With no negative term the element still has one of the scores. */
+        return (op == SET_OP_UNION && bound == 0) ? min : bound;
+    } else if (aggregate == REDIS_AGGR_MAX && op == SET_OP_INTER) {
+        return max;
+    } else {
+        return min;
+    }
+}
+
+/* ZUNION / ZINTER: reply with the aggregated elements, from 'offset' and
+ * at most 'count' of them (all of them if 'count' is negative), without
+ * creating the destination sorted set.
+ *
+ * The inputs are read in parallel in the order of the reply, one element
+ * from each input at every round, and every element is aggregated by
+ * looking it up in the other inputs the first time it is found, the
+ * so called threshold algorithm. The best offset+count elements are kept
+ * in a bounded heap, and as soon as the heap is full and the elements
+ * still to read can't make it into the heap, we stop. Elements are
+ * remembered in a dictionary to only aggregate them once, so with a
+ * LIMIT the memory used depends on how much of the inputs we read and
+ * not on the size of the result. */
+static void zunionInterReply(client *c, zsetopsrc *src, long setnum, int op,
+                             int aggregate, int withscores, int rev,
+                             long offset, long count)
+{
+    zsetopres *heap = NULL;
+    long heaplen = 0, heapsize = 0, limit = 0;
+    double *frontier;
+    char *done;
+    dict *seen;
+    zsetopval zval;
+    int canstop = 1, oaggregate = aggregate;
+    long i, j;
+
+    if (offset < 0 || count == 0 ||
+        (op == SET_OP_INTER && zuiLength(&src[0]) == 0))
+    {
+        addReply(c,shared.emptyarray);
+        return;
+    }
+
+    /* Number of elements to keep, zero means all of them. */
+    if (count > 0) limit = (count > LONG_MAX-offset) ? LONG_MAX : offset+count;
+
+    /* Early stop needs the weighted scores to be monotonic while reading
+     * the inputs, NaN scores (inf * 0) break this. Negating the scores for
+     * REV swaps MIN and MAX. */
+    for (i = 0; i < setnum; i++) {
+        if (src[i].weight == 0 || isinf(src[i].weight)) canstop = 0;
+        /* Read every input in the order of its weighted scores. */
+        src[i].reverse = (src[i].weight >= 0) == rev;
+    }
+    if (rev && aggregate == REDIS_AGGR_MIN) oaggregate = REDIS_AGGR_MAX;
+    else if (rev && aggregate == REDIS_AGGR_MAX) oaggregate = REDIS_AGGR_MIN;
+
+    frontier = zmalloc(sizeof(double)*setnum);
+    done = zcalloc(setnum);
+    seen = dictCreate(&setDictType,NULL);
+    memset(&zval, 0, sizeof(zval));
+    for (i = 0; i < setnum; i++) {
+        if (zuiLength(&src[i]) == 0) done[i] = 1;
+        else zuiInitIterator(&src[i]);
+    }
+
+    while (1) {
+        int active = 0, stop = 0;
+
+        for (i = 0; i < setnum && !stop; i++) {
+            double score, value;
+            int found = 0;
+            zsetopres res;
+
+            if (done[i]) continue;
+            if (!zuiNext(&src[i],&zval)) {
+                done[i] = 1;
+                /* Elements not read yet are missing from this input. */
+                if (op == SET_OP_INTER) stop = 1;
+                continue;
+            }
+            active = 1;
+
+            value = src[i].weight * zval.score;
+            if (isnan(value)) value = 0;
+            frontier[i] = rev ? -value : value;
+            if (dictFind(seen,zuiSdsFromValue(&zval)) != NULL) continue;
+
+            /* Aggregate in the same order used by ZUNIONSTORE/ZINTERSTORE,
+             * so that the same sums are computed. */
+            score = 0;
+            for (j = 0; j < setnum; j++) {
+                if (j == i || src[j].subject == src[i].subject) {
+                    value = zval.score*src[j].weight;
+                } else if (zuiFind(&src[j],&zval,&value)) {
+                    value *= src[j].weight;
+                } else if (op == SET_OP_INTER) {
+                    break;
+                } else {
+                    continue;
+                }
+                /* Like ZUNIONSTORE, a NaN weighted score (inf * 0) counts as
+                 * zero for every input of a union. ZINTERSTORE only does it
+                 * for the first input. */
+                if (isnan(value) && (!found || op == SET_OP_UNION)) value = 0;
+                if (!found) {
+                    score = value;
+                    found = 1;
+                } else {
+                    zunionInterAggregate(&score,value,aggregate);
+                }
+            }
+            /* The heap references the strings owned by the dictionary. */
+            res.ele = zuiNewSdsFromValue(&zval);
+            dictAdd(seen,res.ele,NULL);
+            if (j != setnum) continue; /* Not in every input. */
+
+            res.order = rev ? -score : score;
+            if (limit && heaplen == limit) {
+                if (!zsetopresBefore(&res,heap,rev)) continue;
+                heap[0] = res;
+                zsetopresSiftDown(heap,heaplen,0,rev);
+            } else {
+                if (heaplen == heapsize) {
+                    heapsize = heapsize ? heapsize*2 : 16;
+                    if (limit && heapsize > limit) heapsize = limit;
+                    heap = zrealloc(heap,sizeof(zsetopres)*heapsize);
+                }
+                heap[heaplen++] = res;
+                zsetopresSiftUp(heap,heaplen-1,rev);
+            }
+        }
+        if (!active || stop) break;
+
+        /* Nothing we did not read yet can still enter the heap? */
+        if (canstop && limit && heaplen == limit &&
+            zunionInterUnseenBound(setnum,frontier,done,op,oaggregate) >
+            heap[0].order) break;
+    }
+
+    for (i = 0; i < setnum; i++)
+        if (zuiLength(&src[i]) != 0) zuiClearIterator(&src[i]);
+    if (zval.flags & OPVAL_DIRTY_SDS) sdsfree(zval.ele);
+
+    /* Sort the heap in place: the root is moved to the end every time. */
+    for (i = heaplen-1; i > 0; i--) {
+        zsetopres tmp = heap[0];
+        heap[0] = heap[i];
+        heap[i] = tmp;
+        zsetopresSiftDown(heap,i,0,rev);
+    }
+
+    count = (offset >= heaplen) ? 0 : heaplen-offset;
+    if (withscores && c->resp == 2)
+        addReplyArrayLen(c,count*2);
+    else
+        addReplyArrayLen(c,count);
+    for (i = offset; i < heaplen; i++) {
+        if (withscores && c->resp > 2) addReplyArrayLen(c,2);
+        addReplyBulkCBuffer(c,heap[i].ele,sdslen(heap[i].ele));
+        if (withscores) addReplyDouble(c,rev ? -heap[i].order : heap[i].order);
+    }
+
+    zfree(heap);
+    zfree(frontier);
+    zfree(done);
+    dictRelease(seen);
+}
+
+/* Implements ZUNIONSTORE / ZINTERSTORE when 'dstkey' is given, and the
+ * read only ZUNION / ZINTER otherwise. 'numkeysIndex' is the position of
+ * the numkeys argument. */
+void zunionInterGenericCommand(client *c, robj *dstkey, int numkeysIndex, int op) {
     int i, j;
     long setnum;
     int aggregate = REDIS_AGGR_SUM;
+    int withscores = 0, rev = 0;
+    long offset = 0, count = -1;
     zsetopsrc *src;
     zsetopval zval;
     sds tmp;
     size_t maxelelen = 0;
     robj *dstobj;
     zset *dstzset;
-    zskiplistNode *znode;
     int touched = 0;
 
     /* expect setnum input keys to be given */
-    if ((getLongFromObjectOrReply(c, c->argv[2], &setnum, NULL) != C_OK))
+    if ((getLongFromObjectOrReply(c, c->argv[numkeysIndex], &setnum, NULL) != C_OK))
         return;
 
     if (setnum < 1) {
-        addReplyError(c,
-            "at least 1 input key is needed for ZUNIONSTORE/ZINTERSTORE");
+        addReplyError(c, dstkey ?
+            "at least 1 input key is needed for ZUNIONSTORE/ZINTERSTORE" :
+            "at least 1 input key is needed for ZUNION/ZINTER");
         return;
     }
 
     /* test if the expected number of keys would overflow */
-    if (setnum > c->argc-3) {
+    if (setnum > c->argc-(numkeysIndex+1)) {
         addReply(c,shared.syntaxerr);
         return;
     }
 
     /* read keys to be used for input */
     src = zcalloc(sizeof(zsetopsrc) * setnum);
-    for (i = 0, j = 3; i < setnum; i++, j++) {
-        robj *obj = lookupKeyWrite(c->db,c->argv[j]);
+    for (i = 0, j = numkeysIndex+1; i < setnum; i++, j++) {
+        robj *obj = dstkey ? lookupKeyWrite(c->db,c->argv[j]) :
+                             lookupKeyRead(c->db,c->argv[j]);
         if (obj != NULL) {
             if (obj->type != OBJ_ZSET && obj->type != OBJ_SET) {
                 zfree(src);
@@ -2506,6 +3106,28 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                     return;
                 }
                 j++; remaining--;
+            } else if (!dstkey &&
+                       !strcasecmp(c->argv[j]->ptr,"withscores"))
+            {
+                j++; remaining--;
+                withscores = 1;
+            } else if (!dstkey &&
+                       !strcasecmp(c->argv[j]->ptr,"rev"))
+            {
+                j++; remaining--;
+                rev = 1;
+            } else if (!dstkey && remaining >= 3 &&
+                       !strcasecmp(c->argv[j]->ptr,"limit"))
+            {
+                if ((getLongFromObjectOrReply(c,c->argv[j+1],&offset,NULL)
+                     != C_OK) ||
+                    (getLongFromObjectOrReply(c,c->argv[j+2],&count,NULL)
+                     != C_OK))
+                {
+                    zfree(src);
+                    return;
+                }
+                j += 3; remaining -= 3;
             } else {
                 zfree(src);
                 addReply(c,shared.syntaxerr);
@@ -2518,6 +3140,13 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
+    if (!dstkey) {
+        zunionInterReply(c,src,setnum,op,aggregate,withscores,rev,
+                         offset,count);
+        zfree(src);
+        return;
+    }
+
     dstobj = createZsetObject();
     dstzset = dstobj->ptr;
     memset(&zval, 0, sizeof(zval));
@@ -2551,8 +3180,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 /* Only continue when present in every input. */
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    zsetInsert(dstzset,score,tmp);
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                 }
             }
@@ -2617,8 +3245,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
             score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+            zsetInsert(dstzset,score,ele);
         }
         dictReleaseIterator(di);
         dictRelease(accumulator);
@@ -2628,7 +3255,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
 
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
+    if (zsetLength(dstobj)) {
         zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
@@ -2650,11 +3277,37 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
 }
 
 void zunionstoreCommand(client *c) {
-    zunionInterGenericCommand(c,c->argv[1], SET_OP_UNION);
+    zunionInterGenericCommand(c,c->argv[1],2,SET_OP_UNION);
 }
 
 void zinterstoreCommand(client *c) {
-    zunionInterGenericCommand(c,c->argv[1], SET_OP_INTER);
+    zunionInterGenericCommand(c,c->argv[1],2,SET_OP_INTER);
+}
+
+void zunionCommand(client *c) {
+    zunionInterGenericCommand(c,NULL,1,SET_OP_UNION);
+}
+
+void zinterCommand(client *c) {
+    zunionInterGenericCommand(c,NULL,1,SET_OP_INTER);
+}
+
+/* Move the btree iterator 'offset' elements forward, or backward if 'reverse'
+ * is true, for the LIMIT option of the range commands. Other encodings walk
+ * the elements one by one, here we jump using the ranks. Returns 0 if the
+ * iterator moved past the first or last element (or if the offset is
+ * negative, that never returns elements). */
+static int zbtSkip(zbtree *zbt, zbtreeIter *it, long offset, int reverse) {
+    unsigned long rank;
+
+    if (offset == 0) return 1;
+    if (offset < 0) return 0;
+    rank = zbtGetRank(zbt,zbtIterScore(it),zbtIterEle(it));
+    if (reverse) {
+        if ((unsigned long)offset >= rank) return 0;
+        return zbtSeekRank(zbt,rank-offset,it);
+    }
+    return zbtSeekRank(zbt,rank+offset,it);
 }
 
 void zrangeGenericCommand(client *c, int reverse) {
@@ -2759,6 +3412,21 @@ void zrangeGenericCommand(client *c, int reverse) {
             if (withscores) addReplyDouble(c,ln->score);
             ln = reverse ? ln->backward : ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        sds ele;
+        int found;
+
+        found = zbtSeekRank(zs->zbt,reverse ? llen-start : start+1,&it);
+        while(rangelen--) {
+            serverAssertWithInfo(c,zobj,found);
+            ele = zbtIterEle(&it);
+            if (withscores && c->resp > 2) addReplyArrayLen(c,2);
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            if (withscores) addReplyDouble(c,zbtIterScore(&it));
+            found = reverse ? zbtPrev(&it) : zbtNext(&it);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2950,6 +3618,47 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        int found;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            found = zbtLastInRange(zs->zbt,&range,&it);
+        } else {
+            found = zbtFirstInRange(zs->zbt,&range,&it);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!found) {
+            addReply(c,shared.emptyarray);
+            return;
+        }
+
+        replylen = addReplyDeferredLen(c);
+
+        /* The offset is skipped in O(log(N)) using the ranks. */
+        found = zbtSkip(zs->zbt,&it,offset,reverse);
+
+        while (found && limit--) {
+            double score = zbtIterScore(&it);
+            sds ele = zbtIterEle(&it);
+
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(score,&range)) break;
+            } else {
+                if (!zslValueLteMax(score,&range)) break;
+            }
+
+            rangelen++;
+            if (withscores && c->resp > 2) addReplyArrayLen(c,2);
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            if (withscores) addReplyDouble(c,score);
+
+            found = reverse ? zbtPrev(&it) : zbtNext(&it);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -3036,6 +3745,18 @@ void zcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset*)zobj->ptr)->zbt;
+        zbtreeIter first, last;
+
+        /* The count is the difference between the ranks of the first and
+         * last elements in range. */
+        if (zbtFirstInRange(zbt,&range,&first) &&
+            zbtLastInRange(zbt,&range,&last))
+        {
+            count = zbtGetRank(zbt,zbtIterScore(&last),zbtIterEle(&last)) -
+                    zbtGetRank(zbt,zbtIterScore(&first),zbtIterEle(&first))+1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -3114,6 +3835,16 @@ void zlexcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset*)zobj->ptr)->zbt;
+        zbtreeIter first, last;
+
+        if (zbtFirstInLexRange(zbt,&range,&first) &&
+            zbtLastInLexRange(zbt,&range,&last))
+        {
+            count = zbtGetRank(zbt,zbtIterScore(&last),zbtIterEle(&last)) -
+                    zbtGetRank(zbt,zbtIterScore(&first),zbtIterEle(&first))+1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -3294,6 +4025,42 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        int found;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            found = zbtLastInLexRange(zs->zbt,&range,&it);
+        } else {
+            found = zbtFirstInLexRange(zs->zbt,&range,&it);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!found) {
+            addReply(c,shared.emptyarray);
+            zslFreeLexRange(&range);
+            return;
+        }
+
+        replylen = addReplyDeferredLen(c);
+        found = zbtSkip(zs->zbt,&it,offset,reverse);
+
+        while (found && limit--) {
+            sds ele = zbtIterEle(&it);
+
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zslLexValueGteMin(ele,&range)) break;
+            } else {
+                if (!zslLexValueLteMax(ele,&range)) break;
+            }
+
+            rangelen++;
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            found = reverse ? zbtPrev(&it) : zbtNext(&it);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -3455,6 +4222,19 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             serverAssertWithInfo(c,zobj,zln != NULL);
             ele = sdsdup(zln->ele);
             score = zln->score;
+        } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = zobj->ptr;
+            zbtreeIter it;
+            int found;
+
+            /* Get the first or last element in the sorted set. */
+            found = where == ZSET_MAX ? zbtSeekLast(zs->zbt,&it) :
+                                        zbtSeekFirst(zs->zbt,&it);
+
+            /* There must be an element in the sorted set. */
+            serverAssertWithInfo(c,zobj,found);
+            ele = sdsdup(zbtIterEle(&it));
+            score = zbtIterScore(&it);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
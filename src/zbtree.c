@@ -0,0 +1,843 @@
+/*
+ * B+-tree encoding of big sorted sets.
+ *
+ * Copyright (c) 2026, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* B+-tree of (score, ele) pairs with subtree counts, used as an alternative
+ * to the skiplist for big sorted sets.
+ *
+ * Entries are kept sorted by score and then by ele (binary comparison), the
+ * same order of the skiplist. Leaves store up to ZBTREE_LEAF_ENTRIES entries
+ * in a flat array and are chained in a doubly linked list, inner nodes store
+ * for every child its smallest entry and the number of entries below it.
+ * This allows:
+ *
+ *  - Lookups, insertions and deletions in O(log(N)), touching a handful of
+ *    contiguous nodes instead of one allocation per element.
+ *  - Rank computation and access by rank in O(log(N)) using the counts.
+ *  - Ranges walked in both directions through the leaves chain.
+ *
+ * Every node but the root and the first and last leaves is kept at least
+ * half full: when a deletion leaves a node under this limit it is merged
+ * with, or takes entries from, one of its siblings. The cost per element is about 16 bytes in the leaves
+ * (plus the unused slots), against a skiplist node of 40 bytes or more.
+ *
+ * The tree owns the SDS strings of the entries: they are freed when the
+ * entry is deleted or the tree released. The copies of the smallest entries
+ * in the inner nodes just reference the same strings. */
+
+#include <string.h>
+#include "zbtree.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+#define ZBTREE_LEAF_MIN (ZBTREE_LEAF_ENTRIES/2)
+#define ZBTREE_INNER_MIN (ZBTREE_INNER_CHILDREN/2)
+
+static inline int zbtCompare(double score, sds ele, const zbtreeEntry *e) {
+    if (score < e->score) return -1;
+    if (score > e->score) return 1;
+    return sdscmp(ele,e->ele);
+}
+
+static zbtreeLeaf *zbtCreateLeaf(zbtree *t) {
+    zbtreeLeaf *l = zmalloc(sizeof(*l));
+    l->hdr.leaf = 1;
+    l->hdr.len = 0;
+    l->prev = l->next = NULL;
+    t->leaves++;
+    return l;
+}
+
+static zbtreeInner *zbtCreateInner(zbtree *t) {
+    zbtreeInner *in = zmalloc(sizeof(*in));
+    in->hdr.leaf = 0;
+    in->hdr.len = 0;
+    t->inners++;
+    return in;
+}
+
+static inline zbtreeEntry *zbtNodeMin(zbtreeNode *n) {
+    if (n->leaf) return ((zbtreeLeaf*)n)->entries;
+    return ((zbtreeInner*)n)->min;
+}
+
+static unsigned long zbtNodeCount(zbtreeNode *n) {
+    if (n->leaf) return n->len;
+    zbtreeInner *in = (zbtreeInner*)n;
+    unsigned long count = 0;
+    for (unsigned int j = 0; j < in->hdr.len; j++) count += in->count[j];
+    return count;
+}
+
+zbtree *zbtCreate(void) {
+    zbtree *t = zmalloc(sizeof(*t));
+    t->length = 0;
+    t->leaves = t->inners = 0;
+    t->height = 1;
+    t->head = t->tail = zbtCreateLeaf(t);
+    t->root = (zbtreeNode*)t->head;
+    return t;
+}
+
+static void zbtFreeNode(zbtreeNode *n) {
+    if (n->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)n;
+        for (unsigned int j = 0; j < l->hdr.len; j++)
+            sdsfree(l->entries[j].ele);
+    } else {
+        zbtreeInner *in = (zbtreeInner*)n;
+        for (unsigned int j = 0; j < in->hdr.len; j++)
+            zbtFreeNode(in->child[j]);
+    }
+    zfree(n);
+}
+
+void zbtFree(zbtree *t) {
+    zbtFreeNode(t->root);
+    zfree(t);
+}
+
+/* Return the position of the first entry of the leaf not smaller than
+ * (score, ele), or the number of entries if there is none. */
+static int zbtLeafLowerBound(zbtreeLeaf *l, double score, sds ele) {
+    int min = 0, max = l->hdr.len;
+
+    while (min < max) {
+        int mid = (min+max) >> 1;
+        if (zbtCompare(score,ele,l->entries+mid) > 0)
+            min = mid+1;
+        else
+            max = mid;
+    }
+    return min;
+}
+
+/* Return the index of the child of 'in' that may contain (score, ele), that
+ * is the last child whose smallest entry is not greater than the searched
+ * one. Return -1 if (score, ele) is smaller than every entry of the node. */
+static int zbtInnerChildIndex(zbtreeInner *in, double score, sds ele) {
+    int min = 0, max = in->hdr.len;
+
+    while (min < max) {
+        int mid = (min+max) >> 1;
+        if (zbtCompare(score,ele,in->min+mid) >= 0)
+            min = mid+1;
+        else
+            max = mid;
+    }
+    return min-1;
+}
+
+static void zbtLeafInsertAt(zbtreeLeaf *l, int pos, double score, sds ele) {
+    memmove(l->entries+pos+1,l->entries+pos,
+            sizeof(zbtreeEntry)*(l->hdr.len-pos));
+    l->entries[pos].score = score;
+    l->entries[pos].ele = ele;
+    l->hdr.len++;
+}
+
+static void zbtInnerInsertAt(zbtreeInner *in, int pos, zbtreeNode *child) {
+    int tail = in->hdr.len-pos;
+    memmove(in->min+pos+1,in->min+pos,sizeof(zbtreeEntry)*tail);
+    memmove(in->count+pos+1,in->count+pos,sizeof(unsigned long)*tail);
+    memmove(in->child+pos+1,in->child+pos,sizeof(zbtreeNode*)*tail);
+    in->min[pos] = *zbtNodeMin(child);
+    in->count[pos] = zbtNodeCount(child);
+    in->child[pos] = child;
+    in->hdr.len++;
+}
+
+static void zbtInnerRemoveAt(zbtreeInner *in, int pos) {
+    int tail = in->hdr.len-pos-1;
+    memmove(in->min+pos,in->min+pos+1,sizeof(zbtreeEntry)*tail);
+    memmove(in->count+pos,in->count+pos+1,sizeof(unsigned long)*tail);
+    memmove(in->child+pos,in->child+pos+1,sizeof(zbtreeNode*)*tail);
+    in->hdr.len--;
+}
+
+/* Insert the entry in the subtree rooted at 'n'. If the node had to be
+ * split, the new right sibling is returned, otherwise NULL. */
+static zbtreeNode *zbtInsertNode(zbtree *t, zbtreeNode *n, double score, sds ele) {
+    if (n->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)n, *r;
+        int pos = zbtLeafLowerBound(l,score,ele);
+        int half = ZBTREE_LEAF_ENTRIES/2;
+
+        if (l->hdr.len < ZBTREE_LEAF_ENTRIES) {
+            zbtLeafInsertAt(l,pos,score,ele);
+            return NULL;
+        }
+
+        /* Split the full leaf in two halves and link the new one. When
+         * appending past the last leaf, or prepending before the first one,
+         * leave the full leaf alone instead: elements are often added in
+         * order (loading, conversions) and this keeps the leaves full. */
+        if (pos == ZBTREE_LEAF_ENTRIES && l->next == NULL)
+            half = ZBTREE_LEAF_ENTRIES;
+        else if (pos == 0 && l->prev == NULL)
+            half = 0;
+        r = zbtCreateLeaf(t);
+        memcpy(r->entries,l->entries+half,
+               sizeof(zbtreeEntry)*(ZBTREE_LEAF_ENTRIES-half));
+        r->hdr.len = ZBTREE_LEAF_ENTRIES-half;
+        l->hdr.len = half;
+        r->prev = l;
+        r->next = l->next;
+        if (l->next) l->next->prev = r; else t->tail = r;
+        l->next = r;
+        if (pos <= half && half < ZBTREE_LEAF_ENTRIES)
+            zbtLeafInsertAt(l,pos,score,ele);
+        else
+            zbtLeafInsertAt(r,pos-half,score,ele);
+        return (zbtreeNode*)r;
+    } else {
+        zbtreeInner *in = (zbtreeInner*)n, *r;
+        int i = zbtInnerChildIndex(in,score,ele);
+        int half = ZBTREE_INNER_CHILDREN/2;
+        zbtreeNode *split;
+
+        if (i < 0) i = 0;
+        split = zbtInsertNode(t,in->child[i],score,ele);
+        in->min[i] = *zbtNodeMin(in->child[i]);
+        if (split == NULL) {
+            in->count[i]++;
+            return NULL;
+        }
+        in->count[i] = zbtNodeCount(in->child[i]);
+        if (in->hdr.len < ZBTREE_INNER_CHILDREN) {
+            zbtInnerInsertAt(in,i+1,split);
+            return NULL;
+        }
+
+        /* No room for the new child: split this node as well. */
+        r = zbtCreateInner(t);
+        r->hdr.len = ZBTREE_INNER_CHILDREN-half;
+        memcpy(r->min,in->min+half,sizeof(zbtreeEntry)*r->hdr.len);
+        memcpy(r->count,in->count+half,sizeof(unsigned long)*r->hdr.len);
+        memcpy(r->child,in->child+half,sizeof(zbtreeNode*)*r->hdr.len);
+        in->hdr.len = half;
+        if (i+1 <= half)
+            zbtInnerInsertAt(in,i+1,split);
+        else
+            zbtInnerInsertAt(r,i+1-half,split);
+        return (zbtreeNode*)r;
+    }
+}
+
+/* Insert a new entry. The caller must make sure the element is not already
+ * in the tree. The SDS string is owned by the tree after the call. */
+void zbtInsert(zbtree *t, double score, sds ele) {
+    zbtreeNode *split = zbtInsertNode(t,t->root,score,ele);
+
+    if (split) {
+        zbtreeInner *root = zbtCreateInner(t);
+        zbtInnerInsertAt(root,0,t->root);
+        zbtInnerInsertAt(root,1,split);
+        t->root = (zbtreeNode*)root;
+        t->height++;
+    }
+    t->length++;
+}
+
+/* Fix the child at index 'i' of 'in' after a deletion left it with too few
+ * entries, merging it with a sibling or moving entries from it. */
+static void zbtRebalance(zbtree *t, zbtreeInner *in, int i) {
+    zbtreeNode *c = in->child[i], *a, *b;
+    unsigned int min = c->leaf ? ZBTREE_LEAF_MIN : ZBTREE_INNER_MIN;
+    unsigned int cap = c->leaf ? ZBTREE_LEAF_ENTRIES : ZBTREE_INNER_CHILDREN;
+    int left;
+
+    if (c->len >= min || in->hdr.len == 1) return;
+    left = i > 0 ? i-1 : i;
+    a = in->child[left];
+    b = in->child[left+1];
+
+    if ((unsigned int)(a->len+b->len) <= cap) {
+        /* Merge 'b' into 'a' and drop 'b'. */
+        if (a->leaf) {
+            zbtreeLeaf *la = (zbtreeLeaf*)a, *lb = (zbtreeLeaf*)b;
+            memcpy(la->entries+la->hdr.len,lb->entries,
+                   sizeof(zbtreeEntry)*lb->hdr.len);
+            la->next = lb->next;
+            if (lb->next) lb->next->prev = la; else t->tail = la;
+            t->leaves--;
+        } else {
+            zbtreeInner *ia = (zbtreeInner*)a, *ib = (zbtreeInner*)b;
+            memcpy(ia->min+ia->hdr.len,ib->min,sizeof(zbtreeEntry)*ib->hdr.len);
+            memcpy(ia->count+ia->hdr.len,ib->count,
+                   sizeof(unsigned long)*ib->hdr.len);
+            memcpy(ia->child+ia->hdr.len,ib->child,
+                   sizeof(zbtreeNode*)*ib->hdr.len);
+            t->inners--;
+        }
+        a->len += b->len;
+        in->count[left] += in->count[left+1];
+        in->min[left] = *zbtNodeMin(a);
+        zbtInnerRemoveAt(in,left+1);
+        zfree(b);
+        return;
+    }
+
+    /* Too many entries for a single node: split them evenly. */
+    unsigned int total = a->len+b->len, alen = total/2;
+    if (a->leaf) {
+        zbtreeLeaf *la = (zbtreeLeaf*)a, *lb = (zbtreeLeaf*)b;
+        if (la->hdr.len > alen) {
+            unsigned int move = la->hdr.len-alen;
+            memmove(lb->entries+move,lb->entries,sizeof(zbtreeEntry)*lb->hdr.len);
+            memcpy(lb->entries,la->entries+alen,sizeof(zbtreeEntry)*move);
+        } else {
+            unsigned int move = alen-la->hdr.len;
+            memcpy(la->entries+la->hdr.len,lb->entries,sizeof(zbtreeEntry)*move);
+            memmove(lb->entries,lb->entries+move,
+                    sizeof(zbtreeEntry)*(lb->hdr.len-move));
+        }
+    } else {
+        zbtreeInner *ia = (zbtreeInner*)a, *ib = (zbtreeInner*)b;
+        if (ia->hdr.len > alen) {
+            unsigned int move = ia->hdr.len-alen, blen = ib->hdr.len;
+            memmove(ib->min+move,ib->min,sizeof(zbtreeEntry)*blen);
+            memmove(ib->count+move,ib->count,sizeof(unsigned long)*blen);
+            memmove(ib->child+move,ib->child,sizeof(zbtreeNode*)*blen);
+            memcpy(ib->min,ia->min+alen,sizeof(zbtreeEntry)*move);
+            memcpy(ib->count,ia->count+alen,sizeof(unsigned long)*move);
+            memcpy(ib->child,ia->child+alen,sizeof(zbtreeNode*)*move);
+        } else {
+            unsigned int move = alen-ia->hdr.len, rest = ib->hdr.len-move;
+            unsigned int alen_old = ia->hdr.len;
+            memcpy(ia->min+alen_old,ib->min,sizeof(zbtreeEntry)*move);
+            memcpy(ia->count+alen_old,ib->count,sizeof(unsigned long)*move);
+            memcpy(ia->child+alen_old,ib->child,sizeof(zbtreeNode*)*move);
+            memmove(ib->min,ib->min+move,sizeof(zbtreeEntry)*rest);
+            memmove(ib->count,ib->count+move,sizeof(unsigned long)*rest);
+            memmove(ib->child,ib->child+move,sizeof(zbtreeNode*)*rest);
+        }
+    }
+    a->len = alen;
+    b->len = total-alen;
+    in->count[left] = zbtNodeCount(a);
+    in->count[left+1] = zbtNodeCount(b);
+    in->min[left] = *zbtNodeMin(a);
+    in->min[left+1] = *zbtNodeMin(b);
+}
+
+/* Delete the entry from the subtree rooted at 'n'. Return 1 if the entry
+ * was found, 0 otherwise. */
+static int zbtDeleteNode(zbtree *t, zbtreeNode *n, double score, sds ele, sds *deleted) {
+    if (n->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)n;
+        int pos = zbtLeafLowerBound(l,score,ele);
+
+        if (pos == (int)l->hdr.len ||
+            zbtCompare(score,ele,l->entries+pos) != 0) return 0;
+        if (deleted)
+            *deleted = l->entries[pos].ele;
+        else
+            sdsfree(l->entries[pos].ele);
+        memmove(l->entries+pos,l->entries+pos+1,
+                sizeof(zbtreeEntry)*(l->hdr.len-pos-1));
+        l->hdr.len--;
+        return 1;
+    } else {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int i = zbtInnerChildIndex(in,score,ele);
+
+        if (i < 0 || !zbtDeleteNode(t,in->child[i],score,ele,deleted))
+            return 0;
+        in->count[i]--;
+        if (in->child[i]->len) in->min[i] = *zbtNodeMin(in->child[i]);
+        zbtRebalance(t,in,i);
+        return 1;
+    }
+}
+
+/* Delete the entry matching both score and ele. Return 1 if the entry was
+ * found and removed, 0 otherwise.
+ *
+ * If 'deleted' is NULL the SDS string of the entry is freed, otherwise it is
+ * stored into '*deleted' and the caller is responsible for it. */
+int zbtDelete(zbtree *t, double score, sds ele, sds *deleted) {
+    if (!zbtDeleteNode(t,t->root,score,ele,deleted)) return 0;
+    t->length--;
+
+    /* Shrink the tree when the root is left with a single child. */
+    if (!t->root->leaf && t->root->len == 1) {
+        zbtreeInner *root = (zbtreeInner*)t->root;
+        t->root = root->child[0];
+        t->height--;
+        t->inners--;
+        zfree(root);
+    }
+    return 1;
+}
+
+/* Update the score of an element that must exist in the tree with score
+ * 'curscore'. When the new score keeps the element in the same position
+ * of the same leaf it is updated in place, otherwise the entry is removed
+ * and inserted again, reusing the same SDS string. */
+void zbtUpdateScore(zbtree *t, double curscore, sds ele, double newscore) {
+    zbtreeNode *n = t->root;
+    sds stored;
+    int found;
+
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int i = zbtInnerChildIndex(in,curscore,ele);
+        assert(i >= 0);
+        n = in->child[i];
+    }
+
+    zbtreeLeaf *l = (zbtreeLeaf*)n;
+    int pos = zbtLeafLowerBound(l,curscore,ele);
+    assert(pos < (int)l->hdr.len &&
+                 zbtCompare(curscore,ele,l->entries+pos) == 0);
+
+    /* The smallest entry of the leaf is also referenced by the inner nodes,
+     * so we never update it in place. */
+    if (pos > 0 && pos+1 < (int)l->hdr.len &&
+        zbtCompare(newscore,ele,l->entries+pos-1) > 0 &&
+        zbtCompare(newscore,ele,l->entries+pos+1) < 0)
+    {
+        l->entries[pos].score = newscore;
+        return;
+    }
+
+    found = zbtDelete(t,curscore,ele,&stored);
+    assert(found);
+    zbtInsert(t,newscore,stored);
+}
+
+/* Find the rank for an element by both score and ele. Return 0 when the
+ * element cannot be found, the rank (starting from 1) otherwise, like
+ * zslGetRank(). */
+unsigned long zbtGetRank(zbtree *t, double score, sds ele) {
+    zbtreeNode *n = t->root;
+    unsigned long rank = 0;
+
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int i = zbtInnerChildIndex(in,score,ele);
+        if (i < 0) return 0;
+        for (int j = 0; j < i; j++) rank += in->count[j];
+        n = in->child[i];
+    }
+
+    zbtreeLeaf *l = (zbtreeLeaf*)n;
+    int pos = zbtLeafLowerBound(l,score,ele);
+    if (pos == (int)l->hdr.len || zbtCompare(score,ele,l->entries+pos) != 0)
+        return 0;
+    return rank+pos+1;
+}
+
+/* Position the iterator at the element with the given rank (starting from
+ * 1). Return 0 if the rank is out of range. */
+int zbtSeekRank(zbtree *t, unsigned long rank, zbtreeIter *it) {
+    zbtreeNode *n = t->root;
+
+    if (rank == 0 || rank > t->length) return 0;
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int i = 0;
+        while (rank > in->count[i]) rank -= in->count[i++];
+        n = in->child[i];
+    }
+    it->leaf = (zbtreeLeaf*)n;
+    it->pos = rank-1;
+    return 1;
+}
+
+int zbtSeekFirst(zbtree *t, zbtreeIter *it) {
+    if (t->length == 0) return 0;
+    it->leaf = t->head;
+    it->pos = 0;
+    return 1;
+}
+
+int zbtSeekLast(zbtree *t, zbtreeIter *it) {
+    if (t->length == 0) return 0;
+    it->leaf = t->tail;
+    it->pos = t->tail->hdr.len-1;
+    return 1;
+}
+
+/* Position the iterator at the first entry matching 'gte', a predicate
+ * which is false for a (possibly empty) prefix of the entries and true for
+ * all the rest, such as "score >= min". Return 0 if no entry matches. */
+int zbtSeekFirstMatch(zbtree *t, zbtreePredicate *gte, void *privdata, zbtreeIter *it) {
+    zbtreeNode *n = t->root;
+
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int min = 0, max = in->hdr.len;
+
+        /* Go down in the last child whose smallest entry does not match:
+         * if the child has no matching entry, the first match is the first
+         * entry of the next leaf. */
+        while (min < max) {
+            int mid = (min+max) >> 1;
+            if (gte(in->min[mid].score,in->min[mid].ele,privdata))
+                max = mid;
+            else
+                min = mid+1;
+        }
+        n = in->child[min > 0 ? min-1 : 0];
+    }
+
+    zbtreeLeaf *l = (zbtreeLeaf*)n;
+    int min = 0, max = l->hdr.len;
+    while (min < max) {
+        int mid = (min+max) >> 1;
+        if (gte(l->entries[mid].score,l->entries[mid].ele,privdata))
+            max = mid;
+        else
+            min = mid+1;
+    }
+    if (min == (int)l->hdr.len) {
+        if (l->next == NULL) return 0;
+        l = l->next;
+        min = 0;
+    }
+    it->leaf = l;
+    it->pos = min;
+    return 1;
+}
+
+/* Position the iterator at the last entry matching 'lte', a predicate which
+ * is true for a (possibly empty) prefix of the entries and false for all the
+ * rest, such as "score <= max". Return 0 if no entry matches. */
+int zbtSeekLastMatch(zbtree *t, zbtreePredicate *lte, void *privdata, zbtreeIter *it) {
+    zbtreeNode *n = t->root;
+
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int min = 0, max = in->hdr.len;
+
+        /* Go down in the last child whose smallest entry matches. */
+        while (min < max) {
+            int mid = (min+max) >> 1;
+            if (lte(in->min[mid].score,in->min[mid].ele,privdata))
+                min = mid+1;
+            else
+                max = mid;
+        }
+        if (min == 0) return 0;
+        n = in->child[min-1];
+    }
+
+    zbtreeLeaf *l = (zbtreeLeaf*)n;
+    int min = 0, max = l->hdr.len;
+    while (min < max) {
+        int mid = (min+max) >> 1;
+        if (lte(l->entries[mid].score,l->entries[mid].ele,privdata))
+            min = mid+1;
+        else
+            max = mid;
+    }
+    if (min == 0) return 0;
+    it->leaf = l;
+    it->pos = min-1;
+    return 1;
+}
+
+/* Move the iterator to the next entry. Return 0 when there are no more
+ * entries, in which case the iterator is no longer valid. */
+int zbtNext(zbtreeIter *it) {
+    if (++it->pos < (int)it->leaf->hdr.len) return 1;
+    it->leaf = it->leaf->next;
+    it->pos = 0;
+    return it->leaf != NULL;
+}
+
+/* Move the iterator to the previous entry, see zbtNext(). */
+int zbtPrev(zbtreeIter *it) {
+    if (--it->pos >= 0) return 1;
+    it->leaf = it->leaf->prev;
+    if (it->leaf == NULL) return 0;
+    it->pos = it->leaf->hdr.len-1;
+    return 1;
+}
+
+/* Replace the SDS string of the entry (score, oldele) with 'newele', that
+ * must compare equal to it. Used by active defrag: 'oldele' may have been
+ * already freed, so it is only compared by address. Return 1 if the entry
+ * was found. */
+int zbtReplaceEle(zbtree *t, double score, sds oldele, sds newele) {
+    zbtreeNode *n = t->root;
+
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int i = in->hdr.len-1;
+
+        while (i > 0 && in->min[i].ele != oldele &&
+               zbtCompare(score,newele,in->min+i) < 0) i--;
+        if (in->min[i].ele == oldele) in->min[i].ele = newele;
+        n = in->child[i];
+    }
+
+    zbtreeLeaf *l = (zbtreeLeaf*)n;
+    for (unsigned int j = 0; j < l->hdr.len; j++) {
+        if (l->entries[j].ele == oldele) {
+            l->entries[j].ele = newele;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static long zbtDefragNode(zbtree *t, zbtreeNode **np, void *(*defragfn)(void *ptr)) {
+    zbtreeNode *newn;
+    long defragged = 0;
+
+    if ((newn = defragfn(*np))) {
+        defragged++;
+        *np = newn;
+        if (newn->leaf) {
+            zbtreeLeaf *l = (zbtreeLeaf*)newn;
+            if (l->prev) l->prev->next = l; else t->head = l;
+            if (l->next) l->next->prev = l; else t->tail = l;
+        }
+    }
+    if (!(*np)->leaf) {
+        zbtreeInner *in = (zbtreeInner*)*np;
+        for (unsigned int j = 0; j < in->hdr.len; j++)
+            defragged += zbtDefragNode(t,in->child+j,defragfn);
+    }
+    return defragged;
+}
+
+/* Try to move every node of the tree calling 'defragfn', that returns the
+ * new address of the node or NULL if it was not moved. Return the number
+ * of nodes moved. */
+long zbtDefragNodes(zbtree *t, void *(*defragfn)(void *ptr)) {
+    return zbtDefragNode(t,&t->root,defragfn);
+}
+
+/* Return the memory used by the nodes, not including the elements. */
+size_t zbtNodesAllocSize(const zbtree *t) {
+    return sizeof(*t)+t->leaves*sizeof(zbtreeLeaf)+
+           t->inners*sizeof(zbtreeInner);
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define UNUSED(x) (void)(x)
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Check the structural invariants of the subtree, returning the number of
+ * entries below 'n'. */
+static unsigned long zbtCheckNode(zbtree *t, zbtreeNode *n, int depth) {
+    if (n->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)n;
+        assert(depth == t->height);
+        if (l != t->head && l != t->tail) assert(n->len >= ZBTREE_LEAF_MIN);
+        for (unsigned int j = 1; j < l->hdr.len; j++)
+            assert(zbtCompare(l->entries[j].score,l->entries[j].ele,
+                              l->entries+j-1) > 0);
+        return n->len;
+    }
+    zbtreeInner *in = (zbtreeInner*)n;
+    unsigned long count = 0;
+    if (n != t->root) assert(n->len >= ZBTREE_INNER_MIN);
+    else assert(n->len >= 2);
+    for (unsigned int j = 0; j < in->hdr.len; j++) {
+        zbtreeEntry *min = zbtNodeMin(in->child[j]);
+        assert(in->min[j].score == min->score && in->min[j].ele == min->ele);
+        assert(zbtCheckNode(t,in->child[j],depth+1) == in->count[j]);
+        count += in->count[j];
+    }
+    return count;
+}
+
+static void zbtCheck(zbtree *t) {
+    zbtreeIter it;
+    unsigned long seen = 0;
+
+    assert(zbtCheckNode(t,t->root,1) == t->length);
+    if (zbtSeekFirst(t,&it)) {
+        double score = zbtIterScore(&it);
+        sds ele = zbtIterEle(&it);
+        seen++;
+        assert(zbtGetRank(t,score,ele) == 1);
+        while (zbtNext(&it)) {
+            assert(zbtCompare(zbtIterScore(&it),zbtIterEle(&it),
+                   &(zbtreeEntry){score,ele}) > 0);
+            score = zbtIterScore(&it);
+            ele = zbtIterEle(&it);
+            seen++;
+        }
+    }
+    assert(seen == t->length);
+}
+
+static int zbtTestScoreGte(double score, sds ele, void *privdata) {
+    UNUSED(ele);
+    return score >= *(double*)privdata;
+}
+
+static int zbtTestScoreLte(double score, sds ele, void *privdata) {
+    UNUSED(ele);
+    return score <= *(double*)privdata;
+}
+
+int zbtreeTest(int argc, char **argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+
+    printf("Insert, rank and delete: ");
+    {
+        zbtree *t = zbtCreate();
+        char buf[32];
+        int n = 100000;
+
+        /* Few distinct scores so that the order by ele is exercised. */
+        for (int j = 0; j < n; j++) {
+            snprintf(buf,sizeof(buf),"ele:%d",j);
+            zbtInsert(t,j%100,sdsnew(buf));
+        }
+        zbtCheck(t);
+        for (int j = 0; j < n; j++) {
+            zbtreeIter it;
+            unsigned long rank;
+            snprintf(buf,sizeof(buf),"ele:%d",j);
+            sds ele = sdsnew(buf);
+            rank = zbtGetRank(t,j%100,ele);
+            assert(rank != 0);
+            assert(zbtSeekRank(t,rank,&it));
+            assert(zbtIterScore(&it) == j%100 && !sdscmp(zbtIterEle(&it),ele));
+            assert(zbtGetRank(t,j%100+1,ele) == 0);
+            sdsfree(ele);
+        }
+        for (int j = 0; j < n; j += 2) {
+            snprintf(buf,sizeof(buf),"ele:%d",j);
+            sds ele = sdsnew(buf);
+            assert(zbtDelete(t,j%100,ele,NULL));
+            assert(!zbtDelete(t,j%100,ele,NULL));
+            sdsfree(ele);
+        }
+        assert(t->length == (unsigned long)n/2);
+        zbtCheck(t);
+        for (int j = 1; j < n; j += 2) {
+            snprintf(buf,sizeof(buf),"ele:%d",j);
+            sds ele = sdsnew(buf);
+            zbtUpdateScore(t,j%100,ele,-j);
+            sdsfree(ele);
+        }
+        zbtCheck(t);
+        for (int j = 1; j < n; j += 2) {
+            zbtreeIter it;
+            assert(zbtSeekRank(t,(n-j+1)/2,&it));
+            assert(zbtIterScore(&it) == -j);
+        }
+        while (t->length) {
+            zbtreeIter it;
+            assert(zbtSeekRank(t,rand()%t->length+1,&it));
+            assert(zbtDelete(t,zbtIterScore(&it),zbtIterEle(&it),NULL));
+            if (t->length % 1000 == 0) zbtCheck(t);
+        }
+        assert(t->height == 1 && t->leaves == 1 && t->inners == 0);
+        zbtFree(t);
+        printf("OK\n");
+    }
+
+    printf("Ordered insertion: ");
+    {
+        zbtree *t = zbtCreate();
+        for (int j = 0; j < 100000; j++) zbtInsert(t,j,sdsfromlonglong(j));
+        zbtCheck(t);
+        assert(t->leaves == (100000+ZBTREE_LEAF_ENTRIES-1)/ZBTREE_LEAF_ENTRIES);
+        for (int j = -1; j > -100000; j--) zbtInsert(t,j,sdsfromlonglong(j));
+        zbtCheck(t);
+        for (int j = 0; j < 100000; j++) {
+            sds ele = sdsfromlonglong(j);
+            assert(zbtDelete(t,j,ele,NULL));
+            sdsfree(ele);
+            if (j % 1000 == 0) zbtCheck(t);
+        }
+        zbtCheck(t);
+        zbtFree(t);
+        printf("OK\n");
+    }
+
+    printf("Range seek: ");
+    {
+        zbtree *t = zbtCreate();
+        zbtreeIter it;
+        double min, max;
+
+        for (int j = 0; j < 10000; j++) zbtInsert(t,j*2,sdsfromlonglong(j));
+        for (int j = 0; j < 1000; j++) {
+            min = rand()%20010-5;
+            assert(zbtSeekFirstMatch(t,zbtTestScoreGte,&min,&it) == (min <= 19998));
+            if (min <= 19998) {
+                assert(zbtIterScore(&it) >= min);
+                if (zbtPrev(&it)) assert(zbtIterScore(&it) < min);
+            }
+            max = rand()%20010-5;
+            assert(zbtSeekLastMatch(t,zbtTestScoreLte,&max,&it) == (max >= 0));
+            if (max >= 0) {
+                assert(zbtIterScore(&it) <= max);
+                if (zbtNext(&it)) assert(zbtIterScore(&it) > max);
+            }
+        }
+        zbtFree(t);
+        printf("OK\n");
+    }
+
+    printf("Benchmark zbtInsert/zbtGetRank: ");
+    {
+        zbtree *t = zbtCreate();
+        int n = 1000000;
+        long long start = usec();
+        for (int j = 0; j < n; j++)
+            zbtInsert(t,rand(),sdsfromlonglong(j));
+        zbtCheck(t);
+        for (int j = 0; j < n; j++) {
+            zbtreeIter it;
+            assert(zbtSeekRank(t,j+1,&it));
+            assert(zbtGetRank(t,zbtIterScore(&it),zbtIterEle(&it)) ==
+                   (unsigned long)j+1);
+        }
+        printf("%lld usec, %zu bytes of nodes\n",usec()-start,
+               zbtNodesAllocSize(t));
+        zbtFree(t);
+    }
+    return 0;
+}
+#endif
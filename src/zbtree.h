@@ -0,0 +1,114 @@
+/*
+ * B+-tree encoding of big sorted sets.
+ *
+ * Copyright (c) 2026, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+#include "sds.h"
+
+/* Node sizes are chosen so that both kinds of nodes fit in a 1024 bytes
+ * allocation. */
+#define ZBTREE_LEAF_ENTRIES 62
+#define ZBTREE_INNER_CHILDREN 31
+
+typedef struct zbtreeEntry {
+    double score;
+    sds ele;
+} zbtreeEntry;
+
+/* Common header of leaf and inner nodes. */
+typedef struct zbtreeNode {
+    unsigned int leaf:1;
+    unsigned int len:31;    /* Entries (leaves) or children (inner nodes). */
+} zbtreeNode;
+
+/* Leaves hold the entries sorted by (score, ele) and are linked together
+ * so that ranges can be walked in both directions. */
+typedef struct zbtreeLeaf {
+    zbtreeNode hdr;
+    struct zbtreeLeaf *prev, *next;
+    zbtreeEntry entries[ZBTREE_LEAF_ENTRIES];
+} zbtreeLeaf;
+
+/* Inner nodes remember, for every child, its smallest entry (used to route
+ * lookups without touching the child) and the number of entries stored
+ * below it (used to compute ranks). The 'ele' of the smallest entry is the
+ * same SDS string referenced by the leaf. */
+typedef struct zbtreeInner {
+    zbtreeNode hdr;
+    zbtreeEntry min[ZBTREE_INNER_CHILDREN];
+    unsigned long count[ZBTREE_INNER_CHILDREN];
+    zbtreeNode *child[ZBTREE_INNER_CHILDREN];
+} zbtreeInner;
+
+typedef struct zbtree {
+    zbtreeNode *root;           /* Never NULL, an empty leaf when empty. */
+    zbtreeLeaf *head, *tail;    /* First and last leaf. */
+    unsigned long length;       /* Number of entries. */
+    unsigned long leaves;       /* Number of leaves, for memory accounting. */
+    unsigned long inners;       /* Number of inner nodes. */
+    int height;                 /* 1 when the root is a leaf. */
+} zbtree;
+
+/* Position of an entry inside the tree. Iterators are invalidated by any
+ * modification of the tree. */
+typedef struct zbtreeIter {
+    zbtreeLeaf *leaf;
+    int pos;
+} zbtreeIter;
+
+#define zbtIterScore(it) ((it)->leaf->entries[(it)->pos].score)
+#define zbtIterEle(it) ((it)->leaf->entries[(it)->pos].ele)
+
+/* Monotonic predicate over the (score, ele) order, used to seek ranges. */
+typedef int zbtreePredicate(double score, sds ele, void *privdata);
+
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *t);
+void zbtInsert(zbtree *t, double score, sds ele);
+int zbtDelete(zbtree *t, double score, sds ele, sds *deleted);
+void zbtUpdateScore(zbtree *t, double curscore, sds ele, double newscore);
+unsigned long zbtGetRank(zbtree *t, double score, sds ele);
+int zbtSeekRank(zbtree *t, unsigned long rank, zbtreeIter *it);
+int zbtSeekFirst(zbtree *t, zbtreeIter *it);
+int zbtSeekLast(zbtree *t, zbtreeIter *it);
+int zbtSeekFirstMatch(zbtree *t, zbtreePredicate *gte, void *privdata, zbtreeIter *it);
+int zbtSeekLastMatch(zbtree *t, zbtreePredicate *lte, void *privdata, zbtreeIter *it);
+int zbtNext(zbtreeIter *it);
+int zbtPrev(zbtreeIter *it);
+int zbtReplaceEle(zbtree *t, double score, sds oldele, sds newele);
+long zbtDefragNodes(zbtree *t, void *(*defragfn)(void *ptr));
+size_t zbtNodesAllocSize(const zbtree *t);
+
+#ifdef REDIS_TEST
+int zbtreeTest(int argc, char *argv[]);
+#endif
+
+#endif /* __ZBTREE_H */
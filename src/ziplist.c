@@ -938,6 +938,56 @@ unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int sle
     return __ziplistInsert(zl,p,s,slen);
 }
 
+/* Append the 'count' entries 's[i]' of length 'slen[i]' at the tail of the
+ * ziplist with a single resize, instead of one per entry like calling
+ * ziplistPush() for each of them would do. Since nothing follows the new
+ * entries no cascade update is ever needed. */
+unsigned char *ziplistPushMany(unsigned char *zl, unsigned char **s, unsigned int *slen, unsigned int count) {
+    size_t curlen = intrev32ifbe(ZIPLIST_BYTES(zl)), reqlen = 0, offset = 0;
+    unsigned int prevlen = 0, len = intrev16ifbe(ZIPLIST_LENGTH(zl)), i;
+    unsigned char *ptail = ZIPLIST_ENTRY_TAIL(zl), *p, encoding;
+    long long value;
+
+    if (count == 0) return zl;
+    if (ptail[0] != ZIP_END) prevlen = zipRawEntryLength(ptail);
+
+    /* Compute the size of every entry first, each one depends on the
+     * length of the previous one. */
+    unsigned int entrylen = prevlen;
+    for (i = 0; i < count; i++) {
+        encoding = 0;
+        size_t datalen = zipTryEncoding(s[i],slen[i],&value,&encoding) ?
+                         zipIntSize(encoding) : slen[i];
+        size_t prevlensize = zipStorePrevEntryLength(NULL,entrylen);
+        entrylen = prevlensize+zipStoreEntryEncoding(NULL,encoding,slen[i])+
+                   datalen;
+        reqlen += entrylen;
+    }
+
+    zl = ziplistResize(zl,curlen+reqlen);
+    p = zl+curlen-ZIPLIST_END_SIZE;
+    for (i = 0; i < count; i++) {
+        offset = p-zl;
+        encoding = 0;
+        int isint = zipTryEncoding(s[i],slen[i],&value,&encoding);
+        p += zipStorePrevEntryLength(p,prevlen);
+        p += zipStoreEntryEncoding(p,encoding,slen[i]);
+        if (isint) {
+            zipSaveInteger(p,value,encoding);
+            p += zipIntSize(encoding);
+        } else {
+            memcpy(p,s[i],slen[i]);
+            p += slen[i];
+        }
+        prevlen = p-(zl+offset);
+    }
+    ZIPLIST_TAIL_OFFSET(zl) = intrev32ifbe(offset);
+    if (len < UINT16_MAX)
+        ZIPLIST_LENGTH(zl) = intrev16ifbe(len+count < UINT16_MAX ?
+                                          len+count : UINT16_MAX);
+    return zl;
+}
+
 /* 根据给定的索引值返回一个节点的指针。当给定的索引值为负时，从后向前遍历。当链表在给定的索引值上没有节点时返回NULL. */
 unsigned char *ziplistIndex(unsigned char *zl, int index) {
     unsigned char *p;
@@ -1629,6 +1679,33 @@ int ziplistTest(int argc, char **argv) {
         zfree(zl);
     }
 
+    printf("Push many entries at once:\n");
+    {
+        char big[300], *vals[] = {"foo","1024","-12","hello",big,"7",big,
+                                  "4294967296","bar"};
+        unsigned char *s[9], *one = ziplistNew();
+        unsigned int slen[9], i;
+
+        memset(big,'z',sizeof(big)-1);
+        big[sizeof(big)-1] = '\0';
+        for (i = 0; i < 9; i++) {
+            s[i] = (unsigned char*)vals[i];
+            slen[i] = strlen(vals[i]);
+        }
+        zl = ziplistNew();
+        zl = ziplistPushMany(zl,s,slen,0);
+        zl = ziplistPushMany(zl,s,slen,4);
+        zl = ziplistPushMany(zl,s+4,slen+4,5);
+        for (i = 0; i < 9; i++)
+            one = ziplistPush(one,s[i],slen[i],ZIPLIST_TAIL);
+        assert(ziplistLen(zl) == 9);
+        assert(ziplistBlobLen(zl) == ziplistBlobLen(one));
+        assert(memcmp(zl,one,ziplistBlobLen(one)) == 0);
+        zfree(one);
+        zfree(zl);
+        printf("SUCCESS\n\n");
+    }
+
     printf("Regression test for >255 byte strings:\n");
     {
         char v1[257] = {0}, v2[257] = {0};
@@ -37,6 +37,7 @@
 unsigned char *ziplistNew(void);  // 创建一个压缩链表
 unsigned char *ziplistMerge(unsigned char **first, unsigned char **second);  // 合并两个压缩链表
 unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int slen, int where);  // 向表头/表尾添加一个节点
+unsigned char *ziplistPushMany(unsigned char *zl, unsigned char **s, unsigned int *slen, unsigned int count);  // Append many entries at the tail with a single resize
 unsigned char *ziplistIndex(unsigned char *zl, int index);  // 获取索引值为index的节点
 unsigned char *ziplistNext(unsigned char *zl, unsigned char *p);  // 获取指定节点的下一个节点
 unsigned char *ziplistPrev(unsigned char *zl, unsigned char *p);  // 获取指定节点的上一个节点
@@ -42,6 +42,7 @@ void zlibc_free(void *ptr) {
 
 #include <string.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include "config.h"
 #include "zmalloc.h"
 #include "atomicvar.h"
@@ -95,6 +96,227 @@ static void zmalloc_default_oom(size_t size) {
 
 static void (*zmalloc_oom_handler)(size_t) = zmalloc_default_oom;
 
+/* Memory mapped regions, registered with zmalloc_map_register(), whose
+ * bytes are used in place of allocations: this is how the blobs of a memory
+ * mapped RDB file are adopted by the loader with zmalloc_map_retain(). Such
+ * pointers can be passed to zfree() and zrealloc() like any other: zfree()
+ * drops the blob, zrealloc() copies it to a real allocation first, and the
+ * region is unmapped once the owner and all its blobs are gone.
+ *
+ * Only the bytes of the blobs still adopted are counted, by
+ * zmalloc_used_memory() as well, so that they are checked against maxmemory
+ * like the allocations they replace. The region keeps the offset and length
+ * of every adopted blob, sorted by offset, to find them back when they are
+ * freed. Freed blobs are only marked as such, the array is released with
+ * the region.
+ *
+ * Pointers are freed by other threads as well, so the regions are only
+ * accessed with zmalloc_map_mutex held. The count of adopted bytes has its
+ * own mutex, so that reading it never waits for a region lookup. The bounds of the live regions are
+ * checked first without locking to keep zfree() fast: they only grow before
+ * any pointer to a new region exists, and only shrink when the pointers to
+ * a region are all gone, so a stale value is never wrong. */
+#define ZMALLOC_MAP_MAX 64
+typedef struct zmallocMapBlob {
+    size_t off;             /* Offset of the blob inside the region. */
+    size_t len;             /* Length of the blob, 0 once freed. */
+} zmallocMapBlob;
+static struct {
+    char *base;
+    size_t len;             /* 0 if the slot is free. */
+    unsigned long refs;     /* Blobs still adopted, plus the owner's. */
+    zmallocMapBlob *blobs;  /* Adopted blobs, sorted by offset. */
+    size_t numblobs, blobsalloc;
+} zmalloc_maps[ZMALLOC_MAP_MAX];
+static uintptr_t zmalloc_map_lo = 0, zmalloc_map_hi = 0;
+static size_t zmalloc_mapped = 0;
+static pthread_mutex_t zmalloc_mapped_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t zmalloc_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define zmalloc_map_maybe(p) \
+    ((uintptr_t)(p) - zmalloc_map_lo < zmalloc_map_hi - zmalloc_map_lo)
+
+/* Return the slot of the region 'ptr' points into, or -1. Must be called
+ * with zmalloc_map_mutex held. */
+static int zmalloc_map_lookup(void *ptr) {
+    for (int j = 0; j < ZMALLOC_MAP_MAX; j++) {
+        if (zmalloc_maps[j].len &&
+            (char*)ptr >= zmalloc_maps[j].base &&
+            (char*)ptr < zmalloc_maps[j].base+zmalloc_maps[j].len) return j;
+    }
+    return -1;
+}
+
+/* Return the index of the first blob of the region in 'slot' whose offset
+ * is not lower than 'off'. Must be called with zmalloc_map_mutex held. */
+static size_t zmalloc_map_blob_search(int slot, size_t off) {
+    zmallocMapBlob *blobs = zmalloc_maps[slot].blobs;
+    size_t lo = 0, hi = zmalloc_maps[slot].numblobs;
+
+    /* Blobs are adopted while reading the file, so in order. */
+    if (hi && blobs[hi-1].off < off) return hi;
+    while (lo < hi) {
+        size_t mid = lo+(hi-lo)/2;
+        if (blobs[mid].off < off) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Return the live blob 'ptr' is the start of, or NULL. Must be called with
+ * zmalloc_map_mutex held. */
+static zmallocMapBlob *zmalloc_map_blob_lookup(int slot, void *ptr) {
+    size_t off = (char*)ptr-zmalloc_maps[slot].base;
+    size_t idx = zmalloc_map_blob_search(slot,off);
+
+    if (idx == zmalloc_maps[slot].numblobs) return NULL;
+    zmallocMapBlob *blob = zmalloc_maps[slot].blobs+idx;
+    return (blob->off == off && blob->len) ? blob : NULL;
+}
+
+/* Recompute the bounds of the live regions. Must be called with
+ * zmalloc_map_mutex held. */
+static void zmalloc_map_update_bounds(void) {
+    uintptr_t lo = UINTPTR_MAX, hi = 0;
+
+    for (int j = 0; j < ZMALLOC_MAP_MAX; j++) {
+        if (zmalloc_maps[j].len == 0) continue;
+        uintptr_t base = (uintptr_t)zmalloc_maps[j].base;
+        if (base < lo) lo = base;
+        if (base+zmalloc_maps[j].len > hi) hi = base+zmalloc_maps[j].len;
+    }
+    if (hi == 0) lo = 0;
+    zmalloc_map_lo = lo;
+    zmalloc_map_hi = hi;
+}
+
+/* Drop a reference to the region in 'slot', unmapping it if it was the
+ * last one. Must be called with zmalloc_map_mutex held. */
+static void zmalloc_map_unref(int slot) {
+    if (--zmalloc_maps[slot].refs) return;
+    munmap(zmalloc_maps[slot].base,zmalloc_maps[slot].len);
+    free(zmalloc_maps[slot].blobs);
+    atomicDecr(used_memory,zmalloc_maps[slot].blobsalloc*sizeof(zmallocMapBlob));
+    zmalloc_maps[slot].blobs = NULL;
+    zmalloc_maps[slot].numblobs = zmalloc_maps[slot].blobsalloc = 0;
+    zmalloc_maps[slot].len = 0;
+    zmalloc_map_update_bounds();
+}
+
+/* Register the memory mapped region at 'base'. The caller owns a first
+ * reference that it will drop with zmalloc_map_unregister(base), the region
+ * is unmapped once the blobs adopted with zmalloc_map_retain() are all
+ * released as well. Returns -1 if too many regions are mapped. */
+int zmalloc_map_register(void *base, size_t len) {
+    int slot = -1;
+
+    pthread_mutex_lock(&zmalloc_map_mutex);
+    for (int j = 0; j < ZMALLOC_MAP_MAX && slot == -1; j++)
+        if (zmalloc_maps[j].len == 0) slot = j;
+    if (slot != -1) {
+        zmalloc_maps[slot].base = base;
+        zmalloc_maps[slot].len = len;
+        zmalloc_maps[slot].refs = 1;
+        zmalloc_map_update_bounds();
+    }
+    pthread_mutex_unlock(&zmalloc_map_mutex);
+    return slot == -1 ? -1 : 0;
+}
+
+/* Drop the reference of the owner of the region registered at 'base'. */
+void zmalloc_map_unregister(void *base) {
+    int slot;
+
+    pthread_mutex_lock(&zmalloc_map_mutex);
+    slot = zmalloc_map_lookup(base);
+    if (slot != -1) zmalloc_map_unref(slot);
+    pthread_mutex_unlock(&zmalloc_map_mutex);
+}
+
+/* Make the 'len' bytes at 'ptr', that point into a registered region,
+ * usable as if they were returned by zmalloc(len). */
+void zmalloc_map_retain(void *ptr, size_t len) {
+    int slot;
+
+    pthread_mutex_lock(&zmalloc_map_mutex);
+    slot = zmalloc_map_lookup(ptr);
+    if (slot != -1) {
+        size_t off = (char*)ptr-zmalloc_maps[slot].base;
+        size_t idx = zmalloc_map_blob_search(slot,off);
+        size_t n = zmalloc_maps[slot].numblobs;
+
+        if (n == zmalloc_maps[slot].blobsalloc) {
+            size_t alloc = n ? n*2 : 64;
+            zmallocMapBlob *blobs = realloc(zmalloc_maps[slot].blobs,
+                                            alloc*sizeof(zmallocMapBlob));
+            if (!blobs) zmalloc_oom_handler(alloc*sizeof(zmallocMapBlob));
+            atomicIncr(used_memory,(alloc-n)*sizeof(zmallocMapBlob));
+            zmalloc_maps[slot].blobs = blobs;
+            zmalloc_maps[slot].blobsalloc = alloc;
+        }
+        zmallocMapBlob *blobs = zmalloc_maps[slot].blobs;
+        if (idx < n) memmove(blobs+idx+1,blobs+idx,(n-idx)*sizeof(*blobs));
+        blobs[idx].off = off;
+        blobs[idx].len = len;
+        zmalloc_maps[slot].numblobs++;
+        zmalloc_maps[slot].refs++;
+        pthread_mutex_lock(&zmalloc_mapped_mutex);
+        zmalloc_mapped += len;
+        pthread_mutex_unlock(&zmalloc_mapped_mutex);
+    }
+    pthread_mutex_unlock(&zmalloc_map_mutex);
+}
+
+/* Release the blob 'ptr' was adopted with. Returns 0 if 'ptr' is not an
+ * adopted blob. */
+int zmalloc_map_release(void *ptr) {
+    zmallocMapBlob *blob = NULL;
+    int slot;
+
+    if (!zmalloc_map_maybe(ptr)) return 0;
+    pthread_mutex_lock(&zmalloc_map_mutex);
+    slot = zmalloc_map_lookup(ptr);
+    if (slot != -1) blob = zmalloc_map_blob_lookup(slot,ptr);
+    if (blob) {
+        pthread_mutex_lock(&zmalloc_mapped_mutex);
+        zmalloc_mapped -= blob->len;
+        pthread_mutex_unlock(&zmalloc_mapped_mutex);
+        blob->len = 0;
+        zmalloc_map_unref(slot);
+    }
+    pthread_mutex_unlock(&zmalloc_map_mutex);
+    return blob != NULL;
+}
+
+/* Return the length 'ptr' was adopted with, or 0 if 'ptr' is not an
+ * adopted blob. */
+static size_t zmalloc_map_blob_len(void *ptr) {
+    zmallocMapBlob *blob = NULL;
+    int slot;
+
+    if (!zmalloc_map_maybe(ptr)) return 0;
+    pthread_mutex_lock(&zmalloc_map_mutex);
+    slot = zmalloc_map_lookup(ptr);
+    if (slot != -1) blob = zmalloc_map_blob_lookup(slot,ptr);
+    size_t len = blob ? blob->len : 0;
+    pthread_mutex_unlock(&zmalloc_map_mutex);
+    return len;
+}
+
+int zmalloc_is_mapped(void *ptr) {
+    return zmalloc_map_blob_len(ptr) != 0;
+}
+
+/* Bytes of the blobs still adopted from the registered regions. */
+size_t zmalloc_mapped_memory(void) {
+    size_t mapped;
+
+    pthread_mutex_lock(&zmalloc_mapped_mutex);
+    mapped = zmalloc_mapped;
+    pthread_mutex_unlock(&zmalloc_mapped_mutex);
+    return mapped;
+}
+
 void *zmalloc(size_t size) {
     void *ptr = malloc(size+PREFIX_SIZE);
 
@@ -153,6 +375,15 @@ void *zrealloc(void *ptr, size_t size) {
         return NULL;
     }
     if (ptr == NULL) return zmalloc(size);
+
+    /* Adopted from a mapped region: time to make a real copy. */
+    size_t bloblen = zmalloc_map_blob_len(ptr);
+    if (bloblen) {
+        newptr = zmalloc(size);
+        memcpy(newptr,ptr,size < bloblen ? size : bloblen);
+        zmalloc_map_release(ptr);
+        return newptr;
+    }
 #ifdef HAVE_MALLOC_SIZE
     oldsize = zmalloc_size(ptr);
     newptr = realloc(ptr,size);
@@ -195,6 +426,7 @@ void zfree(void *ptr) {
 #endif
 
     if (ptr == NULL) return;
+    if (zmalloc_map_release(ptr)) return;
 #ifdef HAVE_MALLOC_SIZE
     update_zmalloc_stat_free(zmalloc_size(ptr));
     free(ptr);
@@ -217,7 +449,7 @@ char *zstrdup(const char *s) {
 size_t zmalloc_used_memory(void) {
     size_t um;
     atomicGet(used_memory,um);
-    return um;
+    return um+zmalloc_mapped_memory();
 }
 
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
@@ -92,6 +92,12 @@ size_t zmalloc_get_private_dirty(long pid);
 size_t zmalloc_get_smap_bytes_by_field(char *field, long pid);
 size_t zmalloc_get_memory_size(void);
 void zlibc_free(void *ptr);
+int zmalloc_map_register(void *base, size_t len);
+void zmalloc_map_unregister(void *base);
+void zmalloc_map_retain(void *ptr, size_t len);
+int zmalloc_map_release(void *ptr);
+int zmalloc_is_mapped(void *ptr);
+size_t zmalloc_mapped_memory(void);
 
 #ifdef HAVE_DEFRAG
 void zfree_no_tcache(void *ptr);
@@ -9,6 +9,9 @@ proc append_to_aof {str} {
 
 proc create_aof {code} {
     upvar fp fp aof_path aof_path
+    # Start from an AOF written by an older version: a single file without
+    # manifest, adopted by the server as the base.
+    foreach f [glob -nocomplain $aof_path.*] {file delete $f}
     set fp [open $aof_path w+]
     uplevel 1 $code
     close $fp
@@ -260,7 +263,7 @@ tags {"aof"} {
                 r del x
                 r setrange x [expr {int(rand()*5000000)+10000000}] x
                 r debug aof-flush-sleep 500000
-                set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+                set aof [file join [lindex [r config get dir] 1] appendonly.aof.1.incr.aof]
                 set size1 [file size $aof]
                 $rd get x
                 after [expr {int(rand()*30)}]
@@ -272,4 +275,278 @@ tags {"aof"} {
             }
         }
     }
+
+    ## Multi part AOF: a base file plus incr files listed in a manifest.
+    proc read_manifest {path} {
+        set fp [open $path.manifest r]
+        set content [string trim [read $fp]]
+        close $fp
+        return $content
+    }
+
+    foreach f [glob -nocomplain $aof_path*] {file delete $f}
+    start_server_aof [list dir $server_path aof-use-rdb-preamble yes] {
+        set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+        wait_done_loading $client
+
+        test "Multi part AOF: writes are appended to the first incr file" {
+            $client set foo bar
+            $client rpush list a b c
+            assert_equal {file "appendonly.aof.1.incr.aof" seq 1 type i} \
+                [read_manifest $aof_path]
+            assert {[file size $aof_path.1.incr.aof] > 0}
+        }
+
+        test "Multi part AOF: rewrite switches to a new base and incr file" {
+            $client bgrewriteaof
+            wait_for_condition 50 100 {
+                [status $client aof_rewrite_in_progress] eq 0
+            } else {
+                fail "The AOF rewrite did not finish"
+            }
+            $client set foo baz
+            assert_equal [join [list \
+                {file "appendonly.aof.1.base.rdb" seq 1 type b} \
+                {file "appendonly.aof.2.incr.aof" seq 2 type i}] "\n"] \
+                [read_manifest $aof_path]
+            assert {[file size $aof_path.2.incr.aof] > 0}
+            wait_for_condition 50 100 {
+                ![file exists $aof_path.1.incr.aof]
+            } else {
+                fail "The replaced incr file was not deleted"
+            }
+        }
+
+        test "Multi part AOF: a failed rewrite leaves a loadable AOF" {
+            $client config set rdb-key-save-delay 1000000
+            $client bgrewriteaof
+            $client set during rewrite
+            set child [string trim [exec pgrep -P [dict get $srv pid]]]
+            exec kill -9 $child
+            wait_for_condition 50 100 {
+                [status $client aof_rewrite_in_progress] eq 0
+            } else {
+                fail "The AOF rewrite child is still running"
+            }
+            $client config set rdb-key-save-delay 0
+            $client set after rewrite
+            assert_equal [join [list \
+                {file "appendonly.aof.1.base.rdb" seq 1 type b} \
+                {file "appendonly.aof.2.incr.aof" seq 2 type i} \
+                {file "appendonly.aof.3.incr.aof" seq 3 type i}] "\n"] \
+                [read_manifest $aof_path]
+        }
+    }
+
+    start_server_aof [list dir $server_path] {
+        test "Multi part AOF: dataset is loaded from the base and incr files" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal baz [$client get foo]
+            assert_equal {a b c} [$client lrange list 0 -1]
+            assert_equal rewrite [$client get during]
+            assert_equal rewrite [$client get after]
+        }
+    }
+
+    ## A truncated file can't be fixed when more data follows it.
+    create_aof {
+        append_to_aof [formatCommand set foo hello]
+        append_to_aof [string range [formatCommand set bar world] 0 end-1]
+    }
+    set fp [open $aof_path.1.incr.aof w]
+    puts -nonewline $fp [formatCommand set foo world]
+    close $fp
+    set fp [open $aof_path.manifest w]
+    puts $fp {file "appendonly.aof" seq 0 type b}
+    puts $fp {file "appendonly.aof.1.incr.aof" seq 1 type i}
+    close $fp
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "Multi part AOF: a truncated file followed by data is fatal" {
+            wait_for_condition 100 50 {
+                ! [is_alive $srv]
+            } else {
+                fail "The server should not start"
+            }
+            assert_match "*Unexpected end of file reading the append only file*" \
+                [exec tail -1 < [dict get $srv stdout]]
+        }
+    }
+
+    test "Multi part AOF: utility checks the files listed by the manifest" {
+        catch {exec src/redis-check-aof $aof_path.manifest} result
+        assert_match "*Checking base file*not valid*" $result
+        catch {exec src/redis-check-aof --fix $aof_path.manifest << "y\n"} result
+        assert_match "*not the last incr file*" $result
+        catch {exec src/redis-check-aof $aof_path} result
+        assert_match "*not valid*" $result
+    }
+
+    test "Multi part AOF: utility fixes only the last incr file" {
+        set fp [open $aof_path w]
+        puts -nonewline $fp [formatCommand set foo hello]
+        close $fp
+        set fp [open $aof_path.1.incr.aof a]
+        puts -nonewline $fp [string range [formatCommand set bar world] 0 end-1]
+        close $fp
+        catch {exec src/redis-check-aof $aof_path.manifest} result
+        assert_match "*Checking incr file*not valid*" $result
+        set result [exec src/redis-check-aof --fix $aof_path.manifest << "y\n"]
+        assert_match "*Successfully truncated AOF*AOF is valid*" $result
+        assert_match "*AOF is valid*" [exec src/redis-check-aof $aof_path.manifest]
+    }
+
+    ## The reader thread parses more batches than the ring can hold, then
+    ## stops at the truncated tail and the incomplete MULTI is reverted.
+    create_aof {
+        for {set j 0} {$j < 10000} {incr j} {
+            append_to_aof [formatCommand rpush list $j]
+        }
+        append_to_aof [formatCommand multi]
+        append_to_aof [formatCommand set foo bar]
+        append_to_aof [string range [formatCommand exec] 0 end-1]
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated yes aof-load-reader-thread yes] {
+        test "AOF reader thread: commands are replayed in order" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal 10000 [$client llen list]
+            assert_equal {0 1 2} [$client lrange list 0 2]
+            assert_equal 9999 [$client lindex list -1]
+            assert_equal 0 [$client exists foo]
+        }
+    }
+
+    ## Format errors are still detected when parsing in the thread.
+    create_aof {
+        append_to_aof [formatCommand set foo hello]
+        append_to_aof "!!!"
+    }
+
+    start_server_aof [list dir $server_path aof-load-reader-thread yes] {
+        test "AOF reader thread: bad format is fatal" {
+            wait_for_condition 100 50 {
+                ! [is_alive $srv]
+            } else {
+                fail "The server should not start"
+            }
+            assert_match "*Bad file format reading the append only file*" \
+                [exec tail -1 < [dict get $srv stdout]]
+        }
+    }
+
+    ## Binary encoding: commands logged as binary frames and compressed
+    ## blocks, mixed with the protocol when the option changes at runtime.
+    create_aof {}
+
+    start_server_aof [list dir $server_path aof-binary-encoding yes aof-binary-compression zstd] {
+        test "Binary AOF: commands are logged as binary frames" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client set foo bar
+            $client incrby counter -12345
+            $client set big [string repeat x 5000]
+            $client expire foo 1000
+            $client multi
+            $client rpush list a b c
+            $client hset hash field 9223372036854775807
+            $client exec
+            $client select 9
+            $client sadd set -9223372036854775808 0 01
+            $client config set aof-binary-encoding no
+            $client set resp yes
+            $client config set aof-binary-encoding yes
+            $client set binary again
+            set ::binary_digest [$client debug digest]
+            set fp [open $aof_path.1.incr.aof r]
+            fconfigure $fp -translation binary
+            set first [read $fp 1]
+            close $fp
+            assert_equal "\x01" $first
+        }
+    }
+
+    test "Binary AOF: redis-check-aof validates binary frames" {
+        assert_match "*AOF is valid*" [exec src/redis-check-aof $aof_path.1.incr.aof]
+    }
+
+    start_server_aof [list dir $server_path aof-load-reader-thread yes] {
+        test "Binary AOF: the dataset is loaded back" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal $::binary_digest [$client debug digest]
+            $client select 9
+            assert_equal {-9223372036854775808 0 01} [lsort [$client smembers set]]
+        }
+    }
+
+    test "Binary AOF: a truncated frame is detected" {
+        set size [file size $aof_path.1.incr.aof]
+        set fp [open $aof_path.1.incr.aof r+]
+        chan truncate $fp [expr {$size-3}]
+        close $fp
+        catch {exec src/redis-check-aof $aof_path.1.incr.aof} result
+        assert_match "*not valid*" $result
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "Binary AOF: a truncated frame is dropped when loading" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client select 9
+            assert_equal {} [$client get binary]
+            assert_equal yes [$client get resp]
+        }
+    }
+
+    start_server {overrides {appendonly no}} {
+        test "WAITAOF is refused when the AOF is disabled" {
+            r set foo bar
+            assert_error "*appendonly is disabled*" {r waitaof 0}
+        }
+    }
+
+    start_server {overrides {appendonly yes appendfsync no}} {
+        test "WAITAOF fsyncs the AOF even with appendfsync no" {
+            r set foo bar
+            assert_equal 1 [r waitaof 0]
+            r incr counter
+            assert_equal 1 [r waitaof 0]
+        }
+
+        test "WAITAOF inside MULTI does not block" {
+            r multi
+            r set foo baz
+            r waitaof 0
+            assert_match {OK [01]} [r exec]
+            assert_equal 1 [r waitaof 0]
+        }
+
+        test "WAITAOF times out when fsync is not allowed" {
+            r config set no-appendfsync-on-rewrite yes
+            r config set rdb-key-save-delay 1000000
+            r bgsave
+            r set foo qux
+            assert_equal 0 [r waitaof 100]
+        }
+
+        test "WAITAOF clients are served when the AOF is turned off" {
+            set rd [redis_deferring_client]
+            $rd set foo quux
+            $rd read
+            $rd waitaof 0
+            wait_for_condition 50 100 {
+                [s blocked_clients] eq 1
+            } else {
+                fail "The client is not blocked in WAITAOF"
+            }
+            r config set appendonly no
+            assert_equal 1 [$rd read]
+            $rd close
+            r config set rdb-key-save-delay 0
+            catch {exec kill -9 [get_child_pid 0]}
+        }
+    }
 }
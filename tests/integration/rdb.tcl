@@ -58,6 +58,247 @@ start_server [list overrides [list "dir" $server_path] keep_persistence true] {
     }
 }
 
+start_server {tags {"rdb"} overrides {rdb-load-threads 4}} {
+    test {Parallel RDB loading restores the same dataset} {
+        createComplexDataset r 10000
+        r xadd mystream * a 1 b 2
+        r xadd mystream * c 3
+        r xgroup create mystream mygroup 0
+        r xreadgroup GROUP mygroup Alice COUNT 1 STREAMS mystream >
+        r hset ttlhash f1 v1 f2 v2
+        r hexpire ttlhash 1000 FIELDS 1 f1
+        r setbit sparsebits 10000000 1
+        r set compressible [string repeat a 1000]
+        r select 10
+        r set otherdb 1
+        r select 9
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert_equal 2 [r xlen mystream]
+        assert_equal -1 [r httl ttlhash FIELDS 1 f2]
+        assert_range [r httl ttlhash FIELDS 1 f1] 900 1000
+        r select 10
+        assert_equal 1 [r get otherdb]
+        r select 9
+    }
+
+    test {Parallel RDB loading skips keys already expired} {
+        r flushall
+        r debug set-active-expire 0
+        r set foo bar px 100
+        r set persistent bar
+        after 200
+        r debug reload
+        r debug set-active-expire 1
+        assert_equal 1 [r dbsize]
+        r get persistent
+    } {bar}
+}
+
+start_server {tags {"rdb"}} {
+    test {RDB compression codecs restore the same dataset} {
+        createComplexDataset r 5000
+        r set compressible [string repeat "abcdefgh" 1000]
+        r set smallcompressible [string repeat "a" 100]
+        set digest [r debug digest]
+        foreach codec {lz4 zstd lzf} {
+            foreach minsize {0 256} {
+                r config set rdb-compression-codec $codec
+                r config set rdb-zstd-min-size $minsize
+                r debug reload
+                assert_equal $digest [r debug digest]
+            }
+        }
+        r config set rdb-compression-codec zstd
+        set dump [r dump compressible]
+        r del compressible
+        r restore compressible 0 $dump
+        r config set rdb-compression-codec lzf
+        assert_equal $digest [r debug digest]
+    }
+
+    test {RDB compressed with zstd passes redis-check-rdb} {
+        r config set rdb-compression-codec zstd
+        r save
+        set dir [lindex [r config get dir] 1]
+        set output [exec src/redis-check-rdb [file join $dir dump.rdb]]
+        r config set rdb-compression-codec lzf
+        assert_match {*RDB looks OK*} $output
+    }
+}
+
+start_server {tags {"rdb"} overrides {rdb-save-threads 4}} {
+    test {Sharded RDB saving restores the same dataset} {
+        createComplexDataset r 10000
+        r debug populate 20000 sharded
+        r hset ttlhash f1 v1 f2 v2
+        r hexpire ttlhash 1000 FIELDS 1 f1
+        r set volatile v px 1000000
+        r select 10
+        r set otherdb 1
+        r select 9
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert_range [r pttl volatile] 900000 1000000
+        assert_range [r httl ttlhash FIELDS 1 f1] 900 1000
+        r config set rdb-load-threads 4
+        r debug reload
+        r config set rdb-load-threads 0
+        assert_equal $digest [r debug digest]
+        r select 10
+        assert_equal 1 [r get otherdb]
+        r select 9
+    }
+
+    test {Sharded RDB file passes redis-check-rdb} {
+        r save
+        set dir [lindex [r config get dir] 1]
+        set output [exec src/redis-check-rdb [file join $dir dump.rdb]]
+        assert_match {*Index of * sections*} $output
+        assert_match {*RDB looks OK*} $output
+    }
+}
+
+start_server {tags {"rdb"} overrides {rdb-mmap-snapshot yes}} {
+    test {Memory mapped RDB snapshot restores the same dataset} {
+        createComplexDataset r 5000
+        for {set j 0} {$j < 5000} {incr j} {
+            r rpush biglist [string repeat x [expr {$j%50}]]
+        }
+        r sadd intset 1 2 3 100000
+        r hset smallhash a 1 b 2
+        r zadd smallzset 1 a 2 b
+        r xadd stream * item 1
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert {[s rdb_mmap_bytes] > 0}
+    }
+
+    test {Values adopted from a mapped RDB file are copied when modified} {
+        set mapped [s rdb_mmap_bytes]
+        r rpush biglist last
+        r lset biglist 0 first
+        r sadd intset 5 -10000000000
+        r hset smallhash c 3
+        r zadd smallzset 3 c
+        r xadd stream * item 2
+        assert_equal first [r lindex biglist 0]
+        assert_equal last [r lindex biglist -1]
+        assert_equal {-10000000000 1 2 3 5 100000} [lsort -integer [r smembers intset]]
+        assert_equal {a 1 b 2 c 3} [r hgetall smallhash]
+        assert_equal {a b c} [r zrange smallzset 0 -1]
+        assert_equal 2 [r xlen stream]
+        # The copied blobs are no longer counted as mapped.
+        assert {[s rdb_mmap_bytes] < $mapped}
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+
+    test {Mapped RDB file passes redis-check-rdb} {
+        r save
+        set dir [lindex [r config get dir] 1]
+        set output [exec src/redis-check-rdb [file join $dir dump.rdb]]
+        assert_match {*RDB looks OK*} $output
+    }
+
+    test {Mapped RDB file only counts the adopted blobs} {
+        r config set rdb-mmap-snapshot no
+        r debug reload
+        set used [s used_memory]
+        r config set rdb-mmap-snapshot yes
+        r save
+        r debug reload
+        assert {[s rdb_mmap_bytes] > 0}
+        assert {[s used_memory] < $used*1.1}
+    }
+
+    test {Mapped RDB file counts toward maxmemory} {
+        r debug reload
+        set mapped [s rdb_mmap_bytes]
+        assert {$mapped > 0 && [s used_memory] > $mapped}
+        r config set maxmemory-policy noeviction
+        r config set maxmemory [expr {[s used_memory]-$mapped/2}]
+        catch {r set foo bar} e
+        r config set maxmemory 0
+        set e
+    } {OOM*}
+
+    test {Mapped RDB file is released when no value uses it} {
+        set used [s used_memory]
+        set mapped [s rdb_mmap_bytes]
+        r flushall
+        assert_equal 0 [s rdb_mmap_bytes]
+        assert {[s used_memory] < $used-$mapped}
+    }
+}
+
+start_server {tags {"rdb"} overrides {rdb-forkless-save yes}} {
+    test {Forkless BGSAVE saves the dataset as of when it started} {
+        createComplexDataset r 2000
+        r debug populate 5000 forkless
+        r hset ttlhash f1 v1 f2 v2
+        r hexpire ttlhash 1000 FIELDS 1 f1
+        r set volatile v px 1000000
+        r select 10
+        r set otherdb 1
+        r select 9
+        set digest [r debug digest]
+
+        r config set rdb-key-save-delay 200
+        r bgsave
+        assert_equal 1 [s rdb_bgsave_in_progress]
+        for {set j 0} {$j < 500} {incr j} {
+            r set forkless:$j changed
+            r del forkless:[expr {$j+1000}]
+            r set newkey:$j value
+            r expire forkless:[expr {$j+2000}] 100
+        }
+        r hset ttlhash f3 v3
+        r persist volatile
+        r select 10
+        r del otherdb
+        r select 9
+        set after [r debug digest]
+        wait_for_condition 100 100 {
+            [s rdb_bgsave_in_progress] == 0
+        } else {
+            fail "forkless bgsave not done"
+        }
+        r config set rdb-key-save-delay 0
+        assert_equal ok [s rdb_last_bgsave_status]
+        assert {[s rdb_forkless_cow_keys] > 0}
+        assert_equal $after [r debug digest]
+
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+        assert_range [r pttl volatile] 900000 1000000
+        r select 10
+        assert_equal 1 [r get otherdb]
+        r select 9
+    }
+
+    test {FLUSHALL aborts a forkless BGSAVE} {
+        r config set rdb-key-save-delay 1000
+        r bgsave
+        assert_equal 1 [s rdb_bgsave_in_progress]
+        r flushall
+        wait_for_condition 5 100 {
+            [s rdb_bgsave_in_progress] == 0
+        } else {
+            fail "forkless bgsave not aborted"
+        }
+        r config set rdb-key-save-delay 0
+        assert_equal 0 [r dbsize]
+        r set foo bar
+        r debug reload
+        assert_equal bar [r get foo]
+    }
+}
+
 # Helper function to start a server and kill it, just to check the error
 # logged.
 set defaults {}
@@ -116,6 +357,35 @@ start_server_and_kill_it [list "dir" $server_path] {
     }
 }
 
+# Save a sharded RDB and flip a byte in the middle of its sections. When the
+# sections are loaded by multiple threads their CRC is only verified by the
+# thread decoding them, so make sure the corruption is still detected.
+file delete [file join $server_path dump.rdb]
+start_server [list overrides [list "dir" $server_path "rdb-save-threads" 4] keep_persistence true] {
+    r debug populate 20000 sharded
+    r save
+}
+
+set filesize [file size [file join $server_path dump.rdb]]
+set fd [open [file join $server_path dump.rdb] r+]
+fconfigure $fd -translation binary
+seek $fd [expr {$filesize/2}]
+binary scan [read $fd 1] c byte
+seek $fd [expr {$filesize/2}]
+puts -nonewline $fd [binary format c [expr {$byte ^ 0xff}]]
+close $fd
+
+start_server_and_kill_it [list "dir" $server_path "rdb-load-threads" 4] {
+    test {Server should not start if an RDB section is corrupted} {
+        wait_for_condition 50 100 {
+            [string match {*Wrong RDB section checksum*} \
+                [exec cat [dict get $srv stdout]]]
+        } else {
+            fail "Server started even if an RDB section was corrupted!"
+        }
+    }
+}
+
 start_server {} {
     test {Test FLUSHALL aborts bgsave} {
         # 1000 keys with 1ms sleep per key shuld take 1 second
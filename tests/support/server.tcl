@@ -27,6 +27,7 @@ proc clean_persistence config {
     set aof [format "%s/%s" [dict get $config "dir"] "appendonly.aof"]
     catch {exec rm -rf $rdb}
     catch {exec rm -rf $aof}
+    catch {exec rm -rf {*}[glob -nocomplain $aof.*]}
 }
 
 proc kill_server config {
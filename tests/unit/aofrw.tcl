@@ -106,10 +106,15 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     }
 
     foreach d {string int} {
-        foreach e {intset hashtable} {
+        foreach e {intset bitmap hashtable} {
             test "AOF rewrite of set with $e encoding, $d data" {
                 r flushall
                 if {$e eq {intset}} {set len 10} else {set len 1000}
+                if {$e eq {hashtable}} {
+                    r config set set-bitmap-encoding no
+                } else {
+                    r config set set-bitmap-encoding yes
+                }
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
                         set data [randstring 0 16 alpha]
@@ -131,6 +136,7 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
                 }
             }
         }
+        r config set set-bitmap-encoding yes
     }
 
     foreach d {string int} {
@@ -185,6 +191,43 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
         }
     }
 
+    test "AOF rewrite of hash with field TTLs" {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            r hset key f$j [randstring 0 16 alpha]
+        }
+        r hpexpire key 1000000 FIELDS 3 f1 f2 f3
+        set d1 [r debug digest]
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        set d2 [r debug digest]
+        if {$d1 ne $d2} {
+            error "assertion:$d1 is not equal to $d2"
+        }
+        assert {[lindex [r hpttl key FIELDS 1 f2] 0] > 900000}
+    }
+
+    test "AOF rewrite of string with bitmap encoding" {
+        r flushall
+        for {set j 0} {$j < 1000} {incr j} {
+            r setbit key [randomInt 100000000] 1
+        }
+        r setbit key 99999999 0
+        r expire key 1000
+        assert_encoding bitmap key
+        set d1 [r debug digest]
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        set d2 [r debug digest]
+        if {$d1 ne $d2} {
+            error "assertion:$d1 is not equal to $d2"
+        }
+        assert_encoding bitmap key
+        assert_equal 12500000 [r strlen key]
+    }
+
     test {BGREWRITEAOF is delayed if BGSAVE is in progress} {
         r multi
         r bgsave
@@ -214,6 +214,85 @@ start_server {tags {"bitops"}} {
         r bitop or x a b
     } {32}
 
+    test {BITOP AND|OR|XOR|NOT on large keys of different lengths} {
+        # Keys larger than the block BITOP works with, with lengths that
+        # are not multiples of any word or vector size.
+        r flushdb
+        set lens {150001 70003 131072 33}
+        set keys {}
+        for {set k 0} {$k < 4} {incr k} {
+            set s [randstring 0 255 binary]
+            set s [string repeat $s [expr {[lindex $lens $k]/[string length $s]+1}]]
+            set s [string range $s 0 [expr {[lindex $lens $k]-1}]]
+            binary scan $s cu* bytes($k)
+            r set key$k $s
+            lappend keys key$k
+        }
+        foreach op {and or xor} {
+            r bitop $op dest {*}$keys
+            binary scan [r get dest] cu* res
+            assert_equal 150001 [llength $res]
+            for {set i 0} {$i < 150001} {incr i 997} {
+                set byte [lindex $bytes(0) $i]
+                for {set k 1} {$k < 4} {incr k} {
+                    set b [lindex $bytes($k) $i]
+                    if {$b eq {}} {set b 0}
+                    switch $op {
+                        and {set byte [expr {$byte & $b}]}
+                        or  {set byte [expr {$byte | $b}]}
+                        xor {set byte [expr {$byte ^ $b}]}
+                    }
+                }
+                assert_equal $byte [lindex $res $i]
+            }
+        }
+        r bitop not dest key1
+        binary scan [r get dest] cu* res
+        for {set i 0} {$i < 70003} {incr i 997} {
+            assert_equal [expr {~[lindex $bytes(1) $i] & 255}] [lindex $res $i]
+        }
+    }
+
+    test {BITOP with many source keys} {
+        r flushdb
+        set keys {}
+        for {set k 0} {$k < 40} {incr k} {
+            r setbit key$k [expr {$k*1000+7}] 1
+            lappend keys key$k
+        }
+        r bitop or dest {*}$keys
+        assert_equal 40 [r bitcount dest]
+        r bitop and dest {*}$keys
+        assert_equal 0 [r bitcount dest]
+    }
+
+    test {BITCOUNT on large strings with unaligned ranges} {
+        set s [string repeat [randstring 0 255 binary] 100]
+        r set str $s
+        assert_equal [count_bits $s] [r bitcount str]
+        for {set j 0} {$j < 20} {incr j} {
+            set start [randomInt [string length $s]]
+            set end [expr {$start+[randomInt 5000]}]
+            assert_equal [count_bits [string range $s $start $end]] \
+                [r bitcount str $start $end]
+        }
+    }
+
+    test {BITPOS after long runs of zeros or ones} {
+        foreach len {100 4097 100000} {
+            foreach off {0 1 63 64} {
+                set pos [expr {($len+$off)*8+3}]
+                r del str
+                r setbit str $pos 1
+                assert_equal $pos [r bitpos str 1]
+                r set str [string repeat "\xff" [expr {$len+$off+10}]]
+                r setbit str $pos 0
+                assert_equal $pos [r bitpos str 0]
+                assert_equal $pos [r bitpos str 0 $off]
+            }
+        }
+    }
+
     test {BITPOS bit=0 with empty key returns 0} {
         r del str
         r bitpos str 0
@@ -349,3 +428,174 @@ start_server {tags {"bitops"}} {
         }
     }
 }
+
+start_server {tags {"bitops"}} {
+    test {SETBIT at a huge offset uses the bitmap encoding} {
+        r del big
+        r setbit big 4294967295 1
+        assert_encoding bitmap big
+        assert_equal 536870912 [r strlen big]
+        assert_equal 1 [r getbit big 4294967295]
+        assert_equal 0 [r getbit big 4294967294]
+        assert_equal 1 [r bitcount big]
+        assert_equal 1 [r bitcount big -1 -1]
+        assert_equal 0 [r bitcount big 0 -2]
+        assert_equal 4294967295 [r bitpos big 1]
+        assert_equal 0 [r bitpos big 0]
+        assert_equal "\x01" [r getrange big -1 -1]
+        assert {[r memory usage big] < 1000}
+    }
+
+    # Build the same bitmap as a plain string and as a bitmap encoded one.
+    proc create_bitmap_pair {len bits} {
+        r del flat sparse
+        r config set string-bitmap-min-bytes 0
+        r setbit flat [expr {$len*8-1}] 0
+        r config set string-bitmap-min-bytes 1024
+        r setbit sparse [expr {$len*8-1}] 0
+        foreach bit $bits {
+            r setbit flat $bit 1
+            r setbit sparse $bit 1
+        }
+        assert_encoding raw flat
+        assert_encoding bitmap sparse
+    }
+
+    test {Bitmap encoded strings read like plain strings} {
+        for {set iter 0} {$iter < 20} {incr iter} {
+            set len [expr {4096+[randomInt 4096]}]
+            set bits {}
+            for {set j 0} {$j < [randomInt 200]} {incr j} {
+                set start [randomInt [expr {$len*8}]]
+                # Runs of bits set, so that BITPOS bit=0 has to skip them.
+                for {set k 0} {$k < [randomInt 20]} {incr k} {
+                    lappend bits [expr {($start+$k) % ($len*8)}]
+                }
+            }
+            create_bitmap_pair $len $bits
+            assert_equal [r get flat] [r get sparse]
+            assert_equal [r strlen flat] [r strlen sparse]
+            assert_equal [r bitcount flat] [r bitcount sparse]
+            assert_equal [r bitpos flat 1] [r bitpos sparse 1]
+            assert_equal [r bitpos flat 0] [r bitpos sparse 0]
+            for {set j 0} {$j < 20} {incr j} {
+                set start [expr {[randomInt [expr {$len+100}]]-50}]
+                set end [expr {[randomInt [expr {$len+100}]]-50}]
+                assert_equal [r getrange flat $start $end] [r getrange sparse $start $end]
+                assert_equal [r bitcount flat $start $end] [r bitcount sparse $start $end]
+                assert_equal [r bitpos flat 1 $start] [r bitpos sparse 1 $start]
+                assert_equal [r bitpos flat 0 $start] [r bitpos sparse 0 $start]
+                assert_equal [r bitpos flat 1 $start $end] [r bitpos sparse 1 $start $end]
+                assert_equal [r bitpos flat 0 $start $end] [r bitpos sparse 0 $start $end]
+                set off [randomInt [expr {$len*8}]]
+                assert_equal [r getbit flat $off] [r getbit sparse $off]
+                assert_equal [r bitfield flat get i13 $off get u63 $off] \
+                             [r bitfield sparse get i13 $off get u63 $off]
+            }
+            assert_equal [r debug digest-value flat] [r debug digest-value sparse]
+        }
+        r config set string-bitmap-min-bytes 65536
+    }
+
+    test {BITFIELD writes on bitmap encoded strings} {
+        create_bitmap_pair 8192 {7 100 65535}
+        for {set j 0} {$j < 200} {incr j} {
+            set off [randomInt 70000]
+            set val [randomInt 100000]
+            assert_equal [r bitfield flat set u17 $off $val incrby i9 [expr {$off+3}] -7] \
+                         [r bitfield sparse set u17 $off $val incrby i9 [expr {$off+3}] -7]
+        }
+        assert_encoding bitmap sparse
+        assert_equal [r get flat] [r get sparse]
+        r config set string-bitmap-min-bytes 65536
+    }
+
+    test {BITOP between bitmap encoded strings} {
+        r config set string-bitmap-min-bytes 1024
+        r del a b c
+        foreach bit {80000 5000 70 1} {r setbit a $bit 1}
+        foreach bit {9000 5000 70} {r setbit b $bit 1}
+        r setbit c 200000 0
+        foreach key {a b c} {assert_encoding bitmap $key}
+        r bitop or dest a b c
+        assert_encoding bitmap dest
+        assert_equal 25001 [r strlen dest]
+        foreach {op expected} {or {1 70 5000 9000 80000}
+                               and {}
+                               xor {1 9000 80000}} {
+            r bitop $op dest a b c
+            set got {}
+            foreach bit {1 70 5000 9000 80000} {
+                if {[r getbit dest $bit]} {lappend got $bit}
+            }
+            assert_equal $expected $got
+            assert_equal [llength $expected] [r bitcount dest]
+        }
+        r bitop and dest a b
+        assert_equal {70 5000} [list [r bitpos dest 1] [r bitpos dest 1 625]]
+        r bitop and dest a b missing
+        assert_equal 0 [r bitcount dest]
+        assert_equal 10001 [r strlen dest]
+
+        # With a plain string or NOT the bitmaps are made flat.
+        r set plain [string repeat "\xff" 100]
+        r bitop and dest a plain
+        assert_equal 2 [r bitcount dest]
+        r bitop not dest a
+        assert_encoding raw dest
+        assert_equal [expr {10001*8-4}] [r bitcount dest]
+        r config set string-bitmap-min-bytes 65536
+    }
+
+    test {Bitmap encoded strings become plain when dense or written} {
+        r config set string-bitmap-min-bytes 1024
+        r del s
+        r setbit s 16383 1
+        assert_encoding bitmap s
+        for {set j 0} {$j < 2000} {incr j 2} {r setbit s $j 1}
+        assert_encoding raw s
+        assert_equal 1001 [r bitcount s]
+
+        # A plain string growing a lot switches to the bitmap encoding if
+        # it has few bits set.
+        r set s "ab"
+        r setbit s 1000000 1
+        assert_encoding bitmap s
+        assert_equal "ab" [r getrange s 0 1]
+        assert_equal [expr {[r bitcount s 0 1]+1}] [r bitcount s]
+
+        r append s "xyz"
+        assert_encoding raw s
+        assert_equal "xyz" [r getrange s -3 -1]
+        assert_equal "ab" [r getrange s 0 1]
+
+        r del s
+        r setbit s 100000 1
+        r setrange s 5 "hello"
+        assert_encoding raw s
+        assert_equal "hello" [r getrange s 5 9]
+        assert_equal 1 [r getbit s 100000]
+
+        r del s
+        r setbit s 100000 0
+        assert_error {*not an integer*} {r incr s}
+        r config set string-bitmap-min-bytes 65536
+    }
+
+    test {Bitmap encoded strings survive DEBUG RELOAD and DUMP/RESTORE} {
+        r config set string-bitmap-min-bytes 1024
+        r del s
+        foreach bit {3 4 5 77777 99999999} {r setbit s $bit 1}
+        set digest [r debug digest-value s]
+        r debug reload
+        assert_encoding bitmap s
+        assert_equal $digest [r debug digest-value s]
+        set dump [r dump s]
+        r del s
+        r restore s 0 $dump
+        assert_encoding bitmap s
+        assert_equal $digest [r debug digest-value s]
+        assert_equal 5 [r bitcount s]
+        r config set string-bitmap-min-bytes 65536
+    }
+}
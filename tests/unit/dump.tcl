@@ -93,6 +93,16 @@ start_server {tags {"dump"}} {
         set e
     } {*syntax*}
 
+    test {DUMP payloads carry a version outside the upstream range} {
+        r set foo bar
+        set encoded [r dump foo]
+        binary scan [string range $encoded end-9 end-8] s rdbver
+        assert {$rdbver >= 9001}
+        r del foo
+        r restore foo 0 $encoded
+        r get foo
+    } {bar}
+
     test {DUMP of non existing key returns nil} {
         r dump nonexisting_key
     } {}
@@ -224,6 +224,32 @@ start_server {tags {"geo"}} {
         assert {[lindex $res 0] eq "Catania"}
     }
 
+    test {GEORADIUS COUNT ASC returns the nearest points} {
+        r del mypoints
+        set argv {}
+        for {set j 0} {$j < 5000} {incr j} {
+            set lon [expr {10 + rand()*10}]
+            set lat [expr {40 + rand()*10}]
+            lappend argv $lon $lat "place:$j"
+        }
+        r geoadd mypoints {*}$argv
+        foreach radius {1 20 100 500 2000} {
+            foreach count {1 10 100} {
+                set lon [expr {10 + rand()*10}]
+                set lat [expr {40 + rand()*10}]
+                set all [r georadius mypoints $lon $lat $radius km withdist asc]
+                set top [r georadius mypoints $lon $lat $radius km withdist asc count $count]
+                set expected {}
+                foreach item [lrange $all 0 [expr {$count-1}]] {
+                    lappend expected [lindex $item 1]
+                }
+                set got {}
+                foreach item $top {lappend got [lindex $item 1]}
+                assert_equal $expected $got
+            }
+        }
+    }
+
     test {GEOADD + GEORANGE randomized test} {
         set attempt 30
         while {[incr attempt -1]} {
@@ -194,6 +194,31 @@ start_server {tags {"hll"}} {
         assert {$err < (double($card)/100)*5}
     }
 
+    test {PFMERGE into a dense HLL keeps the max of every register} {
+        r del hll hll1 hll2
+        r config set hll-sparse-max-bytes 3000
+        for {set x 1} {$x < 5000} {incr x} {
+            r pfadd hll1 "a-$x"
+            r pfadd hll2 "b-$x"
+        }
+        r pfadd hll x y z
+        r pfdebug todense hll
+        set regs1 [r pfdebug getreg hll1]
+        set regs2 [r pfdebug getreg hll2]
+        set regs0 [r pfdebug getreg hll]
+        r pfmerge hll hll1 hll2
+        assert_equal [r pfdebug encoding hll] dense
+        set expected {}
+        foreach a $regs0 b $regs1 c $regs2 {
+            set m $a
+            if {$b > $m} {set m $b}
+            if {$c > $m} {set m $c}
+            lappend expected $m
+        }
+        assert_equal $expected [r pfdebug getreg hll]
+        assert_equal [r pfcount hll] [r pfcount hll hll1 hll2]
+    }
+
     test {PFDEBUG GETREG returns the HyperLogLog raw registers} {
         r del hll
         r pfadd hll 1 2 3
@@ -210,4 +235,56 @@ start_server {tags {"hll"}} {
         r pfadd hll 1 2 3
         assert {[r getrange hll 15 15] eq "\x80"}
     }
+
+    test {PFCOUNT multiple keys cached union is invalidated by writes} {
+        r del hll1 hll2 hll3
+        r pfadd hll1 a b c
+        r pfadd hll2 c d e
+        assert_equal 5 [r pfcount hll1 hll2]
+        assert_equal 5 [r pfcount hll2 hll1 hll2]
+        r pfadd hll2 f
+        assert_equal 6 [r pfcount hll1 hll2]
+        r pfmerge hll1 hll1 hll3
+        r pfadd hll3 x y
+        assert_equal 8 [r pfcount hll1 hll2 hll3]
+        r del hll2
+        assert_equal 5 [r pfcount hll1 hll2 hll3]
+        r rename hll3 hll2
+        assert_equal 5 [r pfcount hll1 hll2 hll3]
+        assert_equal 3 [r pfcount hll1 hll3]
+        r set hll3 foo
+        assert_error {*WRONGTYPE*} {r pfcount hll1 hll3}
+        r del hll3
+        r pfadd hll3 z
+        assert_equal 4 [r pfcount hll1 hll3]
+    }
+
+    test {PFCOUNT multiple keys cached union is invalidated by expires} {
+        r del hll1 hll2
+        r pfadd hll1 a b c
+        r pfadd hll2 d e
+        r pexpire hll2 50
+        assert_equal 5 [r pfcount hll1 hll2]
+        after 100
+        assert_equal 3 [r pfcount hll1 hll2]
+    }
+
+    test {PFCOUNT multiple keys cached union after FLUSHDB and SWAPDB} {
+        r del hll1 hll2
+        r pfadd hll1 a b c
+        r pfadd hll2 d e
+        assert_equal 5 [r pfcount hll1 hll2]
+        r select 10
+        r flushdb
+        r pfadd hll1 a
+        assert_equal 1 [r pfcount hll1 hll2]
+        r swapdb 9 10
+        assert_equal 5 [r pfcount hll1 hll2]
+        r select 9
+        assert_equal 1 [r pfcount hll1 hll2]
+        r swapdb 9 10
+        assert_equal 5 [r pfcount hll1 hll2]
+        r flushdb
+        assert_equal 0 [r pfcount hll1 hll2]
+    }
 }
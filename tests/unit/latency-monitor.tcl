@@ -59,7 +59,7 @@ start_server {tags {"latency-monitor"}} {
         r eval {
             local i = 0
             while (i < tonumber(ARGV[1])) do
-                redis.call('sadd',KEYS[1],i)
+                redis.call('sadd',KEYS[1],'ele:'..i)
                 i = i+1
              end
         } 1 mybigkey $count
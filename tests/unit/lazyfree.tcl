@@ -3,7 +3,7 @@ start_server {tags {"lazyfree"}} {
         set orig_mem [s used_memory]
         set args {}
         for {set i 0} {$i < 100000} {incr i} {
-            lappend args $i
+            lappend args "ele:$i"
         }
         r sadd myset {*}$args
         assert {[r scard myset] == 100000}
@@ -22,7 +22,7 @@ start_server {tags {"lazyfree"}} {
         set orig_mem [s used_memory]
         set args {}
         for {set i 0} {$i < 100000} {incr i} {
-            lappend args $i
+            lappend args "ele:$i"
         }
         r sadd myset {*}$args
         assert {[r scard myset] == 100000}
@@ -41,7 +41,11 @@ start_server {
         16 sadd intset "Intset"
         1000 sadd hashtable "Hash table"
         10000 sadd hashtable "Big Hash table"
+        1000 sadd bitmap "Bitmap"
+        10000 sadd bitmap "Big Bitmap"
     } {
+        # Integer sets only get the hash table encoding without bitmaps.
+        r config set set-bitmap-encoding [expr {$enc eq "hashtable" ? "no" : "yes"}]
         set result [create_random_dataset $num $cmd]
         assert_encoding $enc tosort
 
@@ -56,7 +60,21 @@ start_server {
         test "$title: SORT BY hash field" {
             assert_equal $result [r sort tosort BY wobj_*->weight]
         }
+
+        test "$title: SORT BY hash field with small limit" {
+            assert_equal [lrange $result 0 9] \
+                [r sort tosort BY wobj_*->weight LIMIT 0 10]
+            assert_equal [lrange [lreverse $result] 3 7] \
+                [r sort tosort BY wobj_*->weight DESC LIMIT 3 5]
+            set expected {}
+            foreach ele [lrange $result 0 19] {
+                lappend expected $ele [r get weight_$ele]
+            }
+            assert_equal $expected \
+                [r sort tosort BY weight_* LIMIT 0 20 GET # GET weight_*]
+        }
     }
+    r config set set-bitmap-encoding yes
 
     set result [create_random_dataset 16 lpush]
     test "SORT GET #" {
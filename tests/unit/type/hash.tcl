@@ -540,4 +540,203 @@ start_server {tags {"hash"}} {
             assert {[r hincrbyfloat myhash float -0.1] eq {1.9}}
         }
     }
+
+    test {Variadic HSET converts based on the fields actually set} {
+        r del myhash
+        set args {}
+        for {set i 0} {$i < 1000} {incr i} { lappend args f$i v$i }
+        assert_equal 1000 [r hset myhash {*}$args]
+        assert_encoding hashtable myhash
+        assert_equal {v999} [r hget myhash f999]
+        assert_equal 0 [r hset myhash {*}$args]
+        assert_equal 1000 [r hlen myhash]
+        r del myhash
+        assert_equal 1 [r hset myhash {*}[lrepeat 600 f v]]
+        assert_encoding ziplist myhash
+        assert_equal 1 [r hlen myhash]
+    }
+
+    test {Large variadic HSET into a ziplist} {
+        set original [lindex [r config get hash-max-ziplist-entries] 1]
+        r config set hash-max-ziplist-entries 512
+        r del myhash myhash2
+        r hset myhash f1 old 10 old
+        r hset myhash2 f1 old 10 old
+        set args {}
+        for {set i 0} {$i < 300} {incr i} {
+            lappend args [randomInt 200] v$i
+        }
+        lappend args f1 new
+        set created 0
+        foreach {f v} $args { incr created [r hset myhash2 $f $v] }
+        assert_equal $created [r hset myhash {*}$args]
+        assert_encoding ziplist myhash
+        assert_equal [r hgetall myhash2] [r hgetall myhash]
+        assert_equal new [r hget myhash f1]
+        r config set hash-max-ziplist-entries $original
+    }
+
+    test {HEXPIRE/HTTL/HPERSIST - Basic field TTL} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        assert_equal {1 -2} [r hexpire myhash 100 FIELDS 2 f1 nofield]
+        set ttl [r httl myhash FIELDS 2 f1 f2]
+        assert {[lindex $ttl 0] > 90 && [lindex $ttl 0] <= 100}
+        assert_equal -1 [lindex $ttl 1]
+        assert_encoding hashtable myhash
+        assert_equal {1 -1 -2} [r hpersist myhash FIELDS 3 f1 f2 nofield]
+        assert_equal {-1} [r httl myhash FIELDS 1 f1]
+        assert_equal {-2 -2} [r hpttl nokey FIELDS 2 f1 f2]
+    }
+
+    test {HEXPIRE - NX / XX / GT / LT conditions} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        assert_equal {0 0} [r hpexpire myhash 5000 XX FIELDS 2 f1 f2]
+        assert_equal {0 0} [r hpexpire myhash 5000 GT FIELDS 2 f1 f2]
+        assert_equal {1} [r hpexpire myhash 5000 NX FIELDS 1 f1]
+        assert_equal {0 1} [r hpexpire myhash 8000 NX FIELDS 2 f1 f2]
+        assert_equal {1 0} [r hpexpire myhash 6000 GT FIELDS 2 f1 f2]
+        assert_equal {0 1} [r hpexpire myhash 7000 LT FIELDS 2 f1 f2]
+        assert_equal {1 1} [r hpexpire myhash 6000 XX FIELDS 2 f1 f2]
+        r hset myhash f3 v3
+        assert_equal {1} [r hpexpire myhash 6000 LT FIELDS 1 f3]
+    }
+
+    test {HEXPIRE - Argument errors} {
+        r del myhash
+        r hset myhash f1 v1
+        assert_error {*FIELDS is missing*} {r hexpire myhash 100 NX 1 f1}
+        assert_error {*Unsupported argument*} {r hexpire myhash 100 YY FIELDS 1 f1}
+        assert_error {*numFields*} {r hexpire myhash 100 FIELDS 0 f1}
+        assert_error {*numfields*} {r hexpire myhash 100 FIELDS 2 f1}
+        assert_error {*invalid expire time*} {r hexpire myhash -1 FIELDS 1 f1}
+        assert_error {*invalid expire time*} {r hexpire myhash 9223372036854775807 FIELDS 1 f1}
+        assert_error {*numfields*} {r httl myhash FIELDS 2 f1}
+        r set mystring foo
+        assert_error {WRONGTYPE*} {r hexpire mystring 100 FIELDS 1 f1}
+    }
+
+    test {HEXPIRE - Time in the past deletes the fields and the key} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        assert_equal {2 -2} [r hexpireat myhash 1 FIELDS 2 f1 nofield]
+        assert_equal {f2 v2} [r hgetall myhash]
+        assert_equal {2} [r hpexpire myhash 0 FIELDS 1 f2]
+        r exists myhash
+    } {0}
+
+    test {Hash field lazy expire} {
+        r del myhash
+        r debug set-active-expire 0
+        r hset myhash f1 v1 f2 v2 f3 v3
+        r hpexpire myhash 10 FIELDS 2 f1 f2
+        after 20
+        assert_equal {} [r hget myhash f1]
+        assert_equal {0} [r hexists myhash f2]
+        assert_equal {f3 v3} [r hgetall myhash]
+        assert_equal {f3} [r hkeys myhash]
+        assert_equal {0 {f3 v3}} [r hscan myhash 0]
+        assert_equal {1} [r hset myhash f2 new]
+        assert_equal {-1} [r httl myhash FIELDS 1 f2]
+        r hpexpire myhash 10 FIELDS 2 f2 f3
+        after 20
+        assert_equal {{} {}} [r hmget myhash f2 f3]
+        r debug set-active-expire 1
+        r exists myhash
+    } {0}
+
+    test {HLEN does not count expired fields} {
+        r del myhash
+        r debug set-active-expire 0
+        r hset myhash a 1 b 2 c 3
+        r hpexpire myhash 20 FIELDS 2 a b
+        after 30
+        assert_equal 1 [r hlen myhash]
+        assert_equal {c 3} [r hgetall myhash]
+        r hpexpire myhash 20 FIELDS 1 c
+        after 30
+        assert_equal 0 [r hlen myhash]
+        r debug set-active-expire 1
+        r exists myhash
+    } {0}
+
+    test {Hash field active expire} {
+        r del myhash
+        r config resetstat
+        r hset myhash f1 v1 f2 v2 f3 v3
+        r hpexpire myhash 10 FIELDS 2 f1 f2
+        wait_for_condition 50 100 {
+            [s expired_fields] == 2
+        } else {
+            fail "Hash fields not actively expired"
+        }
+        assert_equal 1 [r hlen myhash]
+        r hpexpire myhash 10 FIELDS 1 f3
+        wait_for_condition 50 100 {
+            [r exists myhash] == 0
+        } else {
+            fail "Hash not deleted after its last field expired"
+        }
+    }
+
+    test {HSET clears the field TTL, HINCRBY keeps it} {
+        r del myhash
+        r hset myhash f1 1 f2 1
+        r hexpire myhash 100 FIELDS 2 f1 f2
+        r hset myhash f1 2
+        r hincrby myhash f2 1
+        assert_equal {-1} [r httl myhash FIELDS 1 f1]
+        assert {[lindex [r httl myhash FIELDS 1 f2] 0] > 0}
+    }
+
+    test {Hash field TTL survives DEBUG RELOAD and RENAME} {
+        r del myhash myhash2
+        r hset myhash f1 v1 f2 v2
+        r hpexpire myhash 100000 FIELDS 1 f1
+        set digest [r debug digest-value myhash]
+        r debug reload
+        assert_equal $digest [r debug digest-value myhash]
+        assert {[lindex [r hpttl myhash FIELDS 1 f1] 0] > 90000}
+        r rename myhash myhash2
+        r hpexpire myhash2 10 FIELDS 1 f2
+        wait_for_condition 50 100 {
+            [r hkeys myhash2] eq {f1}
+        } else {
+            fail "Renamed hash fields not expired"
+        }
+    }
+
+    test {Hash field TTL is propagated as absolute HPEXPIREAT or HDEL} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        set repl [attach_to_replication_stream]
+        r hexpire myhash 100 FIELDS 2 f1 nofield
+        r hexpire myhash 0 FIELDS 1 f2
+        r hpersist myhash FIELDS 1 f1
+        assert_replication_stream $repl {
+            {select *}
+            {hpexpireat myhash * FIELDS 1 f1}
+            {hdel myhash f2}
+            {hpersist myhash FIELDS 1 f1}
+        }
+        close_replication_stream $repl
+    }
+
+    test {Expired hash fields are propagated as HDEL} {
+        r del myhash
+        r debug set-active-expire 0
+        r hset myhash f1 v1 f2 v2
+        set repl [attach_to_replication_stream]
+        r hpexpire myhash 10 FIELDS 1 f1
+        after 20
+        r hget myhash f1
+        r debug set-active-expire 1
+        assert_replication_stream $repl {
+            {select *}
+            {hpexpireat myhash * FIELDS 1 f1}
+            {hdel myhash f1}
+        }
+        close_replication_stream $repl
+    }
 }
@@ -56,7 +56,124 @@ start_server {
         for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
         assert_encoding intset myset
         assert_equal 1 [r sadd myset 512]
+        assert_encoding bitmap myset
+    }
+
+    test "SADD overflows the maximum allowed integers with bitmaps disabled" {
+        r del myset
+        r config set set-bitmap-encoding no
+        for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
+        assert_encoding intset myset
+        assert_equal 1 [r sadd myset 512]
+        r config set set-bitmap-encoding yes
+        assert_encoding hashtable myset
+    }
+
+    test "Variadic SADD converts based on the elements actually added" {
+        r del myset myset2 myset3
+        set ints {}
+        for {set i 0} {$i < 1000} {incr i} { lappend ints $i }
+        assert_equal 1000 [r sadd myset {*}$ints]
+        assert_encoding bitmap myset
+        r config set set-bitmap-encoding no
+        assert_equal 1000 [r sadd myset2 {*}$ints]
+        assert_encoding hashtable myset2
+        r sadd myset3 1 2 3
+        assert_equal 997 [r sadd myset3 {*}$ints]
+        r config set set-bitmap-encoding yes
+        assert_encoding hashtable myset3
+        assert_equal 1000 [r scard myset3]
+        assert_equal [lsort [r smembers myset]] [lsort [r smembers myset2]]
+        r del myset
+        assert_equal 1 [r sadd myset {*}[lrepeat 600 7]]
+        assert_encoding intset myset
+        r del myset
+        assert_equal 1 [r sadd myset {*}[lrepeat 600 a]]
+        assert_encoding hashtable myset
+        assert_equal 1 [r scard myset]
+    }
+
+    test "Large variadic SADD into an intset" {
+        r del myset myset2
+        r sadd myset 5 -70000
+        r sadd myset2 5 -70000
+        set ints {}
+        for {set i 0} {$i < 500} {incr i} {
+            lappend ints [expr {[randomInt 400]-200}]
+        }
+        lappend ints 4294967296 5
+        set added 0
+        foreach i $ints { incr added [r sadd myset2 $i] }
+        assert_equal $added [r sadd myset {*}$ints]
+        assert_encoding intset myset
+        assert_equal [r smembers myset2] [r smembers myset]
+        assert_equal 0 [r sadd myset {*}$ints]
+        lappend ints a
+        assert_equal 1 [r sadd myset {*}$ints]
+        assert_encoding hashtable myset
+        assert_equal [expr {[r scard myset2]+1}] [r scard myset]
+    }
+
+    test "SADD a non-integer against a bitmap" {
+        r del myset
+        for {set i 0} {$i < 1000} {incr i} { r sadd myset [expr {$i*1000}] }
+        assert_encoding bitmap myset
+        assert_equal 1 [r sadd myset a]
         assert_encoding hashtable myset
+        assert_equal 1001 [r scard myset]
+        assert_equal 1 [r sismember myset 999000]
+        assert_equal 1 [r sismember myset a]
+    }
+
+    test "Bitmap encoded sets with negative and extreme integers" {
+        r del myset
+        r sadd myset -9223372036854775808 9223372036854775807 -1 0 1
+        for {set i 0} {$i < 600} {incr i} { r sadd myset [expr {$i*-65537}] }
+        assert_encoding bitmap myset
+        assert_equal 604 [r scard myset]
+        assert_equal 1 [r sismember myset -9223372036854775808]
+        assert_equal 1 [r sismember myset 9223372036854775807]
+        assert_equal 0 [r sismember myset 2]
+        assert_equal 1 [r srem myset -65537]
+        assert_equal 0 [r sismember myset -65537]
+        assert_equal 603 [llength [r smembers myset]]
+    }
+
+    test "Sparse bitmap encoded sets with many containers" {
+        r del myset
+        set expected {}
+        for {set i 0} {$i < 2000} {incr i} {
+            set v [expr {($i*104729+7)*65536*1009}]
+            lappend expected $v
+            r sadd myset $v
+        }
+        assert_encoding bitmap myset
+        assert_equal 2000 [r scard myset]
+        for {set i 0} {$i < 2000} {incr i 3} {
+            assert_equal 1 [r srem myset [lindex $expected $i]]
+        }
+        set remaining {}
+        for {set i 0} {$i < 2000} {incr i} {
+            if {$i % 3} {lappend remaining [lindex $expected $i]}
+        }
+        assert_equal [lsort -integer $remaining] [lsort -integer [r smembers myset]]
+        assert_equal 1 [r sismember myset [lindex $expected 1]]
+        assert_equal 0 [r sismember myset [lindex $expected 0]]
+    }
+
+    test "SSCAN over a bitmap encoded set" {
+        r del myset
+        for {set i 0} {$i < 5000} {incr i} { r sadd myset [expr {$i*7}] }
+        assert_encoding bitmap myset
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [r sscan myset $cur count 100]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        assert_equal 5000 [llength [lsort -unique $keys]]
     }
 
     test {Variadic SADD} {
@@ -72,13 +189,25 @@ start_server {
         for {set i 0} {$i < 1280} {incr i} { r sadd mylargeintset $i }
         for {set i 0} {$i <  256} {incr i} { r sadd myhashset [format "i%03d" $i] }
         assert_encoding intset myintset
-        assert_encoding hashtable mylargeintset
+        assert_encoding bitmap mylargeintset
         assert_encoding hashtable myhashset
 
         r debug reload
         assert_encoding intset myintset
-        assert_encoding hashtable mylargeintset
+        assert_encoding bitmap mylargeintset
         assert_encoding hashtable myhashset
+        assert_equal 1280 [r scard mylargeintset]
+    }
+
+    test "Bitmap encoded set after DEBUG RELOAD with bitmaps disabled" {
+        r del mylargeintset
+        for {set i 0} {$i < 1280} {incr i} { r sadd mylargeintset $i }
+        assert_encoding bitmap mylargeintset
+        r config set set-bitmap-encoding no
+        r debug reload
+        r config set set-bitmap-encoding yes
+        assert_encoding hashtable mylargeintset
+        assert_equal 1280 [r scard mylargeintset]
     }
 
     test {SREM basics - regular set} {
@@ -111,7 +240,11 @@ start_server {
         r srem myset 1 2 3 4 5 6 7 8
     } {3}
 
-    foreach {type} {hashtable intset} {
+    foreach {type} {hashtable intset bitmap} {
+        # Bitmaps are used for integer sets larger than set-max-intset-entries.
+        if {$type eq "bitmap"} {
+            r config set set-max-intset-entries 0
+        }
         for {set i 1} {$i <= 5} {incr i} {
             r del [format "set%d" $i]
         }
@@ -175,6 +308,23 @@ start_server {
             assert_equal $expected [lsort [r smembers setres]]
         }
 
+        test "SINTERCARD with two sets - $type" {
+            assert_equal 6 [r sintercard 2 set1 set2]
+            assert_equal 6 [r sintercard 2 set1 set2 limit 0]
+            assert_equal 6 [r sintercard 2 set1 set2 limit 10]
+            assert_equal 3 [r sintercard 2 set1 set2 limit 3]
+        }
+
+        test "SINTERCARD against three sets - $type" {
+            assert_equal 3 [r sintercard 3 set1 set2 set3]
+            assert_equal 1 [r sintercard 3 set1 set2 set3 limit 1]
+        }
+
+        test "SUNION with the same set repeated - $type" {
+            set expected [lsort -uniq "[r smembers set1] [r smembers set5]"]
+            assert_equal $expected [lsort [r sunion set1 set5 set1 set5]]
+        }
+
         test "SINTER against three sets - $type" {
             assert_equal [list 195 199 $large] [lsort [r sinter set1 set2 set3]]
         }
@@ -205,6 +355,53 @@ start_server {
             }
             assert_equal {1 2 3 4} [lsort [r smembers setres]]
         }
+
+        r config set set-max-intset-entries 512
+    }
+
+    test "SINTERCARD against non existing keys" {
+        r del set1 set2
+        r sadd set1 a b c
+        assert_equal 0 [r sintercard 2 set1 set2]
+        assert_equal 0 [r sintercard 2 set2 set1 limit 1]
+    }
+
+    test "SINTERCARD errors" {
+        r del set1
+        r sadd set1 a b c
+        assert_error "*greater than 0*" {r sintercard 0 set1}
+        assert_error "*not an integer*" {r sintercard a set1}
+        assert_error "*can't be greater*" {r sintercard 2 set1}
+        assert_error "*can't be negative*" {r sintercard 1 set1 limit -1}
+        assert_error "*syntax*" {r sintercard 1 set1 limit}
+        assert_error "*syntax*" {r sintercard 1 set1 foo 1}
+    }
+
+    test "SINTER between intsets of similar size" {
+        r del set1 set2 set3
+        for {set i 0} {$i < 400} {incr i} {
+            r sadd set1 [expr {$i*2}]
+            r sadd set2 [expr {$i*3}]
+        }
+        r sadd set3 0 6 12 2394 2400
+        assert_encoding intset set1
+        assert_encoding intset set2
+        set expected {}
+        for {set i 0} {$i < 800} {incr i 6} { lappend expected $i }
+        assert_equal $expected [lsort -integer [r sinter set1 set2]]
+        assert_equal 134 [r sintercard 2 set1 set2]
+        assert_equal {0 6 12} [lsort -integer [r sinter set1 set2 set3]]
+    }
+
+    test "SUNION with many sets" {
+        r del set1 set2 set3 set4
+        r sadd set1 a b c 1 2 3
+        r sadd set2 c d 3 4
+        r sadd set3 e f 5 6 a
+        r sadd set4 1 2 3 4 5 6 7 8
+        assert_equal [lsort {a b c d e f 1 2 3 4 5 6 7 8}] \
+            [lsort [r sunion set1 nokey set2 set3 set4 set1]]
+        assert_equal {b} [lsort [r sdiff set1 nokey set2 set3 set4]]
     }
 
     test "SDIFF with first set empty" {
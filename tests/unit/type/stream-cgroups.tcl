@@ -294,6 +294,72 @@ start_server {
         assert {[lindex $reply 0 3] == 2}
     }
 
+    test {XACK with many IDs spanning multiple PEL blocks} {
+        r del mystream
+        for {set j 1} {$j <= 500} {incr j} {
+            r XADD mystream $j-0 f v
+        }
+        r XGROUP CREATE mystream mygroup 0
+        r XREADGROUP GROUP mygroup c1 COUNT 250 STREAMS mystream >
+        r XREADGROUP GROUP mygroup c2 STREAMS mystream >
+        # Ack every odd ID, with duplicates and IDs that are not pending.
+        set ids {}
+        for {set j 1} {$j <= 500} {incr j 2} {
+            lappend ids $j-0 $j-0
+        }
+        lappend ids 1000-0 0-1
+        assert {[r XACK mystream mygroup {*}$ids] == 250}
+        assert {[lindex [r XPENDING mystream mygroup] 0] == 250}
+        set pending [r XPENDING mystream mygroup - + 1000]
+        assert {[llength $pending] == 250}
+        set j 2
+        foreach item $pending {
+            assert {[lindex $item 0] eq "$j-0"}
+            assert {[lindex $item 1] eq [expr {$j <= 250 ? "c1" : "c2"}]}
+            incr j 2
+        }
+        assert {[llength [r XPENDING mystream mygroup - + 1000 c1]] == 125}
+        assert {[llength [r XPENDING mystream mygroup - + 1000 c2]] == 125}
+        assert {[lindex [r XPENDING mystream mygroup] 3] eq {{c1 125} {c2 125}}}
+    }
+
+    test {XCLAIM with many IDs keeps the consumer PELs consistent} {
+        set ids {}
+        for {set j 400} {$j >= 2} {incr j -4} {
+            lappend ids $j-0
+        }
+        lappend ids 1-0 1000-0
+        set claimed [r XCLAIM mystream mygroup c3 0 {*}$ids JUSTID]
+        assert {[llength $claimed] == 100}
+        assert {[lindex $claimed 0] eq "400-0"}
+        assert {[lindex [r XPENDING mystream mygroup] 0] == 250}
+        assert {[lindex [r XPENDING mystream mygroup] 3] eq {{c1 63} {c2 87} {c3 100}}}
+        foreach item [r XPENDING mystream mygroup - + 1000 c3] {
+            assert {[lindex $item 1] eq "c3"}
+            assert {[lsearch $ids [lindex $item 0]] != -1}
+        }
+        set before {}
+        foreach item [r XPENDING mystream mygroup - + 1000] {
+            lappend before [lindex $item 0] [lindex $item 1] [lindex $item 3]
+        }
+        r DEBUG RELOAD
+        set after {}
+        foreach item [r XPENDING mystream mygroup - + 1000] {
+            lappend after [lindex $item 0] [lindex $item 1] [lindex $item 3]
+        }
+        assert {$before eq $after}
+        assert {[lindex [r XPENDING mystream mygroup] 3] eq {{c1 63} {c2 87} {c3 100}}}
+    }
+
+    test {XGROUP DELCONSUMER with a large PEL} {
+        assert {[r XGROUP DELCONSUMER mystream mygroup c3] == 100}
+        assert {[lindex [r XPENDING mystream mygroup] 0] == 150}
+        assert {[lindex [r XPENDING mystream mygroup] 3] eq {{c1 63} {c2 87}}}
+        foreach item [r XPENDING mystream mygroup - + 1000] {
+            assert {[lindex $item 1] ne "c3"}
+        }
+    }
+
     test {XINFO FULL output} {
         r del x
         r XADD x 100 a 1
@@ -257,6 +257,50 @@ start_server {
         assert {[lindex $res 0 1 1 1] eq {field two}}
     }
 
+    test {Blocking XREAD clients tailing the same stream get the same entries} {
+        r del s3
+        r XADD s3 1-0 a 1 b 2
+        set readers {}
+        foreach {start count} {$ 0 $ 0 $ 2 1-0 0 1-0 1 $ 0} {
+            set rd [redis_deferring_client]
+            $rd XREAD COUNT $count BLOCK 20000 STREAMS s3 $start
+            lappend readers $rd $start $count
+        }
+        r MULTI
+        r XADD s3 2-0 a 10 b -20
+        r XADD s3 3-0 a foo c bar
+        r XADD s3 4-0 a 12345678901 b [string repeat x 100]
+        r EXEC
+        set new {{2-0 {a 10 b -20}} {3-0 {a foo c bar}} {4-0 {a 12345678901 b xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx}}}
+        foreach {rd start count} $readers {
+            set expected $new
+            if {$count} {set expected [lrange $expected 0 [expr {$count-1}]]}
+            assert_equal [list [list s3 $expected]] [$rd read]
+            $rd close
+        }
+    }
+
+    test {XRANGE replies with entries with and without the master fields} {
+        r del s3
+        r XADD s3 1-0 f1 v1 f2 2
+        r XADD s3 2-0 f1 -3 f2 v4
+        r XADD s3 3-0 other v5
+        r XADD s3 4-0 f1 v6 f2 7
+        r XADD s3 18446744073709551615-18446744073709551615 f1 v8 f2 9
+        r XDEL s3 2-0
+        assert_equal {{1-0 {f1 v1 f2 2}} {3-0 {other v5}} {4-0 {f1 v6 f2 7}} {18446744073709551615-18446744073709551615 {f1 v8 f2 9}}} [r XRANGE s3 - +]
+        assert_equal {{18446744073709551615-18446744073709551615 {f1 v8 f2 9}} {4-0 {f1 v6 f2 7}}} [r XREVRANGE s3 + - COUNT 2]
+        # A reply much larger than the reply chunk size.
+        r del s3
+        set big [string repeat abcdefghij 1000]
+        for {set j 1} {$j <= 50} {incr j} {
+            r XADD s3 $j-0 field $big n $j
+        }
+        set res [r XRANGE s3 - +]
+        assert {[llength $res] == 50}
+        assert_equal [list 50-0 [list field $big n 50]] [lindex $res 49]
+    }
+
     test {XDEL basic test} {
         r del somestream
         r xadd somestream * foo value0
@@ -414,6 +458,85 @@ start_server {tags {"stream"} overrides {appendonly yes stream-node-max-entries
     }
 }
 
+start_server {tags {"stream"} overrides {appendonly yes stream-node-max-entries 10}} {
+    test {XTRIM and XADD with MINID} {
+        r del mystream
+        for {set j 1} {$j <= 100} {incr j} {
+            r XADD mystream $j-0 xitem v
+        }
+        # Approximated: only whole nodes of 10 entries are removed.
+        assert {[r XTRIM mystream MINID ~ 25] == 20}
+        assert {[lindex [r XRANGE mystream - + COUNT 1] 0 0] eq {21-0}}
+        # Exact: entries inside the head node are removed as well.
+        r XDEL mystream 26-0
+        assert {[r XTRIM mystream MINID 28] == 6}
+        assert {[lindex [r XRANGE mystream - + COUNT 1] 0 0] eq {28-0}}
+        assert {[r XTRIM mystream MINID = 28-0] == 0}
+        assert {[r xlen mystream] == 73}
+        r XADD mystream MINID ~ 60 101-0 xitem v
+        assert {[r xlen mystream] == 51}
+        r XADD mystream MINID 60 102-0 xitem v
+        assert {[r xlen mystream] == 43}
+        assert {[lindex [r XRANGE mystream - + COUNT 1] 0 0] eq {60-0}}
+        # Trimming everything leaves an empty stream.
+        assert {[r XTRIM mystream MINID 1000] == 43}
+        assert {[r xlen mystream] == 0}
+        assert {[r exists mystream] == 1}
+    }
+
+    test {XTRIM and XADD MINID errors} {
+        r XADD mystream 200-0 xitem v
+        assert_error {*not compatible*} {r XTRIM mystream MAXLEN 1 MINID 1}
+        assert_error {*not compatible*} {r XADD mystream MINID 1 MAXLEN 1 * a b}
+        assert_error {*Invalid stream ID*} {r XTRIM mystream MINID foo}
+        assert_error {*syntax*} {r XTRIM mystream MINID}
+    }
+
+    test {XTRIM with ~ MINID can propagate correctly} {
+        r del mystream
+        for {set j 1} {$j <= 100} {incr j} {
+            r XADD mystream $j-0 xitem v
+        }
+        r XTRIM mystream MINID ~ 25
+        r XADD mystream MINID ~ 45 * xitem v
+        assert {[r xlen mystream] == 61}
+        r config set stream-node-max-entries 1
+        r debug loadaof
+        assert {[r xlen mystream] == 61}
+        assert {[lindex [r XRANGE mystream - + COUNT 1] 0 0] eq {41-0}}
+        r config set stream-node-max-entries 10
+    }
+
+    test {Streams are trimmed in the background according to stream-max-age} {
+        r del mystream otherstream
+        set now [clock milliseconds]
+        set old [expr {$now - 3600000}]
+        for {set j 0} {$j < 25} {incr j} {
+            r XADD mystream $old-$j xitem v
+            r XADD otherstream $old-$j xitem v
+        }
+        for {set j 0} {$j < 5} {incr j} {
+            r XADD mystream * xitem v
+        }
+        r set notastream foo
+        set trimmed [s stream_trimmed_entries]
+        r config set stream-max-age 60000
+        wait_for_condition 50 100 {
+            [r xlen otherstream] == 0 && [r xlen mystream] == 10
+        } else {
+            fail "Stream not trimmed in the background"
+        }
+        r config set stream-max-age 0
+        # Only the whole nodes are removed: the node holding both old and
+        # new entries is kept.
+        assert {[lindex [r XRANGE mystream - + COUNT 1] 0 0] eq "$old-20"}
+        assert {[s stream_trimmed_entries] - $trimmed == 45}
+        r debug loadaof
+        assert {[r xlen mystream] == 10}
+        assert {[r xlen otherstream] == 0}
+    }
+}
+
 start_server {tags {"stream xsetid"}} {
     test {XADD can CREATE an empty stream} {
         r XADD mystream MAXLEN 0 * a b
@@ -13,6 +13,11 @@ start_server {tags {"zset"}} {
         } elseif {$encoding == "skiplist"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+            r config set zset-btree-encoding no
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-btree-encoding yes
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -629,6 +634,24 @@ start_server {tags {"zset"}} {
             assert_equal {b 2 c 3} [r zrange zsetc 0 -1 withscores]
         }
 
+        test "ZUNION/ZINTER basics - $encoding" {
+            assert_equal {a b d c} [r zunion 2 zseta zsetb]
+            assert_equal {a 2 b 7 d 9 c 12} [r zunion 2 zseta zsetb weights 2 3 withscores]
+            assert_equal {b 1 c 2} [r zinter 2 zseta zsetb aggregate min withscores]
+            assert_equal {b 2 c 3} [r zinter 2 zseta zsetb withscores aggregate max]
+            assert_equal {} [r zinter 2 zseta nosuchkey]
+        }
+
+        test "ZUNION/ZINTER with LIMIT and REV - $encoding" {
+            assert_equal {b 3 d 3} [r zunion 2 zseta zsetb withscores limit 1 2]
+            assert_equal {c 5 d 3} [r zunion 2 zseta zsetb rev withscores limit 0 2]
+            assert_equal {d b a} [r zunion 2 zseta zsetb rev limit 1 -1]
+            assert_equal {c} [r zinter 2 zseta zsetb rev limit 0 1]
+            assert_equal {} [r zunion 2 zseta zsetb limit 10 1]
+            assert_equal {} [r zunion 2 zseta zsetb limit 0 0]
+            assert_error "*syntax*" {r zunionstore zsetc 2 zseta zsetb withscores}
+        }
+
         foreach cmd {ZUNIONSTORE ZINTERSTORE} {
             test "$cmd with +inf/-inf scores - $encoding" {
                 r del zsetinf1 zsetinf2
@@ -737,6 +760,57 @@ start_server {tags {"zset"}} {
 
     basics ziplist
     basics skiplist
+    basics btree
+    r config set zset-btree-encoding no
+
+    test {Variadic ZADD converts based on the elements actually added} {
+        r config set zset-max-ziplist-entries 128
+        r config set zset-max-ziplist-value 64
+        r del myzset myzset2
+        set args {}
+        for {set i 0} {$i < 200} {incr i} { lappend args $i m$i }
+        assert_equal 200 [r zadd myzset {*}$args]
+        assert_encoding skiplist myzset
+        assert_equal {m199} [r zrange myzset -1 -1]
+        r zadd myzset2 1 a 2 b
+        assert_encoding ziplist myzset2
+        assert_equal 2 [r zadd myzset2 3 c 4 [string repeat x 100]]
+        assert_encoding skiplist myzset2
+        assert_equal {a b c} [r zrange myzset2 0 2]
+        r zadd myzset2 xx 5 a {*}$args
+        assert_equal 4 [r zcard myzset2]
+        r del myzset
+        assert_equal 1 [r zadd myzset {*}[lrepeat 200 1 a]]
+        assert_encoding ziplist myzset
+        assert_equal 1 [r zcard myzset]
+    }
+
+    test {Large variadic ZADD into a ziplist} {
+        r config set zset-max-ziplist-entries 128
+        r config set zset-max-ziplist-value 64
+        foreach opts {{} nx xx ch {xx ch}} {
+            r del myzset myzset2
+            r zadd myzset 1 a 2 b 3 10 2.5 c
+            r zadd myzset2 1 a 2 b 3 10 2.5 c
+            set args {}
+            for {set i 0} {$i < 120} {incr i} {
+                lappend args [randomInt 20] [randomInt 60]
+            }
+            lappend args 1.5 a 2 b -inf z
+            set reply 0
+            foreach {score ele} $args {
+                incr reply [r zadd myzset2 {*}$opts $score $ele]
+            }
+            assert_equal $reply [r zadd myzset {*}$opts {*}$args]
+            assert_encoding ziplist myzset
+            assert_equal [r zrange myzset2 0 -1 withscores] \
+                         [r zrange myzset 0 -1 withscores]
+        }
+        r del myzset
+        assert_equal 2 [r zadd myzset 1 a 2 b]
+        assert_equal 1 [r zadd myzset ch 1 a 0 b]
+        assert_equal {b 0 a 1} [r zrange myzset 0 -1 withscores]
+    }
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -781,6 +855,51 @@ start_server {tags {"zset"}} {
         }
     }
 
+    test {ZUNION/ZINTER with LIMIT match ZUNIONSTORE/ZINTERSTORE} {
+        r del one two three dest
+        for {set j 0} {$j < 300} {incr j} {
+            r zadd one [randomInt 100] [randomInt 1000]
+            r zadd two [expr rand()*10-5] [randomInt 1000]
+            r sadd three [randomInt 1000]
+        }
+        foreach op {union inter} {
+            foreach aggr {sum min max} {
+                foreach weights {{1 1 1} {2 0.5 3} {1 -1 2}} {
+                    r z${op}store dest 3 one two three \
+                        weights {*}$weights aggregate $aggr
+                    set offset [randomInt 20]
+                    set count [randomInt 50]
+                    set end [expr {$offset+$count-1}]
+                    assert_equal [r zrange dest $offset $end withscores] \
+                        [r z$op 3 one two three weights {*}$weights \
+                         aggregate $aggr withscores limit $offset $count]
+                    assert_equal [r zrevrange dest $offset $end withscores] \
+                        [r z$op 3 one two three weights {*}$weights \
+                         aggregate $aggr withscores rev limit $offset $count]
+                    assert_equal [r zrange dest 0 -1] \
+                        [r z$op 3 one two three weights {*}$weights \
+                         aggregate $aggr]
+                }
+            }
+        }
+    }
+
+    test {ZUNION/ZINTER with NaN weighted scores match the STORE variants} {
+        r del z y dest
+        r zadd z inf a
+        r zadd y inf a
+        assert_equal {a inf} [r zunion 2 z y weights 1 0 withscores]
+        r zunionstore dest 2 z y weights 1 0
+        assert_equal {a inf} [r zrange dest 0 -1 withscores]
+        foreach op {union inter} {
+            foreach weights {{1 0} {0 1} {0 0}} {
+                r z${op}store dest 2 z y weights {*}$weights
+                assert_equal [r zrange dest 0 -1 withscores] \
+                    [r z$op 2 z y weights {*}$weights withscores]
+            }
+        }
+    }
+
     test "ZSET commands don't accept the empty strings as valid score" {
         assert_error "*not*float*" {r zadd myzset "" abc}
     }
@@ -794,7 +913,14 @@ start_server {tags {"zset"}} {
         } elseif {$encoding == "skiplist"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+            r config set zset-btree-encoding no
             if {$::accurate} {set elements 1000} else {set elements 100}
+        } elseif {$encoding == "btree"} {
+            # Enough elements to get a few levels of inner nodes
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-btree-encoding yes
+            if {$::accurate} {set elements 5000} else {set elements 500}
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -1200,6 +1326,8 @@ start_server {tags {"zset"}} {
     tags {"slow"} {
         stressers ziplist
         stressers skiplist
+        stressers btree
+        r config set zset-btree-encoding no
     }
 
     test {ZSET skiplist order consistency when elements are moved} {
@@ -1227,4 +1355,50 @@ start_server {tags {"zset"}} {
         }
         r config set zset-max-ziplist-entries $original_max
     }
+
+    test {ZSET btree order consistency when elements are moved} {
+        set original_max [lindex [r config get zset-max-ziplist-entries] 1]
+        r config set zset-max-ziplist-entries 0
+        r config set zset-btree-encoding yes
+        for {set times 0} {$times < 10} {incr times} {
+            r del zset
+            for {set j 0} {$j < 1000} {incr j} {
+                r zadd zset [randomInt 50] ele-[randomInt 500]
+            }
+            assert_encoding btree zset
+
+            set prev_element {}
+            set prev_score -1
+            set rank 0
+            foreach {element score} [r zrange zset 0 -1 WITHSCORES] {
+                assert {
+                    $prev_score < $score ||
+                    ($prev_score == $score &&
+                     [string compare $prev_element $element] == -1)
+                }
+                assert_equal $rank [r zrank zset $element]
+                set prev_element $element
+                set prev_score $score
+                incr rank
+            }
+        }
+        r config set zset-btree-encoding no
+        r config set zset-max-ziplist-entries $original_max
+    }
+
+    test {ZSET btree encoding survives DEBUG RELOAD} {
+        r config set zset-btree-encoding yes
+        r del zset
+        for {set j 0} {$j < 1000} {incr j} {
+            r zadd zset $j ele-$j
+        }
+        assert_encoding btree zset
+        set digest [r debug digest-value zset]
+        r debug reload
+        assert_encoding btree zset
+        assert_equal $digest [r debug digest-value zset]
+        assert_equal {ele-0} [r zrange zset 0 0]
+        assert_equal {ele-999} [r zrange zset -1 -1]
+        r config set zset-btree-encoding no
+    } {OK}
 }